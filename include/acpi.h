@@ -69,5 +69,65 @@ struct madt_ioapic {
   uint32 interrupt_base;
 } __attribute__((__packed__));
 
+// 5.2.16 System Resource Affinity Table
+#define SIG_SRAT "SRAT"
+struct acpi_srat {
+  struct acpi_desc_header header;
+  uint32 reserved1;
+  uint64 reserved2;
+  uchar table[0];
+} __attribute__((__packed__));
+
+#define TYPE_SRAT_LAPIC  0
+#define TYPE_SRAT_MEM    1
+#define TYPE_SRAT_X2APIC 2
+
+#define SRAT_ENABLED 1
+
+// 5.2.16.1
+struct srat_lapic {
+  uchar type;
+  uchar length;
+  uchar proximity_lo;
+  uchar apic_id;
+  uint32 flags;
+  uchar sapic_eid;
+  uchar proximity_hi[3];
+  uint32 clock_domain;
+} __attribute__((__packed__));
+
+// 5.2.16.2
+struct srat_mem {
+  uchar type;
+  uchar length;
+  uint32 proximity;
+  ushort reserved1;
+  uint64 base;
+  uint64 len;
+  uint32 reserved2;
+  uint32 flags;
+  uint64 reserved3;
+} __attribute__((__packed__));
+
+// 5.2.16.3
+struct srat_x2apic {
+  uchar type;
+  uchar length;
+  ushort reserved1;
+  uint32 proximity;
+  uint32 x2apic_id;
+  uint32 flags;
+  uint32 clock_domain;
+  uint32 reserved2;
+} __attribute__((__packed__));
+
+// 5.2.17 System Locality Distance Information Table
+#define SIG_SLIT "SLIT"
+struct acpi_slit {
+  struct acpi_desc_header header;
+  uint64 nlocalities;
+  uchar entry[0];
+} __attribute__((__packed__));
+
 void acpi_halt();
 void acpi_reboot();
@@ -19,6 +19,23 @@
 #define FIS_TYPE_REG_H2D      0x27
 #define ATA_CMD_READ_DMA_EX   0x25
 #define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA    0x60 // READ FPDMA QUEUED
+#define ATA_CMD_WRITE_FPDMA   0x61 // WRITE FPDMA QUEUED
+#define ATA_CMD_IDENTIFY      0xEC
+
+// IDENTIFY DEVICE words
+#define ATA_IDENT_QDEPTH   75  // queue depth - 1, bits 4:0
+#define ATA_IDENT_SATACAP  76
+#define ATA_SATACAP_NCQ    (1 << 8)
+
+// Scatter-gather limits. Each port's 1MB at AHCI_MEM holds the
+// command list, the received FIS and 32 command tables of
+// AHCI_MAX_PRDT entries each.
+#define AHCI_PRDT_MAXBYTES  (4 << 20) // most one PRDT entry can move
+#define AHCI_MAX_PRDT       1024      // PRDT entries per command
+#define AHCI_MAX_SECT       0xFFFF    // 16-bit sector count
+#define AHCI_CMDTBL_OFFSET  (64 << 10)
+#define AHCI_CMDTBL_SIZE    (128 + 16 * AHCI_MAX_PRDT)
 
 #define HBA_PORT_IPM_ACTIVE  0x1
 #define HBA_PORT_DET_PRESENT 0x3
@@ -37,6 +54,11 @@
 #define AHCI_DEVICE_OFFSET 0x02
 //...
 #define AHCI_BAR5_OFFSET   0x24
+#define AHCI_INTERRUPT_OFFSET 0x3C
+
+#define AHCI_GHC_IE 0x2 // global interrupt enable
+#define AHCI_CAP_SNCQ (1U << 30) // supports native command queuing
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1) // command slots
 
 //AHCI vendors:
 #define AHCI_VENDOR_INTEL  0x8086
@@ -195,16 +217,28 @@ uint16 ahci_probe(uint16 bus, uint16 slot, uint16 func, uint16 offset);
 uint64 ahci_read(uint16 bus, uint16 slot, uint16 func, uint16 offset);
 void   ahci_write8(ushort bus, ushort slot,ushort func, ushort offset, uint8 data);
 void   ahci_device_hacks(uint16 bus, uint16 slot, uint16 func, uint16 vendor, uint16 device);
-void   ahci_try_setup_device(uint16 bus, uint16 slot, uint16 func);
-void   ahci_try_setup_known_device(char *dev_name, uint64 ahci_base_mem, uint16 bus, uint16 slot, uint16 func);
-int    ahci_sata_read(HBA_PORT *port, uint32 startl, uint32 starth, uint32 count, uint8 *buf);
-int    ahci_sata_write(HBA_PORT *port, uint32 startl, uint32 starth, uint32 count, uint8 *buf);
+struct pci_func;
+void   ahci_try_setup_device(uint16 bus, uint16 slot, uint16 func, struct pci_func *f);
+void   ahci_try_setup_known_device(char *dev_name, uint64 ahci_base_mem, uint16 bus, uint16 slot, uint16 func, struct pci_func *f);
+struct ahci_port;
+struct ahci_ctlr;
+int    ahci_sata_read(struct ahci_port *port, uint32 startl, uint32 starth, uint32 count, uint8 *buf);
+int    ahci_sata_write(struct ahci_port *port, uint32 startl, uint32 starth, uint32 count, uint8 *buf);
+// One physically contiguous piece of a transfer.
+struct sata_sg {
+	uint8 *buf;
+	uint32 len;   // bytes, even
+};
+
+int    ahci_sata_rw(struct ahci_port *port, uint64 lba, struct sata_sg *sg, int nsg, int write);
 uint32 sata_device_count();
 int    sata_read(uint32 dev, uint64 lba, uint32 count, uint8 *buf);
 int    sata_write(uint32 dev, uint64 lba, uint32 count, uint8 *buf);
-void   ahci_sata_init(HBA_PORT *port, int num);
+int    sata_readv(uint32 dev, uint64 lba, struct sata_sg *sg, int nsg);
+int    sata_writev(uint32 dev, uint64 lba, struct sata_sg *sg, int nsg);
+void   ahci_sata_init(struct ahci_ctlr *ctlr, HBA_PORT *port, int num);
 
 int8   ahci_rebase_port(HBA_PORT *port, int num);
 uint16 ahci_stop_port(HBA_PORT *port);
 void   ahci_start_port(HBA_PORT *port);
-int32  ahci_find_cmdslot(HBA_PORT *port);
+int32  ahci_find_cmdslot(struct ahci_port *port);
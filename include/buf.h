@@ -1,22 +1,79 @@
 #define SECTOR_SIZE 512
 
+#include "sleeplock.h"
+
 struct buf {
   int32 flags;
   uint32 dev;
   uint32 sector;
-  struct buf *prev; // LRU cache list
+  uint32 nsec;      // sectors in the block
+  int refcnt;       // holders and waiters; protected by bucket lock
+  struct sleeplock lock;
+  struct buf *hnext; // hash chain
+  struct buf *prev; // LRU list, while unreferenced
   struct buf *next;
   struct buf *qnext; // disk queue
-  uint8 data[SECTOR_SIZE];
+  struct buf *ionext; // request queue; see blkq.c
+  void (*iodone)(struct buf*);
+  uint iodeadline;
+  struct buf *dnext; // dirty list, while dlisted
+  int dlisted;       // on the dirty list; protected by its lock
+  uint dirtied;      // tick it went on the dirty list
+  int logpin;        // log transactions it is in; changed only while held
+  uint8 *data;       // nsec * SECTOR_SIZE bytes
+};
+#define BMAXSECT 64       // largest block, in sectors
+
+// Buffer cache counters, from bcachestat().
+struct bcachestat {
+  uint64 hits;
+  uint64 misses;
+  uint64 evictions;  // cached blocks recycled for others
+  uint64 readaheads; // blocks read ahead of use
+  uint64 delwri;     // writes put off by bdwrite()
+  uint64 flushed;    // delayed writes the flusher or bsync() did
+  uint64 ndirty;     // delayed writes waiting now
+  uint64 grows;      // pages added
+  uint64 shrinks;    // pages given back under memory pressure
+  uint64 nbuf;       // buffers now
+  uint64 pages;      // pages they take
+  uint64 maxpages;   // most pages the cache may grow to
+};
+
+// A device's request queue counters, from blkqstat().
+struct blkqstat {
+  uint dev;
+  uint pending;      // requests queued now
+  uint64 reads;      // requests submitted
+  uint64 writes;
+  uint64 rsect;      // sectors they moved
+  uint64 wsect;
+  uint64 cmds;       // commands dispatched, after merging
+};
+
+// Log counters, from logstat().
+struct logstat {
+  uint64 commits;    // transactions written
+  uint64 blocks;     // blocks they held
+  uint64 waits;      // times begin_op() had to sleep
+  uint nsect;        // sectors for records
+  uint running;      // blocks in the running transaction
+  int outstanding;   // ops in progress
+  int reserved;      // log blocks they may yet use
 };
-#define B_BUSY  0x1  // buffer is locked by some process
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_QUEUED 0x8 // I/O submitted and not yet finished
+#define B_DELWRI 0x10 // write put off by bdwrite()
 
 #define DEV_TYPE_MASK 0xF0000000
 #define DEV_NUM_MASK  0x0FFFFFFF
 #define DEV_IDE 0
 #define DEV_SATA 1
+#define DEV_VIRTIO 2
+#define DEV_NVME 3
+#define DEV_TMPFS 4   // no device; the file system is in memory
+#define DEV_PROCFS 5  // no device; the files are made up as they're read
 
 #define GETDEVTYPE(a) ((a & DEV_TYPE_MASK) >> 28)
 #define GETDEVNUM(a) (a & DEV_NUM_MASK)
@@ -1,28 +1,110 @@
+struct bcachestat;
+struct blkqstat;
 struct buf;
 struct context;
+struct epoll;
+struct epoll_event;
+struct execplan;
 struct file;
+struct fsops;
 struct inode;
+struct kmem_cache;
+struct kringpair;
+struct ipcmsg;
+struct syscallstat;
+struct lockstat;
+struct logstat;
+struct netdev;
+struct perfgroup;
 struct pipe;
+struct pollfd;
+struct pollentry;
+struct pollhead;
+struct poller;
+struct sleeplock;
 struct proc;
+struct procinfo;
+struct rusage;
+struct shrinker;
 struct spinlock;
 struct stat;
 struct superblock;
+struct trapframe;
+struct useg;
+struct vmspace;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     breadshared(uint, uint);
+struct buf*     breadn(uint, uint, uint);
+struct buf*     breadsharedn(uint, uint, uint);
+void            breada(uint, uint, uint);
 void            brelse(struct buf*);
+void            brelsecold(struct buf*);
 void            bwrite(struct buf*);
+void            bwriteat(struct buf*, uint);
+void            bdwrite(struct buf*);
+void            bsync(void);
+void            bflushinit(void);
+void            bcachestat(struct bcachestat*);
+
+// blkq.c
+void            blkqinit(void);
+void            bsubmit(struct buf*, void (*)(struct buf*));
+void            bwait(struct buf*);
+int             blkqstat(struct blkqstat*, int);
+
+// boottime.c
+void            bootphase(char*);
+void            bootprobe(char*, int, uint64);
+void            bootreport(void);
+
+// clock.c
+void            clockinit(void);
+void            clockparams(uint64*, uint64*);
+uint64          nsecs(void);
+void            pitdelay(uint);
+uint64          tsc2ns(uint64);
 
 // console.c
 void            consoleinit(void);
 void            cprintf(char*, ...);
+int             snprintf(char*, int, char*, ...);
+void            consoleputs(char*, int);
 void            consoleintr(int(*)(void));
 void            panic(char*) __attribute__((noreturn));
 void            halt() __attribute__((noreturn));
 
 // exec.c
+struct execimage;
 int             exec(char*, char**);
+int             execload(char*, char**, int, int, struct execimage*);
+void            execfree(struct execimage*);
+
+// epoll.c
+void            epollinit(void);
+struct epoll*   epollalloc(void);
+int             epollctl(struct epoll*, int, int, struct file*, struct epoll_event*);
+int             epollwait(struct epoll*, struct epoll_event*, int, int);
+void            epollfileclose(struct file*);
+void            epollclose(struct epoll*);
+
+// fpu.c
+void            fpuinit(void);
+int             fputrap(void);
+void            fpuswitchout(void);
+void            fpuswitchin(struct proc*);
+int             fpufork(struct proc*);
+void            fpuexec(void);
+void            fpufree(struct proc*);
+
+// fbcons.c
+extern int      fbactive;
+void            fbinit(void);
+void            fbputs(char*, int, uint32);
+void            fbputc(int, uint32);
+void            fbsize(int*, int*, int*, int*);
 
 // file.c
 struct file*    filealloc(void);
@@ -32,16 +114,26 @@ void            fileinit(void);
 int             fileread(struct file*, char*, int n);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
+int             filepread(struct file*, char*, int n, uint);
+int             filepwrite(struct file*, char*, int n, uint);
+int             filesendfile(struct file*, struct file*, uint*, int);
+int             filepoll(struct file*, struct poller*);
 int             fileseek(struct file *f, int offset);
 
 // vfs.c
 void            readsb(int dev, struct superblock *sb);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+int             dirunlink(struct inode*, uint);
+int             isdirempty(struct inode*);
+int             readdir(struct inode*, uint*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct inode*   iget(uint, uint);
 void            vfsinit(void);
+int             vfsmount(uint, struct fsops*, struct inode*);
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
@@ -50,25 +142,49 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+void            readaheadi(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
+int             fsynci(struct inode*);
 int             writei(struct inode*, char*, uint, uint);
 
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
+void            ideattachdma(uint);
 void            iderw(struct buf*);
 
+// initramfs.c
+int             initramfs_present(void);
+void            initramfs(void);
+
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
+void            irqbalance(void);
+int             irqaffinity(int, int);
 extern uchar    ioapicid;
 void            ioapicinit(void);
 
+// e820.c
+void            e820init(void);
+int             e820range(int, uint64*, uint64*);
+uint64          e820top(void);
+
 // kalloc.c
 char*           kalloc(void);
+char*           kalloc_zeroed(void);
+char*           kalloc_huge(void);
+void            ksplit(char*);
 char*           kmalloc(uint16 pages);
+void            kmfree(char*, uint16 pages);
 void            kfree(char*);
+void            kref(char*);
+int             krefcount(char*);
 void            kinit1(void*, void*);
-void            kinit2(void*, void*);
+void            kinit2(void);
+void            kmemstats(void);
+int             kzpoolfill(void);
+uint            kmemtotal(void);
+uint            kmemfree(void);
 
 // kbd.c
 void            kbdintr(void);
@@ -77,15 +193,69 @@ void            kbdintr(void);
 int             cpunum(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
+void            lapiccalibrate(void);
 void            lapicinit(void);
-void            lapicstartap(uchar, uint);
+void            lapicipi(int, int);
+void            lapicnmi(int);
+void            tlbinit(void);
+void            tlbintr(void);
+void            tlbshootdown(struct vmspace*, uintp, uint);
+void            lapictimer(int);
+void            lapicstartaps(uchar*, int, uint);
 void            microdelay(int);
 
+// klog.c
+void            kloginit(void);
+void            klogdinit(void);
+void            klogwrite(char*, int);
+void            klogsync(void);
+int             klogread(char*, int);
+
+// kstack.c
+void            kstackinit(void);
+char*           kstackalloc(void);
+void            kstackfree(char*);
+int             kstackguard(uintp);
+
+// kring.c
+void            kringinit(void);
+struct kringpair* kringget(struct proc*);
+void            kringput(struct kringpair*);
+void            kringclose(struct kringpair*);
+int             kringread(struct kringpair*, char*, int);
+int             kringwrite(struct kringpair*, char*, int);
+int             kringpoll(struct kringpair*, struct poller*);
+uintp           kringmap(void);
+int             kringwait(int);
+int             kringnotify(void);
+
 // log.c
 void            initlog(void);
 void            log_write(struct buf*);
 void            begin_op();
+void            begin_opn(int);
 void            end_op();
+void            end_opn(int);
+void            log_force(void);
+void            logcommitinit(void);
+void            logstat(struct logstat*);
+
+// mmap.c
+struct vma*     vmalookup(struct proc*, uintp);
+uintp           uvmlimit(struct proc*, uintp);
+uintp           vmalowest(struct proc*);
+int             vmapagein(struct proc*, uintp);
+int             vmafork(struct proc*, struct proc*);
+uintp           mmapshared(struct proc*, char**, int);
+void            vmafree(struct proc*);
+
+// net.c
+void            netinit(void);
+int             netregister(struct netdev*);
+void            netschedule(struct netdev*);
+void            netrxput(struct netdev*, char*, int, int);
+int             netxmit(struct netdev*, char*, int, int);
+uintp           netrecv(int, int*);
 
 // mp.c
 extern int      ismp;
@@ -96,21 +266,53 @@ void            mpstartthem(void);
 
 // apic.c
 int             acpiinit(void);
+int             numanodes(void);
+int             numanode(uint64);
+int             numadistance(int, int);
+
+// pagecache.c
+void            pagecacheinit(void);
+int             pagecache_read(struct inode*, char*, uint, uint);
+void            pagecache_write(struct inode*, char*, uint, uint);
+int             pagecache_has(struct inode*, uint);
+char*           pagecache_map(struct inode*, uint);
+uint            pagecache_drop(struct inode*);
 
 // picirq.c
 void            picenable(int);
 void            picinit(void);
 
+// perf.c
+void            perfinit(void);
+int             perfctl(int*, int);
+int             perfread(uint64*, int);
+void            perfswitchin(struct proc*);
+void            perfswitchout(void);
+void            perffree(struct proc*);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, char*, int);
-int             pipewrite(struct pipe*, char*, int);
+void            pipeinit(void);
+int             piperead(struct pipe*, char*, int, int);
+int             pipewrite(struct pipe*, char*, int, int);
+int             pipesize(struct pipe*);
+int             piperesize(struct pipe*, int);
+int             pipepoll(struct pipe*, int, struct poller*);
+
+// poll.c
+void            pollinit(void);
+void            pollwait(struct pollhead*, struct poller*);
+void            pollwake(struct pollhead*);
+void            polldetach(struct pollhead*);
+void            pollunlink(struct pollentry*);
+int             poll(struct pollfd*, int, int);
 
 // proc.c
 struct proc*    copyproc(struct proc*);
-void            exit(void);
+void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, int*);
 int             bfork(void);
 int             growproc(int);
 int             kill(int);
@@ -123,17 +325,96 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+int             kthread(char*, void (*)(void*), void*);
+int             kthreadon(char*, void (*)(void*), void*, int);
 int             wait(void);
+int             waitpid(int, int*, int);
 void            wakeup(void*);
 void            yield(void);
+int             sliceover(void);
+void            preempt_disable(void);
+void            preempt_enable(void);
+void            cond_resched(void);
 enum procstate  pstate(int);
 int             pname(int, char*, int);
+int             procnext(int);
+int             procinfo(int, struct procinfo*);
+void            acctcharge(int);
+void            loadavgtick(uint);
+void            loadavg(int*);
+int             getrusage(int, struct rusage*);
 int             getpriority(int);
 int             setpriority(int, int);
+int             setaffinity(int, uint64*);
+int             getaffinity(int, uint64*);
+int             cpureserve(int, int);
+int             clone(uintp, uintp, uintp, uintp);
+int             futexwait(uintp, int);
+int             futexwake(uintp, int);
+int             ipccall(int, struct ipcmsg*);
+int             ipcreplywait(int, struct ipcmsg*);
+int             vmspaceexit(struct proc*);
+int             oomkill(void);
+int             vmspaceunshare(struct proc*, struct vmspace**);
+void            vmspacerelease(struct vmspace*);
+int             vmspacepin(struct vmspace**, int);
+void            vmlock(struct vmspace*);
+void            vmunlock(struct vmspace*);
+
+// prof.c
+void            profinit(void);
+void            proftick(struct trapframe*);
+
+// random.c
+void            randominit(void);
+
+// reclaim.c
+void            register_shrinker(struct shrinker*);
+int             shrink(int);
+void            reclaiminit(void);
+void            reclaimstats(void);
+
+// swap.c
+void            swapinit(void);
+int             swapout(int);
+int             swapin(struct proc*, uintp, pde_t*);
+void            swapdup(pde_t);
+void            swapfree(pde_t);
+uint            swapbusy(void);
+void            swapstats(void);
 
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// namecache.c
+void            namecacheinit(void);
+int             namecachelookup(uint, uint, char*, uint*);
+void            namecacheenter(uint, uint, char*, uint);
+void            namecachenegative(uint, uint, char*);
+void            namecacheremove(uint, uint, char*);
+void            namecachepurge(uint, uint);
+
+// sleeplock.c
+void            initsleeplock(struct sleeplock*, char*);
+void            acquiresleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
+void            releasesleep(struct sleeplock*);
+void            downgradesleep(struct sleeplock*);
+int             holdingsleep(struct sleeplock*);
+int             sleeplocked(struct sleeplock*);
+
+// slab.c
+struct kmem_cache* kmem_cache_create(char*, uint, void (*)(void*));
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void            slabstats(void);
+
+// softirq.c
+void            open_softirq(int, void (*)(void));
+void            raise_softirq(int);
+void            softirq(void);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 uint8           sacquire(struct spinlock*, uint32 waitticks);
@@ -144,20 +425,48 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
+int             lockstatcopy(struct lockstat*, int);
 
 // syscall.c
 int             argint(int, int*);
 int             arglong(int n, long* lp);
 int             argptr(int, char**, int);
+int             arguptr(int, char**, int);
 int             argstr(int, char**);
 int             arguintp(int, uintp*);
+int             fetchint(uintp, int*);
 int             fetchuintp(uintp, uintp*);
 int             fetchstr(uintp, char**);
 void            syscall(void);
+void            syscallinit(void);
+int             syscallstatcopy(int, struct syscallstat*, int, int);
+
+// sysfile.c
+int             closefd(int);
+int             openpath(char*, int);
+
+// textcache.c
+void            textcacheinit(void);
+char*           textcache_get(uint, uint, uintp);
+void            textcache_put(uint, uint, uintp, char*);
+void            textcache_invalidate(uint, uint);
+int             textcache_plan_get(uint, uint, struct execplan*);
+void            textcache_plan_put(uint, uint, struct execplan*);
 
 // timer.c
 void            timerinit(void);
 
+// ktimer.c
+struct ktimer;
+void            ktimerinit(void);
+void            ktimerset(struct ktimer*, uint, void (*)(void*), void*);
+int             ktimercancel(struct ktimer*);
+void            ktimertick(uint);
+
+// trace.c
+void            traceinit(void);
+void            tracerec(int, uint64, uint64);
+
 // trap.c
 void            trapinit(void);
 void            idtinit(void);
@@ -165,6 +474,9 @@ extern uint     ticks;
 void            tvinit(void);
 extern struct spinlock tickslock;
 
+// uaccess64.S
+uintp           copyuser(void*, const void*, uintp);
+
 // uart.c
 #define COM1      0x3F8
 #define COM2      0x2F8
@@ -174,24 +486,68 @@ void		uartearlyinit(void);
 void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
+void            uartsync(void);
+
+// uring.c
+uintp           uringsetup(void);
+int             uringenter(int);
+void            uringrelease(struct proc*);
+
+// vdso.c
+void            vdsoinit(void);
+void            vdsotick(uint);
+int             vdsomap(pde_t*, int, int);
+void            vdsoshared(struct proc*);
+void            vdsoreparent(struct proc*);
 
 // vm.c
 void            seginit(void);
+void            segalloc(int);
 void            kvmalloc(void);
 void            vmenable(void);
 pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
-int             allocuvm(pde_t*, uint, uint);
-int             deallocuvm(pde_t*, uintp, uintp);
+uintp           allocuvm(pde_t*, uintp, uintp);
+uintp           allocuvmhuge(pde_t*, uintp, uintp);
+int             mapuvmhuge(pde_t*, uintp, char*, int);
+uintp           deallocuvm(pde_t*, uintp, uintp);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(pde_t*, uintp);
+int             copyuvmrange(pde_t*, pde_t*, uintp, uintp);
+int             mappages(pde_t*, void*, uintp, uintp, int);
+int             cowfault(pde_t*, char*);
+int             pagein(struct proc*, char*);
+int             pageinrange(struct proc*, uintp, uintp);
+void            premapexe(pde_t*, struct inode*, struct useg*, int);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
-int             copyout(pde_t*, uint, void*, uint);
+int             kmap(char*, char*);
+char*           fbmap(uint64, uint64);
+void            uvmleave(void);
+uint64          newmmid(void);
+void            uvmflush(char*);
+void            uvmflushrange(uintp, uintp);
+void            vmflush(struct vmspace*);
+pde_t*          walkpgdir(pde_t*, const void*, int);
+int             copyout(pde_t*, uintp, void*, uintp);
+int             copy_from_user(void*, uintp, uintp);
+int             copy_to_user(uintp, void*, uintp);
+int             uprefault(uintp, uintp, int);
 void            clearpteu(pde_t *pgdir, char *uva);
 
+// watchdog.c
+void            watchdogtick(struct trapframe*);
+int             watchdognmi(struct trapframe*);
+
+// workqueue.c
+struct work;
+void            workqueueinit(void);
+int             queue_work(struct work*);
+int             queue_work_on(int, struct work*);
+void            flush_work(struct work*);
+
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
 
@@ -0,0 +1,13 @@
+// Directory entries from getdents(), the same for every file
+// system. Names are cut to DENT_NAMELEN, as path elements are.
+
+#define DENT_NAMELEN 14
+
+#ifndef __ASSEMBLER__
+struct dent {
+	uint ino;
+	uint size;
+	short type;                     // T_DIR, T_FILE or T_DEV
+	char name[DENT_NAMELEN + 1];    // nul-terminated
+};
+#endif
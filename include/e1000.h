@@ -0,0 +1,92 @@
+#ifndef XV64_E1000_H
+#define XV64_E1000_H
+
+// Intel 8254x (e1000) registers and descriptors. See e1000.c.
+
+#define E1000_VENDOR    0x8086
+#define E1000_82540EM   0x100E   // qemu's -device e1000
+#define E1000_82545EM   0x100F
+
+#define E1000_CTRL      0x0000
+#define E1000_STATUS    0x0008
+#define E1000_EERD      0x0014
+#define E1000_ICR       0x00C0   // read clears
+#define E1000_IMS       0x00D0
+#define E1000_IMC       0x00D8
+#define E1000_RCTL      0x0100
+#define E1000_TCTL      0x0400
+#define E1000_TIPG      0x0410
+#define E1000_RDBAL     0x2800
+#define E1000_RDBAH     0x2804
+#define E1000_RDLEN     0x2808
+#define E1000_RDH       0x2810
+#define E1000_RDT       0x2818
+#define E1000_TDBAL     0x3800
+#define E1000_TDBAH     0x3804
+#define E1000_TDLEN     0x3808
+#define E1000_TDH       0x3810
+#define E1000_TDT       0x3818
+#define E1000_MTA       0x5200   // 128 words
+#define E1000_RAL       0x5400
+#define E1000_RAH       0x5404
+
+#define E1000_CTRL_SLU  (1 << 6)
+#define E1000_CTRL_RST  (1 << 26)
+
+#define E1000_EERD_START (1 << 0)
+#define E1000_EERD_DONE  (1 << 4)
+
+#define E1000_RAH_AV    (1U << 31)
+
+#define E1000_RCTL_EN    (1 << 1)
+#define E1000_RCTL_BAM   (1 << 15)  // take broadcasts
+#define E1000_RCTL_SECRC (1 << 26)  // strip the CRC; buffers of 2048
+
+#define E1000_TCTL_EN   (1 << 1)
+#define E1000_TCTL_PSP  (1 << 3)
+#define E1000_TCTL_CT   (0x10 << 4)
+#define E1000_TCTL_COLD (0x40 << 12)
+
+#define E1000_TIPG_DEFAULT (10 | (8 << 10) | (6 << 20))
+
+// Interrupt causes, in ICR, IMS and IMC.
+#define E1000_INT_TXDW   (1 << 0)
+#define E1000_INT_LSC    (1 << 2)
+#define E1000_INT_RXDMT0 (1 << 4)
+#define E1000_INT_RXO    (1 << 6)
+#define E1000_INT_RXT0   (1 << 7)
+#define E1000_INT_RX     (E1000_INT_RXDMT0 | E1000_INT_RXO | E1000_INT_RXT0)
+
+#define E1000_RXBUF     2048
+
+struct e1000_rx_desc {
+	uint64 addr;
+	uint16 length;
+	uint16 csum;
+	uint8  status;
+	uint8  errors;
+	uint16 special;
+};
+
+struct e1000_tx_desc {
+	uint64 addr;
+	uint16 length;
+	uint8  cso;
+	uint8  cmd;
+	uint8  status;
+	uint8  css;
+	uint16 special;
+};
+
+#define E1000_RXD_DD    0x01
+#define E1000_RXD_EOP   0x02
+#define E1000_TXD_EOP   0x01
+#define E1000_TXD_IFCS  0x02
+#define E1000_TXD_RS    0x08
+#define E1000_TXD_DD    0x01
+
+struct pci_func;
+
+int    e1000_attach(struct pci_func *f);
+
+#endif
@@ -0,0 +1,23 @@
+// Physical memory map reported by the BIOS (INT 15h, AX=E820).
+// bootasm.S leaves the raw entries at E820MAP for the kernel.
+
+#define E820MAP        0x8000      // header, then entries
+#define E820_SIG       0x534D4150  // 'SMAP'
+#define E820_RAM       1           // usable memory
+#define E820_ENTSIZE   20
+#define E820MAX        32          // ranges the kernel keeps
+
+#ifndef __ASSEMBLER__
+struct e820entry {
+	uint64 addr;
+	uint64 len;
+	uint32 type;
+} __attribute__((packed));
+
+struct e820map {
+	uint32 sig;                    // E820_SIG once the BIOS was asked
+	uint16 end;                    // address just past the last entry
+	uint16 pad;
+	struct e820entry ent[];
+} __attribute__((packed));
+#endif
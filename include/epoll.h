@@ -0,0 +1,17 @@
+// epoll: wait on a set of files kept in the kernel. See epoll.c.
+
+#define EPOLL_CTL_ADD  1
+#define EPOLL_CTL_DEL  2
+#define EPOLL_CTL_MOD  3
+
+// Events, the same as poll()'s.
+#define EPOLLIN   0x001
+#define EPOLLOUT  0x010
+#define EPOLLERR  0x040
+#define EPOLLHUP  0x080
+#define EPOLLET   0x1000   // report a readiness once per wakeup
+
+struct epoll_event {
+	unsigned int events;
+	unsigned long data;   // returned as given
+};
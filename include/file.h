@@ -1,11 +1,20 @@
+#include "sleeplock.h"
+
 struct file {
-  enum { FD_NONE, FD_PIPE, FD_INODE } type;
+  enum { FD_NONE, FD_PIPE, FD_INODE, FD_EPOLL } type;
   int ref; // reference count
   char readable;
   char writable;
+  char nonblock;    // O_NONBLOCK: FNOT_READY instead of waiting
   struct pipe *pipe;
   struct inode *ip;
+  struct epoll *ep;
+  struct epitem *epitems; // on epolls' interest lists
   uint off;
+  struct sleeplock offlock; // serializes readers' offset updates
+  uint ranext;      // offset a sequential read would start at
+  uint rawin;       // readahead window in bytes, 0 if not sequential
+  uint raend;       // end of what has been read ahead
 };
 
 
@@ -14,7 +23,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
-  int flags;          // I_BUSY, I_VALID
+  int flags;          // I_VALID
+  struct fsops *ops;  // of the file system on dev
+  struct sleeplock lock; // shared for readers, exclusive for writers
 
   short type;         // copy of disk inode
   short major;
@@ -22,15 +33,29 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[/*NDIRECT+1*/29]; // TODO: make this not specific to fs1
+
+  // Last run of blocks looked up: file blocks [mapbn, mapbn+maplen)
+  // are at mapaddr on.
+  struct spinlock maplock;
+  uint mapbn;
+  uint mapaddr;
+  uint maplen;        // 0 if none
+
+  // Cached pages of file contents; see pagecache.c.
+  struct spinlock pclock;
+  struct pcnode *pcroot;
+  uint pcheight;      // levels in the tree, 0 if empty
 };
-#define I_BUSY 0x1
 #define I_VALID 0x2
+#define I_MOUNT 0x4   // a file system is mounted on it
 
 // table mapping major device number to
 // device functions
+struct poller;
 struct devsw {
   int (*read)(struct inode*, char*, int);
   int (*write)(struct inode*, char*, int);
+  int (*poll)(struct inode*, struct poller*);  // may be 0: always ready
 };
 
 extern struct devsw devsw[];
@@ -38,9 +63,8 @@ extern struct devsw devsw[];
 #define TTY0    1
 #define TTY1    2
 #define LOOP0   3
-
-struct pollfd {
-    int   fd;         /* file descriptor */
-    short events;     /* requested events */
-    short revents;    /* returned events */
-};
+#define PROF0   4
+#define TRACE0  5
+#define ZERO0   6
+#define RANDOM0 7
+#define NET0    8
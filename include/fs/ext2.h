@@ -80,18 +80,41 @@ struct ext2_inode {
     uint32 os_value2[3];           // Operating System Specific Value #2 (see https://web.archive.org/web/20211027105440/https://wiki.osdev.org/Ext2#OS_Specific_Value_2)
 }; // 128 bytes
 
+// Directory entry; rec_len takes it to the next one.
+struct ext2_dirent {
+    uint32 inode;                  // 0 if unused
+    uint16 rec_len;
+    uint8  name_len;
+    uint8  file_type;              // in version >= 1 with the filetype feature; else high byte of name_len
+    char   name[];                 // not terminated
+};
+
+#define EXT2_NDIR_BLOCKS 12        // direct pointers before the indirect ones
+#define EXT2_N_BLOCKS    15
+#define EXT2_ROOT_INO    2
+
 #define EXT2_IFMT  00170000
 #define EXT2_IFREG  0100000
 #define EXT2_IFDIR  0040000
+#define EXT2_IFCHR  0020000
 
 #define EXT2_TYPE_ISREG(m)	(((m) & EXT2_IFMT) == EXT2_IFREG)
 #define EXT2_TYPE_ISDIR(m)	(((m) & EXT2_IFMT) == EXT2_IFDIR)
+#define EXT2_TYPE_ISCHR(m)	(((m) & EXT2_IFMT) == EXT2_IFCHR)
+
+// Directory entry file types, with FS_EXT2_FEATURE_FILETYPE.
+#define EXT2_FT_REG_FILE 1
+#define EXT2_FT_DIR      2
+#define EXT2_FT_CHRDEV   3
 
 #define FS_EXT2_SIGNATURE 0xEF53
 #define FS_EXT2_SB_SIZE 1024
 #define FS_EXT2_OLD_INODE_SIZE 128
 #define FS_EXT2_MAX_BLOCK_SIZE 4096 // this should match the page size (in bytes) as allocated by kalloc
 
+// Required features (required_features) we can read with.
+#define FS_EXT2_FEATURE_FILETYPE 0x0002 // directory entries record the file type
+
 // File System States:
 #define FS_EXT2_CLEAN  0x1
 #define FS_EXT2_ERRORS 0x2
@@ -110,6 +133,7 @@ struct ext2_inode {
 
 uint8         ext2_init_dev(uint16 devt, uint32 devnum);
 void          ext2_readsb(uint16 devt, uint32 devnum, struct ext2_superblock* sb2);
+extern struct fsops ext2_ops;
 void          ext2_ilock(struct inode *ip);
 int           ext2_readi(struct inode *ip, char *dst, uint off, uint n);
 void          ext2_readinode(struct inode *ip);
@@ -117,8 +141,12 @@ int           ext2_writei(struct inode *ip, char *src, uint off, uint n);
 int           ext2_dirlink(struct inode *dp, char *name, uint inum);
 struct inode *ext2_dirlookup(struct inode *dp, char *name, uint *poff);
 struct inode *ext2_ialloc(uint dev, short type);
-struct inode *ext2_idup(struct inode *ip);
 void          ext2_iupdate(struct inode *ip);
 int           ext2_namecmp(const char *s, const char *t);
 void          ext2_stati(struct inode *ip, struct stat *st);
 void          ext2_itrunc(struct inode* ip);
+void          ext2_readahead(struct inode *ip, uint off, uint n);
+void          ext2_release(struct inode *ip);
+int           ext2_dirunlink(struct inode *dp, uint off);
+int           ext2_isdirempty(struct inode *dp);
+int           ext2_readdir(struct inode *dp, uint *off, char *name, uint *inum);
@@ -16,18 +16,26 @@ struct fs1_superblock {
   uint nblocks;      // Number of data blocks
   uint ninodes;      // Number of inodes.
   uint nlog;         // Number of log blocks
+  uint flags;        // FS1_*
 };
 
+#define FS1_EXTENTS  0x1  // files are mapped by extents
+#define FS1_DIRINDEX 0x2  // big directories may be hashed
+
 void            fs1_readsb(int dev, struct fs1_superblock *sb);
+extern struct fsops fs1_ops;
 int             fs1_dirlink(struct inode*, char*, uint);
 struct inode*   fs1_dirlookup(struct inode*, char*, uint*);
+int             fs1_dirunlink(struct inode*, uint);
+int             fs1_isdirempty(struct inode*);
+int             fs1_readdir(struct inode*, uint*, char*, uint*);
 struct inode*   fs1_ialloc(uint, short);
-struct inode*   fs1_idup(struct inode*);
 void            fs1_iinit(void);
 void            fs1_readinode(struct inode *);
 void            fs1_iupdate(struct inode*);
 int             fs1_namecmp(const char*, const char*);
 int             fs1_readi(struct inode*, char*, uint, uint);
+void            fs1_readahead(struct inode*, uint, uint);
 void            fs1_stati(struct inode*, struct stat*);
 int             fs1_writei(struct inode*, char*, uint, uint);
 void            fs1_itrunc(struct inode* ip);
@@ -36,6 +44,18 @@ void            fs1_itrunc(struct inode* ip);
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
 
+// With FS1_EXTENTS, addrs[] instead holds NDEXTENT extents, runs
+// of blocks that are contiguous on disk, mapping the file in
+// order, and then the address of a block of NIEXTENT more. An
+// unused extent has length 0.
+struct fs1_extent {
+  uint32 start;
+  uint32 len;
+};
+#define NDEXTENT (NDIRECT / 2)
+#define NIEXTENT (BSIZE / sizeof(struct fs1_extent))
+#define NEXTENT (NDEXTENT + NIEXTENT)
+
 // On-disk inode structure
 struct dinode {
   int16  type;               // File type
@@ -65,3 +85,29 @@ struct dirent {
   ushort inum;
   char name[DIRSIZ];
 };
+
+// With FS1_DIRINDEX, a directory that outgrows its first block
+// is hashed: block 0 keeps "." and ".." and becomes an index of
+// the leaf blocks after it, by the least hash of the names each
+// holds, and leaves split in two when they fill. The index is
+// kept in slots with inum 0, so code reading the directory as
+// plain dirents still sees all its entries and nothing else.
+#define FS1_DXMAGIC 0x7864
+
+struct fs1_dxslot {
+  ushort inum;               // 0
+  ushort block[2];           // leaf, as a block of the directory
+  ushort pad;
+  uint32 hash[2];            // least hash of a name in the leaf
+};
+
+struct fs1_dxroot {
+  struct dirent dot, dotdot;
+  ushort inum;               // 0
+  ushort magic;              // FS1_DXMAGIC
+  ushort count;              // index entries in use
+  ushort pad[5];
+  struct fs1_dxslot slot[(BSIZE - 3 * sizeof(struct dirent)) / sizeof(struct fs1_dxslot)];
+};
+
+#define NDXENTRY (2 * (BSIZE / sizeof(struct dirent) - 3))
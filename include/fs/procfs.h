@@ -0,0 +1,6 @@
+// procfs: process and system statistics as files. See kernel/fs/procfs.c.
+
+#define PROCFS_DEV      TODEVNUM(DEV_PROCFS, 0)
+#define PROCFS_ROOTINO  1
+
+extern struct fsops procfs_ops;
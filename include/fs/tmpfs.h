@@ -0,0 +1,7 @@
+// tmpfs: a file system kept in memory. See kernel/fs/tmpfs.c.
+
+#define TMPFS_DEV      TODEVNUM(DEV_TMPFS, 0)
+#define TMPFS_ROOTINO  1
+#define TMPFS_NINODE   1024   // files, directories and devices
+
+extern struct fsops tmpfs_ops;
@@ -0,0 +1,13 @@
+#ifndef XV64_IPC
+#define XV64_IPC
+
+// Synchronous call/reply between processes. See ipccall() in
+// proc.c.
+
+#define IPC_NWORDS  6   // words in a message
+
+struct ipcmsg {
+	uint64 w[IPC_NWORDS];
+};
+
+#endif
@@ -9,10 +9,22 @@
 #define IRQ_IDE1        14
 #define IRQ_IDE2        15
 #define IRQ_ERROR       19
+#define IRQ_TLB         29      // IPI: flush an address space; see lapic.c
+#define IRQ_RESCHED     30      // IPI: wake an idle cpu to run new work
 #define IRQ_SPURIOUS    31
-#define MAX_IRQS        32
+#define IRQ_MSI0        33      // first of the vectors handed out for MSI,
+                                // above T_SYSCALL (T_IRQ0 + 32)
+#define MAX_IRQS        64
+
+// Bottom halves; see softirq.c.
+#define SOFTIRQ_IDE      0
+#define SOFTIRQ_CONSOLE  1
+#define SOFTIRQ_NET      2
+#define NSOFTIRQ         3
 
 typedef void (*irqhandler)(uint16);
 uint8 irq_register_handler(uint16 irq, irqhandler handler); //this is defined in trap.c
+irqhandler get_registered_handler(uint16 irq);
+int irq_alloc_handler(irqhandler handler);
 
 #endif
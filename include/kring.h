@@ -0,0 +1,74 @@
+// Shared-memory rings between a blessed process and the kernel,
+// standing in for the pipes behind its process loop device.
+// See kring.c. Include after memmove() is declared.
+
+#define KRING_DATA  4096   // bytes in each ring, a power of two
+
+// kringwait() conditions
+#define KRING_IN    0x1    // there is data in in
+#define KRING_OUT   0x2    // there is room in out
+
+// One direction of the pair, with one producer and one consumer.
+// Each side only writes its own index and flag; indices count
+// bytes and wrap freely. A side that goes to sleep sets its
+// flag first and looks again; the other side, having moved its
+// index, rings the doorbell (kringnotify()) if it sees the flag.
+struct kring {
+	volatile unsigned int head;    // producer: bytes written
+	volatile unsigned int pwait;   // producer waits for room
+	char pad0[56];
+	volatile unsigned int tail;    // consumer: bytes read
+	volatile unsigned int cwait;   // consumer waits for data
+	char pad1[56];
+};
+
+// What kringmap() maps: a page of indices, then the two rings'
+// data a page each.
+struct kringmap {
+	struct kring out;   // process to kernel: what its device's readers get
+	struct kring in;    // kernel to process: what its device's writers put
+	char pad[4096 - 2 * sizeof(struct kring)];
+	char outdata[KRING_DATA];
+	char indata[KRING_DATA];
+};
+
+static inline unsigned int kring_used(struct kring *r) {
+	return r->head - r->tail;
+}
+
+static inline unsigned int kring_room(struct kring *r) {
+	return KRING_DATA - (r->head - r->tail);
+}
+
+// Producer: copy up to n bytes from src into r, whose data is at
+// data. Returns how many fit.
+static inline unsigned int kring_put(struct kring *r, char *data, const char *src, unsigned int n) {
+	unsigned int head = r->head, at = head % KRING_DATA, m;
+
+	if (n > kring_room(r))
+		n = kring_room(r);
+	m = n < KRING_DATA - at ? n : KRING_DATA - at;
+	memmove(data + at, src, m);
+	memmove(data, src + m, n - m);
+	__sync_synchronize();   // the data, then the index
+	r->head = head + n;
+	__sync_synchronize();   // the index, then the consumer's flag
+	return n;
+}
+
+// Consumer: copy up to n bytes out of r into dst. Returns how
+// many there were.
+static inline unsigned int kring_get(struct kring *r, char *data, char *dst, unsigned int n) {
+	unsigned int tail = r->tail, at = tail % KRING_DATA, m;
+
+	if (n > kring_used(r))
+		n = kring_used(r);
+	__sync_synchronize();   // the index, then the data
+	m = n < KRING_DATA - at ? n : KRING_DATA - at;
+	memmove(dst, data + at, m);
+	memmove(dst + m, data, n - m);
+	__sync_synchronize();   // done with the data before it is reused
+	r->tail = tail + n;
+	__sync_synchronize();
+	return n;
+}
@@ -0,0 +1,10 @@
+// Kernel timers: call fn(arg) once ticks reaches expires.
+// See ktimer.c.
+
+struct ktimer {
+	uint expires;                  // tick at which fn runs
+	void (*fn)(void*);
+	void *arg;
+	struct ktimer *next;           // wheel slot links, valid while pending
+	struct ktimer **pprev;         // 0 when not pending
+};
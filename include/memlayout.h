@@ -3,23 +3,35 @@
 #define EXTMEM  0x100000            // Start of extended memory
 #define AHCI_MEM 0x500000           // 5 MB to 36 MB
 #define KALLOC_START 0x3200000      // start kalloc @ 50 MB
-#define PHYSTOP 0xE000000           // Top physical memory
+#define KALLOC_EARLY 0x3600000      // kinit1() frees up to here
+#define PHYSTOP 0xE000000           // Top physical memory if the BIOS has no map
 #define DEVSPACE 0xFE000000         // Other devices are at high addresses
 
 // Key addresses for address space layout (see kmap in vm.c for layout)
 #define KERNBASE 0xFFFFFFFF80000000 // First kernel virtual address
 #define DEVBASE  0xFFFFFFFF40000000 // First device virtual address
+#define FBBASE   0xFFFFFFFF00000000 // Linear framebuffer, write-combining
+#define DIRECTBASE 0xFFFF800000000000 // Direct map of all physical memory
 #define KERNLINK (KERNBASE+EXTMEM)  // Address where kernel is linked
+#define USERTOP  0x800000000000     // End of user space (lower canonical half)
+#define KSTACKBASE 0xFFFFFF0000000000 // Kernel stacks, in guarded slots
+#define KSTACKREGION 0x40000000     // 1 GB of them
+#define KSTACKSLOT (2 * KSTACKSIZE) // a stack and its guard below
 
 #ifndef __ASSEMBLER__
 
-static inline uintp v2p(void *a) { return ((uintp) (a)) - ((uintp)KERNBASE); }
-static inline void *p2v(uintp a) { return (void *) ((a) + ((uintp)KERNBASE)); }
+// Kernel image addresses are above KERNBASE; everything
+// else the kernel reaches through the direct map.
+static inline uintp v2p(void *a) {
+	uintp v = (uintp)a;
+	return v >= KERNBASE ? v - KERNBASE : v - DIRECTBASE;
+}
+static inline void *p2v(uintp a) { return (void *) ((a) + ((uintp)DIRECTBASE)); }
 
 #endif
 
-#define V2P(a) (((uintp) (a)) - KERNBASE)
-#define P2V(a) (((void *) (a)) + KERNBASE)
+#define V2P(a) v2p((void *) (a))
+#define P2V(a) (((void *) (a)) + DIRECTBASE)
 #define IO2V(a) (((void *) (a)) + DEVBASE - DEVSPACE)
 
 #define ADDRHI(a) ((a >> 32) & 0xffffffff)
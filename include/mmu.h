@@ -38,12 +38,18 @@
 #define CR0_PG          0x80000000      // Paging
 
 #define CR4_PSE         0x00000010      // Page size extension
+#define CR4_OSFXSR      0x00000200      // fxsave/fxrstor and SSE
+#define CR4_OSXMMEXCPT  0x00000400      // SIMD floating-point exceptions
+#define CR4_PCIDE       0x00020000      // Process-context identifiers
+#define CR4_OSXSAVE     0x00040000      // xsave/xrstor and XCR0
+
+#define CR3_NOFLUSH     (1UL << 63)     // Keep TLB entries of the new PCID
 
 #define SEG_KCODE 1  // kernel code
 #define SEG_KDATA 2  // kernel data+stack
 #define SEG_KCPU  3  // kernel per-cpu data
-#define SEG_UCODE 4  // user code
-#define SEG_UDATA 5  // user data+stack
+#define SEG_UDATA 4  // user data+stack
+#define SEG_UCODE 5  // user code; SYSRET wants it right after SEG_UDATA
 #define SEG_TSS   6  // this process's task state
 
 
@@ -100,13 +106,20 @@ struct segdesc {
 #define STS_IG32    0xE     // 32-bit Interrupt Gate
 #define STS_TG32    0xF     // 32-bit Trap Gate
 
-// A virtual address 'la' has a three-part structure as follows:
+// A canonical virtual address 'la' has a five-part structure:
 //
-// +--------10------+-------10-------+---------12----------+
-// | Page Directory |   Page Table   | Offset within Page  |
-// |      Index     |      Index     |                     |
-// +----------------+----------------+---------------------+
-//  \--- PDX(va) --/ \--- PTX(va) --/
+// +---16---+----9----+----9----+----9----+----9----+----12----+
+// |  sign  |  PML4   |  PDPT   |  Page   |  Page   |  Offset  |
+// | extend |  Index  |  Index  |   Dir   |  Table  |  within  |
+// |        |         |         |  Index  |  Index  |   Page   |
+// +--------+---------+---------+---------+---------+----------+
+//           \PML4X(va)/\PDPTX(va)/\-PDX(va)/\-PTX(va)/
+
+// page map level 4 index
+#define PML4X(va)       (((uintp)(va) >> PML4XSHIFT) & PXMASK)
+
+// page directory pointer table index
+#define PDPTX(va)       (((uintp)(va) >> PDPTXSHIFT) & PXMASK)
 
 // page directory index
 #define PDX(va)         (((uintp)(va) >> PDXSHIFT) & PXMASK)
@@ -121,10 +134,13 @@ struct segdesc {
 #define NPDENTRIES      512     // # directory entries per page directory
 #define NPTENTRIES      512     // # PTEs per page table
 #define PGSIZE          4096    // bytes mapped by a page
+#define HUGEPGSIZE      (1UL << PDXSHIFT) // bytes mapped by a PTE_PS directory entry
 
 #define PGSHIFT         12      // log2(PGSIZE)
 #define PTXSHIFT        12      // offset of PTX in a linear address
 #define PDXSHIFT        21      // offset of PDX in a linear address
+#define PDPTXSHIFT      30      // offset of PDPTX in a linear address
+#define PML4XSHIFT      39      // offset of PML4X in a linear address
 
 #define PXMASK          0x1FF
 
@@ -140,7 +156,10 @@ struct segdesc {
 #define PTE_A           0x020   // Accessed
 #define PTE_D           0x040   // Dirty
 #define PTE_PS          0x080   // Page Size
+#define PTE_PS_PAT      0x1000  // PAT index bit 2, in a PTE_PS entry
 #define PTE_MBZ         0x180   // Bits must be zero
+#define PTE_COW         0x200   // Copy-on-write (software, available bit)
+#define PTE_SWAP        0x400   // Not present: swapped out; see swap.h (software)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uintp)(pte) & ~0xFFF)
@@ -0,0 +1,38 @@
+#ifndef XV64_MULTIBOOT_H
+#define XV64_MULTIBOOT_H
+
+// What a multiboot loader such as GRUB passes the kernel; entry64.S
+// keeps the magic and the info's physical address in mbootmagic
+// and mbootinfo. Only the framebuffer fields are used, by fbcons.c.
+
+#define MULTIBOOT_BOOTLOADER_MAGIC  0x2BADB002
+#define MULTIBOOT_INFO_FRAMEBUFFER  (1 << 12)
+#define MULTIBOOT_FRAMEBUFFER_RGB   1
+
+struct multiboot_info {
+	uint32 flags;
+	uint32 mem_lower, mem_upper;
+	uint32 boot_device;
+	uint32 cmdline;
+	uint32 mods_count, mods_addr;
+	uint32 syms[4];
+	uint32 mmap_length, mmap_addr;
+	uint32 drives_length, drives_addr;
+	uint32 config_table;
+	uint32 boot_loader_name;
+	uint32 apm_table;
+	uint32 vbe_control_info, vbe_mode_info;
+	uint16 vbe_mode, vbe_interface_seg, vbe_interface_off, vbe_interface_len;
+	uint64 framebuffer_addr;
+	uint32 framebuffer_pitch;      // bytes per line
+	uint32 framebuffer_width, framebuffer_height;
+	uint8  framebuffer_bpp;
+	uint8  framebuffer_type;
+	uint8  red_position, red_size;
+	uint8  green_position, green_size;
+	uint8  blue_position, blue_size;
+} __attribute__((packed));
+
+extern uint32 mbootmagic, mbootinfo;
+
+#endif
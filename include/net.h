@@ -0,0 +1,46 @@
+#ifndef XV64_NET_H
+#define XV64_NET_H
+
+// Network devices, as the drivers (e1000.c, virtionet.c) present
+// them to the rest of the kernel. See net.c.
+
+#define NETDEV_MAX   4     // devices, /dev/net0 and on
+#define NETRXQ       64    // received frames waiting for a reader
+#define NETBUDGET    32    // frames a poll takes before others get a go
+#define NETHEADROOM  64    // bytes before a sent frame, for driver headers
+#define ETH_HLEN     14
+#define ETH_MTU      1500
+
+// A frame, in a page of its own from kalloc(), starting at off.
+struct netframe {
+	char *page;
+	uint16 off;
+	uint16 len;
+};
+
+struct netdev {
+	char name[8];
+	uint8 mac[6];
+	int mtu;
+	int index;                     // in netdevs[], the device's minor
+	int irq;                       // has an interrupt; else it is polled by the tick
+	struct spinlock lock;          // the rx queue
+	struct netframe rxq[NETRXQ];
+	uint rxr, rxw;
+	struct pollhead poll;
+	struct ktimer timer;           // the next poll, without an interrupt
+
+	// Send len bytes at page+off, off >= NETHEADROOM; the driver
+	// owns the page from then and kfree()s it once sent. Returns
+	// -1 if the frame was dropped.
+	int (*xmit)(struct netdev*, char *page, int off, int len);
+	// With its interrupts masked, take up to budget received frames
+	// to netrxput(); returns how many it took.
+	int (*rxpoll)(struct netdev*, int budget);
+	// Unmask the interrupts; returns 1 if frames came in meanwhile.
+	int (*irqon)(struct netdev*);
+
+	uint64 rxpackets, txpackets, rxdrops, txdrops;
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef XV64_NVME_H
+#define XV64_NVME_H
+
+// NVMe controller registers, commands and queue entries.
+// See nvme.c.
+
+#define PCI_SUBCLASS_STORAGE_NVME 0x08
+
+#define NVME_REG_CAP    0x00  // 64-bit
+#define NVME_REG_VS     0x08
+#define NVME_REG_INTMS  0x0C
+#define NVME_REG_INTMC  0x10
+#define NVME_REG_CC     0x14
+#define NVME_REG_CSTS   0x1C
+#define NVME_REG_AQA    0x24
+#define NVME_REG_ASQ    0x28  // 64-bit
+#define NVME_REG_ACQ    0x30  // 64-bit
+#define NVME_REG_DBS    0x1000 // doorbells
+
+#define NVME_CAP_MQES(cap)   ((uint32)((cap) & 0xFFFF))   // entries - 1
+#define NVME_CAP_TO(cap)     ((uint32)(((cap) >> 24) & 0xFF)) // 500ms units
+#define NVME_CAP_DSTRD(cap)  ((uint32)(((cap) >> 32) & 0xF))
+
+#define NVME_CC_EN       0x1
+#define NVME_CC_IOSQES   (6 << 16)  // 64-byte submission entries
+#define NVME_CC_IOCQES   (4 << 20)  // 16-byte completion entries
+#define NVME_CSTS_RDY    0x1
+#define NVME_CSTS_CFS    0x2
+
+// Admin commands
+#define NVME_ADM_CREATE_SQ  0x01
+#define NVME_ADM_CREATE_CQ  0x05
+#define NVME_ADM_IDENTIFY   0x06
+#define NVME_ADM_SET_FEAT   0x09
+#define NVME_FEAT_NQUEUES   0x07
+#define NVME_ID_NS          0x00
+#define NVME_ID_CTRL        0x01
+
+// I/O commands
+#define NVME_CMD_WRITE      0x01
+#define NVME_CMD_READ       0x02
+
+// Identify data
+#define NVME_IDC_MDTS       77    // max transfer, 2^n pages; 0 for no limit
+#define NVME_IDNS_NSZE      0     // uint64, namespace size in blocks
+#define NVME_IDNS_FLBAS     26
+#define NVME_IDNS_LBAF      128   // uint32 each, LBA data size in bits 23:16
+
+struct nvme_sqe {
+	uint32 cdw0;          // opcode, command id in bits 31:16
+	uint32 nsid;
+	uint64 rsvd;
+	uint64 mptr;
+	uint64 prp1;
+	uint64 prp2;
+	uint32 cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+};
+
+struct nvme_cqe {
+	uint32 dw0;
+	uint32 dw1;
+	uint16 sqhd;
+	uint16 sqid;
+	uint16 cid;
+	uint16 status;        // phase tag in bit 0
+};
+
+struct pci_func;
+struct sata_sg;
+
+int    nvme_attach(struct pci_func *f);
+int    nvme_rw(uint32 dev, uint64 lba, struct sata_sg *sg, int nsg, int write);
+
+#endif
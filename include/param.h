@@ -1,11 +1,20 @@
 #define NPROC        64  // maximum number of processes
-#define KSTACKSIZE 4096  // size of per-process kernel stack
+#define KSTACKSIZE 16384 // size of per-process kernel stack; see kstack.c
 #define NCPU        128  // maximum number of CPUs
+#define NPCID         8  // PCIDs per CPU for user address spaces
+#define NNUMA         8  // maximum NUMA nodes
+#define HZ          100  // timer interrupts per second
+#define QUANTUM      10  // scheduler time slice (ms)
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NICACHE     256  // cached i-nodes before unused ones are reused
 #define NDEV         10  // maximum major device number
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data sectors in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define MAXWRITEBLOCKS 128 // blocks a filewrite() transaction may write
+#define LOGSIZE      512  // data sectors in the on-disk log mkfs makes
+#define LOGHDRSECT   8    // most sectors of a log record's header
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define BCACHE_PCT   10  // percent of memory the block cache may grow to
+#define PCACHE_PCT   25  // percent of memory the page cache may take
+#define BWRITEBACK    1  // let committed blocks reach home via the flusher
@@ -25,6 +25,15 @@ struct pci_bus {
     uint32 busno;
 };
 
+// External PCI subsystem interface (pci.c)
+uint32 pci_conf_read(struct pci_func* f, uint32 off);
+void   pci_conf_write(struct pci_func* f, uint32 off, uint32 v);
+void   pci_func_enable(struct pci_func* f);
+int    pci_find_cap(struct pci_func* f, int id);
+int    pci_msi_vector(struct pci_func* f, void (*handler)(uint16), int cpu);
+int    pci_msix_count(struct pci_func* f);
+int    pci_msix_vector(struct pci_func* f, int entry, void (*handler)(uint16), int cpu);
+
 #define PCI_DEV_CLASS_STORAGE       0x1
 #define PCI_DEV_CLASS_NETWORKING    0x2
 #define PCI_DEV_CLASS_DISPLAY       0x3
@@ -33,6 +42,7 @@ struct pci_bus {
 #define PCI_DEV_CLASS_BRIDGE        0x6
 
 #define	PCI_SUBCLASS_BRIDGE_PCI 0x04
+#define	PCI_SUBCLASS_STORAGE_IDE 0x01
 
 #define PCI_BAR0_OFFSET   0x10
 #define PCI_BAR1_OFFSET   0x14
@@ -52,6 +62,20 @@ struct pci_bus {
 #define PCI_CMD_IO_ENABLE     0x1
 #define PCI_CMD_MEM_ENABLE    0x2
 #define PCI_CMD_MASTER_ENABLE 0x4
+#define PCI_CMD_INTX_DISABLE  0x400
+#define PCI_STATUS_CAPLIST    (1 << 20) // in the command/status dword
+#define PCI_CAPLIST_REG       0x34
+
+// Message signalled interrupts. Control words are read and
+// written as the upper half of the capability's first dword.
+#define PCI_CAP_MSI           0x05
+#define PCI_CAP_MSIX          0x11
+#define PCI_MSI_CTRL_ENABLE   (1 << 16)
+#define PCI_MSI_CTRL_MME      (7 << 20)
+#define PCI_MSI_CTRL_64BIT    (1 << 23)
+#define PCI_MSIX_CTRL_SIZE    0x7FF     // entries - 1, after the shift
+#define PCI_MSIX_CTRL_ENABLE  (1U << 31)
+#define PCI_MSI_ADDR_BASE     0xFEE00000 // local APIC, destination in bits 19:12
 
 #define PCI_BRIDGE_BUS_SECONDARY_SHIFT   0x08
 #define PCI_BRIDGE_BUS_SUBORDINATE_SHIFT 0x10
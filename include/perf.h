@@ -0,0 +1,13 @@
+// Hardware performance counter events, as perfctl() takes them:
+// the architectural events of CPUID leaf 0xA, in its order.
+
+#define PERF_CYCLES       0  // core cycles, unhalted
+#define PERF_INSTRUCTIONS 1  // instructions retired
+#define PERF_REFCYCLES    2  // reference (TSC-rate) cycles, unhalted
+#define PERF_LLCREFS      3  // last-level cache references
+#define PERF_LLCMISSES    4  // last-level cache misses
+#define PERF_BRANCHES     5  // branch instructions retired
+#define PERF_BRANCHMISSES 6  // mispredicted branches retired
+#define PERF_NEVENTS      7
+
+#define PERF_MAXCTR       8  // counters in a group, at most
@@ -0,0 +1,46 @@
+// poll(): events, and how waiters find out about them.
+// See poll.c.
+
+// Events, as in unix/poll.h.
+#define POLLIN      0b000000001
+#define POLLRDNORM  0b000000010
+#define POLLRDBAND  0b000000100
+#define POLLPRI     0b000001000
+#define POLLOUT     0b000010000
+#define POLLWRNORM  POLLOUT
+#define POLLWRBAND  0b000100000
+#define POLLERR     0b001000000
+#define POLLHUP     0b010000000
+#define POLLNVAL    0b100000000
+
+struct pollfd {
+    int   fd;         /* file descriptor */
+    short events;     /* requested events */
+    short revents;    /* returned events */
+};
+
+struct pollentry;
+
+// The pollers waiting on one object, which calls pollwake() on
+// it whenever it may have become readable or writable.
+struct pollhead {
+	struct pollentry *list;
+};
+
+// One waiter's link on a pollhead.
+struct pollentry {
+	struct pollentry *next;
+	struct pollhead *head;         // 0 once the object is gone
+	struct poller *poller;
+	void (*func)(struct pollentry*); // if set, called instead of waking poller
+	void *arg;
+};
+
+// A poll() in progress, or anything else waiting on pollheads.
+struct poller {
+	int woken;                     // something may be ready
+	int full;                      // ran out of entries
+	int n;
+	struct pollentry *ent;         // a page of them
+	struct pollentry *(*alloc)(struct poller*); // if set, where entries come from
+};
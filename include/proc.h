@@ -1,12 +1,30 @@
+#include "spinlock.h"
+#include "workqueue.h"
+#include "ipc.h"
+
 // Segments in proc->gdt.
 #define NSEGS     7
 #define PROC_BLESSED 1
 #define PROC_DAMNED  0
 
+// Per-CPU cache of free pages in front of the kmem freelist; see kalloc.c
+#define KMAG_SIZE  32                  // pages held by one cpu's magazine
+#define KMAG_BATCH (KMAG_SIZE / 2)     // pages moved per refill/drain
+
+struct kmag {
+  int count;                   // number of pages in pages[]
+  char *pages[KMAG_SIZE];
+  uint64 hits;                 // kalloc/kfree served without kmem.lock
+  uint64 misses;               // kalloc/kfree that had to take kmem.lock
+};
+
+#define NHELD 8  // locks a cpu's held[] keeps track of
+
 // Per-CPU state
 struct cpu {
   uchar id;                    // index into cpus[] below
   uchar apicid;                // Local APIC ID
+  uchar node;                  // NUMA node, from the ACPI SRAT
   struct context *scheduler;   // swtch() here to enter scheduler
   struct taskstate ts;         // Used by x86 to find stack for interrupt
   struct segdesc gdt[NSEGS];   // x86 global descriptor table
@@ -14,6 +32,27 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   uint64 capabilities;         // bitmask of capabilities of this CPU
+  struct kmag kmag;            // per-CPU free page cache
+  uint64 pcidmm[NPCID];        // address space tagged by PCID i+1
+  uint pcidnext;               // next PCID slot to recycle
+  volatile int idle;           // halted in idle(), wants a reschedule IPI
+  uint64 slicestart;           // nsecs() when proc was switched in
+  uintp tls;                   // GS base loaded for the current proc
+  struct proc *fpuowner;       // whose FPU state was last loaded here; see fpu.c
+  struct vmspace *curvm;       // whose page table is loaded; see switchuvm()
+  uint softirqs;               // bottom halves pending; see softirq.c
+  int insoftirq;               // running them
+  uint64 accttsc;              // TSC when time here was last charged; see acctcharge()
+  uint64 busytsc;              // TSC cycles spent running processes
+  uint64 idletsc;              // and not
+  volatile uint wdticks;       // timer ticks taken; see watchdog.c
+  uint wdmoved;                // wdticks when last seen getting somewhere
+  uint wdpeer;                 // the next cpu round's wdticks when it last changed
+  uint wdpeerat;               // and ours then
+  volatile int wdnmi;          // that cpu has sent us an NMI to report a lockup
+  struct spinlock *spinning;   // lock sacquire() is waiting for, if any
+  struct spinlock *held[NHELD]; // locks held here, oldest first
+  int nheld;                   // may be more than NHELD
 
   // Cpu-local storage variables; see below
   void *local;
@@ -23,6 +62,10 @@ struct cpu {
 extern struct cpu cpus[NCPU];
 extern int ncpu;
 
+// Sets of cpus, one bit per cpus[] index.
+#define NCPUMASK          (NCPU / 64)
+#define CPUMASK_ISSET(m, c) (((m)[(c) / 64] >> ((c) % 64)) & 1)
+
 #define CPU_RESERVED_BLESS 0x01
 #define CPU_DISABLED       0x02
 
@@ -74,30 +117,161 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
-// Per-process state
-struct proc {
-  uintp sz;                     // Size of process memory (bytes)
+// An ELF segment that exec() left to be paged in on first touch.
+#define NUSEG 4
+struct useg {
+  uintp vaddr;                 // first user address of the segment
+  uintp memsz;                 // bytes of memory, zero-filled past filesz
+  uintp off;                   // offset of the segment in the executable
+  uintp filesz;                // bytes backed by the executable
+};
+
+// What execload() makes of an executable's headers. textcache.c
+// keeps it, so the next exec of the file needn't read them.
+struct execplan {
+  uintp entry;
+  uintp sz;                    // end of the highest segment
+  struct useg useg[NUSEG];
+  int nuseg;
+};
+
+// A program image built by execload(), for exec() or spawn().
+struct execimage {
+  pde_t *pgdir;
+  uintp sz;
+  uintp sp;                    // initial user stack pointer
+  uintp entry;
+  uintp argc;
+  uintp argv;                  // user address of argv[]
+  struct inode *exe;
+  struct useg useg[NUSEG];
+  int nuseg;
+  char name[16];
+};
+
+// A region created by mmap(); see mmap.c.
+#define NVMA 16
+struct vma {
+  uintp start;                 // page-aligned, 0 if slot unused
+  uintp end;
+  int prot;                    // PROT_* from mman.h
+  struct inode *ip;            // backing file, 0 for anonymous memory
+  uintp off;                   // file offset of start
+  int shared;                  // kernel pages mapped by mmapshared()
+};
+
+// Address space, shared by the threads of a process; see clone().
+struct vmspace {
+  struct spinlock lock;        // guards busy; see vmlock()
+  int busy;                    // someone is changing the mappings
+  int ref;                     // procs pointing here, under ptable.lock
+  int users;                   // of those, the ones not yet exited
   pde_t* pgdir;                // Page table
+  uint64 mmid;                 // address space generation; see switchuvm()
+  uint64 active[NCPUMASK];     // cpus with pgdir loaded; see tlbshootdown()
+  uintp sz;                    // Size of process memory (bytes)
+  uint8 hugepages;             // back large regions with 2 MB pages
+  struct inode *exe;           // executable backing useg[], if any
+  struct useg useg[NUSEG];     // demand-paged segments; see pagein()
+  int nuseg;
+  struct vma vma[NVMA];        // mappings above sz, below MMAPTOP
+  struct work free;            // frees the page table; see vmspaceput()
+  uintp swaphand;              // where swapout() looks next; see swap.c
+};
+
+// Open files and current directory, shared like vmspace.
+struct files {
+  struct spinlock lock;        // guards ofile[] and cwd
+  int ref;                     // procs pointing here, under ptable.lock
+  struct file *ofile[NOFILE];  // Open files
+  struct inode *cwd;           // Current directory
+};
+
+// Per-process state. Threads created by clone() are processes
+// that share their vm and files with the cloning process.
+struct proc {
+  struct vmspace *vm;          // address space
+  struct files *files;         // open files and cwd
+  uintp tls;                   // user %gs base, for thread-local storage
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   int pid;                     // Process ID
+  struct proc *pidnext;        // pid hash chain; see findproc()
   struct proc *parent;         // Parent process
+  struct proc *kids;           // children still running, under ptable.lock
+  struct proc *zombies;        // children that have exited, not reaped
+  struct proc *sibnext;        // on the parent's kids or zombies
+  struct proc **sibprev;
+  int xstatus;                 // exit status, for waitpid()
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
+  struct proc *wqnext;         // next sleeper in chan's waitq
   int killed;                  // If non-zero, have been killed
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  int preempt;                 // preempt_disable() depth; see cond_resched()
   char name[16];               // Process name (debugging)
   int lastsyscall;
+  uint64 nsyscall;             // system calls made
+  uint64 utime;                // TSC cycles run in user mode; see acctcharge()
+  uint64 stime;                // and in the kernel
+  uint64 cutime;               // children's reaped by wait(), and theirs
+  uint64 cstime;
+  uint64 cnsyscall;
   uint8 blessed;
   uint8 priority;
   uint32 skipped;
+  int rqcpu;                   // cpu whose runqueue holds p; see setrunnable()
+  uint64 affinity[NCPUMASK];   // cpus p may run on; see canrun()
+  struct proc *rqnext;         // runqueue links, valid while RUNNABLE
+  struct proc *rqprev;
+  uint8 rqprio;                // runqueue bucket, the effective priority
+  void (*kfn)(void*);          // kernel thread body; see kthread()
+  void *karg;
 
   // rpipe & wpipe are only used by blessed processes
   // both are named from the perspective of the kernel
   struct file *rpipe;   // read
   struct file *wpipe;   // write
+  struct kringpair *kring; // shared rings instead, once mapped; see kring.c
+
+  // Synchronous IPC, under ptable.lock; see ipccall()
+  int ipcstate;
+  struct proc *ipcpeer;        // server we called
+  struct proc *ipcnext;        // next call queued on ipcpeer
+  struct proc *ipccalls;       // calls queued on us, oldest first
+  struct ipcmsg ipcmsg;        // request, then reply
+
+  struct uring *uring;         // batched system calls; see uring.c
+
+  char *fpu;                   // saved FPU/SSE/AVX state, once used; see fpu.c
+  struct cpu *fpucpu;          // cpu whose registers last had it
+  struct perfgroup *perf;      // performance counters, if any; see perf.c
+};
+
+// What procinfo() copies out about a process, for /proc.
+struct procfd {
+  uchar type;                  // FD_NONE if the fd isn't open
+  uchar readable;
+  uchar writable;
+  uint off;
+  uint dev;                    // of an FD_INODE's inode
+  uint inum;
+};
+
+struct procinfo {
+  int pid;
+  int ppid;
+  enum procstate state;
+  char name[16];
+  uint8 blessed;
+  uint8 priority;
+  int killed;
+  int rqcpu;
+  uintp sz;
+  uint64 nsyscall;
+  uint64 utime;                // nanoseconds
+  uint64 stime;
+  struct procfd fd[NOFILE];
 };
 
 // Process memory is laid out contiguously, low addresses first:
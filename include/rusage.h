@@ -0,0 +1,10 @@
+// Resource usage, from getrusage().
+
+#define RUSAGE_SELF      0
+#define RUSAGE_CHILDREN  (-1)  // those reaped by wait(), and theirs
+
+struct rusage {
+  uint64 utime;      // nanoseconds run in user mode
+  uint64 stime;      // and in the kernel
+  uint64 nsyscall;   // system calls made
+};
@@ -0,0 +1,13 @@
+// Caches that give memory back when kalloc() runs short.
+// See reclaim.c.
+
+#ifndef XV64_SHRINKER
+#define XV64_SHRINKER
+
+struct shrinker {
+	char *name;
+	int (*shrink)(int n);          // free up to n pages; returns how many
+	struct shrinker *next;
+};
+
+#endif
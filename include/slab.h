@@ -0,0 +1,24 @@
+// Object caches carved out of kalloc()'d pages; see slab.c.
+
+#define NSLABCACHE      16  // maximum number of object caches
+#define SLAB_CPU_MAX    16  // objects held on one cpu's free list
+#define SLAB_CPU_BATCH  (SLAB_CPU_MAX / 2)
+
+struct slabobj {
+  struct slabobj *next;
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint objsize;                // bytes per object, 8-byte aligned
+  uint perslab;                // objects carved from each page
+  void (*ctor)(void*);         // run on every object handed out, if set
+  struct slabobj *freelist;    // shared free objects, under lock
+  uint nslabs;                 // pages owned by this cache
+  uint nfree;                  // objects on the shared freelist
+  struct {
+    struct slabobj *freelist;
+    uint count;
+  } cpu[NCPU];                 // per-cpu free objects, under pushcli
+};
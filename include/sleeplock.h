@@ -0,0 +1,17 @@
+#ifndef XV64_SLEEPLOCK
+#define XV64_SLEEPLOCK
+
+#include "spinlock.h"
+
+// Long-term reader-writer lock for processes. Any number of
+// holders may share it, or one may hold it exclusively; both
+// sleep rather than spin while waiting.
+struct sleeplock {
+  struct spinlock lk; // protects the fields below
+  int readers;        // number of shared holders
+  int writer;         // held exclusively?
+  int wantw;          // exclusive waiters; new readers hold off
+  struct proc *owner; // exclusive holder, for debugging
+};
+
+#endif
@@ -1,6 +1,28 @@
-// Mutual exclusion lock.
+#ifndef XV64_SPINLOCK
+#define XV64_SPINLOCK
+
+// Acquisition statistics, shared by every lock with the same
+// name and copied out to userland by lockstat().
+#define LOCKSTAT_NAME 16
+struct lockstat {
+  char name[LOCKSTAT_NAME];
+  uint64 acquires;    // times acquired
+  uint64 contended;   // acquisitions that had to wait
+  uint64 spins;       // pause loops spent waiting
+  uint64 maxhold;     // longest hold, TSC cycles (ns from lockstat())
+};
+
+// Mutual exclusion lock: a ticket lock. Acquirers take the next
+// ticket and wait for owner to reach it; it is free when
+// owner == next.
 struct spinlock {
-  uint locked;        // Is the lock held?
+  union {
+    struct {
+      volatile ushort owner; // ticket now being served
+      volatile ushort next;  // next ticket to hand out
+    };
+    volatile uint ticket;    // both, for compare-and-swap
+  };
   unsigned short sig; // Used by spinlock/holding to differentiate empty ram
                       // from an unacquired lock on CPU#0
 
@@ -9,8 +31,12 @@ struct spinlock {
   struct cpu *cpu;   // The cpu holding the lock.
   uintp pcs[10];      // The call stack (an array of program counters)
                      // that locked the lock.
+  struct lockstat *stat;
+  uint64 start;      // TSC at acquisition
 };
 
 #define SPINLOCK_SIG 0xAD16
 #define SPINLOCK_ACQUIRED 1
 #define SPINLOCK_NOT_ACQUIRED 0
+
+#endif
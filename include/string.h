@@ -7,6 +7,7 @@ int   strlen(const char* s);
 int   strncmp(const char* p, const char* q, uint n);
 char* strncpy(char* s, const char* t, int n);
 int   memcmp(const void* v1, const void* v2, uint n);
+void* memchr(const void* s, int c, uint n);
 
 
 //defined in ulib/string.c
@@ -0,0 +1,7 @@
+// Vectorized string scanning shared by ulib/string.c and
+// ulib/unix/string.c; see ulib/strsimd.c.
+
+unsigned long _strlen(const char* s);
+void*         _memchr(const void* s, int c, unsigned long n);
+int           _memcmp(const void* v1, const void* v2, unsigned long n);
+char*         _strchr(const char* s, int c);
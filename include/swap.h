@@ -0,0 +1,21 @@
+// Swap disk layout and swap entries in the page table.
+// See swap.c.
+
+#ifndef XV64_SWAP
+#define XV64_SWAP
+
+#define SWAP_MAGIC "XV64SWAP"
+
+// In the first sector of a swap disk. Page 0 of the disk is the
+// header's; pages 1 to npages-1 hold swapped-out pages.
+struct swaphdr {
+	char magic[8];
+	uint npages;                   // disk size in 4096-byte pages
+};
+
+// In the PTE of a swapped-out page: not present, PTE_SWAP set,
+// and the slot on disk where the physical address would be.
+#define SWAPPTE(slot)   (((uintp)(slot) << PGSHIFT) | PTE_SWAP)
+#define SWAPSLOT(pte)   ((uint)(PTE_ADDR(pte) >> PGSHIFT))
+
+#endif
@@ -38,3 +38,46 @@
 #define SYS_cpuhalt       37
 #define SYS_getpriority   38
 #define SYS_setpriority   39
+#define SYS_mmap          40
+#define SYS_munmap        41
+#define SYS_hugepages     42
+#define SYS_clock_gettime 43
+#define SYS_sched_setaffinity 44
+#define SYS_sched_getaffinity 45
+#define SYS_cpureserve    46
+#define SYS_clone         47
+#define SYS_futex         48
+#define SYS_lockstat      49
+#define SYS_bcachestat    50
+#define SYS_sync          51
+#define SYS_fsync         52
+#define SYS_mount         53
+#define SYS_pread         54
+#define SYS_pwrite        55
+#define SYS_readv         56
+#define SYS_writev        57
+#define SYS_sendfile      58
+#define SYS_getdents      59
+#define SYS_pipe2         60
+#define SYS_fcntl         61
+#define SYS_poll          62
+#define SYS_epoll_create  63
+#define SYS_epoll_ctl     64
+#define SYS_epoll_wait    65
+#define SYS_kringwait     66
+#define SYS_kringnotify   67
+#define SYS_kringmap      68
+#define SYS_ipc_call      69
+#define SYS_ipc_reply_wait 70
+#define SYS_uring_enter   71
+#define SYS_uring_setup   72
+#define SYS_syscallstat   73
+#define SYS_klogread      74
+#define SYS_spawn         75
+#define SYS__exit         76
+#define SYS_waitpid       77
+#define SYS_irqaffinity   78
+#define SYS_perfctl       79
+#define SYS_perfread      80
+#define SYS_getrusage     81
+#define SYS_netrecv       82
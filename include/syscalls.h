@@ -1,4 +1,16 @@
 struct stat;
+struct timespec;
+struct lockstat;
+struct bcachestat;
+struct iovec;
+struct dent;
+struct pollfd;
+struct epoll_event;
+struct kringmap;
+struct ipcmsg;
+struct uring;
+struct syscallstat;
+struct rusage;
 
 // system calls
 int fork(void);
@@ -39,3 +51,46 @@ int nprocs(void);
 void cpuhalt(void);
 int getpriority(int);
 int setpriority(int, int);
+void* mmap(void*, unsigned long, int, int, int, long);
+int munmap(void*, unsigned long);
+int hugepages(int);
+int clock_gettime(int, struct timespec*);
+int sched_setaffinity(int, int, unsigned long*);
+int sched_getaffinity(int, int, unsigned long*);
+int cpureserve(int, int);
+int clone(void (*)(void*), void*, void*, void*);
+int futex(volatile int*, int, int);
+int lockstat(struct lockstat*, int);
+int bcachestat(struct bcachestat*);
+int sync(void);
+int fsync(int);
+int mount(char*, char*);
+int pread(int, void*, int, int);
+int pwrite(int, void*, int, int);
+int readv(int, struct iovec*, int);
+int writev(int, struct iovec*, int);
+int sendfile(int, int, int*, int);
+int getdents(int, struct dent*, int);
+int pipe2(int*, int);
+int fcntl(int, int, int);
+int poll(struct pollfd*, unsigned long, int);
+int epoll_create(void);
+int epoll_ctl(int, int, int, struct epoll_event*);
+int epoll_wait(int, struct epoll_event*, int, int);
+int kringwait(int);
+int kringnotify(void);
+struct kringmap* kringmap(void);
+int ipc_call(int, struct ipcmsg*);
+int ipc_reply_wait(int, struct ipcmsg*);
+int uring_enter(int);
+struct uring* uring_setup(void);
+int syscallstat(int, struct syscallstat*, int, int);
+int klogread(char*, int);
+int spawn(char*, char**, int*);
+int _exit(int) __attribute__((noreturn));
+int waitpid(int, int*, int);
+int irqaffinity(int, int);
+int perfctl(int*, int);
+int perfread(unsigned long*, int);
+int getrusage(int, struct rusage*);
+char* netrecv(int, int*);
@@ -0,0 +1,11 @@
+// Counts and latencies of system calls, per cpu, copied out to
+// userland by syscallstat().
+
+#define NSYSCALLSTAT   128  // system call numbers counted
+#define SYSCALLSTAT_NHIST 32
+
+struct syscallstat {
+  uint64 count;      // calls made
+  uint64 cycles;     // TSC cycles spent in them
+  uint hist[SYSCALLSTAT_NHIST]; // calls taking [2^b, 2^(b+1)) cycles; the last bucket takes the rest
+};
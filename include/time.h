@@ -0,0 +1,10 @@
+// clock_gettime() clocks and time values
+
+#define CLOCK_MONOTONIC 1      // nanoseconds since boot
+
+#ifndef __ASSEMBLER__
+struct timespec {
+	long tv_sec;
+	long tv_nsec;
+};
+#endif
@@ -0,0 +1,42 @@
+// Static tracepoints: the records the kernel puts in its trace
+// rings, which /dev/trace gives out. See kernel/trace.c.
+
+#ifndef XV64_TRACE
+#define XV64_TRACE
+
+// Events, with what their arguments are.
+#define TRACE_SWITCHIN    1   // pid
+#define TRACE_SWITCHOUT   2   // pid, state it leaves in
+#define TRACE_SLEEP       3   // chan
+#define TRACE_WAKEUP      4   // pid woken, chan
+#define TRACE_BIOSUBMIT   5   // sector, dev | TRACE_WRITE
+#define TRACE_BIODONE     6   // sector, dev | TRACE_WRITE
+#define TRACE_BEGINOP     7   // blocks reserved
+#define TRACE_ENDOP       8   // blocks reserved
+#define TRACE_COMMIT      9   // blocks in the transaction
+#define TRACE_COMMITDONE  10  // blocks in the transaction
+#define TRACE_SYSENTER    11  // system call number
+#define TRACE_SYSEXIT     12  // system call number, result
+#define TRACE_DROPPED     13  // records the cpu lost, in arg[0]
+#define TRACE_NEVENTS     14
+
+#define TRACE_WRITE       (1ULL << 32)
+
+struct tracerec {
+	uint64 tsc;
+	uint64 arg[2];
+	int pid;              // running when it happened, or 0
+	ushort event;
+	uchar cpu;
+	uchar pad;
+};
+
+// In the kernel, a tracepoint costs a load and a branch while
+// tracing is off.
+extern int tracing;
+#define TRACE(ev, a, b) do { \
+	if (tracing) \
+		tracerec((ev), (uint64)(a), (uint64)(b)); \
+} while (0)
+
+#endif
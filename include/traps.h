@@ -22,6 +22,11 @@
 #define T_MCHK          18      // machine check
 #define T_SIMDERR       19      // SIMD floating point error
 
+// Page fault error code bits
+#define FEC_PR           0x1    // fault on a present page
+#define FEC_WR           0x2    // fault was a write
+#define FEC_U            0x4    // fault happened in user mode
+
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
 #define T_SYSCALL       64      // system call
@@ -0,0 +1,10 @@
+// scatter/gather buffers for readv() and writev()
+
+#define IOV_MAX 64     // most buffers in one call
+
+#ifndef __ASSEMBLER__
+struct iovec {
+	void *iov_base;
+	unsigned long iov_len;
+};
+#endif
@@ -19,5 +19,5 @@ struct pollfd {
 
 typedef unsigned long nfds_t;
 
-//defined in posix.c:
+// a system call
 int poll(struct pollfd fds[], nfds_t nfds, int timeout);
@@ -8,10 +8,27 @@
 #define SEEK_CUR 1
 #define SEEK_END 2
 
+#define BUFSIZ 4096
 
-typedef struct {
+// setvbuf() modes
+#define _IOFBF 0   // fully buffered
+#define _IOLBF 1   // line buffered: flushed at each newline
+#define _IONBF 2   // unbuffered
+
+// One buffer serves both directions: it holds either bytes read
+// ahead, buf[rpos, rlen), or bytes waiting to be written,
+// buf[0, wlen), never both.
+typedef struct _xv64_file {
     int fd;
-    int readable;
+    int readable;      // -1 at end of file or after an error
+    int mode;          // _IOFBF, _IOLBF or _IONBF
+    char *buf;         // 0 until first use
+    int bufsize;
+    int rpos, rlen;
+    int wlen;
+    int ownbuf;        // buf came from malloc() here
+    char ch;           // the buffer when unbuffered
+    struct _xv64_file *next; // all open streams, for fflush(0)
 } FILE;
 
 extern FILE *_xv64_stdin;
@@ -23,8 +40,16 @@ extern FILE *_xv64_stderr;
 #define stderr _xv64_stderr
 
 int   feof(FILE *);
+int   fflush(FILE *stream);
 int   fgetc(FILE *stream);
 char *fgets(char *restrict, int, FILE *restrict);
+int   fputc(int c, FILE *stream);
+int   fputs(const char *restrict s, FILE *restrict stream);
+size_t fread(void *restrict ptr, size_t size, size_t nitems, FILE *restrict stream);
+size_t fwrite(const void *restrict ptr, size_t size, size_t nitems, FILE *restrict stream);
+int   getchar(void);
+int   putchar(int c);
+int   setvbuf(FILE *restrict stream, char *restrict buf, int mode, size_t size);
 FILE *fopen(const char *restrict filename, const char *restrict mode);
 long  ftell(FILE *stream);
 int   fclose(FILE *);
@@ -7,4 +7,6 @@ long atol(const char *str);
 void exit(int status);
 void *malloc(size_t size);
 void free(void *ptr);
+void malloc_profile(unsigned int rate);
+void malloc_stats(void);
 long strtol(const char *restrict str, char **restrict endptr, int base);
@@ -5,6 +5,7 @@
 
 int32_t atoi(const char *s);
 char*   gets(char *buf, int32_t max);
+void*   memchr(const void* s, int32_t c, uint32_t n);
 int32_t memcmp(const void* v1, const void* v2, uint32_t n);
 void*   memmove(void* dst, const void* src, uint32_t n);
 void*   memset(void* dst, int32_t c, uint32_t n);
@@ -0,0 +1,42 @@
+// Batched system calls through a ring shared with the kernel.
+// See kernel/uring.c.
+
+#define URING_ENTRIES  64   // in each queue, a power of two
+
+// Operations
+#define URING_NOP      0
+#define URING_READ     1    // read(fd, addr, len)
+#define URING_WRITE    2    // write(fd, addr, len)
+#define URING_OPEN     3    // open(addr, flags)
+#define URING_CLOSE    4    // close(fd)
+#define URING_FSTAT    5    // fstat(fd, addr)
+
+// A request. data comes back in its completion.
+struct uring_sqe {
+	uint8 op;
+	uint8 pad[3];
+	int fd;
+	uint len;
+	int flags;
+	uint64 addr;
+	uint64 data;
+};
+
+// What the request returned, as the system call would have.
+struct uring_cqe {
+	uint64 data;
+	int res;
+	uint pad;
+};
+
+// What uring_setup() maps: one page. Indices count entries and
+// wrap freely; each side only writes its own.
+struct uring {
+	volatile uint sqhead;   // kernel: requests taken
+	volatile uint sqtail;   // process: requests queued
+	volatile uint cqhead;   // process: completions seen
+	volatile uint cqtail;   // kernel: completions posted
+	uint pad[12];
+	struct uring_sqe sq[URING_ENTRIES];
+	struct uring_cqe cq[URING_ENTRIES];
+};
@@ -12,10 +12,52 @@ int32 ioctl(int32 fd, uint64 cmd, ...);
 #define stderr 2
 
 void  fprintf(int32, const char*, ...);
+void  printf(const char*, ...);
+int   snprintf(char*, unsigned int, const char*, ...);
 
 
 // umalloc.c
+#define MALLOC_NCLASS 8
+
+struct mallocstats {
+	uint64 nmalloc[MALLOC_NCLASS + 1];  // by size class, 16 bytes up, then bigger
+	uint64 nfree[MALLOC_NCLASS + 1];
+	uint64 inuse;                       // bytes, counting rounding up
+	uint64 peak;
+	uint64 heap;                        // bytes got from sbrk()
+	uint64 mapped;                      // bytes mmap()ed now
+};
+
 void* malloc(uint);
 void  free(void*);
+void  malloc_info(struct mallocstats*);
+void  malloc_profile(uint);
+void  malloc_stats(void);
+void  _malloc_threadexit(void*);
+
+
+// thread.c
+typedef struct thread* thread_t;
+
+thread_t thread_create(void (*)(void*), void*);
+int      thread_join(thread_t);
+thread_t thread_self(void);
+int      thread_id(thread_t);
+
+typedef struct { volatile int state; } mutex_t;
+typedef struct { volatile int seq; } cond_t;
+#define MUTEX_INITIALIZER { 0 }
+#define COND_INITIALIZER  { 0 }
+
+void mutex_lock(mutex_t*);
+int  mutex_trylock(mutex_t*);
+void mutex_unlock(mutex_t*);
+void cond_wait(cond_t*, mutex_t*);
+void cond_signal(cond_t*);
+void cond_broadcast(cond_t*);
+
+// for umalloc.c
+extern int _threaded;
+void** _thread_mcache(void);
 
 uint32 getppid(void);
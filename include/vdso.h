@@ -0,0 +1,20 @@
+// Pages the kernel keeps mapped read-only at the top of every
+// user address space, so common queries need no system call.
+// See kernel/vdso.c.
+
+#define VDSO_TIME   0x7f0000000000   // struct vdsotime, at MMAPTOP
+#define VDSO_PROC   0x7f0000001000   // struct vdsoproc
+
+// Shared by all processes.
+struct vdsotime {
+	volatile uint ticks;   // as ticks() returns
+	uint pad;
+	uint64 tscboot;        // TSC at boot
+	uint64 tsckhz;         // TSC cycles per millisecond, or 0
+};
+
+// The process's own.
+struct vdsoproc {
+	int pid;               // 0 if threads share the page: ask the kernel
+	volatile int ppid;
+};
@@ -1,5 +1,5 @@
 #define FS_MAX_SB_SIZE 4096
-#define FS_MAX_INIT_DEV 1
+#define FS_MAX_INIT_DEV 4  // devices mounted at once
 
 // generic super block
 struct superblock {
@@ -10,3 +10,37 @@ typedef int16 fstype;
 
 #define FS_TYPE_FS1  0x1
 #define FS_TYPE_EXT2 0x2
+#define FS_TYPE_TMPFS 0x3
+#define FS_TYPE_PROCFS 0x4
+
+struct inode;
+struct stat;
+
+// What a file system does for the VFS. Each kind of file system
+// has one table, attached to the devices mounted with it by
+// vfsmount(); every inode carries its device's, so vfs.c calls
+// straight through. mount, readahead, release, fsync and
+// dirunlink may be 0.
+struct fsops {
+  fstype type;
+  uint           rootino;
+  int            pagecache;                      // file data goes in the page cache
+  int            nonamecache;                    // names come and go by themselves; don't cache lookups
+  int            (*mount)(uint dev);             // before first use
+  void           (*readsb)(int dev, struct superblock *sb);
+  struct inode*  (*ialloc)(uint dev, short type);
+  void           (*readinode)(struct inode *ip);
+  void           (*iupdate)(struct inode *ip);
+  void           (*itrunc)(struct inode *ip);
+  void           (*release)(struct inode *ip);   // last reference going
+  int            (*readi)(struct inode *ip, char *dst, uint off, uint n);
+  int            (*writei)(struct inode *ip, char *src, uint off, uint n);
+  void           (*readahead)(struct inode *ip, uint off, uint n);
+  void           (*stati)(struct inode *ip, struct stat *st);
+  struct inode*  (*dirlookup)(struct inode *dp, char *name, uint *poff);
+  int            (*dirlink)(struct inode *dp, char *name, uint inum);
+  int            (*dirunlink)(struct inode *dp, uint off);
+  int            (*isdirempty)(struct inode *dp);
+  int            (*readdir)(struct inode *dp, uint *off, char *name, uint *inum);
+  int            (*fsync)(struct inode *ip);         // get ip's changes to disk
+};
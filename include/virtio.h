@@ -0,0 +1,168 @@
+#ifndef XV64_VIRTIO_H
+#define XV64_VIRTIO_H
+
+// Virtio 1.0 over PCI ("modern" devices), and split virtqueues.
+// See virtio.c; the block driver is in virtioblk.c, the network
+// one in virtionet.c.
+
+#define VIRTIO_PCI_VENDOR        0x1AF4
+#define VIRTIO_PCI_BLK_LEGACY    0x1001 // transitional, modern interface too
+#define VIRTIO_PCI_BLK           0x1042
+#define VIRTIO_PCI_NET_LEGACY    0x1000
+#define VIRTIO_PCI_NET           0x1041
+
+// Vendor-specific PCI capabilities locating the register blocks.
+#define PCI_CAP_ID_VNDR          0x09
+#define VIRTIO_PCI_CAP_COMMON    1
+#define VIRTIO_PCI_CAP_NOTIFY    2
+#define VIRTIO_PCI_CAP_ISR       3
+#define VIRTIO_PCI_CAP_DEVICE    4
+
+// Device status bits.
+#define VIRTIO_STAT_ACK          0x01
+#define VIRTIO_STAT_DRIVER       0x02
+#define VIRTIO_STAT_DRIVER_OK    0x04
+#define VIRTIO_STAT_FEATURES_OK  0x08
+#define VIRTIO_STAT_FAILED       0x80
+
+#define VIRTIO_F_VERSION_1       (1ULL << 32)
+
+#define VIRTIO_ISR_QUEUE         0x1
+#define VIRTIO_NO_VECTOR         0xFFFF
+
+typedef volatile struct {
+	uint32 device_feature_select;
+	uint32 device_feature;
+	uint32 driver_feature_select;
+	uint32 driver_feature;
+	uint16 msix_config;
+	uint16 num_queues;
+	uint8  device_status;
+	uint8  config_generation;
+	uint16 queue_select;
+	uint16 queue_size;
+	uint16 queue_msix_vector;
+	uint16 queue_enable;
+	uint16 queue_notify_off;
+	uint32 queue_desc_lo, queue_desc_hi;     // written as two halves
+	uint32 queue_driver_lo, queue_driver_hi;
+	uint32 queue_device_lo, queue_device_hi;
+} virtio_common_cfg;
+
+// Split virtqueue layout, all in one page.
+#define VIRTQ_MAX         128  // most entries we use in a queue
+#define VIRTQ_DESC_NEXT   0x1
+#define VIRTQ_DESC_WRITE  0x2  // device writes the buffer
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 0x1 // driver polls the used ring
+
+struct virtq_desc {
+	uint64 addr;
+	uint32 len;
+	uint16 flags;
+	uint16 next;
+};
+
+struct virtq_avail {
+	uint16 flags;
+	uint16 idx;
+	uint16 ring[VIRTQ_MAX];
+};
+
+struct virtq_used_elem {
+	uint32 id;
+	uint32 len;
+};
+
+struct virtq_used {
+	uint16 flags;
+	uint16 idx;
+	struct virtq_used_elem ring[VIRTQ_MAX];
+};
+
+// A PCI virtio device's register blocks.
+struct virtio_pci {
+	virtio_common_cfg *common;
+	volatile uint8 *isr;
+	volatile uint8 *device;       // device-specific configuration
+	volatile uint8 *notify;
+	uint32 notify_mult;
+	int irq;                      // -1 if none
+};
+
+struct virtq {
+	struct spinlock lock;
+	struct virtio_pci *vp;
+	uint16 index;
+	uint16 size;
+	struct virtq_desc *desc;
+	struct virtq_avail *avail;
+	volatile struct virtq_used *used;
+	volatile uint16 *notify;
+	uint16 freehead;              // chain of free descriptors
+	uint16 nfree;
+	uint16 lastused;              // used ring entries already reaped
+};
+
+struct pci_func;
+struct sata_sg;
+
+int    virtio_pci_init(struct virtio_pci *vp, struct pci_func *f);
+int    virtio_negotiate(struct virtio_pci *vp, uint64 wanted, uint64 *features);
+int    virtq_init(struct virtio_pci *vp, struct virtq *vq, int index, int vector);
+void   virtio_ready(struct virtio_pci *vp);
+void   virtio_fail(struct virtio_pci *vp);
+uint32 virtio_config32(struct virtio_pci *vp, int off);
+uint64 virtio_config64(struct virtio_pci *vp, int off);
+uint16 virtio_config16(struct virtio_pci *vp, int off);
+int    virtq_alloc(struct virtq *vq, int n);
+void   virtq_free(struct virtq *vq, int head);
+void   virtq_submit(struct virtq *vq, int head);
+int    virtq_reap(struct virtq *vq, uint32 *len);
+
+// virtio-blk
+#define VIRTIO_BLK_F_SIZE_MAX    (1ULL << 1)
+#define VIRTIO_BLK_F_SEG_MAX     (1ULL << 2)
+#define VIRTIO_BLK_F_RO          (1ULL << 5)
+#define VIRTIO_BLK_F_MQ          (1ULL << 12)
+
+#define VIRTIO_BLK_CFG_CAPACITY  0   // uint64, in 512-byte sectors
+#define VIRTIO_BLK_CFG_SIZE_MAX  8
+#define VIRTIO_BLK_CFG_SEG_MAX   12
+#define VIRTIO_BLK_CFG_NUMQ      34
+
+#define VIRTIO_BLK_T_IN          0
+#define VIRTIO_BLK_T_OUT         1
+#define VIRTIO_BLK_S_OK          0
+#define VIRTIO_BLK_S_IOERR       1
+#define VIRTIO_BLK_S_UNSUPP      2
+
+struct virtio_blk_req {
+	uint32 type;
+	uint32 reserved;
+	uint64 sector;
+};
+
+int    virtio_blk_attach(struct pci_func *f);
+int    virtio_blk_rw(uint32 dev, uint64 lba, struct sata_sg *sg, int nsg, int write);
+
+// virtio-net
+#define VIRTIO_NET_F_MTU         (1ULL << 3)
+#define VIRTIO_NET_F_MAC         (1ULL << 5)
+
+#define VIRTIO_NET_CFG_MAC       0   // 6 bytes
+#define VIRTIO_NET_CFG_MTU       10  // uint16
+
+// Before every frame, both ways; 12 bytes with VIRTIO_F_VERSION_1.
+struct virtio_net_hdr {
+	uint8  flags;
+	uint8  gso_type;
+	uint16 hdr_len;
+	uint16 gso_size;
+	uint16 csum_start;
+	uint16 csum_offset;
+	uint16 num_buffers;
+};
+
+int    virtio_net_attach(struct pci_func *f);
+
+#endif
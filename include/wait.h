@@ -0,0 +1,3 @@
+// waitpid() options
+
+#define WNOHANG 1   // return 0 rather than wait for a child
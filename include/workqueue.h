@@ -0,0 +1,17 @@
+// Deferred work: fn(arg) run later by a cpu's worker thread.
+// See workqueue.c.
+
+#ifndef XV64_WORKQUEUE
+#define XV64_WORKQUEUE
+
+struct work {
+	void (*fn)(void*);
+	void *arg;
+	struct work *next;             // queue link, valid while pending
+	int pending;                   // queued and not yet started
+	int cpu;                       // queue it was last put on
+};
+
+#define INIT_WORK(w, f, a) do { (w)->fn = (f); (w)->arg = (a); (w)->next = 0; (w)->pending = 0; (w)->cpu = 0; } while (0)
+
+#endif
@@ -120,6 +120,27 @@ static inline void stosl(void *addr, int data, int cnt) {
 	              "memory", "cc");
 }
 
+static inline void stosq(void *addr, unsigned long data, unsigned long cnt) {
+	asm volatile ("cld; rep stosq" :
+	              "=D" (addr), "=c" (cnt) :
+	              "0" (addr), "1" (cnt), "a" (data) :
+	              "memory", "cc");
+}
+
+static inline void movsb(void *dst, const void *src, unsigned long cnt) {
+	asm volatile ("cld; rep movsb" :
+	              "=D" (dst), "=S" (src), "=c" (cnt) :
+	              "0" (dst), "1" (src), "2" (cnt) :
+	              "memory", "cc");
+}
+
+static inline void movsq(void *dst, const void *src, unsigned long cnt) {
+	asm volatile ("cld; rep movsq" :
+	              "=D" (dst), "=S" (src), "=c" (cnt) :
+	              "0" (dst), "1" (src), "2" (cnt) :
+	              "memory", "cc");
+}
+
 struct segdesc;
 
 static inline void lgdt(struct segdesc *p, int size) {
@@ -160,6 +181,13 @@ static inline unsigned long readeflags(void) {
 	return eflags;
 }
 
+static inline unsigned long rdtsc(void) {
+	unsigned int lo, hi;
+
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((unsigned long long)hi << 32) | lo;
+}
+
 static inline void loadgs(unsigned short v) {
 	asm volatile ("movw %0, %%gs" : : "r" (v));
 }
@@ -176,6 +204,12 @@ static inline void amd64_hlt(void) {
 	asm volatile ("hlt");
 }
 
+// Enable interrupts and halt. sti takes effect only after the
+// next instruction, so no interrupt can slip in between.
+static inline void amd64_sti_hlt(void) {
+	asm volatile ("sti; hlt");
+}
+
 static inline unsigned int amd64_xchg(volatile unsigned int *addr, unsigned long newval) {
 	unsigned int result;
 
@@ -187,6 +221,27 @@ static inline unsigned int amd64_xchg(volatile unsigned int *addr, unsigned long
 	return result;
 }
 
+// Atomically add v to *addr and return the old value.
+static inline unsigned short amd64_xadd16(volatile unsigned short *addr, unsigned short v) {
+	asm volatile ("lock; xaddw %0, %1" :
+	              "+r" (v), "+m" (*addr) :
+	              :
+	              "memory", "cc");
+	return v;
+}
+
+// Atomically set *addr to newval if it holds old;
+// returns the value *addr held.
+static inline unsigned int amd64_cmpxchg(volatile unsigned int *addr, unsigned int old, unsigned int newval) {
+	unsigned int result;
+
+	asm volatile ("lock; cmpxchgl %2, %1" :
+	              "=a" (result), "+m" (*addr) :
+	              "r" (newval), "0" (old) :
+	              "memory", "cc");
+	return result;
+}
+
 static inline unsigned long rcr2(void) {
 	unsigned long val;
 	asm volatile ("mov %%cr2,%0" : "=r" (val));
@@ -197,12 +252,53 @@ static inline void lcr3(unsigned long val) {
 	asm volatile ("mov %0,%%cr3" : : "r" (val));
 }
 
+static inline unsigned long rcr3(void) {
+	unsigned long val;
+	asm volatile ("mov %%cr3,%0" : "=r" (val));
+	return val;
+}
+
+static inline void lcr0(unsigned long val) {
+	asm volatile ("mov %0,%%cr0" : : "r" (val));
+}
+
+static inline unsigned long rcr0(void) {
+	unsigned long val;
+	asm volatile ("mov %%cr0,%0" : "=r" (val));
+	return val;
+}
+
+static inline void clts(void) {
+	asm volatile ("clts");
+}
+
+static inline void lcr4(unsigned long val) {
+	asm volatile ("mov %0,%%cr4" : : "r" (val));
+}
+
+static inline unsigned long rcr4(void) {
+	unsigned long val;
+	asm volatile ("mov %%cr4,%0" : "=r" (val));
+	return val;
+}
+
+static inline void invlpg(void *addr) {
+	asm volatile ("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
 static inline void amd64_cpuid(unsigned int ax, unsigned int *p) {
 	asm volatile ("cpuid"
 	              : "=a" (p[0]), "=b" (p[1]), "=c" (p[2]), "=d" (p[3])
 	              :  "0" (ax));
 }
 
+// cpuid of a leaf with subleaves, like 7.
+static inline void amd64_cpuidcount(unsigned int ax, unsigned int cx, unsigned int *p) {
+	asm volatile ("cpuid"
+	              : "=a" (p[0]), "=b" (p[1]), "=c" (p[2]), "=d" (p[3])
+	              :  "0" (ax), "2" (cx));
+}
+
 // lie about some register names in 64bit mode to avoid
 // clunky ifdefs in proc.c and trap.c.
 struct trapframe {
@@ -167,8 +167,135 @@ static int acpi_config_smp(struct acpi_madt* madt) {
 	return -1;
 }
 
+// NUMA topology. Proximity domains from the SRAT are numbered
+// densely as nodes in the order they are first seen; machines
+// without an SRAT have a single node 0.
+#define NNUMARANGE 32
+
+static struct {
+	uint64 start;
+	uint64 end;
+	uchar node;
+} numaranges[NNUMARANGE];
+static int nnumaranges;
+static uint32 nodepxm[NNUMA];    // proximity domain of each node
+static int nnodes;
+static uchar nodedist[NNUMA][NNUMA];
+static int haveslit;
+
+// Node for proximity domain pxm, numbering it if it is new
+// and add is set. Returns -1 if it has no node.
+static int pxmnode(uint32 pxm, int add){
+	int i;
+
+	for (i = 0; i < nnodes; i++)
+		if (nodepxm[i] == pxm)
+			return i;
+	if (!add)
+		return -1;
+	if (nnodes == NNUMA) {
+		cprintf("acpi: more than %d numa nodes, folding into node 0\n", NNUMA);
+		return 0;
+	}
+	nodepxm[nnodes] = pxm;
+	return nnodes++;
+}
+
+static void acpi_cpunode(uint32 apicid, uint32 pxm){
+	int node = pxmnode(pxm, 1);
+
+	for (int i = 0; i < ncpu; i++)
+		if (cpus[i].apicid == apicid)
+			cpus[i].node = node;
+}
+
+static void acpi_config_numa(struct acpi_srat* srat, struct acpi_slit* slit){
+	uchar* p, * e;
+
+	if (!srat || srat->header.length < sizeof(struct acpi_srat))
+		return;
+
+	p = srat->table;
+	e = p + srat->header.length - sizeof(struct acpi_srat);
+	while (p < e) {
+		uint len;
+		if ((e - p) < 2)
+			break;
+		len = p[1];
+		if (len < 2 || (e - p) < len)
+			break;
+		switch (p[0]) {
+		case TYPE_SRAT_LAPIC: {
+			struct srat_lapic* l = (void*)p;
+			if (len < sizeof(*l) || !(l->flags & SRAT_ENABLED))
+				break;
+			acpi_cpunode(l->apic_id, l->proximity_lo | l->proximity_hi[0] << 8 |
+			             l->proximity_hi[1] << 16 | l->proximity_hi[2] << 24);
+			break;
+		}
+		case TYPE_SRAT_X2APIC: {
+			struct srat_x2apic* x = (void*)p;
+			if (len < sizeof(*x) || !(x->flags & SRAT_ENABLED))
+				break;
+			acpi_cpunode(x->x2apic_id, x->proximity);
+			break;
+		}
+		case TYPE_SRAT_MEM: {
+			struct srat_mem* m = (void*)p;
+			if (len < sizeof(*m) || !(m->flags & SRAT_ENABLED) || m->len == 0)
+				break;
+			if (nnumaranges == NNUMARANGE)
+				break;
+			numaranges[nnumaranges].start = m->base;
+			numaranges[nnumaranges].end = m->base + m->len;
+			numaranges[nnumaranges].node = pxmnode(m->proximity, 1);
+			cprintf("acpi: node %d memory %p - %p\n", numaranges[nnumaranges].node,
+			        m->base, m->base + m->len);
+			nnumaranges++;
+			break;
+		}
+		}
+		p += len;
+	}
+
+	if (slit && slit->header.length >= sizeof(struct acpi_slit) +
+	    slit->nlocalities * slit->nlocalities) {
+		uint64 n = slit->nlocalities;
+		for (uint64 i = 0; i < n; i++) {
+			for (uint64 j = 0; j < n; j++) {
+				int a = pxmnode(i, 0), b = pxmnode(j, 0);
+				if (a >= 0 && b >= 0)
+					nodedist[a][b] = slit->entry[i * n + j];
+			}
+		}
+		haveslit = 1;
+	}
+	if (nnodes > 1)
+		cprintf("acpi: %d numa nodes\n", nnodes);
+}
+
+// Number of NUMA nodes.
+int numanodes(void){
+	return nnodes > 0 ? nnodes : 1;
+}
+
+// NUMA node holding physical address pa; 0 if unknown.
+int numanode(uint64 pa){
+	for (int i = 0; i < nnumaranges; i++)
+		if (pa >= numaranges[i].start && pa < numaranges[i].end)
+			return numaranges[i].node;
+	return 0;
+}
+
+// Relative distance from node a to node b, 10 being local.
+int numadistance(int a, int b){
+	if (haveslit && nodedist[a][b])
+		return nodedist[a][b];
+	return a == b ? 10 : 20;
+}
+
 #if X64
-#define PHYSLIMIT 0x80000000
+#define PHYSLIMIT 0xFFFFFFFF
 #else
 #define PHYSLIMIT 0x0E000000
 #endif
@@ -178,6 +305,8 @@ int acpiinit(void) {
 	struct acpi_rdsp* rdsp;
 	struct acpi_rsdt* rsdt;
 	struct acpi_madt* madt = 0;
+	struct acpi_srat* srat = 0;
+	struct acpi_slit* slit = 0;
 
 	rdsp = find_rdsp();
 	if (rdsp->rsdt_addr_phys > PHYSLIMIT)
@@ -200,9 +329,16 @@ int acpiinit(void) {
 #endif
 		if (!memcmp(hdr->signature, SIG_MADT, 4))
 			madt = (void*)hdr;
+		if (!memcmp(hdr->signature, SIG_SRAT, 4))
+			srat = (void*)hdr;
+		if (!memcmp(hdr->signature, SIG_SLIT, 4))
+			slit = (void*)hdr;
 	}
 
-	return acpi_config_smp(madt);
+	if (acpi_config_smp(madt) < 0)
+		return -1;
+	acpi_config_numa(srat, slit);
+	return 0;
 
 notmapped:
 	cprintf("acpi: tables above 0x%x not mapped.\n", PHYSLIMIT);
@@ -1,13 +1,26 @@
 #include "ahci.h"
+#include "pci.h"
 #include "types.h"
 #include "defs.h"
 #include "buf.h"
 #include "x86.h"
 #include "kernel/string.h"
 #include "memlayout.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "ktimer.h"
 
 //AHCI implementation.
 //See Intel reference docs @ https://www.intel.com/content/dam/www/public/us/en/documents/technical-specifications/serial-ata-ahci-spec-rev1-3-1.pdf
+//
+//Once a controller's interrupt is hooked up, a process issuing a
+//command sleeps until ahciintr() sees it complete, with a one-tick
+//timer as a backstop against lost interrupts. Commands issued
+//before there are processes (or with no usable interrupt line)
+//are polled.
 
 static const struct {
 	uint16 vendor;
@@ -23,37 +36,112 @@ static const struct {
 	{0, 0, ""} //this is a terminal node - this must be present and the last entry
 };
 
+// Driver state for a port with a disk on it.
+struct ahci_port {
+	HBA_PORT *regs;
+	struct spinlock lock;  // protects busy and is
+	uint32 busy;           // command slots in use
+	uint32 is;             // interrupt status collected since the port went idle
+	int intr;              // completions arrive by interrupt
+	int ncq;               // queue reads and writes with FPDMA commands
+	int nslots;            // command slots to use
+};
+
+// A controller and the ports on it.
+struct ahci_ctlr {
+	HBA_MEM *hba;
+	int irq;               // -1 if none
+	struct ahci_port ports[32];
+};
+
+#define AHCI_MAX_CTLR 4
+
 extern uint64 ROOT_DEV;
 static uint32 sataDeviceCount = 0;
-static HBA_PORT* BLOCK_DEVICES[AHCI_MAX_SLOT];
+static struct ahci_port* BLOCK_DEVICES[AHCI_MAX_SLOT];
+static struct ahci_ctlr ctlrs[AHCI_MAX_CTLR];
+static int nctlr;
 
 #define SATA_IO_MAX_WAIT 10000
 
-static inline uint8 wait_for_sata_command(HBA_PORT *port, int32 slot) {
-	// Wait for completion
-	while (1) {
-		amd64_nop();
-		if ((port->ci & (1<<slot)) == 0) {
-			break;
-		}
-		if ((port->is & HBA_PxIS_ERR_MASK) > 0) {
-			break;
-		}
+// Move the port's pending interrupt status into ap->is,
+// acknowledging it. Must hold ap->lock.
+static void ahci_collect(struct ahci_port *ap) {
+	uint32 is = ap->regs->is;
+	if (is) {
+		ap->regs->is = is;
+		ap->is |= is;
 	}
-	if ((port->is & HBA_PxIS_IFS) == HBA_PxIS_IFS) {
+}
+
+static uint8 ahci_status(uint32 is) {
+	if ((is & HBA_PxIS_IFS) == HBA_PxIS_IFS) {
 		return SATA_IO_ERROR_CRC_ERR;
 	}
-	if ((port->is & HBA_PxIS_HBDS) == HBA_PxIS_HBDS) {
+	if ((is & HBA_PxIS_HBDS) == HBA_PxIS_HBDS) {
 		return SATA_IO_HBA_DATA_ERR;
 	}
-	if ((port->is & HBA_PxIS_HBFS) == HBA_PxIS_HBFS) {
+	if ((is & HBA_PxIS_HBFS) == HBA_PxIS_HBFS) {
 		return SATA_IO_HBA_HOST_BUS_ERR;
 	}
 
-	return (port->is & HBA_PxIS_TFES) == HBA_PxIS_TFES ? SATA_IO_ERROR_TASK_ERR : SATA_IO_SUCCESS;
+	return (is & HBA_PxIS_TFES) == HBA_PxIS_TFES ? SATA_IO_ERROR_TASK_ERR : SATA_IO_SUCCESS;
 }
 
-void ahci_try_setup_device(uint16 bus, uint16 slot, uint16 func) {
+// Wait for the command in slot to finish or the port to report an
+// error, sleeping if we can. Must hold ap->lock.
+static uint8 wait_for_sata_command(struct ahci_port *ap, int32 slot) {
+	struct ktimer t;
+	int slept = 0;
+
+	memset(&t, 0, sizeof(t));
+	while (1) {
+		ahci_collect(ap);
+		if (((ap->regs->ci | ap->regs->sact) & (1<<slot)) == 0) {
+			break;
+		}
+		if ((ap->is & HBA_PxIS_ERR_MASK) > 0) {
+			break;
+		}
+		if (ap->intr && proc) {
+			ktimerset(&t, ticks + 1, wakeup, ap);
+			sleep(ap, &ap->lock);
+			slept = 1;
+		} else {
+			amd64_nop();
+		}
+	}
+	if (slept)
+		ktimercancel(&t);
+	return ahci_status(ap->is);
+}
+
+// Interrupt handler for every controller on irq.
+static void ahciintr(uint16 irq) {
+	for (int c = 0; c < nctlr; c++) {
+		struct ahci_ctlr *ctlr = &ctlrs[c];
+		uint32 pending;
+
+		if (ctlr->irq != irq)
+			continue;
+		// Interrupts are routed edge-triggered, so keep going
+		// until the controller has nothing left to report.
+		while ((pending = ctlr->hba->is) != 0) {
+			for (int i = 0; i < 32; i++) {
+				struct ahci_port *ap = &ctlr->ports[i];
+				if ((pending & (1 << i)) == 0 || ap->regs == 0)
+					continue;
+				acquire(&ap->lock);
+				ahci_collect(ap);
+				wakeup(ap);
+				release(&ap->lock);
+			}
+			ctlr->hba->is = pending;
+		}
+	}
+}
+
+void ahci_try_setup_device(uint16 bus, uint16 slot, uint16 func, struct pci_func *f) {
 	uint16 vendor = ahci_probe(bus, slot, func, AHCI_VENDOR_OFFSET);
 	uint16 device = ahci_probe(bus, slot, func, AHCI_DEVICE_OFFSET);
 
@@ -71,15 +159,24 @@ void ahci_try_setup_device(uint16 bus, uint16 slot, uint16 func) {
 			}
 		}
 		if(identified) {
-			ahci_try_setup_known_device((char *)name, ahci_base_mem, bus, slot, func);
+			ahci_try_setup_known_device((char *)name, ahci_base_mem, bus, slot, func, f);
 		}
 	}
 }
 
-void ahci_try_setup_known_device(char *dev_name, uint64 ahci_base_mem, uint16 bus, uint16 slot, uint16 func) {
+void ahci_try_setup_known_device(char *dev_name, uint64 ahci_base_mem, uint16 bus, uint16 slot, uint16 func, struct pci_func *f) {
 	cprintf("%s controller found (bus=%d, slot=%d, func=%d, abar=0x%x)\n", dev_name, bus, slot, func, ahci_base_mem);
 
+	if (nctlr == AHCI_MAX_CTLR) {
+		cprintf("   too many AHCI controllers, ignoring\n");
+		return;
+	}
+	struct ahci_ctlr *ctlr = &ctlrs[nctlr++];
 	HBA_MEM *ptr = (HBA_MEM *)IO2V(ahci_base_mem);
+	ctlr->hba = ptr;
+	ctlr->irq = ahci_read(bus, slot, func, AHCI_INTERRUPT_OFFSET) & 0xFF;
+	if (ctlr->irq == 0 || ctlr->irq >= IRQ_ERROR)
+		ctlr->irq = -1;
 	cprintf("   HBA in ");
 	if(ptr->ghc == 0x0) {
 		cprintf("legacy mode\n");
@@ -116,10 +213,35 @@ void ahci_try_setup_known_device(char *dev_name, uint64 ahci_base_mem, uint16 bu
 				cprintf("SATA device detected:\n");
 				cprintf("   port[%d].sig = %x\n", i, hba_port->sig);
 				cprintf("   ipm=%x, spd=%x, det=%x\n", ipm, spd, det);
-				ahci_sata_init(hba_port, i);
+				uint64 t = rdtsc();
+				ahci_sata_init(ctlr, hba_port, i);
+				bootprobe("ahci port", i, t);
 			}
 		}
 	}
+
+	// A message-signalled vector of its own beats the INTx line.
+	int msi = pci_msi_vector(f, ahciintr, 0);
+	if (msi >= 0) {
+		cprintf("   MSI\n");
+		ctlr->irq = msi;
+	} else if (ctlr->irq < 0) {
+		cprintf("   no interrupt line, polling\n");
+		return;
+	} else {
+		irq_register_handler(ctlr->irq, ahciintr);
+		picenable(ctlr->irq);
+		ioapicenable(ctlr->irq, 0);
+	}
+	ptr->ghc |= AHCI_GHC_IE;
+	for (int i = 0; i < 32; i++) {
+		struct ahci_port *ap = &ctlr->ports[i];
+		if (ap->regs) {
+			acquire(&ap->lock);
+			ap->intr = 1;
+			release(&ap->lock);
+		}
+	}
 }
 
 ushort ahci_probe(ushort bus, ushort slot, uint16 func, ushort offset){
@@ -174,10 +296,10 @@ void ahci_write8(ushort bus, ushort slot,ushort func, ushort offset, uint8 data)
 	amd64_out32(AHCI_HBA_PORT, address);
 }
 
-int32 ahci_find_cmdslot(HBA_PORT *port) {
-	// If not set in SACT and CI, the slot is free
-	uint32 slots = (port->sact | port->ci);
-	for (int32 i=0; i<AHCI_MAX_SLOT; i++) {
+int32 ahci_find_cmdslot(struct ahci_port *ap) {
+	// If not set in SACT and CI, or handed out, the slot is free
+	uint32 slots = (ap->regs->sact | ap->regs->ci | ap->busy);
+	for (int32 i=0; i<ap->nslots; i++) {
 		if ((slots&1) == 0)
 			return i;
 		slots >>= 1;
@@ -190,184 +312,227 @@ uint32 sata_device_count() {
 }
 
 int sata_read(uint32 dev, uint64 lba, uint32 count, uint8 *buf) {
-	if( dev >= AHCI_MAX_SLOT) {
-		return SATA_IO_ERROR_DEV_GT_MAX_SLOT;
-	}
-	HBA_PORT *port = BLOCK_DEVICES[dev];
-	if(!port) {
-		return SATA_IO_ERROR_NO_PORT;
-	}
-	uint32 lbal = (uint32)lba;
-	uint32 lbah = (uint32)(lba >> 32);
-	return ahci_sata_read(port, lbal, lbah, count, buf);
+	struct sata_sg sg = { buf, count * 512 };
+	return sata_readv(dev, lba, &sg, 1);
 }
 
-int ahci_sata_read(HBA_PORT *port, uint32 startl, uint32 starth, uint32 count, uint8 *buf) {
-	port->is = (uint32) -1; // Clear pending interrupt bits
-	int spin = 0; // Spin lock timeout counter
-	int32 slot = ahci_find_cmdslot(port);
-	if (slot == -1)
-		return SATA_IO_ERROR_NO_SLOT;
-
-	HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER*) P2V(
-		HILO2ADDR(port->clbu, port->clb)
-		);
-	cmdheader += slot;
-	cmdheader->cfl = sizeof(FIS_REG_H2D)/sizeof(uint32); // Command FIS size
-	cmdheader->w = 0; // Read from device
-	cmdheader->prdtl = (uint16)((count-1)>>4) + 1; // PRDT entries count
-
-	HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*) P2V(
-		HILO2ADDR(cmdheader->ctbau, cmdheader->ctba)
-		);
-	// cprintf("cmdtbl: %x, cmdheader: %x, prdtl: %x, ctbau: %x, ctba: %x, slot: %d\n", cmdtbl, cmdheader, cmdheader->prdtl, cmdheader->ctbau, cmdheader->ctba, slot);
-
-	memset(cmdtbl, 0, sizeof(HBA_CMD_TBL) +
-	       (cmdheader->prdtl-1)*sizeof(HBA_PRDT_ENTRY));
-
-	// 8K bytes (16 sectors) per PRDT
-	uint64 addr = V2P(buf);
-	if (addr & 0x1) {
-		panic("SATA CBA address not word aligned.");
-	}
-	int i;
-	for (i=0; i < cmdheader->prdtl - 1; i++) {
-		panic("Unsupported read request - only single sector reads are supported.");
-		cmdtbl->prdt_entry[i].dba = ADDRLO(addr);
-		cmdtbl->prdt_entry[i].dbau = ADDRHI(addr);
-		cmdtbl->prdt_entry[i].dbc = 8*1024-1;   // 8K bytes (this value should always be set to 1 less than the actual value)
-		cmdtbl->prdt_entry[i].i = 1;
-		buf += 4*1024;  // 4K words
-		count -= 16;    // 16 sectors
-	}
-	// Last entry
-	cmdtbl->prdt_entry[i].dba = ADDRLO(addr);
-	cmdtbl->prdt_entry[i].dbau = ADDRHI(addr);
-	cmdtbl->prdt_entry[i].dbc = 511; // 512 bytes per sector, 0-based. So 0 means 1, 1 means 2, etc.
-	cmdtbl->prdt_entry[i].i = 1;
+int sata_write(uint32 dev, uint64 lba, uint32 count, uint8 *buf) {
+	struct sata_sg sg = { buf, count * 512 };
+	return sata_writev(dev, lba, &sg, 1);
+}
 
-	// Setup command
-	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&cmdtbl->cfis);
+int sata_readv(uint32 dev, uint64 lba, struct sata_sg *sg, int nsg) {
+	struct ahci_port *port;
 
-	cmdfis->fis_type = FIS_TYPE_REG_H2D;
-	cmdfis->c = 1; // Command
-	cmdfis->command = ATA_CMD_READ_DMA_EX;
+	if (dev >= AHCI_MAX_SLOT)
+		return SATA_IO_ERROR_DEV_GT_MAX_SLOT;
+	if ((port = BLOCK_DEVICES[dev]) == 0)
+		return SATA_IO_ERROR_NO_PORT;
+	return ahci_sata_rw(port, lba, sg, nsg, 0);
+}
 
+int sata_writev(uint32 dev, uint64 lba, struct sata_sg *sg, int nsg) {
+	struct ahci_port *port;
 
-	cmdfis->lba0 = (uint8)startl;
-	cmdfis->lba1 = (uint8)(startl>>8);
-	cmdfis->lba2 = (uint8)(startl>>16);
-	cmdfis->device = 1<<6; // LBA mode
+	if (dev >= AHCI_MAX_SLOT)
+		return SATA_IO_ERROR_DEV_GT_MAX_SLOT;
+	if ((port = BLOCK_DEVICES[dev]) == 0)
+		return SATA_IO_ERROR_NO_PORT;
+	return ahci_sata_rw(port, lba, sg, nsg, 1);
+}
 
-	cmdfis->lba3 = (uint8)(startl>>24);
-	cmdfis->lba4 = (uint8)starth;
-	cmdfis->lba5 = (uint8)(starth>>8);
+int ahci_sata_read(struct ahci_port *port, uint32 startl, uint32 starth, uint32 count, uint8 *buf) {
+	struct sata_sg sg = { buf, count * 512 };
+	return ahci_sata_rw(port, HILO2ADDR(starth, startl), &sg, 1, 0);
+}
 
-	cmdfis->countl = count & 0xFF;
-	cmdfis->counth = (count >> 8) & 0xFF;
+int ahci_sata_write(struct ahci_port *port, uint32 startl, uint32 starth, uint32 count, uint8 *buf) {
+	struct sata_sg sg = { buf, count * 512 };
+	return ahci_sata_rw(port, HILO2ADDR(starth, startl), &sg, 1, 1);
+}
 
-	// The below loop waits until the port is no longer busy before issuing a new command
-	while ((port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < SATA_IO_MAX_WAIT) {
-		spin++;
-	}
-	if (spin == SATA_IO_MAX_WAIT) {
-		return SATA_IO_ERROR_HUNG_PORT;
+// Fill the command table's PRDT from a scatter-gather list,
+// splitting segments at the 4MB an entry can describe.
+// Returns the number of entries, or -1 if the list does not fit.
+static int ahci_fill_prdt(HBA_CMD_TBL *cmdtbl, struct sata_sg *sg, int nsg, uint32 *bytes) {
+	int n = 0;
+
+	*bytes = 0;
+	for (int i = 0; i < nsg; i++) {
+		uint64 addr = V2P(sg[i].buf);
+		uint32 len = sg[i].len;
+		if ((addr & 0x1) || (len & 0x1) || len == 0)
+			panic("SATA PRDT segment not word aligned.");
+		*bytes += len;
+		while (len > 0) {
+			uint32 chunk = len < AHCI_PRDT_MAXBYTES ? len : AHCI_PRDT_MAXBYTES;
+			if (n == AHCI_MAX_PRDT)
+				return -1;
+			cmdtbl->prdt_entry[n].dba = ADDRLO(addr);
+			cmdtbl->prdt_entry[n].dbau = ADDRHI(addr);
+			cmdtbl->prdt_entry[n].dbc = chunk - 1; // byte count, 0-based. So 0 means 1, 1 means 2, etc.
+			cmdtbl->prdt_entry[n].rsv0 = 0;
+			cmdtbl->prdt_entry[n].rsv1 = 0;
+			cmdtbl->prdt_entry[n].i = 0;
+			addr += chunk;
+			len -= chunk;
+			n++;
+		}
 	}
-
-	port->ci = 1<<slot; // Issue command
-
-	return wait_for_sata_command(port, slot);
+	if (n > 0)
+		cmdtbl->prdt_entry[n-1].i = 1;
+	return n;
 }
 
-
-int sata_write(uint32 dev, uint64 lba, uint32 count, uint8 *buf) {
-	if( dev >= AHCI_MAX_SLOT) {
-		return SATA_IO_ERROR_DEV_GT_MAX_SLOT;
-	}
-	HBA_PORT *port = BLOCK_DEVICES[dev];
-	if(!port) {
-		return SATA_IO_ERROR_NO_PORT;
+// Wait for the port's state to change. Must hold ap->lock.
+static void ahci_block(struct ahci_port *ap) {
+	if (ap->intr && proc) {
+		sleep(ap, &ap->lock);
+	} else {
+		release(&ap->lock);
+		amd64_nop();
+		acquire(&ap->lock);
 	}
-	uint32 lbal = (uint32)lba;
-	uint32 lbah = (uint32)(lba >> 32);
-	return ahci_sata_write(port, lbal, lbah, count, buf);
 }
 
+// After an error the port stops processing commands; once every
+// command caught up in it has given up, restart it.
+// Must hold ap->lock.
+static void ahci_recover(struct ahci_port *ap) {
+	ahci_stop_port(ap->regs);
+	ap->regs->serr = (uint32) -1;
+	ahci_start_port(ap->regs);
+	ap->is = 0;
+}
 
-int ahci_sata_write(HBA_PORT *port, uint32 startl, uint32 starth, uint32 count, uint8 *buf) {
-    port->is = (uint32) -1;
+// Issue command on lba with the buffers in sg and wait for it.
+// NCQ commands share the port with up to nslots others; anything
+// else has the port to itself.
+static int ahci_exec(struct ahci_port *ap, uint8 command, uint64 lba, struct sata_sg *sg, int nsg, int write) {
+	HBA_PORT *port = ap->regs;
+	int queued = command == ATA_CMD_READ_FPDMA || command == ATA_CMD_WRITE_FPDMA;
 	int spin = 0; // Spin lock timeout counter
-
-    int32 slot = ahci_find_cmdslot(port);
-	if (slot == -1)
-		return SATA_IO_ERROR_NO_SLOT;
+	uint32 bytes, count;
+	int32 slot;
+	int r;
+
+	acquire(&ap->lock);
+	for (;;) {
+		if (ap->busy == 0) {
+			if (ap->is & HBA_PxIS_ERR_MASK)
+				ahci_recover(ap);
+			port->is = (uint32) -1; // Clear pending interrupt bits
+			ap->is = 0;
+		}
+		if ((ap->is & HBA_PxIS_ERR_MASK) == 0 && (queued || ap->busy == 0) &&
+		    (slot = ahci_find_cmdslot(ap)) != -1)
+			break;
+		ahci_block(ap);
+	}
+	ap->busy |= 1 << slot;
 
 	HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER*) P2V(
 		HILO2ADDR(port->clbu, port->clb)
 		);
-
-    cmdheader += slot;
-
-    cmdheader->cfl = sizeof(FIS_REG_H2D)/sizeof(uint32); // Command FIS size
-    cmdheader->w = 1; // Write to device
-    cmdheader->c = 1;
-    cmdheader->prdtl = 1;    // PRDT entries count
+	cmdheader += slot;
+	cmdheader->cfl = sizeof(FIS_REG_H2D)/sizeof(uint32); // Command FIS size
+	cmdheader->w = write; // 1: write to device, 0: read from device
+	cmdheader->c = write && !queued;
 
 	HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*) P2V(
 		HILO2ADDR(cmdheader->ctbau, cmdheader->ctba)
 		);
-	memset(cmdtbl, 0, sizeof(HBA_CMD_TBL) +
-	       (cmdheader->prdtl-1)*sizeof(HBA_PRDT_ENTRY));
+	memset(cmdtbl, 0, sizeof(HBA_CMD_TBL));
 
-	uint64 addr = V2P(buf);
-	if (addr & 0x1) {
-		panic("SATA CBA address not word aligned.");
-	}
-	cmdtbl->prdt_entry[0].dba = ADDRLO(addr);
-	cmdtbl->prdt_entry[0].dbau = ADDRHI(addr);
-	cmdtbl->prdt_entry[0].dbc = 511; // 512 bytes per sector
-	cmdtbl->prdt_entry[0].i = 0;
-
-    // Setup command
-    FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&cmdtbl->cfis);
+	int n = ahci_fill_prdt(cmdtbl, sg, nsg, &bytes);
+	if (n <= 0 || bytes % 512 || bytes / 512 > AHCI_MAX_SECT)
+		panic("ahci_exec: bad transfer");
+	cmdheader->prdtl = n; // PRDT entries count
+	count = bytes / 512;
 
-    cmdfis->fis_type = FIS_TYPE_REG_H2D;
-    cmdfis->c = 1;  // Command
-    cmdfis->command = ATA_CMD_WRITE_DMA_EXT;
+	// Setup command
+	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&cmdtbl->cfis);
 
-    cmdfis->lba0 = (uint8)startl;
-    cmdfis->lba1 = (uint8)(startl>>8);
-    cmdfis->lba2 = (uint8)(startl>>16);
-    cmdfis->device = 1<<6;  // LBA mode
+	cmdfis->fis_type = FIS_TYPE_REG_H2D;
+	cmdfis->c = 1; // Command
+	cmdfis->command = command;
 
-    cmdfis->lba3 = (uint8)(startl>>24);
-    cmdfis->lba4 = (uint8)starth;
-    cmdfis->lba5 = (uint8)(starth>>8);
+	cmdfis->lba0 = (uint8)lba;
+	cmdfis->lba1 = (uint8)(lba>>8);
+	cmdfis->lba2 = (uint8)(lba>>16);
+	cmdfis->device = 1<<6; // LBA mode
 
-    cmdfis->countl = 2;
-    cmdfis->counth = 0;
+	cmdfis->lba3 = (uint8)(lba>>24);
+	cmdfis->lba4 = (uint8)(lba>>32);
+	cmdfis->lba5 = (uint8)(lba>>40);
+
+	if (queued) {
+		// FPDMA commands carry the count in the feature
+		// register and the tag in the count register.
+		cmdfis->featurel = count & 0xFF;
+		cmdfis->featureh = (count >> 8) & 0xFF;
+		cmdfis->countl = slot << 3;
+		cmdfis->counth = 0;
+	} else {
+		cmdfis->countl = count & 0xFF;
+		cmdfis->counth = (count >> 8) & 0xFF;
+	}
 
-	// The below loop waits until the port is no longer busy before issuing a new command
-	while ((port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < SATA_IO_MAX_WAIT) {
+	// With nothing else in flight, wait until the port is no longer busy before issuing a new command
+	while ((ap->busy & ~(1 << slot)) == 0 && (port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < SATA_IO_MAX_WAIT) {
 		spin++;
 	}
 	if (spin == SATA_IO_MAX_WAIT) {
-		return SATA_IO_ERROR_HUNG_PORT;
+		r = SATA_IO_ERROR_HUNG_PORT;
+	} else {
+		if (queued)
+			port->sact = 1<<slot;
+		port->ci = 1<<slot; // Issue command
+		r = wait_for_sata_command(ap, slot);
 	}
 
-    port->ci = 1<<slot; // Issue command
+	ap->busy &= ~(1 << slot);
+	wakeup(ap);
+	release(&ap->lock);
+	return r;
+}
+
+// Transfer between the sectors starting at lba and the buffers
+// in sg, in order, as a single command.
+int ahci_sata_rw(struct ahci_port *ap, uint64 lba, struct sata_sg *sg, int nsg, int write) {
+	uint8 command;
 
-	return wait_for_sata_command(port, slot);
+	if (ap->ncq)
+		command = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+	else
+		command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EX;
+	return ahci_exec(ap, command, lba, sg, nsg, write);
 }
 
-void ahci_sata_init(HBA_PORT *port, int num){
+void ahci_sata_init(struct ahci_ctlr *ctlr, HBA_PORT *port, int num){
 	if(ahci_rebase_port(port,num) > 0) {
+		struct ahci_port *ap = &ctlr->ports[num];
 		uint8 buf[512];
-		int result = ahci_sata_read(port, 0, 0, 1, &buf[0]);
+		struct sata_sg sg = { buf, sizeof(buf) };
+		initlock(&ap->lock, "ahci");
+		ap->regs = port;
+		ap->nslots = AHCI_CAP_NCS(ctlr->hba->cap);
+
+		// Queue commands if both the controller and the disk can.
+		if (ahci_exec(ap, ATA_CMD_IDENTIFY, 0, &sg, 1, 0) == SATA_IO_SUCCESS &&
+		    (ctlr->hba->cap & AHCI_CAP_SNCQ) && (((uint16*)buf)[ATA_IDENT_SATACAP] & ATA_SATACAP_NCQ)) {
+			int depth = (((uint16*)buf)[ATA_IDENT_QDEPTH] & 0x1F) + 1;
+			if (depth < ap->nslots)
+				ap->nslots = depth;
+			ap->ncq = 1;
+			cprintf("   NCQ, %d commands deep\n", ap->nslots);
+		}
+
+		int result = ahci_sata_read(ap, 0, 0, 1, &buf[0]);
 		if(result == SATA_IO_SUCCESS) {
 			uint32 devNum = sataDeviceCount++;
 			cprintf("   Init success: disk(%d, %d)\n", DEV_SATA, devNum);
-			BLOCK_DEVICES[devNum] = port;
+			BLOCK_DEVICES[devNum] = ap;
 			if(devNum == 0){
 				ROOT_DEV = TODEVNUM(DEV_SATA, 0);
 			}
@@ -406,15 +571,13 @@ int8 ahci_rebase_port(HBA_PORT *port, int num) {
 	HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER *) addr;
 
 	for (uint8 i = 0; i < 32; i++) {
-		cmdheader[i].prdtl = 8; // 8 prdt entries per command table
-		                        // 256 bytes per command table, 64+16+48+16*8
-		                        // Command table offset: 40K + 8K*portno + cmdheader_index*256
-		cmdheader[i].ctba = (((uint64) ahciBase
-		                      + (uint64) ((40 << 10) / 8) + (uint64) ((i << 8) / 8))
-		                     & 0xffffffff);
-		cmdheader[i].ctbau =
-			((((uint64) ahciBase + (uint64) ((40 << 10) / 8)
-			   + (uint64) ((i << 8) / 8)) >> 32) & 0xffffffff);
+		// AHCI_MAX_PRDT entries per command table, 128+16*AHCI_MAX_PRDT
+		// bytes each, laid out from 64K into the port's 1MB.
+		uint64 ctbAddr = ahciBase + AHCI_CMDTBL_OFFSET + (uint64)i * AHCI_CMDTBL_SIZE;
+		cmdheader[i].prdtl = 0;
+		cmdheader[i].ctba = ADDRLO(ctbAddr);
+		cmdheader[i].ctbau = ADDRHI(ctbAddr);
+		memset(P2V(ctbAddr), 0, AHCI_CMDTBL_SIZE);
 	}
 
 	ahci_start_port(port);
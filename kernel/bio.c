@@ -1,166 +1,670 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a set of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Buffers are found through a hash table on (dev, sector) with a
+// lock per bucket, so lookups on different CPUs rarely contend.
+// Unreferenced buffers are also on an LRU list, under its own
+// lock, from which bget() takes the one to recycle.
+// Lock order is bucket (lower index first), then lru.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
-// * Only one process at a time can use a buffer,
+// * brelsecold releases one not wanted again soon.
+// * breadn reads nsec sectors, a power of two up to BMAXSECT,
+//     as one block; a given sector must always be read with
+//     the same count.
+// * Only one process at a time can use a buffer from bread,
 //     so do not keep them longer than necessary.
+// * breadshared returns a buffer that others may be reading
+//     at the same time; it must not be modified.
 //
-// The implementation uses three state flags internally:
-// * B_BUSY: the block has been returned from bread
-//     and has not been passed back to brelse.
+// Each buffer has a sleep lock held from bread until brelse,
+// and a reference count that keeps it from being recycled
+// while anyone holds or waits for it. Two state flags:
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+// * B_DELWRI: as well as B_DIRTY, the write has been put off
+//     with bdwrite(); the flusher thread will do it.
+// Buffers changed in a log transaction are pinned (logpin) until
+// log.c has installed them, and are not recycled meanwhile.
+//
+// Delayed writes wait on a dirty list, oldest first. bflusher
+// writes out the ones older than BFLUSH_AGE every BFLUSH_INTERVAL,
+// or all of them if the cache is short of clean buffers, sorted
+// by sector so the request queue can merge them. bsync() writes
+// everything out and waits. Listed buffers are not recycled.
+// Lock order is dirty list, then bucket.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
 #include "buf.h"
-#include "ahci.h"
+#include "mmu.h"
+#include "proc.h"
+#include "slab.h"
+#include "ktimer.h"
+#include "shrinker.h"
 #include "kernel/string.h"
 
-struct {
+#define NBUCKET 61
+#define BPERPAGE (PGSIZE / SECTOR_SIZE)
+#define BMINPAGES ((NBUF + BPERPAGE - 1) / BPERPAGE)
+#define BFLUSH_INTERVAL HZ      // ticks between flusher runs
+#define BFLUSH_AGE (5 * HZ)     // delayed writes older than this go out
+#define BFLUSH_BATCH 32         // buffers written per pass
+
+struct bucket {
 	struct spinlock lock;
-	struct buf buf[NBUF];
+	struct buf* head;     // chain through hnext
+};
+
+// Buffers come a page at a time: BPERPAGE one-sector buffers
+// sharing a page for data, fewer larger ones, or one buffer
+// over several contiguous pages from kmalloc().
+struct bpage {
+	struct buf buf[BPERPAGE];
+	uint nsec;            // sectors in each buffer
+	uint nbuf;            // buffers in buf[] in use
+	uint pages;           // pages at mem
+	char* mem;
+	struct bpage* next;
+};
 
-	// Linked list of all buffers, through prev/next.
+// Counted per cpu so hits on different buckets don't share
+// a line; bcachestat() adds them up.
+struct bcpustat {
+	uint64 hits;
+	uint64 misses;
+	uint64 evictions;
+	uint64 readaheads;
+	uint64 delwri;
+	uint64 flushed;
+} __attribute__((aligned(64)));
+
+struct {
+	struct bucket bucket[NBUCKET];
+
+	// Unreferenced buffers, through prev/next.
 	// head.next is most recently used.
+	struct spinlock lrulock;
 	struct buf head;
+
+	// The pages buffers live in. pagelock comes before
+	// the bucket locks.
+	struct spinlock pagelock;
+	struct bpage* pages;
+	uint npages;
+	uint nbuf;
+	uint spare;           // sectors for unused buffers' hash keys
+	uint64 grows;
+	uint64 shrinks;
+	struct kmem_cache* cache;
+
+	// Buffers with delayed writes, through dnext.
+	struct spinlock dirtylock;
+	struct buf* dirty;
+	struct buf** dirtytail;
+	uint ndirty;
+	int pressure;         // bshrink() found dirty pages it couldn't free
+
+	struct bcpustat stat[NCPU];
 } bcache;
 
-void binit(void){
+static struct bucket* bucketof(uint dev, uint sector){
+	return &bcache.bucket[(dev ^ sector * 2654435761u) % NBUCKET];
+}
+
+static void lruremove(struct buf* b){
+	b->next->prev = b->prev;
+	b->prev->next = b->next;
+	b->next = b->prev = 0;
+}
+
+static void lrupush(struct buf* b){
+	b->next = bcache.head.next;
+	b->prev = &bcache.head;
+	bcache.head.next->prev = b;
+	bcache.head.next = b;
+}
+
+// Add b at the cold end, to be the next one recycled.
+static void lrupushtail(struct buf* b){
+	b->prev = bcache.head.prev;
+	b->next = &bcache.head;
+	bcache.head.prev->next = b;
+	bcache.head.prev = b;
+}
+
+static void hashremove(struct bucket* bk, struct buf* b){
+	struct buf** pp;
+
+	for (pp = &bk->head; *pp != 0; pp = &(*pp)->hnext) {
+		if (*pp == b) {
+			*pp = b->hnext;
+			break;
+		}
+	}
+	b->hnext = 0;
+}
+
+static struct bcpustat* bstat(void){
+	return &bcache.stat[cpu - cpus];
+}
+
+// Most pages the cache may grow to.
+static uint bmaxpages(void){
+	uint max = kmemtotal() / 100 * BCACHE_PCT;
+	return max < BMINPAGES ? BMINPAGES : max;
+}
+
+// Add a page's worth of unused nsec-sector buffers to the cold
+// end of the LRU. Returns 0 if out of memory.
+static int bgrow(uint nsec){
+	struct bpage* bp;
+	struct bucket* bk;
 	struct buf* b;
+	uint pages = nsec > BPERPAGE ? nsec / BPERPAGE : 1;
+	char* mem;
+
+	if ((mem = pages == 1 ? kalloc() : kmalloc(pages)) == 0)
+		return 0;
+	if ((bp = kmem_cache_alloc(bcache.cache)) == 0) {
+		if (pages == 1)
+			kfree(mem);
+		else
+			kmfree(mem, pages);
+		return 0;
+	}
+	memset(bp, 0, sizeof(*bp));
+	bp->mem = mem;
+	bp->pages = pages;
+	bp->nsec = nsec;
+	bp->nbuf = nsec < BPERPAGE ? BPERPAGE / nsec : 1;
+
+	acquire(&bcache.pagelock);
+	bp->next = bcache.pages;
+	bcache.pages = bp;
+	bcache.npages += pages;
+	bcache.nbuf += bp->nbuf;
+	bcache.grows++;
+	for (int i = 0; i < bp->nbuf; i++) {
+		b = &bp->buf[i];
+		initsleeplock(&b->lock, "buffer");
+		b->data = (uint8*)mem + i * nsec * SECTOR_SIZE;
+		b->nsec = nsec;
+		b->dev = -1;
+		b->sector = bcache.spare++;
+		bk = bucketof(b->dev, b->sector);
+		acquire(&bk->lock);
+		b->hnext = bk->head;
+		bk->head = b;
+		acquire(&bcache.lrulock);
+		lrupushtail(b);
+		release(&bcache.lrulock);
+		release(&bk->lock);
+	}
+	release(&bcache.pagelock);
+	return 1;
+}
+
+// Give up to n pages back to kalloc, taking only pages none of
+// whose buffers are in use or waiting to be logged, and never
+// going below BMINPAGES. A shrinker, so it must not allocate.
+// Returns the number of pages freed.
+static int bshrink(int n){
+	struct bpage** pp, * bp;
+	struct bucket* bk;
+	int i, freed = 0;
 
-	initlock(&bcache.lock, "bcache");
+	if (bcache.cache == 0)
+		return 0;
+	acquire(&bcache.pagelock);
+	for (bk = bcache.bucket; bk < &bcache.bucket[NBUCKET]; bk++)
+		acquire(&bk->lock);
+	acquire(&bcache.lrulock);
 
+	for (pp = &bcache.pages; *pp != 0 && freed < n && bcache.npages > BMINPAGES; ) {
+		bp = *pp;
+		for (i = 0; i < bp->nbuf; i++)
+			if (bp->buf[i].refcnt != 0 || (bp->buf[i].flags & B_DIRTY) || bp->buf[i].dlisted ||
+			    bp->buf[i].logpin)
+				break;
+		if (i < bp->nbuf) {
+			if (bp->buf[i].flags & B_DIRTY)
+				bcache.pressure = 1;
+			pp = &bp->next;
+			continue;
+		}
+		for (i = 0; i < bp->nbuf; i++) {
+			struct buf* b = &bp->buf[i];
+			hashremove(bucketof(b->dev, b->sector), b);
+			lruremove(b);
+		}
+		*pp = bp->next;
+		bcache.npages -= bp->pages;
+		bcache.nbuf -= bp->nbuf;
+		bcache.shrinks++;
+		freed += bp->pages;
+		if (bp->pages == 1)
+			kfree(bp->mem);
+		else
+			kmfree(bp->mem, bp->pages);
+		kmem_cache_free(bcache.cache, bp);
+	}
+
+	release(&bcache.lrulock);
+	for (bk = &bcache.bucket[NBUCKET - 1]; bk >= bcache.bucket; bk--)
+		release(&bk->lock);
+	release(&bcache.pagelock);
+	return freed;
+}
+
+static struct shrinker bshrinker = { "bcache", bshrink };
+
+void binit(void){
+	struct bucket* bk;
 
-	// Create linked list of buffers
+	initlock(&bcache.lrulock, "bcache");
+	initlock(&bcache.pagelock, "bcache.pages");
+	initlock(&bcache.dirtylock, "bcache.dirty");
+	bcache.dirtytail = &bcache.dirty;
+	for (bk = bcache.bucket; bk < &bcache.bucket[NBUCKET]; bk++)
+		initlock(&bk->lock, "bcache.bucket");
 	bcache.head.prev = &bcache.head;
 	bcache.head.next = &bcache.head;
-	for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
-		b->next = bcache.head.next;
-		b->prev = &bcache.head;
-		b->dev = -1;
-		bcache.head.next->prev = b;
-		bcache.head.next = b;
-	}
+	bcache.cache = kmem_cache_create("bpage", sizeof(struct bpage), 0);
+
+	// The floor: enough for the log and a few operations.
+	while (bcache.npages < BMINPAGES)
+		if (!bgrow(1))
+			panic("binit");
+	register_shrinker(&bshrinker);
 }
 
-// Look through buffer cache for sector on device dev.
-// If not found, allocate a buffer.
-// In either case, return B_BUSY buffer.
-static struct buf* bget(uint dev, uint sector){
+static struct buf* bfind(struct bucket* bk, uint dev, uint sector){
 	struct buf* b;
 
-	acquire(&bcache.lock);
+	for (b = bk->head; b != 0; b = b->hnext)
+		if (b->dev == dev && b->sector == sector)
+			return b;
+	return 0;
+}
 
-loop:
-	// Is the sector already cached?
-	for (b = bcache.head.next; b != &bcache.head; b = b->next) {
-		if (b->dev == dev && b->sector == sector) {
-			if (!(b->flags & B_BUSY)) {
-				b->flags |= B_BUSY;
-				release(&bcache.lock);
-				return b;
-			}
-			sleep(b, &bcache.lock);
-			goto loop;
-		}
+// Take a reference on b. Must hold b's bucket lock.
+static void bhold(struct buf* b){
+	if (b->refcnt++ == 0) {
+		acquire(&bcache.lrulock);
+		lruremove(b);
+		release(&bcache.lrulock);
+	}
+}
+
+// Look through buffer cache for the nsec-sector block at
+// sector on device dev. If not found, allocate a buffer.
+// In either case, return it referenced but not locked.
+static struct buf* bget(uint dev, uint sector, uint nsec){
+	struct bucket* bk = bucketof(dev, sector), * old;
+	struct buf* b, * hit;
+	int nogrow = 0, same;
+
+	acquire(&bk->lock);
+	if (nsec == 0 || nsec > BMAXSECT || (nsec & (nsec - 1)))
+		panic("bget: bad size");
+	if ((b = bfind(bk, dev, sector)) != 0) {
+		if (b->nsec != nsec)
+			panic("bget: size mismatch");
+		bhold(b);
+		bstat()->hits++;
+		release(&bk->lock);
+		return b;
 	}
+	bstat()->misses++;
+	release(&bk->lock);
+
+	for (;;) {
+		// Not cached; pick the least recently used clean buffer
+		// of the right size. "clean" because a pinned buffer
+		// holds changes log.c hasn't yet installed.
+		acquire(&bcache.lrulock);
+		for (b = bcache.head.prev; b != &bcache.head; b = b->prev)
+			if ((b->flags & B_DIRTY) == 0 && !b->dlisted && !b->logpin && b->nsec == nsec)
+				break;
 
-	// Not cached; recycle some non-busy and clean buffer.
-	// "clean" because B_DIRTY and !B_BUSY means log.c
-	// hasn't yet committed the changes to the buffer.
-	for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-		if ((b->flags & B_BUSY) == 0 && (b->flags & B_DIRTY) == 0) {
+		// Rather than throw away cached data, grow while
+		// there is room; unused buffers are never B_VALID.
+		// With none of this size at all, grow past the limit;
+		// kalloc() will shrink other sizes if it must.
+		if (!nogrow && (b == &bcache.head || ((b->flags & B_VALID) &&
+		    bcache.npages < bmaxpages()))) {
+			release(&bcache.lrulock);
+			if (!bgrow(nsec))
+				nogrow = 1;
+			continue;
+		}
+		if (b == &bcache.head)
+			panic("bget: no buffers");
+		old = bucketof(b->dev, b->sector);
+		release(&bcache.lrulock);
+
+		// Lock both buckets, in order, and check nothing
+		// changed while we held neither.
+		if (old < bk) {
+			acquire(&old->lock);
+			acquire(&bk->lock);
+		} else {
+			acquire(&bk->lock);
+			if (old != bk)
+				acquire(&old->lock);
+		}
+		hit = bfind(bk, dev, sector);
+		if (hit && hit->nsec != nsec)
+			panic("bget: size mismatch");
+		same = hit == 0 && b->refcnt == 0 && (b->flags & B_DIRTY) == 0 && !b->dlisted &&
+		       !b->logpin && bucketof(b->dev, b->sector) == old;
+		if (hit) {
+			bhold(hit);
+			b = hit;
+		} else if (same) {
+			if (b->flags & B_VALID)
+				bstat()->evictions++;
+			hashremove(old, b);
 			b->dev = dev;
 			b->sector = sector;
-			b->flags = B_BUSY;
-			release(&bcache.lock);
-			return b;
+			b->flags = 0;
+			b->hnext = bk->head;
+			bk->head = b;
+			bhold(b);
 		}
+		if (old != bk)
+			release(&old->lock);
+		release(&bk->lock);
+		if (hit || same)
+			return b;
 	}
-	panic("bget: no buffers");
 }
 
-// Return a B_BUSY buf with the contents of the indicated disk sector.
+// Fill b from disk. Must hold b->lock exclusively.
+static void bfill(struct buf* b){
+	bsubmit(b, 0);
+	bwait(b);
+}
+
+// Return a locked buf with the contents of the nsec sectors
+// starting at the indicated disk sector.
+struct buf* breadn(uint dev, uint sector, uint nsec){
+	struct buf* b;
+
+	b = bget(dev, sector, nsec);
+	acquiresleep(&b->lock);
+	if (!(b->flags & B_VALID))
+		bfill(b);
+	return b;
+}
+
 struct buf* bread(uint dev, uint sector){
+	return breadn(dev, sector, 1);
+}
+
+// Return a buf with the contents of the nsec sectors starting
+// at the indicated disk sector, shared with other readers.
+// The caller must not modify it.
+struct buf* breadsharedn(uint dev, uint sector, uint nsec){
 	struct buf* b;
 
-	b = bget(dev, sector);
-	if (!(b->flags & B_VALID)) {
-		uint8 devType = GETDEVTYPE(dev);
-		uint32 devNum = GETDEVNUM(dev);
-
-		if(devType == DEV_IDE) {
-			iderw(b);
-		} else if(devType == DEV_SATA) {
-			int status = sata_read(devNum, sector, 1, &b->data[0]);
-			if(status != SATA_IO_SUCCESS){
-				cprintf("Error reading SATA: %d\n", status);
-				panic("SATA I/O ERROR");
-			}
-			b->flags |= B_VALID;
-			b->flags &= ~B_DIRTY;
-			wakeup(b);
-		} else {
-			panic("Unsupported device type");
-		}
-	}
+	b = bget(dev, sector, nsec);
+	acquiresleepshared(&b->lock);
+	if (b->flags & B_VALID)
+		return b;
+
+	// Not read in yet: fill it exclusively, then let
+	// the readers queued behind us in.
+	releasesleep(&b->lock);
+	acquiresleep(&b->lock);
+	if (!(b->flags & B_VALID))
+		bfill(b);
+	downgradesleep(&b->lock);
 	return b;
 }
 
-// Write b's contents to disk.  Must be B_BUSY.
+struct buf* breadshared(uint dev, uint sector){
+	return breadsharedn(dev, sector, 1);
+}
+
+// Drop a reference taken by bget() without locking the buffer.
+static void bput(struct buf* b){
+	// b can't be rehashed while we hold a reference.
+	struct bucket* bk = bucketof(b->dev, b->sector);
+
+	acquire(&bk->lock);
+	if (--b->refcnt == 0) {
+		acquire(&bcache.lrulock);
+		lrupush(b);
+		release(&bcache.lrulock);
+	}
+	release(&bk->lock);
+}
+
+// Start reading the nsec sectors at sector into the cache, unless
+// they are there already or somebody has the buffer. Does not wait.
+void breada(uint dev, uint sector, uint nsec){
+	struct buf* b;
+
+	b = bget(dev, sector, nsec);
+	if ((b->flags & B_VALID) || !tryacquiresleep(&b->lock)) {
+		bput(b);
+		return;
+	}
+	if (b->flags & B_VALID) {
+		brelse(b);
+		return;
+	}
+	bstat()->readaheads++;
+	bsubmit(b, brelse);
+}
+
+// Write b's contents to disk.  Must be locked by bread.
 void bwrite(struct buf* b){
-	if ((b->flags & B_BUSY) == 0)
+	if (!holdingsleep(&b->lock))
 		panic("bwrite");
 	b->flags |= B_DIRTY;
-	uint8 devType = GETDEVTYPE(b->dev);
-	uint32 devNum = GETDEVNUM(b->dev);
-
-	if(devType == DEV_IDE) {
-		iderw(b);
-	} else {
-		int status = sata_write(devNum, b->sector, 1, &b->data[0]);
-		b->flags |= B_VALID;
-		b->flags &= ~B_DIRTY;
-		wakeup(b);
-		if(status != SATA_IO_SUCCESS){
-			cprintf("Error writing SATA: %d\n", status);
-			panic("SATA I/O ERROR");
+	b->flags &= ~B_DELWRI;
+	bsubmit(b, 0);
+	bwait(b);
+}
+
+// Write b's contents to disk at sector rather than its own.
+// Must hold b locked.
+void bwriteat(struct buf* b, uint sector){
+	struct buf t;
+
+	if (!holdingsleep(&b->lock))
+		panic("bwriteat");
+	memset(&t, 0, sizeof(t));
+	initsleeplock(&t.lock, "bwriteat");
+	acquiresleep(&t.lock);
+	t.dev = b->dev;
+	t.sector = sector;
+	t.nsec = b->nsec;
+	t.data = b->data;
+	t.flags = B_VALID | B_DIRTY;
+	bsubmit(&t, 0);
+	bwait(&t);
+	releasesleep(&t.lock);
+}
+
+// Mark b to be written to disk later, by the flusher or bsync().
+// Without BWRITEBACK, just write it. Must hold b locked.
+void bdwrite(struct buf* b){
+	if (!holdingsleep(&b->lock))
+		panic("bdwrite");
+	if (!BWRITEBACK) {
+		bwrite(b);
+		return;
+	}
+	b->flags |= B_DIRTY | B_DELWRI;
+	bstat()->delwri++;
+	acquire(&bcache.dirtylock);
+	if (!b->dlisted) {
+		b->dlisted = 1;
+		b->dirtied = ticks;
+		b->dnext = 0;
+		*bcache.dirtytail = b;
+		bcache.dirtytail = &b->dnext;
+		bcache.ndirty++;
+	}
+	release(&bcache.dirtylock);
+}
+
+// Take up to BFLUSH_BATCH buffers off the dirty list, referenced,
+// into batch, sorted by device and sector. With all clear, only
+// those dirtied at least BFLUSH_AGE ago. Returns how many.
+static int bdirtytake(struct buf** batch, int all){
+	struct buf* b;
+	struct bucket* bk;
+	int n = 0, i;
+
+	acquire(&bcache.dirtylock);
+	while (n < BFLUSH_BATCH && (b = bcache.dirty) != 0) {
+		if (!all && (int)(ticks - b->dirtied) < BFLUSH_AGE)
+			break;
+		if ((bcache.dirty = b->dnext) == 0)
+			bcache.dirtytail = &bcache.dirty;
+		bcache.ndirty--;
+		// Listed buffers are never rehashed, so b's bucket
+		// holds still until it is referenced.
+		bk = bucketof(b->dev, b->sector);
+		acquire(&bk->lock);
+		bhold(b);
+		release(&bk->lock);
+		b->dlisted = 0;
+		for (i = n++; i > 0 && (batch[i-1]->dev > b->dev ||
+		     (batch[i-1]->dev == b->dev && batch[i-1]->sector > b->sector)); i--)
+			batch[i] = batch[i-1];
+		batch[i] = b;
+	}
+	release(&bcache.dirtylock);
+	return n;
+}
+
+// Write out delayed writes: the old ones, or with all set every
+// one. With wait set, return only once they are on disk.
+// Returns the number written.
+static int bflush(int all, int wait){
+	struct buf* batch[BFLUSH_BATCH];
+	int n, i, total = 0;
+
+	while ((n = bdirtytake(batch, all)) > 0) {
+		for (i = 0; i < n; i++) {
+			struct buf* b = batch[i];
+			acquiresleep(&b->lock);
+			if ((b->flags & B_DELWRI) == 0) {
+				// Written or taken back by the log since.
+				releasesleep(&b->lock);
+				bput(b);
+				batch[i] = 0;
+				continue;
+			}
+			b->flags &= ~B_DELWRI;
+			bsubmit(b, wait ? 0 : brelse);
+			total++;
+		}
+		if (wait) {
+			for (i = 0; i < n; i++) {
+				if (batch[i]) {
+					bwait(batch[i]);
+					brelse(batch[i]);
+				}
+			}
 		}
 	}
+	bstat()->flushed += total;
+	return total;
+}
+
+// Write every delayed write to disk and wait for them.
+void bsync(void){
+	bflush(1, 1);
+}
+
+static void bflusher(void* arg){
+	struct ktimer t;
+	int all;
+
+	memset(&t, 0, sizeof(t));
+	for (;;) {
+		acquire(&tickslock);
+		ktimerset(&t, ticks + BFLUSH_INTERVAL, wakeup, &t);
+		sleep(&t, &tickslock);
+		release(&tickslock);
+
+		all = bcache.pressure || bcache.ndirty > bcache.nbuf / 4;
+		bcache.pressure = 0;
+		bflush(all, 0);
+	}
 }
 
-// Release a B_BUSY buffer.
-// Move to the head of the MRU list.
+// Start the thread that writes back delayed writes.
+void bflushinit(void){
+	if (BWRITEBACK && kthread("bflush", bflusher, 0) < 0)
+		panic("bflushinit");
+}
+
+// Release a buffer from bread or breadshared.
+// Move to the head of the LRU list once nobody holds it.
 void brelse(struct buf* b){
-	if ((b->flags & B_BUSY) == 0)
+	if (!sleeplocked(&b->lock))
 		panic("brelse");
 
-	acquire(&bcache.lock);
+	releasesleep(&b->lock);
+	bput(b);
+}
 
-	b->next->prev = b->prev;
-	b->prev->next = b->next;
-	b->next = bcache.head.next;
-	b->prev = &bcache.head;
-	bcache.head.next->prev = b;
-	bcache.head.next = b;
+// Release a buffer the caller won't want again soon, such as file
+// data kept in the page cache: it goes to the cold end of the LRU
+// list, to be recycled first.
+void brelsecold(struct buf* b){
+	struct bucket* bk;
 
-	b->flags &= ~B_BUSY;
-	wakeup(b);
+	if (!sleeplocked(&b->lock))
+		panic("brelsecold");
 
-	release(&bcache.lock);
+	releasesleep(&b->lock);
+	bk = bucketof(b->dev, b->sector);
+	acquire(&bk->lock);
+	if (--b->refcnt == 0) {
+		acquire(&bcache.lrulock);
+		lrupushtail(b);
+		release(&bcache.lrulock);
+	}
+	release(&bk->lock);
 }
 
+// Copy out the cache's counters, summed over cpus.
+void bcachestat(struct bcachestat* st){
+	memset(st, 0, sizeof(*st));
+	for (int i = 0; i < NCPU; i++) {
+		st->hits += bcache.stat[i].hits;
+		st->misses += bcache.stat[i].misses;
+		st->evictions += bcache.stat[i].evictions;
+		st->readaheads += bcache.stat[i].readaheads;
+		st->delwri += bcache.stat[i].delwri;
+		st->flushed += bcache.stat[i].flushed;
+	}
+	st->ndirty = bcache.ndirty;
+	st->grows = bcache.grows;
+	st->shrinks = bcache.shrinks;
+	st->nbuf = bcache.nbuf;
+	st->pages = bcache.npages;
+	st->maxpages = bmaxpages();
+}
 
 // Blank page.
@@ -0,0 +1,301 @@
+// Block request queue.
+//
+// bio.c hands buffers to bsubmit() instead of calling the disk
+// drivers itself. Each device has a queue of pending buffers kept
+// sorted by sector; a pool of dispatch threads takes requests off
+// the queues and runs them through the driver, so submitters need
+// not wait on the disk.
+//
+// Dispatch goes in one direction across the disk (C-SCAN) from
+// where the last request ended, unless some request has waited
+// past its deadline, in which case the oldest such goes first.
+// Reads expire sooner than writes. The request picked is merged
+// with the ones queued right after it on disk into a single
+// scatter-gather command.
+//
+// Before the scheduler runs there are no threads to wait for, so
+// requests are carried out inline. IDE disks keep the queue and
+// interrupt handling in ide.c and are also driven inline.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "buf.h"
+#include "ahci.h"
+#include "virtio.h"
+#include "nvme.h"
+#include "trace.h"
+
+#define NBLKQ          8     // devices with queues
+#define NBLKWORKER     8     // dispatch threads
+#define BLKQ_MAXMERGE  32    // buffers in one command
+#define BLKQ_MAXSECT   2048  // sectors in one command
+#define READ_EXPIRE    (HZ / 20)   // ticks a read may wait
+#define WRITE_EXPIRE   (HZ / 2)    // and a write
+
+struct blkq {
+	uint dev;
+	int used;
+	struct buf* head;      // pending, by sector
+	uint pos;              // sector after the last dispatched
+	int n;                 // pending
+	uint64 reads;          // for blkqstat()
+	uint64 writes;
+	uint64 rsect;
+	uint64 wsect;
+	uint64 cmds;
+};
+
+static struct {
+	struct spinlock lock;  // protects the queues and B_QUEUED
+	struct blkq q[NBLKQ];
+	int started;           // dispatch threads exist
+	int next;              // queue to look at first
+} blk;
+
+static void blkqworker(void*);
+
+void blkqinit(void){
+	initlock(&blk.lock, "blkq");
+	for (int i = 0; i < NBLKWORKER; i++)
+		if (kthread("blkq", blkqworker, 0) < 0)
+			panic("blkqinit");
+	blk.started = 1;
+}
+
+// Return dev's queue, making one if need be. Must hold blk.lock.
+static struct blkq* queueof(uint dev){
+	struct blkq* free = 0;
+
+	for (int i = 0; i < NBLKQ; i++) {
+		if (blk.q[i].used && blk.q[i].dev == dev)
+			return &blk.q[i];
+		if (!blk.q[i].used && free == 0)
+			free = &blk.q[i];
+	}
+	if (free == 0)
+		panic("blkq: too many devices");
+	free->used = 1;
+	free->dev = dev;
+	return free;
+}
+
+// Carry out the n requests in batch, contiguous on disk and all
+// reads or all writes, without blk.lock held.
+static void dispatch(struct buf** batch, int n){
+	struct sata_sg sg[BLKQ_MAXMERGE];
+	struct buf* b = batch[0];
+	int write = b->flags & B_DIRTY;
+	int status;
+
+	for (int i = 0; i < n; i++) {
+		sg[i].buf = batch[i]->data;
+		sg[i].len = batch[i]->nsec * SECTOR_SIZE;
+	}
+	switch (GETDEVTYPE(b->dev)) {
+	case DEV_SATA:
+		if (write)
+			status = sata_writev(GETDEVNUM(b->dev), b->sector, sg, n);
+		else
+			status = sata_readv(GETDEVNUM(b->dev), b->sector, sg, n);
+		if (status != SATA_IO_SUCCESS) {
+			cprintf("Error %s SATA: %d\n", write ? "writing" : "reading", status);
+			panic("SATA I/O ERROR");
+		}
+		break;
+	case DEV_VIRTIO:
+		status = virtio_blk_rw(GETDEVNUM(b->dev), b->sector, sg, n, write);
+		if (status != VIRTIO_BLK_S_OK) {
+			cprintf("Error %s virtio: %d\n", write ? "writing" : "reading", status);
+			panic("virtio I/O ERROR");
+		}
+		break;
+	case DEV_NVME:
+		status = nvme_rw(GETDEVNUM(b->dev), b->sector, sg, n, write);
+		if (status != 0) {
+			cprintf("Error %s NVMe: %d\n", write ? "writing" : "reading", status);
+			panic("NVMe I/O ERROR");
+		}
+		break;
+	default:
+		panic("Unsupported device type");
+	}
+	for (int i = 0; i < n; i++) {
+		TRACE(TRACE_BIODONE, batch[i]->sector, batch[i]->dev | (write ? TRACE_WRITE : 0));
+		batch[i]->flags |= B_VALID;
+		batch[i]->flags &= ~B_DIRTY;
+	}
+}
+
+// Take the next batch of requests from q into batch.
+// Must hold blk.lock. Returns how many.
+static int takebatch(struct blkq* q, struct buf** batch){
+	struct buf** pp, ** pick, * b;
+	int write, n, nsec;
+
+	// The most overdue request, if any has expired...
+	pick = 0;
+	for (pp = &q->head; *pp; pp = &(*pp)->ionext)
+		if ((int)(ticks - (*pp)->iodeadline) >= 0 &&
+		    (pick == 0 || (int)((*pp)->iodeadline - (*pick)->iodeadline) < 0))
+			pick = pp;
+	// ...else the next one up the disk, wrapping to the start.
+	if (pick == 0) {
+		for (pp = &q->head; *pp && (*pp)->sector < q->pos; pp = &(*pp)->ionext)
+			;
+		pick = *pp ? pp : &q->head;
+	}
+
+	// Unlink the run of adjacent requests starting there.
+	b = *pick;
+	write = b->flags & B_DIRTY;
+	n = 0;
+	nsec = 0;
+	do {
+		*pick = b->ionext;
+		batch[n++] = b;
+		nsec += b->nsec;
+		q->n--;
+		b = *pick;
+	} while (b && n < BLKQ_MAXMERGE && (b->flags & B_DIRTY) == write &&
+	         b->sector == batch[n-1]->sector + batch[n-1]->nsec &&
+	         nsec + b->nsec <= BLKQ_MAXSECT);
+	q->pos = batch[n-1]->sector + batch[n-1]->nsec;
+	q->cmds++;
+	return n;
+}
+
+// Clear B_QUEUED on the n buffers in batch, waking waiters and
+// calling completion functions.
+static void complete(struct buf** batch, int n){
+	void (*done[BLKQ_MAXMERGE])(struct buf*);
+
+	acquire(&blk.lock);
+	for (int i = 0; i < n; i++) {
+		done[i] = batch[i]->iodone;
+		batch[i]->flags &= ~B_QUEUED;
+		wakeup(batch[i]);
+	}
+	release(&blk.lock);
+	for (int i = 0; i < n; i++)
+		if (done[i])
+			done[i](batch[i]);
+}
+
+static void blkqworker(void* arg){
+	struct buf* batch[BLKQ_MAXMERGE];
+	struct blkq* q;
+	int n;
+
+	for (;;) {
+		acquire(&blk.lock);
+		for (;;) {
+			q = 0;
+			for (int i = 0; i < NBLKQ; i++) {
+				struct blkq* c = &blk.q[(blk.next + i) % NBLKQ];
+				if (c->n > 0) {
+					q = c;
+					blk.next = (blk.next + i + 1) % NBLKQ;
+					break;
+				}
+			}
+			if (q)
+				break;
+			sleep(&blk, &blk.lock);
+		}
+		n = takebatch(q, batch);
+		release(&blk.lock);
+		dispatch(batch, n);
+		complete(batch, n);
+	}
+}
+
+// Count b against q. Must hold blk.lock.
+static void count(struct blkq* q, struct buf* b){
+	if (b->flags & B_DIRTY) {
+		q->writes++;
+		q->wsect += b->nsec;
+	} else {
+		q->reads++;
+		q->rsect += b->nsec;
+	}
+}
+
+// Queue b to be written (if B_DIRTY) or read. done, if not 0,
+// is called once the I/O is finished, from whichever thread
+// finished it. The caller must have b locked and keep it so
+// until then.
+void bsubmit(struct buf* b, void (*done)(struct buf*)){
+	struct buf** pp;
+	struct blkq* q;
+
+	b->iodone = done;
+	TRACE(TRACE_BIOSUBMIT, b->sector, b->dev | ((b->flags & B_DIRTY) ? TRACE_WRITE : 0));
+	if (GETDEVTYPE(b->dev) == DEV_IDE || !blk.started || proc == 0) {
+		acquire(&blk.lock);
+		q = queueof(b->dev);
+		count(q, b);
+		q->cmds++;
+		release(&blk.lock);
+		if (GETDEVTYPE(b->dev) == DEV_IDE) {
+			uint64 w = (b->flags & B_DIRTY) ? TRACE_WRITE : 0;
+			iderw(b);
+			TRACE(TRACE_BIODONE, b->sector, b->dev | w);
+		} else {
+			dispatch(&b, 1);
+		}
+		if (done)
+			done(b);
+		return;
+	}
+
+	b->iodeadline = ticks + ((b->flags & B_DIRTY) ? WRITE_EXPIRE : READ_EXPIRE);
+	acquire(&blk.lock);
+	if (b->flags & B_QUEUED)
+		panic("bsubmit: queued");
+	b->flags |= B_QUEUED;
+	q = queueof(b->dev);
+	count(q, b);
+	for (pp = &q->head; *pp && (*pp)->sector < b->sector; pp = &(*pp)->ionext)
+		;
+	b->ionext = *pp;
+	*pp = b;
+	q->n++;
+	wakeup(&blk);
+	release(&blk.lock);
+}
+
+// Wait for I/O submitted on b to finish.
+void bwait(struct buf* b){
+	acquire(&blk.lock);
+	while (b->flags & B_QUEUED)
+		sleep(b, &blk.lock);
+	release(&blk.lock);
+}
+
+// Copy out the counters of up to n devices' queues. Returns how
+// many there were.
+int blkqstat(struct blkqstat* st, int n){
+	int k = 0;
+
+	acquire(&blk.lock);
+	for (int i = 0; i < NBLKQ && k < n; i++) {
+		struct blkq* q = &blk.q[i];
+		if (!q->used)
+			continue;
+		st[k].dev = q->dev;
+		st[k].pending = q->n;
+		st[k].reads = q->reads;
+		st[k].writes = q->writes;
+		st[k].rsect = q->rsect;
+		st[k].wsect = q->wsect;
+		st[k].cmds = q->cmds;
+		k++;
+	}
+	release(&blk.lock);
+	return k;
+}
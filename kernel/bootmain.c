@@ -10,6 +10,7 @@
 #include "memlayout.h"
 
 #define SECTSIZE  512
+#define MAXSECTS  256 // per read command; a count of 0 means 256
 
 struct mbheader {
 	uint32 magic;
@@ -22,7 +23,7 @@ struct mbheader {
 	uint32 entry_addr;
 };
 
-void readseg(uchar*, uint, uint);
+static void readseg(uchar*, uint, uint);
 
 void bootmain(void){
 	struct mbheader* hdr;
@@ -67,32 +68,29 @@ found_it:
 	entry();
 }
 
-void waitdisk(void){
+static void waitdisk(void){
 	// Wait for disk ready.
 	while ((inb(0x1F7) & 0xC0) != 0x40)
 		;
 }
 
-// Read a single sector at offset into dst.
-void readsect(void* dst, uint offset){
-	// Issue command.
+// Ask for n sectors (1..MAXSECTS) at offset with one command;
+// the disk then has each ready in turn.
+static void readsects(uint offset, uint n){
 	waitdisk();
-	amd64_out8(0x1F2, 1); // count = 1
+	amd64_out8(0x1F2, n); // count, MAXSECTS as 0
 	amd64_out8(0x1F3, offset);
 	amd64_out8(0x1F4, offset >> 8);
 	amd64_out8(0x1F5, offset >> 16);
 	amd64_out8(0x1F6, (offset >> 24) | 0xE0);
 	amd64_out8(0x1F7, 0x20); // cmd 0x20 - read sectors
-
-	// Read data.
-	waitdisk();
-	amd64_insl(0x1F0, dst, SECTSIZE / 4);
 }
 
 // Read 'count' bytes at 'offset' from kernel into physical address 'pa'.
 // Might copy more than asked.
-void readseg(uchar* pa, uint count, uint offset){
+static void readseg(uchar* pa, uint count, uint offset){
 	uchar* epa;
+	uint n = 0; // sectors the disk still has for us from the last command
 
 	epa = pa + count;
 
@@ -102,9 +100,18 @@ void readseg(uchar* pa, uint count, uint offset){
 	// Translate from bytes to sectors; kernel starts at sector 1.
 	offset = (offset / SECTSIZE) + 1;
 
-	// If this is too slow, we could read lots of sectors at a time.
-	// We'd write more to memory than asked, but it doesn't matter --
-	// we load in increasing order.
-	for (; pa < epa; pa += SECTSIZE, offset++)
-		readsect(pa, offset);
+	// Up to MAXSECTS sectors a command, rather than one: the wait
+	// on the disk is for each command more than for each sector.
+	// The last sector may be partly past epa, which doesn't matter
+	// -- we load in increasing order.
+	for (; pa < epa; pa += SECTSIZE, offset++, n--) {
+		if (n == 0) {
+			n = (uint)(epa - pa + SECTSIZE - 1) / SECTSIZE;
+			if (n > MAXSECTS)
+				n = MAXSECTS;
+			readsects(offset, n);
+		}
+		waitdisk();
+		amd64_insl(0x1F0, pa, SECTSIZE / 4);
+	}
 }
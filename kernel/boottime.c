@@ -0,0 +1,91 @@
+// Boot time profile.
+//
+// main() calls bootphase() as each stretch of starting up
+// finishes, naming it for the last init function in it, and device
+// probes call bootprobe() around themselves. Both note the TSC,
+// which runs from reset, before clockinit() has measured its rate. Once the boot cpu has brought everything up,
+// bootreport() writes how long each phase and probe took to the
+// kernel log, where dmesg shows it. Only the boot cpu records,
+// before there are processes, so there is no lock.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+
+#define NBOOTMARK 128
+
+struct bootmark {
+	char* name;
+	int id;             // probe's device, or -1 for a phase
+	uint64 start;
+	uint64 end;
+};
+
+static struct bootmark marks[NBOOTMARK];
+static int nmarks;
+static int dropped;
+static uint64 last;     // TSC when the last phase ended
+
+static void bootrecord(char* name, int id, uint64 start, uint64 end){
+	if (nmarks == NBOOTMARK) {
+		dropped++;
+		return;
+	}
+	marks[nmarks].name = name;
+	marks[nmarks].id = id;
+	marks[nmarks].start = start;
+	marks[nmarks].end = end;
+	nmarks++;
+}
+
+// The boot step called name is done: it ran from the end of
+// the one before. main() starts the clock with a name of 0.
+void bootphase(char* name){
+	uint64 t = rdtsc();
+
+	if (name)
+		bootrecord(name, -1, last, t);
+	last = t;
+}
+
+// A probe of device id (a PCI bus:dev.func, an AHCI port...),
+// begun when the TSC read start, is done.
+void bootprobe(char* name, int id, uint64 start){
+	bootrecord(name, id, start, rdtsc());
+}
+
+// Write the profile to the kernel log, phases in order with the
+// probes they made under them.
+void bootreport(void){
+	struct bootmark* m;
+	uint64 first;
+
+	if (nmarks == 0)
+		return;
+	first = marks[0].start;
+	for (int i = 0; i < nmarks; i++)
+		if (marks[i].start < first)
+			first = marks[i].start;
+	cprintf("boot: main() at %d ms since reset, running %d us\n",
+	        (int)(tsc2ns(first) / 1000000), (int)(tsc2ns(last - first) / 1000));
+
+	// Probes are recorded before the phase they are part of;
+	// print by start time, each phase before its probes.
+	for (int i = 1; i < nmarks; i++) {
+		struct bootmark t = marks[i];
+		int j;
+		for (j = i; j > 0 && (marks[j - 1].start > t.start ||
+		     (marks[j - 1].start == t.start && marks[j - 1].id >= 0 && t.id < 0)); j--)
+			marks[j] = marks[j - 1];
+		marks[j] = t;
+	}
+	for (m = marks; m < marks + nmarks; m++) {
+		if (m->id < 0)
+			cprintf("boot: %d us %s\n", (int)(tsc2ns(m->end - m->start) / 1000), m->name);
+		else
+			cprintf("boot:   %d us %s %x\n", (int)(tsc2ns(m->end - m->start) / 1000), m->name, m->id);
+	}
+	if (dropped)
+		cprintf("boot: %d marks dropped\n", dropped);
+}
@@ -0,0 +1,65 @@
+// Nanosecond clock.
+//
+// At boot clockinit() counts TSC cycles across a known interval
+// timed by channel 2 of the PIT, which can be polled without an
+// interrupt. nsecs() then scales the TSC, assumed constant-rate
+// and in step across cpus, to nanoseconds since boot. Without a
+// calibrated TSC it falls back to ticks.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+
+#define IO_PIT2         0x042           // 8254 counter 2
+#define IO_PITMODE      0x043
+#define IO_PITGATE      0x061           // keyboard controller port B
+#define PITGATE2        0x01            // counter 2 gate
+#define PITSPKR         0x02            // speaker data enable
+#define PITOUT2         0x20            // counter 2 output
+#define PIT_FREQ        1193182
+#define CALIBRATE_US    10000
+
+static uint64 tscboot;                  // TSC at clockinit()
+static uint64 tsckhz;                   // TSC cycles per millisecond
+
+// Busy-wait us microseconds (at most 54925) on PIT counter 2.
+void pitdelay(uint us){
+	uint count = (uint64)PIT_FREQ * us / 1000000;
+
+	amd64_out8(IO_PITGATE, (amd64_in8(IO_PITGATE) & ~PITSPKR) | PITGATE2);
+	amd64_out8(IO_PITMODE, 0xB0);   // counter 2, lsb then msb, mode 0
+	amd64_out8(IO_PIT2, count & 0xFF);
+	amd64_out8(IO_PIT2, count >> 8);
+	while ((amd64_in8(IO_PITGATE) & PITOUT2) == 0)
+		;
+}
+
+void clockinit(void){
+	uint64 t0;
+
+	t0 = rdtsc();
+	pitdelay(CALIBRATE_US);
+	tsckhz = (rdtsc() - t0) / (CALIBRATE_US / 1000);
+	tscboot = t0;
+	cprintf("clock: tsc %d MHz\n", tsckhz / 1000);
+}
+
+// Convert a TSC interval to nanoseconds.
+uint64 tsc2ns(uint64 d){
+	if (tsckhz == 0)
+		return 0;
+	return d / tsckhz * 1000000 + d % tsckhz * 1000000 / tsckhz;
+}
+
+// For the vDSO, which does what nsecs() does in user space.
+void clockparams(uint64* boot, uint64* khz){
+	*boot = tscboot;
+	*khz = tsckhz;
+}
+
+uint64 nsecs(void){
+	if (tsckhz == 0)
+		return (uint64)ticks * (1000000000 / HZ);
+	return tsc2ns(rdtsc() - tscboot);
+}
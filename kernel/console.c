@@ -18,10 +18,12 @@
 #include "vga.h"
 #include "vga_modes.h"
 #include "irq.h"
+#include "poll.h"
 #include "kernel/string.h"
 #include "console.h"
 
 static void consputc(int, uint32);
+static void cgaputs(char*, int, uint32);
 
 #define CGA_BLACK         0x0
 #define CGA_BLUE          0x1
@@ -78,16 +80,40 @@ static struct {
 
 static char digits[] = "0123456789abcdef";
 
-static void printptr(uintp x, uint32 color) {
+// cprintf() formats into one of these, and hands it to the log
+// whenever it fills and at the end. snprintf() formats into the
+// caller's str instead, keeping what fits.
+struct cbuf {
+	char buf[128];
+	int n;
+	char* str;         // snprintf()'s buffer, or 0
+	int size;          // of str
+};
+
+static void cbputc(struct cbuf* b, int c){
+	if (b->str) {
+		if (b->n < b->size - 1)
+			b->str[b->n] = c;
+		b->n++;
+		return;
+	}
+	if (b->n == sizeof(b->buf)) {
+		klogwrite(b->buf, b->n);
+		b->n = 0;
+	}
+	b->buf[b->n++] = c;
+}
+
+static void printptr(struct cbuf* b, uintp x){
 	int i;
 	for (i = 0; i < (sizeof(uintp) * 2); i++, x <<= 4)
-		consputc(digits[x >> (sizeof(uintp) * 8 - 4)], color);
+		cbputc(b, digits[x >> (sizeof(uintp) * 8 - 4)]);
 }
 
-static void printint(int xx, int base, int sign, uint32 color){
-	char buf[16];
+static void printint(struct cbuf* b, int64 xx, int base, int sign){
+	char buf[24];
 	int i;
-	uint x;
+	uint64 x;
 
 	if (sign && (sign = xx < 0))
 		x = -xx;
@@ -103,59 +129,107 @@ static void printint(int xx, int base, int sign, uint32 color){
 		buf[i++] = '-';
 
 	while (--i >= 0)
-		consputc(buf[i], color);
+		cbputc(b, buf[i]);
 }
 
-void cprintf(char* fmt, ...){
-	va_list ap;
-	int i, c, locking;
+// %d, %x, %p, %s and %%, with %ld and %lx for 64-bit numbers.
+static void cbformat(struct cbuf* b, char* fmt, va_list ap){
+	int i, c;
 	char* s;
 
-	va_start(ap, fmt);
-
-	locking = cons.locking;
-	if (locking)
-		acquire(&cons.lock);
-
 	if (fmt == 0)
 		panic("null fmt");
 
-	uint32 color = DEFAULT_CONSOLE_COLOR;
 	for (i = 0; (c = fmt[i] & 0xff) != 0; i++) {
 		if (c != '%') {
-			consputc(c, color);
+			cbputc(b, c);
 			continue;
 		}
 		c = fmt[++i] & 0xff;
 		if (c == 0)
 			break;
+		if (c == 'l' && (fmt[i + 1] == 'd' || fmt[i + 1] == 'x')) {
+			c = fmt[++i];
+			printint(b, va_arg(ap, int64), c == 'd' ? 10 : 16, c == 'd');
+			continue;
+		}
 		switch (c) {
 		case 'd':
-			printint(va_arg(ap, int), 10, 1, color);
+			printint(b, va_arg(ap, int), 10, 1);
 			break;
 		case 'x':
-			printint(va_arg(ap, int), 16, 0, color);
+			printint(b, (uint)va_arg(ap, int), 16, 0);
 			break;
 		case 'p':
-			printptr(va_arg(ap, uintp), color);
+			printptr(b, va_arg(ap, uintp));
 			break;
 		case 's':
 			if ((s = va_arg(ap, char*)) == 0)
 				s = "(null)";
 			for (; *s; s++)
-				consputc(*s, color);
+				cbputc(b, *s);
 			break;
 		case '%':
-			consputc('%', color);
+			cbputc(b, '%');
 			break;
 		default:
 			// Print unknown % sequence to draw attention.
-			consputc('%', color);
-			consputc(c, color);
+			cbputc(b, '%');
+			cbputc(b, c);
 			break;
 		}
 	}
+}
 
+// Print to the console through the kernel log; see klog.c.
+void cprintf(char* fmt, ...){
+	struct cbuf b;
+	va_list ap;
+
+	b.n = 0;
+	b.str = 0;
+	va_start(ap, fmt);
+	cbformat(&b, fmt, ap);
+	va_end(ap);
+	if (b.n > 0)
+		klogwrite(b.buf, b.n);
+}
+
+// Format into str, of size bytes, as cprintf() would print, and
+// end it with a NUL if size > 0. Returns the length of the whole
+// output, which may not all have fitted.
+int snprintf(char* str, int size, char* fmt, ...){
+	struct cbuf b;
+	va_list ap;
+
+	b.n = 0;
+	b.str = str;
+	b.size = size;
+	va_start(ap, fmt);
+	cbformat(&b, fmt, ap);
+	va_end(ap);
+	if (size > 0)
+		str[b.n < size ? b.n : size - 1] = 0;
+	return b.n;
+}
+
+// Write s to the screen and serial port, now.
+void consoleputs(char* s, int n){
+	int locking = cons.locking;
+
+	if (panicked) {
+		cli();
+		for (;;)
+			;
+	}
+	if (locking)
+		acquire(&cons.lock);
+	for (int i = 0; i < n; i++)
+		uartputc(s[i] & 0xff);
+	if (fbactive)
+		fbputs(s, n, DEFAULT_CONSOLE_COLOR);
+	else
+		cgaputs(s, n, DEFAULT_CONSOLE_COLOR);
 	if (locking)
 		release(&cons.lock);
 }
@@ -165,6 +239,8 @@ void panic(char* s){
 
 	cli();
 	cons.locking = 0;
+	uartsync();
+	klogsync();
 	cprintf("\n\nPANIC on cpu %d\n ", cpu->id);
 	cprintf(s);
 	if(cpu->proc) {
@@ -197,7 +273,9 @@ static void console_setbackgroundcolor(uint32 color){
 }
 #endif
 
-static void cgaputc(int c, uint32 color){
+#define ROWS 24
+
+static int cgagetpos(void){
 	int pos;
 
 	// Cursor position: col + 80*row.
@@ -205,7 +283,20 @@ static void cgaputc(int c, uint32 color){
 	pos = inb(CRTPORT + 1) << 8;
 	amd64_out8(CRTPORT, 15);
 	pos |= inb(CRTPORT + 1);
+	return pos;
+}
 
+static void cgasetpos(int pos){
+	amd64_out8(CRTPORT, 14);
+	amd64_out8(CRTPORT + 1, pos >> 8);
+	amd64_out8(CRTPORT, 15);
+	amd64_out8(CRTPORT + 1, pos);
+	crt[pos] = ' ' | 0x0700;
+}
+
+// Put c at pos and return where the cursor goes next, which may
+// be off the bottom of the screen.
+static int cgarender(int pos, int c, uint32 color){
 	if (c == '\n') {
 		pos += COLUMNS - pos % COLUMNS;
 	} else if (c == BACKSPACE) {
@@ -216,18 +307,44 @@ static void cgaputc(int c, uint32 color){
 	} else {
 		crt[pos++] = (c & 0xFF) | (color << 8);
 	}
+	return pos;
+}
+
+// Scroll up n lines, pos having just gone off the bottom.
+static int cgascroll(int pos, int n){
+	if (n > ROWS)
+		n = ROWS;
+	memmove(crt, crt + n * COLUMNS, sizeof(crt[0]) * (ROWS - n) * COLUMNS);
+	pos -= n * COLUMNS;
+	memset(crt + pos, 0, sizeof(crt[0]) * (ROWS * COLUMNS - pos));
+	return pos;
+}
 
-	if ((pos / COLUMNS) >= 24) { // Scroll up.
-		memmove(crt, crt + COLUMNS, sizeof(crt[0]) * 23 * COLUMNS);
-		pos -= COLUMNS;
-		memset(crt + pos, 0, sizeof(crt[0]) * (24 * COLUMNS - pos));
+// Write s to the screen, reading and moving the cursor only once.
+// On reaching the bottom, scroll up as many lines as the newlines
+// still to come in s will need anyway (up to a screenful) rather
+// than one at a time.
+static void cgaputs(char* s, int n, uint32 color){
+	int pos = cgagetpos();
+	int nl = 0;
+
+	for (int i = 0; i < n; i++)
+		nl += s[i] == '\n';
+	for (int i = 0; i < n; i++) {
+		nl -= s[i] == '\n';
+		pos = cgarender(pos, s[i] & 0xff, color);
+		if ((pos / COLUMNS) >= ROWS)
+			pos = cgascroll(pos, nl + 1);
 	}
+	cgasetpos(pos);
+}
 
-	amd64_out8(CRTPORT, 14);
-	amd64_out8(CRTPORT + 1, pos >> 8);
-	amd64_out8(CRTPORT, 15);
-	amd64_out8(CRTPORT + 1, pos);
-	crt[pos] = ' ' | 0x0700;
+static void cgaputc(int c, uint32 color){
+	int pos = cgarender(cgagetpos(), c, color);
+
+	if ((pos / COLUMNS) >= ROWS)
+		pos = cgascroll(pos, 1);
+	cgasetpos(pos);
 }
 
 static void consputc(int c, uint32 color){
@@ -244,7 +361,10 @@ static void consputc(int c, uint32 color){
 	} else {
 		uartputc(c);
 	}
-	cgaputc(c, color);
+	if (fbactive)
+		fbputc(c, color);
+	else
+		cgaputc(c, color);
 }
 
 #define INPUT_BUF 128
@@ -254,15 +374,52 @@ struct {
 	uint r; // Read index
 	uint w; // Write index
 	uint e; // Edit index
+	struct pollhead poll;
 } input;
 
+// Characters consoleintr() has taken from the keyboard and the
+// serial port, for the bottom half to edit into input.
+#define RAW_BUF 256
+static struct {
+	struct spinlock lock;
+	char buf[RAW_BUF];
+	uint r;
+	uint w;
+} raw;
+
 #define C(x)  ((x) - '@')  // Control-x
 
+// Interrupt handler: keep what getc() has, for consolesoftirq().
+// Characters beyond RAW_BUF waiting are dropped.
 void consoleintr(int (*getc)(void)){
 	int c;
 
+	acquire(&raw.lock);
+	while ((c = getc()) >= 0)
+		if (raw.w - raw.r < RAW_BUF)
+			raw.buf[raw.w++ % RAW_BUF] = c;
+	release(&raw.lock);
+	raise_softirq(SOFTIRQ_CONSOLE);
+}
+
+static int rawgetc(void){
+	int c = -1;
+
+	acquire(&raw.lock);
+	if (raw.r != raw.w)
+		c = (uchar)raw.buf[raw.r++ % RAW_BUF];
+	release(&raw.lock);
+	return c;
+}
+
+// Bottom half: edit and echo the characters typed, and wake
+// readers at the end of a line. Under input.lock, so two cpus
+// doing this take the characters in order.
+static void consolesoftirq(void){
+	int c;
+
 	acquire(&input.lock);
-	while ((c = getc()) >= 0) {
+	while ((c = rawgetc()) >= 0) {
 		switch (c) {
 		case C('Z'): // reboot
 			lidt(0, 0);
@@ -294,6 +451,7 @@ void consoleintr(int (*getc)(void)){
 				if (c == '\n' || c == C('D') || input.e == input.r + INPUT_BUF) {
 					input.w = input.e;
 					wakeup(&input.r);
+					pollwake(&input.poll);
 				}
 			}
 			break;
@@ -338,14 +496,21 @@ int consoleread(struct inode* ip, char* dst, int n){
 	return target - n;
 }
 
-int consolewrite(struct inode* ip, char* buf, int n){
-	int i;
+// A line is ready to read; writing never waits.
+static int consolepoll(struct inode* ip, struct poller* pt){
+	int r = POLLOUT;
 
+	pollwait(&input.poll, pt);
+	acquire(&input.lock);
+	if (input.r != input.w)
+		r |= POLLIN;
+	release(&input.lock);
+	return r;
+}
+
+int consolewrite(struct inode* ip, char* buf, int n){
 	iunlock(ip);
-	acquire(&cons.lock);
-	for (i = 0; i < n; i++)
-		consputc(buf[i] & 0xff, DEFAULT_CONSOLE_COLOR);
-	release(&cons.lock);
+	consoleputs(buf, n);
 	ilock(ip);
 
 	return n;
@@ -370,7 +535,14 @@ static void vga_init(){
 void sys_kconsole_info(struct winsize *winsz, struct termios *termios) {
 	//TODO: when we support more resolutions, etc.,
 	//update this method accordingly.
-	if(winsz != 0) {
+	if(winsz != 0 && fbactive) {
+		int cols, rows, w, h;
+		fbsize(&cols, &rows, &w, &h);
+		winsz->ws_row = rows;
+		winsz->ws_col = cols;
+		winsz->ws_xpixel = w;
+		winsz->ws_ypixel = h;
+	} else if(winsz != 0) {
 		winsz->ws_row = 80;
 		winsz->ws_col = 25;
 		winsz->ws_xpixel = 640;
@@ -387,15 +559,21 @@ void sys_kconsole_info(struct winsize *winsz, struct termios *termios) {
 
 void consoleinit(void){
 	initlock(&cons.lock, "console");
+	kloginit();
 	initlock(&input.lock, "input");
+	initlock(&raw.lock, "rawinput");
+	open_softirq(SOFTIRQ_CONSOLE, consolesoftirq);
 
 	devsw[TTY0].write = consolewrite;
 	devsw[TTY0].read = consoleread;
+	devsw[TTY0].poll = consolepoll;
 	cons.locking = 1;
 
 	picenable(IRQ_KBD);
 	ioapicenable(IRQ_KBD, 0);
 
+	fbinit(); // a framebuffer from the loader, instead of CGA text
+
 	uint32 backColor = CGA_GET_FONT_BACKGROUND_COLOR(DEFAULT_CONSOLE_COLOR);
     #ifdef VGA_GRAPHICS
 	vga_init();
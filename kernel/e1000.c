@@ -0,0 +1,283 @@
+// Intel 8254x (e1000) network card driver.
+//
+// The receive and send rings are a page each of legacy
+// descriptors. Every receive descriptor points at a page from
+// kalloc(), of which the card fills the first E1000_RXBUF bytes;
+// the page goes up to net.c as it is and a fresh one takes its
+// place. A frame to send is sent from its own page, freed once a
+// later send or poll finds the descriptor done.
+//
+// The interrupt, MSI where the card has it and the INTx line
+// otherwise, masks the card's interrupts with IMC and schedules a
+// poll, which unmasks them with IMS once the ring is empty; see
+// net.c.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "poll.h"
+#include "ktimer.h"
+#include "pci.h"
+#include "e1000.h"
+#include "net.h"
+#include "kernel/string.h"
+
+#define E1000_MAX 2              // cards
+#define NRXDESC   64             // a multiple of 8
+#define NTXDESC   64
+
+struct e1000 {
+	struct netdev nd;
+	volatile uint8 *regs;
+	int irq;                     // INTx line, or -1
+	struct spinlock rxlock, txlock;
+	struct e1000_rx_desc *rx;
+	struct e1000_tx_desc *tx;
+	char *rxpage[NRXDESC];
+	char *txpage[NTXDESC];
+	uint rxnext;                 // next descriptor the card fills
+	uint txtail, txclean;        // next to fill, oldest not freed
+};
+
+static struct e1000 e1000s[E1000_MAX];
+static int ne1000;
+static irqhandler e1000chain[MAX_IRQS]; // whoever had the line before us
+static struct e1000 *e1000irq[MAX_IRQS]; // card of each MSI vector
+
+static inline uint32 e1000_rd(struct e1000 *d, int reg){
+	return *(volatile uint32*)(d->regs + reg);
+}
+
+static inline void e1000_wr(struct e1000 *d, int reg, uint32 v){
+	*(volatile uint32*)(d->regs + reg) = v;
+}
+
+// Word w of the EEPROM.
+static uint16 e1000_eeprom(struct e1000 *d, int w){
+	uint32 r;
+
+	e1000_wr(d, E1000_EERD, (w << 8) | E1000_EERD_START);
+	for (int i = 0; i < 10000; i++) {
+		if ((r = e1000_rd(d, E1000_EERD)) & E1000_EERD_DONE)
+			return r >> 16;
+		microdelay(1);
+	}
+	return 0;
+}
+
+// Free the pages the card has finished sending. Must hold d->txlock.
+static void e1000_txreap(struct e1000 *d){
+	while (d->txclean != d->txtail && (d->tx[d->txclean].status & E1000_TXD_DD)) {
+		kfree(d->txpage[d->txclean]);
+		d->txpage[d->txclean] = 0;
+		d->txclean = (d->txclean + 1) % NTXDESC;
+	}
+}
+
+static int e1000_xmit(struct netdev *nd, char *page, int off, int len){
+	struct e1000 *d = (struct e1000*)nd;
+	struct e1000_tx_desc *t;
+
+	acquire(&d->txlock);
+	e1000_txreap(d);
+	if ((d->txtail + 1) % NTXDESC == d->txclean) {
+		release(&d->txlock);
+		kfree(page);
+		return -1;
+	}
+	t = &d->tx[d->txtail];
+	t->addr = V2P(page + off);
+	t->length = len;
+	t->cmd = E1000_TXD_EOP | E1000_TXD_IFCS | E1000_TXD_RS;
+	t->status = 0;
+	d->txpage[d->txtail] = page;
+	d->txtail = (d->txtail + 1) % NTXDESC;
+	__sync_synchronize(); // descriptor before the tail
+	e1000_wr(d, E1000_TDT, d->txtail);
+	release(&d->txlock);
+	return 0;
+}
+
+static int e1000_rxpoll(struct netdev *nd, int budget){
+	struct e1000 *d = (struct e1000*)nd;
+	struct e1000_rx_desc *r;
+	char *page, *fresh;
+	int n = 0, len;
+
+	acquire(&d->txlock);
+	e1000_txreap(d);
+	release(&d->txlock);
+
+	acquire(&d->rxlock);
+	while (n < budget && ((r = &d->rx[d->rxnext])->status & E1000_RXD_DD)) {
+		__sync_synchronize(); // status before the rest
+		page = d->rxpage[d->rxnext];
+		len = r->length;
+		fresh = 0;
+		// A frame in pieces is too long for us; it and any frame
+		// without a page to post instead are dropped.
+		if ((r->status & E1000_RXD_EOP) && r->errors == 0 && len >= ETH_HLEN)
+			fresh = kalloc();
+		if (fresh == 0)
+			nd->rxdrops++;
+		else
+			d->rxpage[d->rxnext] = fresh;
+		r->addr = V2P(d->rxpage[d->rxnext]);
+		r->status = 0;
+		e1000_wr(d, E1000_RDT, d->rxnext);
+		d->rxnext = (d->rxnext + 1) % NRXDESC;
+		n++;
+		if (fresh) {
+			release(&d->rxlock);
+			netrxput(nd, page, 0, len);
+			acquire(&d->rxlock);
+		}
+	}
+	release(&d->rxlock);
+	return n;
+}
+
+static int e1000_irqon(struct netdev *nd){
+	struct e1000 *d = (struct e1000*)nd;
+	int more;
+
+	acquire(&d->rxlock);
+	e1000_wr(d, E1000_IMS, E1000_INT_RX);
+	more = (d->rx[d->rxnext].status & E1000_RXD_DD) != 0;
+	release(&d->rxlock);
+	return more;
+}
+
+// Returns 1 if d wanted attention.
+static int e1000_service(struct e1000 *d){
+	// Reading ICR acknowledges the interrupt.
+	if ((e1000_rd(d, E1000_ICR) & E1000_INT_RX) == 0)
+		return 0;
+	e1000_wr(d, E1000_IMC, ~0U);
+	netschedule(&d->nd);
+	return 1;
+}
+
+static void e1000intr(uint16 irq){
+	for (int i = 0; i < ne1000; i++)
+		if (e1000s[i].irq == irq)
+			e1000_service(&e1000s[i]);
+	if (e1000chain[irq])
+		e1000chain[irq](irq);
+}
+
+static void e1000msi(uint16 irq){
+	e1000_service(e1000irq[irq]);
+}
+
+// Set up the rings, rx buffers and all. Returns -1 if out of pages.
+static int e1000_rings(struct e1000 *d){
+	if ((d->rx = (struct e1000_rx_desc*)kalloc_zeroed()) == 0 ||
+	    (d->tx = (struct e1000_tx_desc*)kalloc_zeroed()) == 0)
+		return -1;
+	for (int i = 0; i < NRXDESC; i++) {
+		if ((d->rxpage[i] = kalloc()) == 0)
+			return -1;
+		d->rx[i].addr = V2P(d->rxpage[i]);
+	}
+	e1000_wr(d, E1000_RDBAL, (uint32)V2P(d->rx));
+	e1000_wr(d, E1000_RDBAH, (uint32)(V2P(d->rx) >> 32));
+	e1000_wr(d, E1000_RDLEN, NRXDESC * sizeof(struct e1000_rx_desc));
+	e1000_wr(d, E1000_RDH, 0);
+	e1000_wr(d, E1000_RDT, NRXDESC - 1);
+	e1000_wr(d, E1000_TDBAL, (uint32)V2P(d->tx));
+	e1000_wr(d, E1000_TDBAH, (uint32)(V2P(d->tx) >> 32));
+	e1000_wr(d, E1000_TDLEN, NTXDESC * sizeof(struct e1000_tx_desc));
+	e1000_wr(d, E1000_TDH, 0);
+	e1000_wr(d, E1000_TDT, 0);
+	return 0;
+}
+
+// Attach an e1000 PCI function; called from pci.c.
+// Returns 1 if it is driven from now on.
+int e1000_attach(struct pci_func *f){
+	struct e1000 *d;
+	uint32 hi = 0, ral, rah;
+	int irq;
+
+	cprintf("e1000 found (bus=%d, slot=%d, func=%d)\n", f->bus->busno, f->dev, f->func);
+	if (ne1000 == E1000_MAX) {
+		cprintf("   too many e1000 cards, ignoring\n");
+		return 0;
+	}
+	d = &e1000s[ne1000];
+	pci_func_enable(f);
+	if ((pci_conf_read(f, PCI_BAR0_OFFSET) & 0x7) == PCI_MAPREG_MEM_TYPE_64BIT)
+		hi = pci_conf_read(f, PCI_BAR1_OFFSET);
+	if (hi != 0 || f->reg_base[0] < DEVSPACE) {
+		cprintf("   registers at 0x%x out of reach\n", f->reg_base[0]);
+		return 0;
+	}
+	d->regs = (volatile uint8*)IO2V((uint64)f->reg_base[0]);
+	initlock(&d->rxlock, "e1000rx");
+	initlock(&d->txlock, "e1000tx");
+
+	e1000_wr(d, E1000_IMC, ~0U);
+	e1000_wr(d, E1000_CTRL, e1000_rd(d, E1000_CTRL) | E1000_CTRL_RST);
+	microdelay(1000);
+	e1000_wr(d, E1000_IMC, ~0U);
+	e1000_wr(d, E1000_CTRL, e1000_rd(d, E1000_CTRL) | E1000_CTRL_SLU);
+
+	ral = e1000_rd(d, E1000_RAL);
+	rah = e1000_rd(d, E1000_RAH);
+	if (ral == 0 && (rah & 0xFFFF) == 0) {
+		ral = e1000_eeprom(d, 0) | (e1000_eeprom(d, 1) << 16);
+		rah = e1000_eeprom(d, 2);
+	}
+	for (int i = 0; i < 4; i++)
+		d->nd.mac[i] = ral >> (8 * i);
+	d->nd.mac[4] = rah;
+	d->nd.mac[5] = rah >> 8;
+	e1000_wr(d, E1000_RAL, ral);
+	e1000_wr(d, E1000_RAH, (rah & 0xFFFF) | E1000_RAH_AV);
+	for (int i = 0; i < 128; i++)
+		e1000_wr(d, E1000_MTA + 4 * i, 0);
+
+	if (e1000_rings(d) < 0) {
+		cprintf("   out of memory for the rings\n");
+		return 0;
+	}
+	e1000_wr(d, E1000_TCTL, E1000_TCTL_EN | E1000_TCTL_PSP | E1000_TCTL_CT | E1000_TCTL_COLD);
+	e1000_wr(d, E1000_TIPG, E1000_TIPG_DEFAULT);
+	e1000_wr(d, E1000_RCTL, E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_SECRC);
+
+	d->nd.mtu = ETH_MTU;
+	d->nd.xmit = e1000_xmit;
+	d->nd.rxpoll = e1000_rxpoll;
+	d->nd.irqon = e1000_irqon;
+	d->irq = -1;
+	if ((irq = pci_msi_vector(f, e1000msi, 0)) >= 0) {
+		cprintf("   MSI\n");
+		e1000irq[irq] = d;
+	} else if (f->irq_line != 0 && f->irq_line < IRQ_ERROR) {
+		d->irq = f->irq_line;
+	}
+	d->nd.irq = irq >= 0 || d->irq >= 0;
+	if (netregister(&d->nd) < 0) {
+		cprintf("   too many network devices\n");
+		e1000_wr(d, E1000_RCTL, 0);
+		e1000_wr(d, E1000_TCTL, 0);
+		return 0;
+	}
+	ne1000++;
+	if (d->irq >= 0) {
+		irqhandler prev = get_registered_handler(d->irq);
+		if (prev != e1000intr) {
+			e1000chain[d->irq] = prev;
+			irq_register_handler(d->irq, e1000intr);
+			picenable(d->irq);
+			ioapicenable(d->irq, 0);
+		}
+	}
+	return 1;
+}
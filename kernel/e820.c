@@ -0,0 +1,67 @@
+// Usable physical memory.
+//
+// bootasm.S asks the BIOS for its memory map before leaving real
+// mode. e820init() turns the usable entries into a sorted list of
+// page-aligned ranges, which kvmalloc() uses to size the direct
+// map and kinit2() hands to the page allocator. Without a map
+// (e.g. booted by a multiboot loader) memory up to PHYSTOP is
+// assumed.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "e820.h"
+
+static struct {
+	uint64 start;
+	uint64 end;
+} ranges[E820MAX];
+static int nranges;
+
+void e820init(void){
+	struct e820map* m = (struct e820map*)p2v(E820MAP);
+	uint64 start, end;
+	int i, j, n;
+
+	n = 0;
+	if (m->sig == E820_SIG && m->end > E820MAP + 8)
+		n = (m->end - (E820MAP + 8)) / E820_ENTSIZE;
+	for (i = 0; i < n && nranges < E820MAX; i++) {
+		if (m->ent[i].type != E820_RAM)
+			continue;
+		start = PGROUNDUP(m->ent[i].addr);
+		end = PGROUNDDOWN(m->ent[i].addr + m->ent[i].len);
+		if (start >= end)
+			continue;
+		// insertion sort by start address
+		for (j = nranges; j > 0 && ranges[j - 1].start > start; j--)
+			ranges[j] = ranges[j - 1];
+		ranges[j].start = start;
+		ranges[j].end = end;
+		nranges++;
+	}
+	if (nranges == 0) {
+		ranges[0].start = 0;
+		ranges[0].end = PHYSTOP;
+		nranges = 1;
+	}
+	for (i = 0; i < nranges; i++)
+		cprintf("e820: %p - %p usable\n", ranges[i].start, ranges[i].end);
+}
+
+// Return range i of usable memory in [*start, *end), or 0
+// once there are no more.
+int e820range(int i, uint64* start, uint64* end){
+	if (i < 0 || i >= nranges)
+		return 0;
+	*start = ranges[i].start;
+	*end = ranges[i].end;
+	return 1;
+}
+
+// End of the highest usable range.
+uint64 e820top(void){
+	return ranges[nranges - 1].end;
+}
@@ -0,0 +1,340 @@
+// epoll: poll a set of files kept in the kernel.
+//
+// An epoll has an interest list of items, each a file and the
+// events wanted from it, and a ready list of the items whose
+// objects have called pollwake() since epoll_wait() last looked.
+// Adding an item hangs entries for it on its file's pollheads, for
+// as long as it is on the list, and their wakeups queue it as
+// ready. epoll_wait() only looks at the ready list, so it costs
+// in the items that may be ready, not in those watched. Items are
+// level-triggered unless EPOLLET is asked for: one still ready
+// when reported stays on the ready list.
+//
+// The lists are under polllock, so wakeups can queue items.
+// Changing the lists and reporting items is also serialized by
+// epmutex, which keeps items and their files in place while
+// epoll_wait() polls them without polllock. The last close of a
+// file takes its items off every epoll, in epollfileclose(),
+// before the file goes.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "ktimer.h"
+#include "slab.h"
+#include "vfs.h"
+#include "file.h"
+#include "poll.h"
+#include "epoll.h"
+#include "kernel/string.h"
+
+#define EPNENT 2   // pollheads an item may wait on
+
+struct epoll {
+	struct epitem* items;          // interest list
+	struct epitem* ready;          // ready list, through rnext
+	struct epitem** readytail;
+};
+
+struct epitem {
+	struct epoll* ep;
+	struct file* f;
+	int fd;
+	uint events;
+	uint64 data;
+	int ready;                     // on the ready list
+	int nent;
+	struct pollentry ent[EPNENT];
+	struct epitem* next;           // on ep->items
+	struct epitem* fnext;          // on f->epitems
+	struct epitem* rnext;          // on ep->ready
+};
+
+// Adding an item: where pollwait() gets its entries.
+struct epqueuer {
+	struct poller pt;
+	struct epitem* it;
+};
+
+// An epoll_wait() with a timeout.
+struct epwaiter {
+	struct epoll* ep;
+	int expired;
+};
+
+extern struct spinlock polllock;
+static struct sleeplock epmutex;
+static struct kmem_cache* epcache;
+static struct kmem_cache* epitemcache;
+
+void epollinit(void){
+	initsleeplock(&epmutex, "epoll");
+	epcache = kmem_cache_create("epoll", sizeof(struct epoll), 0);
+	epitemcache = kmem_cache_create("epitem", sizeof(struct epitem), 0);
+}
+
+struct epoll* epollalloc(void){
+	struct epoll* ep;
+
+	if ((ep = kmem_cache_alloc(epcache)) == 0)
+		return 0;
+	ep->items = ep->ready = 0;
+	ep->readytail = &ep->ready;
+	return ep;
+}
+
+// Put it on its ready list. Must hold polllock.
+static void epqueue(struct epitem* it){
+	struct epoll* ep = it->ep;
+
+	if (it->ready)
+		return;
+	it->ready = 1;
+	it->rnext = 0;
+	*ep->readytail = it;
+	ep->readytail = &it->rnext;
+	wakeup(ep);
+}
+
+// Take the first item off ep's ready list, or return 0. Must hold
+// polllock.
+static struct epitem* epdequeue(struct epoll* ep){
+	struct epitem* it;
+
+	if ((it = ep->ready) == 0)
+		return 0;
+	if ((ep->ready = it->rnext) == 0)
+		ep->readytail = &ep->ready;
+	it->ready = 0;
+	return it;
+}
+
+static void epwake(struct pollentry* e){
+	epqueue(e->arg);
+}
+
+static struct pollentry* epalloc(struct poller* pt){
+	struct epitem* it = ((struct epqueuer*)pt)->it;
+	struct pollentry* e;
+
+	if (it->nent == EPNENT)
+		return 0;
+	e = &it->ent[it->nent++];
+	e->poller = 0;
+	e->func = epwake;
+	e->arg = it;
+	return e;
+}
+
+// Take it off its pollheads and every list. Must hold polllock.
+static void epunlink(struct epitem* it){
+	struct epoll* ep = it->ep;
+	struct epitem** pp;
+
+	for (int i = 0; i < it->nent; i++)
+		pollunlink(&it->ent[i]);
+	for (pp = &ep->items; *pp; pp = &(*pp)->next) {
+		if (*pp == it) {
+			*pp = it->next;
+			break;
+		}
+	}
+	for (pp = &it->f->epitems; *pp; pp = &(*pp)->fnext) {
+		if (*pp == it) {
+			*pp = it->fnext;
+			break;
+		}
+	}
+	if (it->ready) {
+		for (pp = &ep->ready; *pp; pp = &(*pp)->rnext) {
+			if (*pp == it) {
+				if ((*pp = it->rnext) == 0)
+					ep->readytail = pp;
+				break;
+			}
+		}
+	}
+}
+
+// The events wanted from it that hold now.
+static uint epready(struct epitem* it){
+	return filepoll(it->f, 0) & (it->events | POLLERR | POLLHUP);
+}
+
+// Add, change or remove (op) what ep wants from f, open as fd.
+int epollctl(struct epoll* ep, int op, int fd, struct file* f, struct epoll_event* ev){
+	struct epqueuer q;
+	struct epitem* it;
+	int r = 0;
+
+	if (f->type == FD_EPOLL)
+		return -1;
+	acquiresleep(&epmutex);
+	acquire(&polllock);
+	for (it = ep->items; it; it = it->next)
+		if (it->f == f && it->fd == fd)
+			break;
+	release(&polllock);
+
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		if (it || (it = kmem_cache_alloc(epitemcache)) == 0) {
+			r = -1;
+			break;
+		}
+		memset(it, 0, sizeof(*it));
+		it->ep = ep;
+		it->f = f;
+		it->fd = fd;
+		it->events = ev->events;
+		it->data = ev->data;
+		acquire(&polllock);
+		it->next = ep->items;
+		ep->items = it;
+		it->fnext = f->epitems;
+		f->epitems = it;
+		release(&polllock);
+		memset(&q, 0, sizeof(q));
+		q.pt.alloc = epalloc;
+		q.it = it;
+		if (filepoll(f, &q.pt) & (it->events | POLLERR | POLLHUP)) {
+			acquire(&polllock);
+			epqueue(it);
+			release(&polllock);
+		}
+		break;
+	case EPOLL_CTL_MOD:
+		if (it == 0) {
+			r = -1;
+			break;
+		}
+		acquire(&polllock);
+		it->events = ev->events;
+		it->data = ev->data;
+		release(&polllock);
+		if (epready(it)) {
+			acquire(&polllock);
+			epqueue(it);
+			release(&polllock);
+		}
+		break;
+	case EPOLL_CTL_DEL:
+		if (it == 0) {
+			r = -1;
+			break;
+		}
+		acquire(&polllock);
+		epunlink(it);
+		release(&polllock);
+		kmem_cache_free(epitemcache, it);
+		break;
+	default:
+		r = -1;
+	}
+	releasesleep(&epmutex);
+	return r;
+}
+
+// Report up to max of ep's ready items in evs. Each item on the
+// ready list is looked at once.
+static int epscan(struct epoll* ep, struct epoll_event* evs, int max){
+	struct epitem* it;
+	int n = 0, left = 0;
+	uint r;
+
+	acquiresleep(&epmutex);
+	acquire(&polllock);
+	for (it = ep->ready; it; it = it->rnext)
+		left++;
+	release(&polllock);
+	for (; left > 0 && n < max; left--) {
+		acquire(&polllock);
+		it = epdequeue(ep);
+		release(&polllock);
+		if (it == 0)
+			break;
+		if ((r = epready(it)) == 0)
+			continue;
+		evs[n].events = r;
+		evs[n].data = it->data;
+		n++;
+		if ((it->events & EPOLLET) == 0) {
+			acquire(&polllock);
+			epqueue(it);
+			release(&polllock);
+		}
+	}
+	releasesleep(&epmutex);
+	return n;
+}
+
+static void eptimeout(void* arg){
+	struct epwaiter* w = arg;
+
+	acquire(&polllock);
+	w->expired = 1;
+	wakeup(w->ep);
+	release(&polllock);
+}
+
+// Wait up to timeout ticks (forever if negative) for some of ep's
+// items to be ready, and report up to max of them in evs.
+// Returns how many, or -1 if killed.
+int epollwait(struct epoll* ep, struct epoll_event* evs, int max, int timeout){
+	struct epwaiter w;
+	struct ktimer t;
+	int n;
+
+	w.ep = ep;
+	w.expired = 0;
+	memset(&t, 0, sizeof(t));
+	if (timeout > 0)
+		ktimerset(&t, ticks + timeout, eptimeout, &w);
+	for (;;) {
+		acquire(&polllock);
+		while (ep->ready == 0 && timeout != 0 && !w.expired && !proc->killed)
+			sleep(ep, &polllock);
+		release(&polllock);
+		if (proc->killed) {
+			n = -1;
+			break;
+		}
+		if ((n = epscan(ep, evs, max)) > 0 || timeout == 0 || w.expired)
+			break;
+	}
+	ktimercancel(&t);
+	return n;
+}
+
+// f's last reference is going: take it off every epoll.
+void epollfileclose(struct file* f){
+	struct epitem* it;
+
+	acquiresleep(&epmutex);
+	acquire(&polllock);
+	while ((it = f->epitems) != 0) {
+		epunlink(it);
+		kmem_cache_free(epitemcache, it);
+	}
+	release(&polllock);
+	releasesleep(&epmutex);
+}
+
+// ep's file is closed.
+void epollclose(struct epoll* ep){
+	struct epitem* it;
+
+	acquiresleep(&epmutex);
+	acquire(&polllock);
+	while ((it = ep->items) != 0) {
+		epunlink(it);
+		kmem_cache_free(epitemcache, it);
+	}
+	release(&polllock);
+	releasesleep(&epmutex);
+	kmem_cache_free(epcache, ep);
+}
@@ -6,50 +6,93 @@
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#include "spinlock.h"
+#include "file.h"
 #include "kernel/string.h"
 
-int exec(char *path, char **argv) {
+#define HDRBYTES 512  // read at once: the ELF header, and usually the program headers
+
+// Make the load plan of executable ip, which is locked, from its
+// ELF headers. Returns -1 if it won't run.
+static int execplan(struct inode *ip, struct execplan *pl) {
+	char buf[HDRBYTES];
+	struct elfhdr *elf = (struct elfhdr*)buf;
+	struct proghdr ph;
+	int i, n;
+	uintp off;
+
+	if((n = readi(ip, buf, 0, sizeof(buf))) < (int)sizeof(*elf))
+		return -1;
+	if(elf->magic != ELF_MAGIC)
+		return -1;
+	pl->entry = elf->entry;
+	pl->sz = 0;
+	pl->nuseg = 0;
+	for(i=0, off=elf->phoff; i<elf->phnum; i++, off+=sizeof(ph)) {
+		if(off + sizeof(ph) <= n)
+			memmove(&ph, buf + off, sizeof(ph));
+		else if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
+			return -1;
+		if(ph.type != ELF_PROG_LOAD)
+			continue;
+		if(ph.memsz < ph.filesz || ph.vaddr + ph.memsz < ph.vaddr)
+			return -1;
+		if(pl->nuseg == NUSEG || ph.vaddr + ph.memsz >= USERTOP)
+			return -1;
+		pl->useg[pl->nuseg].vaddr = ph.vaddr;
+		pl->useg[pl->nuseg].memsz = ph.memsz;
+		pl->useg[pl->nuseg].off = ph.off;
+		pl->useg[pl->nuseg].filesz = ph.filesz;
+		pl->nuseg++;
+		if(ph.vaddr + ph.memsz > pl->sz)
+			pl->sz = ph.vaddr + ph.memsz;
+	}
+	return 0;
+}
+
+// Build the image of path run with argv, for process pid whose
+// parent is ppid, without touching the current process: a page
+// table with the arguments on the stack, and the segments to page
+// in. Returns -1 if path won't run.
+int execload(char *path, char **argv, int pid, int ppid, struct execimage *im) {
 	char *s, *last;
-	int i, off;
 	uintp argc, sz, sp, ustack[3+MAXARG+1];
-	struct elfhdr elf;
+	struct execplan plan;
 	struct inode *ip;
-	struct proghdr ph;
-	pde_t *pgdir, *oldpgdir;
+	pde_t *pgdir;
+	struct inode *exe;
 
 	begin_op();
 	if((ip = namei(path)) == 0) {
 		end_op();
 		return -1;
 	}
-	ilock(ip);
+	ilockshared(ip);
 	pgdir = 0;
+	exe = 0;
 
-	// Check ELF header
-	if(readi(ip, (char*)&elf, 0, sizeof(elf)) < sizeof(elf))
-		goto bad;
-	if(elf.magic != ELF_MAGIC)
-		goto bad;
+	// The loadable segments, from the text cache if the file ran
+	// lately and hasn't changed since.
+	if(textcache_plan_get(ip->dev, ip->inum, &plan) < 0) {
+		if(execplan(ip, &plan) < 0)
+			goto bad;
+		textcache_plan_put(ip->dev, ip->inum, &plan);
+	}
 
 	if((pgdir = setupkvm()) == 0)
 		goto bad;
+	if(vdsomap(pgdir, pid, ppid) < 0)
+		goto bad;
 
-	// Load program into memory.
-	sz = 0;
-	for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)) {
-		if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
-			goto bad;
-		if(ph.type != ELF_PROG_LOAD)
-			continue;
-		if(ph.memsz < ph.filesz)
-			goto bad;
-		if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
-			goto bad;
-		if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
-			goto bad;
-	}
-	iunlockput(ip);
+	// Pages others have read are mapped now; pagein() reads the
+	// rest from the executable the first time each is touched.
+	premapexe(pgdir, ip, plan.useg, plan.nuseg);
+	memmove(im->useg, plan.useg, sizeof(plan.useg));
+	im->nuseg = plan.nuseg;
+	sz = plan.sz;
+	iunlock(ip);
 	end_op();
+	exe = ip; // keeps the reference from namei
 	ip = 0;
 
 	// Allocate two pages at the next page boundary.
@@ -75,8 +118,8 @@ int exec(char *path, char **argv) {
 	ustack[1] = argc;
 	ustack[2] = sp - (argc+1)*sizeof(uintp); // argv pointer
 
-	proc->tf->rdi = argc;
-	proc->tf->rsi = sp - (argc+1)*sizeof(uintp);
+	im->argc = argc;
+	im->argv = sp - (argc+1)*sizeof(uintp);
 
 	sp -= (3+argc+1) * sizeof(uintp);
 	if(copyout(pgdir, sp, ustack, (3+argc+1)*sizeof(uintp)) < 0)
@@ -86,16 +129,13 @@ int exec(char *path, char **argv) {
 	for(last=s=path; *s; s++)
 		if(*s == '/')
 			last = s+1;
-	safestrcpy(proc->name, last, sizeof(proc->name));
-
-	// Commit to the user image.
-	oldpgdir = proc->pgdir;
-	proc->pgdir = pgdir;
-	proc->sz = sz;
-	proc->tf->eip = elf.entry; // main
-	proc->tf->esp = sp;
-	switchuvm(proc);
-	freevm(oldpgdir);
+	safestrcpy(im->name, last, sizeof(im->name));
+
+	im->pgdir = pgdir;
+	im->sz = sz;
+	im->sp = sp;
+	im->entry = plan.entry;
+	im->exe = exe;
 	return 0;
 
 bad:
@@ -105,5 +145,69 @@ bad:
 		iunlockput(ip);
 		end_op();
 	}
+	if(exe) {
+		begin_op();
+		iput(exe);
+		end_op();
+	}
 	return -1;
 }
+
+// Throw away an image that won't be used after all.
+void execfree(struct execimage *im) {
+	freevm(im->pgdir);
+	begin_op();
+	iput(im->exe);
+	end_op();
+}
+
+int exec(char *path, char **argv) {
+	struct execimage im;
+	pde_t *oldpgdir;
+	struct inode *oldexe;
+	struct vmspace *oldvm;
+
+	if(execload(path, argv, proc->pid, proc->parent ? proc->parent->pid : 0, &im) < 0)
+		return -1;
+
+	// Commit to the user image. If other threads share the old
+	// address space, leave it to them and start a new one.
+	oldpgdir = proc->vm->pgdir;
+	oldexe = proc->vm->exe;
+	if(vmspaceunshare(proc, &oldvm) < 0) {
+		execfree(&im);
+		return -1;
+	}
+	safestrcpy(proc->name, im.name, sizeof(proc->name));
+	if(oldvm == 0)
+		proc->vm->mmid = newmmid();
+	// Under vm->lock for swapout(), which may be looking at the
+	// old page table from another cpu.
+	acquire(&proc->vm->lock);
+	proc->vm->pgdir = im.pgdir;
+	proc->vm->sz = im.sz;
+	proc->vm->swaphand = 0;
+	release(&proc->vm->lock);
+	proc->vm->exe = im.exe;
+	memmove(proc->vm->useg, im.useg, sizeof(im.useg));
+	proc->vm->nuseg = im.nuseg;
+	proc->tf->rdi = im.argc;
+	proc->tf->rsi = im.argv;
+	proc->tf->eip = im.entry; // main
+	proc->tf->esp = im.sp;
+	proc->tls = 0;
+	uringrelease(proc);
+	fpuexec();
+	switchuvm(proc);
+	if(oldvm) {
+		vmspacerelease(oldvm);
+		return 0;
+	}
+	freevm(oldpgdir);
+	begin_op();
+	if(oldexe)
+		iput(oldexe);
+	vmafree(proc);
+	end_op();
+	return 0;
+}
@@ -0,0 +1,215 @@
+// Framebuffer console.
+//
+// When a multiboot loader (GRUB, from VBE or UEFI GOP) has set a
+// 32 bit linear framebuffer mode, the console draws its text
+// there with the VGA 8x16 font instead of in CGA text memory. The
+// framebuffer is mapped write-combining (see fbmap()), so it is
+// only ever written, a scanline at a time, and never read.
+//
+// Text goes first into a shadow of character cells. Each write to
+// the console marks the rectangle of cells it touched, and the
+// flush at its end redraws, in that rectangle, just the cells
+// that differ from what the screen shows. Scrolling moves the
+// shadow, not pixels, and the blit that follows skips whatever
+// stayed the same, such as the blank ends of lines.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "multiboot.h"
+#include "vga_modes.h"
+#include "kernel/string.h"
+
+#define BACKSPACE 0x100
+#define TAB_SIZE  8
+#define FONTW     8
+#define FONTH     16
+#define MAXCOLS   (1920 / FONTW)
+#define MAXROWS   (1200 / FONTH)
+#define NOCELL    0xFFFF         // in shown[]: redraw whatever is wanted
+
+int fbactive;                    // the console is on the framebuffer
+
+static struct {
+	uint8 *fb;
+	uint pitch;                  // bytes per scanline
+	int cols, rows;
+	int pos;                     // the cursor's cell
+	int top, bottom, left, right; // dirty cells: rows [top, bottom), columns [left, right)
+	uint32 palette[16];
+	uint16 cells[MAXROWS * MAXCOLS];  // char | attribute << 8, as wanted
+	uint16 shown[MAXROWS * MAXCOLS];  // and as on the screen
+} fbc;
+
+static uint8 font[VGA_8X16_FONT_SIZE] = VGA_8X16_FONT;
+
+// The CGA colours, as red, green, blue.
+static uint8 cgargb[16][3] = {
+	{0x00, 0x00, 0x00}, {0x00, 0x00, 0xAA}, {0x00, 0xAA, 0x00}, {0x00, 0xAA, 0xAA},
+	{0xAA, 0x00, 0x00}, {0xAA, 0x00, 0xAA}, {0xAA, 0x55, 0x00}, {0xAA, 0xAA, 0xAA},
+	{0x55, 0x55, 0x55}, {0x55, 0x55, 0xFF}, {0x55, 0xFF, 0x55}, {0x55, 0xFF, 0xFF},
+	{0xFF, 0x55, 0x55}, {0xFF, 0x55, 0xFF}, {0xFF, 0xFF, 0x55}, {0xFF, 0xFF, 0xFF},
+};
+
+static uint32 fbcolour(struct multiboot_info* mb, uint8* rgb){
+	return (uint32)(rgb[0] >> (8 - mb->red_size)) << mb->red_position |
+	       (uint32)(rgb[1] >> (8 - mb->green_size)) << mb->green_position |
+	       (uint32)(rgb[2] >> (8 - mb->blue_size)) << mb->blue_position;
+}
+
+static void fbdirty(int first, int last){
+	int r0 = first / fbc.cols, r1 = last / fbc.cols + 1;
+	int c0 = r0 + 1 == r1 ? first % fbc.cols : 0;
+	int c1 = r0 + 1 == r1 ? last % fbc.cols + 1 : fbc.cols;
+
+	if (fbc.top >= fbc.bottom) {
+		fbc.top = r0, fbc.bottom = r1, fbc.left = c0, fbc.right = c1;
+		return;
+	}
+	if (r0 < fbc.top) fbc.top = r0;
+	if (r1 > fbc.bottom) fbc.bottom = r1;
+	if (c0 < fbc.left) fbc.left = c0;
+	if (c1 > fbc.right) fbc.right = c1;
+}
+
+// Draw cells [c0, c1) of row r, scanline by scanline.
+static void fbdraw(int r, int c0, int c1){
+	uint16 *cell = &fbc.cells[r * fbc.cols];
+
+	for (int y = 0; y < FONTH; y++) {
+		uint32 *p = (uint32*)(fbc.fb + (r * FONTH + y) * fbc.pitch) + c0 * FONTW;
+		for (int c = c0; c < c1; c++) {
+			uint bits = font[(cell[c] & 0xFF) * FONTH + y];
+			uint32 fg = fbc.palette[(cell[c] >> 8) & 0xF], bg = fbc.palette[(cell[c] >> 12) & 0xF];
+			for (int x = 0; x < FONTW; x++, bits <<= 1)
+				*p++ = bits & 0x80 ? fg : bg;
+		}
+	}
+}
+
+// Bring the dirty rectangle on the screen up to date, and show
+// the cursor as an underline.
+static void fbflush(void){
+	for (int r = fbc.top; r < fbc.bottom; r++) {
+		uint16 *cell = &fbc.cells[r * fbc.cols], *shown = &fbc.shown[r * fbc.cols];
+		int c0 = fbc.left, c1 = fbc.right;
+		while (c0 < c1 && cell[c0] == shown[c0])
+			c0++;
+		while (c1 > c0 && cell[c1 - 1] == shown[c1 - 1])
+			c1--;
+		if (c0 == c1)
+			continue;
+		fbdraw(r, c0, c1);
+		memmove(shown + c0, cell + c0, (c1 - c0) * sizeof(cell[0]));
+	}
+	fbc.top = fbc.bottom = 0;
+
+	uint32 fg = fbc.palette[(fbc.cells[fbc.pos] >> 8) & 0xF];
+	for (int y = FONTH - 2; y < FONTH; y++) {
+		uint32 *p = (uint32*)(fbc.fb + ((fbc.pos / fbc.cols) * FONTH + y) * fbc.pitch) + (fbc.pos % fbc.cols) * FONTW;
+		for (int x = 0; x < FONTW; x++)
+			*p++ = fg;
+	}
+	fbc.shown[fbc.pos] = NOCELL;
+}
+
+// Put c at the cursor and move it on, maybe off the bottom.
+static void fbrender(int c, uint32 color){
+	int pos = fbc.pos;
+
+	if (c == '\n') {
+		pos += fbc.cols - pos % fbc.cols;
+	} else if (c == BACKSPACE) {
+		if (pos > 0) --pos;
+	} else if (c == '\t') {
+		pos += TAB_SIZE - (pos % fbc.cols) % TAB_SIZE;
+	} else {
+		fbc.cells[pos] = (c & 0xFF) | (color & 0xFF) << 8;
+		fbdirty(pos, pos);
+		pos++;
+	}
+	fbc.pos = pos;
+}
+
+// Scroll up n lines, the cursor having just gone off the bottom.
+static void fbscroll(int n){
+	int size = fbc.rows * fbc.cols;
+
+	if (n > fbc.rows)
+		n = fbc.rows;
+	memmove(fbc.cells, fbc.cells + n * fbc.cols, sizeof(fbc.cells[0]) * (size - n * fbc.cols));
+	fbc.pos -= n * fbc.cols;
+	for (int i = (fbc.rows - n) * fbc.cols; i < size; i++)
+		fbc.cells[i] = ' ' | 0x07 << 8;
+	fbdirty(0, size - 1);
+}
+
+// As cgaputs() in console.c: scroll once by as many lines as the
+// newlines still to come need.
+void fbputs(char* s, int n, uint32 color){
+	int nl = 0;
+
+	fbdirty(fbc.pos, fbc.pos); // the old cursor goes
+	for (int i = 0; i < n; i++)
+		nl += s[i] == '\n';
+	for (int i = 0; i < n; i++) {
+		nl -= s[i] == '\n';
+		fbrender(s[i] & 0xff, color);
+		if (fbc.pos >= fbc.rows * fbc.cols)
+			fbscroll(nl + 1);
+	}
+	fbflush();
+}
+
+void fbputc(int c, uint32 color){
+	fbdirty(fbc.pos, fbc.pos);
+	fbrender(c, color);
+	if (fbc.pos >= fbc.rows * fbc.cols)
+		fbscroll(1);
+	fbflush();
+}
+
+// The console's size in cells and pixels.
+void fbsize(int* cols, int* rows, int* width, int* height){
+	*cols = fbc.cols;
+	*rows = fbc.rows;
+	*width = fbc.cols * FONTW;
+	*height = fbc.rows * FONTH;
+}
+
+// Take over the console if the loader left a framebuffer we can
+// draw on. From consoleinit(), after kvmalloc().
+void fbinit(void){
+	struct multiboot_info* mb;
+	uint8* fb;
+
+	if (mbootmagic != MULTIBOOT_BOOTLOADER_MAGIC)
+		return;
+	mb = (struct multiboot_info*)p2v(mbootinfo);
+	if (!(mb->flags & MULTIBOOT_INFO_FRAMEBUFFER) || mb->framebuffer_type != MULTIBOOT_FRAMEBUFFER_RGB ||
+	    mb->framebuffer_bpp != 32 || mb->framebuffer_width < 80 * FONTW || mb->framebuffer_height < 25 * FONTH)
+		return;
+	if ((fb = (uint8*)fbmap(mb->framebuffer_addr, (uint64)mb->framebuffer_pitch * mb->framebuffer_height)) == 0)
+		return;
+	fbc.fb = fb;
+	fbc.pitch = mb->framebuffer_pitch;
+	fbc.cols = mb->framebuffer_width / FONTW;
+	fbc.rows = mb->framebuffer_height / FONTH;
+	if (fbc.cols > MAXCOLS)
+		fbc.cols = MAXCOLS;
+	if (fbc.rows > MAXROWS)
+		fbc.rows = MAXROWS;
+	for (int i = 0; i < 16; i++)
+		fbc.palette[i] = fbcolour(mb, cgargb[i]);
+	for (int i = 0; i < fbc.rows * fbc.cols; i++) {
+		fbc.cells[i] = ' ' | 0x07 << 8;
+		fbc.shown[i] = NOCELL;
+	}
+	fbdirty(0, fbc.rows * fbc.cols - 1);
+	fbflush();
+	fbactive = 1;
+	cprintf("fb: %dx%d, %d columns, %d rows\n", mb->framebuffer_width, mb->framebuffer_height,
+	        fbc.cols, fbc.rows);
+}
@@ -5,18 +5,31 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "stat.h"
 #include "vfs.h"
 #include "file.h"
 #include "spinlock.h"
+#include "poll.h"
+#include "kernel/string.h"
+
+#define RAMIN (2 << 10)   // first readahead window
+#define RAMAX (64 << 10)  // largest window
 
 struct devsw devsw[NDEV];
 struct {
-	struct spinlock lock;
-	struct file file[NFILE];
+	struct spinlock lock;  // protects ref counts
+	struct kmem_cache* cache;
 } ftable;
 
+static void filector(void* v){
+	memset(v, 0, sizeof(struct file));
+	initsleeplock(&((struct file*)v)->offlock, "file");
+}
+
 void fileinit(void){
 	initlock(&ftable.lock, "ftable");
+	ftable.cache = kmem_cache_create("file", sizeof(struct file), filector);
 }
 
 // Allocate a file structure.
@@ -24,16 +37,12 @@ struct file*
 filealloc(void){
 	struct file* f;
 
-	acquire(&ftable.lock);
-	for (f = ftable.file; f < ftable.file + NFILE; f++) {
-		if (f->ref == 0) {
-			f->ref = 1;
-			release(&ftable.lock);
-			return f;
-		}
-	}
-	release(&ftable.lock);
-	return 0;
+	if ((f = kmem_cache_alloc(ftable.cache)) == 0)
+		return 0;
+	f->ref = 1;
+	f->nonblock = 0;
+	f->ranext = f->rawin = f->raend = 0;
+	return f;
 }
 
 // Increment ref count for file f.
@@ -61,9 +70,14 @@ void fileclose(struct file* f){
 	f->ref = 0;
 	f->type = FD_NONE;
 	release(&ftable.lock);
+	if (f->epitems)
+		epollfileclose(f);
+	kmem_cache_free(ftable.cache, f);
 
 	if (ff.type == FD_PIPE)
 		pipeclose(ff.pipe, ff.writable);
+	else if (ff.type == FD_EPOLL)
+		epollclose(ff.ep);
 	else if (ff.type == FD_INODE) {
 		begin_op();
 		iput(ff.ip);
@@ -82,18 +96,74 @@ filestat(struct file* f, struct stat* st){
 }
 
 // Read from file f.
+// After a read of r bytes ending at f->off: if it carried on
+// where the last one ended, keep the window ahead of it full,
+// doubling the window each time. Must hold f->offlock.
+static void readahead(struct file* f, int r){
+	uint start;
+
+	if (r <= 0)
+		return;
+	if (f->off - r != f->ranext) {
+		// Not sequential; start over.
+		f->rawin = 0;
+		f->ranext = f->off;
+		f->raend = f->off;
+		return;
+	}
+	f->ranext = f->off;
+	if (f->raend < f->off || f->raend > f->off + RAMAX)
+		f->raend = f->off;
+	// Only refill once half the window has been used.
+	if (f->rawin && f->raend >= f->off + f->rawin / 2)
+		return;
+	f->rawin = f->rawin == 0 ? RAMIN : f->rawin * 2 > RAMAX ? RAMAX : f->rawin * 2;
+	start = f->raend;
+	if (f->off + f->rawin > start) {
+		readaheadi(f->ip, start, f->off + f->rawin - start);
+		f->raend = f->off + f->rawin;
+	}
+}
+
+// Which poll() events hold for f, waiting for changes as part of
+// pt if it isn't 0. Files and devices that don't say are always
+// ready.
+int filepoll(struct file* f, struct poller* pt){
+	struct inode* ip = f->ip;
+	int r;
+
+	if (f->type == FD_PIPE)
+		return pipepoll(f->pipe, f->writable, pt);
+	if (f->type != FD_INODE)
+		return POLLNVAL;
+	if (ip->type == T_DEV && ip->major >= 0 && ip->major < NDEV && devsw[ip->major].poll)
+		r = devsw[ip->major].poll(ip, pt);
+	else
+		r = POLLIN | POLLOUT;
+	if (!f->readable)
+		r &= ~POLLIN;
+	if (!f->writable)
+		r &= ~POLLOUT;
+	return r;
+}
+
 int fileread(struct file* f, char* addr, int n){
 	int r;
 
 	if (f->readable == 0)
 		return -1;
 	if (f->type == FD_PIPE)
-		return piperead(f->pipe, addr, n);
+		return piperead(f->pipe, addr, n, f->nonblock);
 	if (f->type == FD_INODE) {
-		ilock(f->ip);
+		// The inode lock is shared, so readers of this open
+		// file need their own lock to move the offset.
+		acquiresleep(&f->offlock);
+		ilockshared(f->ip);
 		if ((r = readi(f->ip, addr, f->off, n)) > 0)
 			f->off += r;
+		readahead(f, r);
 		iunlock(f->ip);
+		releasesleep(&f->offlock);
 		return r;
 	}
 	panic("fileread");
@@ -114,41 +184,128 @@ int fileseek(struct file *f, int offset){
 
 
 // Write to file f.
-int filewrite(struct file* f, char* addr, int n){
+// Write n bytes from addr to f's inode at *off, moving *off on.
+static int filewriteat(struct file* f, char* addr, int n, uint* off){
 	int r;
 
+	// write a few blocks at a time to avoid exceeding
+	// the maximum log transaction size, including
+	// i-node, indirect block, allocation blocks,
+	// and 2 blocks of slop for non-aligned writes.
+	// this really belongs lower down, since writei()
+	// might be writing a device like the console.
+	int max = ((MAXWRITEBLOCKS - 1 - 1 - 2) / 2) * 512;
+	int i = 0;
+	while (i < n) {
+		int n1 = n - i;
+		if (n1 > max)
+			n1 = max;
+
+		begin_opn(MAXWRITEBLOCKS);
+		ilock(f->ip);
+		if ((r = writei(f->ip, addr + i, *off, n1)) > 0)
+			*off += r;
+		iunlock(f->ip);
+		end_opn(MAXWRITEBLOCKS);
+
+		if (r < 0)
+			break;
+		if (r != n1)
+			return r;
+		i += r;
+	}
+	return i == n ? n : -1;
+}
+
+int filewrite(struct file* f, char* addr, int n){
 	if (f->writable == 0)
 		return -1;
 	if (f->type == FD_PIPE)
-		return pipewrite(f->pipe, addr, n);
-	if (f->type == FD_INODE) {
-		// write a few blocks at a time to avoid exceeding
-		// the maximum log transaction size, including
-		// i-node, indirect block, allocation blocks,
-		// and 2 blocks of slop for non-aligned writes.
-		// this really belongs lower down, since writei()
-		// might be writing a device like the console.
-		int max = ((LOGSIZE - 1 - 1 - 2) / 2) * 512;
-		int i = 0;
-		while (i < n) {
-			int n1 = n - i;
-			if (n1 > max)
-				n1 = max;
-
-			begin_op();
-			ilock(f->ip);
-			if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
-				f->off += r;
-			iunlock(f->ip);
-			end_op();
-
-			if (r < 0)
+		return pipewrite(f->pipe, addr, n, f->nonblock);
+	if (f->type == FD_INODE)
+		return filewriteat(f, addr, n, &f->off);
+	panic("filewrite");
+}
+
+// Read from f at off without using or moving its offset.
+// Pipes have no offsets.
+int filepread(struct file* f, char* addr, int n, uint off){
+	int r;
+
+	if (f->readable == 0 || f->type != FD_INODE)
+		return -1;
+	ilockshared(f->ip);
+	r = readi(f->ip, addr, off, n);
+	iunlock(f->ip);
+	return r;
+}
+
+// Write to f at off, the same way.
+int filepwrite(struct file* f, char* addr, int n, uint off){
+	if (f->writable == 0 || f->type != FD_INODE)
+		return -1;
+	return filewriteat(f, addr, n, &off);
+}
+
+// Copy up to n bytes of in's file, from *off or from in's offset if
+// off is 0, to out without going through user memory, and move the
+// offset on. Pages are passed on straight from the page cache where
+// there is one, so a pipe reader gets the only copy.
+int filesendfile(struct file* out, struct file* in, uint* off, int n){
+	struct inode* ip = in->ip;
+	char* page, * src, * bounce = 0;
+	uint* pos = off ? off : &in->off;
+	int tot = 0, m, r = 0;
+
+	if (in->readable == 0 || in->type != FD_INODE || out->writable == 0)
+		return -1;
+	if (off == 0)
+		acquiresleep(&in->offlock);
+	while (tot < n) {
+		ilockshared(ip);
+		if (ip->type != T_FILE || *pos >= ip->size) {
+			r = ip->type != T_FILE ? -1 : 0;
+			iunlock(ip);
+			break;
+		}
+		m = n - tot;
+		if (m > PGSIZE - *pos % PGSIZE)
+			m = PGSIZE - *pos % PGSIZE;
+		if (m > ip->size - *pos)
+			m = ip->size - *pos;
+		page = ip->ops->pagecache ? pagecache_map(ip, *pos / PGSIZE) : 0;
+		if (page) {
+			src = page + *pos % PGSIZE;
+		} else {
+			if ((bounce == 0 && (bounce = kalloc()) == 0) || (m = readi(ip, bounce, *pos, m)) <= 0) {
+				r = -1;
+				iunlock(ip);
 				break;
-			if (r != n1)
-				return r;
-			i += r;
+			}
+			src = bounce;
+		}
+		iunlock(ip);
+
+		// out may be the same inode, so this is without ip locked.
+		r = out->type == FD_PIPE ? pipewrite(out->pipe, src, m, out->nonblock) : filewrite(out, src, m);
+		if (page)
+			kfree(page);
+		if (r <= 0)
+			break;
+		*pos += r;
+		tot += r;
+		if (off == 0) {
+			ilockshared(ip);
+			readahead(in, r);
+			iunlock(ip);
 		}
-		return i == n ? n : -1;
+		if (r < m)
+			break;
 	}
-	panic("filewrite");
+	if (off == 0)
+		releasesleep(&in->offlock);
+	if (bounce)
+		kfree(bounce);
+	return tot > 0 ? tot : r;
 }
+
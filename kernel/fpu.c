@@ -0,0 +1,172 @@
+// FPU, SSE and AVX state.
+//
+// The kernel itself never touches these registers, so a process's
+// state only has to be kept apart from other processes'. A process
+// that has never used them has no save area and runs with CR0.TS
+// set; its first FPU or SIMD instruction traps (T_DEVICE), and
+// fputrap() gives it an area holding the initial state and loads
+// it. From then on sched() saves the registers into the area
+// whenever it was switched in with them live, with xsaveopt if the
+// CPU has it (which skips parts unchanged since the last restore),
+// else xsave, else fxsave.
+//
+// Restores are lazy: switching in, a process whose state is still
+// in this cpu's registers (nobody else loaded theirs here since,
+// and it hasn't run elsewhere) gets TS cleared and pays nothing;
+// any other gets TS set and restores on first use.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "slab.h"
+#include "kernel/string.h"
+
+#define XCR0_X87  0x1
+#define XCR0_SSE  0x2
+#define XCR0_AVX  0x4
+
+#define MXCSR_DEFAULT 0x1F80 // all SIMD exceptions masked
+
+static struct {
+	uint64 xcr0;         // components saved, if xsave is in use
+	int xsave;
+	int xsaveopt;
+	uint size;           // bytes in a save area
+	struct kmem_cache* cache;
+	char* init;          // the state after fninit, to start from
+} fpu;
+
+static void fpusave(char* area){
+	uint lo = fpu.xcr0, hi = fpu.xcr0 >> 32;
+
+	if (fpu.xsaveopt)
+		asm volatile ("xsaveopt64 (%0)" : : "r" (area), "a" (lo), "d" (hi) : "memory");
+	else if (fpu.xsave)
+		asm volatile ("xsave64 (%0)" : : "r" (area), "a" (lo), "d" (hi) : "memory");
+	else
+		asm volatile ("fxsave64 (%0)" : : "r" (area) : "memory");
+}
+
+static void fpurestore(char* area){
+	uint lo = fpu.xcr0, hi = fpu.xcr0 >> 32;
+
+	if (fpu.xsave)
+		asm volatile ("xrstor64 (%0)" : : "r" (area), "a" (lo), "d" (hi) : "memory");
+	else
+		asm volatile ("fxrstor64 (%0)" : : "r" (area) : "memory");
+}
+
+// Turn on the FPU and SSE, and AVX through xsave if there is
+// one, on this cpu. The first call, on the boot cpu, also works
+// out the save area and its initial contents. After seginit().
+void fpuinit(void){
+	uint regs[4], ecx1;
+	uint mxcsr = MXCSR_DEFAULT;
+
+	amd64_cpuid(1, regs);
+	ecx1 = regs[2];
+	lcr0((rcr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+	lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	if (ecx1 & (1 << 26)) {
+		lcr4(rcr4() | CR4_OSXSAVE);
+		if (cpu->id == 0) {
+			fpu.xsave = 1;
+			fpu.xcr0 = XCR0_X87 | XCR0_SSE;
+			if (ecx1 & (1 << 28))
+				fpu.xcr0 |= XCR0_AVX;
+		}
+		asm volatile ("xsetbv" : : "c" (0), "a" ((uint)fpu.xcr0), "d" ((uint)(fpu.xcr0 >> 32)));
+	}
+	asm volatile ("fninit; ldmxcsr %0" : : "m" (mxcsr));
+
+	if (cpu->id == 0) {
+		fpu.size = 512;
+		if (fpu.xsave) {
+			amd64_cpuidcount(0xD, 0, regs);
+			fpu.size = regs[1];
+			amd64_cpuidcount(0xD, 1, regs);
+			fpu.xsaveopt = regs[0] & 1;
+		}
+		// Areas must be 64-byte aligned; slab objects of a size
+		// that is a multiple of 64 are.
+		fpu.size = (fpu.size + 63) & ~63;
+		if (fpu.size > PGSIZE)
+			panic("fpuinit: save area too large");
+		fpu.cache = kmem_cache_create("fpu", fpu.size, 0);
+		if ((fpu.init = kmem_cache_alloc(fpu.cache)) == 0)
+			panic("fpuinit");
+		memset(fpu.init, 0, fpu.size);
+		fpusave(fpu.init);
+		cprintf("fpu: %s, %d-byte save area%s\n", fpu.xsaveopt ? "xsaveopt" : fpu.xsave ? "xsave" : "fxsave",
+		        fpu.size, (fpu.xcr0 & XCR0_AVX) ? ", AVX" : "");
+	}
+	lcr0(rcr0() | CR0_TS);
+}
+
+// The current process used the FPU with TS set. Returns -1 if it
+// has no save area and there is no memory for one.
+int fputrap(void){
+	if (proc->fpu == 0) {
+		if ((proc->fpu = kmem_cache_alloc(fpu.cache)) == 0)
+			return -1;
+		memmove(proc->fpu, fpu.init, fpu.size);
+	}
+	clts();
+	fpurestore(proc->fpu);
+	cpu->fpuowner = proc;
+	proc->fpucpu = cpu;
+	return 0;
+}
+
+// The current process is about to be switched out: save its
+// registers if they are live. Interrupts must be off.
+void fpuswitchout(void){
+	if (rcr0() & CR0_TS)
+		return;
+	fpusave(proc->fpu);
+	lcr0(rcr0() | CR0_TS);
+}
+
+// p is being switched in on this cpu, with TS set by whoever was
+// switched out; let it at the registers if they still hold its
+// state. Interrupts must be off.
+void fpuswitchin(struct proc* p){
+	if (p->fpu && p->fpucpu == cpu && cpu->fpuowner == p)
+		clts();
+}
+
+// Give np, a new child of the current process, a copy of its
+// FPU state. Returns -1 if out of memory.
+int fpufork(struct proc* np){
+	if (proc->fpu == 0)
+		return 0;
+	if ((np->fpu = kmem_cache_alloc(fpu.cache)) == 0)
+		return -1;
+	pushcli();
+	if ((rcr0() & CR0_TS) == 0)
+		fpusave(proc->fpu);
+	popcli();
+	memmove(np->fpu, proc->fpu, fpu.size);
+	return 0;
+}
+
+// exec: start the current process over from the initial state.
+void fpuexec(void){
+	pushcli();
+	if (cpu->fpuowner == proc)
+		cpu->fpuowner = 0;
+	lcr0(rcr0() | CR0_TS);
+	fpufree(proc);
+	popcli();
+}
+
+// Free p's save area.
+void fpufree(struct proc* p){
+	if (p->fpu)
+		kmem_cache_free(fpu.cache, p->fpu);
+	p->fpu = 0;
+	p->fpucpu = 0;
+}
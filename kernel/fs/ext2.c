@@ -6,6 +6,28 @@
     * https://engineering.purdue.edu/~ee469/lectures/469_lec22_part3.pdf
     * https://web.archive.org/web/20211027105440/https://wiki.osdev.org/Ext2
     * http://www.science.smith.edu/~nhowe/Teaching/csc262/oldlabs/ext2.html
+
+  The superblock and all the block group descriptors are read once,
+  by ext2_init_dev(), and kept. Everything else is read a whole ext2
+  block at a time through the buffer cache, as spb sectors from
+  sector block * spb, so each block is always one buffer. The
+  superblock is the exception: it is sectors 2 and 3 whatever the
+  block size, and goes as two one-sector buffers, so probing an fs1
+  disk for it leaves nothing fs1 would read differently.
+
+  ext2 has no journal. Changes go to the buffer cache as delayed
+  writes, which the flusher, sync() and fsync() push out; a crash
+  may leave work for e2fsck, as it does on other systems.
+
+  Blocks are allocated from the one after the file's previous block,
+  or for its first from the start of its inode's block group, so
+  files stay near their inodes. Each allocation also takes the
+  EXT2_PREALLOC - 1 free blocks after the one it found, if it can;
+  the file's next blocks come from these without touching the
+  bitmap, so files written sequentially land contiguously even when
+  others are being written at the same time. Blocks preallocated
+  and not used go back when the file is truncated or its last
+  reference goes.
 */
 
 #include "types.h"
@@ -16,16 +38,51 @@
 #include "defs.h"
 #include "kernel/string.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "mmu.h"
+#include "vfs.h"
+#include "fs/fs1.h"
 
 
 struct ext2_superblock sb;
 #define DISK_SECTOR_SIZE 512
+#define EXT2_PREALLOC 8   // blocks an allocation tries to take
+
+// ext2's own use of ip->addrs[], after the block pointers.
+#define EXT2_ISECT (EXT2_N_BLOCKS + 0)  // sectors in use (i_blocks)
+#define EXT2_ILAST (EXT2_N_BLOCKS + 1)  // block allocated last, or 0
+#define EXT2_IPA   (EXT2_N_BLOCKS + 2)  // first preallocated block
+#define EXT2_INPA  (EXT2_N_BLOCKS + 3)  // how many
+
+// The mounted volume.
+static struct {
+    uint32 dev;
+    uint32 blocksize;
+    uint32 spb;                       // sectors per block
+    uint32 apb;                       // block addresses per block
+    uint32 inodesize;
+    uint32 ngroups;
+    struct ext2_blockgroupdesc *bgd;  // all ngroups of them
+    struct sleeplock alloc;           // bitmaps, and free counts here and in sb
+    uint32 dirgroup;                  // group of the last directory made
+} ext2;
 
 extern uint64 ROOT_DEV;
 
-static inline void readblock(uint16 devt, uint32 devnum, uint64 blocknum, uint32 blocksize, void *buf, int n);
+static struct buf *ext2_bread(uint32 block) {
+    return breadsharedn(ext2.dev, block * ext2.spb, ext2.spb);
+}
+
+// Like ext2_bread, for changing the block.
+static struct buf *ext2_breadw(uint32 block) {
+    return breadn(ext2.dev, block * ext2.spb, ext2.spb);
+}
 
 uint8 ext2_init_dev(uint16 devt, uint32 devnum) {
+    uint32 gdblock, perblock, bytes;
+
+    if (ext2.bgd != 0 && ext2.dev == TODEVNUM(devt, devnum))
+        return 1; // already mounted
     ext2_readsb(devt, devnum, &sb);
     if (sb.ext2_signature != FS_EXT2_SIGNATURE) {
         return 0;
@@ -35,125 +92,774 @@ uint8 ext2_init_dev(uint16 devt, uint32 devnum) {
         cprintf("unsupported block size (%d bytes) - unmountable\n", blocksize);
         return 0;
     }
+    if (sb.major_ver >= 1 && (sb.required_features & ~FS_EXT2_FEATURE_FILETYPE)) {
+        cprintf("unsupported ext2 features 0x%x - unmountable\n", sb.required_features);
+        return 0;
+    }
+    if (sb.blocks_in_group == 0 || sb.inodes_in_group == 0) {
+        cprintf("bad ext2 superblock - unmountable\n");
+        return 0;
+    }
+
+    ext2.dev = TODEVNUM(devt, devnum);
+    ext2.blocksize = blocksize;
+    ext2.spb = blocksize / DISK_SECTOR_SIZE;
+    ext2.apb = blocksize / sizeof(uint32);
+    ext2.inodesize = sb.major_ver >= 1 ? sb.inode_size : FS_EXT2_OLD_INODE_SIZE;
+    ext2.ngroups = (sb.block_count - sb.superblock_num + sb.blocks_in_group - 1) / sb.blocks_in_group;
+
+    // The descriptors follow the superblock's block.
+    bytes = ext2.ngroups * sizeof(struct ext2_blockgroupdesc);
+    if ((ext2.bgd = (struct ext2_blockgroupdesc*)kmalloc((bytes + PGSIZE - 1) / PGSIZE)) == 0) {
+        cprintf("no memory for ext2 group descriptors - unmountable\n");
+        return 0;
+    }
+    initsleeplock(&ext2.alloc, "ext2.alloc");
+    gdblock = sb.superblock_num + 1;
+    perblock = blocksize / sizeof(struct ext2_blockgroupdesc);
+    for (uint32 i = 0; i < ext2.ngroups; i += perblock) {
+        struct buf *bp = ext2_bread(gdblock + i / perblock);
+        uint32 n = ext2.ngroups - i < perblock ? ext2.ngroups - i : perblock;
+        memmove(&ext2.bgd[i], bp->data, n * sizeof(struct ext2_blockgroupdesc));
+        brelse(bp);
+    }
     return 1;
 }
 
+// The superblock is the 1024 bytes from byte 1024 on, whatever
+// the block size.
 void ext2_readsb(uint16 devt, uint32 devnum, struct ext2_superblock* sb2) {
-    readblock(devt, devnum, 1, FS_EXT2_SB_SIZE, &sb, FS_EXT2_SB_SIZE);
-    if (&sb != sb2) {
-        memcopy(sb2, &sb, sizeof(sb));
+    for (int i = 0; i < FS_EXT2_SB_SIZE / DISK_SECTOR_SIZE; i++) {
+        struct buf *bp = breadshared(TODEVNUM(devt, devnum), FS_EXT2_SB_SIZE / DISK_SECTOR_SIZE + i);
+        memmove((char*)sb2 + i * DISK_SECTOR_SIZE, bp->data, DISK_SECTOR_SIZE);
+        brelse(bp);
+    }
+    if (sb2 != &sb) {
+        memmove(&sb, sb2, FS_EXT2_SB_SIZE);
+    }
+}
+
+// Blocks and inodes.
+
+static void ext2_writesb(void) {
+    for (int i = 0; i < FS_EXT2_SB_SIZE / DISK_SECTOR_SIZE; i++) {
+        struct buf *bp = bread(ext2.dev, FS_EXT2_SB_SIZE / DISK_SECTOR_SIZE + i);
+        memmove(bp->data, (char*)&sb + i * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+        bdwrite(bp);
+        brelse(bp);
+    }
+}
+
+// Add to group g's free counts, and the superblock's. Must hold
+// ext2.alloc.
+static void ext2_count(uint32 g, int blocks, int inodes, int dirs) {
+    uint32 perblock = ext2.blocksize / sizeof(struct ext2_blockgroupdesc);
+    struct buf *bp;
+
+    ext2.bgd[g].unallocated_blocks += blocks;
+    ext2.bgd[g].unallocated_inodes += inodes;
+    ext2.bgd[g].dir_count += dirs;
+    bp = ext2_breadw(sb.superblock_num + 1 + g / perblock);
+    memmove(bp->data + (g % perblock) * sizeof(struct ext2_blockgroupdesc), &ext2.bgd[g],
+            sizeof(struct ext2_blockgroupdesc));
+    bdwrite(bp);
+    brelse(bp);
+    sb.unallocated_blockcnt += blocks;
+    sb.unallocated_inodecnt += inodes;
+    ext2_writesb();
+}
+
+// Blocks in group g; the last may be short.
+static uint32 ext2_groupblocks(uint32 g) {
+    uint32 left = sb.block_count - sb.superblock_num - g * sb.blocks_in_group;
+    return left < sb.blocks_in_group ? left : sb.blocks_in_group;
+}
+
+static uint32 ext2_groupstart(uint32 g) {
+    return sb.superblock_num + g * sb.blocks_in_group;
+}
+
+#define BITSET(p, i) ((p)[(i) / 8] & (1 << ((i) % 8)))
+
+// Take the first free block of group g from bit start on, and up
+// to want - 1 free ones right after it. Returns the first, setting
+// *got to how many, or 0 if there is none. Must hold ext2.alloc.
+static uint32 ext2_galloc(uint32 g, uint32 start, uint32 want, uint32 *got) {
+    uint32 nbits = ext2_groupblocks(g), bit, n;
+    struct buf *bp;
+
+    if (ext2.bgd[g].unallocated_blocks == 0 || start >= nbits)
+        return 0;
+    bp = ext2_breadw(ext2.bgd[g].block_usage_addr);
+    for (bit = start; bit < nbits; bit++) {
+        if (bit % 8 == 0 && bit + 8 <= nbits && bp->data[bit / 8] == 0xFF)
+            bit += 7; // full byte
+        else if (!BITSET(bp->data, bit))
+            break;
+    }
+    if (bit >= nbits) {
+        brelse(bp);
+        return 0;
+    }
+    for (n = 0; n < want && bit + n < nbits && !BITSET(bp->data, bit + n); n++)
+        bp->data[(bit + n) / 8] |= 1 << ((bit + n) % 8);
+    bdwrite(bp);
+    brelse(bp);
+    ext2_count(g, -(int)n, 0, 0);
+    *got = n;
+    return ext2_groupstart(g) + bit;
+}
+
+// Allocate blocks at or after goal, else anywhere, as ext2_galloc.
+static uint32 ext2_balloc(uint32 goal, uint32 want, uint32 *got) {
+    uint32 g = 0, start = 0, b = 0;
+
+    if (goal >= sb.superblock_num && goal < sb.block_count) {
+        g = (goal - sb.superblock_num) / sb.blocks_in_group;
+        start = (goal - sb.superblock_num) % sb.blocks_in_group;
+    }
+    acquiresleep(&ext2.alloc);
+    // The goal's group from the goal, the others, then the
+    // goal's group again from its start.
+    for (uint32 i = 0; i <= ext2.ngroups && b == 0; i++)
+        b = ext2_galloc((g + i) % ext2.ngroups, i == 0 ? start : 0, want, got);
+    releasesleep(&ext2.alloc);
+    return b;
+}
+
+// Free blocks [b, b+n).
+static void ext2_bfree(uint32 b, uint32 n) {
+    acquiresleep(&ext2.alloc);
+    while (n > 0) {
+        uint32 g = (b - sb.superblock_num) / sb.blocks_in_group;
+        uint32 bit = (b - sb.superblock_num) % sb.blocks_in_group, m = 0;
+        struct buf *bp = ext2_breadw(ext2.bgd[g].block_usage_addr);
+
+        for (; m < n && bit + m < ext2_groupblocks(g); m++) {
+            if (!BITSET(bp->data, bit + m))
+                panic("ext2_bfree: freeing free block");
+            bp->data[(bit + m) / 8] &= ~(1 << ((bit + m) % 8));
+        }
+        bdwrite(bp);
+        brelse(bp);
+        ext2_count(g, m, 0, 0);
+        b += m;
+        n -= m;
+    }
+    releasesleep(&ext2.alloc);
+}
+
+// Zero block b.
+static void ext2_bzero(uint32 b) {
+    struct buf *bp = ext2_breadw(b);
+
+    memset(bp->data, 0, ext2.blocksize);
+    bdwrite(bp);
+    brelse(bp);
+}
+
+// Give back the blocks preallocated for ip. Caller holds ip locked.
+static void ext2_discard(struct inode *ip) {
+    if (ip->addrs[EXT2_INPA] > 0)
+        ext2_bfree(ip->addrs[EXT2_IPA], ip->addrs[EXT2_INPA]);
+    ip->addrs[EXT2_INPA] = 0;
+}
+
+// The last reference to ip is going.
+void ext2_release(struct inode *ip) {
+    acquiresleep(&ip->lock);
+    ext2_discard(ip);
+    releasesleep(&ip->lock);
+}
+
+// A new block for ip, from its preallocation if there is one.
+// Returns 0 if the disk is full.
+static uint32 ext2_alloc(struct inode *ip) {
+    uint32 b, got, goal;
+
+    if (ip->addrs[EXT2_INPA] > 0) {
+        b = ip->addrs[EXT2_IPA]++;
+        ip->addrs[EXT2_INPA]--;
+    } else {
+        goal = ip->addrs[EXT2_ILAST] ? ip->addrs[EXT2_ILAST] + 1 :
+               ext2_groupstart((ip->inum - 1) / sb.inodes_in_group);
+        if ((b = ext2_balloc(goal, EXT2_PREALLOC, &got)) == 0)
+            return 0;
+        ip->addrs[EXT2_IPA] = b + 1;
+        ip->addrs[EXT2_INPA] = got - 1;
     }
+    ip->addrs[EXT2_ILAST] = b;
+    ip->addrs[EXT2_ISECT] += ext2.spb;
+    return b;
 }
 
+
 void ext2_ilock(struct inode *ip) {
     panic("ext2_ilock not implemented yet");
 }
 
+// The block holding the bn'th block of ip, or 0 for a hole.
+static uint32 ext2_bmap(struct inode *ip, uint32 bn) {
+    uint32 apb = ext2.apb, addr, level, span;
+    struct buf *bp;
+
+    if (bn < EXT2_NDIR_BLOCKS)
+        return ip->addrs[bn];
+    bn -= EXT2_NDIR_BLOCKS;
+
+    // Singly, doubly and triply indirect blocks map apb, apb^2 and
+    // apb^3 blocks.
+    for (level = 1, span = apb; level <= 3; level++, span *= apb) {
+        if (bn < span)
+            break;
+        bn -= span;
+    }
+    if (level > 3)
+        return 0;
+    addr = ip->addrs[EXT2_NDIR_BLOCKS + level - 1];
+    while (addr != 0 && level-- > 0) {
+        span /= apb;
+        bp = ext2_bread(addr);
+        addr = ((uint32*)bp->data)[bn / span];
+        brelse(bp);
+        bn %= span;
+    }
+    return addr;
+}
+
+// Like ext2_bmap, but allocates the block, and the indirect blocks
+// on the way to it, if they are missing. Returns 0 if the disk is
+// full.
+static uint32 ext2_bmapw(struct inode *ip, uint32 bn) {
+    uint32 apb = ext2.apb, addr, level, span, *a;
+    struct buf *bp;
+
+    if (bn < EXT2_NDIR_BLOCKS) {
+        if (ip->addrs[bn] == 0)
+            ip->addrs[bn] = ext2_alloc(ip);
+        return ip->addrs[bn];
+    }
+    bn -= EXT2_NDIR_BLOCKS;
+
+    for (level = 1, span = apb; level <= 3; level++, span *= apb) {
+        if (bn < span)
+            break;
+        bn -= span;
+    }
+    if (level > 3)
+        return 0;
+    if ((addr = ip->addrs[EXT2_NDIR_BLOCKS + level - 1]) == 0) {
+        if ((addr = ext2_alloc(ip)) == 0)
+            return 0;
+        ext2_bzero(addr);
+        ip->addrs[EXT2_NDIR_BLOCKS + level - 1] = addr;
+    }
+    while (level-- > 0) {
+        span /= apb;
+        bp = ext2_breadw(addr);
+        a = (uint32*)bp->data + bn / span;
+        if (*a == 0 && (*a = ext2_alloc(ip)) != 0) {
+            if (level > 0)
+                ext2_bzero(*a);
+            bdwrite(bp);
+        }
+        addr = *a;
+        brelse(bp);
+        if (addr == 0)
+            return 0;
+        bn %= span;
+    }
+    return addr;
+}
+
 int ext2_readi(struct inode *ip, char *dst, uint off, uint n) {
-    struct ext2_blockgroupdesc bgd;
-    uint8 devt = GETDEVTYPE(ip->dev);
-    uint32 devnum = GETDEVNUM(ip->dev);
+    uint tot, m, addr, bs = ext2.blocksize;
+    struct buf *bp;
 
-    readblock(devt, devnum, 2, sb.block_size, &bgd, sizeof(bgd));
+    if (off > ip->size || off + n < off)
+        return -1;
+    if (off + n > ip->size)
+        n = ip->size - off;
 
-    int blocksize = (1024 << sb.block_size);
-    // int blockgroup = (ip->inum - 1) / sb.inodes_in_group;
-    int index = (ip->inum - 1) % sb.inodes_in_group;
-    int inodesize = sb.major_ver >= 1 ? sb.inode_size : FS_EXT2_OLD_INODE_SIZE;
-    int containingblock = (index * inodesize) / blocksize;
-
-    char *buf = kalloc();
-    readblock(devt, devnum, containingblock + 3, sb.block_size, buf, sb.block_size);
-    memmove(dst, buf + (index * inodesize), inodesize);
-    kfree(buf);
-    return 1;
+    for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+        m = n - tot < bs - off % bs ? n - tot : bs - off % bs;
+        if ((addr = ext2_bmap(ip, off / bs)) == 0) {
+            memset(dst, 0, m);
+            continue;
+        }
+        bp = ext2_bread(addr);
+        memmove(dst, bp->data + off % bs, m);
+        // File data is kept in the page cache instead.
+        if (ip->type == T_FILE)
+            brelsecold(bp);
+        else
+            brelse(bp);
+    }
+    return n;
+}
+
+// Start reading the blocks holding [off, off+n) of ip into the
+// buffer cache without waiting for them.
+void ext2_readahead(struct inode *ip, uint off, uint n) {
+    uint bn, end, addr, bs = ext2.blocksize;
+
+    if (off >= ip->size)
+        return;
+    end = off + n > ip->size || off + n < off ? ip->size : off + n;
+    for (bn = off / bs; bn < (end + bs - 1) / bs; bn++)
+        if ((addr = ext2_bmap(ip, bn)) != 0)
+            breada(ip->dev, addr * ext2.spb, ext2.spb);
+}
+
+// Does the entry de name name? Names are cut to DIRSIZ, as paths are.
+static int ext2_namematch(char *name, struct ext2_dirent *de) {
+    uint len = de->name_len < DIRSIZ ? de->name_len : DIRSIZ;
+
+    return strncmp(name, de->name, len) == 0 && (len == DIRSIZ || name[len] == 0);
 }
 
 int ext2_writei(struct inode *ip, char *src, uint off, uint n) {
-    panic("ext2_writei not implemented yet");
+    uint tot, m, addr, bs = ext2.blocksize;
+    struct buf *bp;
+
+    if (off > ip->size || off + n < off)
+        return -1;
+
+    for (tot = 0; tot < n; tot += m, off += m, src += m) {
+        if ((addr = ext2_bmapw(ip, off / bs)) == 0)
+            break; // disk full
+        bp = ext2_breadw(addr);
+        m = n - tot < bs - off % bs ? n - tot : bs - off % bs;
+        memmove(bp->data + off % bs, src, m);
+        bdwrite(bp);
+        brelse(bp);
+    }
+
+    if (off > ip->size)
+        ip->size = off;
+    if (tot > 0)
+        ext2_iupdate(ip);
+    return tot == n ? n : (tot > 0 ? tot : -1);
 }
 
+// Bytes a directory entry with a name of len bytes takes.
+#define EXT2_DIRLEN(len) ((8 + (len) + 3) & ~3)
+
+// Write a new directory entry (name, inum) into the directory dp.
 int ext2_dirlink(struct inode *dp, char *name, uint inum) {
-    panic("ext2_dirlink not implemented yet");
+    uint off, bs = ext2.blocksize, addr, len, need, used;
+    struct ext2_dirent *de, *nde;
+    struct inode *ip;
+    struct buf *bp;
+    uint8 ft = 0;
+
+    // Check that name is not present.
+    if ((ip = ext2_dirlookup(dp, name, 0)) != 0) {
+        iput(ip);
+        return -1;
+    }
+    for (len = 0; len < DIRSIZ && name[len]; len++)
+        ;
+    need = EXT2_DIRLEN(len);
+
+    // The caller has the inode; it's been read in.
+    if (sb.major_ver >= 1 && (sb.required_features & FS_EXT2_FEATURE_FILETYPE)) {
+        ip = iget(dp->dev, inum);
+        if (ip->flags & I_VALID)
+            ft = ip->type == T_DIR ? EXT2_FT_DIR : ip->type == T_DEV ? EXT2_FT_CHRDEV : EXT2_FT_REG_FILE;
+        iput(ip);
+    }
+
+    // Look for an unused entry, or one with room after its name.
+    for (off = 0; off < dp->size; off += bs) {
+        if ((addr = ext2_bmap(dp, off / bs)) == 0)
+            continue;
+        bp = ext2_breadw(addr);
+        for (uint i = 0; i + 8 <= bs; i += de->rec_len) {
+            de = (struct ext2_dirent*)(bp->data + i);
+            if (de->rec_len < 8 || i + de->rec_len > bs)
+                break;
+            used = de->inode ? EXT2_DIRLEN(de->name_len) : 0;
+            if (de->rec_len - used < need)
+                continue;
+            if (used) {
+                nde = (struct ext2_dirent*)((char*)de + used);
+                nde->rec_len = de->rec_len - used;
+                de->rec_len = used;
+                de = nde;
+            }
+            goto found;
+        }
+        brelse(bp);
+    }
+
+    // None; add a block.
+    if ((addr = ext2_bmapw(dp, dp->size / bs)) == 0)
+        return -1;
+    bp = ext2_breadw(addr);
+    memset(bp->data, 0, bs);
+    de = (struct ext2_dirent*)bp->data;
+    de->rec_len = bs;
+    dp->size += bs;
+    ext2_iupdate(dp);
+
+found:
+    de->inode = inum;
+    de->name_len = len;
+    de->file_type = ft;
+    memmove(de->name, name, len);
+    bdwrite(bp);
+    brelse(bp);
+    return 0;
+}
+
+// Remove the entry at off in directory dp, giving its space to the
+// one before it in its block.
+int ext2_dirunlink(struct inode *dp, uint off) {
+    uint bs = ext2.blocksize, addr, prev = 0, i;
+    struct ext2_dirent *de = 0;
+    struct buf *bp;
+
+    if ((addr = ext2_bmap(dp, off / bs)) == 0)
+        return -1;
+    bp = ext2_breadw(addr);
+    for (i = 0; i < off % bs; i += de->rec_len) {
+        de = (struct ext2_dirent*)(bp->data + i);
+        if (de->rec_len < 8 || i + de->rec_len > bs)
+            break;
+        prev = i;
+    }
+    if (i != off % bs) {
+        brelse(bp);
+        return -1;
+    }
+    de = (struct ext2_dirent*)(bp->data + i);
+    if (i == 0)
+        de->inode = 0;
+    else
+        ((struct ext2_dirent*)(bp->data + prev))->rec_len += de->rec_len;
+    bdwrite(bp);
+    brelse(bp);
+    return 0;
 }
 
+// Is the directory dp empty except for "." and ".." ?
+int ext2_isdirempty(struct inode *dp) {
+    uint off, bs = ext2.blocksize, addr, empty = 1;
+    struct ext2_dirent *de;
+    struct buf *bp;
+
+    for (off = 0; off < dp->size && empty; off += bs) {
+        if ((addr = ext2_bmap(dp, off / bs)) == 0)
+            continue;
+        bp = ext2_bread(addr);
+        for (uint i = 0; i + 8 <= bs; i += de->rec_len) {
+            de = (struct ext2_dirent*)(bp->data + i);
+            if (de->rec_len < 8 || i + de->rec_len > bs)
+                break;
+            if (de->inode != 0 && !ext2_namematch(".", de) && !ext2_namematch("..", de)) {
+                empty = 0;
+                break;
+            }
+        }
+        brelse(bp);
+    }
+    return empty;
+}
+
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
 struct inode *ext2_dirlookup(struct inode *dp, char *name, uint *poff) {
-    panic("ext2_dirlookup not implemented yet");
+    uint off, bs = ext2.blocksize, addr, inum = 0, at = 0;
+    struct ext2_dirent *de;
+    struct buf *bp;
+
+    if (dp->type != T_DIR)
+        panic("dirlookup not DIR");
+
+    for (off = 0; off < dp->size && inum == 0; off += bs) {
+        if ((addr = ext2_bmap(dp, off / bs)) == 0)
+            continue;
+        bp = ext2_bread(addr);
+        for (uint i = 0; i + 8 <= bs; i += de->rec_len) {
+            de = (struct ext2_dirent*)(bp->data + i);
+            if (de->rec_len < 8 || i + de->rec_len > bs)
+                break; // corrupt; skip the rest of the block
+            if (de->inode != 0 && ext2_namematch(name, de)) {
+                inum = de->inode;
+                at = off + i;
+                break;
+            }
+        }
+        brelse(bp);
+    }
+    if (inum == 0)
+        return 0;
+    if (poff)
+        *poff = at;
+    return iget(dp->dev, inum);
 }
 
-struct inode *ext2_ialloc(uint dev, short type) {
-    panic("ext2_ialloc not implemented yet");
+// Return the next entry of dp at or after *off, as readdir().
+int ext2_readdir(struct inode *dp, uint *off, char *name, uint *inum) {
+    uint bs = ext2.blocksize, addr, i, len;
+    struct ext2_dirent *de;
+    struct buf *bp;
+
+    while (*off < dp->size) {
+        if ((addr = ext2_bmap(dp, *off / bs)) == 0) {
+            *off += bs - *off % bs;
+            continue;
+        }
+        bp = ext2_bread(addr);
+        i = *off % bs;
+        de = (struct ext2_dirent*)(bp->data + i);
+        if (i + 8 > bs || de->rec_len < 8 || i + de->rec_len > bs) {
+            brelse(bp);
+            *off += bs - i; // corrupt; skip the rest of the block
+            continue;
+        }
+        *off += de->rec_len;
+        if (de->inode != 0) {
+            len = de->name_len < DIRSIZ ? de->name_len : DIRSIZ;
+            memset(name, 0, DIRSIZ);
+            memmove(name, de->name, len);
+            *inum = de->inode;
+            brelse(bp);
+            return 1;
+        }
+        brelse(bp);
+    }
+    return 0;
 }
 
-struct inode *ext2_idup(struct inode *ip) {
-    panic("ext2_idup not implemented yet");
+// Take a free inode of group g, or return 0. Must hold ext2.alloc.
+static uint32 ext2_gialloc(uint32 g) {
+    uint32 first = sb.major_ver >= 1 ? sb.fst_nr_inode : 11, bit;
+    struct buf *bp;
+
+    if (ext2.bgd[g].unallocated_inodes == 0)
+        return 0;
+    bp = ext2_breadw(ext2.bgd[g].inode_usage_addr);
+    for (bit = 0; bit < sb.inodes_in_group; bit++)
+        if (!BITSET(bp->data, bit) && g * sb.inodes_in_group + bit + 1 >= first)
+            break;
+    if (bit == sb.inodes_in_group) {
+        brelse(bp);
+        return 0;
+    }
+    bp->data[bit / 8] |= 1 << (bit % 8);
+    bdwrite(bp);
+    brelse(bp);
+    return g * sb.inodes_in_group + bit + 1;
 }
 
+// Allocate a new inode with the given type on device dev.
+// Directories go to the group with the most free blocks, and
+// files to the group of the last directory made, near it.
+struct inode *ext2_ialloc(uint dev, short type) {
+    uint32 g = ext2.dirgroup, inum = 0, i, at;
+    struct ext2_inode *ext2i;
+    struct buf *bp;
+
+    acquiresleep(&ext2.alloc);
+    if (type == T_DIR) {
+        for (i = 0; i < ext2.ngroups; i++)
+            if (ext2.bgd[i].unallocated_inodes > 0 &&
+                ext2.bgd[i].unallocated_blocks > ext2.bgd[g].unallocated_blocks)
+                g = i;
+    }
+    for (i = 0; i < ext2.ngroups && inum == 0; i++)
+        inum = ext2_gialloc((g + i) % ext2.ngroups);
+    if (inum == 0)
+        panic("ialloc: no inodes");
+    g = (inum - 1) / sb.inodes_in_group;
+    ext2_count(g, 0, -1, type == T_DIR);
+    if (type == T_DIR)
+        ext2.dirgroup = g;
+    releasesleep(&ext2.alloc);
+
+    at = ((inum - 1) % sb.inodes_in_group) * ext2.inodesize;
+    bp = ext2_breadw(ext2.bgd[g].inode_tbl_addr + at / ext2.blocksize);
+    ext2i = (struct ext2_inode*)(bp->data + at % ext2.blocksize);
+    memset(ext2i, 0, ext2.inodesize);
+    ext2i->type = type == T_DIR ? (EXT2_IFDIR | 0755) : type == T_DEV ? (EXT2_IFCHR | 0666) : (EXT2_IFREG | 0644);
+    // There's no clock; the volume's last write is the best time known.
+    ext2i->last_accessed_at = ext2i->creation_time = ext2i->created_at = sb.write_time;
+    bdwrite(bp);
+    brelse(bp);
+    return iget(dev, inum);
+}
+
+// Copy a modified in-memory inode to disk. With ip->type 0 the
+// inode is being freed; its data is already gone.
 void ext2_iupdate(struct inode *ip) {
-    panic("ext2_iupdate not implemented yet");
+    uint32 g = (ip->inum - 1) / sb.inodes_in_group;
+    uint32 index = (ip->inum - 1) % sb.inodes_in_group;
+    uint32 at = index * ext2.inodesize;
+    struct ext2_inode *ext2i;
+    struct buf *bp;
+    int dir;
+
+    bp = ext2_breadw(ext2.bgd[g].inode_tbl_addr + at / ext2.blocksize);
+    ext2i = (struct ext2_inode*)(bp->data + at % ext2.blocksize);
+    dir = EXT2_TYPE_ISDIR(ext2i->type);
+    ext2i->hard_link_count = ip->nlink + (dir && ip->nlink > 0); // see ext2_readinode
+    ext2i->lower_size = ip->size;
+    ext2i->disk_sectors = ip->addrs[EXT2_ISECT];
+    memmove(ext2i->block_pointers, ip->addrs, EXT2_N_BLOCKS * sizeof(uint32));
+    if (ip->type == T_DEV)
+        ext2i->block_pointers[0] = (ip->major & 0xFF) << 8 | (ip->minor & 0xFF);
+    if (ip->type == 0) {
+        ext2i->hard_link_count = 0;
+        // No clock, but it must not look like an orphan list link.
+        ext2i->deleted_at = sb.write_time > sb.inode_count ? sb.write_time : sb.inode_count;
+    }
+    bdwrite(bp);
+    brelse(bp);
+
+    if (ip->type == 0) {
+        acquiresleep(&ext2.alloc);
+        bp = ext2_breadw(ext2.bgd[g].inode_usage_addr);
+        bp->data[index / 8] &= ~(1 << (index % 8));
+        bdwrite(bp);
+        brelse(bp);
+        ext2_count(g, 0, 1, dir ? -1 : 0);
+        releasesleep(&ext2.alloc);
+    }
 }
 
 int ext2_namecmp(const char *s, const char *t) {
-    panic("ext2_namecmp not implemented yet");
+    return strncmp(s, t, DIRSIZ);
 }
 
 void ext2_stati(struct inode *ip, struct stat *st) {
-    panic("ext2_stati not implemented yet");
+    st->dev = ip->dev;
+    st->ino = ip->inum;
+    st->type = ip->type;
+    st->nlink = ip->nlink;
+    st->size = ip->size;
 }
 
-void ext2_itrunc(struct inode* ip) {
-    panic("ext2_itrunc not implemented yet");
+// Blocks being freed, gathered into runs.
+struct ext2_frees {
+    uint32 start, n;
+};
+
+static void ext2_freeadd(struct ext2_frees *f, uint32 b) {
+    if (f->n > 0 && b == f->start + f->n) {
+        f->n++;
+        return;
+    }
+    if (f->n > 0)
+        ext2_bfree(f->start, f->n);
+    f->start = b;
+    f->n = 1;
 }
 
-void dump_data(uint8 *ptr, int cnt) {
-    int j = 0;
-    while(j <= cnt) {
-        for(int i = 0; i != 60; i++) {
-            cprintf("%x ", ptr[j++]);
+// Free block b and, for an indirect block of the given level,
+// the blocks under it.
+static void ext2_freetree(struct ext2_frees *f, uint32 b, int level) {
+    if (level > 0) {
+        struct buf *bp = ext2_bread(b);
+        for (uint32 i = 0; i < ext2.apb; i++)
+            if (((uint32*)bp->data)[i])
+                ext2_freetree(f, ((uint32*)bp->data)[i], level - 1);
+        brelse(bp);
+    }
+    ext2_freeadd(f, b);
+}
+
+// Truncate inode (discard contents).
+// Only called when the inode has no links to it (no directory
+// entries referring to it) and has no in-memory reference,
+// or when opened with O_TRUNC.
+void ext2_itrunc(struct inode* ip) {
+    struct ext2_frees f = {0, 0};
+
+    ext2_discard(ip);
+    if (ip->type != T_DEV) {
+        for (int i = 0; i < EXT2_N_BLOCKS; i++) {
+            if (ip->addrs[i])
+                ext2_freetree(&f, ip->addrs[i], i < EXT2_NDIR_BLOCKS ? 0 : i - EXT2_NDIR_BLOCKS + 1);
+            ip->addrs[i] = 0;
         }
-        cprintf("\n");
     }
+    if (f.n > 0)
+        ext2_bfree(f.start, f.n);
+    ip->addrs[EXT2_ISECT] = 0;
+    ip->addrs[EXT2_ILAST] = 0;
+    ip->size = 0;
+    ext2_iupdate(ip);
 }
 
 void ext2_readinode(struct inode *ip) {
     struct buf *bp;
-	struct ext2_inode *ext2i;
+    struct ext2_inode *ext2i;
+    uint32 group = (ip->inum - 1) / sb.inodes_in_group;
+    uint32 index = (ip->inum - 1) % sb.inodes_in_group;
+    uint32 at = index * ext2.inodesize;
 
-    int blocksize = (1024 << sb.block_size);
-    int index = (ip->inum - 1) % sb.inodes_in_group;
-    int inodesize = sb.major_ver >= 1 ? sb.inode_size : FS_EXT2_OLD_INODE_SIZE;
-    int block = (index * inodesize) / blocksize;
-    cprintf("About to read block %d\n", block);
-
-    bp = bread(ip->dev, block + 2);
-    dump_data(bp->data, 4096);
-    cprintf("Seeking to inode @ index %d\n", index);
-    ext2i = (struct ext2_inode*)bp->data + (index * sizeof(struct ext2_inode));
-    dump_data((uint8 *)ext2i, sizeof(struct ext2_inode));
-    if (EXT2_TYPE_ISREG(ext2i->type)) {
-        ip->type = T_FILE;
-    } else if (EXT2_TYPE_ISDIR(ext2i->type)) {
+    if (ip->inum == 0 || group >= ext2.ngroups) {
+        ip->type = 0;
+        return;
+    }
+    bp = ext2_bread(ext2.bgd[group].inode_tbl_addr + at / ext2.blocksize);
+    ext2i = (struct ext2_inode*)(bp->data + at % ext2.blocksize);
+    memmove(ip->addrs, ext2i->block_pointers, EXT2_N_BLOCKS * sizeof(uint32));
+    ip->major = ip->minor = 0;
+    if (EXT2_TYPE_ISDIR(ext2i->type)) {
         ip->type = T_DIR;
+    } else if (EXT2_TYPE_ISCHR(ext2i->type)) {
+        ip->type = T_DEV;
+        ip->major = (ext2i->block_pointers[0] >> 8) & 0xFF;
+        ip->minor = ext2i->block_pointers[0] & 0xFF;
+        ip->addrs[0] = 0;
+    } else if (ext2i->type != 0) {
+        ip->type = T_FILE; // symlinks and the rest read as plain files
     } else {
-        cprintf("Uknown type %d\n", ext2i->type);
-        ip->type = 0; // unknown!
+        ip->type = 0; // free
     }
     ip->nlink = ext2i->hard_link_count;
+    // ext2 counts a directory's "." as a link; the rest of the
+    // kernel doesn't.
+    if (ip->type == T_DIR && ip->nlink > 0)
+        ip->nlink--;
     ip->size = ext2i->lower_size;
-    memmove(ip->addrs, ext2i->block_pointers, sizeof(ext2i->block_pointers));
+    ip->addrs[EXT2_ISECT] = ext2i->disk_sectors;
+    ip->addrs[EXT2_ILAST] = 0;
+    ip->addrs[EXT2_INPA] = 0;
     brelse(bp);
 }
 
-static inline void readblock(uint16 devt, uint32 devnum, uint64 blocknum, uint32 blocksize, void *buf, int n) {
-    uint32 spb = blocksize / DISK_SECTOR_SIZE; // 2
-    uint64 start = blocknum * spb;
-    uint32 legacydevid = TODEVNUM(devt, devnum);
+// Delayed writes aren't tracked per file, so write them all.
+static int ext2_fsync(struct inode *ip) {
+    bsync();
+    return 0;
+}
 
-    for(uint8 i = 0; i != spb && n > 0; i++) {
-        struct buf* bp = bread(legacydevid, start + i);
-        void *offset = buf + (DISK_SECTOR_SIZE * i);
-        memcopy(offset, &bp->data[0], n > DISK_SECTOR_SIZE ? DISK_SECTOR_SIZE : 0);
-        n -= DISK_SECTOR_SIZE;
-        brelse(bp);
-    }
+static void ext2_vfsreadsb(int dev, struct superblock *sb) {
+    ext2_readsb(GETDEVTYPE(dev), GETDEVNUM(dev), (struct ext2_superblock*)sb);
 }
+
+struct fsops ext2_ops = {
+    .type       = FS_TYPE_EXT2,
+    .rootino    = EXT2_ROOT_INO,
+    .pagecache  = 1,
+    .readsb     = ext2_vfsreadsb,
+    .ialloc     = ext2_ialloc,
+    .readinode  = ext2_readinode,
+    .iupdate    = ext2_iupdate,
+    .itrunc     = ext2_itrunc,
+    .release    = ext2_release,
+    .readi      = ext2_readi,
+    .writei     = ext2_writei,
+    .readahead  = ext2_readahead,
+    .stati      = ext2_stati,
+    .dirlookup  = ext2_dirlookup,
+    .dirlink    = ext2_dirlink,
+    .dirunlink  = ext2_dirunlink,
+    .isdirempty = ext2_isdirempty,
+    .readdir    = ext2_readdir,
+    .fsync      = ext2_fsync,
+};
@@ -47,40 +47,132 @@ static void fs1_bzero(int dev, int bno){
 }
 
 // Blocks.
+//
+// Each device's superblock and count of free blocks are kept in
+// memory from its first use, with a cursor where the last search
+// for a free block ended. fs1_balloc() looks from just after the
+// block given as a hint, normally the file's previous one, so
+// files come out contiguous, else from the cursor; either way
+// it skips full bitmap bytes and blocks and never rescans the
+// full part of the disk from the start.
 
-// Allocate a zeroed disk block.
-static uint fs1_balloc(uint dev){
-	int b, bi, m;
-	struct buf* bp;
+#define NFS1DEV 4  // devices with cached allocation state
+
+struct fs1_alloc {
+	int used;
+	uint dev;
 	struct fs1_superblock sb;
+	uint nfree;    // free blocks
+	uint cursor;   // where to look next without a hint
+};
 
-	bp = 0;
-	fs1_readsb(dev, &sb);
-	for (b = 0; b < sb.size; b += BPB) {
-		bp = bread(dev, BBLOCK(b, sb.ninodes));
-		for (bi = 0; bi < BPB && b + bi < sb.size; bi++) {
-			m = 1 << (bi % 8);
-			if ((bp->data[bi / 8] & m) == 0) { // Is block free?
-				bp->data[bi / 8] |= m; // Mark block in use.
-				log_write(bp);
-				brelse(bp);
-				fs1_bzero(dev, b + bi);
-				return b + bi;
-			}
+static struct {
+	struct spinlock lock;   // protects nfree and cursor
+	struct sleeplock init;  // serializes reading in a device
+	struct fs1_alloc dev[NFS1DEV];
+} fs1_allocs;
+
+// Return dev's allocation state, reading the superblock and
+// counting free blocks the first time.
+static struct fs1_alloc* fs1_allocof(uint dev){
+	struct fs1_alloc* a;
+	struct buf* bp;
+	int b, bi;
+
+	for (a = fs1_allocs.dev; a < &fs1_allocs.dev[NFS1DEV]; a++)
+		if (a->used && a->dev == dev)
+			return a;
+
+	acquiresleep(&fs1_allocs.init);
+	for (a = fs1_allocs.dev; a < &fs1_allocs.dev[NFS1DEV]; a++)
+		if (a->used && a->dev == dev)
+			break;
+	if (a == &fs1_allocs.dev[NFS1DEV]) {
+		for (a = fs1_allocs.dev; a < &fs1_allocs.dev[NFS1DEV]; a++)
+			if (!a->used)
+				break;
+		if (a == &fs1_allocs.dev[NFS1DEV])
+			panic("fs1_allocof: too many devices");
+		a->dev = dev;
+		fs1_readsb(dev, &a->sb);
+		a->nfree = 0;
+		for (b = 0; b < a->sb.size; b += BPB) {
+			bp = bread(dev, BBLOCK(b, a->sb.ninodes));
+			for (bi = 0; bi < BPB && b + bi < a->sb.size; bi++)
+				if ((bp->data[bi / 8] & (1 << (bi % 8))) == 0)
+					a->nfree++;
+			brelse(bp);
 		}
-		brelse(bp);
+		a->cursor = 0;
+		__sync_synchronize();
+		a->used = 1;
+	}
+	releasesleep(&fs1_allocs.init);
+	return a;
+}
+
+// Find and mark a free block in the bitmap block holding block
+// b, from b to the end of the bitmap block. Returns it, or 0.
+static uint fs1_bscan(struct fs1_alloc* a, uint b){
+	struct buf* bp;
+	uint base = b - b % BPB, bi, end;
+
+	end = a->sb.size - base < BPB ? a->sb.size - base : BPB;
+	bp = bread(a->dev, BBLOCK(base, a->sb.ninodes));
+	for (bi = b % BPB; bi < end; bi++) {
+		int m = 1 << (bi % 8);
+		if (bi % 8 == 0 && bp->data[bi / 8] == 0xFF) { // all in use
+			bi += 7;
+			continue;
+		}
+		if ((bp->data[bi / 8] & m) == 0) { // Is block free?
+			bp->data[bi / 8] |= m; // Mark block in use.
+			log_write(bp);
+			brelse(bp);
+			return base + bi;
+		}
+	}
+	brelse(bp);
+	return 0;
+}
+
+// Allocate a zeroed disk block, near the block hint if not 0.
+static uint fs1_balloc(uint dev, uint hint){
+	struct fs1_alloc* a = fs1_allocof(dev);
+	uint start, b, got = 0;
+
+	acquire(&fs1_allocs.lock);
+	if (a->nfree == 0) {
+		release(&fs1_allocs.lock);
+		panic("fs1_balloc: out of blocks");
 	}
-	panic("fs1_balloc: out of blocks");
+	start = hint && hint + 1 < a->sb.size ? hint + 1 : a->cursor;
+	release(&fs1_allocs.lock);
+
+	// From start to the end of the disk, then around from 0;
+	// block 0 is never free.
+	for (b = start; got == 0 && b < a->sb.size; b += BPB - b % BPB)
+		got = fs1_bscan(a, b);
+	for (b = 0; got == 0 && b < start; b += BPB)
+		got = fs1_bscan(a, b);
+	if (got == 0)
+		panic("fs1_balloc: out of blocks");
+
+	acquire(&fs1_allocs.lock);
+	a->nfree--;
+	a->cursor = got + 1 < a->sb.size ? got + 1 : 0;
+	release(&fs1_allocs.lock);
+	fs1_bzero(dev, got);
+	return got;
 }
 
 // Free a disk block.
 static void fs1_bfree(int dev, uint b){
+	struct fs1_alloc* a = fs1_allocof(dev);
 	struct buf* bp;
-	struct fs1_superblock sb;
 	int bi, m;
 
-	fs1_readsb(dev, &sb);
-	bp = bread(dev, BBLOCK(b, sb.ninodes));
+	bp = bread(dev, BBLOCK(b, a->sb.ninodes));
 	bi = b % BPB;
 	m = 1 << (bi % 8);
 	if ((bp->data[bi / 8] & m) == 0)
@@ -88,6 +180,9 @@ static void fs1_bfree(int dev, uint b){
 	bp->data[bi / 8] &= ~m;
 	log_write(bp);
 	brelse(bp);
+	acquire(&fs1_allocs.lock);
+	a->nfree++;
+	release(&fs1_allocs.lock);
 }
 
 // Inodes.
@@ -115,24 +210,24 @@ static void fs1_bfree(int dev, uint b){
 //   is non-zero. ialloc() allocates, iput() frees if
 //   the link count has fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() to find or
-//   create a cache entry and increment its ref, iput()
-//   to decrement ref.
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to the entry (open files and current
+//   directories). iget() to find or create a cache entry
+//   and increment its ref, iput() to decrement ref. The
+//   cache is shared by all file systems (see vfs.c); an
+//   entry whose ref is zero stays cached until it's reused.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when the I_VALID bit
 //   is set in ip->flags. ilock() reads the inode from
 //   the disk and sets I_VALID, while iput() clears
-//   I_VALID if ip->ref has fallen to zero.
+//   I_VALID if it frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
-//   has first locked the inode. The I_BUSY flag indicates
-//   that the inode is locked. ilock() sets I_BUSY,
-//   while iunlock clears it.
+//   has first locked the inode's sleep lock. ilock() takes
+//   it exclusively, ilockshared() shared with other readers
+//   (readi, dirlookup), and iunlock() releases either.
 //
 // Thus a typical sequence is:
 //   ip = iget(dev, inum)
@@ -152,17 +247,12 @@ static void fs1_bfree(int dev, uint b){
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 
-struct {
-	struct spinlock lock;
-	struct inode inode[NINODE];
-} fs1_icache;
-
 void fs1_iinit(void){
-	initlock(&fs1_icache.lock, "fs1_icache");
+	initlock(&fs1_allocs.lock, "fs1_allocs");
+	initsleeplock(&fs1_allocs.init, "fs1_allocs.init");
 }
 
 extern uint64 ROOT_DEV;
-static struct inode* fs1_iget(uint dev, uint inum);
 
 
 // Allocate a new inode with the given type on device dev.
@@ -171,11 +261,9 @@ struct inode* fs1_ialloc(uint dev, short type){
 	int inum;
 	struct buf* bp;
 	struct dinode* dip;
-	struct fs1_superblock sb;
-
-	fs1_readsb(dev, &sb);
+	struct fs1_superblock* sb = &fs1_allocof(dev)->sb;
 
-	for (inum = 1; inum < sb.ninodes; inum++) {
+	for (inum = 1; inum < sb->ninodes; inum++) {
 		bp = bread(dev, IBLOCK(inum));
 		dip = (struct dinode*)bp->data + inum % IPB;
 		if (dip->type == 0) { // a free inode
@@ -183,7 +271,7 @@ struct inode* fs1_ialloc(uint dev, short type){
 			dip->type = type;
 			log_write(bp); // mark it allocated on the disk
 			brelse(bp);
-			return fs1_iget(dev, inum);
+			return iget(dev, inum);
 		}
 		brelse(bp);
 	}
@@ -207,66 +295,186 @@ void fs1_iupdate(struct inode* ip){
 	brelse(bp);
 }
 
-// Find the inode with number inum on device dev
-// and return the in-memory copy. Does not lock
-// the inode and does not read it from disk.
-static struct inode* fs1_iget(uint dev, uint inum){
-	struct inode* ip, * empty;
 
-	acquire(&fs1_icache.lock);
 
-	// Is the inode already cached?
-	empty = 0;
-	for (ip = &fs1_icache.inode[0]; ip < &fs1_icache.inode[NINODE]; ip++) {
-		if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-			ip->ref++;
-			release(&fs1_icache.lock);
-			return ip;
-		}
-		if (empty == 0 && ip->ref == 0) // Remember empty slot.
-			empty = ip;
+// Inode content
+//
+// The content (data) associated with each inode is stored
+// in blocks on the disk. The first NDIRECT block numbers
+// are listed in ip->addrs[].  The next NINDIRECT blocks are
+// listed in block ip->addrs[NDIRECT].
+//
+// On a file system made with FS1_EXTENTS, ip->addrs[] holds
+// extents instead (see fs1.h). Files only grow at the end, so
+// a new block extends the last extent if the allocator put it
+// right after it, else starts a new one.
+//
+// Each inode remembers the last run of blocks contiguous on disk
+// that a lookup found, so sequential reads and writes map most
+// blocks without reading the indirect or extent block. Blocks
+// only move when the file is truncated, which forgets the run.
+
+// Look bn up in ip's cached run. Returns 0 if it isn't there.
+static uint fs1_mapget(struct inode* ip, uint bn, uint* run){
+	uint addr = 0;
+
+	acquire(&ip->maplock);
+	if (bn - ip->mapbn < ip->maplen) {
+		addr = ip->mapaddr + bn - ip->mapbn;
+		*run = ip->maplen - (bn - ip->mapbn);
 	}
+	release(&ip->maplock);
+	return addr;
+}
 
-	// Recycle an inode cache entry.
-	if (empty == 0)
-		panic("fs1_iget: no inodes");
+// Remember that file blocks [bn, bn+len) are at addr on. With
+// len 0, that bn was just allocated at addr, growing the run if
+// it follows on.
+static void fs1_mapset(struct inode* ip, uint bn, uint addr, uint len){
+	acquire(&ip->maplock);
+	if (len == 0 && ip->maplen && bn == ip->mapbn + ip->maplen &&
+	    addr == ip->mapaddr + ip->maplen) {
+		ip->maplen++;
+	} else {
+		ip->mapbn = bn;
+		ip->mapaddr = addr;
+		ip->maplen = len ? len : 1;
+	}
+	release(&ip->maplock);
+}
 
-	ip = empty;
-	ip->dev = dev;
-	ip->inum = inum;
-	ip->ref = 1;
-	ip->flags = 0;
-	release(&fs1_icache.lock);
+static int fs1_extents(uint dev){
+	return fs1_allocof(dev)->sb.flags & FS1_EXTENTS;
+}
 
-	return ip;
+// Extent i of ip, reading the extent block into *bpp if need be.
+// Returns 0 past the last extent slot in use.
+static struct fs1_extent* fs1_extent(struct inode* ip, int i, struct buf** bpp, int write){
+	if (i < NDEXTENT)
+		return (struct fs1_extent*)ip->addrs + i;
+	if (i >= NEXTENT || ip->addrs[NDIRECT] == 0)
+		return 0;
+	if (*bpp == 0)
+		*bpp = write ? bread(ip->dev, ip->addrs[NDIRECT]) : breadshared(ip->dev, ip->addrs[NDIRECT]);
+	return (struct fs1_extent*)(*bpp)->data + i - NDEXTENT;
 }
 
-// Increment reference count for ip.
-// Returns ip to enable ip = idup(ip1) idiom.
-struct inode* fs1_idup(struct inode* ip){
-	acquire(&fs1_icache.lock);
-	ip->ref++;
-	release(&fs1_icache.lock);
-	return ip;
+// Find block bn of extent-mapped ip. Returns its address, or 0
+// past the end, and sets *run to the blocks from it to the end
+// of its extent.
+static uint fs1_elookup(struct inode* ip, uint bn, uint* run){
+	struct buf* bp = 0;
+	struct fs1_extent* e;
+	uint addr = 0;
+
+	*run = 1;
+	for (int i = 0; (e = fs1_extent(ip, i, &bp, 0)) != 0 && e->len != 0; i++) {
+		if (bn < e->len) {
+			addr = e->start + bn;
+			*run = e->len - bn;
+			break;
+		}
+		bn -= e->len;
+	}
+	if (bp)
+		brelse(bp);
+	return addr;
 }
 
+// fs1_bmap for extent-mapped ip. Returns 0 if ip has no room
+// for another extent.
+static uint fs1_ebmap(struct inode* ip, uint bn){
+	struct buf* bp = 0;
+	struct fs1_extent* e, * last = 0;
+	uint addr = 0, nb = 0;
+	int i, dirty = 0;
 
-// Inode content
-//
-// The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+	for (i = 0; (e = fs1_extent(ip, i, &bp, 1)) != 0 && e->len != 0; i++) {
+		nb += e->len;
+		last = e;
+	}
+	// Append up to bn; mkfs leaves some directories ending in a hole.
+	for (; nb <= bn; nb++) {
+		addr = fs1_balloc(ip->dev, last ? last->start + last->len - 1 : 0);
+		if (last && addr == last->start + last->len) {
+			last->len++;
+		} else if (i < NEXTENT) {
+			if (i == NDEXTENT && ip->addrs[NDIRECT] == 0)
+				ip->addrs[NDIRECT] = fs1_balloc(ip->dev, 0); // zeroed
+			last = fs1_extent(ip, i++, &bp, 1);
+			last->start = addr;
+			last->len = 1;
+		} else {
+			fs1_bfree(ip->dev, addr);
+			addr = 0;
+			break;
+		}
+		if (i > NDEXTENT)
+			dirty = 1; // last is in the extent block
+	}
+	if (bp) {
+		if (dirty)
+			log_write(bp);
+		brelse(bp);
+	}
+	return addr;
+}
+
+// Return a[i], setting *run to how many entries from there on
+// hold consecutive blocks.
+static uint fs1_brun(uint* a, uint i, uint n, uint* run){
+	*run = 1;
+	if (a[i] == 0)
+		return 0;
+	while (i + *run < n && a[i + *run] == a[i] + *run)
+		(*run)++;
+	return a[i];
+}
+
+// Like fs1_bmap, but never allocates: returns 0 for a hole.
+// Sets *run to the blocks from bn on known to follow it on disk.
+// Safe under a shared inode lock.
+static uint fs1_blookup(struct inode* ip, uint bn, uint* run){
+	uint addr;
+	struct buf* bp;
+
+	if ((addr = fs1_mapget(ip, bn, run)) != 0)
+		return addr;
+	if (fs1_extents(ip->dev)) {
+		addr = fs1_elookup(ip, bn, run);
+	} else if (bn < NDIRECT) {
+		addr = fs1_brun(ip->addrs, bn, NDIRECT, run);
+	} else if (bn - NDIRECT < NINDIRECT) {
+		*run = 1;
+		if ((addr = ip->addrs[NDIRECT]) == 0)
+			return 0;
+		bp = breadshared(ip->dev, addr);
+		addr = fs1_brun((uint*)bp->data, bn - NDIRECT, NINDIRECT, run);
+		brelse(bp);
+	} else {
+		panic("fs1_blookup: out of range");
+	}
+	if (addr)
+		fs1_mapset(ip, bn, addr, *run);
+	return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 static uint fs1_bmap(struct inode* ip, uint bn){
-	uint addr, * a;
+	uint addr, * a, run, n = bn;
 	struct buf* bp;
 
+	if ((addr = fs1_blookup(ip, bn, &run)) != 0)
+		return addr;
+	if (fs1_extents(ip->dev)) {
+		if ((addr = fs1_ebmap(ip, bn)) != 0)
+			fs1_mapset(ip, bn, addr, 0);
+		return addr;
+	}
 	if (bn < NDIRECT) {
-		if ((addr = ip->addrs[bn]) == 0)
-			ip->addrs[bn] = addr = fs1_balloc(ip->dev);
+		ip->addrs[bn] = addr = fs1_balloc(ip->dev, bn > 0 ? ip->addrs[bn - 1] : 0);
+		fs1_mapset(ip, bn, addr, 0);
 		return addr;
 	}
 	bn -= NDIRECT;
@@ -274,14 +482,16 @@ static uint fs1_bmap(struct inode* ip, uint bn){
 	if (bn < NINDIRECT) {
 		// Load indirect block, allocating if necessary.
 		if ((addr = ip->addrs[NDIRECT]) == 0)
-			ip->addrs[NDIRECT] = addr = fs1_balloc(ip->dev);
+			ip->addrs[NDIRECT] = addr = fs1_balloc(ip->dev, ip->addrs[NDIRECT - 1]);
 		bp = bread(ip->dev, addr);
 		a = (uint*)bp->data;
 		if ((addr = a[bn]) == 0) {
-			a[bn] = addr = fs1_balloc(ip->dev);
+			// After the previous data block, else the indirect one.
+			a[bn] = addr = fs1_balloc(ip->dev, bn > 0 && a[bn - 1] ? a[bn - 1] : ip->addrs[NDIRECT]);
 			log_write(bp);
 		}
 		brelse(bp);
+		fs1_mapset(ip, n, addr, 0);
 		return addr;
 	}
 
@@ -298,6 +508,23 @@ void fs1_itrunc(struct inode* ip){
 	struct buf* bp;
 	uint* a;
 
+	if (fs1_extents(ip->dev)) {
+		struct fs1_extent* e;
+		bp = 0;
+		for (i = 0; (e = fs1_extent(ip, i, &bp, 0)) != 0 && e->len != 0; i++)
+			for (j = 0; j < e->len; j++)
+				fs1_bfree(ip->dev, e->start + j);
+		if (bp) {
+			brelse(bp);
+			fs1_bfree(ip->dev, ip->addrs[NDIRECT]);
+		}
+		memset(ip->addrs, 0, sizeof(ip->addrs));
+		ip->maplen = 0;
+		ip->size = 0;
+		iupdate(ip);
+		return;
+	}
+
 	for (i = 0; i < NDIRECT; i++) {
 		if (ip->addrs[i]) {
 			fs1_bfree(ip->dev, ip->addrs[i]);
@@ -317,6 +544,7 @@ void fs1_itrunc(struct inode* ip){
 		ip->addrs[NDIRECT] = 0;
 	}
 
+	ip->maplen = 0;
 	ip->size = 0;
 	iupdate(ip);
 }
@@ -333,7 +561,7 @@ void fs1_stati(struct inode* ip, struct stat* st){
 
 // Read data from inode.
 int fs1_readi(struct inode* ip, char* dst, uint off, uint n){
-	uint tot, m;
+	uint tot, m, next = 0, run = 0;
 	struct buf* bp;
 
 	if (off > ip->size || off + n < off)
@@ -342,14 +570,50 @@ int fs1_readi(struct inode* ip, char* dst, uint off, uint n){
 		n = ip->size - off;
 
 	for (tot = 0; tot < n; tot += m, off += m, dst += m) {
-		bp = bread(ip->dev, fs1_bmap(ip, off / BSIZE));
+		uint addr;
+		if (run == 0)
+			next = fs1_blookup(ip, off / BSIZE, &run);
+		addr = next;
+		if (next)
+			next++;
+		run--;
 		m = min(n - tot, BSIZE - off % BSIZE);
+		if (addr == 0) {
+			memset(dst, 0, m);
+			continue;
+		}
+		bp = breadshared(ip->dev, addr);
 		memmove(dst, bp->data + off % BSIZE, m);
-		brelse(bp);
+		// File data is kept in the page cache instead.
+		if (ip->type == T_FILE)
+			brelsecold(bp);
+		else
+			brelse(bp);
 	}
 	return n;
 }
 
+// Start reading the blocks holding [off, off+n) of ip into the
+// buffer cache without waiting for them. Holes are skipped.
+void fs1_readahead(struct inode* ip, uint off, uint n){
+	uint bn, end, addr, run;
+
+	if (off >= ip->size)
+		return;
+	end = off + n > ip->size || off + n < off ? ip->size : off + n;
+	for (bn = off / BSIZE; bn < (end + BSIZE - 1) / BSIZE; bn++) {
+		if (!fs1_extents(ip->dev) && bn >= MAXFILE)
+			break;
+		// A run on disk goes out together; the request queue
+		// merges it into one command.
+		addr = fs1_blookup(ip, bn, &run);
+		for (; run > 0 && bn < (end + BSIZE - 1) / BSIZE; run--, bn++)
+			if (addr)
+				breada(ip->dev, addr++, 1);
+		bn--;
+	}
+}
+
 // Write data to inode.
 int fs1_writei(struct inode* ip, char* src, uint off, uint n){
 	uint tot, m;
@@ -357,22 +621,25 @@ int fs1_writei(struct inode* ip, char* src, uint off, uint n){
 
 	if (off > ip->size || off + n < off)
 		return -1;
-	if (off + n > MAXFILE * BSIZE)
+	if (!fs1_extents(ip->dev) && off + n > MAXFILE * BSIZE)
 		return -1;
 
 	for (tot = 0; tot < n; tot += m, off += m, src += m) {
-		bp = bread(ip->dev, fs1_bmap(ip, off / BSIZE));
+		uint addr = fs1_bmap(ip, off / BSIZE);
+		if (addr == 0)
+			break; // out of extents
+		bp = bread(ip->dev, addr);
 		m = min(n - tot, BSIZE - off % BSIZE);
 		memmove(bp->data + off % BSIZE, src, m);
 		log_write(bp);
 		brelse(bp);
 	}
 
-	if (n > 0 && off > ip->size) {
+	if (tot > 0 && off > ip->size) {
 		ip->size = off;
 		iupdate(ip);
 	}
-	return n;
+	return tot == n ? n : (tot > 0 ? tot : -1);
 }
 
 
@@ -382,15 +649,259 @@ int fs1_namecmp(const char* s, const char* t){
 	return strncmp(s, t, DIRSIZ);
 }
 
+// Hashed directories (see fs1.h). A lookup reads the index and
+// then the one leaf the name can be in; directories made before
+// FS1_DIRINDEX or still a block long are searched linearly.
+
+#define DPB (BSIZE / sizeof(struct dirent))
+#define DXHASH(r, i) ((r)->slot[(i) / 2].hash[(i) % 2])
+#define DXBLOCK(r, i) ((r)->slot[(i) / 2].block[(i) % 2])
+
+static uint fs1_dxhash(const char* name){
+	uint h = 2166136261U;
+
+	for (int i = 0; i < DIRSIZ && name[i]; i++)
+		h = (h ^ (uchar)name[i]) * 16777619U;
+	return h;
+}
+
+// Is dp hashed? Returns its index block's address if so, else 0.
+static uint fs1_dxroot(struct inode* dp){
+	struct fs1_dxroot* r;
+	struct buf* bp;
+	uint addr, run, ok;
+
+	if (!(fs1_allocof(dp->dev)->sb.flags & FS1_DIRINDEX) || dp->size < 2 * BSIZE)
+		return 0;
+	if ((addr = fs1_blookup(dp, 0, &run)) == 0)
+		return 0;
+	bp = breadshared(dp->dev, addr);
+	r = (struct fs1_dxroot*)bp->data;
+	ok = r->inum == 0 && r->magic == FS1_DXMAGIC;
+	brelse(bp);
+	return ok ? addr : 0;
+}
+
+// The index entry of the leaf that holds names hashing to h.
+static int fs1_dxfind(struct fs1_dxroot* r, uint h){
+	int lo = 0, hi = r->count - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (DXHASH(r, mid) <= h)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+// The leaf block of dp, indexed at root, for names hashing to h.
+// Sets *pi to its index entry if pi isn't 0.
+static uint fs1_dxleaf(struct inode* dp, uint root, uint h, int* pi){
+	struct buf* bp;
+	uint bn;
+	int i;
+
+	bp = breadshared(dp->dev, root);
+	i = fs1_dxfind((struct fs1_dxroot*)bp->data, h);
+	bn = DXBLOCK((struct fs1_dxroot*)bp->data, i);
+	brelse(bp);
+	if (pi)
+		*pi = i;
+	return bn;
+}
+
+// The hash that splits the entries of bp, from slot i on, about in
+// half: at least one hashes lower. 0 if they all hash alike.
+static uint fs1_dxmedian(struct buf* bp, int i){
+	struct dirent* de = (struct dirent*)bp->data;
+	uint h[DPB], x;
+	int n = 0, j, k;
+
+	for (; i < DPB; i++) {
+		if (de[i].inum == 0)
+			continue;
+		x = fs1_dxhash(de[i].name);
+		for (j = n++; j > 0 && h[j - 1] > x; j--)
+			h[j] = h[j - 1];
+		h[j] = x;
+	}
+	for (k = n / 2; k < n; k++)
+		if (h[k] != h[0])
+			return h[k];
+	return 0;
+}
+
+// Move the entries of from, from slot i on, that hash to at least
+// m into the empty block to.
+static void fs1_dxmove(struct buf* from, int i, struct buf* to, uint m){
+	struct dirent* de = (struct dirent*)from->data;
+	struct dirent* nde = (struct dirent*)to->data;
+
+	for (; i < DPB; i++) {
+		if (de[i].inum == 0 || fs1_dxhash(de[i].name) < m)
+			continue;
+		*nde++ = de[i];
+		memset(&de[i], 0, sizeof(de[i]));
+	}
+}
+
+// Add block bn to the end of directory dp and read it, empty.
+static struct buf* fs1_dxgrow(struct inode* dp, uint bn){
+	struct buf* bp;
+	uint addr;
+
+	if (bn * BSIZE != dp->size || (addr = fs1_bmap(dp, bn)) == 0)
+		return 0;
+	bp = bread(dp->dev, addr);
+	memset(bp->data, 0, BSIZE);
+	dp->size += BSIZE;
+	return bp;
+}
+
+// Hash the one-block directory dp, whose first block is at addr
+// and full: its entries go to one or two leaves after it.
+static int fs1_dxconvert(struct inode* dp, uint addr){
+	struct buf* bp, * lo, * hi = 0;
+	struct fs1_dxroot* r;
+	uint m;
+
+	bp = bread(dp->dev, addr);
+	r = (struct fs1_dxroot*)bp->data;
+	if (namecmp(r->dot.name, ".") != 0 || namecmp(r->dotdot.name, "..") != 0) {
+		brelse(bp);
+		return -1;
+	}
+	m = fs1_dxmedian(bp, 2);
+	if ((lo = fs1_dxgrow(dp, 1)) == 0 || (m && (hi = fs1_dxgrow(dp, 2)) == 0)) {
+		if (lo)
+			brelse(lo);
+		brelse(bp);
+		iupdate(dp);
+		return -1;
+	}
+	if (hi) {
+		fs1_dxmove(bp, 2, hi, m);
+		log_write(hi);
+		brelse(hi);
+	}
+	fs1_dxmove(bp, 2, lo, 0);
+	log_write(lo);
+	brelse(lo);
+
+	memset((char*)r + 2 * sizeof(struct dirent), 0, BSIZE - 2 * sizeof(struct dirent));
+	r->magic = FS1_DXMAGIC;
+	r->count = hi ? 2 : 1;
+	DXBLOCK(r, 0) = 1;
+	if (hi) {
+		DXHASH(r, 1) = m;
+		DXBLOCK(r, 1) = 2;
+	}
+	log_write(bp);
+	brelse(bp);
+	iupdate(dp);
+	return 0;
+}
+
+// Split the full leaf of dp at index entry i in two.
+static int fs1_dxsplit(struct inode* dp, uint root, int i){
+	struct buf* rbp, * bp, * nbp;
+	struct fs1_dxroot* r;
+	uint m, run, bn;
+	int j;
+
+	rbp = bread(dp->dev, root);
+	r = (struct fs1_dxroot*)rbp->data;
+	bn = DXBLOCK(r, i);
+	bp = bread(dp->dev, fs1_blookup(dp, bn, &run));
+	if (r->count == NDXENTRY || (m = fs1_dxmedian(bp, 0)) == 0 ||
+	    (nbp = fs1_dxgrow(dp, dp->size / BSIZE)) == 0) {
+		brelse(bp);
+		brelse(rbp);
+		return -1;
+	}
+	fs1_dxmove(bp, 0, nbp, m);
+	log_write(bp);
+	brelse(bp);
+	log_write(nbp);
+	brelse(nbp);
+
+	for (j = r->count++; j > i + 1; j--) {
+		DXHASH(r, j) = DXHASH(r, j - 1);
+		DXBLOCK(r, j) = DXBLOCK(r, j - 1);
+	}
+	DXHASH(r, i + 1) = m;
+	DXBLOCK(r, i + 1) = dp->size / BSIZE - 1;
+	log_write(rbp);
+	brelse(rbp);
+	iupdate(dp);
+	return 0;
+}
+
+// Look name up in the leaf of dp, indexed at root, that holds it.
+static struct inode* fs1_dxlookup(struct inode* dp, uint root, char* name, uint* poff){
+	struct dirent* de;
+	struct buf* bp;
+	uint bn, run, inum = 0;
+	int i;
+
+	bn = fs1_dxleaf(dp, root, fs1_dxhash(name), 0);
+	bp = breadshared(dp->dev, fs1_blookup(dp, bn, &run));
+	de = (struct dirent*)bp->data;
+	for (i = 0; i < DPB; i++) {
+		if (de[i].inum != 0 && namecmp(name, de[i].name) == 0) {
+			inum = de[i].inum;
+			break;
+		}
+	}
+	brelse(bp);
+	if (inum == 0)
+		return 0;
+	if (poff)
+		*poff = bn * BSIZE + i * sizeof(struct dirent);
+	return iget(dp->dev, inum);
+}
+
+// Write (name, inum) into a free slot of the leaf of dp, indexed
+// at root, that should hold it, splitting the leaf if it's full.
+static int fs1_dxlink(struct inode* dp, uint root, char* name, uint inum){
+	struct dirent* de;
+	struct buf* bp;
+	uint h = fs1_dxhash(name), bn, addr, run;
+	int i, j;
+
+	for (;;) {
+		bn = fs1_dxleaf(dp, root, h, &i);
+		addr = fs1_blookup(dp, bn, &run);
+		bp = bread(dp->dev, addr);
+		de = (struct dirent*)bp->data;
+		for (j = 0; j < DPB; j++) {
+			if (de[j].inum == 0) {
+				strncpy(de[j].name, name, DIRSIZ);
+				de[j].inum = inum;
+				log_write(bp);
+				brelse(bp);
+				return 0;
+			}
+		}
+		brelse(bp);
+		if (fs1_dxsplit(dp, root, i) < 0)
+			return -1;
+	}
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode* fs1_dirlookup(struct inode* dp, char* name, uint* poff){
-	uint off, inum;
+	uint off, inum, root;
 	struct dirent de;
 
 	if (dp->type != T_DIR)
 		panic("dirlookup not DIR");
 
+	if ((root = fs1_dxroot(dp)) != 0)
+		return fs1_dxlookup(dp, root, name, poff);
 	for (off = 0; off < dp->size; off += sizeof(de)) {
 		if (readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
 			panic("dirlink read");
@@ -401,7 +912,7 @@ struct inode* fs1_dirlookup(struct inode* dp, char* name, uint* poff){
 			if (poff)
 				*poff = off;
 			inum = de.inum;
-			return fs1_iget(dp->dev, inum);
+			return iget(dp->dev, inum);
 		}
 	}
 
@@ -411,6 +922,7 @@ struct inode* fs1_dirlookup(struct inode* dp, char* name, uint* poff){
 // Write a new directory entry (name, inum) into the directory dp.
 int fs1_dirlink(struct inode* dp, char* name, uint inum){
 	int off;
+	uint root, run;
 	struct dirent de;
 	struct inode* ip;
 
@@ -420,6 +932,9 @@ int fs1_dirlink(struct inode* dp, char* name, uint inum){
 		return -1;
 	}
 
+	if ((root = fs1_dxroot(dp)) != 0)
+		return fs1_dxlink(dp, root, name, inum);
+
 	// Look for an empty dirent.
 	for (off = 0; off < dp->size; off += sizeof(de)) {
 		if (readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
@@ -428,6 +943,12 @@ int fs1_dirlink(struct inode* dp, char* name, uint inum){
 			break;
 	}
 
+	// Rather than grow a full one-block directory, hash it.
+	if (off == BSIZE && dp->size == BSIZE &&
+	    (fs1_allocof(dp->dev)->sb.flags & FS1_DIRINDEX) &&
+	    fs1_dxconvert(dp, fs1_blookup(dp, 0, &run)) == 0)
+		return fs1_dxlink(dp, fs1_blookup(dp, 0, &run), name, inum);
+
 	strncpy(de.name, name, DIRSIZ);
 	de.inum = inum;
 	if (writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
@@ -436,12 +957,53 @@ int fs1_dirlink(struct inode* dp, char* name, uint inum){
 	return 0;
 }
 
+// Remove the directory entry at off in dp.
+int fs1_dirunlink(struct inode* dp, uint off){
+	struct dirent de;
+
+	memset(&de, 0, sizeof(de));
+	return writei(dp, (char*)&de, off, sizeof(de)) == sizeof(de) ? 0 : -1;
+}
+
+// Is the directory dp empty except for "." and ".." ?
+int fs1_isdirempty(struct inode* dp){
+	int off;
+	struct dirent de;
+
+	for (off = 2 * sizeof(de); off < dp->size; off += sizeof(de)) {
+		if (readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+			panic("isdirempty: readi");
+		if (de.inum != 0)
+			return 0;
+	}
+	return 1;
+}
+
+// Return the next entry of dp at or after *off, as readdir().
+// Index slots in hashed directories have inum 0 and are skipped
+// with the free entries.
+int fs1_readdir(struct inode* dp, uint* off, char* name, uint* inum){
+	struct dirent de;
+
+	while (*off + sizeof(de) <= dp->size) {
+		if (readi(dp, (char*)&de, *off, sizeof(de)) != sizeof(de))
+			return -1;
+		*off += sizeof(de);
+		if (de.inum != 0) {
+			memmove(name, de.name, DIRSIZ);
+			*inum = de.inum;
+			return 1;
+		}
+	}
+	return 0;
+}
+
 void fs1_readinode(struct inode *ip) {
 	struct buf* bp;
 	struct dinode* dip;
 
 	uint32 sector = IBLOCK(ip->inum);
-	bp = bread(ip->dev, sector);
+	bp = breadshared(ip->dev, sector);
 	dip = (struct dinode*)bp->data;
 	dip += ip->inum % IPB; // increment dip to the correct inode in the sector
 	ip->type = dip->type;
@@ -450,5 +1012,40 @@ void fs1_readinode(struct inode *ip) {
 	ip->nlink = dip->nlink;
 	ip->size = dip->size;
 	memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+	acquire(&ip->maplock);
+	ip->maplen = 0;
+	release(&ip->maplock);
 	brelse(bp);
 }
+
+// Everything fs1 writes goes through the log, and is safe once
+// it is committed; installing it can wait.
+static int fs1_fsync(struct inode *ip){
+	log_force();
+	return 0;
+}
+
+static void fs1_vfsreadsb(int dev, struct superblock *sb){
+	fs1_readsb(dev, (struct fs1_superblock*)sb);
+}
+
+struct fsops fs1_ops = {
+	.type       = FS_TYPE_FS1,
+	.rootino    = ROOTINO,
+	.pagecache  = 1,
+	.readsb     = fs1_vfsreadsb,
+	.ialloc     = fs1_ialloc,
+	.readinode  = fs1_readinode,
+	.iupdate    = fs1_iupdate,
+	.itrunc     = fs1_itrunc,
+	.readi      = fs1_readi,
+	.writei     = fs1_writei,
+	.readahead  = fs1_readahead,
+	.stati      = fs1_stati,
+	.dirlookup  = fs1_dirlookup,
+	.dirlink    = fs1_dirlink,
+	.dirunlink  = fs1_dirunlink,
+	.isdirempty = fs1_isdirempty,
+	.readdir    = fs1_readdir,
+	.fsync      = fs1_fsync,
+};
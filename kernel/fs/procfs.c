@@ -0,0 +1,352 @@
+// procfs: process and system statistics as files.
+//
+// init mounts it on /proc. Nothing is stored: each read makes up
+// the file's text from the kernel's counters, into a page, and
+// copies out the part at the offset. A file read in one go, as
+// cat does, is one snapshot; one read in pieces may see things
+// change between them.
+//
+// The root has the system-wide files (sysfiles[] below) and a
+// directory for each process, named by its pid, with the files
+// in pidfiles[]. An inode number says which file it is: the
+// system files are 2 on, and a process's are its pid shifted up
+// by PIDSHIFT, plus 0 for its directory or 1 + the index into
+// pidfiles[]. A process's files outlive it, reading as empty.
+//
+// Names come and go as processes do, so the VFS doesn't cache
+// them, and nothing can be created, written or removed.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "buf.h"
+#include "vfs.h"
+#include "fs/fs1.h"
+#include "fs/procfs.h"
+#include "file.h"
+#include "kernel/string.h"
+
+#define PIDSHIFT 3
+#define PIDINO(pid, f) ((uint)(pid) << PIDSHIFT | (f))
+#define INOPID(inum)   ((int)((inum) >> PIDSHIFT))
+#define INOFILE(inum)  ((inum) & ((1 << PIDSHIFT) - 1))
+#define NDISK 8        // devices /proc/disk shows
+
+// Append to the text being made up in buf, of n bytes; what
+// doesn't fit is dropped.
+#define OUT(...) (len += snprintf(buf + len, len < n ? n - len : 0, __VA_ARGS__))
+#define DONE()   (len < n ? len : n - 1)
+
+static char* states[] = {
+	[UNUSED]   "unused",
+	[EMBRYO]   "embryo",
+	[SLEEPING] "sleeping",
+	[RUNNABLE] "runnable",
+	[RUNNING]  "running",
+	[ZOMBIE]   "zombie",
+};
+
+// Count the processes, and those running or runnable.
+static int countprocs(int* nrun){
+	int nproc = 0;
+
+	*nrun = 0;
+	for (int pid = procnext(0); pid != 0; pid = procnext(pid)) {
+		enum procstate s = pstate(pid);
+		nproc++;
+		if (s == RUNNING || s == RUNNABLE)
+			(*nrun)++;
+	}
+	return nproc;
+}
+
+// Uptime, and how busy each cpu and the process table are.
+// Times are in microseconds.
+static int showstat(char* buf, int n){
+	int len = 0, nproc, nrun;
+
+	OUT("uptime %d ticks\nhz %d\n", ticks, HZ);
+	for (int i = 0; i < ncpu; i++)
+		OUT("cpu%d busy %ld idle %ld\n", i, tsc2ns(cpus[i].busytsc) / 1000,
+		    tsc2ns(cpus[i].idletsc) / 1000);
+	nproc = countprocs(&nrun);
+	OUT("procs %d\nrunnable %d\n", nproc, nrun);
+	return DONE();
+}
+
+// The 1, 5 and 15 minute load averages, then runnable/processes.
+static int showloadavg(char* buf, int n){
+	int len = 0, avg[3], nproc, nrun;
+
+	loadavg(avg);
+	for (int i = 0; i < 3; i++)
+		OUT("%d.%d%d ", avg[i] / 100, avg[i] / 10 % 10, avg[i] % 10);
+	nproc = countprocs(&nrun);
+	OUT("%d/%d\n", nrun, nproc);
+	return DONE();
+}
+
+// The page allocator.
+static int showmeminfo(char* buf, int n){
+	int len = 0;
+
+	OUT("total %d pages\nfree %d pages\n", kmemtotal(), kmemfree());
+	for (int i = 0; i < ncpu; i++)
+		OUT("cpu%d cached %d hits %ld misses %ld\n", i, cpus[i].kmag.count,
+		    cpus[i].kmag.hits, cpus[i].kmag.misses);
+	return DONE();
+}
+
+static int showbcache(char* buf, int n){
+	struct bcachestat st;
+	int len = 0;
+
+	bcachestat(&st);
+	OUT("hits %ld\nmisses %ld\nevictions %ld\nreadaheads %ld\n",
+	    st.hits, st.misses, st.evictions, st.readaheads);
+	OUT("delwri %ld\nflushed %ld\ndirty %ld\n", st.delwri, st.flushed, st.ndirty);
+	OUT("grows %ld\nshrinks %ld\nbufs %ld\npages %ld\nmaxpages %ld\n",
+	    st.grows, st.shrinks, st.nbuf, st.pages, st.maxpages);
+	return DONE();
+}
+
+static int showlog(char* buf, int n){
+	struct logstat st;
+	int len = 0;
+
+	logstat(&st);
+	OUT("commits %ld\nblocks %ld\nwaits %ld\n", st.commits, st.blocks, st.waits);
+	OUT("size %d sectors\nrunning %d blocks\noutstanding %d\nreserved %d\n",
+	    st.nsect, st.running, st.outstanding, st.reserved);
+	return DONE();
+}
+
+// A line for each disk with a request queue.
+static int showdisk(char* buf, int n){
+	struct blkqstat st[NDISK];
+	int len = 0, k;
+
+	k = blkqstat(st, NDISK);
+	for (int i = 0; i < k; i++)
+		OUT("disk(%d, %d) reads %ld sectors %ld writes %ld sectors %ld cmds %ld pending %d\n",
+		    GETDEVTYPE(st[i].dev), GETDEVNUM(st[i].dev), st[i].reads, st[i].rsect,
+		    st[i].writes, st[i].wsect, st[i].cmds, st[i].pending);
+	return DONE();
+}
+
+// Times are in microseconds.
+static int showstatus(struct procinfo* pi, char* buf, int n){
+	int len = 0;
+
+	OUT("pid %d\nname %s\nstate %s\nppid %d\n", pi->pid, pi->name,
+	    pi->state < NELEM(states) ? states[pi->state] : "???", pi->ppid);
+	OUT("blessed %d\npriority %d\nkilled %d\ncpu %d\n", pi->blessed == PROC_BLESSED,
+	    pi->priority, pi->killed, pi->rqcpu);
+	OUT("size %ld\nsyscalls %ld\nutime %ld\nstime %ld\n", pi->sz, pi->nsyscall,
+	    pi->utime / 1000, pi->stime / 1000);
+	return DONE();
+}
+
+// A line for each open fd.
+static int showfd(struct procinfo* pi, char* buf, int n){
+	static char* modes[] = { "-", "r", "w", "rw" };
+	struct procfd* f;
+	int len = 0;
+
+	for (int i = 0; i < NOFILE; i++) {
+		f = &pi->fd[i];
+		if (f->type == FD_NONE)
+			continue;
+		OUT("%d %s", i, modes[(f->readable != 0) | (f->writable != 0) << 1]);
+		if (f->type == FD_INODE)
+			OUT(" inode dev %x inum %d off %d\n", f->dev, f->inum, f->off);
+		else
+			OUT(" %s\n", f->type == FD_PIPE ? "pipe" : "epoll");
+	}
+	return DONE();
+}
+
+static struct {
+	char* name;
+	int (*show)(char*, int);
+} sysfiles[] = {
+	{ "stat",    showstat },
+	{ "loadavg", showloadavg },
+	{ "meminfo", showmeminfo },
+	{ "bcache",  showbcache },
+	{ "log",     showlog },
+	{ "disk",    showdisk },
+};
+#define NSYSFILE NELEM(sysfiles)  // at most 6: their inums stay below PIDINO(1, 0)
+
+static struct {
+	char* name;
+	int (*show)(struct procinfo*, char*, int);
+} pidfiles[] = {
+	{ "status", showstatus },
+	{ "fd",     showfd },
+};
+#define NPIDFILE NELEM(pidfiles)
+
+static void procfs_readsb(int dev, struct superblock* sb){
+	memset(sb, 0, sizeof(*sb));
+}
+
+static struct inode* procfs_ialloc(uint dev, short type){
+	return 0;
+}
+
+static void procfs_readinode(struct inode* ip){
+	uint inum = ip->inum;
+
+	if (inum == PROCFS_ROOTINO || (INOPID(inum) > 0 && INOFILE(inum) == 0))
+		ip->type = T_DIR;
+	else if (INOPID(inum) == 0 ? inum >= 2 && inum < 2 + NSYSFILE : INOFILE(inum) <= NPIDFILE)
+		ip->type = T_FILE;
+	else
+		panic("procfs: bad inum");
+	ip->major = ip->minor = 0;
+	ip->nlink = 1;
+	ip->size = 0;
+}
+
+static void procfs_iupdate(struct inode* ip){
+}
+
+static void procfs_itrunc(struct inode* ip){
+}
+
+static int procfs_readi(struct inode* ip, char* dst, uint off, uint n){
+	struct procinfo pi;
+	uint inum = ip->inum;
+	char* buf;
+	uint len;
+
+	if (ip->type != T_FILE)
+		return -1;
+	if ((buf = kalloc()) == 0)
+		return -1;
+	if (INOPID(inum) == 0)
+		len = sysfiles[inum - 2].show(buf, PGSIZE);
+	else if (procinfo(INOPID(inum), &pi) == 0)
+		len = pidfiles[INOFILE(inum) - 1].show(&pi, buf, PGSIZE);
+	else
+		len = 0;
+	if (off >= len)
+		n = 0;
+	else if (n > len - off)
+		n = len - off;
+	memmove(dst, buf + off, n);
+	kfree(buf);
+	return n;
+}
+
+static int procfs_writei(struct inode* ip, char* src, uint off, uint n){
+	return -1;
+}
+
+static void procfs_stati(struct inode* ip, struct stat* st){
+	st->dev = ip->dev;
+	st->ino = ip->inum;
+	st->type = ip->type;
+	st->nlink = ip->nlink;
+	st->size = ip->size;
+}
+
+static struct inode* procfs_dirlookup(struct inode* dp, char* name, uint* poff){
+	int pid = 0;
+	char* s;
+
+	if (dp->type != T_DIR)
+		panic("dirlookup not DIR");
+	if (poff)
+		*poff = 0;
+
+	if (namecmp(name, ".") == 0)
+		return iget(dp->dev, dp->inum);
+	if (namecmp(name, "..") == 0)
+		return iget(dp->dev, PROCFS_ROOTINO);
+	if (dp->inum != PROCFS_ROOTINO) {
+		for (uint i = 0; i < NPIDFILE; i++)
+			if (namecmp(name, pidfiles[i].name) == 0)
+				return iget(dp->dev, dp->inum + 1 + i);
+		return 0;
+	}
+	for (uint i = 0; i < NSYSFILE; i++)
+		if (namecmp(name, sysfiles[i].name) == 0)
+			return iget(dp->dev, 2 + i);
+
+	// A pid, if there is such a process.
+	for (s = name; s < name + DIRSIZ && *s; s++) {
+		if (*s < '0' || *s > '9' || pid > (0x7FFFFFFF >> PIDSHIFT) / 10)
+			return 0;
+		pid = pid * 10 + *s - '0';
+	}
+	if (pid <= 0 || procnext(pid - 1) != pid)
+		return 0;
+	return iget(dp->dev, PIDINO(pid, 0));
+}
+
+static int procfs_dirlink(struct inode* dp, char* name, uint inum){
+	return -1;
+}
+
+static int procfs_isdirempty(struct inode* dp){
+	return 0;
+}
+
+// *off counts ".", ".." and then the files; in the root, past
+// the system files it is 2 + NSYSFILE + the last pid listed.
+static int procfs_readdir(struct inode* dp, uint* off, char* name, uint* inum){
+	int pid;
+
+	memset(name, 0, DIRSIZ);
+	if (*off < 2) {
+		safestrcpy(name, *off == 0 ? "." : "..", DIRSIZ);
+		*inum = *off == 0 ? dp->inum : PROCFS_ROOTINO;
+		(*off)++;
+		return 1;
+	}
+	if (dp->inum != PROCFS_ROOTINO) {
+		if (*off - 2 >= NPIDFILE)
+			return 0;
+		safestrcpy(name, pidfiles[*off - 2].name, DIRSIZ);
+		*inum = dp->inum + *off - 1;
+		(*off)++;
+		return 1;
+	}
+	if (*off < 2 + NSYSFILE) {
+		safestrcpy(name, sysfiles[*off - 2].name, DIRSIZ);
+		*inum = *off;
+		(*off)++;
+		return 1;
+	}
+	if ((pid = procnext(*off - 2 - NSYSFILE)) == 0)
+		return 0;
+	snprintf(name, DIRSIZ, "%d", pid);
+	*inum = PIDINO(pid, 0);
+	*off = 2 + NSYSFILE + pid;
+	return 1;
+}
+
+struct fsops procfs_ops = {
+	.type        = FS_TYPE_PROCFS,
+	.rootino     = PROCFS_ROOTINO,
+	.nonamecache = 1,
+	.readsb      = procfs_readsb,
+	.ialloc      = procfs_ialloc,
+	.readinode   = procfs_readinode,
+	.iupdate     = procfs_iupdate,
+	.itrunc      = procfs_itrunc,
+	.readi       = procfs_readi,
+	.writei      = procfs_writei,
+	.stati       = procfs_stati,
+	.dirlookup   = procfs_dirlookup,
+	.dirlink     = procfs_dirlink,
+	.isdirempty  = procfs_isdirempty,
+	.readdir     = procfs_readdir,
+};
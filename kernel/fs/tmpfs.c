@@ -0,0 +1,301 @@
+// tmpfs: a file system kept in memory.
+//
+// Nothing here goes through the buffer cache, the log or a disk.
+// What would be disk inodes are a fixed table of nodes indexed
+// by inum, and file contents are pages from kalloc(), found
+// through two levels of pointer pages the way a page table finds
+// pages, so a file may be up to NPTR * NPTR pages long. Holes
+// read as zeroes and take no page. Directories are arrays of
+// struct dirent, like fs1's. Everything is gone at reboot.
+//
+// A node's fields and pages are under the sleeplock of its
+// in-memory inode; this file's lock only covers which nodes are
+// free.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "buf.h"
+#include "vfs.h"
+#include "fs/fs1.h"
+#include "fs/tmpfs.h"
+#include "file.h"
+#include "kernel/string.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define NPTR ((uint)(PGSIZE / sizeof(char*)))
+#define MAXBYTES ((uint64)NPTR * NPTR * PGSIZE)
+
+struct tmpnode {
+	short type;        // 0 if free
+	short major;
+	short minor;
+	short nlink;
+	uint size;
+	char ***pages;     // NPTR pointers to pages of NPTR page pointers
+};
+
+static struct {
+	struct spinlock lock;
+	struct tmpnode node[TMPFS_NINODE];
+} tmpfs;
+
+static struct tmpnode* tmpfs_node(struct inode* ip){
+	if (ip->inum == 0 || ip->inum >= TMPFS_NINODE)
+		panic("tmpfs: bad inum");
+	return &tmpfs.node[ip->inum];
+}
+
+// Return the page holding bytes [pg*PGSIZE, (pg+1)*PGSIZE) of n,
+// or 0 if it is a hole. If alloc is set, fill the hole, and
+// return 0 only when out of memory.
+static char* tmpfs_page(struct tmpnode* n, uint pg, int alloc){
+	char** mid;
+
+	if (n->pages == 0 && (!alloc || (n->pages = (char***)kalloc_zeroed()) == 0))
+		return 0;
+	mid = n->pages[pg / NPTR];
+	if (mid == 0 && (!alloc || (mid = n->pages[pg / NPTR] = (char**)kalloc_zeroed()) == 0))
+		return 0;
+	if (mid[pg % NPTR] == 0 && alloc)
+		mid[pg % NPTR] = kalloc_zeroed();
+	return mid[pg % NPTR];
+}
+
+// Give back all of n's pages.
+static void tmpfs_free(struct tmpnode* n){
+	if (n->pages == 0)
+		return;
+	for (uint i = 0; i < NPTR; i++) {
+		char** mid = n->pages[i];
+		if (mid == 0)
+			continue;
+		for (uint j = 0; j < NPTR; j++)
+			if (mid[j])
+				kfree(mid[j]);
+		kfree((char*)mid);
+	}
+	kfree((char*)n->pages);
+	n->pages = 0;
+}
+
+// Set up the root directory, with "." and ".." both itself.
+// There is one tmpfs, on TMPFS_DEV, and vfsmount() won't mount
+// a device twice.
+static int tmpfs_mount(uint dev){
+	struct tmpnode* root = &tmpfs.node[TMPFS_ROOTINO];
+	struct dirent* de;
+
+	initlock(&tmpfs.lock, "tmpfs");
+	if ((de = (struct dirent*)tmpfs_page(root, 0, 1)) == 0) {
+		tmpfs_free(root);
+		return -1;
+	}
+	de[0].inum = de[1].inum = TMPFS_ROOTINO;
+	strncpy(de[0].name, ".", DIRSIZ);
+	strncpy(de[1].name, "..", DIRSIZ);
+	root->type = T_DIR;
+	root->nlink = 1;
+	root->size = 2 * sizeof(*de);
+	return 0;
+}
+
+static void tmpfs_readsb(int dev, struct superblock* sb){
+	memset(sb, 0, sizeof(*sb));
+}
+
+static struct inode* tmpfs_ialloc(uint dev, short type){
+	acquire(&tmpfs.lock);
+	for (uint inum = TMPFS_ROOTINO + 1; inum < TMPFS_NINODE; inum++) {
+		struct tmpnode* n = &tmpfs.node[inum];
+		if (n->type == 0) {
+			memset(n, 0, sizeof(*n));
+			n->type = type;
+			release(&tmpfs.lock);
+			return iget(dev, inum);
+		}
+	}
+	release(&tmpfs.lock);
+	return 0;
+}
+
+static void tmpfs_readinode(struct inode* ip){
+	struct tmpnode* n = tmpfs_node(ip);
+
+	ip->type = n->type;
+	ip->major = n->major;
+	ip->minor = n->minor;
+	ip->nlink = n->nlink;
+	ip->size = n->size;
+}
+
+static void tmpfs_iupdate(struct inode* ip){
+	struct tmpnode* n = tmpfs_node(ip);
+
+	n->major = ip->major;
+	n->minor = ip->minor;
+	n->nlink = ip->nlink;
+	n->size = ip->size;
+	if (ip->type == 0) {
+		acquire(&tmpfs.lock);
+		n->type = 0;
+		release(&tmpfs.lock);
+	} else {
+		n->type = ip->type;
+	}
+}
+
+static void tmpfs_itrunc(struct inode* ip){
+	tmpfs_free(tmpfs_node(ip));
+	ip->size = 0;
+	tmpfs_iupdate(ip);
+}
+
+static int tmpfs_readi(struct inode* ip, char* dst, uint off, uint n){
+	struct tmpnode* np = tmpfs_node(ip);
+	uint tot, m;
+	char* p;
+
+	if (off > ip->size || off + n < off)
+		return -1;
+	if (off + n > ip->size)
+		n = ip->size - off;
+
+	for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+		m = min(n - tot, PGSIZE - off % PGSIZE);
+		if ((p = tmpfs_page(np, off / PGSIZE, 0)) == 0)
+			memset(dst, 0, m);
+		else
+			memmove(dst, p + off % PGSIZE, m);
+	}
+	return n;
+}
+
+static int tmpfs_writei(struct inode* ip, char* src, uint off, uint n){
+	struct tmpnode* np = tmpfs_node(ip);
+	uint tot, m;
+	char* p;
+
+	if (off > ip->size || off + n < off)
+		return -1;
+	if ((uint64)off + n > MAXBYTES)
+		return -1;
+
+	for (tot = 0; tot < n; tot += m, off += m, src += m) {
+		if ((p = tmpfs_page(np, off / PGSIZE, 1)) == 0)
+			break; // out of memory
+		m = min(n - tot, PGSIZE - off % PGSIZE);
+		memmove(p + off % PGSIZE, src, m);
+	}
+
+	if (tot > 0 && off > ip->size) {
+		ip->size = off;
+		tmpfs_iupdate(ip);
+	}
+	return tot == n ? n : (tot > 0 ? tot : -1);
+}
+
+static void tmpfs_stati(struct inode* ip, struct stat* st){
+	st->dev = ip->dev;
+	st->ino = ip->inum;
+	st->type = ip->type;
+	st->nlink = ip->nlink;
+	st->size = ip->size;
+}
+
+static struct inode* tmpfs_dirlookup(struct inode* dp, char* name, uint* poff){
+	struct dirent de;
+
+	if (dp->type != T_DIR)
+		panic("dirlookup not DIR");
+
+	for (uint off = 0; off < dp->size; off += sizeof(de)) {
+		if (tmpfs_readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+			panic("tmpfs_dirlookup read");
+		if (de.inum != 0 && namecmp(name, de.name) == 0) {
+			if (poff)
+				*poff = off;
+			return iget(dp->dev, de.inum);
+		}
+	}
+	return 0;
+}
+
+static int tmpfs_dirlink(struct inode* dp, char* name, uint inum){
+	struct dirent de;
+	struct inode* ip;
+	uint off;
+
+	if ((ip = tmpfs_dirlookup(dp, name, 0)) != 0) {
+		iput(ip);
+		return -1;
+	}
+
+	for (off = 0; off < dp->size; off += sizeof(de)) {
+		if (tmpfs_readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+			panic("tmpfs_dirlink read");
+		if (de.inum == 0)
+			break;
+	}
+
+	strncpy(de.name, name, DIRSIZ);
+	de.inum = inum;
+	return tmpfs_writei(dp, (char*)&de, off, sizeof(de)) == sizeof(de) ? 0 : -1;
+}
+
+static int tmpfs_dirunlink(struct inode* dp, uint off){
+	struct dirent de;
+
+	memset(&de, 0, sizeof(de));
+	return tmpfs_writei(dp, (char*)&de, off, sizeof(de)) == sizeof(de) ? 0 : -1;
+}
+
+static int tmpfs_isdirempty(struct inode* dp){
+	struct dirent de;
+
+	for (uint off = 2 * sizeof(de); off < dp->size; off += sizeof(de)) {
+		if (tmpfs_readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+			panic("tmpfs_isdirempty read");
+		if (de.inum != 0)
+			return 0;
+	}
+	return 1;
+}
+
+static int tmpfs_readdir(struct inode* dp, uint* off, char* name, uint* inum){
+	struct dirent de;
+
+	while (*off + sizeof(de) <= dp->size) {
+		if (tmpfs_readi(dp, (char*)&de, *off, sizeof(de)) != sizeof(de))
+			return -1;
+		*off += sizeof(de);
+		if (de.inum != 0) {
+			memmove(name, de.name, DIRSIZ);
+			*inum = de.inum;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+struct fsops tmpfs_ops = {
+	.type       = FS_TYPE_TMPFS,
+	.rootino    = TMPFS_ROOTINO,
+	.mount      = tmpfs_mount,
+	.readsb     = tmpfs_readsb,
+	.ialloc     = tmpfs_ialloc,
+	.readinode  = tmpfs_readinode,
+	.iupdate    = tmpfs_iupdate,
+	.itrunc     = tmpfs_itrunc,
+	.readi      = tmpfs_readi,
+	.writei     = tmpfs_writei,
+	.stati      = tmpfs_stati,
+	.dirlookup  = tmpfs_dirlookup,
+	.dirlink    = tmpfs_dirlink,
+	.dirunlink  = tmpfs_dirunlink,
+	.isdirempty = tmpfs_isdirempty,
+	.readdir    = tmpfs_readdir,
+};
@@ -1,4 +1,8 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code.
+//
+// Transfers use PCI busmaster DMA when pci.c found the
+// controller's busmaster registers and the buffer is below 4GB,
+// and PIO otherwise.
 
 #include "types.h"
 #include "defs.h"
@@ -18,6 +22,32 @@
 
 #define IDE_CMD_READ  0x20
 #define IDE_CMD_WRITE 0x30
+#define IDE_CMD_RDMUL 0xc4
+#define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+
+#define IDE_MAXSECT   8    // most sectors in one READ/WRITE MULTIPLE
+
+// Busmaster registers, from the channel's base in BAR4.
+#define BM_CMD        0
+#define BM_STATUS     2
+#define BM_PRDT       4
+#define BM_CMD_START  0x01
+#define BM_CMD_READ   0x08 // device to memory
+#define BM_ST_ERR     0x02
+#define BM_ST_INTR    0x04
+#define BM_SECONDARY  8    // offset of the secondary channel's registers
+
+// Physical region descriptor: one piece of a DMA transfer,
+// not crossing a 64K boundary.
+struct prd {
+	uint32 addr;
+	uint16 count;  // bytes, 0 meaning 64K
+	uint16 flags;
+};
+#define PRD_EOT 0x8000     // last entry
+#define NPRD (PGSIZE / sizeof(struct prd))
 
 #define PRIMARY_IDE_CHANNEL_BASE   0x1F0
 #define PRIMARY_IDE_INTERRUPT      0x3F6
@@ -38,6 +68,18 @@ uint16 ideChannel = SECONDARY_IDE_CHANNEL_BASE;
 static int havedisk0;
 static int havedisk1;
 static void idestart(struct buf*);
+static void idesoftirq(void);
+
+static uint16 idebm;       // busmaster registers for ideChannel, 0 if none
+static struct prd* prdt;   // a page, below 4GB
+static int idedma;         // the active request is using DMA
+
+// Bufs finished by ideintr() whose waiters idesoftirq() is yet
+// to wake. The bufs are only channels to wake on by then: their
+// owners may have seen them done and moved on.
+#define NIDEDONE 16
+static void* idedone[NIDEDONE];
+static uint idedoner, idedonew;
 
 // Wait for IDE disk to become ready.
 static int idewait(int checkerr){
@@ -50,11 +92,50 @@ static int idewait(int checkerr){
 	return 0;
 }
 
+// Called by pci.c with the busmaster base address from BAR4.
+void ideattachdma(uint bmbase){
+	idebm = (bmbase & ~3) + (ideChannel == PRIMARY_IDE_CHANNEL_BASE ? 0 : BM_SECONDARY);
+}
+
+// Fill the PRD table for b. Returns 0 if b can't use DMA.
+static int idedmasetup(struct buf* b){
+	uintp pa = V2P(b->data);
+	uint len = b->nsec * SECTOR_SIZE;
+	int n = 0;
+
+	if (prdt == 0 || pa + len > 0x100000000ULL)
+		return 0;
+	while (len > 0) {
+		uint chunk = 0x10000 - (pa & 0xFFFF);
+		if (chunk > len)
+			chunk = len;
+		if (n == NPRD)
+			return 0;
+		prdt[n].addr = pa;
+		prdt[n].count = chunk & 0xFFFF;
+		prdt[n].flags = 0;
+		pa += chunk;
+		len -= chunk;
+		n++;
+	}
+	prdt[n-1].flags = PRD_EOT;
+	return 1;
+}
+
 void ideinit(void){
 	int i;
 
 	cprintf("Detecting IDE devices:\n");
 	initlock(&idelock, "ide");
+	if (idebm) {
+		char* mem = kalloc();
+		if (mem && V2P(mem) + PGSIZE <= 0x100000000ULL) {
+			prdt = (struct prd*)mem;
+			cprintf("   busmaster DMA at 0x%x\n", idebm);
+		} else if (mem) {
+			kfree(mem);
+		}
+	}
 	if(ideChannel == PRIMARY_IDE_CHANNEL_BASE) {
 		picenable(IRQ_IDE1);
 		ioapicenable(IRQ_IDE1, ncpu - 1);
@@ -62,6 +143,7 @@ void ideinit(void){
 		picenable(IRQ_IDE2);
 		ioapicenable(IRQ_IDE2, ncpu - 1);
 	}
+	open_softirq(SOFTIRQ_IDE, idesoftirq);
 	havedisk0 = idewait(0);
 	if(havedisk0) {
 		cprintf("   Init success: disk(%d, 0)\n", DEV_IDE);
@@ -87,25 +169,60 @@ void ideinit(void){
 
 // Start the request for b.  Caller must hold idelock.
 static void idestart(struct buf* b){
+	int read_cmd, write_cmd;
+
 	if (b == 0)
 		panic("idestart");
+	idedma = idedmasetup(b);
+	if (idedma) {
+		read_cmd = IDE_CMD_RDDMA;
+		write_cmd = IDE_CMD_WRDMA;
+		amd64_out32(idebm + BM_PRDT, V2P(prdt));
+		amd64_out8(idebm + BM_STATUS, BM_ST_ERR | BM_ST_INTR); // write 1 to clear
+		amd64_out8(idebm + BM_CMD, (b->flags & B_DIRTY) ? 0 : BM_CMD_READ);
+	} else {
+		if (b->nsec > IDE_MAXSECT)
+			panic("idestart: too many sectors");
+		read_cmd = b->nsec == 1 ? IDE_CMD_READ : IDE_CMD_RDMUL;
+		write_cmd = b->nsec == 1 ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+	}
 
 	idewait(0);
 	amd64_out8((ideChannel == PRIMARY_IDE_CHANNEL_BASE ? PRIMARY_IDE_INTERRUPT : SECONDARY_IDE_INTERRUPT), 0); // generate interrupt
-	amd64_out8(ideChannel + 2, 1); // number of sectors
+	amd64_out8(ideChannel + 2, b->nsec); // number of sectors
 	amd64_out8(ideChannel + 3, b->sector & 0xff);
 	amd64_out8(ideChannel + 4, (b->sector >> 8) & 0xff);
 	amd64_out8(ideChannel + 5, (b->sector >> 16) & 0xff);
 	amd64_out8(ideChannel + 6, (b->dev == 1 ? IDE_SLAVE : IDE_MASTER) | ((b->sector >> 24) & 0x0f));
 	if (b->flags & B_DIRTY) {
-		amd64_out8(ideChannel + 7, IDE_CMD_WRITE);
-		amd64_outsl(ideChannel, b->data, 512 / 4);
+		amd64_out8(ideChannel + 7, write_cmd);
+		if (!idedma)
+			amd64_outsl(ideChannel, b->data, b->nsec * 512 / 4);
 	} else {
-		amd64_out8(ideChannel + 7, IDE_CMD_READ);
+		amd64_out8(ideChannel + 7, read_cmd);
+	}
+	if (idedma)
+		amd64_out8(idebm + BM_CMD, amd64_in8(idebm + BM_CMD) | BM_CMD_START);
+}
+
+// Bottom half: wake whoever waits on the bufs ideintr() finished.
+static void idesoftirq(void){
+	void* chan;
+
+	for (;;) {
+		acquire(&idelock);
+		if (idedoner == idedonew) {
+			release(&idelock);
+			return;
+		}
+		chan = idedone[idedoner++ % NIDEDONE];
+		release(&idelock);
+		wakeup(chan);
 	}
 }
 
-// Interrupt handler.
+// Interrupt handler. The waiter is woken from the bottom half,
+// unless too many are already waiting for that.
 void ideintr(void){
 	struct buf* b;
 
@@ -118,14 +235,28 @@ void ideintr(void){
 	}
 	idequeue = b->qnext;
 
-	// Read data if needed.
-	if (!(b->flags & B_DIRTY) && idewait(1) >= 0)
-		amd64_insl(ideChannel, b->data, 512 / 4);
+	if (idedma) {
+		// Stop the engine and acknowledge its interrupt.
+		uint8 st = amd64_in8(idebm + BM_STATUS);
+		amd64_out8(idebm + BM_CMD, amd64_in8(idebm + BM_CMD) & ~BM_CMD_START);
+		amd64_out8(idebm + BM_STATUS, BM_ST_ERR | BM_ST_INTR);
+		if ((st & BM_ST_ERR) || idewait(1) < 0)
+			cprintf("ide: DMA error on sector %d\n", b->sector);
+		idedma = 0;
+	} else if (!(b->flags & B_DIRTY) && idewait(1) >= 0) {
+		// Read data if needed.
+		amd64_insl(ideChannel, b->data, b->nsec * 512 / 4);
+	}
 
 	// Wake process waiting for this buf.
 	b->flags |= B_VALID;
 	b->flags &= ~B_DIRTY;
-	wakeup(b);
+	if (idedonew - idedoner < NIDEDONE) {
+		idedone[idedonew++ % NIDEDONE] = b;
+		raise_softirq(SOFTIRQ_IDE);
+	} else {
+		wakeup(b);
+	}
 
 	// Start disk on next buf in queue.
 	if (idequeue != 0)
@@ -140,8 +271,8 @@ void ideintr(void){
 void iderw(struct buf* b){
 	struct buf** pp;
 
-	if (!(b->flags & B_BUSY))
-		panic("iderw: buf not busy");
+	if (!holdingsleep(&b->lock))
+		panic("iderw: buf not locked");
 	if ((b->flags & (B_VALID | B_DIRTY)) == B_VALID)
 		panic("iderw: nothing to do");
 	if (b->dev != 0 && !havedisk1)
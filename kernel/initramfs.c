@@ -0,0 +1,176 @@
+// The built-in root file system of a MEMFS kernel.
+//
+// A MEMFS build links a cpio archive of the fs directory, made by
+// tools/mkinitramfs.c, into the kernel. vfsinit() then mounts
+// tmpfs as the root instead of a disk, and initramfs(), once all
+// of memory is kalloc()'s, unpacks the archive into it. From then
+// on file data is in tmpfs's pages: no disk driver, buffer cache
+// or log lies between a read and the page it copies from, and
+// the archive is not looked at again.
+//
+// The archive is in cpio's "newc" format, as Linux's initramfs:
+// each entry is a 110 byte header of ASCII hex fields, the name,
+// and the data, the latter two padded to 4 bytes. Directories,
+// regular files and character devices are made; anything else
+// is skipped.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "vfs.h"
+#include "fs/fs1.h"
+#include "file.h"
+#include "kernel/string.h"
+
+#define CPIO_MAGIC    "070701"
+#define CPIO_HDRSZ    110
+#define CPIO_TRAILER  "TRAILER!!!"
+#define CPIO_MODE     1          // header fields, after the magic
+#define CPIO_FILESIZE 6
+#define CPIO_RDEVMAJ  9
+#define CPIO_RDEVMIN  10
+#define CPIO_NAMESIZE 11
+
+#define S_IFMT  0170000
+#define S_IFDIR 0040000
+#define S_IFREG 0100000
+#define S_IFCHR 0020000
+
+#define MAXPATH   256
+#define ALIGN4(n) (((n) + 3) & ~(uintp)3)
+
+// From the Makefile, under MEMFS; absent, and so 0, otherwise.
+extern char _binary_initramfs_cpio_start[] __attribute__((weak));
+extern char _binary_initramfs_cpio_size[] __attribute__((weak));
+
+int initramfs_present(void){
+	return _binary_initramfs_cpio_start != 0;
+}
+
+// Header field i, or -1 if it isn't hex.
+static int64 cpiofield(char* h, int i){
+	char* p = h + 6 + 8 * i;
+	int64 v = 0;
+
+	for (int j = 0; j < 8; j++) {
+		int c = p[j];
+		if (c >= '0' && c <= '9')
+			v = v * 16 + c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v = v * 16 + c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			v = v * 16 + c - 'A' + 10;
+		else
+			return -1;
+	}
+	return v;
+}
+
+// Make path, with n bytes of data if a file. An existing
+// directory is left as it is. Returns -1 if it can't be made.
+static int mkentry(char* path, short type, short major, short minor, char* data, uint n){
+	struct inode* ip, * dp;
+	char name[DIRSIZ];
+	int r;
+
+	if ((dp = nameiparent(path, name)) == 0)
+		return -1;
+	ilock(dp);
+	if ((ip = dirlookup(dp, name, 0)) != 0) {
+		iunlockput(dp);
+		ilock(ip);
+		r = ip->type == T_DIR && type == T_DIR ? 0 : -1;
+		iunlockput(ip);
+		return r;
+	}
+	if ((ip = ialloc(dp->dev, type)) == 0) {
+		iunlockput(dp);
+		return -1;
+	}
+	ilock(ip);
+	ip->major = major;
+	ip->minor = minor;
+	ip->nlink = 1;
+	iupdate(ip);
+	if (type == T_DIR) {
+		dp->nlink++; // for ".."
+		iupdate(dp);
+		if (dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0)
+			panic("initramfs: dots");
+	}
+	if (dirlink(dp, name, ip->inum) < 0)
+		panic("initramfs: dirlink");
+	iunlockput(dp);
+
+	r = n > 0 && writei(ip, data, 0, n) != n ? -1 : 0;
+	iunlockput(ip);
+	return r;
+}
+
+// Unpack the built-in archive into the root. From main(), after
+// kinit2(), and before there are processes to look.
+void initramfs(void){
+	char* p = _binary_initramfs_cpio_start;
+	char* end = p + (uintp)_binary_initramfs_cpio_size;
+	char path[MAXPATH];
+	int nfiles = 0, nbad = 0;
+	uint64 bytes = 0;
+
+	if (!initramfs_present())
+		return;
+	while (p + CPIO_HDRSZ <= end) {
+		char* h = p, * name = h + CPIO_HDRSZ, * data;
+		int64 mode = cpiofield(h, CPIO_MODE), size = cpiofield(h, CPIO_FILESIZE);
+		int64 namesz = cpiofield(h, CPIO_NAMESIZE);
+		short type;
+
+		if (strncmp(h, CPIO_MAGIC, 6) != 0 || mode < 0 || size < 0 || namesz <= 0 ||
+		    name + namesz > end || name[namesz - 1] != 0) {
+			cprintf("initramfs: bad header at %d\n", (int)(h - _binary_initramfs_cpio_start));
+			break;
+		}
+		data = h + ALIGN4(CPIO_HDRSZ + namesz);
+		if (data + size > end) {
+			cprintf("initramfs: /%s cut short\n", name);
+			break;
+		}
+		p = data + ALIGN4(size);
+		if (strncmp(name, CPIO_TRAILER, sizeof(CPIO_TRAILER)) == 0)
+			break;
+
+		while (name[0] == '.' && name[1] == '/')
+			name += 2;
+		while (*name == '/')
+			name++;
+		if (*name == 0 || strncmp(name, ".", 2) == 0)
+			continue;
+		switch (mode & S_IFMT) {
+		case S_IFDIR: type = T_DIR; break;
+		case S_IFREG: type = T_FILE; break;
+		case S_IFCHR: type = T_DEV; break;
+		default:
+			cprintf("initramfs: /%s: can't make that kind of file\n", name);
+			nbad++;
+			continue;
+		}
+		if (strlen(name) + 2 > sizeof(path)) {
+			cprintf("initramfs: /%s: name too long\n", name);
+			nbad++;
+			continue;
+		}
+		path[0] = '/';
+		safestrcpy(path + 1, name, sizeof(path) - 1);
+		if (mkentry(path, type, cpiofield(h, CPIO_RDEVMAJ), cpiofield(h, CPIO_RDEVMIN),
+		            data, type == T_FILE ? size : 0) < 0) {
+			cprintf("initramfs: can't make %s\n", path);
+			nbad++;
+			continue;
+		}
+		nfiles++;
+		bytes += type == T_FILE ? size : 0;
+	}
+	cprintf("initramfs: %d files, %d KB%s\n", nfiles, (int)(bytes / 1024), nbad ? ", some missing" : "");
+}
@@ -1,11 +1,23 @@
 // The I/O APIC manages hardware interrupts for an SMP system.
 // http://www.intel.com/design/chipsets/datashts/29056601.pdf
 // See also picirq.c.
+//
+// Drivers enable their interrupt with the cpu they would like it
+// on, but once all cpus are up irqbalance() spreads the enabled
+// ones round-robin over the cpus not reserved for blessed
+// processes, and does so again whenever a reservation changes.
+// irqaffinity() pins an interrupt to a cpu, out of the balancing.
+// MSI vectors are programmed into their devices by pci.c and are
+// not moved here.
 
 #include "types.h"
 #include "defs.h"
+#include "param.h"
 #include "irq.h"
 #include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
 
 #define IOAPIC  0xFEC00000   // Default physical address of IO APIC
 
@@ -25,6 +37,17 @@
 
 volatile struct ioapic* ioapic;
 
+#define NIOAPICIRQ 24  // redirection entries we keep track of
+
+static struct {
+	struct spinlock lock;
+	int maxintr;
+	int balanced;              // irqbalance() has run
+	int enabled[NIOAPICIRQ];
+	int cpu[NIOAPICIRQ];       // where each goes, as a cpus[] index
+	int pinned[NIOAPICIRQ];    // by irqaffinity()
+} irqs;
+
 // IO APIC MMIO structure: write reg, then read or write data.
 struct ioapic {
 	uint reg;
@@ -45,6 +68,7 @@ static void ioapicwrite(int reg, uint data){
 void ioapicinit(void){
 	int i, id, maxintr;
 
+	initlock(&irqs.lock, "ioapic");
 	if (!ismp)
 		return;
 
@@ -60,15 +84,74 @@ void ioapicinit(void){
 		ioapicwrite(REG_TABLE + 2 * i, INT_DISABLED | (T_IRQ0 + i));
 		ioapicwrite(REG_TABLE + 2 * i + 1, 0);
 	}
+	irqs.maxintr = maxintr < NIOAPICIRQ ? maxintr : NIOAPICIRQ - 1;
+}
+
+// Mark interrupt edge-triggered, active high, enabled, and
+// routed to cpu c. Must hold irqs.lock.
+static void route(int irq, int c){
+	ioapicwrite(REG_TABLE + 2 * irq, T_IRQ0 + irq);
+	ioapicwrite(REG_TABLE + 2 * irq + 1, cpus[c].apicid << 24);
+	irqs.cpu[irq] = c;
 }
 
 void ioapicenable(int irq, int cpunum){
+	if (!ismp || irq > irqs.maxintr)
+		return;
+
+	acquire(&irqs.lock);
+	irqs.enabled[irq] = 1;
+	route(irq, irqs.pinned[irq] ? irqs.cpu[irq] : cpunum);
+	release(&irqs.lock);
+	if (irqs.balanced)
+		irqbalance();
+}
+
+// May cpu c take device interrupts?
+static int irqcpu(int c){
+	return cpus[c].started && !(cpus[c].capabilities & CPU_RESERVED_BLESS);
+}
+
+// Deal the interrupts that aren't pinned out over the cpus that
+// are up and not reserved, one each in turn. If all are reserved,
+// leave them where they are.
+void irqbalance(void){
+	int c, n = 0;
+
 	if (!ismp)
 		return;
+	acquire(&irqs.lock);
+	irqs.balanced = 1;
+	for (c = 0; c < ncpu; c++)
+		n += irqcpu(c);
+	c = 0;
+	for (int irq = 0; n > 0 && irq <= irqs.maxintr; irq++) {
+		if (!irqs.enabled[irq] || irqs.pinned[irq])
+			continue;
+		while (!irqcpu(c))
+			c = (c + 1) % ncpu;
+		route(irq, c);
+		c = (c + 1) % ncpu;
+	}
+	release(&irqs.lock);
+}
 
-	// Mark interrupt edge-triggered, active high,
-	// enabled, and routed to the given cpunum,
-	// which happens to be that cpu's APIC ID.
-	ioapicwrite(REG_TABLE + 2 * irq, T_IRQ0 + irq);
-	ioapicwrite(REG_TABLE + 2 * irq + 1, cpunum << 24);
+// Send irq to cpu c from now on, or if c < 0, put it back in the
+// balancing. Returns -1 if irq isn't an enabled I/O APIC
+// interrupt or c can't take it.
+int irqaffinity(int irq, int c){
+	if (!ismp || irq < 0 || irq > irqs.maxintr || c >= ncpu || (c >= 0 && !cpus[c].started))
+		return -1;
+	acquire(&irqs.lock);
+	if (!irqs.enabled[irq]) {
+		release(&irqs.lock);
+		return -1;
+	}
+	irqs.pinned[irq] = c >= 0;
+	if (c >= 0)
+		route(irq, c);
+	release(&irqs.lock);
+	if (c < 0)
+		irqbalance();
+	return 0;
 }
@@ -1,28 +1,93 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers. Allocates 4096-byte pages, or physically
+// contiguous runs of 2^order pages via kmalloc().
+//
+// Free memory from KALLOC_START up to the top of the usable
+// ranges found by e820init() is managed by a binary buddy
+// allocator with orders 0..KMAXORDER. kpgorder[] holds one byte
+// per page: for the first page of a free block it is
+// KPG_FREE|order, for the first page of an allocated block it
+// is the block's order. Holes in the memory map are never
+// marked free, so blocks do not merge across them.
+//
+// Each NUMA node found in the ACPI SRAT has its own free lists
+// and lock, and blocks never merge across nodes. Allocations
+// come from the calling cpu's node first, then from the other
+// nodes nearest first. The pages kinit1() frees are taken to be
+// on node 0.
+//
+// Single pages are additionally cached per cpu (struct kmag)
+// so the common kalloc/kfree path stays off the node locks.
+//
+// A pool of pre-zeroed pages is refilled by the scheduler while
+// a cpu is idle and handed out by kalloc_zeroed(), so page table
+// and user pages are not cleared on the allocation path. Freed
+// pages are only filled with junk when built with KALLOC_JUNK.
+//
+// Pages handed out by kalloc() carry a reference count so that
+// copy-on-write fork can share them; kfree() only releases a
+// page once its last reference is dropped. kalloc_huge() pages
+// are counted on their first page and freed the same way.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
 #include "kernel/string.h"
 
-void freerange(void* vstart, void* vend);
+#define KMAXORDER 10                             // largest block is 4 MB
+#define KNEARLY   ((KALLOC_EARLY - KALLOC_START) / PGSIZE)
+#define KPG_FREE  0x80
+#define KHUGEORDER (PDXSHIFT - PGSHIFT)          // a 2 MB page
+
+#define KZPOOL_SIZE  256   // pre-zeroed pages kept in reserve
+#define KZPOOL_BATCH 8     // pages zeroed per idle pass
+
+static void freerange(void* vstart, void* vend);
+static char* kzpooltake(void);
 extern char end[]; // first address after kernel loaded from ELF file
 
 struct run {
 	struct run* next;
+	struct run* prev;
 };
 
-struct {
+struct kmemnode {
 	struct spinlock lock;
+	struct run freelist[KMAXORDER + 1];   // list heads, one per order
+	uint nfree[KMAXORDER + 1];            // blocks on each list
+	uint64 local;                         // pages handed to cpus on this node
+	uint64 remote;                        // pages handed to cpus elsewhere
+};
+
+struct {
 	int use_lock;
-	struct run* freelist;
+	int nnodes;
+	struct kmemnode node[NNUMA];
+	uchar fallback[NNUMA][NNUMA];         // nodes by distance from each node
 } kmem;
 
+// Page metadata. kinit1() uses the static arrays, which only
+// cover the early pages; kinit2() moves them into memory taken
+// from the first usable range large enough for all of RAM.
+static uchar kpgorder0[KNEARLY];
+static ushort kpgref0[KNEARLY];
+static uchar* kpgorder = kpgorder0;
+static ushort* kpgref = kpgref0;
+static uint knpages = KNEARLY;
+
+struct {
+	struct spinlock lock;
+	int count;
+	char* pages[KZPOOL_SIZE];
+	uint64 hits;
+	uint64 misses;
+} kzpool;
+
 int kalloc_fullysetup = 0;
 
 // Initialization happens in two phases.
@@ -34,25 +99,285 @@ void kinit1(void* vstart, void* vend){
 	uint64 startmb = V2P(vstart) / 1024 / 1024;
 	uint64 endmb = V2P(vend) / 1024 / 1024;
 	cprintf("Freeing mem from %d MB to %d MB...\n", startmb, endmb);
-	initlock(&kmem.lock, "kmem");
+	initlock(&kzpool.lock, "kzpool");
 	kmem.use_lock = 0;
+	kmem.nnodes = 1;
+	for (int n = 0; n < NNUMA; n++) {
+		struct kmemnode* kn = &kmem.node[n];
+		initlock(&kn->lock, "kmem");
+		for (int i = 0; i <= KMAXORDER; i++)
+			kn->freelist[i].next = kn->freelist[i].prev = &kn->freelist[i];
+	}
 	freerange(vstart, vend);
 }
 
-void kinit2(void* vstart, void* vend){
-	uint64 startmb = V2P(vstart) / 1024 / 1024;
-	uint64 endmb = V2P(vend) / 1024 / 1024;
-	cprintf("Freeing mem from %d MB to %d MB...\n", startmb, endmb);
-	freerange(vstart, vend);
+void kinit2(void){
+	uint64 start, end, meta, metaend, n;
+	ushort* ref;
+	uchar* order;
+	int i, j, k, t;
+
+	// Order the nodes by distance from each other, as found
+	// by acpiinit().
+	kmem.nnodes = numanodes();
+	for (i = 0; i < kmem.nnodes; i++) {
+		for (j = 0; j < kmem.nnodes; j++)
+			kmem.fallback[i][j] = j;
+		kmem.fallback[i][0] = i;
+		kmem.fallback[i][i] = 0;
+		for (j = 1; j < kmem.nnodes; j++)
+			for (k = j; k > 1 && numadistance(i, kmem.fallback[i][k]) <
+			     numadistance(i, kmem.fallback[i][k - 1]); k--) {
+				t = kmem.fallback[i][k];
+				kmem.fallback[i][k] = kmem.fallback[i][k - 1];
+				kmem.fallback[i][k - 1] = t;
+			}
+	}
+
+	// Take room for the metadata of every page up to the top
+	// of memory from the first usable range that has it.
+	n = (e820top() - KALLOC_START) / PGSIZE;
+	meta = metaend = 0;
+	for (i = 0; e820range(i, &start, &end); i++) {
+		if (start < KALLOC_EARLY)
+			start = KALLOC_EARLY;
+		if (start < end && end - start >= PGROUNDUP(n * 3)) {
+			meta = start;
+			metaend = start + PGROUNDUP(n * 3);
+			break;
+		}
+	}
+	if (meta == 0)
+		panic("kinit2: no room for page metadata");
+	ref = (ushort*)p2v(meta);
+	order = (uchar*)(ref + n);
+	memset(ref, 0, n * 3);
+	memmove(ref, kpgref0, sizeof(kpgref0));
+	memmove(order, kpgorder0, sizeof(kpgorder0));
+	kpgref = ref;
+	kpgorder = order;
+	knpages = n;
+
+	for (i = 0; e820range(i, &start, &end); i++) {
+		if (start < KALLOC_EARLY)
+			start = KALLOC_EARLY;
+		if (start == meta)
+			start = metaend;
+		if (start >= end)
+			continue;
+		cprintf("Freeing mem from %d MB to %d MB...\n", start / 1024 / 1024, end / 1024 / 1024);
+		freerange(p2v(start), p2v(end));
+	}
 	kmem.use_lock = 1;
 	kalloc_fullysetup = 1;
 }
 
-void freerange(void* vstart, void* vend){
-	char* p;
-	p = (char*)PGROUNDUP((uintp)vstart);
-	for (; p + PGSIZE <= (char*)vend; p += PGSIZE)
-		kfree(p);
+static inline uint pgindex(char* v){
+	return (v2p(v) - KALLOC_START) / PGSIZE;
+}
+
+static inline char* pgaddr(uint idx){
+	return p2v(KALLOC_START + (uintp)idx * PGSIZE);
+}
+
+static void listpush(struct run* head, struct run* r){
+	r->next = head->next;
+	r->prev = head;
+	head->next->prev = r;
+	head->next = r;
+}
+
+static void listremove(struct run* r){
+	r->prev->next = r->next;
+	r->next->prev = r->prev;
+}
+
+// NUMA node holding page idx.
+static inline int pgnode(uint idx){
+	if (kmem.nnodes == 1 || idx < KNEARLY)
+		return 0;
+	return numanode(KALLOC_START + (uint64)idx * PGSIZE);
+}
+
+// Return the 2^order block starting at page idx to the free
+// lists of its node n, merging it with its buddy for as long
+// as the buddy is also free. Caller must hold n->lock if
+// use_lock is set.
+static void buddyfree(struct kmemnode* n, uint idx, uint order){
+	while (order < KMAXORDER) {
+		uint buddy = idx ^ (1 << order);
+		if (buddy + (1 << order) > knpages || kpgorder[buddy] != (KPG_FREE | order))
+			break;
+		if (&kmem.node[pgnode(buddy)] != n)
+			break;
+		listremove((struct run*)pgaddr(buddy));
+		n->nfree[order]--;
+		kpgorder[buddy] = 0;
+		idx &= ~(1 << order);
+		order++;
+	}
+	kpgorder[idx] = KPG_FREE | order;
+	listpush(&n->freelist[order], (struct run*)pgaddr(idx));
+	n->nfree[order]++;
+}
+
+// Take a 2^order block off the free lists of node n, splitting
+// a larger block if needed. Returns 0 if no block is large
+// enough. Caller must hold n->lock if use_lock is set.
+static char* buddyalloc(struct kmemnode* n, uint order){
+	uint o;
+	struct run* r;
+
+	for (o = order; o <= KMAXORDER; o++)
+		if (n->freelist[o].next != &n->freelist[o])
+			break;
+	if (o > KMAXORDER)
+		return 0;
+
+	r = n->freelist[o].next;
+	listremove(r);
+	n->nfree[o]--;
+	uint idx = pgindex((char*)r);
+	while (o > order) {
+		o--;
+		uint half = idx + (1 << o);
+		kpgorder[half] = KPG_FREE | o;
+		listpush(&n->freelist[o], (struct run*)pgaddr(half));
+		n->nfree[o]++;
+	}
+	kpgorder[idx] = order;
+	return (char*)r;
+}
+
+// Free a 2^order block to its node, taking the node's lock.
+static void buddyput(uint idx, uint order){
+	struct kmemnode* n = &kmem.node[pgnode(idx)];
+
+	if (kmem.use_lock)
+		acquire(&n->lock);
+	buddyfree(n, idx, order);
+	if (kmem.use_lock)
+		release(&n->lock);
+}
+
+// Put the pages of [vstart, vend) on the free lists. Rather than
+// one page at a time, each the largest aligned block that fits and
+// stays on one node: only the first page of a block is written, so
+// kinit2() takes a few thousand steps for gigabytes, not a million.
+static void freerange(void* vstart, void* vend){
+	uint idx = pgindex((char*)PGROUNDUP((uintp)vstart));
+	uint top = pgindex((char*)PGROUNDDOWN((uintp)vend));
+	uint order;
+
+	if (top > knpages)
+		panic("freerange");
+	while (idx < top) {
+		for (order = KMAXORDER; order > 0; order--)
+			if ((idx & ((1 << order) - 1)) == 0 && idx + (1 << order) <= top &&
+			    pgnode(idx) == pgnode(idx + (1 << order) - 1))
+				break;
+		buddyput(idx, order);
+		idx += 1 << order;
+	}
+}
+
+// Take a 2^order block for a cpu on node nid, from that
+// node if it has one and otherwise from the nearest node
+// that does.
+static char* buddyget(int nid, uint order){
+	char* v = 0;
+
+	for (int i = 0; i < kmem.nnodes && v == 0; i++) {
+		int id = kmem.fallback[nid][i];
+		struct kmemnode* n = &kmem.node[id];
+		if (kmem.use_lock)
+			acquire(&n->lock);
+		if ((v = buddyalloc(n, order)) != 0) {
+			if (id == nid)
+				n->local += 1 << order;
+			else
+				n->remote += 1 << order;
+		}
+		if (kmem.use_lock)
+			release(&n->lock);
+	}
+	return v;
+}
+
+// Move a batch of pages into this cpu's magazine, from its
+// own node if it has any. Caller must hold pushcli.
+static void kmagrefill(struct kmag* m){
+	int nid = cpu->node;
+	char* v;
+
+	for (int i = 0; i < kmem.nnodes && m->count == 0; i++) {
+		int id = kmem.fallback[nid][i];
+		struct kmemnode* n = &kmem.node[id];
+		acquire(&n->lock);
+		while (m->count < KMAG_BATCH && (v = buddyalloc(n, 0)) != 0) {
+			m->pages[m->count++] = v;
+			if (id == nid)
+				n->local++;
+			else
+				n->remote++;
+		}
+		release(&n->lock);
+	}
+}
+
+// Return a batch of pages from this cpu's magazine to
+// their nodes' freelists. Caller must hold pushcli.
+static void kmagdrain(struct kmag* m){
+	struct kmemnode* held = 0;
+
+	while (m->count > KMAG_SIZE - KMAG_BATCH) {
+		uint idx = pgindex(m->pages[--m->count]);
+		struct kmemnode* n = &kmem.node[pgnode(idx)];
+		if (n != held) {
+			if (held)
+				release(&held->lock);
+			acquire(&n->lock);
+			held = n;
+		}
+		buddyfree(n, idx, 0);
+	}
+	if (held)
+		release(&held->lock);
+}
+
+// Print per-cpu page cache counters and buddy free
+// lists. For debugging; runs from procdump without locks.
+void kmemstats(void){
+	for (int i = 0; i < ncpu; i++) {
+		struct kmag* m = &cpus[i].kmag;
+		cprintf("cpu%d kmag: %d cached, %ld hits, %ld misses\n",
+		        i, m->count, m->hits, m->misses);
+	}
+	for (int i = 0; i < kmem.nnodes; i++) {
+		struct kmemnode* n = &kmem.node[i];
+		cprintf("node%d buddy:", i);
+		for (int o = 0; o <= KMAXORDER; o++)
+			cprintf(" %d", n->nfree[o]);
+		cprintf(", %ld local, %ld remote\n", n->local, n->remote);
+	}
+	cprintf("kzpool: %d zeroed, %ld hits, %ld misses\n",
+	        kzpool.count, kzpool.hits, kzpool.misses);
+}
+
+// Approximate number of free pages in the buddy lists.
+// Read without the lock; only used as a heuristic.
+static uint kfreepages(void){
+	uint n = 0;
+	for (int i = 0; i < kmem.nnodes; i++)
+		for (int o = 0; o <= KMAXORDER; o++)
+			n += kmem.node[i].nfree[o] << o;
+	return n;
+}
+
+static void kcheck(char* v, char* who){
+	if ((uintp)v % PGSIZE || v2p(v) < v2p(end) || v2p(v) < KALLOC_START ||
+	    v2p(v) >= KALLOC_START + (uint64)knpages * PGSIZE)
+		panic(who);
 }
 
 //PAGEBREAK: 21
@@ -61,56 +386,233 @@ void freerange(void* vstart, void* vend){
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
 void kfree(char* v){
-	struct run* r;
+	kcheck(v, "kfree");
 
-	if ((uintp)v % PGSIZE || v < end || v2p(v) >= PHYSTOP)
-		panic("kfree");
+	// Drop a reference; the page stays in use while shared.
+	// Pages never handed out start at zero.
+	ushort* ref = &kpgref[pgindex(v)];
+	if (*ref != 0 && __sync_sub_and_fetch(ref, 1) != 0)
+		return;
+
+	if (kpgorder[pgindex(v)] == KHUGEORDER) {
+#ifdef KALLOC_JUNK
+		memset(v, 1, HUGEPGSIZE);
+#endif
+		buddyput(pgindex(v), KHUGEORDER);
+		return;
+	}
 
+#ifdef KALLOC_JUNK
 	// Fill with junk to catch dangling refs.
 	memset(v, 1, PGSIZE);
+#endif
 
-	if (kmem.use_lock)
-		acquire(&kmem.lock);
-	r = (struct run*)v;
-	r->next = kmem.freelist;
-	kmem.freelist = r;
-	if (kmem.use_lock)
-		release(&kmem.lock);
+	// Only pages of this cpu's own node are kept in its
+	// magazine; others go straight back to their node.
+	if (kmem.use_lock) {
+		pushcli();
+		if (pgnode(pgindex(v)) == cpu->node) {
+			struct kmag* m = &cpu->kmag;
+			if (m->count == KMAG_SIZE) {
+				m->misses++;
+				kmagdrain(m);
+			} else {
+				m->hits++;
+			}
+			m->pages[m->count++] = v;
+			popcli();
+			return;
+		}
+		popcli();
+	}
+	buddyput(pgindex(v), 0);
+}
+
+static char* kalloc1(void){
+	if (kmem.use_lock) {
+		char* v = 0;
+		pushcli();
+		struct kmag* m = &cpu->kmag;
+		if (m->count == 0) {
+			m->misses++;
+			kmagrefill(m);
+		} else {
+			m->hits++;
+		}
+		if (m->count > 0)
+			v = m->pages[--m->count];
+		popcli();
+		if (v == 0)
+			return kzpooltake();
+		kpgref[pgindex(v)] = 1;
+		return v;
+	}
+	char* v = buddyget(0, 0);
+	if (v)
+		kpgref[pgindex(v)] = 1;
+	return v;
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 char* kalloc(void){
-	struct run* r;
+	char* v;
 
-	if (kmem.use_lock)
-		acquire(&kmem.lock);
-	r = kmem.freelist;
-	if (r)
-		kmem.freelist = r->next;
-	if (kmem.use_lock)
-		release(&kmem.lock);
-	return (char*)r;
+	// Out of memory: win some back from the caches.
+	if ((v = kalloc1()) == 0 && shrink(KMAG_BATCH) > 0)
+		v = kalloc1();
+	return v;
 }
 
+// Pages of memory managed, counting holes in the memory map.
+uint kmemtotal(void){
+	return knpages;
+}
+
+// Pages free, roughly; see kfreepages().
+uint kmemfree(void){
+	return kfreepages();
+}
+
+// Allocate one zero-filled, 2 MB aligned page of HUGEPGSIZE
+// bytes for a PTE_PS mapping. It is reference counted like a
+// kalloc() page and released with kfree(). Returns 0 if no
+// free block is large enough.
+char* kalloc_huge(void){
+	char* v;
+
+	if (!kmem.use_lock)
+		return 0;
+	if ((v = buddyget(cpu->node, KHUGEORDER)) == 0)
+		return 0;
+	memset(v, 0, HUGEPGSIZE);
+	kpgref[pgindex(v)] = 1;
+	return v;
+}
+
+// Turn an unshared page from kalloc_huge() into single pages,
+// each with one reference, that are freed one at a time.
+void ksplit(char* v){
+	uint idx, i;
+
+	kcheck(v, "ksplit");
+	idx = pgindex(v);
+	if (kpgorder[idx] != KHUGEORDER || kpgref[idx] != 1)
+		panic("ksplit");
+	for (i = 0; i < HUGEPGSIZE / PGSIZE; i++) {
+		kpgorder[idx + i] = 0;
+		kpgref[idx + i] = 1;
+	}
+}
+
+// Take another reference to a page returned by kalloc().
+void kref(char* v){
+	kcheck(v, "kref");
+	__sync_add_and_fetch(&kpgref[pgindex(v)], 1);
+}
+
+// Number of references held to a page returned by kalloc().
+int krefcount(char* v){
+	kcheck(v, "krefcount");
+	return kpgref[pgindex(v)];
+}
+
+// Take a page from the zeroed pool, or return 0 if it is empty.
+static char* kzpooltake(void){
+	char* v = 0;
+
+	acquire(&kzpool.lock);
+	if (kzpool.count > 0)
+		v = kzpool.pages[--kzpool.count];
+	release(&kzpool.lock);
+	return v;
+}
+
+// Allocate one zero-filled page, preferably from the pool
+// of pages cleared while idle. Returns 0 if out of memory.
+char* kalloc_zeroed(void){
+	char* v;
+
+	if ((v = kzpooltake()) != 0) {
+		kzpool.hits++;
+		return v;
+	}
+	kzpool.misses++;
+	if ((v = kalloc()) != 0)
+		memset(v, 0, PGSIZE);
+	return v;
+}
+
+// Zero a few free pages into the pool. Called by the
+// scheduler when it finds nothing to run. Leaves the pool
+// alone once less than a pool's worth of memory is free.
+// Returns the number of pages zeroed.
+int kzpoolfill(void){
+	int i;
+
+	if (!kmem.use_lock)
+		return 0;
+	for (i = 0; i < KZPOOL_BATCH; i++) {
+		if (kzpool.count >= KZPOOL_SIZE || kfreepages() < 2 * KZPOOL_SIZE)
+			return i;
+		char* v = kalloc();
+		if (v == 0)
+			return i;
+		memset(v, 0, PGSIZE);
+		acquire(&kzpool.lock);
+		if (kzpool.count < KZPOOL_SIZE) {
+			kzpool.pages[kzpool.count++] = v;
+			v = 0;
+		}
+		release(&kzpool.lock);
+		if (v)
+			kfree(v);
+	}
+	return i;
+}
+
+// Smallest order whose block holds the given number of pages.
+static uint pagesorder(uint16 pages){
+	uint order = 0;
+	while ((1 << order) < pages)
+		order++;
+	return order;
+}
+
+// Allocate physically contiguous memory of at least the given
+// number of pages, rounded up to a power of two. The result is
+// aligned to its size relative to KALLOC_START. Free with kmfree().
+// Returns 0 if the memory cannot be allocated.
 char *kmalloc(uint16 pages){
 	if(!kalloc_fullysetup) {
 		panic("kalloc not fully setup");
 	}
-	struct run* r;
+	if (pages == 0)
+		return 0;
+	if (pages == 1)
+		return kalloc();
+	uint order = pagesorder(pages);
+	if (order > KMAXORDER)
+		return 0;
 
-	if (kmem.use_lock)
-		acquire(&kmem.lock);
-	r = kmem.freelist;
-	if (r) {
-		struct run* n = r->next;
-		for(uint8 i = 0; i != pages; i++) {
-			kmem.freelist = n;
-			n = n->next;
-		}
+	return buddyget(cpu->node, order);
+}
+
+// Free memory returned by kmalloc(pages).
+void kmfree(char* v, uint16 pages){
+	if (pages <= 1) {
+		kfree(v);
+		return;
 	}
-	if (kmem.use_lock)
-		release(&kmem.lock);
-	return (char*)r;
+	kcheck(v, "kmfree");
+	uint order = pagesorder(pages);
+	if (kpgorder[pgindex(v)] != order)
+		panic("kmfree: bad order");
+
+#ifdef KALLOC_JUNK
+	memset(v, 1, PGSIZE << order);
+#endif
+
+	buddyput(pgindex(v), order);
 }
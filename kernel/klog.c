@@ -0,0 +1,159 @@
+// Kernel log.
+//
+// cprintf() hands each message to klogwrite(), which appends it
+// to its cpu's ring and returns: it never waits for the screen or
+// the serial port, or for another cpu. The klogd kernel thread
+// takes messages off the rings, in the order it finds them, writes
+// them to the console, and keeps the last KLOGSIZE bytes in a
+// history that klogread() (the dmesg command) copies out.
+//
+// A cpu's ring has one writer, that cpu with interrupts off, and
+// one reader, klogd, so it needs no lock: each side only moves its
+// own index forward. A message that doesn't fit is dropped and
+// counted, and klogd says how much was lost.
+//
+// Until klogd is running, and from panic() on, messages are
+// written through to the console instead, in the caller.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "mmu.h"
+#include "proc.h"
+#include "ktimer.h"
+#include "kernel/string.h"
+
+#define KLOGCPU  2048   // bytes in a cpu's ring
+#define KLOGSIZE 16384  // bytes of history
+
+struct klogring {
+	char buf[KLOGCPU];
+	uint head;           // written up to here, by the cpu
+	uint tail;           // read up to here, by klogd
+	uint dropped;        // bytes that didn't fit
+};
+
+static struct {
+	struct spinlock lock; // the history
+	int locking;          // from consoleinit() until panic()
+	int async;            // klogd is draining the rings
+	char hist[KLOGSIZE];
+	uint64 end;           // bytes ever put in the history
+	struct klogring ring[NCPU];
+} klog;
+
+void kloginit(void){
+	initlock(&klog.lock, "klog");
+	klog.locking = 1;
+}
+
+// Remember s for klogread(). Doesn't take the lock once we have
+// panicked: whoever held it isn't going to let go.
+static void klogsave(char* s, int n){
+	int locking = klog.locking;
+
+	if (locking)
+		acquire(&klog.lock);
+	for (int i = 0; i < n; i++)
+		klog.hist[klog.end++ % KLOGSIZE] = s[i];
+	if (locking)
+		release(&klog.lock);
+}
+
+void klogwrite(char* s, int n){
+	struct klogring* r;
+	uint head;
+
+	if (!klog.async) {
+		klogsave(s, n);
+		consoleputs(s, n);
+		return;
+	}
+	pushcli();
+	r = &klog.ring[cpu->id];
+	head = r->head;
+	if (head + n - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > KLOGCPU) {
+		__atomic_fetch_add(&r->dropped, n, __ATOMIC_RELAXED);
+	} else {
+		for (int i = 0; i < n; i++)
+			r->buf[(head + i) % KLOGCPU] = s[i];
+		__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+	}
+	popcli();
+}
+
+// Move what is in the rings to the history and the console.
+// Returns the bytes moved.
+static int klogdrain(void){
+	struct klogring* r;
+	char buf[128];
+	uint head, n, dropped, moved = 0;
+
+	for (int c = 0; c < ncpu; c++) {
+		r = &klog.ring[c];
+		while ((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) != r->tail) {
+			n = head - r->tail;
+			if (n > sizeof(buf))
+				n = sizeof(buf);
+			for (uint i = 0; i < n; i++)
+				buf[i] = r->buf[(r->tail + i) % KLOGCPU];
+			__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+			klogsave(buf, n);
+			consoleputs(buf, n);
+			moved += n;
+		}
+		if ((dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED)) != 0)
+			cprintf("klog: cpu%d dropped %d bytes\n", c, dropped);
+	}
+	return moved;
+}
+
+static void klogd(void* arg){
+	struct ktimer t;
+
+	memset(&t, 0, sizeof(t));
+	klog.async = 1;
+	for (;;) {
+		if (klogdrain() > 0)
+			continue;
+		acquire(&tickslock);
+		ktimerset(&t, ticks + 1, wakeup, &t);
+		sleep(&t, &tickslock);
+		release(&tickslock);
+	}
+}
+
+// Start the thread that writes the log to the console.
+void klogdinit(void){
+	if (kthread("klogd", klogd, 0) < 0)
+		panic("klogdinit");
+}
+
+// We are panicking: write through from now on, after what the
+// rings hold, which klogd may never get to.
+void klogsync(void){
+	int async = klog.async;
+
+	klog.locking = 0;
+	klog.async = 0;
+	if (async)
+		klogdrain();
+}
+
+// Copy the last n bytes (at most) of the log to dst. Returns the
+// number copied.
+int klogread(char* dst, int n){
+	uint64 start;
+
+	acquire(&klog.lock);
+	if (n > KLOGSIZE)
+		n = KLOGSIZE;
+	if (n > klog.end)
+		n = klog.end;
+	start = klog.end - n;
+	for (int i = 0; i < n; i++)
+		dst[i] = klog.hist[(start + i) % KLOGSIZE];
+	release(&klog.lock);
+	return n;
+}
@@ -0,0 +1,233 @@
+// Shared-memory rings for blessed processes.
+//
+// A blessed process that calls kringmap() gets a pair of rings
+// (struct kringmap, in kring.h) mapped into its address space,
+// and from then on the readers and writers of its process loop
+// device go through them instead of the pipes: a read takes
+// what the process put in out, a write puts into in what the
+// process will take, each a single copy, and the process moves
+// its side of the rings without a system call. Both sides only
+// enter the kernel to sleep, in kringwait() or a device read or
+// write, or to wake the other, in kringnotify().
+//
+// The kernel side of each ring may have several readers or
+// writers of the device, serialized by the pair's lock so that
+// each ring still has one producer and one consumer. Everyone
+// waiting on the pair sleeps on it. The pages are mapped with a
+// reference each, so they outlive whichever of the process and
+// the pair goes first. The pair itself is counted, by the process
+// and by each device call using it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "poll.h"
+#include "fcntl.h"
+#include "kernel/string.h"
+#include "kring.h"
+
+struct kringpair {
+	struct spinlock lock;
+	int ref;
+	int dead;                      // the process is gone
+	struct kringmap* map;          // the index page
+	char* outdata;
+	char* indata;
+	struct pollhead poll;
+};
+
+static struct kmem_cache* kringcache;
+
+void kringinit(void){
+	kringcache = kmem_cache_create("kring", sizeof(struct kringpair), 0);
+}
+
+static void kringfree(struct kringpair* kp){
+	kfree((char*)kp->map);
+	kfree(kp->outdata);
+	kfree(kp->indata);
+	kmem_cache_free(kringcache, kp);
+}
+
+// Take a reference to p's rings, or return 0 if it has none.
+// Must hold ptable.lock, so p keeps its reference meanwhile.
+struct kringpair* kringget(struct proc* p){
+	struct kringpair* kp = p->kring;
+
+	if (kp)
+		__sync_add_and_fetch(&kp->ref, 1);
+	return kp;
+}
+
+void kringput(struct kringpair* kp){
+	if (__sync_sub_and_fetch(&kp->ref, 1) == 0)
+		kringfree(kp);
+}
+
+// The process is exiting: wake everyone waiting on it.
+void kringclose(struct kringpair* kp){
+	acquire(&kp->lock);
+	kp->dead = 1;
+	wakeup(kp);
+	pollwake(&kp->poll);
+	release(&kp->lock);
+}
+
+// Wake whoever waits on the rings. Must hold kp->lock.
+static void kringwake(struct kringpair* kp){
+	wakeup(kp);
+	pollwake(&kp->poll);
+}
+
+// A device read: take up to n bytes from the out ring, sleeping
+// until there are some. Returns 0 once the process is gone.
+int kringread(struct kringpair* kp, char* dst, int n){
+	struct kring* r = &kp->map->out;
+	int m;
+
+	acquire(&kp->lock);
+	for (;;) {
+		r->cwait = 1;
+		__sync_synchronize();
+		if ((m = kring_get(r, kp->outdata, dst, n)) > 0 || kp->dead)
+			break;
+		if (proc->killed) {
+			release(&kp->lock);
+			return -1;
+		}
+		sleep(kp, &kp->lock);
+	}
+	r->cwait = 0;
+	if (r->pwait)
+		kringwake(kp);
+	release(&kp->lock);
+	return m;
+}
+
+// A device write: put all n bytes into the in ring, sleeping
+// while it is full.
+int kringwrite(struct kringpair* kp, char* src, int n){
+	struct kring* r = &kp->map->in;
+	int tot = 0;
+
+	acquire(&kp->lock);
+	while (tot < n) {
+		r->pwait = 1;
+		__sync_synchronize();
+		tot += kring_put(r, kp->indata, src + tot, n - tot);
+		if (r->cwait)
+			kringwake(kp);
+		if (tot == n)
+			break;
+		if (kp->dead || proc->killed) {
+			release(&kp->lock);
+			return F_ERROR;
+		}
+		sleep(kp, &kp->lock);
+	}
+	r->pwait = 0;
+	release(&kp->lock);
+	return n;
+}
+
+// poll() of the device.
+int kringpoll(struct kringpair* kp, struct poller* pt){
+	int r = 0;
+
+	pollwait(&kp->poll, pt);
+	acquire(&kp->lock);
+	if (kring_used(&kp->map->out))
+		r |= POLLIN;
+	if (kring_room(&kp->map->in))
+		r |= POLLOUT;
+	if (kp->dead)
+		r |= POLLHUP;
+	release(&kp->lock);
+	return r;
+}
+
+// Map the calling blessed process's rings into its address space,
+// making them first if need be. Returns the address, or 0.
+uintp kringmap(void){
+	struct kringpair* kp;
+	char* pages[3];
+
+	if (proc->blessed != PROC_BLESSED)
+		return 0;
+	if ((kp = proc->kring) == 0) {
+		if ((kp = kmem_cache_alloc(kringcache)) == 0)
+			return 0;
+		memset(kp, 0, sizeof(*kp));
+		kp->map = (struct kringmap*)kalloc_zeroed();
+		kp->outdata = kalloc();
+		kp->indata = kalloc();
+		if (kp->map == 0 || kp->outdata == 0 || kp->indata == 0) {
+			if (kp->map)
+				kfree((char*)kp->map);
+			if (kp->outdata)
+				kfree(kp->outdata);
+			if (kp->indata)
+				kfree(kp->indata);
+			kmem_cache_free(kringcache, kp);
+			return 0;
+		}
+		initlock(&kp->lock, "kring");
+		kp->ref = 1;
+		__sync_synchronize(); // set up before findproc() callers see it
+		proc->kring = kp;
+	}
+
+	pages[0] = (char*)kp->map;
+	pages[1] = kp->outdata;
+	pages[2] = kp->indata;
+	return mmapshared(proc, pages, 3);
+}
+
+// The process's side: sleep until what (KRING_IN, KRING_OUT) holds
+// of its rings. Returns what does, or -1.
+int kringwait(int what){
+	struct kringpair* kp = proc->kring;
+	int r;
+
+	if (kp == 0 || (what & ~(KRING_IN | KRING_OUT)) || what == 0)
+		return -1;
+	acquire(&kp->lock);
+	for (;;) {
+		if (what & KRING_IN)
+			kp->map->in.cwait = 1;
+		if (what & KRING_OUT)
+			kp->map->out.pwait = 1;
+		__sync_synchronize();
+		r = 0;
+		if ((what & KRING_IN) && kring_used(&kp->map->in))
+			r |= KRING_IN;
+		if ((what & KRING_OUT) && kring_room(&kp->map->out))
+			r |= KRING_OUT;
+		if (r)
+			break;
+		if (proc->killed) {
+			release(&kp->lock);
+			return -1;
+		}
+		sleep(kp, &kp->lock);
+	}
+	release(&kp->lock);
+	return r;
+}
+
+// The process's doorbell, rung after it moved an index the kernel
+// side may be waiting on.
+int kringnotify(void){
+	struct kringpair* kp = proc->kring;
+
+	if (kp == 0)
+		return -1;
+	acquire(&kp->lock);
+	kringwake(kp);
+	release(&kp->lock);
+	return 0;
+}
@@ -0,0 +1,93 @@
+// Kernel stacks.
+//
+// Each process's kernel stack is KSTACKSIZE bytes at the top of a
+// KSTACKSLOT-sized slot of the region at KSTACKBASE, and the rest
+// of the slot, below it, is left unmapped: running off the end of
+// a stack faults instead of overwriting whatever kalloc() put next
+// to it. That fault can't be taken on the stack that overflowed,
+// so it becomes a double fault, which has a stack of its own (see
+// seginit()) and panics.
+//
+// The pages are separate kalloc() pages, mapped into kpml4's part
+// of every address space. A freed slot keeps its pages and goes on
+// a free list, chained through its lowest word, to be handed out
+// again as it is: a slot's mapping never changes, so no cpu can be
+// left with a stale TLB entry for it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+
+#define NKSTACK ((uint)(KSTACKREGION / KSTACKSLOT))
+
+static struct {
+	struct spinlock lock;
+	char* free;          // slots freed, with their pages
+	uint nslot;          // slots ever mapped
+	uint partial;        // pages of the next slot mapped before running out
+	uint nfree;
+} ks;
+
+void kstackinit(void){
+	initlock(&ks.lock, "kstack");
+}
+
+// Map a new slot's stack pages. Returns the stack, or 0 if out
+// of slots or memory. Must hold ks.lock.
+static char* newslot(void){
+	char* stack, * page;
+	uint i;
+
+	if (ks.nslot == NKSTACK)
+		return 0;
+	stack = (char*)KSTACKBASE + (uintp)ks.nslot * KSTACKSLOT + KSTACKSLOT - KSTACKSIZE;
+	for (i = ks.partial; i < KSTACKSIZE / PGSIZE; i++) {
+		if ((page = kalloc()) == 0 || kmap(stack + i * PGSIZE, page) < 0) {
+			if (page)
+				kfree(page);
+			// The pages mapped so far stay, and the next try
+			// starts after them rather than mapping them again.
+			ks.partial = i;
+			return 0;
+		}
+	}
+	ks.partial = 0;
+	ks.nslot++;
+	return stack;
+}
+
+// Return a kernel stack, KSTACKSIZE bytes from the address
+// returned, or 0.
+char* kstackalloc(void){
+	char* stack;
+
+	acquire(&ks.lock);
+	if ((stack = ks.free) != 0) {
+		ks.free = *(char**)stack;
+		ks.nfree--;
+	} else {
+		stack = newslot();
+	}
+	release(&ks.lock);
+	return stack;
+}
+
+void kstackfree(char* stack){
+	if ((uintp)stack < KSTACKBASE || (uintp)stack >= KSTACKBASE + KSTACKREGION ||
+	    ((uintp)stack - KSTACKBASE) % KSTACKSLOT != KSTACKSLOT - KSTACKSIZE)
+		panic("kstackfree");
+	acquire(&ks.lock);
+	*(char**)stack = ks.free;
+	ks.free = stack;
+	ks.nfree++;
+	release(&ks.lock);
+}
+
+// Is va in the unmapped part of a kernel stack slot?
+int kstackguard(uintp va){
+	return va >= KSTACKBASE && va < KSTACKBASE + KSTACKREGION &&
+	       (va - KSTACKBASE) % KSTACKSLOT < KSTACKSLOT - KSTACKSIZE;
+}
@@ -0,0 +1,136 @@
+// Kernel timers.
+//
+// Pending timers live in a hierarchical timer wheel: four levels
+// of 64 slots, level n holding timers due within 64^(n+1) ticks.
+// Each tick runs the level 0 slot for that tick; every 64 ticks
+// the current slot of the level above is cascaded down. Adding,
+// cancelling and firing a timer are O(1) apart from the cascade,
+// and the tick handler only touches timers that are due.
+//
+// Timer functions run from the timer interrupt on cpu 0, with
+// tickslock and the wheel lock held, so they must be short and
+// must not take tickslock or call back into ktimer*().
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "ktimer.h"
+
+#define TVBITS   6
+#define TVSIZE   (1 << TVBITS)
+#define TVMASK   (TVSIZE - 1)
+#define TVLEVELS 4
+#define TVMAX    (1U << (TVBITS * TVLEVELS))  // furthest a timer is filed
+
+static struct {
+	struct spinlock lock;
+	uint now;                      // next tick to run
+	struct ktimer *wheel[TVLEVELS][TVSIZE];
+} tw;
+
+void ktimerinit(void){
+	initlock(&tw.lock, "ktimer");
+	tw.now = ticks;
+}
+
+// File t in the slot of the wheel it is due in. Must hold tw.lock.
+static void enqueue(struct ktimer* t){
+	uint delta, when;
+	struct ktimer** slot;
+	int lvl;
+
+	when = t->expires;
+	delta = when - tw.now;
+	if ((int)delta < 0) {
+		when = tw.now;
+		delta = 0;
+	}
+	if (delta >= TVMAX) {
+		// Too far out: park it in the last slot of the top level
+		// to come around, and file it again from there.
+		when = tw.now + TVMAX - 1;
+		delta = TVMAX - 1;
+	}
+	for (lvl = 0; lvl < TVLEVELS - 1; lvl++)
+		if (delta < 1U << (TVBITS * (lvl + 1)))
+			break;
+
+	slot = &tw.wheel[lvl][(when >> (TVBITS * lvl)) & TVMASK];
+	t->next = *slot;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void dequeue(struct ktimer* t){
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = 0;
+	t->pprev = 0;
+}
+
+// Arrange for fn(arg) to be called at tick expires, replacing any
+// earlier setting of t. t must stay valid until it fires or is
+// cancelled.
+void ktimerset(struct ktimer* t, uint expires, void (*fn)(void*), void* arg){
+	acquire(&tw.lock);
+	if (t->pprev)
+		dequeue(t);
+	t->expires = expires;
+	t->fn = fn;
+	t->arg = arg;
+	enqueue(t);
+	release(&tw.lock);
+}
+
+// Stop t from firing. Returns 1 if it was pending, 0 if it had
+// already fired or was never set.
+int ktimercancel(struct ktimer* t){
+	int pending;
+
+	acquire(&tw.lock);
+	pending = t->pprev != 0;
+	if (pending)
+		dequeue(t);
+	release(&tw.lock);
+	return pending;
+}
+
+// Move every timer in a slot of level lvl down the wheel.
+// Returns the slot index, which is 0 when the level above is due.
+static int cascade(int lvl){
+	int idx = (tw.now >> (TVBITS * lvl)) & TVMASK;
+	struct ktimer* t, * next;
+
+	t = tw.wheel[lvl][idx];
+	tw.wheel[lvl][idx] = 0;
+	for (; t != 0; t = next) {
+		next = t->next;
+		enqueue(t);
+	}
+	return idx;
+}
+
+// Run the timers due up to and including tick now.
+// Called from the timer interrupt with tickslock held.
+void ktimertick(uint now){
+	struct ktimer* t;
+	int idx, lvl;
+
+	acquire(&tw.lock);
+	while ((int)(now - tw.now) >= 0) {
+		idx = tw.now & TVMASK;
+		if (idx == 0)
+			for (lvl = 1; lvl < TVLEVELS && cascade(lvl) == 0; lvl++)
+				;
+		while ((t = tw.wheel[0][idx]) != 0) {
+			dequeue(t);
+			t->fn(t->arg);
+		}
+		tw.now++;
+	}
+	release(&tw.lock);
+}
@@ -8,6 +8,8 @@
 #include "x86.h"
 #include "param.h"
 #include "proc.h"
+#include "spinlock.h"
+#include "kernel/string.h"
 
 // Local APIC registers, divided by 4 for use as uint[] indices.
 #define ID      (0x0020 / 4)   // ID
@@ -27,10 +29,12 @@
 #define BCAST      0x00080000   // Send to all APICs, including self.
 #define BUSY       0x00001000
 #define FIXED      0x00000000
+#define NMI        0x00000400   // Non-maskable interrupt
 #define ICRHI   (0x0310 / 4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320 / 4)   // Local Vector Table 0 (TIMER)
 #define X1         0x0000000B   // divide counts by 1
 #define PERIODIC   0x00020000   // Periodic
+#define ONESHOT    0x00000000   // One-shot
 #define PCINT   (0x0340 / 4)   // Performance Counter LVT
 #define LINT0   (0x0350 / 4)   // Local Vector Table 1 (LINT0)
 #define LINT1   (0x0360 / 4)   // Local Vector Table 2 (LINT1)
@@ -41,6 +45,7 @@
 #define TDCR    (0x03E0 / 4)   // Timer Divide Configuration
 
 volatile uint* lapic;  // Initialized in mp.c
+static uint tickcount = 10000000;  // timer counts per 1/HZ s; see lapiccalibrate()
 
 static void lapicw(int index, int value){
 	lapic[index] = value;
@@ -56,11 +61,10 @@ void lapicinit(void){
 
 	// The timer repeatedly counts down at bus frequency
 	// from lapic[TICR] and then issues an interrupt.
-	// If xv6 cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// lapiccalibrate() sets TICR for HZ interrupts a second.
 	lapicw(TDCR, X1);
 	lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-	lapicw(TICR, 10000000);
+	lapicw(TICR, tickcount);
 
 	// Disable logical interrupt lines.
 	lapicw(LINT0, MASKED);
@@ -119,6 +123,148 @@ int cpunum(void){
 	return 0;
 }
 
+// Run the timer at the scheduler tick rate, or, for an idle
+// cpu, fire it only once, long from now, as a backstop in case
+// a reschedule IPI goes missing.
+void lapictimer(int periodic){
+	if (!lapic)
+		return;
+	if (periodic) {
+		lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
+		lapicw(TICR, tickcount);
+	} else {
+		lapicw(TIMER, ONESHOT | (T_IRQ0 + IRQ_TIMER));
+		lapicw(TICR, 0xFFFFFFFF);
+	}
+}
+
+// Time the timer against the PIT so that it interrupts HZ times
+// a second. Called once on the boot cpu; the others start with
+// the calibrated count in lapicinit().
+void lapiccalibrate(void){
+	uint n;
+
+	if (!lapic)
+		return;
+	lapicw(TIMER, MASKED | ONESHOT | (T_IRQ0 + IRQ_TIMER));
+	lapicw(TICR, 0xFFFFFFFF);
+	pitdelay(10000);
+	n = 0xFFFFFFFF - lapic[TCCR];
+	tickcount = (uint64)n * 100 / HZ;
+	cprintf("lapic: timer %d counts per tick\n", tickcount);
+	lapictimer(1);
+}
+
+// Send interrupt vector to cpu c.
+void lapicipi(int c, int vector){
+	if (!lapic)
+		return;
+	pushcli(); // ICRHI and ICRLO go together
+	while (lapic[ICRLO] & DELIVS)
+		;
+	lapicw(ICRHI, cpus[c].apicid << 24);
+	lapicw(ICRLO, FIXED | ASSERT | vector);
+	popcli();
+}
+
+// TLB shootdowns.
+//
+// A cpu that changed or removed mappings of an address space
+// flushes its own TLB and asks the other cpus that have the page
+// table loaded, as recorded in vm->active by switchuvm(), to do
+// the same: it puts a request in each one's mailbox, sends them
+// IRQ_TLB, and spins until they are all done. Cpus not running the
+// address space need nothing, since it was given a new mmid, which
+// they won't find among their PCIDs. A run of up to TLB_MAXPAGES
+// is flushed a page at a time, anything larger all at once.
+//
+// While it waits, the initiator (which may have interrupts off, or
+// hold spinlocks) serves its own mailbox, so two cpus shooting at
+// each other can't deadlock.
+#define TLB_MAXPAGES 32
+
+struct tlbreq {
+	struct vmspace* vm;
+	uintp va;            // first page
+	uint npages;         // 0 for all of them
+	volatile int pending; // cpus yet to flush
+};
+
+static struct {
+	struct spinlock lock;
+	struct tlbreq* req[NCPU];  // one per cpu that can be waiting
+	int n;
+} tlbbox[NCPU];
+
+void tlbinit(void){
+	for (int c = 0; c < NCPU; c++)
+		initlock(&tlbbox[c].lock, "tlbbox");
+}
+
+// Flush r's pages on this cpu, if it has r->vm loaded.
+static void tlbflush(struct tlbreq* r){
+	if (cpu->curvm != r->vm)
+		return;
+	if (r->npages == 0 || r->npages > TLB_MAXPAGES)
+		lcr3(rcr3());
+	else
+		for (uint i = 0; i < r->npages; i++)
+			invlpg((char*)r->va + i * PGSIZE);
+}
+
+// Carry out the requests in this cpu's mailbox. From the IRQ_TLB
+// interrupt, or a waiting tlbshootdown(). Interrupts must be off.
+void tlbintr(void){
+	struct tlbreq* req[NCPU];
+	int n;
+
+	acquire(&tlbbox[cpu->id].lock);
+	n = tlbbox[cpu->id].n;
+	memmove(req, tlbbox[cpu->id].req, n * sizeof(req[0]));
+	tlbbox[cpu->id].n = 0;
+	release(&tlbbox[cpu->id].lock);
+	for (int i = 0; i < n; i++) {
+		tlbflush(req[i]);
+		// The request lives on its sender's stack: after this it
+		// may be gone.
+		__atomic_sub_fetch(&req[i]->pending, 1, __ATOMIC_RELEASE);
+	}
+}
+
+// Flush npages pages from va (all pages, if npages is 0) of vm on
+// every cpu that has it loaded, this one included. The mappings
+// must have been changed, and vm->mmid renewed, already.
+void tlbshootdown(struct vmspace* vm, uintp va, uint npages){
+	struct tlbreq r = { vm, va, npages, 0 };
+	uint64 active[NCPUMASK];
+	int c;
+
+	pushcli();
+	tlbflush(&r);
+	// Against switchuvm(), which sets its bit and then looks at
+	// mmid: either it sees the new mmid, or we see its bit.
+	__sync_synchronize();
+	memmove(active, (void*)vm->active, sizeof(active));
+	for (c = 0; c < ncpu; c++)
+		if (c != cpu->id && CPUMASK_ISSET(active, c))
+			r.pending++;
+	if (r.pending > 0) {
+		for (c = 0; c < ncpu; c++) {
+			if (c == cpu->id || !CPUMASK_ISSET(active, c))
+				continue;
+			acquire(&tlbbox[c].lock);
+			tlbbox[c].req[tlbbox[c].n++] = &r;
+			release(&tlbbox[c].lock);
+			lapicipi(c, T_IRQ0 + IRQ_TLB);
+		}
+		while (__atomic_load_n(&r.pending, __ATOMIC_ACQUIRE) > 0) {
+			tlbintr();
+			amd64_pause();
+		}
+	}
+	popcli();
+}
+
 // Acknowledge interrupt.
 void lapiceoi(void){
 	if (lapic)
@@ -132,10 +278,31 @@ void microdelay(int us){
 
 #define IO_RTC  0x70
 
-// Start additional processor running entry code at addr.
-// See Appendix B of MultiProcessor Specification.
-void lapicstartap(uchar apicid, uint addr){
-	int i;
+// Send an IPI to the processor with local APIC id apicid, once
+// the last one has been accepted.
+static void lapicsend(uchar apicid, uint icr){
+	while (lapic[ICRLO] & DELIVS)
+		;
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, icr);
+}
+
+// Send cpu c a non-maskable interrupt, which it takes even with
+// interrupts off; see watchdog.c.
+void lapicnmi(int c){
+	if (!lapic)
+		return;
+	pushcli();
+	lapicsend(cpus[c].apicid, NMI | ASSERT);
+	popcli();
+}
+
+// Start the n processors in apicids running entry code at addr,
+// all together: each step of the startup algorithm goes to all of
+// them before the next, so the delays are taken once, not once for
+// each processor. See Appendix B of MultiProcessor Specification.
+void lapicstartaps(uchar* apicids, int n, uint addr){
+	int i, j;
 	ushort* wrv;
 
 	// "The BSP must initialize CMOS shutdown code to 0AH
@@ -148,11 +315,14 @@ void lapicstartap(uchar apicid, uint addr){
 	wrv[1] = addr >> 4;
 
 	// "Universal startup algorithm."
-	// Send INIT (level-triggered) interrupt to reset other CPU.
-	lapicw(ICRHI, apicid << 24);
-	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	// Send INIT (level-triggered) interrupt to reset the other CPUs.
+	// Not a broadcast: that would also wake processors the
+	// firmware has disabled.
+	for (j = 0; j < n; j++)
+		lapicsend(apicids[j], INIT | LEVEL | ASSERT);
 	microdelay(200);
-	lapicw(ICRLO, INIT | LEVEL);
+	for (j = 0; j < n; j++)
+		lapicsend(apicids[j], INIT | LEVEL);
 	microdelay(100); // should be 10ms, but too slow in Bochs!
 
 	// Send startup IPI (twice!) to enter code.
@@ -161,8 +331,8 @@ void lapicstartap(uchar apicid, uint addr){
 	// should be ignored, but it is part of the official Intel algorithm.
 	// Bochs complains about the second one.  Too bad for Bochs.
 	for (i = 0; i < 2; i++) {
-		lapicw(ICRHI, apicid << 24);
-		lapicw(ICRLO, STARTUP | (addr >> 12));
+		for (j = 0; j < n; j++)
+			lapicsend(apicids[j], STARTUP | (addr >> 12));
 		microdelay(200);
 	}
 }
@@ -1,67 +1,157 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
+#include "ktimer.h"
 #include "vfs.h"
 #include "fs/fs1.h"
 #include "fs/ext2.h"
 #include "buf.h"
+#include "trace.h"
 #include "kernel/string.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction is only closed when there are no FS
+// system calls active in it, so there is never any reasoning
+// required about whether a commit might write an uncommitted
+// system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. Usually begin_op() just reserves log space
+// for MAXOPBLOCKS blocks and returns; begin_opn()/end_opn() reserve
+// a different amount. But if it thinks the log is close to running
+// out, or the running transaction is being closed, it sleeps.
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing sector #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged sector #s before commit.
+// Commits are made by a commit thread, which batches every
+// system call that finished since the last one into a single
+// transaction (group commit). It closes the running transaction
+// when asked to, when the log is filling up, or LOGDELAY ticks
+// after the transaction began. Closing copies its blocks into
+// memory; the disk writes happen after that, while new system
+// calls go on. end_op() does not wait for the commit: callers
+// that need their changes on disk call log_force().
+//
+// The log is a physical re-do log containing disk blocks, used
+// circularly. Its size is set by mkfs, in the superblock. On disk:
+//   tail block: where recovery starts, and the sequence # found there
+//   records, one per transaction, each
+//     header: magic, sequence #, checksum, sector #s for block A, B, ...
+//     block A
+//     block B
+//     ...
+// A record is written all at once, and is committed when all of
+// it is on disk: recovery replays records in sequence from the
+// tail for as long as their checksums hold, and the first torn
+// or stale record ends the log. A record that would run past
+// the end of the log goes at the start instead.
+//
+// The whole log is mirrored in memory and written a page per
+// request; the request queue merges the pages into large commands.
+//
+// The running transaction's sectors are indexed by a hash table,
+// so absorbing a block already in it is cheap however large it is.
+//
+// Each transaction a block is in holds a pin on it (b->logpin),
+// keeping it in the cache until installed. With BWRITEBACK,
+// commit() leaves installed blocks to the buffer cache's flusher.
+// A record's space is reused only once it is checkpointed: its
+// blocks are made sure to be home, a block that a later
+// transaction has changed again being written from its copy in
+// the record. Records are checkpointed oldest first, when a new
+// one needs the room, and the tail block is only rewritten when
+// a new record would otherwise overwrite the one it points to.
+
+#define LOGDELAY (HZ / 20) // ticks a transaction collects ops
+#define LOGBPP (PGSIZE / BSIZE) // log sectors in a page
+#define LOGMAXSECT 4096         // most of the log we use
+#define LOGMAGIC 0x6c6f6731      // "log1"
+#define NLOGREC 32              // records waiting for checkpoint
+#define NLOGIO 64               // log requests in flight
+#define LOGHASHBITS 11          // index slots, more than twice MAXLOGSIZE
+#define LOGHASH (1 << LOGHASHBITS)
+
+// A record's header, and in memory the sector #s logged by a
+// transaction before commit.
 struct logheader {
+	uint magic;
+	uint seq;
+	uint sum;  // crc32 of header and blocks, with sum 0
 	int n;
-	int sector[LOGSIZE];
+	int sector[LOGHDRSECT * BSIZE / sizeof(int) - 4];
+};
+#define MAXLOGSIZE (sizeof(((struct logheader*)0)->sector) / sizeof(int))
+#define HDRSECT(n) ((4 * sizeof(int) + (n) * sizeof(int) + BSIZE - 1) / BSIZE)
+
+// The tail block.
+struct logtail {
+	uint magic;
+	uint seq;   // of the record at lsn
+	uint64 lsn;
+};
+
+// A committed record not yet checkpointed. Log positions (lsn)
+// count sectors written to the log since it was made, wrapping
+// at nsect.
+struct logrec {
+	uint64 lsn;
+	uint seq;
 };
 
 struct log {
 	struct spinlock lock;
 	int start;
 	int size;
+	int nsect;       // sectors for records, after the tail block
+	int cap;         // blocks a transaction may have
 	int outstanding; // how many FS sys calls are executing.
-	int committing; // in commit(), please wait.
+	int reserved;    // log blocks they may yet use
+	int committing; // closing the running transaction, please wait.
 	int dev;
-	struct logheader lh;
+	struct logheader lh;   // running transaction
+	struct logheader clh;  // being committed
+	uint16 index[LOGHASH]; // 1 + position in lh.sector, or 0 for none
+	uint seq;        // number of the running transaction
+	uint durable;    // last transaction on disk
+	uint opened;     // tick the running transaction got its first block
+	int force;       // someone waits for the running transaction
+	int full;        // begin_op() waits for log space
+	int started;     // commit thread running
+	uint64 head;     // where the next record goes
+	uint64 dtail;    // where the tail block on disk says to start
+	struct logrec rec[NLOGREC]; // committed, oldest first from rfirst
+	int rfirst;
+	int nrec;
+	uint8* mem;      // the log's records
+	struct logtail* tail; // the tail block, in its own page
+	struct buf io[NLOGIO]; // requests moving the log
+	int nio;
+	struct buf* home[MAXLOGSIZE]; // home blocks being written
+	uint64 commits;  // for logstat()
+	uint64 blocks;
+	uint64 waits;
 };
 
 struct log log;
 extern uint64 ROOT_DEV;
+static uint crctab[256];
 static void recover_from_log(void);
 static void commit();
 
 void initlog(void){
-	if (sizeof(struct logheader) >= BSIZE)
+	int i, j;
+
+	if (sizeof(struct logheader) > LOGHDRSECT * BSIZE)
 		panic("initlog: too big logheader");
 
-	initlock(&log.lock, "log");
 	uint8 devtype = GETDEVTYPE(ROOT_DEV);
 	uint32 devnum = GETDEVNUM(ROOT_DEV);
 	// TODO: update this code to use vfs, and not the fs directly
-	if(ext2_init_dev(devtype, devnum) == 1) {
+	if(devtype == DEV_TMPFS) {
+		// a root in memory has nothing to log
+	} else if(ext2_init_dev(devtype, devnum) == 1) {
 		// ???
 	} else {
 		// legacy fallback...
@@ -71,129 +161,468 @@ void initlog(void){
 		log.size = sb.nlog;
 	}
 	log.dev = ROOT_DEV;
+	log.seq = 1;
+	if (log.size == 0)
+		return; // no log; nothing calls log_write()
+
+	log.nsect = log.size - 1;
+	if (log.nsect > LOGMAXSECT)
+		log.nsect = LOGMAXSECT;
+	log.cap = log.nsect - LOGHDRSECT;
+	if (log.cap > MAXLOGSIZE)
+		log.cap = MAXLOGSIZE;
+	if (log.cap < MAXWRITEBLOCKS)
+		panic("initlog: log too small");
+	log.mem = (uint8*)kmalloc((log.nsect + LOGBPP - 1) / LOGBPP);
+	log.tail = (struct logtail*)kalloc();
+	if (log.mem == 0 || log.tail == 0)
+		panic("initlog: out of memory");
+	for (i = 0; i < NLOGIO; i++)
+		initsleeplock(&log.io[i].lock, "logio");
+	for (i = 0; i < 256; i++) {
+		uint c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crctab[i] = c;
+	}
 	recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
-static void install_trans(void){
+static uint crc32(uint crc, uint8* p, int n){
+	crc = ~crc;
+	while (n-- > 0)
+		crc = crctab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+// The log's copy of the sector at position lsn.
+static uint8* logmem(uint64 lsn){
+	return log.mem + (lsn % log.nsect) * BSIZE;
+}
+
+// Wait for the log requests in flight.
+static void logiowait(void){
+	while (log.nio > 0) {
+		struct buf* t = &log.io[--log.nio];
+		bwait(t);
+		releasesleep(&t->lock);
+	}
+}
+
+// Start moving the nsec sectors at data to (write) or from disk
+// at sector.
+static void logio(uint sector, void* data, uint nsec, int write){
+	struct buf* t;
+
+	if (log.nio == NLOGIO)
+		logiowait();
+	t = &log.io[log.nio++];
+	acquiresleep(&t->lock);
+	t->dev = log.dev;
+	t->sector = sector;
+	t->nsec = nsec;
+	t->data = data;
+	t->flags = write ? B_VALID | B_DIRTY : 0;
+	bsubmit(t, 0);
+}
+
+// Write (or read) the len sectors of the log from lsn, which
+// don't wrap, a page per request, and wait.
+static void logrw(uint64 lsn, int len, int write){
+	uint p = lsn % log.nsect;
+
+	while (len > 0) {
+		int nsec = LOGBPP - p % LOGBPP;
+		if (nsec > len)
+			nsec = len;
+		logio(log.start + 1 + p, log.mem + p * BSIZE, nsec, write);
+		p += nsec;
+		len -= nsec;
+	}
+	logiowait();
+}
+
+// Write the tail block: recovery starts at lsn, with record seq.
+static void write_tail(uint64 lsn, uint seq){
+	log.tail->magic = LOGMAGIC;
+	log.tail->seq = seq;
+	log.tail->lsn = lsn;
+	logio(log.start, log.tail, 1, 1);
+	logiowait();
+	log.dtail = lsn;
+}
+
+// Checksum of the record whose header is at h.
+static uint logsum(struct logheader* h, uint64 lsn){
+	uint sum = h->sum, c;
+
+	h->sum = 0;
+	c = crc32(0, (uint8*)h, 4 * sizeof(int) + h->n * sizeof(int));
+	h->sum = sum;
+	for (int i = 0; i < h->n; i++)
+		c = crc32(c, logmem(lsn + HDRSECT(h->n) + i), BSIZE);
+	return c;
+}
+
+// Wait for the m home blocks in log.home to get to disk.
+static void homewait(int m){
+	for (int i = 0; i < m; i++) {
+		bwait(log.home[i]);
+		brelse(log.home[i]);
+	}
+}
+
+// Read the record at lsn into memory. Returns its length in
+// sectors if it is intact and has sequence # seq, else 0.
+static int read_rec(uint64 lsn, uint seq){
+	struct logheader* h = (struct logheader*)logmem(lsn);
+	uint p = lsn % log.nsect;
+	int len;
+
+	logrw(lsn, 1, 0);
+	if (h->magic != LOGMAGIC || h->seq != seq || h->n <= 0 || h->n > log.cap)
+		return 0;
+	len = HDRSECT(h->n) + h->n;
+	if (p + len > log.nsect)
+		return 0;
+	logrw(lsn + 1, len - 1, 0);
+	if (logsum(h, lsn) != h->sum)
+		return 0;
+	return len;
+}
+
+// Copy the committed blocks of the record at lsn to their home
+// location.
+static void install_trans(uint64 lsn){
+	struct logheader* h = (struct logheader*)logmem(lsn);
 	int tail;
 
-	for (tail = 0; tail < log.lh.n; tail++) {
-		struct buf* lbuf = bread(log.dev, log.start + tail + 1); // read log block
-		struct buf* dbuf = bread(log.dev, log.lh.sector[tail]); // read dst
-		memmove(dbuf->data, lbuf->data, BSIZE); // copy block to dst
-		bwrite(dbuf); // write dst to disk
-		brelse(lbuf);
-		brelse(dbuf);
+	for (tail = 0; tail < h->n; tail++) {
+		struct buf* dbuf = bread(log.dev, h->sector[tail]); // read dst
+		memmove(dbuf->data, logmem(lsn + HDRSECT(h->n) + tail), BSIZE); // copy block to dst
+		dbuf->flags |= B_DIRTY;
+		dbuf->flags &= ~B_DELWRI;
+		bsubmit(dbuf, 0); // write dst to disk
+		log.home[tail] = dbuf;
 	}
+	homewait(h->n);
 }
 
-// Read the log header from disk into the in-memory log header
-static void read_head(void){
-	struct buf* buf = bread(log.dev, log.start);
-	struct logheader* lh = (struct logheader*)(buf->data);
-	int i;
-	log.lh.n = lh->n;
-	for (i = 0; i < log.lh.n; i++) {
-		log.lh.sector[i] = lh->sector[i];
+static void recover_from_log(void){
+	uint64 lsn = 0;
+	uint seq = 1;
+	int len;
+
+	logio(log.start, log.tail, 1, 0);
+	logiowait();
+	if (log.tail->magic == LOGMAGIC) {
+		lsn = log.tail->lsn;
+		seq = log.tail->seq;
+	}
+	for (;; seq++) {
+		len = read_rec(lsn, seq);
+		if (len == 0 && lsn % log.nsect) {
+			// It may have gone at the start.
+			lsn += log.nsect - lsn % log.nsect;
+			len = read_rec(lsn, seq);
+		}
+		if (len == 0)
+			break;
+		install_trans(lsn); // committed, copy from log to disk
+		lsn += len;
+	}
+	log.seq = seq;
+	log.durable = seq - 1;
+	log.head = lsn;
+	write_tail(lsn, seq); // the log is empty
+}
+
+// Find sector's slot in the running transaction's index; it is
+// empty if the transaction doesn't have the sector yet.
+// Must hold log.lock.
+static uint16* logfind(int sector){
+	uint h = ((uint)sector * 2654435761U) >> (32 - LOGHASHBITS);
+
+	while (log.index[h] && log.lh.sector[log.index[h] - 1] != sector)
+		h = (h + 1) & (LOGHASH - 1);
+	return &log.index[h];
+}
+
+// Write the blocks of the committed transaction home from the
+// cache, where they are pinned, unpinning them. One that the
+// running transaction has logged again stays pinned by it; the
+// committed copy is in the log.
+// With delay set, leave the writes to the buffer cache.
+static void install_cache(struct logheader* lh, int delay){
+	int m = 0;
+
+	for (int i = 0; i < lh->n; i++) {
+		struct buf* b = bread(log.dev, lh->sector[i]);
+		int again;
+
+		// The running transaction's ops log_write() before they
+		// release a block, so with b locked this is stable.
+		acquire(&log.lock);
+		again = --b->logpin > 0;
+		release(&log.lock);
+		if (again) {
+			brelse(b);
+		} else if (delay) {
+			bdwrite(b);
+			brelse(b);
+		} else {
+			b->flags |= B_DIRTY;
+			b->flags &= ~B_DELWRI;
+			bsubmit(b, 0);
+			log.home[m++] = b;
+		}
 	}
-	brelse(buf);
+	homewait(m);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void write_head(void){
-	struct buf* buf = bread(log.dev, log.start);
-	struct logheader* hb = (struct logheader*)(buf->data);
+// Get the blocks of the oldest committed record home, so its
+// space can be reused.
+static void checkpoint(void){
+	struct logrec* r = &log.rec[log.rfirst];
+	struct logheader* h = (struct logheader*)logmem(r->lsn);
 	int i;
-	hb->n = log.lh.n;
-	for (i = 0; i < log.lh.n; i++) {
-		hb->sector[i] = log.lh.sector[i];
+
+	for (i = 0; i < h->n; i++) {
+		struct buf* b = bread(log.dev, h->sector[i]);
+		log.home[i] = b;
+		if (b->flags & B_DELWRI) {
+			// Still waiting for the flusher; start it now.
+			b->flags &= ~B_DELWRI;
+			bsubmit(b, 0);
+		} else if (b->logpin) {
+			// Changed again by a later transaction: the
+			// committed copy is in the record.
+			logio(h->sector[i], logmem(r->lsn + HDRSECT(h->n) + i), 1, 1);
+		}
 	}
-	bwrite(buf);
-	brelse(buf);
+	logiowait();
+	homewait(h->n);
+	log.rfirst = (log.rfirst + 1) % NLOGREC;
+	log.nrec--;
 }
 
-static void recover_from_log(void){
-	read_head();
-	install_trans(); // if committed, copy from log to disk
-	log.lh.n = 0;
-	write_head(); // clear the log
+// Make room for a record of up to len sectors, with sequence #
+// seq, at the head of the log, checkpointing old ones.
+// Returns where it goes.
+static uint64 logspace(int len, uint seq){
+	uint64 at = log.head, tail;
+	struct logrec* r;
+
+	if (at % log.nsect + len > log.nsect)
+		at += log.nsect - at % log.nsect; // doesn't fit before the end
+	while (log.nrec > 0) {
+		r = &log.rec[log.rfirst];
+		if (log.nrec < NLOGREC && at + len - r->lsn <= log.nsect)
+			break;
+		checkpoint();
+	}
+	tail = at;
+	if (log.nrec > 0) {
+		r = &log.rec[log.rfirst];
+		tail = r->lsn;
+		seq = r->seq;
+	}
+	// Recovery must not find a record it would start from
+	// overwritten.
+	if (at + len - log.dtail > log.nsect)
+		write_tail(tail, seq);
+	return at;
 }
 
-// called at the start of each FS system call.
-void begin_op(void){
+// called at the start of each FS system call that writes at
+// most nblocks blocks.
+void begin_opn(int nblocks){
+	if (log.cap && nblocks > log.cap)
+		panic("begin_op: too big");
 	acquire(&log.lock);
 	while (1) {
 		if (log.committing) {
+			log.waits++;
 			sleep(&log, &log.lock);
-		} else if (log.lh.n + (log.outstanding + 1) * MAXOPBLOCKS > LOGSIZE) {
+		} else if (log.cap && log.lh.n + log.reserved + nblocks > log.cap) {
 			// this op might exhaust log space; wait for commit.
+			log.full = 1;
+			log.waits++;
+			wakeup(&log);
 			sleep(&log, &log.lock);
 		} else {
 			log.outstanding += 1;
+			log.reserved += nblocks;
 			release(&log.lock);
+			TRACE(TRACE_BEGINOP, nblocks, 0);
 			break;
 		}
 	}
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
-void end_op(void){
+void begin_op(void){
+	begin_opn(MAXOPBLOCKS);
+}
+
+// called at the end of each FS system call, with what it
+// passed to begin_opn().
+// Until the commit thread starts, commits if this was the last
+// outstanding operation.
+void end_opn(int nblocks){
 	int do_commit = 0;
 
+	TRACE(TRACE_ENDOP, nblocks, 0);
 	acquire(&log.lock);
 	log.outstanding -= 1;
-	if (log.committing)
-		panic("log.committing");
-	if (log.outstanding == 0) {
+	log.reserved -= nblocks;
+	if (log.outstanding < 0)
+		panic("end_op");
+	if (log.outstanding == 0 && !log.started)
 		do_commit = 1;
-		log.committing = 1;
-	} else {
-		// begin_op() may be waiting for log space.
-		wakeup(&log);
-	}
+	// begin_op() may be waiting for log space, or the commit
+	// thread for this op to finish.
+	wakeup(&log);
 	release(&log.lock);
 
-	if (do_commit) {
-		// call commit w/o holding locks, since not allowed
-		// to sleep with locks.
+	if (do_commit)
 		commit();
-		acquire(&log.lock);
-		log.committing = 0;
+}
+
+void end_op(void){
+	end_opn(MAXOPBLOCKS);
+}
+
+// Wait until the changes of every FS system call that has
+// finished are committed to the log on disk.
+void log_force(void){
+	uint target;
+
+	acquire(&log.lock);
+	// Closing a transaction starts the next one; anything in an
+	// empty running transaction was in the one before.
+	target = log.lh.n > 0 ? log.seq : log.seq - 1;
+	while ((int)(log.durable - target) < 0) {
+		log.force = 1;
 		wakeup(&log);
-		release(&log.lock);
+		sleep(&log.durable, &log.lock);
 	}
+	release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
-static void write_log(void){
+// Copy modified blocks from cache into the record at lsn, after
+// its header. The disk writes come later, from write_log().
+static void copy_log(uint64 lsn){
 	int tail;
 
-	for (tail = 0; tail < log.lh.n; tail++) {
-		struct buf* to = bread(log.dev, log.start + tail + 1); // log block
-		struct buf* from = bread(log.dev, log.lh.sector[tail]); // cache block
-		memmove(to->data, from->data, BSIZE);
-		bwrite(to); // write the log
+	for (tail = 0; tail < log.clh.n; tail++) {
+		struct buf* from = bread(log.dev, log.clh.sector[tail]); // cache block
+		memmove(logmem(lsn + HDRSECT(log.clh.n) + tail), from->data, BSIZE);
 		brelse(from);
-		brelse(to);
 	}
 }
 
+// Fill in the header of the record at lsn and write the record
+// out, all at once -- the real commit.
+static void write_log(uint64 lsn, uint seq){
+	struct logheader* h = (struct logheader*)logmem(lsn);
+
+	log.clh.magic = LOGMAGIC;
+	log.clh.seq = seq;
+	memmove(h, &log.clh, 4 * sizeof(int) + log.clh.n * sizeof(int));
+	h->sum = logsum(h, lsn);
+	logrw(lsn, HDRSECT(log.clh.n) + log.clh.n, 1);
+}
+
+// Commit the running transaction. Called from the commit thread,
+// or from end_op() while booting, before it starts.
 static void commit(){
-	if (log.lh.n > 0) {
-		write_log(); // Write modified blocks from cache to log
-		write_head(); // Write header to disk -- the real commit
-		install_trans(); // Now install writes to home locations
-		log.lh.n = 0;
-		write_head(); // Erase the transaction from the log
+	uint64 lsn = 0;
+	uint seq;
+	int len;
+
+	// Close the running transaction once its ops have finished,
+	// and copy it out. New ops wait for this part only. Until
+	// they are done it can only grow by what they reserved.
+	acquire(&log.lock);
+	log.committing = 1;
+	len = log.lh.n + log.reserved;
+	seq = log.seq;
+	release(&log.lock);
+	if (len > 0)
+		lsn = logspace(HDRSECT(len) + len, seq); // Make room
+	acquire(&log.lock);
+	while (log.outstanding > 0)
+		sleep(&log, &log.lock);
+	log.clh = log.lh;
+	log.lh.n = 0;
+	memset(log.index, 0, sizeof(log.index));
+	if (log.clh.n > 0)
+		log.seq++;
+	log.force = 0;
+	log.full = 0;
+	release(&log.lock);
+	if (log.clh.n > 0)
+		copy_log(lsn);
+	acquire(&log.lock);
+	log.committing = 0;
+	wakeup(&log);
+	release(&log.lock);
+
+	if (log.clh.n == 0)
+		return;
+	TRACE(TRACE_COMMIT, log.clh.n, 0);
+	write_log(lsn, seq); // Write the record to the log
+	log.head = lsn + HDRSECT(log.clh.n) + log.clh.n;
+	acquire(&log.lock);
+	log.durable = seq;
+	log.commits++;
+	log.blocks += log.clh.n;
+	wakeup(&log.durable);
+	release(&log.lock);
+	TRACE(TRACE_COMMITDONE, log.clh.n, 0);
+
+	install_cache(&log.clh, BWRITEBACK); // Now install writes to home locations
+	if (BWRITEBACK) {
+		// checkpointed when the log needs the room
+		struct logrec* r = &log.rec[(log.rfirst + log.nrec) % NLOGREC];
+		r->lsn = lsn;
+		r->seq = seq;
+		log.nrec++;
+	}
+}
+
+static void logcommitter(void* arg){
+	struct ktimer t;
+
+	memset(&t, 0, sizeof(t));
+	acquire(&log.lock);
+	for (;;) {
+		while (log.lh.n == 0 ||
+		       !(log.force || log.full || (int)(ticks - log.opened) >= LOGDELAY)) {
+			// Wake up when the running transaction is due. An
+			// empty one isn't; log_write() wakes us as it opens.
+			if (log.lh.n)
+				ktimerset(&t, log.opened + LOGDELAY, wakeup, &log);
+			sleep(&log, &log.lock);
+		}
+		release(&log.lock);
+		commit();
+		acquire(&log.lock);
 	}
 }
 
+// Start the commit thread.
+void logcommitinit(void){
+	initlock(&log.lock, "log");
+	if (kthread("logcommit", logcommitter, 0) < 0)
+		panic("logcommitinit");
+	acquire(&log.lock);
+	log.started = 1;
+	release(&log.lock);
+}
+
 // Caller has modified b->data and is done with the buffer.
-// Record the block number and pin in the cache with B_DIRTY.
+// Record the block number and pin it in the cache.
 // commit()/write_log() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
@@ -202,19 +631,37 @@ static void commit(){
 //   log_write(bp)
 //   brelse(bp)
 void log_write(struct buf* b){
-	int i;
+	uint16* slot;
 
-	if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-		panic("too big a transaction");
+	acquire(&log.lock);
 	if (log.outstanding < 1)
 		panic("log_write outside of trans");
 
-	for (i = 0; i < log.lh.n; i++) {
-		if (log.lh.sector[i] == b->sector) // log absorbtion
-			break;
+	slot = logfind(b->sector);
+	if (*slot == 0) { // else log absorbtion
+		if (log.lh.n >= log.cap)
+			panic("too big a transaction");
+		if (log.lh.n == 0) {
+			log.opened = ticks;
+			wakeup(&log); // the commit thread, to time it
+		}
+		log.lh.sector[log.lh.n++] = b->sector;
+		*slot = log.lh.n;
+		b->logpin++; // prevent eviction
 	}
-	log.lh.sector[i] = b->sector;
-	if (i == log.lh.n)
-		log.lh.n++;
-	b->flags |= B_DIRTY; // prevent eviction
+	b->flags &= ~B_DELWRI; // and keep the flusher off it until commit
+	release(&log.lock);
+}
+
+// Copy out the log's counters.
+void logstat(struct logstat* st){
+	acquire(&log.lock);
+	st->commits = log.commits;
+	st->blocks = log.blocks;
+	st->waits = log.waits;
+	st->nsect = log.nsect;
+	st->running = log.lh.n;
+	st->outstanding = log.outstanding;
+	st->reserved = log.reserved;
+	release(&log.lock);
 }
@@ -20,6 +20,11 @@ uint64 ROOT_DEV = 1;
 char CPU_NAME[50];
 char CPU_VENDOR[13];
 uint32 CPU_MODEL;
+int CPU_PCID;       // CPUID reports process-context identifiers
+int CPU_PDPE1GB;    // CPUID reports 1 GB pages
+int CPU_ERMS;       // CPUID reports fast rep movsb/stosb
+int CPU_PAT;        // CPUID reports the page attribute table
+extern int CPU_RDRAND, CPU_RDSEED; // random.c
 
 extern char end[]; // first address after kernel loaded from ELF file
 
@@ -27,40 +32,82 @@ extern char end[]; // first address after kernel loaded from ELF file
 // Allocate a real stack and switch to it, first
 // doing some setup required for memory allocator to work.
 int main(void){
+	bootphase(0); // boot profile starts here; see boottime.c
 	identcpu();
 	uartearlyinit();
-	kinit1(P2V(KALLOC_START), P2V(KALLOC_START + 4 * 1024 * 1024)); // phys page allocator
+	e820init(); // usable physical memory
+	kinit1(P2V(KALLOC_START), P2V(KALLOC_EARLY)); // phys page allocator
+	bootphase("kinit1");
 	kvmalloc(); // kernel page table
+	kstackinit(); // guarded kernel stacks
 	trapinit();
 	if (acpiinit()) // try to use acpi for machine info
 		mpinit(); // otherwise use bios MP tables
 	if (!ismp)
 		panic("too few processors"); //really, it's the year 2021.
+	bootphase("acpiinit");
 
 	lapicinit();
+	tlbinit(); // TLB shootdown mailboxes
 	seginit(); // set up segments
+	fpuinit(); // FPU, SSE and AVX, switched lazily
+	perfinit(); // performance counters
 	cprintf("\ncpu%d: starting Xv64\n\n", cpu->id);
+	bootphase("seginit");
+	clockinit(); // calibrate the TSC
+	bootphase("clockinit");
+	vdsoinit(); // user-visible time page
+	lapiccalibrate(); // and the lapic timer
+	bootphase("lapiccalibrate");
 	credits();
 	picinit(); // interrupt controller
 	ioapicinit(); // another interrupt controller
 	consoleinit(); // I/O devices & their interrupts
 	uartinit(); // serial port
+	bootphase("consoleinit");
 	cprintf("%s CPU detected (%s - %d)\n", CPU_NAME, CPU_VENDOR, CPU_MODEL);
 	pinit();   // process table
 	procloopinit();// setup proc loop device
+	profinit(); // sampling profiler, /dev/prof
+	traceinit(); // tracepoints, /dev/trace
+	randominit(); // /dev/zero, /dev/random
+	netinit(); // network devices, /dev/net0
 	tvinit();  // trap vectors
+	ktimerinit(); // kernel timers
+	bootphase("pinit");
+	startothers(); // start other processors; they idle meanwhile
+	bootphase("startothers");
 	pciinit(); // initialize PCI bus (AHCI also)
+	bootphase("pciinit");
 	binit();   // buffer cache
+	textcacheinit(); // shared executable pages
 	fileinit(); // file table
+	pipeinit(); // pipe buffers
+	pollinit(); // poll() waiters
+	epollinit(); // epoll interest lists
+	kringinit(); // blessed processes' shared rings
 	ideinit(); // init IDE disks
+	bootphase("ideinit");
 
 	cprintf("Root dev: disk(%d, %d)\n", GETDEVTYPE(ROOT_DEV), GETDEVNUM(ROOT_DEV));
 	vfsinit();   // bootstrap fs init
 	             // (must happen after all disk types are initialized)
+	bootphase("vfsinit");
 
-	startothers(); // start other processors
-	kinit2(P2V(KALLOC_START + 4 * 1024 * 1024), P2V(PHYSTOP)); // must come after startothers()
+	kinit2(); // rest of memory
+	bootphase("kinit2");
+	initramfs(); // built-in root, for MEMFS
+	syscallinit(); // system call statistics
 	userinit(); // first user process
+	bootphase("userinit");
+	blkqinit(); // block request queues and their threads
+	bflushinit(); // buffer cache write-back
+	swapinit(); // swap disk, if there is one
+	reclaiminit(); // memory watermarks and kswapd
+	logcommitinit(); // log group commit
+	klogdinit(); // console output, off the kernel log
+	workqueueinit(); // per-cpu workers for deferred work
+	bootphase("kthreads");
 
 	// Finish setting up this processor in mpmain.
 	mpmain();
@@ -74,6 +121,8 @@ void credits(){
 void mpenter(void){
 	switchkvm();
 	seginit();
+	fpuinit();
+	perfinit();
 	lapicinit();
 	mpmain();
 }
@@ -84,8 +133,16 @@ static void mpmain(void){
 	if(cpu->id == 0) {
 		cpu->capabilities = CPU_RESERVED_BLESS;
 	}
-	amd64_xchg(&cpu->started, 1); // tell startothers() we're up
+	amd64_xchg(&cpu->started, 1); // tell the boot cpu we're up
 	if(cpu->id == 0){
+		// The APs have been starting since startothers();
+		// wait for the last of them.
+		for (struct cpu* c = cpus; c < cpus + ncpu; c++)
+			while (c->started == 0)
+				amd64_pause();
+		bootphase("APs online");
+		irqbalance(); // device interrupts, over the cpus now up
+		bootreport();
 		cprintf("%d-way SMP kernel fully online.\nentering user space...\n", ncpu);
 	}
 	scheduler(); // start running processes
@@ -93,12 +150,19 @@ static void mpmain(void){
 
 void entry32mp(void);
 
-// Start the non-boot (AP) processors.
+uint64 apstack[256]; // top of each AP's first stack, by local APIC id
+
+// Start the non-boot (AP) processors, all at once, and don't wait
+// for them: mpmain() does, before irqbalance(). Until then there
+// is nothing for them to run, so they stay out of the way of the
+// rest of main(), which allocates their memory for them.
 static void startothers(void){
 	extern uchar _binary_out_entryother_start[], _binary_out_entryother_size[];
+	uchar apicids[NCPU];
 	uchar* code;
 	struct cpu* c;
 	char* stack;
+	int n = 0;
 
 	// Write entry code to unused memory at 0x7000.
 	// The linker has placed the image of entryother.S in
@@ -106,24 +170,22 @@ static void startothers(void){
 	code = p2v(0x7000);
 	memmove(code, _binary_out_entryother_start, (uintp)_binary_out_entryother_size);
 
+	// Tell entryother.S what stack to use, where to enter, and what
+	// pgdir to use. We cannot use kpgdir yet, because the AP processor
+	// is running in low  memory, so we use entrypgdir for the APs too.
+	*(uint32*)(code - 4) = 0x8000; // just enough stack to get us to entry64mp
+	*(uint32*)(code - 8) = v2p(entry32mp);
+
 	for (c = cpus; c < cpus + ncpu; c++) {
 		if (c == cpus + cpunum()) // We've started already.
 			continue;
-
-		// Tell entryother.S what stack to use, where to enter, and what
-		// pgdir to use. We cannot use kpgdir yet, because the AP processor
-		// is running in low  memory, so we use entrypgdir for the APs too.
-		stack = kalloc();
-		*(uint32*)(code - 4) = 0x8000; // just enough stack to get us to entry64mp
-		*(uint32*)(code - 8) = v2p(entry32mp);
-		*(uint64*)(code - 16) = (uint64)(stack + KSTACKSIZE);
-
-		lapicstartap(c->apicid, v2p(code));
-
-		// wait for cpu to finish mpmain()
-		while (c->started == 0)
-			;
+		if ((stack = kalloc()) == 0)
+			panic("startothers");
+		apstack[c->apicid] = (uint64)(stack + PGSIZE);
+		segalloc(c - cpus);
+		apicids[n++] = c->apicid;
 	}
+	lapicstartaps(apicids, n, v2p(code));
 }
 
 void identcpu() {
@@ -138,6 +200,20 @@ void identcpu() {
 		memmove(&CPU_VENDOR, (char *)vendor, sizeof(CPU_VENDOR));
 		CPU_MODEL = regs[0];
 
+		if (regs[0] >= 7) {
+			amd64_cpuidcount(7, 0, regs);
+			CPU_ERMS = (regs[1] >> 9) & 1;
+			CPU_RDSEED = (regs[1] >> 18) & 1;
+		}
+
+		amd64_cpuid(1, regs);
+		CPU_PCID = (regs[2] >> 17) & 1;
+		CPU_RDRAND = (regs[2] >> 30) & 1;
+		CPU_PAT = (regs[3] >> 16) & 1;
+
+		amd64_cpuid(0x80000001, regs);
+		CPU_PDPE1GB = (regs[3] >> 26) & 1;
+
 		memset(&CPU_NAME, 0, sizeof(CPU_NAME));
 		amd64_cpuid(0x80000002, (void *)&CPU_NAME);
 		amd64_cpuid(0x80000003, ((void *)&CPU_NAME) + 0x10);
@@ -0,0 +1,309 @@
+//
+// Memory mapping system calls.
+//
+// mmap() records a region in the process's vma[] table and
+// returns; pages are filled in by vmapagein() the first time
+// they are touched, either zeroed (anonymous memory) or from
+// the backing inode (read-only file mappings), whose pages in the
+// page cache are mapped as they are. Regions are
+// placed top-down from MMAPTOP, above the sbrk heap. Processes
+// that opted in with hugepages() get large anonymous regions
+// 2 MB aligned and backed by huge pages where they fit.
+// mmapshared() maps pages the kernel shares with the process
+// all at once; fork() leaves those out of the child.
+//
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "vfs.h"
+#include "file.h"
+#include "stat.h"
+#include "mman.h"
+#include "x86.h"
+#include "kernel/string.h"
+
+// Return the mapping of p that contains va, or 0.
+struct vma* vmalookup(struct proc* p, uintp va){
+	for (int i = 0; i < NVMA; i++) {
+		struct vma* v = &p->vm->vma[i];
+		if (v->start && va >= v->start && va < v->end)
+			return v;
+	}
+	return 0;
+}
+
+// Return the end of the user memory region of p that
+// contains va, or 0 if va is not a user address.
+uintp uvmlimit(struct proc* p, uintp va){
+	struct vma* v;
+
+	if (va < p->vm->sz)
+		return p->vm->sz;
+	if ((v = vmalookup(p, va)) != 0)
+		return v->end;
+	return 0;
+}
+
+// Lowest address in use by a mapping; sbrk may not grow past it.
+uintp vmalowest(struct proc* p){
+	uintp low = MMAPTOP;
+	for (int i = 0; i < NVMA; i++)
+		if (p->vm->vma[i].start && p->vm->vma[i].start < low)
+			low = p->vm->vma[i].start;
+	return low;
+}
+
+// Fault in page a of a mapping. May sleep reading the inode.
+// Must hold vmlock(p->vm).
+// Returns 1 if mapped, 0 if a is not in a mapping, -1 on error.
+int vmapagein(struct proc* p, uintp a){
+	struct vma* v;
+	uintp base;
+	char* mem;
+	int perm, n;
+
+	if ((v = vmalookup(p, a)) == 0 || v->prot == PROT_NONE || v->shared)
+		return 0;
+	perm = PTE_U;
+	if (v->prot & PROT_WRITE)
+		perm |= PTE_W;
+
+	base = a & ~(HUGEPGSIZE - 1);
+	if (p->vm->hugepages && v->ip == 0 && base >= v->start && base + HUGEPGSIZE <= v->end) {
+		if ((mem = kalloc_huge()) != 0) {
+			if (mapuvmhuge(p->vm->pgdir, base, mem, perm) == 0)
+				return 1;
+			kfree(mem);
+		}
+	}
+
+	// File pages are shared with the page cache where it has them;
+	// the mapping is read-only.
+	if (v->ip && v->ip->ops->pagecache) {
+		ilockshared(v->ip);
+		mem = 0;
+		if (v->off + (a - v->start) < v->ip->size)
+			mem = pagecache_map(v->ip, (v->off + (a - v->start)) / PGSIZE);
+		iunlock(v->ip);
+		if (mem) {
+			if (mappages(p->vm->pgdir, (char*)a, PGSIZE, v2p(mem), perm) < 0) {
+				kfree(mem);
+				return -1;
+			}
+			return 1;
+		}
+	}
+
+	if ((mem = kalloc_zeroed()) == 0)
+		return -1;
+	if (v->ip) {
+		ilockshared(v->ip);
+		n = readi(v->ip, mem, v->off + (a - v->start), PGSIZE);
+		iunlock(v->ip);
+		if (n < 0) {
+			kfree(mem);
+			return -1;
+		}
+	}
+	if (mappages(p->vm->pgdir, (char*)a, PGSIZE, v2p(mem), perm) < 0) {
+		kfree(mem);
+		return -1;
+	}
+	return 1;
+}
+
+// Give child copies of parent's mappings, sharing
+// the pages already faulted in copy-on-write.
+int vmafork(struct proc* parent, struct proc* child){
+	for (int i = 0; i < NVMA; i++) {
+		struct vma* v = &parent->vm->vma[i];
+		if (v->start == 0 || v->shared)
+			continue;
+		if (copyuvmrange(parent->vm->pgdir, child->vm->pgdir, v->start, v->end) < 0)
+			return -1;
+		child->vm->vma[i] = *v;
+		if (v->ip)
+			child->vm->vma[i].ip = idup(v->ip);
+	}
+	return 0;
+}
+
+// Drop every mapping of p. The pages themselves go with the
+// page table; this only releases the backing inodes, so it
+// must be called inside a transaction.
+void vmafree(struct proc* p){
+	for (int i = 0; i < NVMA; i++) {
+		struct vma* v = &p->vm->vma[i];
+		if (v->start && v->ip)
+			iput(v->ip);
+		memset(v, 0, sizeof(*v));
+	}
+}
+
+// Find len bytes of unmapped address space starting on an
+// align boundary, highest first.
+static uintp vmaplace(struct proc* p, uintp len, uintp align){
+	uintp start, end = MMAPTOP;
+	int moved;
+
+	do {
+		if (end < len)
+			return 0;
+		start = (end - len) & ~(align - 1);
+		moved = 0;
+		for (int i = 0; i < NVMA; i++) {
+			struct vma* v = &p->vm->vma[i];
+			if (v->start && v->start < start + len && v->end > start) {
+				end = v->start;
+				moved = 1;
+			}
+		}
+	} while (moved);
+	if (start < PGROUNDUP(p->vm->sz))
+		return 0;
+	return start;
+}
+
+uintp sys_mmap(void){
+	uintp addr, len, align;
+	int prot, flags, fd;
+	long off;
+	struct file* f = 0;
+	struct vma* v = 0;
+
+	if (arguintp(0, &addr) < 0 || arguintp(1, &len) < 0 || argint(2, &prot) < 0 ||
+	    argint(3, &flags) < 0 || argint(4, &fd) < 0 || arglong(5, &off) < 0)
+		return -1;
+	if (len == 0 || len >= MMAPTOP || off < 0 || off % PGSIZE)
+		return -1;
+	len = PGROUNDUP(len);
+
+	if (!(flags & MAP_ANONYMOUS)) {
+		// Only read-only file mappings for now.
+		if (fd < 0 || fd >= NOFILE || (f = proc->files->ofile[fd]) == 0)
+			return -1;
+		if (f->type != FD_INODE || !f->readable || (prot & PROT_WRITE))
+			return -1;
+		if (f->ip->type != T_FILE)
+			return -1;
+	}
+
+	vmlock(proc->vm);
+	for (int i = 0; i < NVMA; i++) {
+		if (proc->vm->vma[i].start == 0) {
+			v = &proc->vm->vma[i];
+			break;
+		}
+	}
+	align = PGSIZE;
+	if (proc->vm->hugepages && f == 0 && len >= HUGEPGSIZE)
+		align = HUGEPGSIZE;
+	if (v == 0 || (addr = vmaplace(proc, len, align)) == 0) {
+		vmunlock(proc->vm);
+		return -1;
+	}
+
+	v->start = addr;
+	v->end = addr + len;
+	v->prot = prot;
+	v->off = off;
+	v->ip = f ? idup(f->ip) : 0;
+	vmunlock(proc->vm);
+	return addr;
+}
+
+// Map the n kernel pages in pages, in order, read-write into p,
+// with a reference each. Returns where, or 0.
+uintp mmapshared(struct proc* p, char** pages, int n){
+	struct vma* v = 0;
+	uintp va;
+
+	vmlock(p->vm);
+	for (int i = 0; i < NVMA; i++) {
+		if (p->vm->vma[i].start == 0) {
+			v = &p->vm->vma[i];
+			break;
+		}
+	}
+	if (v == 0 || (va = vmaplace(p, n * PGSIZE, PGSIZE)) == 0) {
+		vmunlock(p->vm);
+		return 0;
+	}
+	for (int i = 0; i < n; i++) {
+		kref(pages[i]);
+		if (mappages(p->vm->pgdir, (char*)va + i * PGSIZE, PGSIZE, v2p(pages[i]), PTE_W | PTE_U) < 0) {
+			kfree(pages[i]);
+			acquire(&p->vm->lock);
+			deallocuvm(p->vm->pgdir, va + i * PGSIZE, va);
+			release(&p->vm->lock);
+			vmunlock(p->vm);
+			return 0;
+		}
+	}
+	v->start = va;
+	v->end = va + n * PGSIZE;
+	v->prot = PROT_READ | PROT_WRITE;
+	v->shared = 1;
+	vmunlock(p->vm);
+	return va;
+}
+
+int sys_munmap(void){
+	uintp addr, len, end;
+	struct vma* v, * tail;
+
+	if (arguintp(0, &addr) < 0 || arguintp(1, &len) < 0)
+		return -1;
+	if (addr % PGSIZE || len == 0)
+		return -1;
+	end = addr + PGROUNDUP(len);
+	vmlock(proc->vm);
+	if ((v = vmalookup(proc, addr)) == 0 || end > v->end) {
+		vmunlock(proc->vm);
+		return -1;
+	}
+
+	// Unmapping from the middle splits the mapping in two.
+	if (addr > v->start && end < v->end) {
+		tail = 0;
+		for (int i = 0; i < NVMA; i++) {
+			if (proc->vm->vma[i].start == 0) {
+				tail = &proc->vm->vma[i];
+				break;
+			}
+		}
+		if (tail == 0) {
+			vmunlock(proc->vm);
+			return -1;
+		}
+		*tail = *v;
+		tail->start = end;
+		tail->off = v->off + (end - v->start);
+		if (v->ip)
+			tail->ip = idup(v->ip);
+		v->end = addr;
+	} else if (addr > v->start) {
+		v->end = addr;
+	} else if (end < v->end) {
+		v->off += end - v->start;
+		v->start = end;
+	} else {
+		if (v->ip) {
+			begin_op();
+			iput(v->ip);
+			end_op();
+		}
+		memset(v, 0, sizeof(*v));
+	}
+
+	acquire(&proc->vm->lock);
+	deallocuvm(proc->vm->pgdir, end, addr);
+	release(&proc->vm->lock);
+	uvmflushrange(addr, end);
+	vmunlock(proc->vm);
+	return 0;
+}
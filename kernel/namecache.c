@@ -0,0 +1,117 @@
+// Name cache for lockless path lookup.
+//
+// Maps (dev, directory inum, name) to the inum the name refers
+// to, or to NCNEG if there is no such name, so namex() can walk
+// cached paths, and fail on cached missing ones, without locking
+// or even referencing the directories on the way. The table is fixed
+// and direct-mapped, so entries are never freed; instead each
+// has a sequence count, odd while a writer is changing it, and
+// readers retry if it moved under them. Readers write nothing
+// shared. Writers serialize on ncache.lock.
+//
+// Entries are added by namex() while it holds the directory
+// locked, and by unlink as negative ones. dirlink() removes any
+// for the name it adds, and freeing an inode everything about it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "fs/fs1.h"
+#include "kernel/string.h"
+
+#define NNCACHE 512
+#define NCNEG   ((uint)-1)  // inum of a name known not to exist
+
+struct ncentry {
+	volatile uint seq;
+	uint dev;
+	uint dir;
+	uint inum;         // 0 if the entry is empty
+	char name[DIRSIZ];
+};
+
+static struct {
+	struct spinlock lock;
+	struct ncentry e[NNCACHE];
+} ncache;
+
+void namecacheinit(void){
+	initlock(&ncache.lock, "ncache");
+}
+
+static struct ncentry* ncslot(uint dev, uint dir, char* name){
+	uint h = 2166136261u ^ dev ^ (dir * 16777619u);
+
+	for (int i = 0; i < DIRSIZ && name[i]; i++)
+		h = (h ^ (uchar)name[i]) * 16777619u;
+	return &ncache.e[h % NNCACHE];
+}
+
+// Look name up in directory dir. Sets *inum and returns 1 on a hit,
+// returns -1 if the name is cached as missing, else 0.
+// Takes no locks.
+int namecachelookup(uint dev, uint dir, char* name, uint* inum){
+	struct ncentry* e = ncslot(dev, dir, name);
+	uint seq, ino;
+	int hit;
+
+	do {
+		while ((seq = e->seq) & 1)
+			;
+		__asm__ volatile("" ::: "memory");
+		ino = e->inum;
+		hit = ino != 0 && e->dev == dev && e->dir == dir && strncmp(e->name, name, DIRSIZ) == 0;
+		__asm__ volatile("" ::: "memory");
+	} while (e->seq != seq);
+
+	if (!hit)
+		return 0;
+	if (ino == NCNEG)
+		return -1;
+	*inum = ino;
+	return 1;
+}
+
+static void ncset(struct ncentry* e, uint dev, uint dir, char* name, uint inum){
+	e->seq++;
+	__asm__ volatile("" ::: "memory");
+	e->dev = dev;
+	e->dir = dir;
+	e->inum = inum;
+	if (name)
+		strncpy(e->name, name, DIRSIZ);
+	__asm__ volatile("" ::: "memory");
+	e->seq++;
+}
+
+// Record that name in dir is inum. Caller holds dir locked.
+void namecacheenter(uint dev, uint dir, char* name, uint inum){
+	acquire(&ncache.lock);
+	ncset(ncslot(dev, dir, name), dev, dir, name, inum);
+	release(&ncache.lock);
+}
+
+// Record that dir has no name. Caller holds dir locked.
+void namecachenegative(uint dev, uint dir, char* name){
+	namecacheenter(dev, dir, name, NCNEG);
+}
+
+// Forget name in dir, which is being linked.
+void namecacheremove(uint dev, uint dir, char* name){
+	struct ncentry* e = ncslot(dev, dir, name);
+
+	acquire(&ncache.lock);
+	if (e->inum && e->dev == dev && e->dir == dir && strncmp(e->name, name, DIRSIZ) == 0)
+		ncset(e, 0, 0, 0, 0);
+	release(&ncache.lock);
+}
+
+// Forget everything naming or inside inum, which is being freed.
+void namecachepurge(uint dev, uint inum){
+	acquire(&ncache.lock);
+	for (struct ncentry* e = ncache.e; e < &ncache.e[NNCACHE]; e++)
+		if (e->inum && e->dev == dev && (e->inum == inum || e->dir == inum))
+			ncset(e, 0, 0, 0, 0);
+	release(&ncache.lock);
+}
@@ -0,0 +1,210 @@
+// Network devices.
+//
+// A driver registers its struct netdev and from then on only
+// moves frames. Each frame sits in a page of its own from
+// kalloc(): the driver posts pages to the card's receive ring and
+// hands them up whole once filled, so nothing is copied between
+// the wire and whoever takes the frame. /dev/net0 and on read and
+// write one frame a call, copying it; netrecv() instead maps the
+// frame's page into the caller, who munmap()s it when done.
+//
+// Receiving is polled, as in NAPI: the card's interrupt masks
+// itself and schedules the net bottom half, which takes up to
+// NETBUDGET frames from each scheduled card. A card that had
+// fewer has its interrupt unmasked; one that had as many is
+// scheduled again, so under load a card is polled round after
+// round and interrupts no more. A card without an interrupt is
+// polled every tick.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "poll.h"
+#include "ktimer.h"
+#include "vfs.h"
+#include "file.h"
+#include "net.h"
+#include "kernel/string.h"
+
+static struct netdev *netdevs[NETDEV_MAX];
+static int nnetdev;
+static uint netpending;          // devices scheduled, a bit each
+
+// Have d polled soon. From interrupt handlers, or anywhere.
+void netschedule(struct netdev *d){
+	__sync_fetch_and_or(&netpending, 1 << d->index);
+	pushcli();
+	raise_softirq(SOFTIRQ_NET);
+	popcli();
+}
+
+static void nettick(void *arg){
+	netschedule(arg);
+}
+
+static void netsoftirq(void){
+	uint pending = __sync_fetch_and_and(&netpending, 0);
+
+	for (int i = 0; i < nnetdev; i++) {
+		struct netdev *d = netdevs[i];
+		if ((pending & (1 << i)) == 0)
+			continue;
+		if (d->rxpoll(d, NETBUDGET) == NETBUDGET || d->irqon(d))
+			netschedule(d);
+		else if (!d->irq)
+			ktimerset(&d->timer, ticks + 1, nettick, d);
+	}
+}
+
+// Make d /dev/net and its index. At boot, from the driver's attach.
+// Returns -1 if there are too many.
+int netregister(struct netdev *d){
+	if (nnetdev == NETDEV_MAX)
+		return -1;
+	d->index = nnetdev;
+	safestrcpy(d->name, "net0", sizeof(d->name));
+	d->name[3] += d->index;
+	if (d->mtu == 0)
+		d->mtu = ETH_MTU;
+	initlock(&d->lock, d->name);
+	memset(&d->timer, 0, sizeof(d->timer));
+	netdevs[nnetdev++] = d;
+	cprintf("   %s: %x:%x:%x:%x:%x:%x%s\n", d->name, d->mac[0], d->mac[1], d->mac[2],
+	        d->mac[3], d->mac[4], d->mac[5], d->irq ? "" : ", polled");
+	netschedule(d); // for anything already in, and to start the tick
+	return 0;
+}
+
+// A frame the driver received, at page+off; the page is ours
+// now. From the driver's rxpoll.
+void netrxput(struct netdev *d, char *page, int off, int len){
+	struct netframe *f;
+
+	acquire(&d->lock);
+	if (d->rxw - d->rxr == NETRXQ) {
+		d->rxdrops++;
+		release(&d->lock);
+		kfree(page);
+		return;
+	}
+	f = &d->rxq[d->rxw++ % NETRXQ];
+	f->page = page;
+	f->off = off;
+	f->len = len;
+	d->rxpackets++;
+	wakeup(&d->rxq);
+	pollwake(&d->poll);
+	release(&d->lock);
+}
+
+// Send len bytes at page+off, which need NETHEADROOM before them;
+// the page goes with them, sent or not.
+int netxmit(struct netdev *d, char *page, int off, int len){
+	if (off < NETHEADROOM || off + len > PGSIZE || len < ETH_HLEN || len > d->mtu + ETH_HLEN) {
+		kfree(page);
+		return -1;
+	}
+	if (d->xmit(d, page, off, len) < 0) {
+		__sync_fetch_and_add(&d->txdrops, 1);
+		return -1;
+	}
+	__sync_fetch_and_add(&d->txpackets, 1);
+	return 0;
+}
+
+// Wait for the next frame d received and take it into *f.
+static int netnext(struct netdev *d, struct netframe *f){
+	acquire(&d->lock);
+	while (d->rxr == d->rxw) {
+		if (proc->killed) {
+			release(&d->lock);
+			return -1;
+		}
+		sleep(&d->rxq, &d->lock);
+	}
+	*f = d->rxq[d->rxr++ % NETRXQ];
+	release(&d->lock);
+	return 0;
+}
+
+static struct netdev* netminor(struct inode *ip){
+	if (ip->minor < 0 || ip->minor >= nnetdev)
+		return 0;
+	return netdevs[ip->minor];
+}
+
+// One frame, as much of it as fits in n.
+static int netread(struct inode *ip, char *dst, int n){
+	struct netdev *d = netminor(ip);
+	struct netframe f;
+
+	if (d == 0)
+		return -1;
+	iunlock(ip);
+	if (netnext(d, &f) < 0) {
+		ilock(ip);
+		return -1;
+	}
+	if (n > f.len)
+		n = f.len;
+	memmove(dst, f.page + f.off, n);
+	kfree(f.page);
+	ilock(ip);
+	return n;
+}
+
+// One frame, the whole of buf.
+static int netwrite(struct inode *ip, char *buf, int n){
+	struct netdev *d = netminor(ip);
+	char *page;
+
+	if (d == 0 || n < ETH_HLEN || n > d->mtu + ETH_HLEN)
+		return -1;
+	if ((page = kalloc()) == 0)
+		return -1;
+	memmove(page + NETHEADROOM, buf, n);
+	if (netxmit(d, page, NETHEADROOM, n) < 0)
+		return -1;
+	return n;
+}
+
+static int netpoll(struct inode *ip, struct poller *pt){
+	struct netdev *d = netminor(ip);
+	int r = POLLOUT;
+
+	if (d == 0)
+		return POLLNVAL;
+	pollwait(&d->poll, pt);
+	acquire(&d->lock);
+	if (d->rxr != d->rxw)
+		r |= POLLIN;
+	release(&d->lock);
+	return r;
+}
+
+// The next frame device dev received, mapped into the calling
+// process, its length in *len. Returns its address, or 0.
+uintp netrecv(int dev, int *len){
+	struct netframe f;
+	uintp va;
+
+	if (dev < 0 || dev >= nnetdev || netnext(netdevs[dev], &f) < 0)
+		return 0;
+	va = mmapshared(proc, &f.page, 1);
+	kfree(f.page); // the mapping has its own reference
+	if (va == 0)
+		return 0;
+	*len = f.len;
+	return va + f.off;
+}
+
+void netinit(void){
+	devsw[NET0].read = netread;
+	devsw[NET0].write = netwrite;
+	devsw[NET0].poll = netpoll;
+	open_softirq(SOFTIRQ_NET, netsoftirq);
+}
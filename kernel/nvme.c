@@ -0,0 +1,558 @@
+// NVMe driver.
+//
+// Each controller gets an I/O submission/completion queue pair
+// per CPU, as many as it will give us. A CPU submits on its own
+// queue with interrupts off instead of taking a lock; only when
+// there are fewer queues than CPUs do submitters share one and
+// lock it. Command ids come from a per-queue bitmap updated with
+// atomic operations, since a command may finish on a different
+// CPU than it started on.
+//
+// Completions are reaped under the queue's lock, by the
+// interrupt handler or by the waiter itself, with a one-tick timer
+// in case an interrupt goes missing. With MSI-X each completion
+// queue has its own vector, aimed at the CPU that submits to it;
+// otherwise they share the INTx line. A read or write from the
+// block layer becomes one command per run of its segments that
+// a PRP list can describe.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "ktimer.h"
+#include "buf.h"
+#include "pci.h"
+#include "ahci.h"
+#include "nvme.h"
+#include "kernel/string.h"
+
+#define NVME_MAX      2           // controllers
+#define NVME_QSIZE    64          // entries per queue
+#define NVME_NCID     32          // commands in flight per queue
+#define NVME_PRPLIST  (PGSIZE / sizeof(uint64) / NVME_NCID) // list entries per command
+#define NVME_MAXBYTES (NVME_PRPLIST * PGSIZE) // most data in one command
+#define NVME_BATCH    8           // commands one request keeps in flight
+#define NVME_MAXQ     NCPU
+#define NVME_NSID     1           // the namespace we use
+
+struct nvmeq {
+	struct spinlock lock;         // completion side: cqhead, phase, done, status
+	struct spinlock sqlock;       // submission, if CPUs share the queue
+	int qid;
+	struct nvme_sqe *sq;
+	volatile struct nvme_cqe *cq;
+	volatile uint32 *sqdb;        // doorbells
+	volatile uint32 *cqdb;
+	uint16 sqtail;
+	uint16 cqhead;
+	uint16 phase;                 // phase tag of new completions
+	volatile uint32 cidfree;      // bitmap of free command ids
+	uint8 done[NVME_NCID];
+	uint16 status[NVME_NCID];
+	uint32 result;                // dw0 of the last completion, for admin commands
+	uint64 (*prp)[NVME_PRPLIST];  // PRP list per command id
+};
+
+struct nvme {
+	volatile uint8 *regs;
+	uint32 dstrd;
+	int irq;                      // -1 if none
+	int intr;                     // completions interrupt
+	int msix;                     // on a vector per queue
+	int shared;                   // fewer queues than CPUs
+	uint64 nblocks;
+	uint32 maxbytes;              // per command
+	struct nvmeq admin;
+	struct nvmeq q[NVME_MAXQ];
+	int nq;
+};
+
+static struct nvme nvmes[NVME_MAX];
+static int nnvme;
+static irqhandler nvmechain[MAX_IRQS]; // whoever had the line before us
+static struct nvmeq *nvmeirq[MAX_IRQS]; // queue of each MSI-X vector
+
+extern uint64 ROOT_DEV;
+
+static uint32 nvme_rd32(struct nvme *d, int off){
+	return *(volatile uint32*)(d->regs + off);
+}
+
+static void nvme_wr32(struct nvme *d, int off, uint32 v){
+	*(volatile uint32*)(d->regs + off) = v;
+}
+
+static uint64 nvme_rd64(struct nvme *d, int off){
+	return nvme_rd32(d, off) | (uint64)nvme_rd32(d, off + 4) << 32;
+}
+
+static void nvme_wr64(struct nvme *d, int off, uint64 v){
+	nvme_wr32(d, off, (uint32)v);
+	nvme_wr32(d, off + 4, (uint32)(v >> 32));
+}
+
+static int nvme_qinit(struct nvme *d, struct nvmeq *q, int qid){
+	char *sq = kalloc(), *cq = kalloc(), *prp = kalloc();
+
+	if (sq == 0 || cq == 0 || prp == 0) {
+		if (sq) kfree(sq);
+		if (cq) kfree(cq);
+		if (prp) kfree(prp);
+		return -1;
+	}
+	memset(sq, 0, PGSIZE);
+	memset(cq, 0, PGSIZE);
+	memset(q, 0, sizeof(*q));
+	initlock(&q->lock, "nvmeq");
+	initlock(&q->sqlock, "nvmesq");
+	q->qid = qid;
+	q->sq = (struct nvme_sqe*)sq;
+	q->cq = (struct nvme_cqe*)cq;
+	q->prp = (uint64 (*)[NVME_PRPLIST])prp;
+	q->sqdb = (uint32*)(d->regs + NVME_REG_DBS + (2 * qid) * (4 << d->dstrd));
+	q->cqdb = (uint32*)(d->regs + NVME_REG_DBS + (2 * qid + 1) * (4 << d->dstrd));
+	q->phase = 1;
+	q->cidfree = (uint32)-1;
+	return 0;
+}
+
+static int nvme_getcid(struct nvmeq *q){
+	uint32 f;
+	int cid;
+
+	do {
+		if ((f = q->cidfree) == 0)
+			return -1;
+		cid = __builtin_ctz(f);
+	} while (!__sync_bool_compare_and_swap(&q->cidfree, f, f & ~(1U << cid)));
+	q->done[cid] = 0;
+	return cid;
+}
+
+static void nvme_putcid(struct nvmeq *q, int cid){
+	__sync_fetch_and_or(&q->cidfree, 1U << cid);
+}
+
+// Put e on q's submission queue and ring the doorbell. The caller
+// owns q: it has interrupts off on q's CPU, or holds q->sqlock.
+static void nvme_push(struct nvmeq *q, struct nvme_sqe *e){
+	q->sq[q->sqtail] = *e;
+	q->sqtail = (q->sqtail + 1) % NVME_QSIZE;
+	__sync_synchronize(); // entry before the doorbell
+	*q->sqdb = q->sqtail;
+}
+
+// Take finished commands off q's completion queue.
+// Must hold q->lock.
+static void nvme_reap(struct nvmeq *q){
+	int n = 0;
+
+	while ((q->cq[q->cqhead].status & 1) == q->phase) {
+		volatile struct nvme_cqe *c = &q->cq[q->cqhead];
+		__sync_synchronize(); // phase before the rest of the entry
+		if (c->cid < NVME_NCID) {
+			q->status[c->cid] = c->status >> 1;
+			q->done[c->cid] = 1;
+			q->result = c->dw0;
+		}
+		if (++q->cqhead == NVME_QSIZE) {
+			q->cqhead = 0;
+			q->phase ^= 1;
+		}
+		n++;
+	}
+	if (n)
+		*q->cqdb = q->cqhead;
+}
+
+// Wait for command cid on q and return its status.
+// Must hold q->lock.
+static int nvme_wait(struct nvme *d, struct nvmeq *q, int cid){
+	struct ktimer t;
+	int slept = 0;
+
+	memset(&t, 0, sizeof(t));
+	for (;;) {
+		nvme_reap(q);
+		if (q->done[cid])
+			break;
+		if (d->intr && proc) {
+			ktimerset(&t, ticks + 1, wakeup, q);
+			sleep(q, &q->lock);
+			slept = 1;
+		} else {
+			release(&q->lock);
+			amd64_nop();
+			acquire(&q->lock);
+		}
+	}
+	if (slept)
+		ktimercancel(&t);
+	return q->status[cid];
+}
+
+// Run an admin command, polling for it. Only used while
+// attaching, so nothing else is on the admin queue.
+static int nvme_admin(struct nvme *d, struct nvme_sqe *e, uint32 *result){
+	struct nvmeq *q = &d->admin;
+	int cid, st = -1;
+
+	if ((cid = nvme_getcid(q)) < 0)
+		return -1;
+	e->cdw0 |= cid << 16;
+	nvme_push(q, e);
+	acquire(&q->lock);
+	for (int i = 0; i < 500000; i++) { // 5 seconds
+		nvme_reap(q);
+		if (q->done[cid]) {
+			st = q->status[cid];
+			break;
+		}
+		microdelay(10);
+	}
+	if (result)
+		*result = q->result;
+	release(&q->lock);
+	nvme_putcid(q, cid);
+	return st;
+}
+
+// Start e on this CPU's queue with the n page addresses in pages
+// as its data. Returns the queue and sets *cid, or returns 0 if
+// the queue has no command id free.
+static struct nvmeq* nvme_issue(struct nvme *d, struct nvme_sqe *e, uint64 *pages, int n, int *cid){
+	struct nvmeq *q;
+
+	pushcli();
+	q = &d->q[cpu->id % d->nq];
+	if ((*cid = nvme_getcid(q)) < 0) {
+		popcli();
+		return 0;
+	}
+	e->cdw0 = (e->cdw0 & 0xFFFF) | (*cid << 16);
+	e->prp1 = pages[0];
+	e->prp2 = 0;
+	if (n == 2) {
+		e->prp2 = pages[1];
+	} else if (n > 2) {
+		for (int i = 1; i < n; i++)
+			q->prp[*cid][i - 1] = pages[i];
+		e->prp2 = V2P(q->prp[*cid]);
+	}
+	if (d->shared)
+		acquire(&q->sqlock);
+	nvme_push(q, e);
+	if (d->shared)
+		release(&q->sqlock);
+	popcli();
+	return q;
+}
+
+struct nvmecmd {
+	struct nvmeq *q;
+	int cid;
+};
+
+// Wait for the n commands in flight, returning 0 if they all
+// succeeded.
+static int nvme_drain(struct nvme *d, struct nvmecmd *cmd, int n){
+	int r = 0, st;
+
+	for (int i = 0; i < n; i++) {
+		acquire(&cmd[i].q->lock);
+		st = nvme_wait(d, cmd[i].q, cmd[i].cid);
+		release(&cmd[i].q->lock);
+		nvme_putcid(cmd[i].q, cmd[i].cid);
+		if (st != 0)
+			r = st;
+	}
+	return r;
+}
+
+// Transfer between the sectors starting at lba and the buffers in
+// sg, in order. Returns 0, or nonzero if any command failed.
+int nvme_rw(uint32 dev, uint64 lba, struct sata_sg *sg, int nsg, int write){
+	struct nvmecmd cmd[NVME_BATCH];
+	uint64 pages[NVME_PRPLIST + 1];
+	struct nvme_sqe e;
+	struct nvme *d;
+	struct nvmeq *q;
+	uint64 end = 0, slba = lba;
+	uint32 bytes = 0;
+	int ncmd = 0, npage = 0, r = 0;
+
+	if (dev >= nnvme)
+		return -1;
+	d = &nvmes[dev];
+
+	for (int i = 0; i <= nsg; i++) {
+		uint64 addr = i < nsg ? V2P(sg[i].buf) : 0;
+		uint32 len = i < nsg ? sg[i].len : 0;
+
+		do {
+			uint32 chunk = PGSIZE - (addr & (PGSIZE - 1));
+			if (chunk > len)
+				chunk = len;
+			// A PRP list can only continue on a page boundary.
+			if (npage > 0 && (i == nsg || end % PGSIZE || addr % PGSIZE ||
+			                  npage == NVME_PRPLIST + 1 || bytes + chunk > d->maxbytes)) {
+				if (bytes % SECTOR_SIZE)
+					panic("nvme_rw: unaligned segment");
+				memset(&e, 0, sizeof(e));
+				e.cdw0 = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+				e.nsid = NVME_NSID;
+				e.cdw10 = (uint32)slba;
+				e.cdw11 = (uint32)(slba >> 32);
+				e.cdw12 = bytes / SECTOR_SIZE - 1;
+				if (ncmd == NVME_BATCH) {
+					r |= nvme_drain(d, cmd, ncmd);
+					ncmd = 0;
+				}
+				while ((q = nvme_issue(d, &e, pages, npage, &cmd[ncmd].cid)) == 0) {
+					if (ncmd > 0) {
+						r |= nvme_drain(d, cmd, ncmd);
+						ncmd = 0;
+					} else if (proc) {
+						yield();
+					}
+				}
+				cmd[ncmd++].q = q;
+				slba += bytes / SECTOR_SIZE;
+				npage = 0;
+				bytes = 0;
+			}
+			if (i == nsg)
+				break;
+			pages[npage++] = addr;
+			bytes += chunk;
+			end = addr + chunk;
+			addr += chunk;
+			len -= chunk;
+		} while (len > 0);
+	}
+	r |= nvme_drain(d, cmd, ncmd);
+	return r;
+}
+
+static void nvmemsix(uint16 irq){
+	struct nvmeq *q = nvmeirq[irq];
+
+	acquire(&q->lock);
+	nvme_reap(q);
+	wakeup(q);
+	release(&q->lock);
+}
+
+static void nvmeintr(uint16 irq){
+	for (int i = 0; i < nnvme; i++) {
+		struct nvme *d = &nvmes[i];
+		if (d->irq != irq)
+			continue;
+		for (int j = 0; j < d->nq; j++) {
+			acquire(&d->q[j].lock);
+			nvme_reap(&d->q[j]);
+			wakeup(&d->q[j]);
+			release(&d->q[j].lock);
+		}
+	}
+	if (nvmechain[irq])
+		nvmechain[irq](irq);
+}
+
+// Wait for CSTS.RDY to become rdy. Returns 0, or -1 on a timeout
+// or controller fatal status.
+static int nvme_waitready(struct nvme *d, uint64 cap, uint32 rdy){
+	uint32 to = NVME_CAP_TO(cap) ? NVME_CAP_TO(cap) : 1;
+
+	for (uint32 i = 0; i < to * 50000; i++) { // 500ms units of 10us
+		uint32 csts = nvme_rd32(d, NVME_REG_CSTS);
+		if (csts & NVME_CSTS_CFS)
+			return -1;
+		if ((csts & NVME_CSTS_RDY) == rdy)
+			return 0;
+		microdelay(10);
+	}
+	return -1;
+}
+
+// Identify, using page for the data.
+static int nvme_identify(struct nvme *d, uint32 cns, uint32 nsid, char *page){
+	struct nvme_sqe e;
+
+	memset(&e, 0, sizeof(e));
+	e.cdw0 = NVME_ADM_IDENTIFY;
+	e.nsid = nsid;
+	e.prp1 = V2P(page);
+	e.cdw10 = cns;
+	return nvme_admin(d, &e, 0);
+}
+
+// Set up the controller; returns 0 or -1.
+static int nvme_setup(struct nvme *d, struct pci_func *f){
+	struct nvme_sqe e;
+	uint64 cap = nvme_rd64(d, NVME_REG_CAP);
+	uint32 cc, result, lbaf, want, mdts;
+	char *page;
+	int i, msix;
+
+	if (NVME_CAP_MQES(cap) + 1 < NVME_QSIZE) {
+		cprintf("   queues too small\n");
+		return -1;
+	}
+	d->dstrd = NVME_CAP_DSTRD(cap);
+	cc = nvme_rd32(d, NVME_REG_CC);
+	if (cc & NVME_CC_EN)
+		nvme_wr32(d, NVME_REG_CC, cc & ~NVME_CC_EN);
+	if (nvme_waitready(d, cap, 0) < 0)
+		return -1;
+
+	if (nvme_qinit(d, &d->admin, 0) < 0)
+		return -1;
+	nvme_wr32(d, NVME_REG_AQA, (NVME_QSIZE - 1) << 16 | (NVME_QSIZE - 1));
+	nvme_wr64(d, NVME_REG_ASQ, V2P(d->admin.sq));
+	nvme_wr64(d, NVME_REG_ACQ, V2P(d->admin.cq));
+	nvme_wr32(d, NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+	if (nvme_waitready(d, cap, NVME_CSTS_RDY) < 0) {
+		cprintf("   controller did not start\n");
+		return -1;
+	}
+
+	if ((page = kalloc()) == 0)
+		return -1;
+	if (nvme_identify(d, NVME_ID_CTRL, 0, page) != 0) {
+		kfree(page);
+		return -1;
+	}
+	mdts = ((uint8*)page)[NVME_IDC_MDTS];
+	d->maxbytes = NVME_MAXBYTES;
+	if (mdts && (PGSIZE << mdts) < d->maxbytes)
+		d->maxbytes = PGSIZE << mdts;
+	if (nvme_identify(d, NVME_ID_NS, NVME_NSID, page) != 0) {
+		kfree(page);
+		return -1;
+	}
+	d->nblocks = *(uint64*)(page + NVME_IDNS_NSZE);
+	lbaf = *(uint32*)(page + NVME_IDNS_LBAF + 4 * (page[NVME_IDNS_FLBAS] & 0xF));
+	kfree(page);
+	if (((lbaf >> 16) & 0xFF) != 9) {
+		cprintf("   namespace blocks are not %d bytes\n", SECTOR_SIZE);
+		return -1;
+	}
+
+	// Ask for a queue pair per CPU.
+	want = ncpu < NVME_MAXQ ? ncpu : NVME_MAXQ;
+	memset(&e, 0, sizeof(e));
+	e.cdw0 = NVME_ADM_SET_FEAT;
+	e.cdw10 = NVME_FEAT_NQUEUES;
+	e.cdw11 = (want - 1) << 16 | (want - 1);
+	if (nvme_admin(d, &e, &result) != 0)
+		return -1;
+	if ((result & 0xFFFF) + 1 < want)
+		want = (result & 0xFFFF) + 1;
+	if ((result >> 16) + 1 < want)
+		want = (result >> 16) + 1;
+
+	// MSI-X entry 0 belongs to the admin queue, which is polled;
+	// queue i takes entry i + 1, delivered to CPU i.
+	msix = pci_msix_count(f) > want;
+	for (i = 0; i < want; i++) {
+		struct nvmeq *q = &d->q[i];
+		int qid = i + 1, iv = 0;
+		if (nvme_qinit(d, q, qid) < 0)
+			break;
+		if (msix) {
+			int irq = pci_msix_vector(f, qid, nvmemsix, i);
+			if (irq >= 0) {
+				nvmeirq[irq] = q;
+				iv = qid;
+			} else if (i == 0) {
+				msix = 0;
+			} else {
+				break;
+			}
+		}
+		memset(&e, 0, sizeof(e));
+		e.cdw0 = NVME_ADM_CREATE_CQ;
+		e.prp1 = V2P(q->cq);
+		e.cdw10 = (NVME_QSIZE - 1) << 16 | qid;
+		e.cdw11 = iv << 16 | 0x3; // interrupts on vector iv, physically contiguous
+		if (nvme_admin(d, &e, 0) != 0)
+			break;
+		memset(&e, 0, sizeof(e));
+		e.cdw0 = NVME_ADM_CREATE_SQ;
+		e.prp1 = V2P(q->sq);
+		e.cdw10 = (NVME_QSIZE - 1) << 16 | qid;
+		e.cdw11 = qid << 16 | 0x1; // on completion queue qid, contiguous
+		if (nvme_admin(d, &e, 0) != 0)
+			break;
+	}
+	if (i == 0) {
+		cprintf("   no I/O queues\n");
+		return -1;
+	}
+	d->nq = i;
+	d->shared = d->nq < ncpu;
+	d->msix = msix;
+	return 0;
+}
+
+// Attach an NVMe controller; called from pci.c.
+// Returns 1 if it is driven from now on.
+int nvme_attach(struct pci_func *f){
+	struct nvme *d;
+	uint32 hi = 0;
+
+	cprintf("NVMe controller found (bus=%d, slot=%d, func=%d)\n", f->bus->busno, f->dev, f->func);
+	if (nnvme == NVME_MAX) {
+		cprintf("   too many NVMe controllers, ignoring\n");
+		return 0;
+	}
+	d = &nvmes[nnvme];
+	pci_func_enable(f);
+	if ((pci_conf_read(f, PCI_BAR0_OFFSET) & 0x7) == PCI_MAPREG_MEM_TYPE_64BIT)
+		hi = pci_conf_read(f, PCI_BAR1_OFFSET);
+	if (hi != 0 || f->reg_base[0] < DEVSPACE) {
+		cprintf("   registers at 0x%x out of reach\n", f->reg_base[0]);
+		return 0;
+	}
+	d->regs = (volatile uint8*)IO2V((uint64)f->reg_base[0]);
+	d->irq = f->irq_line;
+	if (d->irq == 0 || d->irq >= IRQ_ERROR)
+		d->irq = -1;
+	if (nvme_setup(d, f) < 0) {
+		cprintf("   Init failure\n");
+		return 0;
+	}
+
+	uint32 devNum = nnvme++;
+	cprintf("   %d blocks, %d queue pair(s)\n", (uint)d->nblocks, d->nq);
+	cprintf("   Init success: disk(%d, %d)\n", DEV_NVME, devNum);
+	if (devNum == 0 && GETDEVTYPE(ROOT_DEV) == DEV_IDE)
+		ROOT_DEV = TODEVNUM(DEV_NVME, 0);
+
+	if (d->msix) {
+		cprintf("   MSI-X, a vector per queue\n");
+		d->irq = -1;
+		d->intr = 1;
+		return 1;
+	}
+	if (d->irq < 0) {
+		cprintf("   no interrupt line, polling\n");
+		return 1;
+	}
+	irqhandler prev = get_registered_handler(d->irq);
+	if (prev != nvmeintr) {
+		nvmechain[d->irq] = prev;
+		irq_register_handler(d->irq, nvmeintr);
+		picenable(d->irq);
+		ioapicenable(d->irq, 0);
+	}
+	d->intr = 1;
+	return 1;
+}
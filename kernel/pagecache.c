@@ -0,0 +1,247 @@
+// Page cache for file contents.
+//
+// Inodes of file systems that ask for it (fsops.pagecache) keep
+// the pages of file data read so far in a radix tree indexed by
+// page number: PCFAN ways per level, and as many levels as the
+// largest page cached needs. readi() of a regular file copies
+// out of these pages, filling missing ones through the file
+// system, writei() writes through them, and read-only mmap()s map
+// them directly. The file systems put the buffers they read and
+// write file data through at the cold end of the buffer cache,
+// which is left holding mostly metadata.
+//
+// Pages past the end of the file read as zeroes. They stay as
+// long as their inode does in the inode cache, until it is
+// recycled or truncated, or memory runs short and vfs.c's
+// shrinker drops those of inodes nobody has open. The cache holds one reference to each
+// page, and takes at most PCACHE_PCT percent of memory; beyond
+// that, reads go around it.
+//
+// The tree is under the inode's pclock. Pages are filled while
+// holding the inode's lock shared, and written and dropped while
+// holding it exclusively (or when nobody has a reference), so a
+// reader can copy from a page without pclock.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "stat.h"
+#include "vfs.h"
+#include "file.h"
+#include "slab.h"
+#include "kernel/string.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define PCSHIFT 6
+#define PCFAN   (1 << PCSHIFT)
+
+struct pcnode {
+	void* slot[PCFAN];   // pcnodes above the bottom level, pages on it
+};
+
+static struct {
+	struct spinlock lock;
+	struct kmem_cache* cache;
+	uint npages;         // pages cached, over all inodes
+} pcache;
+
+void pagecacheinit(void){
+	initlock(&pcache.lock, "pcache");
+	pcache.cache = kmem_cache_create("pcnode", sizeof(struct pcnode), 0);
+}
+
+// Count a page more against the limit. Returns 0 if the cache is full.
+static int pcreserve(void){
+	int ok;
+
+	acquire(&pcache.lock);
+	if ((ok = pcache.npages < kmemtotal() / 100 * PCACHE_PCT))
+		pcache.npages++;
+	release(&pcache.lock);
+	return ok;
+}
+
+static void pcunreserve(uint n){
+	acquire(&pcache.lock);
+	pcache.npages -= n;
+	release(&pcache.lock);
+}
+
+// Does ip's tree reach page pg?
+static int pccovers(struct inode* ip, uint pg){
+	return ip->pcroot && (ip->pcheight * PCSHIFT >= 32 || (pg >> (ip->pcheight * PCSHIFT)) == 0);
+}
+
+// Return ip's page pg, or 0. Must hold ip->pclock.
+static char* pclookup(struct inode* ip, uint pg){
+	struct pcnode* n = ip->pcroot;
+
+	if (!pccovers(ip, pg))
+		return 0;
+	for (int h = ip->pcheight - 1; h > 0 && n; h--)
+		n = n->slot[(pg >> (PCSHIFT * h)) & (PCFAN - 1)];
+	return n ? n->slot[pg & (PCFAN - 1)] : 0;
+}
+
+static struct pcnode* pcalloc(void){
+	struct pcnode* n;
+
+	if ((n = kmem_cache_alloc(pcache.cache)) != 0)
+		memset(n, 0, sizeof(*n));
+	return n;
+}
+
+// Put page in ip's tree as page pg, which must not be there.
+// Returns 0 if out of memory. Must hold ip->pclock.
+static int pcinsert(struct inode* ip, uint pg, char* page){
+	struct pcnode* n, ** np;
+
+	while (!pccovers(ip, pg)) {
+		if ((n = pcalloc()) == 0)
+			return 0;
+		n->slot[0] = ip->pcroot;
+		ip->pcroot = n;
+		ip->pcheight++;
+	}
+	np = &ip->pcroot;
+	for (int h = ip->pcheight - 1; h > 0; h--) {
+		np = (struct pcnode**)&(*np)->slot[(pg >> (PCSHIFT * h)) & (PCFAN - 1)];
+		if (*np == 0 && (*np = pcalloc()) == 0)
+			return 0;
+	}
+	(*np)->slot[pg & (PCFAN - 1)] = page;
+	return 1;
+}
+
+// Free the tree under n, h levels high. Returns the pages freed.
+static uint pcfree(struct pcnode* n, uint h){
+	uint freed = 0;
+
+	for (int i = 0; i < PCFAN; i++) {
+		if (n->slot[i] == 0)
+			continue;
+		if (h > 1) {
+			freed += pcfree(n->slot[i], h - 1);
+		} else {
+			kfree(n->slot[i]);
+			freed++;
+		}
+	}
+	kmem_cache_free(pcache.cache, n);
+	return freed;
+}
+
+// Return page pg of ip, reading it in if need be, or 0 if the
+// cache is full or out of memory. Must hold ip's lock.
+static char* pcget(struct inode* ip, uint pg){
+	char* page, * old;
+	int n;
+
+	acquire(&ip->pclock);
+	page = pclookup(ip, pg);
+	release(&ip->pclock);
+	if (page)
+		return page;
+
+	if (!pcreserve())
+		return 0;
+	if ((page = kalloc()) == 0) {
+		pcunreserve(1);
+		return 0;
+	}
+	if ((n = ip->ops->readi(ip, page, pg * PGSIZE, PGSIZE)) < 0) {
+		kfree(page);
+		pcunreserve(1);
+		return 0;
+	}
+	memset(page + n, 0, PGSIZE - n);
+
+	// Another reader may have been filling it too.
+	acquire(&ip->pclock);
+	if ((old = pclookup(ip, pg)) != 0 || !pcinsert(ip, pg, page)) {
+		release(&ip->pclock);
+		kfree(page);
+		pcunreserve(1);
+		return old;
+	}
+	release(&ip->pclock);
+	return page;
+}
+
+// Read [off, off+n) of ip through the cache, as readi() does.
+// Must hold ip's lock.
+int pagecache_read(struct inode* ip, char* dst, uint off, uint n){
+	uint tot, m;
+	char* page;
+
+	if (off > ip->size || off + n < off)
+		return -1;
+	if (off + n > ip->size)
+		n = ip->size - off;
+
+	for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+		m = min(n - tot, PGSIZE - off % PGSIZE);
+		if ((page = pcget(ip, off / PGSIZE)) != 0)
+			memmove(dst, page + off % PGSIZE, m);
+		else if (ip->ops->readi(ip, dst, off, m) != m)
+			return -1;
+	}
+	return n;
+}
+
+// [off, off+n) of ip has been written from src; bring any cached
+// pages of it up to date. Must hold ip's lock exclusively.
+void pagecache_write(struct inode* ip, char* src, uint off, uint n){
+	uint tot, m;
+	char* page;
+
+	for (tot = 0; tot < n; tot += m, off += m, src += m) {
+		m = min(n - tot, PGSIZE - off % PGSIZE);
+		acquire(&ip->pclock);
+		page = pclookup(ip, off / PGSIZE);
+		release(&ip->pclock);
+		if (page)
+			memmove(page + off % PGSIZE, src, m);
+	}
+}
+
+// Is page pg of ip cached?
+int pagecache_has(struct inode* ip, uint pg){
+	char* page;
+
+	acquire(&ip->pclock);
+	page = pclookup(ip, pg);
+	release(&ip->pclock);
+	return page != 0;
+}
+
+// Return page pg of ip with a reference for the caller, to be
+// mapped read-only, or 0. Must hold ip's lock.
+char* pagecache_map(struct inode* ip, uint pg){
+	char* page;
+
+	if ((page = pcget(ip, pg)) != 0)
+		kref(page);
+	return page;
+}
+
+// Forget all of ip's pages, because it is being truncated or
+// recycled, or memory is short. Must hold ip's lock exclusively,
+// or have its only reference, or hold icache.lock while it has
+// none. Returns the number of pages dropped.
+uint pagecache_drop(struct inode* ip){
+	struct pcnode* root;
+	uint height, n = 0;
+
+	acquire(&ip->pclock);
+	root = ip->pcroot;
+	height = ip->pcheight;
+	ip->pcroot = 0;
+	ip->pcheight = 0;
+	release(&ip->pclock);
+	if (root)
+		pcunreserve(n = pcfree(root, height));
+	return n;
+}
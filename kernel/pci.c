@@ -1,9 +1,18 @@
 #include "types.h"
 #include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "irq.h"
 #include "x86.h"
 #include "pci.h"
 #include "assert.h"
 #include "ahci.h"
+#include "spinlock.h"
+#include "virtio.h"
+#include "nvme.h"
+#include "e1000.h"
 #include "kernel/string.h"
 
 #define	PCI_CLASS_BRIDGE 0x06
@@ -38,7 +47,12 @@ struct pci_driver pci_attach_class[] = {
 // pci_attach_vendor matches the vendor ID and device ID of a PCI device. key1
 // and key2 should be the vendor ID and device ID respectively
 struct pci_driver pci_attach_vendor[] = {
-	//{ 0x8086, 0x100e, &e1000_init },
+	{ E1000_VENDOR, E1000_82540EM, &e1000_attach },
+	{ E1000_VENDOR, E1000_82545EM, &e1000_attach },
+	{ VIRTIO_PCI_VENDOR, VIRTIO_PCI_BLK, &virtio_blk_attach },
+	{ VIRTIO_PCI_VENDOR, VIRTIO_PCI_BLK_LEGACY, &virtio_blk_attach },
+	{ VIRTIO_PCI_VENDOR, VIRTIO_PCI_NET, &virtio_net_attach },
+	{ VIRTIO_PCI_VENDOR, VIRTIO_PCI_NET_LEGACY, &virtio_net_attach },
 	{ 0, 0, 0 },
 };
 
@@ -54,12 +68,12 @@ static void pci_conf1_set_addr(uint32 bus, uint32 dev, uint32 func, uint32 offse
 	amd64_out32(pci_conf1_addr_ioport, v);
 }
 
-static uint32 pci_conf_read(struct pci_func* f, uint32 off){
+uint32 pci_conf_read(struct pci_func* f, uint32 off){
 	pci_conf1_set_addr(f->bus->busno, f->dev, f->func, off);
 	return amd64_in32(pci_conf1_data_ioport);
 }
 
-static void pci_conf_write(struct pci_func* f, uint32 off, uint32 v){
+void pci_conf_write(struct pci_func* f, uint32 off, uint32 v){
 	pci_conf1_set_addr(f->bus->busno, f->dev, f->func, off);
 	amd64_out32(pci_conf1_data_ioport, v);
 }
@@ -82,7 +96,21 @@ static int pci_attach_match(uint32 key1, uint32 key2, struct pci_driver* list, s
 }
 
 static void pci_attach_storage_dev(struct pci_func* f){
-	ahci_try_setup_device(f->bus->busno, f->dev, f->func);
+	if (pci_attach_match(PCI_VENDOR(f->dev_id), PCI_PRODUCT(f->dev_id),
+	                     &pci_attach_vendor[0], f))
+		return;
+	if (PCI_SUBCLASS(f->dev_class) == PCI_SUBCLASS_STORAGE_IDE) {
+		// BAR4 holds the busmaster DMA registers, if any.
+		pci_func_enable(f);
+		if (f->reg_base[4] != 0)
+			ideattachdma(f->reg_base[4]);
+		return;
+	}
+	if (PCI_SUBCLASS(f->dev_class) == PCI_SUBCLASS_STORAGE_NVME) {
+		nvme_attach(f);
+		return;
+	}
+	ahci_try_setup_device(f->bus->busno, f->dev, f->func, f);
 }
 
 static int pci_fallback_attach(struct pci_func* f){ //TODO: remove in favor of dev class specific functions
@@ -171,7 +199,9 @@ static int pci_scan_bus(struct pci_bus* bus){
 			af.dev_class = pci_conf_read(&af, PCI_CLASS_REG);
 			if (pci_show_devs)
 				pci_print_func(&af);
+			uint64 t = rdtsc();
 			pci_try_attach(&af);
+			bootprobe("pci", bus->busno << 8 | af.dev << 3 | af.func, t);
 		}
 	}
 
@@ -260,6 +290,99 @@ void pci_func_enable(struct pci_func* f){
 	        PCI_VENDOR(f->dev_id), PCI_PRODUCT(f->dev_id));
 }
 
+// Offset of f's capability id in config space, or 0.
+int pci_find_cap(struct pci_func* f, int id){
+	if ((pci_conf_read(f, PCI_COMMAND_STATUS_REG) & PCI_STATUS_CAPLIST) == 0)
+		return 0;
+	for (uint32 ptr = pci_conf_read(f, PCI_CAPLIST_REG) & 0xFC; ptr; ) {
+		uint32 hdr = pci_conf_read(f, ptr);
+		if ((hdr & 0xFF) == id)
+			return ptr;
+		ptr = (hdr >> 8) & 0xFC;
+	}
+	return 0;
+}
+
+// The message address that reaches cpus[cpu]'s local APIC.
+static uint32 pci_msi_addr(int cpu){
+	return PCI_MSI_ADDR_BASE | (cpus[cpu].apicid << 12);
+}
+
+static void pci_intx_disable(struct pci_func* f){
+	uint32 cmd = pci_conf_read(f, PCI_COMMAND_STATUS_REG) & 0xFFFF;
+	pci_conf_write(f, PCI_COMMAND_STATUS_REG, cmd | PCI_CMD_INTX_DISABLE);
+}
+
+// Give f a single MSI vector, delivered to cpus[cpu] and
+// handled by handler. Returns the irq, or -1 if f has no MSI or
+// vectors have run out; f keeps its INTx line then.
+int pci_msi_vector(struct pci_func* f, irqhandler handler, int cpu){
+	int cap, irq;
+	uint32 ctrl;
+
+	if ((cap = pci_find_cap(f, PCI_CAP_MSI)) == 0)
+		return -1;
+	if ((irq = irq_alloc_handler(handler)) < 0)
+		return -1;
+	ctrl = pci_conf_read(f, cap);
+	pci_conf_write(f, cap + 4, pci_msi_addr(cpu));
+	if (ctrl & PCI_MSI_CTRL_64BIT) {
+		pci_conf_write(f, cap + 8, 0);
+		pci_conf_write(f, cap + 12, T_IRQ0 + irq);
+	} else {
+		pci_conf_write(f, cap + 8, T_IRQ0 + irq);
+	}
+	// One message (MME 0), enabled.
+	ctrl &= ~PCI_MSI_CTRL_MME;
+	pci_conf_write(f, cap, ctrl | PCI_MSI_CTRL_ENABLE);
+	pci_intx_disable(f);
+	return irq;
+}
+
+// Locate f's MSI-X table, or return 0.
+static volatile uint32* pci_msix_table(struct pci_func* f, int cap){
+	uint32 t = pci_conf_read(f, cap + 4);
+	int bir = t & 0x7;
+	uint64 base;
+
+	if (bir > 5 || f->reg_base[bir] == 0)
+		return 0;
+	base = f->reg_base[bir] + (t & ~0x7);
+	if (base < DEVSPACE)
+		return 0;
+	return (volatile uint32*)IO2V(base);
+}
+
+// Number of MSI-X table entries f has, 0 if none.
+int pci_msix_count(struct pci_func* f){
+	int cap = pci_find_cap(f, PCI_CAP_MSIX);
+
+	if (cap == 0 || pci_msix_table(f, cap) == 0)
+		return 0;
+	return ((pci_conf_read(f, cap) >> 16) & PCI_MSIX_CTRL_SIZE) + 1;
+}
+
+// Point MSI-X table entry at a new vector on cpus[cpu], handled
+// by handler, and turn MSI-X on. f must have been enabled with
+// pci_func_enable(). Returns the irq, or -1.
+int pci_msix_vector(struct pci_func* f, int entry, irqhandler handler, int cpu){
+	int cap, irq;
+	volatile uint32* e;
+
+	if ((cap = pci_find_cap(f, PCI_CAP_MSIX)) == 0 || entry >= pci_msix_count(f))
+		return -1;
+	if ((irq = irq_alloc_handler(handler)) < 0)
+		return -1;
+	e = pci_msix_table(f, cap) + 4 * entry;
+	e[0] = pci_msi_addr(cpu);
+	e[1] = 0;
+	e[2] = T_IRQ0 + irq;
+	e[3] = 0; // unmasked
+	pci_conf_write(f, cap, pci_conf_read(f, cap) | PCI_MSIX_CTRL_ENABLE);
+	pci_intx_disable(f);
+	return irq;
+}
+
 static int pci_init(void){
 	static struct pci_bus root_bus;
 	memset(&root_bus, 0, sizeof(root_bus));
@@ -0,0 +1,176 @@
+// Hardware performance counters.
+//
+// perfinit() finds the architectural performance monitoring
+// counters through CPUID leaf 0xA. A process may have a group of
+// them count events for it (perfctl()): the group is loaded into
+// the general-purpose counters when the process is switched in,
+// and what they counted is added to its totals when it is switched
+// out, so the counts are the process's own, in user mode and in
+// the kernel, on whichever cpus it ran. perfread() reads them.
+//
+// Counting is off whenever no process with a group is running, so
+// there is nothing to pay without one. CPUs without the leaf (AMD,
+// which has counters of its own, and emulators without a PMU) have
+// no counters here, and perfctl() fails.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "slab.h"
+#include "perf.h"
+
+#define MSR_PMC0             0xC1
+#define MSR_PERFEVTSEL0      0x186
+#define MSR_PERF_GLOBAL_CTRL 0x38F
+
+#define EVTSEL_USR  (1 << 16)   // count in user mode
+#define EVTSEL_OS   (1 << 17)   // and in the kernel
+#define EVTSEL_EN   (1 << 22)
+
+void wrmsr(uint msr, uint64 val);
+uint64 rdmsr(uint msr);
+
+struct perfgroup {
+	int n;
+	uint64 sel[PERF_MAXCTR];      // event select register values
+	uint64 count[PERF_MAXCTR];    // counted while switched out
+};
+
+// Event select and unit mask of each PERF_ event.
+static ushort perfevents[PERF_NEVENTS] = {
+	[PERF_CYCLES]       = 0x003C,
+	[PERF_INSTRUCTIONS] = 0x00C0,
+	[PERF_REFCYCLES]    = 0x013C,
+	[PERF_LLCREFS]      = 0x4F2E,
+	[PERF_LLCMISSES]    = 0x412E,
+	[PERF_BRANCHES]     = 0x00C4,
+	[PERF_BRANCHMISSES] = 0x00C5,
+};
+
+static struct {
+	int version;
+	int n;                // general-purpose counters
+	uint64 mask;          // of their width
+	uint avail;           // PERF_ events the CPU has
+	struct kmem_cache* cache;
+} perf;
+
+// Find the counters, on the boot cpu, and turn them on, stopped,
+// on this cpu.
+void perfinit(void){
+	uint regs[4];
+
+	if (cpu->id == 0) {
+		amd64_cpuid(0, regs);
+		if (regs[0] >= 0xA)
+			amd64_cpuid(0xA, regs);
+		else
+			regs[0] = 0;
+		perf.version = regs[0] & 0xFF;
+		if (perf.version == 0)
+			return;
+		perf.n = (regs[0] >> 8) & 0xFF;
+		if (perf.n > PERF_MAXCTR)
+			perf.n = PERF_MAXCTR;
+		perf.mask = ((regs[0] >> 16) & 0xFF) >= 64 ? ~0ULL : (1ULL << ((regs[0] >> 16) & 0xFF)) - 1;
+		// A set bit in EBX is an event the CPU lacks; EAX[31:24]
+		// says how many of the bits mean anything.
+		for (int i = 0; i < PERF_NEVENTS && i < (regs[0] >> 24); i++)
+			if ((regs[1] & (1 << i)) == 0)
+				perf.avail |= 1 << i;
+		perf.cache = kmem_cache_create("perf", sizeof(struct perfgroup), 0);
+		cprintf("perf: version %d, %d counters\n", perf.version, perf.n);
+	}
+	if (perf.version == 0)
+		return;
+	for (int i = 0; i < perf.n; i++)
+		wrmsr(MSR_PERFEVTSEL0 + i, 0);
+	if (perf.version >= 2)
+		wrmsr(MSR_PERF_GLOBAL_CTRL, (1ULL << perf.n) - 1);
+}
+
+// The current process is being switched out: stop its counters
+// and add what they counted. Interrupts must be off.
+void perfswitchout(void){
+	struct perfgroup* g = proc->perf;
+
+	if (g == 0)
+		return;
+	for (int i = 0; i < g->n; i++) {
+		wrmsr(MSR_PERFEVTSEL0 + i, 0);
+		g->count[i] += rdmsr(MSR_PMC0 + i) & perf.mask;
+	}
+}
+
+// p is being switched in on this cpu: start its counters from
+// zero. Interrupts must be off.
+void perfswitchin(struct proc* p){
+	struct perfgroup* g = p->perf;
+
+	if (g == 0)
+		return;
+	for (int i = 0; i < g->n; i++) {
+		wrmsr(MSR_PMC0 + i, 0);
+		wrmsr(MSR_PERFEVTSEL0 + i, g->sel[i]);
+	}
+}
+
+// Count the n PERF_ events in ev for the current process, from
+// zero, instead of whatever it counted before; n = 0 stops. Returns
+// the number of counters, or -1 if the CPU can't count them.
+int perfctl(int* ev, int n){
+	struct perfgroup* g = 0, * old;
+
+	if (n < 0 || n > perf.n)
+		return -1;
+	for (int i = 0; i < n; i++)
+		if (ev[i] < 0 || ev[i] >= PERF_NEVENTS || (perf.avail & (1 << ev[i])) == 0)
+			return -1;
+	if (n > 0) {
+		if ((g = kmem_cache_alloc(perf.cache)) == 0)
+			return -1;
+		g->n = n;
+		for (int i = 0; i < n; i++) {
+			g->sel[i] = perfevents[ev[i]] | EVTSEL_USR | EVTSEL_OS | EVTSEL_EN;
+			g->count[i] = 0;
+		}
+	}
+	pushcli();
+	perfswitchout();
+	old = proc->perf;
+	proc->perf = g;
+	perfswitchin(proc);
+	popcli();
+	if (old)
+		kmem_cache_free(perf.cache, old);
+	return n;
+}
+
+// Copy the current process's counts, up to n of them, to vals.
+// Returns how many it has.
+int perfread(uint64* vals, int n){
+	uint64 v[PERF_MAXCTR];
+	struct perfgroup* g;
+	int m = 0;
+
+	pushcli();
+	if ((g = proc->perf) != 0) {
+		m = g->n;
+		for (int i = 0; i < m; i++)
+			v[i] = g->count[i] + (rdmsr(MSR_PMC0 + i) & perf.mask);
+	}
+	popcli();
+	for (int i = 0; i < m && i < n; i++)
+		vals[i] = v[i];
+	return m;
+}
+
+// Free p's counter group.
+void perffree(struct proc* p){
+	if (p->perf)
+		kmem_cache_free(perf.cache, p->perf);
+	p->perf = 0;
+}
@@ -1,3 +1,12 @@
+// Pipes.
+//
+// A pipe is a ring buffer of a page or more from kmalloc(), a
+// power of two in size so byte counts can wrap freely. Data moves
+// in and out with copyuser(), in at most two pieces around the end
+// of the ring; a fault on the user's side of the copy is taken
+// with the lock dropped, and the copy retried. fcntl(F_SETPIPE_SZ) resizes the ring, up to
+// PIPEMAX bytes, keeping what is in it.
+
 #include "types.h"
 #include "defs.h"
 #include "param.h"
@@ -6,23 +15,43 @@
 #include "vfs.h"
 #include "file.h"
 #include "spinlock.h"
-#include "x86.h"
 #include "fcntl.h"
+#include "poll.h"
+#include "kernel/string.h"
 
-#define PIPESIZE 512
-#define LOCK_WAIT_TICKS 100
-#define MAX_WRITE_WAIT 1000
-#define MAX_READ_WAIT  1000
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define PIPESIZE PGSIZE
+#define PIPEMAX  (16 * PGSIZE)
 
 struct pipe {
 	struct spinlock lock;
-	char data[PIPESIZE];
+	char* data;
+	uint size; // bytes in data, a power of two
 	uint nread; // number of bytes read
 	uint nwrite; // number of bytes written
 	int readopen; // read fd is still open
 	int writeopen; // write fd is still open
+	struct pollhead poll;
 };
 
+static struct kmem_cache* pipecache;
+
+static void pipector(void* v){
+	struct pipe* p = (struct pipe*)v;
+	p->data = 0;
+	p->size = PIPESIZE;
+	p->readopen = 1;
+	p->writeopen = 1;
+	p->nwrite = 0;
+	p->nread = 0;
+	p->poll.list = 0;
+	initlock(&p->lock, "pipe");
+}
+
+void pipeinit(void){
+	pipecache = kmem_cache_create("pipe", sizeof(struct pipe), pipector);
+}
+
 int pipealloc(struct file** f0, struct file** f1){
 	struct pipe* p;
 
@@ -30,13 +59,10 @@ int pipealloc(struct file** f0, struct file** f1){
 	*f0 = *f1 = 0;
 	if ((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
 		goto bad;
-	if ((p = (struct pipe*)kalloc()) == 0)
+	if ((p = kmem_cache_alloc(pipecache)) == 0)
+		goto bad;
+	if ((p->data = kalloc()) == 0)
 		goto bad;
-	p->readopen = 1;
-	p->writeopen = 1;
-	p->nwrite = 0;
-	p->nread = 0;
-	initlock(&p->lock, "pipe");
 	(*f0)->type = FD_PIPE;
 	(*f0)->readable = 1;
 	(*f0)->writable = 0;
@@ -49,7 +75,7 @@ int pipealloc(struct file** f0, struct file** f1){
 
 bad:
 	if (p)
-		kfree((char*)p);
+		kmem_cache_free(pipecache, p);
 	if (*f0)
 		fileclose(*f0);
 	if (*f1)
@@ -66,68 +92,157 @@ void pipeclose(struct pipe* p, int writable){
 		p->readopen = 0;
 		wakeup(&p->nwrite);
 	}
+	pollwake(&p->poll);
 	if (p->readopen == 0 && p->writeopen == 0) {
 		release(&p->lock);
-		kfree((char*)p);
+		polldetach(&p->poll);
+		kmfree(p->data, p->size / PGSIZE);
+		kmem_cache_free(pipecache, p);
 	} else
 		release(&p->lock);
 }
 
-int pipewrite(struct pipe* p, char* addr, int n){
-	int i;
+// Copy n bytes, which are in the ring, out of it from position at.
+// Returns nonzero if dst is a user page that faulted.
+static int pipecopyout(struct pipe* p, char* dst, uint at, uint n){
+	uint m = min(n, p->size - at % p->size);
 
-	uint8 success = sacquire(&p->lock, LOCK_WAIT_TICKS);
-	if(success != SPINLOCK_ACQUIRED) {
-		return FNOT_READY;
-	}
-	for (i = 0; i < n; i++) {
-		uint32 loops = 0;
-		while ((p->nwrite == p->nread + PIPESIZE) && loops++ < MAX_WRITE_WAIT) { // pipewrite-full
+	return copyuser(dst, p->data + at % p->size, m) || copyuser(dst + m, p->data, n - m);
+}
+
+// Write all n bytes, sleeping while the pipe is full. Non-blocking,
+// write what fits, and return FNOT_READY if nothing does.
+int pipewrite(struct pipe* p, char* addr, int n, int nonblock){
+	uint tot, m, at;
+
+	acquire(&p->lock);
+	for (tot = 0; tot < n; tot += m) {
+		while (p->nwrite == p->nread + p->size) { // pipewrite-full
 			if (p->readopen == 0 || proc->killed) {
 				release(&p->lock);
 				return F_ERROR;
 			}
 			wakeup(&p->nread);
-			amd64_nop();
+			pollwake(&p->poll);
+			if (nonblock) {
+				release(&p->lock);
+				return tot > 0 ? tot : FNOT_READY;
+			}
+			sleep(&p->nwrite, &p->lock); // pipewrite-sleep
 		}
-		if(loops >= MAX_WRITE_WAIT) {
-			wakeup(&p->nread);
+		at = p->nwrite % p->size;
+		m = min(n - tot, p->size - (p->nwrite - p->nread));
+		m = min(m, p->size - at);
+		if (copyuser(p->data + at, addr + tot, m) != 0) {
+			// Fault the user's buffer in without the lock, and retry.
 			release(&p->lock);
-			return FNOT_READY;
+			if (uprefault((uintp)addr + tot, m, 0) < 0)
+				return tot > 0 ? tot : F_ERROR;
+			acquire(&p->lock);
+			m = 0;
+			continue;
 		}
-		p->data[p->nwrite++ % PIPESIZE] = addr[i];
+		p->nwrite += m;
 	}
 	wakeup(&p->nread); // pipewrite-wakeup1
+	pollwake(&p->poll);
 	release(&p->lock);
 	return n;
 }
 
-int piperead(struct pipe* p, char* addr, int n){
-	int i;
+// Read up to n bytes, sleeping until there are some or the write
+// end is closed. Non-blocking, return FNOT_READY instead of sleeping.
+int piperead(struct pipe* p, char* addr, int n, int nonblock){
+	uint m;
 
-	uint8 success = sacquire(&p->lock, LOCK_WAIT_TICKS);
-	if(success != SPINLOCK_ACQUIRED) {
-		return FNOT_READY;
-	}
-	uint32 loops = 0;
-	while (p->nread == p->nwrite && p->writeopen && loops++ < MAX_READ_WAIT) { // pipe-empty
+	acquire(&p->lock);
+again:
+	while (p->nread == p->nwrite && p->writeopen) { // pipe-empty
 		if (proc->killed) {
 			release(&p->lock);
 			return F_ERROR;
 		}
-		amd64_nop();
+		if (nonblock) {
+			release(&p->lock);
+			return FNOT_READY;
+		}
+		sleep(&p->nread, &p->lock); // piperead-sleep
 	}
-	if(loops >= MAX_READ_WAIT) {
-		wakeup(&p->nwrite);
+	m = min((uint)n, p->nwrite - p->nread);
+	if (pipecopyout(p, addr, p->nread, m) != 0) { // piperead-copy
 		release(&p->lock);
-		return FNOT_READY;
-	}
-	for (i = 0; i < n; i++) { // piperead-copy
-		if (p->nread == p->nwrite)
-			break;
-		addr[i] = p->data[p->nread++ % PIPESIZE];
+		if (uprefault((uintp)addr, m, 1) < 0)
+			return F_ERROR;
+		acquire(&p->lock);
+		goto again;
 	}
+	p->nread += m;
 	wakeup(&p->nwrite); // piperead-wakeup
+	pollwake(&p->poll);
+	release(&p->lock);
+	return m;
+}
+
+// The size of p's ring.
+int pipesize(struct pipe* p){
+	return p->size;
+}
+
+// Give p a ring of at least size bytes, rounded up to a power of
+// two pages. Fails if that is over PIPEMAX or too small for what
+// p holds. Returns the new size, or -1.
+int piperesize(struct pipe* p, int size){
+	uint pages = 1, used;
+	char* data, * old;
+	uint oldsize;
+
+	if (size <= 0 || size > PIPEMAX)
+		return -1;
+	while (pages * PGSIZE < size)
+		pages *= 2;
+	if ((data = kmalloc(pages)) == 0)
+		return -1;
+
+	acquire(&p->lock);
+	used = p->nwrite - p->nread;
+	if (used > pages * PGSIZE) {
+		release(&p->lock);
+		kmfree(data, pages);
+		return -1;
+	}
+	pipecopyout(p, data, p->nread, used);
+	old = p->data;
+	oldsize = p->size;
+	p->data = data;
+	p->size = pages * PGSIZE;
+	p->nread = 0;
+	p->nwrite = used;
+	wakeup(&p->nwrite); // there may be more room
+	pollwake(&p->poll);
+	release(&p->lock);
+	kmfree(old, oldsize / PGSIZE);
+	return pages * PGSIZE;
+}
+
+// Which of POLLIN, POLLOUT, POLLHUP and POLLERR hold for p's read
+// end, or with writable set its write end. Waits for changes as
+// part of pt, if it isn't 0.
+int pipepoll(struct pipe* p, int writable, struct poller* pt){
+	int r = 0;
+
+	pollwait(&p->poll, pt);
+	acquire(&p->lock);
+	if (writable) {
+		if (p->readopen == 0)
+			r |= POLLERR;
+		else if (p->nwrite != p->nread + p->size)
+			r |= POLLOUT;
+	} else {
+		if (p->nread != p->nwrite)
+			r |= POLLIN;
+		if (p->writeopen == 0)
+			r |= POLLHUP;
+	}
 	release(&p->lock);
-	return i;
+	return r;
 }
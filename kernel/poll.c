@@ -0,0 +1,181 @@
+// poll(): wait for any of several files to become ready.
+//
+// A pipe, the console or another pollable object has a pollhead,
+// and calls pollwake() on it whenever it may have become ready.
+// A poll() looks at each of its files, and on the first pass puts
+// an entry for itself on each object's pollhead: the entries
+// come from a page, so a poll can wait on PGSIZE / sizeof(entry)
+// objects before it falls back to looking again every tick.
+// Then it sleeps until any of them, or its timeout, wakes it,
+// and looks again. Entries go on before the object is looked at,
+// so a change in between is not missed.
+//
+// The pollheads and pollers are under polllock. pollwake() on a
+// pollhead nobody is on doesn't take it, so objects should call
+// it holding, or after holding, the lock their readiness is
+// looked at under. An object that goes away with pollers on it
+// calls polldetach(). epoll.c hangs its own entries on pollheads,
+// which call back into it instead of waking a poller.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "ktimer.h"
+#include "vfs.h"
+#include "file.h"
+#include "poll.h"
+#include "kernel/string.h"
+
+#define NPOLLENT ((int)(PGSIZE / sizeof(struct pollentry)))
+
+struct spinlock polllock;
+
+void pollinit(void){
+	initlock(&polllock, "poll");
+}
+
+// Wait for ph as part of pt, if pt isn't 0.
+void pollwait(struct pollhead* ph, struct poller* pt){
+	struct pollentry* e;
+
+	if (pt == 0)
+		return;
+	acquire(&polllock);
+	if (pt->alloc) {
+		e = pt->alloc(pt);
+	} else if (pt->n < NPOLLENT) {
+		e = &pt->ent[pt->n++];
+		e->poller = pt;
+		e->func = 0;
+	} else {
+		e = 0;
+	}
+	if (e == 0) {
+		pt->full = 1;
+		release(&polllock);
+		return;
+	}
+	e->head = ph;
+	e->next = ph->list;
+	ph->list = e;
+	release(&polllock);
+}
+
+// Take e off its pollhead, if it is still on one. Must hold
+// polllock.
+void pollunlink(struct pollentry* e){
+	struct pollentry** pp;
+
+	if (e->head == 0)
+		return;
+	for (pp = &e->head->list; *pp; pp = &(*pp)->next) {
+		if (*pp == e) {
+			*pp = e->next;
+			break;
+		}
+	}
+	e->head = 0;
+}
+
+static void pollnotify(struct pollentry* e){
+	if (e->func) {
+		e->func(e);
+	} else {
+		e->poller->woken = 1;
+		wakeup(e->poller);
+	}
+}
+
+// The object ph belongs to may be ready: wake who polls it.
+void pollwake(struct pollhead* ph){
+	if (ph->list == 0)
+		return;
+	acquire(&polllock);
+	for (struct pollentry* e = ph->list; e; e = e->next)
+		pollnotify(e);
+	release(&polllock);
+}
+
+// ph's object is going away: wake its pollers and let go of them.
+void polldetach(struct pollhead* ph){
+	struct pollentry* e;
+
+	acquire(&polllock);
+	while ((e = ph->list) != 0) {
+		ph->list = e->next;
+		e->head = 0;
+		pollnotify(e);
+	}
+	release(&polllock);
+}
+
+// Take pt's entries off their pollheads.
+static void pollclear(struct poller* pt){
+	acquire(&polllock);
+	for (int i = 0; i < pt->n; i++)
+		pollunlink(&pt->ent[i]);
+	pt->n = 0;
+	release(&polllock);
+}
+
+static void polltimeout(void* arg){
+	struct poller* pt = arg;
+
+	acquire(&polllock);
+	pt->woken = 1;
+	wakeup(pt);
+	release(&polllock);
+}
+
+// Fill in revents for the nfds entries of fds, waiting for up to
+// timeout ticks (forever if negative) for one to be non-zero.
+// Returns how many are, or -1 if killed or out of memory.
+int poll(struct pollfd* fds, int nfds, int timeout){
+	struct poller pt;
+	struct ktimer t;
+	struct file* f;
+	uint deadline = ticks + timeout;
+	int n, i, first = 1;
+
+	memset(&pt, 0, sizeof(pt));
+	memset(&t, 0, sizeof(t));
+	if ((pt.ent = (struct pollentry*)kalloc()) == 0)
+		return -1;
+	for (;;) {
+		pt.woken = 0;
+		for (i = n = 0; i < nfds; i++) {
+			fds[i].revents = 0;
+			if (fds[i].fd < 0)
+				continue;
+			if (fds[i].fd >= NOFILE || (f = proc->files->ofile[fds[i].fd]) == 0)
+				fds[i].revents = POLLNVAL;
+			else
+				fds[i].revents = filepoll(f, first && timeout != 0 ? &pt : 0) &
+				                 (fds[i].events | POLLERR | POLLHUP);
+			if (fds[i].revents)
+				n++;
+		}
+		first = 0;
+		if (n > 0 || timeout == 0 || (timeout > 0 && (int)(ticks - deadline) >= 0))
+			break;
+		if (proc->killed) {
+			n = -1;
+			break;
+		}
+		if (pt.full)
+			ktimerset(&t, ticks + 1, polltimeout, &pt);
+		else if (timeout > 0)
+			ktimerset(&t, deadline, polltimeout, &pt);
+		acquire(&polllock);
+		while (!pt.woken && !proc->killed)
+			sleep(&pt, &polllock);
+		release(&polllock);
+		ktimercancel(&t);
+	}
+	pollclear(&pt);
+	kfree((char*)pt.ent);
+	return n;
+}
@@ -4,11 +4,18 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
+#include "irq.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "trace.h"
 #include "kernel/string.h"
 #include "vfs.h"
 #include "file.h"
+#include "poll.h"
+#include "slab.h"
+#include "wait.h"
+#include "ktimer.h"
+#include "rusage.h"
 
 struct ptable_node {
     struct proc proc;
@@ -18,9 +25,61 @@ struct ptable_node {
 struct {
 	struct spinlock lock;
 	struct ptable_node *head;
+	struct kmem_cache *cache;
+	struct kmem_cache *vmcache;    // struct vmspace
+	struct kmem_cache *filescache; // struct files
 } ptable;
 
-#define EACH_PTABLE_NODE struct ptable_node *node = ptable.head; node->next != 0; node = node->next
+#define EACH_PTABLE_NODE struct ptable_node *node = ptable.head; node != 0; node = node->next
+
+#define OOM_WAIT  (HZ / 10)   // ticks oomkill() gives a victim to exit
+#define OOM_TRIES 5           // kills growproc() waits out before failing
+#define OOM_SWAP  64          // pages oomkill() tries to swap out first
+
+// Live processes hashed by pid, maintained by allocproc() and
+// freeproc() under ptable.lock.
+#define NPIDHASH 256
+static struct proc* pidhash[NPIDHASH];
+
+// Return the process with the given pid, or 0.
+// Caller should hold ptable.lock.
+static struct proc* findproc(int pid){
+	struct proc* p;
+
+	for (p = pidhash[(uint)pid % NPIDHASH]; p != 0; p = p->pidnext)
+		if (p->pid == pid)
+			return p;
+	return 0;
+}
+
+// Per-CPU queues of RUNNABLE processes. A process is queued on
+// the cpu it last ran on so it stays cache-warm; idle cpus steal
+// from the longest queue. Lock order is ptable.lock, then runq.
+//
+// Each queue keeps a FIFO per effective priority and a bitmap of
+// the non-empty ones, so the best process is found in O(1).
+#define NPRIO (PROC_MAX_PRIORITY + 1)
+struct runq {
+	struct spinlock lock;
+	uint64 map[NPRIO / 64];      // bit b set if bucket b is non-empty
+	struct proc* head[NPRIO];
+	struct proc* tail[NPRIO];
+	volatile int n;
+} runqs[NCPU];
+
+// Sleeping processes, hashed by the channel they sleep on, so
+// wakeup() only looks at likely waiters and needs no ptable.lock.
+// Lock order is ptable.lock, then waitq, then runq.
+#define NWAITQ 64
+struct waitq {
+	struct spinlock lock;
+	struct proc* head;
+} waitqs[NWAITQ];
+
+static struct waitq* waitqof(void* chan){
+	uintp h = (uintp)chan;
+	return &waitqs[(h ^ (h >> 6) ^ (h >> 12)) % NWAITQ];
+}
 
 static struct proc* initproc;
 
@@ -31,24 +90,29 @@ int _fork(int blessed);
 void _allocpipe(struct proc* p);
 void _deallocpipe(struct proc* p);
 
-static void wakeup1(void* chan);
-int growptable();
+static void freeproc(struct proc* p);
+static void setrunnable(struct proc* p);
+static int ipcsleeping(struct proc* p);
+static void ipcwake(struct proc* p);
+static struct files* filesalloc(void);
 
 int procloopread(struct inode* ip, char* buf, int n){
 	//cprintf("Reading: minor=%d, from proc = %d\n", ip->minor, proc->pid);
 	struct proc *tp;
-	struct proc *p;
+	struct kringpair *kp = 0;
+	int r;
 
 	acquire(&ptable.lock);
-	for(EACH_PTABLE_NODE){
-		p = &(node->proc);
-		if (p->pid == ip->minor) {
-			tp = p;
-			break;
-		}
-	}
+	tp = findproc(ip->minor);
+	if(tp)
+		kp = kringget(tp);
 	release(&ptable.lock);
 
+	if(kp) {
+		r = kringread(kp, buf, n);
+		kringput(kp);
+		return r;
+	}
 	if(tp) {
 		return fileread(tp->rpipe, buf, n);
 	}
@@ -58,66 +122,259 @@ int procloopread(struct inode* ip, char* buf, int n){
 int procloopwrite(struct inode* ip, char* buf, int n){
 	//cprintf("Writing: minor=%d, from proc = %d\n", ip->minor, proc->pid);
 	struct proc *tp;
-	struct proc *p;
+	struct kringpair *kp = 0;
+	int r;
 
 	acquire(&ptable.lock);
-	for(EACH_PTABLE_NODE){
-		p = &(node->proc);
-		if (p->pid == ip->minor) {
-			tp = p;
-			break;
-		}
-	}
+	tp = findproc(ip->minor);
+	if(tp)
+		kp = kringget(tp);
 	release(&ptable.lock);
 
+	if(kp) {
+		r = kringwrite(kp, buf, n);
+		kringput(kp);
+		return r;
+	}
 	if(tp) {
 		return filewrite(tp->wpipe, buf, n);
 	}
 	return 0;
 }
 
+static void ptablector(void* v){
+	memset(v, 0, sizeof(struct ptable_node));
+}
+
+static void vmspacector(void* v){
+	memset(v, 0, sizeof(struct vmspace));
+}
+
+static void filesctor(void* v){
+	memset(v, 0, sizeof(struct files));
+}
+
 void pinit(void){
 	initlock(&ptable.lock, "ptable");
-	growptable();
+	for (int i = 0; i < NCPU; i++)
+		initlock(&runqs[i].lock, "runq");
+	for (int i = 0; i < NWAITQ; i++)
+		initlock(&waitqs[i].lock, "waitq");
+	ptable.cache = kmem_cache_create("proc", sizeof(struct ptable_node), ptablector);
+	ptable.vmcache = kmem_cache_create("vmspace", sizeof(struct vmspace), vmspacector);
+	ptable.filescache = kmem_cache_create("files", sizeof(struct files), filesctor);
+}
+
+// A new, empty address space for one process.
+static struct vmspace* vmspacealloc(void){
+	struct vmspace* vm;
+
+	if ((vm = kmem_cache_alloc(ptable.vmcache)) == 0)
+		return 0;
+	initlock(&vm->lock, "vmspace");
+	vm->ref = 1;
+	vm->users = 1;
+	vm->mmid = newmmid();
+	memset(vm->active, 0, sizeof(vm->active));
+	vm->swaphand = 0;
+	return vm;
+}
+
+// p is done with its address space, though it may still be
+// running on it. The last user releases the inodes the mappings
+// hold; the page table itself waits for vmspaceput(). Returns
+// 1 for the last user.
+int vmspaceexit(struct proc* p){
+	int last;
+
+	acquire(&ptable.lock);
+	last = --p->vm->users == 0;
+	release(&ptable.lock);
+	if (!last)
+		return 0;
+	begin_op();
+	if (p->vm->exe)
+		iput(p->vm->exe);
+	vmafree(p);
+	end_op();
+	p->vm->exe = 0;
+	return 1;
+}
+
+static void vmspacefree(void* arg){
+	struct vmspace* vm = arg;
+
+	freevm(vm->pgdir);
+	kmem_cache_free(ptable.vmcache, vm);
+}
+
+// Drop a reference to vm, freeing the page table with the last
+// one. No cpu may be running on it: the caller holds ptable.lock,
+// and took it after the last process using vm switched away.
+// A big page table takes a while to free, so a worker does it,
+// with preemption points, rather than under ptable.lock.
+static void vmspaceput(struct vmspace* vm){
+	if (!holding(&ptable.lock))
+		panic("vmspaceput");
+	if (--vm->ref == 0) {
+		INIT_WORK(&vm->free, vmspacefree, vm);
+		queue_work(&vm->free);
+	}
+}
+
+// Before exec() replaces the image of p: if any other process
+// refers to p's address space, move p to a new, empty one and
+// set *old to the old one, for vmspacerelease() once p no longer
+// runs on it. Otherwise p keeps its vmspace and *old is 0.
+int vmspaceunshare(struct proc* p, struct vmspace** old){
+	struct vmspace* vm;
+	int shared;
+
+	*old = 0;
+	acquire(&ptable.lock);
+	shared = p->vm->ref > 1;
+	release(&ptable.lock);
+	if (!shared)
+		return 0;
+	if ((vm = vmspacealloc()) == 0)
+		return -1;
+	vm->hugepages = p->vm->hugepages;
+	*old = p->vm;
+	vmspaceexit(p);
+	p->vm = vm;
+	return 0;
+}
+
+void vmspacerelease(struct vmspace* vm){
+	acquire(&ptable.lock);
+	vmspaceput(vm);
+	release(&ptable.lock);
+}
+
+// Take references to up to max address spaces of user processes,
+// for swapout(), starting further round the process list each
+// time. Each is let go with vmspacerelease(). Returns how many.
+static int pinnable(struct proc* p){
+	if (p->state == UNUSED || p->state == EMBRYO || p->state == ZOMBIE)
+		return 0;
+	return p->kfn == 0 && p->vm != 0 && p->vm->users > 0 && p->vm->sz > 0;
+}
+
+int vmspacepin(struct vmspace** vms, int max){
+	static int start;
+	struct proc* p;
+	int n = 0, k = 0, i;
+
+	acquire(&ptable.lock);
+	for(EACH_PTABLE_NODE)
+		k += pinnable(&node->proc);
+	if (start >= k)
+		start = 0;
+	// From the start-th one on, then the ones before it.
+	for (int pass = 0; pass < 2 && n < max; pass++) {
+		k = 0;
+		for(EACH_PTABLE_NODE){
+			p = &(node->proc);
+			if (!pinnable(p) || (pass == 0) != (k++ >= start))
+				continue;
+			for (i = 0; i < n && vms[i] != p->vm; i++)
+				;
+			if (i < n)
+				continue;
+			p->vm->ref++;
+			vms[n++] = p->vm;
+			if (n == max)
+				break;
+		}
+	}
+	start += n;
+	release(&ptable.lock);
+	return n;
+}
+
+// Serialize changes to the mappings of vm between its threads.
+// Holders may sleep. Copy-on-write faults don't take it, so
+// changes to present pages also need vm->lock; see cowfault().
+void vmlock(struct vmspace* vm){
+	acquire(&vm->lock);
+	while (vm->busy)
+		sleep(vm, &vm->lock);
+	vm->busy = 1;
+	release(&vm->lock);
+}
+
+void vmunlock(struct vmspace* vm){
+	acquire(&vm->lock);
+	vm->busy = 0;
+	wakeup(vm);
+	release(&vm->lock);
+}
+
+// Readable when there is something to read from the process,
+// writable when it has room for more.
+int proclooppoll(struct inode* ip, struct poller* pt){
+	struct proc *tp;
+	struct kringpair *kp = 0;
+	int r;
+
+	acquire(&ptable.lock);
+	tp = findproc(ip->minor);
+	if(tp)
+		kp = kringget(tp);
+	release(&ptable.lock);
+
+	if(kp) {
+		r = kringpoll(kp, pt);
+		kringput(kp);
+		return r;
+	}
+	if(tp && tp->rpipe && tp->wpipe) {
+		return (filepoll(tp->rpipe, pt) & (POLLIN | POLLHUP)) |
+		       (filepoll(tp->wpipe, pt) & (POLLOUT | POLLERR));
+	}
+	return POLLHUP;
 }
 
 void procloopinit() {
 	cprintf("init: process loop device\n");
 	devsw[LOOP0].write = procloopwrite;
 	devsw[LOOP0].read = procloopread;
+	devsw[LOOP0].poll = proclooppoll;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, change state to EMBRYO and initialize
-// state required to run in the kernel.
-// Otherwise return 0.
+// Allocate a new proc and link it into the process table
+// in state EMBRYO, initializing the state required to run
+// in the kernel. Otherwise return 0.
 static struct proc* allocproc(void){
+	struct ptable_node* node;
 	struct proc* p;
 	char* sp;
 
-	acquire(&ptable.lock);
-	for(EACH_PTABLE_NODE){
-		p = &(node->proc);
-		if (p->state == UNUSED) {
-			goto found;
-		}
-	}
-	if(growptable() > 0) {
-			release(&ptable.lock);
-			return allocproc();
-	}
-	release(&ptable.lock);
-	return 0;
+	if ((node = kmem_cache_alloc(ptable.cache)) == 0)
+		return 0;
+	p = &(node->proc);
 
-found:
+	acquire(&ptable.lock);
 	p->state = EMBRYO;
 	p->pid = nextpid++;
 	p->priority = PROC_DEFAULT_PRIORITY;
+	p->rqcpu = -1;
+	p->preempt = 0;
+	p->nsyscall = 0;
+	p->utime = p->stime = 0;
+	p->cutime = p->cstime = p->cnsyscall = 0;
+	memset(p->affinity, 0xFF, sizeof(p->affinity));
+	node->next = ptable.head;
+	ptable.head = node;
+	p->pidnext = pidhash[(uint)p->pid % NPIDHASH];
+	pidhash[(uint)p->pid % NPIDHASH] = p;
 	release(&ptable.lock);
 
 	// Allocate kernel stack.
-	if ((p->kstack = kalloc()) == 0) {
-		p->state = UNUSED;
+	if ((p->kstack = kstackalloc()) == 0) {
+		acquire(&ptable.lock);
+		freeproc(p);
+		release(&ptable.lock);
 		return 0;
 	}
 	sp = p->kstack + KSTACKSIZE;
@@ -145,10 +402,12 @@ void userinit(void){
 
 	p = allocproc();
 	initproc = p;
-	if ((p->pgdir = setupkvm()) == 0)
+	if ((p->vm = vmspacealloc()) == 0 || (p->files = filesalloc()) == 0)
 		panic("userinit: out of memory?");
-	inituvm(p->pgdir, _binary_out_initcode_start, (uintp)_binary_out_initcode_size);
-	p->sz = PGSIZE;
+	if ((p->vm->pgdir = setupkvm()) == 0)
+		panic("userinit: out of memory?");
+	inituvm(p->vm->pgdir, _binary_out_initcode_start, (uintp)_binary_out_initcode_size);
+	p->vm->sz = PGSIZE;
 	memset(p->tf, 0, sizeof(*p->tf));
 	p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
 	p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
@@ -157,74 +416,293 @@ void userinit(void){
 	p->tf->eip = 0; // beginning of initcode.S
 
 	safestrcpy(p->name, "initcode", sizeof(p->name));
-	p->cwd = namei("/");
+	p->files->cwd = namei("/");
 	p->blessed = PROC_BLESSED;
 	p->priority = PROC_MAX_PRIORITY;
 	_allocpipe(p);
 
-	p->state = RUNNABLE;
+	acquire(&ptable.lock);
+	setrunnable(p);
+	release(&ptable.lock);
+}
+
+// Kernel threads start here, from scheduler() like forkret.
+static void kthreadstart(void){
+	// Still holding ptable.lock from scheduler.
+	release(&ptable.lock);
+	proc->kfn(proc->karg);
+	panic("kthread returned");
+}
+
+// Start a kernel thread running fn(arg) under name. Kernel
+// threads never return to user space or exit; they all share one
+// address space with only the kernel mapped.
+// Returns the thread's pid, or -1.
+int kthread(char* name, void (*fn)(void*), void* arg){
+	return kthreadon(name, fn, arg, -1);
+}
+
+// kthread(), bound to cpu c if c >= 0. A bound thread runs even
+// on a cpu reserved for blessed processes.
+int kthreadon(char* name, void (*fn)(void*), void* arg, int c){
+	static struct vmspace* kvm;
+	struct proc* p;
+
+	if ((p = allocproc()) == 0)
+		return -1;
+	if (kvm == 0) {
+		if ((kvm = vmspacealloc()) == 0 || (kvm->pgdir = setupkvm()) == 0)
+			panic("kthread: out of memory?");
+		kvm->ref = kvm->users = 0;
+	}
+	p->context->eip = (uintp)kthreadstart;
+	p->kfn = fn;
+	p->karg = arg;
+	safestrcpy(p->name, name, sizeof(p->name));
+	if (c >= 0) {
+		memset(p->affinity, 0, sizeof(p->affinity));
+		p->affinity[c / 64] = 1ULL << (c % 64);
+		p->blessed = PROC_BLESSED;
+		p->rqcpu = c;
+	}
+
+	acquire(&ptable.lock);
+	kvm->ref++;
+	kvm->users++;
+	p->vm = kvm;
+	setrunnable(p);
+	release(&ptable.lock);
+	return p->pid;
 }
 
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int growproc(int n){
-	uint sz;
+	uintp sz, old;
+	int tries = 0;
 
-	sz = proc->sz;
+	vmlock(proc->vm);
+	sz = old = proc->vm->sz;
+	if (n > 0 && sz + n > vmalowest(proc))
+		goto bad;
 	if (n > 0) {
-		if ((sz = allocuvm(proc->pgdir, sz, sz + n)) == 0)
-			return -1;
+		while ((sz = proc->vm->hugepages ? allocuvmhuge(proc->vm->pgdir, old, old + n) :
+		        allocuvm(proc->vm->pgdir, old, old + n)) == 0)
+			if (++tries > OOM_TRIES || oomkill() < 0)
+				goto bad;
 	} else if (n < 0) {
-		if ((sz = deallocuvm(proc->pgdir, sz, sz + n)) == 0)
-			return -1;
+		acquire(&proc->vm->lock);
+		sz = deallocuvm(proc->vm->pgdir, sz, sz + n);
+		release(&proc->vm->lock);
+		if (sz == 0)
+			goto bad;
 	}
-	proc->sz = sz;
-	switchuvm(proc);
+	proc->vm->sz = sz;
+	if (n < 0)
+		uvmflushrange(sz, sz - n);
+	vmunlock(proc->vm);
 	return 0;
+
+bad:
+	vmunlock(proc->vm);
+	return -1;
+}
+
+static struct files* filesalloc(void){
+	struct files* f;
+
+	if ((f = kmem_cache_alloc(ptable.filescache)) == 0)
+		return 0;
+	initlock(&f->lock, "files");
+	f->ref = 1;
+	return f;
+}
+
+// Undo a partly set up allocproc() whose vm and files are its
+// own, if it has them.
+static void unallocproc(struct proc* np){
+	if (np->vm) {
+		if (np->vm->pgdir)
+			freevm(np->vm->pgdir);
+		begin_op();
+		vmafree(np);
+		end_op();
+		kmem_cache_free(ptable.vmcache, np->vm);
+		np->vm = 0;
+	}
+	if (np->files) {
+		kmem_cache_free(ptable.filescache, np->files);
+		np->files = 0;
+	}
+	fpufree(np);
+	perffree(np);
+	kstackfree(np->kstack);
+	np->kstack = 0;
+	acquire(&ptable.lock);
+	freeproc(np);
+	release(&ptable.lock);
+}
+
+// Put p on a list of children. Caller holds ptable.lock.
+static void sibinsert(struct proc** head, struct proc* p){
+	p->sibnext = *head;
+	if (*head)
+		(*head)->sibprev = &p->sibnext;
+	p->sibprev = head;
+	*head = p;
+}
+
+static void sibremove(struct proc* p){
+	*p->sibprev = p->sibnext;
+	if (p->sibnext)
+		p->sibnext->sibprev = p->sibprev;
+}
+
+// Hand np, set up by _fork(), clone() or spawn(), to the scheduler.
+static int startproc(struct proc* np, int blessed, char* name){
+	int pid;
+
+	memmove(np->affinity, proc->affinity, sizeof(np->affinity));
+	safestrcpy(np->name, name, sizeof(np->name));
+
+	pid = np->pid;
+
+	// lock to force the compiler to emit the np->state write last.
+	acquire(&ptable.lock);
+	np->parent = proc;
+	np->kids = np->zombies = 0;
+	sibinsert(&proc->kids, np);
+	np->blessed = blessed;
+	_allocpipe(np);
+	setrunnable(np);
+	release(&ptable.lock);
+
+	return pid;
 }
 
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
-// Caller must set state of returned proc to RUNNABLE.
 int _fork(int blessed){
-	int i, pid;
+	int i;
 	struct proc* np;
 
 	// Allocate process.
 	if ((np = allocproc()) == 0)
 		return -1;
+	if ((np->vm = vmspacealloc()) == 0 || (np->files = filesalloc()) == 0 || fpufork(np) < 0) {
+		unallocproc(np);
+		return -1;
+	}
 
-	// Copy process state from p.
-	if ((np->pgdir = copyuvm(proc->pgdir, proc->sz)) == 0) {
-		kfree(np->kstack);
-		np->kstack = 0;
-		np->state = UNUSED;
+	// Copy process state from p. The vm lock keeps other
+	// threads' copy-on-write faults out while pages are shared.
+	vmlock(proc->vm);
+	acquire(&proc->vm->lock);
+	if ((np->vm->pgdir = copyuvm(proc->vm->pgdir, proc->vm->sz)) == 0 || vmafork(proc, np) < 0 ||
+	    vdsomap(np->vm->pgdir, np->pid, proc->pid) < 0) {
+		release(&proc->vm->lock);
+		vmunlock(proc->vm);
+		unallocproc(np);
 		return -1;
 	}
-	np->sz = proc->sz;
-	np->parent = proc;
+	release(&proc->vm->lock);
+	np->vm->sz = proc->vm->sz;
+	if (proc->vm->exe)
+		np->vm->exe = idup(proc->vm->exe);
+	memmove(np->vm->useg, proc->vm->useg, sizeof(proc->vm->useg));
+	np->vm->nuseg = proc->vm->nuseg;
+	np->vm->hugepages = proc->vm->hugepages;
+	vmunlock(proc->vm);
 	*np->tf = *proc->tf;
 
 	// Clear %eax so that fork returns 0 in the child.
 	np->tf->eax = 0;
 
+	acquire(&proc->files->lock);
 	for (i = 0; i < NOFILE; i++)
-		if (proc->ofile[i])
-			np->ofile[i] = filedup(proc->ofile[i]);
-	np->cwd = idup(proc->cwd);
+		if (proc->files->ofile[i])
+			np->files->ofile[i] = filedup(proc->files->ofile[i]);
+	np->files->cwd = idup(proc->files->cwd);
+	release(&proc->files->lock);
 
-	safestrcpy(np->name, proc->name, sizeof(proc->name));
+	return startproc(np, blessed, proc->name);
+}
 
-	pid = np->pid;
+// Create a thread: a process sharing the caller's address space,
+// open files and cwd, that starts at fn(arg) on the user stack
+// ending at stack, with tls as its %gs base. fn must not return.
+// Threads are reaped by wait() like other children.
+int clone(uintp fn, uintp arg, uintp stack, uintp tls){
+	struct proc* np;
+
+	if ((np = allocproc()) == 0)
+		return -1;
+	if (fpufork(np) < 0) {
+		unallocproc(np);
+		return -1;
+	}
 
-	// lock to force the compiler to emit the np->state write last.
 	acquire(&ptable.lock);
-	np->state = RUNNABLE;
-	np->blessed = blessed;
-	_allocpipe(np);
+	np->vm = proc->vm;
+	np->vm->ref++;
+	np->vm->users++;
+	np->files = proc->files;
+	np->files->ref++;
 	release(&ptable.lock);
+	vdsoshared(proc);
 
-	return pid;
+	np->tls = tls;
+	*np->tf = *proc->tf;
+	np->tf->eip = fn;
+	np->tf->rdi = arg;
+	// As if fn had just been called: 16-byte aligned once the
+	// (absent) return address is popped.
+	np->tf->esp = (stack & ~15) - sizeof(uintp);
+
+	return startproc(np, proc->blessed, proc->name);
+}
+
+// Start path with argv in a new child, as fork() and exec() would
+// but without copying the caller's address space: the child's is
+// built straight from the executable. The child's fds 0, 1 and 2
+// are the caller's fds[0], fds[1] and fds[2] (closed where one is
+// -1), or the caller's own 0, 1 and 2 if fds is 0; it has no other
+// open files. Returns the child's pid, or -1 if path won't run.
+int spawn(char* path, char** argv, int* fds){
+	struct execimage im;
+	struct proc* np;
+	int i, fd;
+
+	if ((np = allocproc()) == 0)
+		return -1;
+	if ((np->vm = vmspacealloc()) == 0 || (np->files = filesalloc()) == 0 ||
+	    execload(path, argv, np->pid, proc->pid, &im) < 0) {
+		unallocproc(np);
+		return -1;
+	}
+	np->vm->pgdir = im.pgdir;
+	np->vm->sz = im.sz;
+	np->vm->exe = im.exe;
+	memmove(np->vm->useg, im.useg, sizeof(im.useg));
+	np->vm->nuseg = im.nuseg;
+
+	*np->tf = *proc->tf;
+	np->tf->rdi = im.argc;
+	np->tf->rsi = im.argv;
+	np->tf->eip = im.entry;
+	np->tf->esp = im.sp;
+	np->tls = 0;
+
+	acquire(&proc->files->lock);
+	for (i = 0; i < 3; i++) {
+		fd = fds ? fds[i] : i;
+		if (fd >= 0 && fd < NOFILE && proc->files->ofile[fd])
+			np->files->ofile[i] = filedup(proc->files->ofile[fd]);
+	}
+	np->files->cwd = idup(proc->files->cwd);
+	release(&proc->files->lock);
+
+	return startproc(np, PROC_DAMNED, im.name);
 }
 
 int fork(){
@@ -239,43 +717,84 @@ int bfork(){
 	return _fork(PROC_BLESSED);
 }
 
-// Exit the current process.  Does not return.
+// Exit the current process with status.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
-void exit(void){
+void exit(int status){
 	struct proc* p;
-	int fd;
+	int fd, lastfiles, lastvm;
 
 	if (proc == initproc)
 		panic("init exiting");
 
-	// Close all open files.
-	for (fd = 0; fd < NOFILE; fd++) {
-		if (proc->ofile[fd]) {
-			fileclose(proc->ofile[fd]);
-			proc->ofile[fd] = 0;
+	// Close all open files, unless other threads share them.
+	acquire(&ptable.lock);
+	lastfiles = --proc->files->ref == 0;
+	release(&ptable.lock);
+	if (lastfiles) {
+		for (fd = 0; fd < NOFILE; fd++) {
+			if (proc->files->ofile[fd]) {
+				fileclose(proc->files->ofile[fd]);
+				proc->files->ofile[fd] = 0;
+			}
 		}
+		begin_op();
+		iput(proc->files->cwd);
+		end_op();
+		kmem_cache_free(ptable.filescache, proc->files);
+	}
+	proc->files = 0;
+	lastvm = vmspaceexit(proc);
+	uringrelease(proc);
+	if (proc->kring)
+		kringclose(proc->kring);
+
+	// Give back the user pages now rather than when the parent
+	// gets round to wait(): they are what oomkill() is after.
+	// Nothing touches user memory from here on.
+	if (lastvm) {
+		acquire(&proc->vm->lock);
+		deallocuvm(proc->vm->pgdir, proc->vm->sz, 0);
+		proc->vm->sz = 0;
+		release(&proc->vm->lock);
+		uvmflush(0);
 	}
-
-	begin_op();
-	iput(proc->cwd);
-	end_op();
-	proc->cwd = 0;
 
 	acquire(&ptable.lock);
 
 	// Parent might be sleeping in wait().
-	wakeup1(proc->parent);
+	proc->xstatus = status;
+	sibremove(proc);
+	sibinsert(&proc->parent->zombies, proc);
+	wakeup(proc->parent);
 
 	// Pass abandoned children to init.
+	while ((p = proc->kids) != 0) {
+		sibremove(p);
+		p->parent = initproc;
+		sibinsert(&initproc->kids, p);
+		vdsoreparent(p);
+	}
+	if (proc->zombies) {
+		while ((p = proc->zombies) != 0) {
+			sibremove(p);
+			p->parent = initproc;
+			sibinsert(&initproc->zombies, p);
+		}
+		wakeup(initproc);
+	}
+
+	// Fail the calls waiting on us.
 	for(EACH_PTABLE_NODE){
 		p = &(node->proc);
-		if (p->parent == proc) {
-			p->parent = initproc;
-			if (p->state == ZOMBIE)
-				wakeup1(initproc);
+		if (p->ipcpeer == proc) {
+			p->ipcpeer = 0;
+			p->ipcnext = 0;
+			if (ipcsleeping(p))
+				ipcwake(p);
 		}
 	}
+	proc->ipccalls = 0;
 
 	// Jump into the scheduler, never to return.
 	proc->state = ZOMBIE;
@@ -283,46 +802,276 @@ void exit(void){
 	panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int wait(void){
+// Wait for child pid, or any child if pid is -1, to exit, and
+// return its pid, with its exit status in *status unless status
+// is 0 (-1 if it was killed). Exited children are on a list of
+// their own, so this never looks at the others. With WNOHANG,
+// return 0 rather than wait. Return -1 if there is no such child.
+int waitpid(int pid, int* status, int options){
 	struct proc* p;
-	int havekids, pid;
+	struct file *rpipe, *wpipe;
+	struct kringpair *kring;
+	int xstatus;
 
 	acquire(&ptable.lock);
 	for (;;) {
-		// Scan through table looking for zombie children.
-		havekids = 0;
-		for(EACH_PTABLE_NODE){
-			p = &(node->proc);
-			if (p->parent != proc)
-				continue;
-			havekids = 1;
-			if (p->state == ZOMBIE) {
-				// Found one.
-				pid = p->pid;
-				kfree(p->kstack);
-				p->kstack = 0;
-				freevm(p->pgdir);
-				p->state = UNUSED;
-				p->pid = 0;
-				p->parent = 0;
-				p->name[0] = 0;
-				p->killed = 0;
-				release(&ptable.lock);
-				return pid;
-			}
+		if (pid == -1) {
+			if ((p = proc->zombies) == 0 && proc->kids == 0)
+				break;
+		} else {
+			if ((p = findproc(pid)) == 0 || p->parent != proc)
+				break;
+			if (p->state != ZOMBIE)
+				p = 0;
+		}
+		if (p) {
+			pid = p->pid;
+			xstatus = p->xstatus;
+			proc->cutime += p->utime + p->cutime;
+			proc->cstime += p->stime + p->cstime;
+			proc->cnsyscall += p->nsyscall + p->cnsyscall;
+			sibremove(p);
+			kstackfree(p->kstack);
+			p->kstack = 0;
+			fpufree(p);
+			perffree(p);
+			vmspaceput(p->vm);
+			p->vm = 0;
+			rpipe = p->rpipe;
+			wpipe = p->wpipe;
+			kring = p->kring;
+			freeproc(p);
+			release(&ptable.lock);
+			if (kring)
+				kringput(kring);
+			// fileclose may wakeup(), which takes ptable.lock
+			if (rpipe)
+				fileclose(rpipe);
+			if (wpipe)
+				fileclose(wpipe);
+			if (status)
+				*status = xstatus;
+			return pid;
 		}
 
-		// No point waiting if we don't have any children.
-		if (!havekids || proc->killed) {
+		if (proc->killed)
+			break;
+		if (options & WNOHANG) {
 			release(&ptable.lock);
-			return -1;
+			return 0;
 		}
 
-		// Wait for children to exit.  (See wakeup1 call in proc_exit.)
+		// Wait for children to exit.  (See wakeup call in proc_exit.)
 		sleep(proc, &ptable.lock);
 	}
+	release(&ptable.lock);
+	return -1;
+}
+
+int wait(void){
+	return waitpid(-1, 0, 0);
+}
+
+// May cpu c run p? Reserved cpus run only blessed processes,
+// and p only runs on cpus in its affinity mask.
+static int canrun(struct cpu* c, struct proc* p){
+	if ((c->capabilities & CPU_RESERVED_BLESS) == CPU_RESERVED_BLESS && p->blessed != PROC_BLESSED)
+		return 0;
+	return CPUMASK_ISSET(p->affinity, c->id);
+}
+
+// Priority p is scheduled at: its own plus one for every time it
+// was passed over, unless it is too low to be boosted.
+static int effectivepriority(struct proc* p){
+	uint64 prio = p->priority > PROC_NO_BOOST_PRIORITY
+				? p->priority + p->skipped
+				: p->priority;
+	return prio > PROC_MAX_PRIORITY ? PROC_MAX_PRIORITY : prio;
+}
+
+// Append p to bucket b of rq. Must hold rq->lock.
+static void rqinsert(struct runq* rq, struct proc* p, int b){
+	p->rqprio = b;
+	p->rqnext = 0;
+	p->rqprev = rq->tail[b];
+	if (rq->tail[b])
+		rq->tail[b]->rqnext = p;
+	else
+		rq->head[b] = p;
+	rq->tail[b] = p;
+	rq->map[b / 64] |= 1ULL << (b % 64);
+}
+
+// Unlink p from its bucket of rq. Must hold rq->lock.
+static void rqremove(struct runq* rq, struct proc* p){
+	int b = p->rqprio;
+
+	if (p->rqprev)
+		p->rqprev->rqnext = p->rqnext;
+	else
+		rq->head[b] = p->rqnext;
+	if (p->rqnext)
+		p->rqnext->rqprev = p->rqprev;
+	else
+		rq->tail[b] = p->rqprev;
+	if (rq->head[b] == 0)
+		rq->map[b / 64] &= ~(1ULL << (b % 64));
+	p->rqnext = p->rqprev = 0;
+}
+
+// Highest non-empty bucket of rq below bucket below, or -1.
+static int rqhighest(struct runq* rq, int below){
+	int w;
+	uint64 m;
+
+	if (below <= 0)
+		return -1;
+	w = (below - 1) / 64;
+	m = rq->map[w] & (~0ULL >> (63 - (below - 1) % 64));
+	for (;;) {
+		if (m)
+			return w * 64 + 63 - __builtin_clzll(m);
+		if (--w < 0)
+			return -1;
+		m = rq->map[w];
+	}
+}
+
+// p was queued on cpu c: if c is halted in idle(), wake it,
+// otherwise wake some other idle cpu that may steal p.
+static void kick(int c, struct proc* p){
+	if (c != cpu->id && cpus[c].idle) {
+		lapicipi(c, T_IRQ0 + IRQ_RESCHED);
+		return;
+	}
+	for (int i = 0; i < ncpu; i++) {
+		if (i != cpu->id && cpus[i].idle && canrun(&cpus[i], p)) {
+			lapicipi(i, T_IRQ0 + IRQ_RESCHED);
+			return;
+		}
+	}
+}
+
+// Mark p RUNNABLE and queue it on the cpu it last ran on, or
+// on this cpu if it has not run yet. Must hold ptable.lock or
+// the waitq lock p sleeps under. A priority change takes effect
+// the next time p is queued.
+static void setrunnable(struct proc* p){
+	struct runq* rq;
+	int c;
+
+	c = p->rqcpu;
+	if (c < 0 || c >= ncpu || !canrun(&cpus[c], p))
+		c = cpu->id;
+	for (int i = 1; i < ncpu && !canrun(&cpus[c], p); i++)
+		c = (cpu->id + i) % ncpu;
+
+	p->state = RUNNABLE;
+	p->rqcpu = c;
+	rq = &runqs[c];
+	acquire(&rq->lock);
+	rqinsert(rq, p, effectivepriority(p));
+	rq->n++;
+	release(&rq->lock);
+	// Against idle(): it stores idle then reads n, we store n then
+	// read idle, so one of us sees the other's store.
+	__sync_synchronize();
+	kick(c, p);
+}
+
+// Take the best process on rq that this cpu may run. Every pick
+// also ages the best process left waiting below it by moving it up
+// a bucket, so nothing (except priority =< PROC_NO_BOOST_PRIORITY)
+// is starved.
+static struct proc* rqpick(struct runq* rq){
+	struct proc* p = 0;
+	struct proc* q;
+	int b, qb;
+
+	acquire(&rq->lock);
+	for (b = rqhighest(rq, NPRIO); b >= 0; b = rqhighest(rq, b)) {
+		// Only processes limited to some cpus (by affinity, or
+		// by being damned) make us look past the head of a bucket.
+		for (p = rq->head[b]; p != 0 && !canrun(cpu, p); p = p->rqnext)
+			;
+		if (p)
+			break;
+	}
+	if (p) {
+		rqremove(rq, p);
+		rq->n--;
+		if ((qb = rqhighest(rq, b)) >= 0) {
+			q = rq->head[qb];
+			if (q->priority > PROC_NO_BOOST_PRIORITY && qb < PROC_MAX_PRIORITY) {
+				q->skipped++;
+				rqremove(rq, q);
+				rqinsert(rq, q, qb + 1);
+			}
+		}
+	}
+	release(&rq->lock);
+	return p;
+}
+
+// Choose the next process for this cpu: from its own queue,
+// or failing that from the longest other queue. Must hold
+// ptable.lock.
+static struct proc* pickproc(void){
+	struct proc* p;
+	int i, c, victim, most;
+
+	if ((p = rqpick(&runqs[cpu->id])) != 0)
+		return p;
+
+	victim = -1;
+	most = 0;
+	for (i = 0; i < ncpu; i++) {
+		if (i != cpu->id && runqs[i].n > most) {
+			victim = i;
+			most = runqs[i].n;
+		}
+	}
+	if (victim < 0)
+		return 0;
+	if ((p = rqpick(&runqs[victim])) == 0) {
+		// It may hold only processes we cannot run; try the rest.
+		for (i = 1; i < ncpu && p == 0; i++) {
+			c = (cpu->id + i) % ncpu;
+			if (c != victim && runqs[c].n > 0)
+				p = rqpick(&runqs[c]);
+		}
+	}
+	if (p)
+		p->rqcpu = cpu->id;
+	return p;
+}
+
+// Is there anything this cpu could pick? Checked without locks
+// so idle cpus do not hammer ptable.lock.
+static int runqbusy(void){
+	for (int i = 0; i < ncpu; i++)
+		if (runqs[i].n > 0)
+			return 1;
+	return 0;
+}
+
+// Halt until an interrupt arrives. setrunnable() sends idle cpus
+// a reschedule IPI, so only cpu 0, which keeps time, needs the
+// periodic tick; the others stop taking it while halted.
+static void idle(void){
+	cli();
+	cpu->idle = 1;
+	__sync_synchronize(); // set idle before looking at the queues
+	if (!runqbusy()) {
+		if (cpu->id != 0)
+			lapictimer(0);
+		amd64_sti_hlt();
+		cli();
+		if (cpu->id != 0)
+			lapictimer(1);
+	}
+	cpu->idle = 0;
+	amd64_sti();
 }
 
 // Per-CPU process scheduler.
@@ -335,9 +1084,11 @@ int wait(void){
 void scheduler(void){
 	struct proc* p = 0;
 
+	cpu->accttsc = rdtsc();
 	while(1) {
 		// Enable interrupts on this processor.
 		amd64_sti();
+		cpu->wdmoved = cpu->wdticks; // not stuck; see watchdog.c
 
 		if ((cpu->capabilities & CPU_DISABLED) == CPU_DISABLED) {
 			// if the CPU has been marked as disabled, halt the CPU
@@ -346,55 +1097,37 @@ void scheduler(void){
 			continue;
 		}
 
-		// Loop over process table looking for process to run.
-		uint8 highestpriority = 0;
-		struct proc* bestp = 0;
-		acquire(&ptable.lock);
-		for(EACH_PTABLE_NODE){
-			p = &(node->proc);
-			if (p->state != RUNNABLE)
-				continue;
-
-			if (((cpu->capabilities & CPU_RESERVED_BLESS) == CPU_RESERVED_BLESS) && p->blessed != PROC_BLESSED) {
-				continue;
-			}
-
-			uint64 effectivepriority = p-> priority > PROC_NO_BOOST_PRIORITY
-									  ? p->priority + p->skipped
-									  : p-> priority;
-			effectivepriority = effectivepriority > PROC_MAX_PRIORITY
-									  ? PROC_MAX_PRIORITY
-									  : effectivepriority;
-
-			if(effectivepriority >= highestpriority) {
-				if(bestp) {
-					// if we previously selected a best fit, mark it as skipped
-					bestp->skipped++;
-				}
-				bestp = p;
-				highestpriority = effectivepriority;
-			} else {
-				// each process that is skipped will receive a boost in effective
-				// priority the next time it runs. This ensures that no process
-				// (except priority =< PROC_NO_BOOST_PRIORITY) is starved.
-				p->skipped++;
-			}
+		// Run processes for as long as any are runnable. The
+		// user page table of the last one stays loaded between
+		// them; it cannot be freed while we hold ptable.lock.
+		if (!runqbusy()) {
+			// Nothing to run; use the time to zero pages,
+			// then halt until there is work.
+			if (!kzpoolfill())
+				idle();
+			continue;
 		}
-		if(bestp) {
+		acquire(&ptable.lock);
+		while ((p = pickproc()) != 0) {
 			// Switch to chosen process.  It is the process's job
 			// to release ptable.lock and then reacquire it
 			// before jumping back to us.
-			proc = bestp;
-			switchuvm(bestp);
-			bestp->state = RUNNING;
-			bestp->skipped = 0;
-			cpu->proc = bestp;
+			acctcharge(0); // idle until now
+			proc = p;
+			switchuvm(p);
+			p->state = RUNNING;
+			p->skipped = 0;
+			cpu->proc = p;
+			cpu->slicestart = nsecs();
+			TRACE(TRACE_SWITCHIN, p->pid, 0);
 			swtch(&cpu->scheduler, proc->context);
-			switchkvm();
 			// Process is done running for now.
 			// It should have changed its p->state before coming back.
 			proc = 0;
+			cpu->proc = 0;
 		}
+		uvmleave();
+		switchkvm();
 		release(&ptable.lock);
 	}
 }
@@ -413,6 +1146,10 @@ void sched(void){
 	if (readeflags() & FL_IF)
 		panic("sched interruptible");
 	intena = cpu->intena;
+	TRACE(TRACE_SWITCHOUT, proc->pid, proc->state);
+	acctcharge(0);
+	fpuswitchout();
+	perfswitchout();
 	swtch(&proc->context, cpu->scheduler);
 	cpu->intena = intena;
 }
@@ -420,11 +1157,115 @@ void sched(void){
 // Give up the CPU for one scheduling round.
 void yield(void){
 	acquire(&ptable.lock);
-	proc->state = RUNNABLE;
+	setrunnable(proc);
 	sched();
 	release(&ptable.lock);
 }
 
+// Charge the TSC cycles since the last charge on this cpu to the
+// process running here, as user time if user is set, else system
+// time, or to the cpu as idle if there is none. Called wherever
+// the cpu changes processes or modes: in sched(), ipcsleep(),
+// scheduler() and trap().
+void acctcharge(int user){
+	uint64 now, d;
+
+	pushcli();
+	now = rdtsc();
+	d = now - cpu->accttsc;
+	cpu->accttsc = now;
+	cpu->wdmoved = cpu->wdticks; // as far as the watchdog cares
+	if (proc == 0) {
+		cpu->idletsc += d;
+	} else {
+		cpu->busytsc += d;
+		if (user)
+			proc->utime += d;
+		else
+			proc->stime += d;
+	}
+	popcli();
+}
+
+// Load averages over 1, 5 and 15 minutes: how many processes are
+// running or runnable, sampled every LOADFREQ ticks into decaying
+// averages, in fixed point with FSHIFT bits of fraction.
+#define FSHIFT   11
+#define FIXED_1  (1 << FSHIFT)
+#define LOADFREQ (5 * HZ)
+static const uint64 loadexp[3] = { 1884, 2014, 2037 };  // FIXED_1 / e^(5 s / 1, 5, 15 min)
+static uint64 load[3];
+
+// The timer tick t, on cpu 0. Reads the queues without locks;
+// the count needn't be exact.
+void loadavgtick(uint t){
+	uint64 n = 0;
+
+	if (t % LOADFREQ != 0)
+		return;
+	for (int i = 0; i < ncpu; i++) {
+		n += runqs[i].n;
+		if (cpus[i].proc)
+			n++;
+	}
+	for (int i = 0; i < 3; i++)
+		load[i] = (load[i] * loadexp[i] + n * FIXED_1 * (FIXED_1 - loadexp[i])) >> FSHIFT;
+}
+
+// The load averages, in hundredths.
+void loadavg(int* avg){
+	for (int i = 0; i < 3; i++)
+		avg[i] = (load[i] * 100 + FIXED_1 / 2) >> FSHIFT;
+}
+
+// Fill in ru with the time and system calls of the calling
+// process (a thread alone, for clone()'s), or with those of the
+// children it has reaped and theirs.
+int getrusage(int who, struct rusage* ru){
+	acctcharge(0);
+	acquire(&ptable.lock);
+	if (who == RUSAGE_SELF) {
+		ru->utime = tsc2ns(proc->utime);
+		ru->stime = tsc2ns(proc->stime);
+		ru->nsyscall = proc->nsyscall;
+	} else if (who == RUSAGE_CHILDREN) {
+		ru->utime = tsc2ns(proc->cutime);
+		ru->stime = tsc2ns(proc->cstime);
+		ru->nsyscall = proc->cnsyscall;
+	} else {
+		release(&ptable.lock);
+		return -1;
+	}
+	release(&ptable.lock);
+	return 0;
+}
+
+// Has the current process used up its time slice? With half a
+// tick of slack for timer jitter.
+int sliceover(void){
+	return nsecs() - cpu->slicestart + 500000000 / HZ >= QUANTUM * 1000000ULL;
+}
+
+// Code with interrupts on is preempted at the tick that ends the
+// slice, like user code, except between preempt_disable() and
+// preempt_enable().
+void preempt_disable(void){
+	proc->preempt++;
+}
+
+void preempt_enable(void){
+	if (--proc->preempt < 0)
+		panic("preempt_enable");
+}
+
+// A preemption point, for long loops that run with spinlocks
+// held but may let go of them now and then: if the slice is over
+// and nothing keeps us here, give up the cpu.
+void cond_resched(void){
+	if (proc && proc->state == RUNNING && proc->preempt == 0 && cpu->ncli == 0 && sliceover())
+		yield();
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch here.  "Return" to user space.
 void forkret(void){
@@ -446,26 +1287,34 @@ void forkret(void){
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void sleep(void* chan, struct spinlock* lk){
+	struct waitq* wq;
+
 	if (proc == 0)
 		panic("sleep");
 
 	if (lk == 0)
 		panic("sleep without lk");
 
-	// Must acquire ptable.lock in order to
-	// change p->state and then call sched.
-	// Once we hold ptable.lock, we can be
-	// guaranteed that we won't miss any wakeup
-	// (wakeup runs with ptable.lock locked),
-	// so it's okay to release lk.
-	if (lk != &ptable.lock) {
+	// Must acquire ptable.lock in order to call sched, and
+	// the waitq lock to go on chan's queue. Once we are queued,
+	// we can be guaranteed that we won't miss any wakeup
+	// (wakeup runs with the waitq lock held), so it's okay to
+	// release lk. A waker may mark us RUNNABLE before sched(),
+	// but no cpu can pick us until sched() gives up ptable.lock.
+	if (lk != &ptable.lock)
 		acquire(&ptable.lock);
+	wq = waitqof(chan);
+	acquire(&wq->lock);
+	proc->chan = chan;
+	proc->state = SLEEPING;
+	TRACE(TRACE_SLEEP, chan, 0);
+	proc->wqnext = wq->head;
+	wq->head = proc;
+	release(&wq->lock);
+	if (lk != &ptable.lock)
 		release(lk);
-	}
 
 	// Go to sleep.
-	proc->chan = chan;
-	proc->state = SLEEPING;
 	sched();
 
 	// Tidy up.
@@ -478,58 +1327,347 @@ void sleep(void* chan, struct spinlock* lk){
 	}
 }
 
+// Take p off wq and make it RUNNABLE. Must hold wq->lock.
+static void unsleep(struct waitq* wq, struct proc* p){
+	struct proc** pp;
 
-// Wake up all processes sleeping on chan.
-// The ptable lock must be held.
-static void wakeup1(void* chan){
-	struct proc* p;
-
-	for(EACH_PTABLE_NODE){
-		p = &(node->proc);
-		if (p->state == SLEEPING && p->chan == chan) {
-			p->state = RUNNABLE;
+	for (pp = &wq->head; *pp != 0; pp = &(*pp)->wqnext) {
+		if (*pp == p) {
+			*pp = p->wqnext;
+			break;
 		}
 	}
+	p->wqnext = 0;
+	TRACE(TRACE_WAKEUP, p->pid, p->chan);
+	setrunnable(p);
 }
 
 // Wake up all processes sleeping on chan.
 void
 wakeup(void* chan){
+	struct waitq* wq = waitqof(chan);
+	struct proc* p, * next;
+
+	// Nobody hashed here: nothing to do. Sleepers queue
+	// themselves before releasing the lock the caller holds.
+	if (wq->head == 0)
+		return;
+
+	acquire(&wq->lock);
+	for (p = wq->head; p != 0; p = next) {
+		next = p->wqnext;
+		if (p->chan == chan)
+			unsleep(wq, p);
+	}
+	release(&wq->lock);
+}
+
+// Sleep on the user word at addr as long as it holds val, so
+// user-space locks only enter the kernel when contended.
+// Waiters are keyed by address and address space; a waker
+// changes the word before futexwake(), which takes the same
+// waitq lock we check the word under, so wakeups are not lost.
+// Returns 0 when woken, -1 if the word no longer holds val.
+int futexwait(uintp addr, int val){
+	struct waitq* wq = waitqof((void*)addr);
+	char* ka;
+	int cur;
+
+	// Fault the page in while we may still sleep.
+	if (addr % sizeof(int) || fetchint(addr, &cur) < 0)
+		return -1;
+	if (cur != val)
+		return -1;
+
+	acquire(&ptable.lock);
+	acquire(&wq->lock);
+	ka = uva2ka(proc->vm->pgdir, (char*)addr);
+	if (ka == 0 || *(volatile int*)(ka + addr % PGSIZE) != val) {
+		release(&wq->lock);
+		release(&ptable.lock);
+		return -1;
+	}
+	proc->chan = (void*)addr;
+	proc->state = SLEEPING;
+	proc->wqnext = wq->head;
+	wq->head = proc;
+	release(&wq->lock);
+
+	sched();
+
+	proc->chan = 0;
+	release(&ptable.lock);
+	return 0;
+}
+
+// Wake up to n threads of this address space waiting on addr.
+// Returns the number woken.
+int futexwake(uintp addr, int n){
+	struct waitq* wq = waitqof((void*)addr);
+	struct proc* p, * next;
+	int woken = 0;
+
+	// Unlike wakeup()'s callers, there is no lock the waiter checked
+	// the futex word under, only wq->lock; order the caller's store
+	// to the word before this look at the queue.
+	__sync_synchronize();
+	if (wq->head == 0)
+		return 0;
+
+	acquire(&wq->lock);
+	for (p = wq->head; p != 0 && woken < n; p = next) {
+		next = p->wqnext;
+		if (p->chan == (void*)addr && p->vm == proc->vm) {
+			unsleep(wq, p);
+			woken++;
+		}
+	}
+	release(&wq->lock);
+	return woken;
+}
+
+// Synchronous IPC. A client's ipccall() queues it on the server
+// and sleeps until the server's ipcreplywait() answers. Messages
+// are a few words kept in struct proc, so nothing is mapped or
+// buffered. When the other side is already waiting, the call and
+// the reply switch straight to it on this cpu, instead of going
+// through the run queues and scheduler(); it then runs out the
+// rest of our time slice.
+//
+// A client is IPC_CALLING while queued on its server, IPC_TAKEN
+// once the server has its request, and IPC_REPLIED once the reply
+// is in its ipcmsg. A server is IPC_RECV while it waits for calls.
+// All of it is under ptable.lock.
+enum { IPC_NONE, IPC_CALLING, IPC_TAKEN, IPC_REPLIED, IPC_RECV };
+
+static int ipcsleeping(struct proc* p){
+	return p->state == SLEEPING && p->chan == &p->ipcstate;
+}
+
+static void ipcwake(struct proc* p){
+	p->chan = 0;
+	setrunnable(p);
+}
+
+// Sleep until woken, handing the cpu to p, if any, which must be
+// an IPC sleeper; directly, if this cpu may run it. Must hold
+// ptable.lock and no other lock.
+static void ipcsleep(struct proc* p){
+	struct proc* self = proc;
+	int intena;
+
+	proc->chan = &proc->ipcstate;
+	proc->state = SLEEPING;
+	if (p == 0 || !canrun(cpu, p)) {
+		if (p)
+			ipcwake(p);
+		sched();
+	} else {
+		if (cpu->ncli != 1)
+			panic("ipcsleep locks");
+		p->chan = 0;
+		p->state = RUNNING;
+		p->skipped = 0;
+		p->rqcpu = cpu->id;
+		intena = cpu->intena;
+		TRACE(TRACE_SWITCHOUT, self->pid, self->state);
+		acctcharge(0);
+		fpuswitchout();
+		perfswitchout();
+		TRACE(TRACE_SWITCHIN, p->pid, 0);
+		proc = p;
+		cpu->proc = p;
+		switchuvm(p);
+		swtch(&self->context, p->context);
+		cpu->intena = intena;
+	}
+	proc->chan = 0;
+}
+
+// Send msg to process pid and wait for its reply, which replaces
+// msg. Returns 0, or -1 if there is no such process, it exited
+// before replying, or we were killed.
+int ipccall(int pid, struct ipcmsg* msg){
+	struct proc* s, * run = 0, ** pp;
+	int r = -1;
+
 	acquire(&ptable.lock);
-	wakeup1(chan);
+	if ((s = findproc(pid)) == 0 || s == proc || s->state == ZOMBIE || s->killed) {
+		release(&ptable.lock);
+		return -1;
+	}
+	proc->ipcmsg = *msg;
+	proc->ipcpeer = s;
+	proc->ipcstate = IPC_CALLING;
+	proc->ipcnext = 0;
+	for (pp = &s->ipccalls; *pp != 0; pp = &(*pp)->ipcnext)
+		;
+	*pp = proc;
+	if (s->ipcstate == IPC_RECV && ipcsleeping(s))
+		run = s;
+
+	while (proc->ipcstate != IPC_REPLIED && proc->ipcpeer && !proc->killed) {
+		ipcsleep(run);
+		run = 0;
+	}
+	if (proc->ipcstate == IPC_REPLIED) {
+		*msg = proc->ipcmsg;
+		r = 0;
+	} else if (proc->ipcstate == IPC_CALLING && proc->ipcpeer) {
+		// Killed before the server took the call.
+		for (pp = &s->ipccalls; *pp != 0; pp = &(*pp)->ipcnext) {
+			if (*pp == proc) {
+				*pp = proc->ipcnext;
+				break;
+			}
+		}
+	}
+	proc->ipcstate = IPC_NONE;
+	proc->ipcpeer = 0;
+	proc->ipcnext = 0;
+	release(&ptable.lock);
+	return r;
+}
+
+// Reply with msg to the caller to, if it is positive and still
+// waiting on us, then wait for the next call and return its
+// request in msg. Returns the caller's pid, or -1 if we were
+// killed.
+int ipcreplywait(int to, struct ipcmsg* msg){
+	struct proc* c, * run = 0;
+	int pid;
+
+	acquire(&ptable.lock);
+	if (to > 0 && (c = findproc(to)) != 0 && c->ipcpeer == proc && c->ipcstate == IPC_TAKEN) {
+		c->ipcmsg = *msg;
+		c->ipcstate = IPC_REPLIED;
+		if (ipcsleeping(c))
+			run = c;
+	}
+
+	while ((c = proc->ipccalls) == 0 && !proc->killed) {
+		proc->ipcstate = IPC_RECV;
+		ipcsleep(run);
+		run = 0;
+	}
+	proc->ipcstate = IPC_NONE;
+	if (run)
+		ipcwake(run); // we have more calls; let it run elsewhere
+	if (c == 0) {
+		release(&ptable.lock);
+		return -1;
+	}
+	proc->ipccalls = c->ipcnext;
+	c->ipcnext = 0;
+	c->ipcstate = IPC_TAKEN;
+	*msg = c->ipcmsg;
+	pid = c->pid;
 	release(&ptable.lock);
+	return pid;
 }
 
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
+// Must hold ptable.lock.
+static void killproc(struct proc* p){
+	p->killed = 1;
+	// Wake process from sleep if necessary.
+	if (p->state == SLEEPING) {
+		struct waitq* wq = waitqof(p->chan);
+		acquire(&wq->lock);
+		if (p->state == SLEEPING)
+			unsleep(wq, p);
+		release(&wq->lock);
+	}
+}
+
 int kill(int pid){
 	struct proc* p;
 
+	acquire(&ptable.lock);
+	if ((p = findproc(pid)) != 0) {
+		killproc(p);
+		release(&ptable.lock);
+		return 0;
+	}
+	release(&ptable.lock);
+	return -1;
+}
+
+// Pages p has mapped: its size and its anonymous mappings. Not
+// counting what demand paging hasn't brought in yet, or pages
+// shared copy-on-write, which is near enough to choose between
+// processes.
+static uintp vmpages(struct vmspace* vm){
+	uintp n = vm->sz / PGSIZE;
+
+	for (int i = 0; i < NVMA; i++)
+		if (vm->vma[i].start && vm->vma[i].ip == 0 && !vm->vma[i].shared)
+			n += (vm->vma[i].end - vm->vma[i].start) / PGSIZE;
+	return n;
+}
+
+// Out of memory, with the caches shrunk as far as they go: swap
+// some pages out if there is room, or else kill the process with
+// the most pages mapped, and all the threads sharing its address
+// space, sparing init, kernel threads and blessed processes. If
+// one killed earlier hasn't exited yet, don't kill another, just
+// wait again. When it can, waits OOM_WAIT ticks for the memory to
+// come free. Returns 0 if the caller should try its allocation
+// again, -1 if it is the victim itself or there is nobody to kill.
+int oomkill(void){
+	struct proc* p, * victim = 0;
+	struct ktimer t;
+	uintp n, most = 0;
+	int dying = 0;
+
+	if (swapbusy() > 0 || swapout(OOM_SWAP) > 0)
+		goto wait;
 	acquire(&ptable.lock);
 	for(EACH_PTABLE_NODE){
 		p = &(node->proc);
-		if (p->pid == pid) {
-			p->killed = 1;
-			// Wake process from sleep if necessary.
-			if (p->state == SLEEPING)
-				p->state = RUNNABLE;
-			release(&ptable.lock);
-			return 0;
+		if (p->state == UNUSED || p->state == EMBRYO || p->state == ZOMBIE)
+			continue;
+		if (p == initproc || p->kfn || p->blessed || p->vm == 0)
+			continue;
+		if (p->killed) {
+			dying = 1;
+			continue;
+		}
+		if ((n = vmpages(p->vm)) > most) {
+			most = n;
+			victim = p;
+		}
+	}
+	if (victim && !dying) {
+		cprintf("out of memory: killing pid %d %s, %d pages\n", victim->pid, victim->name, (int)most);
+		for(EACH_PTABLE_NODE){
+			p = &(node->proc);
+			if (p->state != UNUSED && p->vm == victim->vm)
+				killproc(p);
 		}
 	}
 	release(&ptable.lock);
-	return -1;
+
+	if (proc->killed || (victim == 0 && !dying))
+		return -1;
+wait:
+	if (cpu->ncli == 0) {
+		memset(&t, 0, sizeof(t));
+		acquire(&tickslock);
+		ktimerset(&t, ticks + OOM_WAIT, wakeup, &t);
+		sleep(&t, &tickslock);
+		release(&tickslock);
+	}
+	return proc->killed ? -1 : 0;
 }
 
 enum procstate pstate(int pid) {
 	struct proc* p;
 
-	for(EACH_PTABLE_NODE){
-		p = &(node->proc);
-		if (p->pid == pid) {
-			return p->state;
-		}
+	if ((p = findproc(pid)) != 0) {
+		return p->state;
 	}
 	return UNUSED;
 }
@@ -538,14 +1676,74 @@ int pname(int pid, char *buf, int n) {
 	struct proc* p;
 
 	int minsize = n < 16 ? n : 16;
+	if ((p = findproc(pid)) != 0) {
+		safestrcpy(buf, &(p->name[0]), minsize);
+		return 0;
+	}
+	return -1;
+}
+
+// Return the lowest pid above pid of a process in the table, or
+// 0 if there is none; /proc lists processes with it.
+int procnext(int pid){
+	int next = 0;
+
+	acquire(&ptable.lock);
 	for(EACH_PTABLE_NODE){
-		p = &(node->proc);
-		if (p->pid == pid) {
-			safestrcpy(buf, &(p->name[0]), minsize);
-			return 0;
+		struct proc* p = &(node->proc);
+		if (p->state != UNUSED && p->pid > pid && (next == 0 || p->pid < next))
+			next = p->pid;
+	}
+	release(&ptable.lock);
+	return next;
+}
+
+// Copy out what /proc shows of process pid. Returns 0, or -1 if
+// there is no such process.
+int procinfo(int pid, struct procinfo* pi){
+	struct files* fs;
+	struct file* f;
+	struct proc* p;
+
+	memset(pi, 0, sizeof(*pi));
+	acquire(&ptable.lock);
+	if ((p = findproc(pid)) == 0 || p->state == UNUSED) {
+		release(&ptable.lock);
+		return -1;
+	}
+	pi->pid = p->pid;
+	pi->ppid = p->parent ? p->parent->pid : 0;
+	pi->state = p->state;
+	safestrcpy(pi->name, p->name, sizeof(pi->name));
+	pi->blessed = p->blessed;
+	pi->priority = p->priority;
+	pi->killed = p->killed;
+	pi->rqcpu = p->rqcpu;
+	pi->sz = p->vm ? p->vm->sz : 0;
+	pi->nsyscall = p->nsyscall;
+	pi->utime = tsc2ns(p->utime);
+	pi->stime = tsc2ns(p->stime);
+	// exit() frees the table once the last ref goes, which
+	// takes ptable.lock; an fd's file isn't closed before it
+	// is taken out under the table's lock.
+	if ((fs = p->files) != 0 && fs->ref > 0) {
+		acquire(&fs->lock);
+		for (int i = 0; i < NOFILE; i++) {
+			if ((f = fs->ofile[i]) == 0)
+				continue;
+			pi->fd[i].type = f->type;
+			pi->fd[i].readable = f->readable;
+			pi->fd[i].writable = f->writable;
+			pi->fd[i].off = f->off;
+			if (f->type == FD_INODE && f->ip) {
+				pi->fd[i].dev = f->ip->dev;
+				pi->fd[i].inum = f->ip->inum;
+			}
 		}
+		release(&fs->lock);
 	}
-	return -1;
+	release(&ptable.lock);
+	return 0;
 }
 
 int bless(int pid){
@@ -557,14 +1755,11 @@ int bless(int pid){
 	}
 
 	acquire(&ptable.lock);
-	for(EACH_PTABLE_NODE){
-		p = &(node->proc);
-		if (p->pid == pid) {
-			p->blessed = PROC_BLESSED;
-			_allocpipe(p);
-			release(&ptable.lock);
-			return 1;
-		}
+	if ((p = findproc(pid)) != 0) {
+		p->blessed = PROC_BLESSED;
+		_allocpipe(p);
+		release(&ptable.lock);
+		return 1;
 	}
 	release(&ptable.lock);
 	return 0;
@@ -579,14 +1774,11 @@ int damn(int pid){
 	}
 
 	acquire(&ptable.lock);
-	for(EACH_PTABLE_NODE){
-		p = &(node->proc);
-		if (p->pid == pid) {
-			p->blessed = PROC_DAMNED;
-			_deallocpipe(p);
-			release(&ptable.lock);
-			return 1;
-		}
+	if ((p = findproc(pid)) != 0) {
+		p->blessed = PROC_DAMNED;
+		_deallocpipe(p);
+		release(&ptable.lock);
+		return 1;
 	}
 	release(&ptable.lock);
 	return 0;
@@ -595,12 +1787,9 @@ int damn(int pid){
 int isblessed(int pid){
 	struct proc* p;
 
-	for(EACH_PTABLE_NODE){
-		p = &(node->proc);
-		if (p->pid == pid) {
-			int r = p->blessed;
-			return r;
-		}
+	if ((p = findproc(pid)) != 0) {
+		int r = p->blessed;
+		return r;
 	}
 	return 0;
 }
@@ -608,11 +1797,8 @@ int isblessed(int pid){
 int getpriority(int pid) {
 	struct proc* p;
 
-	for(EACH_PTABLE_NODE){
-		p = &(node->proc);
-		if (p->pid == pid) {
-			return p->priority;
-		}
+	if ((p = findproc(pid)) != 0) {
+		return p->priority;
 	}
 	return -1;
 }
@@ -620,16 +1806,80 @@ int getpriority(int pid) {
 int setpriority(int pid, int priority) {
 	struct proc* p;
 
-	for(EACH_PTABLE_NODE){
-		p = &(node->proc);
-		if (p->pid == pid) {
-			p->priority = priority;
-			return 1;
-		}
+	if ((p = findproc(pid)) != 0) {
+		p->priority = priority;
+		return 1;
 	}
 	return -1;
 }
 
+// Limit process pid to the cpus in mask, which must include at
+// least one cpu it may run on. Only blessed processes may change
+// other processes.
+int setaffinity(int pid, uint64* mask){
+	struct proc* p;
+	int c;
+
+	acquire(&ptable.lock);
+	p = pid == 0 ? proc : findproc(pid);
+	if (p == 0 || (p != proc && proc->blessed != PROC_BLESSED)) {
+		release(&ptable.lock);
+		return -1;
+	}
+	for (c = 0; c < ncpu; c++)
+		if (CPUMASK_ISSET(mask, c) && !((cpus[c].capabilities & CPU_RESERVED_BLESS) && p->blessed != PROC_BLESSED))
+			break;
+	if (c == ncpu) {
+		release(&ptable.lock);
+		return -1;
+	}
+	memmove(p->affinity, mask, sizeof(p->affinity));
+	release(&ptable.lock);
+	// A running process moves at its next reschedule.
+	return 0;
+}
+
+int getaffinity(int pid, uint64* mask){
+	struct proc* p;
+
+	acquire(&ptable.lock);
+	p = pid == 0 ? proc : findproc(pid);
+	if (p == 0) {
+		release(&ptable.lock);
+		return -1;
+	}
+	memmove(mask, p->affinity, sizeof(p->affinity));
+	release(&ptable.lock);
+	return 0;
+}
+
+// Reserve cpu c for blessed processes, or give it back to
+// everyone. One cpu always stays open to damned processes.
+int cpureserve(int c, int reserved){
+	int i;
+
+	if (proc->blessed != PROC_BLESSED || c < 0 || c >= ncpu)
+		return -1;
+	acquire(&ptable.lock);
+	if (reserved) {
+		for (i = 0; i < ncpu; i++)
+			if (i != c && !(cpus[i].capabilities & CPU_RESERVED_BLESS))
+				break;
+		if (i == ncpu) {
+			release(&ptable.lock);
+			return -1;
+		}
+		cpus[c].capabilities |= CPU_RESERVED_BLESS;
+	} else {
+		cpus[c].capabilities &= ~CPU_RESERVED_BLESS;
+	}
+	release(&ptable.lock);
+	// Damned processes already queued there get stolen by others.
+	kick(c, proc);
+	irqbalance();
+	return 0;
+}
+
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
@@ -663,6 +1913,10 @@ void procdump(void){
 		}
 		cprintf("\n");
 	}
+	kmemstats();
+	slabstats();
+	reclaimstats();
+	swapstats();
 }
 
 void _allocpipe(struct proc* p){
@@ -676,28 +1930,27 @@ void _deallocpipe(struct proc* p){
 	p->wpipe = 0;
 }
 
-int growptable() {
-	void *ptr = (void *)kalloc();
-	if (ptr == 0) {
-			return 0;
-	}
-	memset(ptr, 0, 4096);
-	uint16 allot = 4096 / sizeof(struct ptable_node);
-	uint16 offset = 0;
-	struct ptable_node *last;
-	if (ptable.head == 0) {
-			ptable.head = (struct ptable_node *)ptr;
-			offset++;
-			last = ptable.head;
-	} else {
-			last = ptable.head;
-			while(last->next != 0) {
-					last = last->next;
-			}
+// Unlink p from the process table and return it to the
+// proc cache. The ptable lock must be held.
+static void freeproc(struct proc* p){
+	struct ptable_node** pp;
+	struct proc** hp;
+
+	for (hp = &pidhash[(uint)p->pid % NPIDHASH]; *hp != 0; hp = &(*hp)->pidnext) {
+		if (*hp == p) {
+			*hp = p->pidnext;
+			break;
+		}
 	}
-	while(allot > offset) {
-			last->next = ((struct ptable_node *)ptr) + offset++;
-			last = last->next;
+
+	for (pp = &ptable.head; *pp != 0; pp = &(*pp)->next) {
+		if (&(*pp)->proc == p) {
+			struct ptable_node* node = *pp;
+			*pp = node->next;
+			node->proc.state = UNUSED;
+			kmem_cache_free(ptable.cache, node);
+			return;
+		}
 	}
-	return 1;
+	panic("freeproc");
 }
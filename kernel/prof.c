@@ -0,0 +1,184 @@
+// Sampling profiler.
+//
+// While it is on, every cpu's timer interrupt notes where the cpu
+// was: the interrupted PC and process and, if it was in the kernel,
+// the return addresses up the frame pointer chain (the kernel keeps
+// frame pointers) as far as they stay on the process's kernel
+// stack. User stacks aren't walked: their pages may not be there.
+//
+// Samples go to a ring for each cpu with one writer, the cpu with
+// interrupts off, and readers that take turns, so the rings need no
+// spinlock, as with the kernel log's. A sample that doesn't fit is
+// counted and dropped.
+//
+// /dev/prof is the interface: write "1" to start sampling and "0"
+// to stop. A read drains the rings as text, a sample a line: cpu,
+// pid, process name, then PCs innermost first, in hex. Lines that
+// start with '#' count samples dropped. tools/proffold turns a
+// capture into folded stacks for flamegraph.pl.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "kernel/string.h"
+
+#define PROF_DEPTH   12   // PCs kept per sample
+#define PROF_NSAMPLE 256  // samples in a cpu's ring
+#define PROF_LINE    256  // longest line a sample prints as
+
+struct profsample {
+	int pid;
+	uint npc;
+	char name[16];
+	uintp pc[PROF_DEPTH];
+};
+
+struct profring {
+	uint head;            // written up to here, by the cpu
+	uint tail;            // read up to here
+	uint dropped;         // samples that didn't fit
+	struct profsample s[PROF_NSAMPLE];
+};
+
+static struct {
+	int on;
+	struct sleeplock lock;            // readers, and turning on
+	struct profring* ring[NCPU];      // allocated at the first start
+} prof;
+
+// Note where this cpu was when the timer interrupted it.
+void proftick(struct trapframe* tf){
+	struct profring* r;
+	struct profsample* s;
+	uintp* fp, lo, hi;
+
+	if (!prof.on || (r = prof.ring[cpu->id]) == 0)
+		return;
+	if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == PROF_NSAMPLE) {
+		r->dropped++;
+		return;
+	}
+	s = &r->s[r->head % PROF_NSAMPLE];
+	s->pc[0] = tf->eip;
+	s->npc = 1;
+	s->pid = proc ? proc->pid : 0;
+	safestrcpy(s->name, proc ? proc->name : "-", sizeof(s->name));
+	if ((tf->cs & 3) == 0 && proc && proc->kstack) {
+		lo = (uintp)proc->kstack;
+		hi = lo + KSTACKSIZE;
+		fp = (uintp*)tf->rbp;
+		while (s->npc < PROF_DEPTH && (uintp)fp >= lo && (uintp)(fp + 2) <= hi &&
+		       ((uintp)fp & 7) == 0) {
+			s->pc[s->npc++] = fp[1];
+			if ((uintp*)fp[0] <= fp)
+				break;
+			fp = (uintp*)fp[0];
+		}
+	}
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+static char* profnum(char* p, uint64 x, int base){
+	char buf[20];
+	int i = 0;
+
+	do {
+		buf[i++] = "0123456789abcdef"[x % base];
+		x /= base;
+	} while (x);
+	while (i > 0)
+		*p++ = buf[--i];
+	return p;
+}
+
+// Print s, taken on cpu c, into line. Returns its length.
+static int profline(char* line, int c, struct profsample* s){
+	char* p = line;
+
+	p = profnum(p, c, 10);
+	*p++ = ' ';
+	p = profnum(p, s->pid, 10);
+	*p++ = ' ';
+	for (int i = 0; i < sizeof(s->name) && s->name[i]; i++)
+		*p++ = s->name[i] == ' ' ? '_' : s->name[i];
+	for (uint i = 0; i < s->npc; i++) {
+		*p++ = ' ';
+		p = profnum(p, s->pc[i], 16);
+	}
+	*p++ = '\n';
+	return p - line;
+}
+
+// Copy out as many whole samples as fit in n bytes, cpu by cpu.
+static int profread(struct inode* ip, char* dst, int n){
+	char line[PROF_LINE];
+	struct profring* r;
+	uint dropped;
+	int len, tot = 0;
+
+	acquiresleep(&prof.lock);
+	for (int c = 0; c < ncpu; c++) {
+		if ((r = prof.ring[c]) == 0)
+			continue;
+		if (tot + PROF_LINE <= n && (dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED))) {
+			memmove(line, "# dropped ", 10);
+			len = profnum(line + 10, dropped, 10) - line;
+			line[len++] = '\n';
+			memmove(dst + tot, line, len);
+			tot += len;
+		}
+		while (r->tail != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+			len = profline(line, c, &r->s[r->tail % PROF_NSAMPLE]);
+			if (tot + len > n)
+				goto done;
+			memmove(dst + tot, line, len);
+			tot += len;
+			__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+		}
+	}
+done:
+	releasesleep(&prof.lock);
+	return tot;
+}
+
+static int profwrite(struct inode* ip, char* src, int n){
+	int pages = PGROUNDUP(sizeof(struct profring)) / PGSIZE;
+	int r = n;
+
+	if (n < 1)
+		return -1;
+	acquiresleep(&prof.lock);
+	if (src[0] == '1') {
+		for (int c = 0; c < ncpu && r > 0; c++) {
+			struct profring* ring;
+			if (prof.ring[c])
+				continue;
+			if ((ring = (struct profring*)kmalloc(pages)) == 0) {
+				r = -1;
+				break;
+			}
+			memset(ring, 0, sizeof(*ring));
+			prof.ring[c] = ring;
+		}
+		if (r > 0)
+			prof.on = 1;
+	} else if (src[0] == '0') {
+		prof.on = 0;
+	} else if (src[0] != '\n') { // echo writes its newline apart
+		r = -1;
+	}
+	releasesleep(&prof.lock);
+	return r;
+}
+
+void profinit(void){
+	initsleeplock(&prof.lock, "prof");
+	devsw[PROF0].read = profread;
+	devsw[PROF0].write = profwrite;
+}
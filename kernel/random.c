@@ -0,0 +1,146 @@
+// /dev/zero and /dev/random, in the kernel.
+//
+// A read of /dev/zero is a memset of the caller's buffer; writes
+// are thrown away.
+//
+// /dev/random is ChaCha20 with fast key erasure: each read takes
+// the key, replaces it with the first block of its own keystream
+// and makes the rest from the blocks after, so what it handed out
+// can't be worked back from a later key. The key comes from RDSEED
+// or RDRAND at boot, where CPUID reports them, and otherwise from
+// the TSC; RDRAND, where there is one, is mixed into the new key at
+// every read. A write mixes what's written into the key.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "file.h"
+#include "kernel/string.h"
+
+int CPU_RDRAND;    // CPUID reports rdrand; set in identcpu()
+int CPU_RDSEED;    // CPUID reports rdseed
+
+static struct {
+	struct spinlock lock;
+	uint32 key[8];
+} rnd;
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QR(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8); \
+	c += d; b ^= c; b = ROTL(b, 7);
+
+// Block ctr of key's keystream.
+static void chacha20(uint32* out, uint32* key, uint64 ctr){
+	uint32 x[16], in[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574, // "expand 32-byte k"
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+		(uint32)ctr, (uint32)(ctr >> 32), 0, 0,
+	};
+
+	memmove(x, in, sizeof(x));
+	for (int i = 0; i < 10; i++) {
+		QR(x[0], x[4], x[8],  x[12]);
+		QR(x[1], x[5], x[9],  x[13]);
+		QR(x[2], x[6], x[10], x[14]);
+		QR(x[3], x[7], x[11], x[15]);
+		QR(x[0], x[5], x[10], x[15]);
+		QR(x[1], x[6], x[11], x[12]);
+		QR(x[2], x[7], x[8],  x[13]);
+		QR(x[3], x[4], x[9],  x[14]);
+	}
+	for (int i = 0; i < 16; i++)
+		out[i] = x[i] + in[i];
+}
+
+// A hardware random word, or 0 if there isn't one to be had.
+static int hwrandom(uint64* v, int seed){
+	uchar ok = 0;
+
+	// Both may run dry for a moment; Intel suggests ten tries.
+	for (int i = 0; i < 10 && !ok; i++) {
+		if (seed)
+			asm volatile("rdseed %0; setc %1" : "=r" (*v), "=qm" (ok));
+		else
+			asm volatile("rdrand %0; setc %1" : "=r" (*v), "=qm" (ok));
+	}
+	return ok;
+}
+
+static int zeroread(struct inode* ip, char* dst, int n){
+	memset(dst, 0, n);
+	return n;
+}
+
+static int zerowrite(struct inode* ip, char* src, int n){
+	return n;
+}
+
+static int randomread(struct inode* ip, char* dst, int n){
+	uint32 key[8], blk[16];
+	uint64 v;
+	int m, tot = n;
+
+	acquire(&rnd.lock);
+	memmove(key, rnd.key, sizeof(key));
+	chacha20(blk, key, 0);
+	memmove(rnd.key, blk, sizeof(rnd.key));
+	for (int i = 0; CPU_RDRAND && i < 8; i += 2) {
+		if (!hwrandom(&v, 0))
+			break;
+		rnd.key[i] ^= (uint32)v;
+		rnd.key[i + 1] ^= (uint32)(v >> 32);
+	}
+	release(&rnd.lock);
+
+	// The copy can fault, so make the output outside the lock,
+	// from the key it had.
+	for (uint64 ctr = 1; n > 0; ctr++, dst += m, n -= m) {
+		chacha20(blk, key, ctr);
+		m = n < sizeof(blk) ? n : sizeof(blk);
+		memmove(dst, blk, m);
+	}
+	memset(key, 0, sizeof(key));
+	memset(blk, 0, sizeof(blk));
+	return tot;
+}
+
+static int randomwrite(struct inode* ip, char* src, int n){
+	uint32 blk[16];
+	int m;
+
+	// A key's worth at a time, copied in first, as in read.
+	for (int i = 0; i < n; i += m) {
+		m = n - i < sizeof(rnd.key) ? n - i : sizeof(rnd.key);
+		memset(blk, 0, sizeof(blk));
+		memmove(blk, src + i, m);
+		acquire(&rnd.lock);
+		for (int j = 0; j < 8; j++)
+			blk[j] ^= rnd.key[j];
+		chacha20(blk, blk, 0);
+		memmove(rnd.key, blk, sizeof(rnd.key));
+		release(&rnd.lock);
+	}
+	memset(blk, 0, sizeof(blk));
+	return n;
+}
+
+void randominit(void){
+	uint64 v;
+
+	initlock(&rnd.lock, "random");
+	for (int i = 0; i < 8; i += 2) {
+		if (!(CPU_RDSEED && hwrandom(&v, 1)) && !(CPU_RDRAND && hwrandom(&v, 0)))
+			v = rdtsc() * 0x9e3779b97f4a7c15ull; // all there is
+		rnd.key[i] ^= (uint32)v;
+		rnd.key[i + 1] ^= (uint32)(v >> 32);
+	}
+	devsw[ZERO0].read = zeroread;
+	devsw[ZERO0].write = zerowrite;
+	devsw[RANDOM0].read = randomread;
+	devsw[RANDOM0].write = randomwrite;
+}
@@ -0,0 +1,105 @@
+// Memory reclaim.
+//
+// The caches that grow to fill free memory, the buffer cache,
+// the page cache and the shared text pages, each register a
+// shrinker, which frees up to a given number of pages that nobody
+// is using and says how many it freed. Shrinkers are called from
+// inside kalloc(), with whatever locks its caller holds, so they
+// must not sleep or allocate, and must skip a cache whose lock
+// the calling cpu already holds.
+//
+// Two things call them. kalloc(), when it finds no free page,
+// shrinks by a batch and tries again (direct reclaim). And the
+// kswapd thread looks at free memory every KSWAPD_INTERVAL
+// ticks; once it is below the low watermark it shrinks the caches
+// until it is back above the high one, so that allocations in
+// a burst mostly don't have to. If the caches run dry first, it
+// writes cold user pages out to swap (swap.c), counting pages
+// still being written as free.
+//
+// When neither the caches nor swap have anything left to give,
+// oomkill() in proc.c picks a process to kill.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "ktimer.h"
+#include "shrinker.h"
+#include "kernel/string.h"
+
+#define KSWAPD_INTERVAL (HZ / 10)  // ticks between looks at free memory
+#define KSWAPD_BATCH    64         // pages asked of the shrinkers at a time
+#define MEMLOW_PCT      2          // of memory: below this, kswapd reclaims
+#define MEMHIGH_PCT     4          // up to this
+
+static struct {
+	struct shrinker* head;
+	uint low, high;       // watermarks, in free pages
+	uint64 direct;        // pages freed by kalloc() failing
+	uint64 background;    // pages freed by kswapd
+} reclaim;
+
+// Add s to the shrinkers. At boot, before other cpus can be
+// allocating: the list is walked without a lock.
+void register_shrinker(struct shrinker* s){
+	s->next = reclaim.head;
+	reclaim.head = s;
+}
+
+static int shrinkall(int n){
+	int freed = 0;
+
+	for (struct shrinker* s = reclaim.head; s != 0 && freed < n; s = s->next)
+		freed += s->shrink(n - freed);
+	return freed;
+}
+
+// kalloc() is out of pages: free up to n. Returns the number freed.
+int shrink(int n){
+	int freed = shrinkall(n);
+
+	__atomic_fetch_add(&reclaim.direct, freed, __ATOMIC_RELAXED);
+	return freed;
+}
+
+static void kswapd(void* arg){
+	struct ktimer t;
+	uint free;
+	int want, freed;
+
+	memset(&t, 0, sizeof(t));
+	for (;;) {
+		acquire(&tickslock);
+		ktimerset(&t, ticks + KSWAPD_INTERVAL, wakeup, &t);
+		sleep(&t, &tickslock);
+		release(&tickslock);
+
+		if (kmemfree() >= reclaim.low)
+			continue;
+		while ((free = kmemfree() + swapbusy()) < reclaim.high) {
+			want = reclaim.high - free < KSWAPD_BATCH ? reclaim.high - free : KSWAPD_BATCH;
+			if ((freed = shrinkall(want)) == 0 && (freed = swapout(want)) == 0)
+				break;
+			__atomic_fetch_add(&reclaim.background, freed, __ATOMIC_RELAXED);
+			cond_resched();
+		}
+	}
+}
+
+// Set the watermarks and start kswapd. After kinit2().
+void reclaiminit(void){
+	reclaim.low = kmemtotal() / 100 * MEMLOW_PCT;
+	reclaim.high = kmemtotal() / 100 * MEMHIGH_PCT;
+	if (kthread("kswapd", kswapd, 0) < 0)
+		panic("reclaiminit");
+}
+
+// Print what reclaim has done. For debugging; runs from procdump
+// without locks.
+void reclaimstats(void){
+	cprintf("reclaim: %d free, watermarks %d/%d, %d pages direct, %d background\n",
+	        kmemfree(), reclaim.low, reclaim.high, (uint)reclaim.direct, (uint)reclaim.background);
+}
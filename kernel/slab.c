@@ -0,0 +1,139 @@
+// Slab allocator for fixed-size kernel objects.
+//
+// Each cache hands out objects carved from whole pages obtained
+// with kalloc(). Free objects are kept on a short per-cpu list
+// first, and overflow to a shared list in batches, so allocation
+// and free are O(1) and usually avoid the cache lock. Pages are
+// never returned to kalloc.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "kernel/string.h"
+
+static struct {
+	struct spinlock lock;
+	struct kmem_cache cache[NSLABCACHE];
+	int n;
+} slabs;
+
+static int slabsinit = 0;
+
+// Create a cache of objects of the given size. ctor, if not 0,
+// is run on each object returned by kmem_cache_alloc().
+struct kmem_cache* kmem_cache_create(char* name, uint size, void (*ctor)(void*)){
+	struct kmem_cache* c;
+
+	if (!slabsinit) {
+		initlock(&slabs.lock, "slabs");
+		slabsinit = 1;
+	}
+	size = (size + 7) & ~7;
+	if (size < sizeof(struct slabobj))
+		size = sizeof(struct slabobj);
+	if (size > PGSIZE)
+		panic("kmem_cache_create: object too large");
+
+	acquire(&slabs.lock);
+	if (slabs.n == NSLABCACHE)
+		panic("kmem_cache_create: too many caches");
+	c = &slabs.cache[slabs.n++];
+	release(&slabs.lock);
+
+	initlock(&c->lock, name);
+	c->name = name;
+	c->objsize = size;
+	c->perslab = PGSIZE / size;
+	c->ctor = ctor;
+	return c;
+}
+
+// Carve a fresh page into objects on the shared freelist.
+// Caller must hold c->lock, which is let go around kalloc():
+// running short, it calls shrinkers, which may free objects
+// of this cache.
+static int cachegrow(struct kmem_cache* c){
+	char* page;
+
+	release(&c->lock);
+	page = kalloc();
+	acquire(&c->lock);
+	if (page == 0)
+		return 0;
+	for (uint i = 0; i < c->perslab; i++) {
+		struct slabobj* o = (struct slabobj*)(page + i * c->objsize);
+		o->next = c->freelist;
+		c->freelist = o;
+	}
+	c->nslabs++;
+	c->nfree += c->perslab;
+	return 1;
+}
+
+// Allocate an object. Returns 0 if out of memory.
+void* kmem_cache_alloc(struct kmem_cache* c){
+	struct slabobj* o;
+
+	pushcli();
+	int id = cpu->id;
+	if (c->cpu[id].freelist == 0) {
+		acquire(&c->lock);
+		if (c->freelist == 0)
+			cachegrow(c);
+		while (c->cpu[id].count < SLAB_CPU_BATCH && (o = c->freelist) != 0) {
+			c->freelist = o->next;
+			c->nfree--;
+			o->next = c->cpu[id].freelist;
+			c->cpu[id].freelist = o;
+			c->cpu[id].count++;
+		}
+		release(&c->lock);
+	}
+	if ((o = c->cpu[id].freelist) != 0) {
+		c->cpu[id].freelist = o->next;
+		c->cpu[id].count--;
+	}
+	popcli();
+
+	if (o && c->ctor)
+		c->ctor(o);
+	return o;
+}
+
+// Return an object to its cache.
+void kmem_cache_free(struct kmem_cache* c, void* v){
+	struct slabobj* o = (struct slabobj*)v;
+
+	pushcli();
+	int id = cpu->id;
+	o->next = c->cpu[id].freelist;
+	c->cpu[id].freelist = o;
+	if (++c->cpu[id].count > SLAB_CPU_MAX) {
+		acquire(&c->lock);
+		while (c->cpu[id].count > SLAB_CPU_BATCH) {
+			o = c->cpu[id].freelist;
+			c->cpu[id].freelist = o->next;
+			c->cpu[id].count--;
+			o->next = c->freelist;
+			c->freelist = o;
+			c->nfree++;
+		}
+		release(&c->lock);
+	}
+	popcli();
+}
+
+// Print object cache usage. For debugging;
+// runs from procdump without locks.
+void slabstats(void){
+	for (int i = 0; i < slabs.n; i++) {
+		struct kmem_cache* c = &slabs.cache[i];
+		cprintf("slab %s: %d bytes, %d pages, %d free\n",
+		        c->name, c->objsize, c->nslabs, c->nfree);
+	}
+}
@@ -0,0 +1,101 @@
+// Sleeping reader-writer locks.
+//
+// Shared holders only read what the lock protects, so readers
+// of the same hot inode or block go in parallel. A waiting
+// writer stops new readers from getting in so it isn't starved.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "sleeplock.h"
+
+void initsleeplock(struct sleeplock* sl, char* name){
+	initlock(&sl->lk, name);
+	sl->readers = 0;
+	sl->writer = 0;
+	sl->wantw = 0;
+	sl->owner = 0;
+}
+
+// Acquire sl exclusively.
+void acquiresleep(struct sleeplock* sl){
+	acquire(&sl->lk);
+	sl->wantw++;
+	while (sl->writer || sl->readers)
+		sleep(sl, &sl->lk);
+	sl->wantw--;
+	sl->writer = 1;
+	sl->owner = proc;
+	release(&sl->lk);
+}
+
+// Acquire sl exclusively if nobody holds or is waiting for it.
+// Returns 1 if acquired, 0 if not.
+int tryacquiresleep(struct sleeplock* sl){
+	int r = 0;
+
+	acquire(&sl->lk);
+	if (!sl->writer && !sl->readers && !sl->wantw) {
+		sl->writer = 1;
+		sl->owner = proc;
+		r = 1;
+	}
+	release(&sl->lk);
+	return r;
+}
+
+// Acquire sl shared with other readers.
+void acquiresleepshared(struct sleeplock* sl){
+	acquire(&sl->lk);
+	while (sl->writer || sl->wantw)
+		sleep(sl, &sl->lk);
+	sl->readers++;
+	release(&sl->lk);
+}
+
+// Release sl, whichever way it is held.
+void releasesleep(struct sleeplock* sl){
+	acquire(&sl->lk);
+	if (sl->writer) {
+		sl->writer = 0;
+		sl->owner = 0;
+	} else if (sl->readers > 0) {
+		sl->readers--;
+	} else {
+		panic("releasesleep");
+	}
+	if (sl->readers == 0)
+		wakeup(sl);
+	release(&sl->lk);
+}
+
+// Turn an exclusive hold into a shared one without letting
+// another writer in between.
+void downgradesleep(struct sleeplock* sl){
+	acquire(&sl->lk);
+	if (!sl->writer || sl->owner != proc)
+		panic("downgradesleep");
+	sl->writer = 0;
+	sl->owner = 0;
+	sl->readers = 1;
+	wakeup(sl);
+	release(&sl->lk);
+}
+
+// Does this process hold sl exclusively?
+int holdingsleep(struct sleeplock* sl){
+	int r;
+
+	acquire(&sl->lk);
+	r = sl->writer && sl->owner == proc;
+	release(&sl->lk);
+	return r;
+}
+
+// Is sl held at all, by anyone?
+int sleeplocked(struct sleeplock* sl){
+	return sl->writer || sl->readers;
+}
@@ -0,0 +1,58 @@
+// Interrupt bottom halves.
+//
+// A device's interrupt handler (the top half) does only what the
+// hardware needs done at once, with interrupts off: acknowledge
+// it, take the data, start the next request. Whatever can wait a
+// moment, such as waking processes or editing console input, it
+// leaves for a bottom half, by raise_softirq(). The bottom halves
+// pending on a cpu run as trap() returns from the last interrupt
+// on it, after the EOI and with interrupts back on, so more
+// interrupts are taken while they run.
+//
+// Bottom halves run on the cpu that raised them. They must not
+// sleep, and not expect proc to be anything in particular; the
+// same one may be running on two cpus at once. Interrupts that
+// come in while they run don't run bottom halves themselves, or
+// preempt the process: the loop here picks up what they raise.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "irq.h"
+
+#define SOFTIRQ_RESTART 10   // rounds before leaving the rest for later
+
+static void (*handlers[NSOFTIRQ])(void);
+
+// Run fn as bottom half n. At init time.
+void open_softirq(int n, void (*fn)(void)){
+	handlers[n] = fn;
+}
+
+// Have bottom half n run on this cpu. Interrupts must be off.
+void raise_softirq(int n){
+	cpu->softirqs |= 1 << n;
+}
+
+// Run the pending bottom halves, if this is not an interrupt of
+// one of them or of code holding a spinlock. Called from trap()
+// with interrupts off.
+void softirq(void){
+	uint pending;
+
+	if (cpu->softirqs == 0 || cpu->insoftirq || cpu->ncli > 0)
+		return;
+	cpu->insoftirq = 1;
+	for (int i = 0; i < SOFTIRQ_RESTART && (pending = cpu->softirqs) != 0; i++) {
+		cpu->softirqs = 0;
+		amd64_sti();
+		for (int n = 0; n < NSOFTIRQ; n++)
+			if ((pending & (1 << n)) && handlers[n])
+				handlers[n]();
+		amd64_cli();
+	}
+	cpu->insoftirq = 0;
+}
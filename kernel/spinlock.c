@@ -1,4 +1,9 @@
 // Mutual exclusion spin locks.
+//
+// Ticket locks: waiters are served in arrival order, and
+// each spins reading the lock's line rather than writing it,
+// so the line is only pulled away on a handoff. Every lock is
+// counted in a lockstat entry shared by all locks of its name.
 
 #include "types.h"
 #include "defs.h"
@@ -8,12 +13,46 @@
 #include "mmu.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "kernel/string.h"
+
+#define NLOCKSTAT 64
+
+// Updated without atomics by whoever holds a lock of that
+// name, so counts from same-named locks on other cpus can race
+// and are only approximate.
+static struct lockstat lockstats[NLOCKSTAT];
+static volatile uint lockstatbusy;
+
+// Find or make the stats entry for name. initlock() runs
+// before interrupts and cpus are set up, so guard the table
+// with a bare xchg flag rather than a spinlock.
+static struct lockstat* lockstatof(char* name){
+	struct lockstat* s, * free = 0;
+
+	while (amd64_xchg(&lockstatbusy, 1) != 0)
+		amd64_pause();
+	for (s = lockstats; s < &lockstats[NLOCKSTAT]; s++) {
+		if (s->name[0] == 0) {
+			if (free == 0)
+				free = s;
+		} else if (strncmp(s->name, name, LOCKSTAT_NAME - 1) == 0) {
+			free = s;
+			goto out;
+		}
+	}
+	if ((s = free) != 0)
+		safestrcpy(s->name, name, LOCKSTAT_NAME);
+out:
+	amd64_xchg(&lockstatbusy, 0);
+	return free;
+}
 
 void initlock(struct spinlock* lk, char* name){
 	lk->name = name;
-	lk->locked = 0;
+	lk->ticket = 0;
 	lk->cpu = 0;
 	lk->sig = SPINLOCK_SIG;
+	lk->stat = lockstatof(name);
 }
 
 
@@ -25,10 +64,14 @@ void acquire(struct spinlock* lk){
 }
 
 // Acquire the lock.
-// Loops (spins) until the lock is acquired.
+// Loops (spins) until the lock is acquired, or for at
+// most wait ticks.
 // Holding a lock for a long time may cause
 // other CPUs to waste time spinning to acquire it.
 uint8 sacquire(struct spinlock* lk, uint32 wait){
+	uint64 spins = 0;
+	uint t;
+
 	pushcli(); // disable interrupts to avoid deadlock.
 	if (holding(lk)) {
 		int i;
@@ -38,20 +81,51 @@ uint8 sacquire(struct spinlock* lk, uint32 wait){
 		cprintf("\n");
 		panic("acquire: already holding lock");
 	}
-	// The amd64_xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it.
-	uint32 startticks = ticks;
-	while (amd64_xchg(&lk->locked, 1) != 0) {
-		uint32 delta = ticks - startticks;
-		if(delta > wait){
-			return SPINLOCK_NOT_ACQUIRED;
+	cpu->spinning = lk;
+	if (wait == UINT32_MAX) {
+		// The locked xadd is atomic and serializes, so reads
+		// after acquire are not reordered before it.
+		ushort me = amd64_xadd16(&lk->next, 1);
+		while (lk->owner != me) {
+			amd64_pause();
+			spins++;
+		}
+	} else {
+		// A timed waiter can't hand its ticket back, so it only
+		// takes one when the lock is free.
+		uint32 startticks = ticks;
+		for (;;) {
+			t = lk->ticket;
+			if ((t & 0xFFFF) == (t >> 16) && amd64_cmpxchg(&lk->ticket, t, t + 0x10000) == t)
+				break;
+			amd64_pause();
+			spins++;
+			if (ticks - startticks > wait) {
+				cpu->spinning = 0;
+				popcli();
+				return SPINLOCK_NOT_ACQUIRED;
+			}
 		}
 	}
+	// Keep the compiler from hoisting the critical section
+	// above the spin.
+	__asm__ volatile("" ::: "memory");
+	cpu->spinning = 0;
 
 	// Record info about lock acquisition for debugging.
 	lk->cpu = cpu;
+	if (cpu->nheld < NHELD)
+		cpu->held[cpu->nheld] = lk;
+	cpu->nheld++;
 	getcallerpcs(&lk, lk->pcs);
+	if (lk->stat) {
+		lk->stat->acquires++;
+		if (spins) {
+			lk->stat->contended++;
+			lk->stat->spins += spins;
+		}
+		lk->start = rdtsc();
+	}
 	return SPINLOCK_ACQUIRED;
 }
 
@@ -60,19 +134,30 @@ void release(struct spinlock* lk){
 	if (!holding(lk))
 		panic("release");
 
+	if (lk->stat) {
+		uint64 held = rdtsc() - lk->start;
+		if (held > lk->stat->maxhold)
+			lk->stat->maxhold = held;
+	}
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
+	// Locks needn't go in the order they came.
+	for (int i = (cpu->nheld < NHELD ? cpu->nheld : NHELD) - 1; i >= 0; i--) {
+		if (cpu->held[i] == lk) {
+			for (; i + 1 < cpu->nheld && i + 1 < NHELD; i++)
+				cpu->held[i] = cpu->held[i + 1];
+			break;
+		}
+	}
+	cpu->nheld--;
 
-	// The amd64_xchg serializes, so that reads before release are
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
-	// The amd64_xchg being asm volatile ensures gcc emits it after
-	// the above assignments (and after the critical section).
-	amd64_xchg(&lk->locked, 0);
+	// Hand the lock to the next ticket. The 2007 Intel 64
+	// Architecture Memory Ordering White Paper says Intel 64
+	// and IA-32 will not move a load after a store, so a plain
+	// store is enough once the compiler barrier keeps gcc from
+	// sinking the critical section below it.
+	__asm__ volatile("" ::: "memory");
+	lk->owner++;
 
 	popcli();
 }
@@ -89,7 +174,7 @@ void getstackpcs(uintp* ebp, uintp pcs[]){
 	int i;
 
 	for (i = 0; i < 10; i++) {
-		if (ebp == 0 || ebp < (uintp*)KERNBASE || ebp == (uintp*)0xffffffff)
+		if (ebp == 0 || ebp < (uintp*)DIRECTBASE || ebp == (uintp*)0xffffffff)
 			break;
 		pcs[i] = ebp[1]; // saved %eip
 		ebp = (uintp*)ebp[0]; // saved %ebp
@@ -103,7 +188,22 @@ int holding(struct spinlock* lock){
 	if(lock->sig != SPINLOCK_SIG) {
 		panic("*lock is not a lock\n");
 	}
-	return lock->locked && lock->cpu == cpu;
+	return lock->owner != lock->next && lock->cpu == cpu;
+}
+
+// Copy up to n stats entries into out, with hold times in ns.
+// Returns the number copied.
+int lockstatcopy(struct lockstat* out, int n){
+	int i, k = 0;
+
+	for (i = 0; i < NLOCKSTAT && k < n; i++) {
+		if (lockstats[i].name[0] == 0)
+			continue;
+		out[k] = lockstats[i];
+		out[k].maxhold = tsc2ns(out[k].maxhold);
+		k++;
+	}
+	return k;
 }
 
 // Pushcli/popcli are like cli/sti except that they are matched:
@@ -0,0 +1,307 @@
+// Swap.
+//
+// A SATA disk whose first sector holds a swap header (swap.h; make
+// one with tools/mkswap.c) is backing store for user memory. Xv64
+// doesn't partition disks, so swap has a disk to itself, as the
+// root file system does. Slot s is the disk's page s + 1.
+//
+// Pages go out when kswapd has shrunk the caches and memory is
+// still below the low watermark (see reclaim.c), and before
+// oomkill() kills anyone. swapout() goes round the processes'
+// heaps and stacks, the pages below sz, like a clock: each address
+// space remembers in swaphand where it got to. A private, writable
+// page with its accessed bit set has the bit cleared and is passed
+// over; one whose bit is still clear the next time round is cold,
+// and goes out. Accessed bits are cleared without flushing the
+// TLB, so a page some cpu still has cached can look cold a little
+// early, which is harmless.
+//
+// Going out, the page's PTE becomes a swap entry: not present,
+// PTE_SWAP, and the slot where the address was. Once every cpu
+// has dropped the old translation the page is queued to be
+// written through blkq.c, without waiting. Until the write is done
+// it stays in the slot's swap cache entry, and a fault on the slot
+// takes it back from there rather than from the disk; then it is
+// freed. pagein() brings swapped pages back. fork() shares swap
+// entries as it does pages, so slots count their references.
+//
+// mmap() regions, huge pages and pages that are shared, copy-on-
+// write or with the kernel, are never swapped.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "buf.h"
+#include "ahci.h"
+#include "slab.h"
+#include "swap.h"
+#include "kernel/string.h"
+
+#define SWAP_SECT     (PGSIZE / SECTOR_SIZE)
+#define SWAP_MAXPAGES 65536  // slots used at most, 256 MB
+#define SWAP_SCAN     1024   // PTEs looked at in an address space per visit
+#define SWAP_BATCH    32     // pages unmapped per TLB flush
+#define SWAP_MAXVM    16     // address spaces visited per swapout()
+
+extern uint64 ROOT_DEV;
+
+static struct {
+	struct spinlock lock;  // the slot tables and counters
+	uint dev;
+	uint nslots;           // 0 if there is no swap
+	ushort* ref;           // swap entries naming each slot
+	char** cache;          // page being written to each slot, or 0
+	uint hand;             // where swapalloc() looks next
+	uint used;             // slots with references
+	uint writing;          // writes not finished
+	uint64 outs;           // pages written
+	uint64 ins;            // pages read back
+	uint64 hits;           // faults met in the swap cache
+	struct kmem_cache* bufs;
+} swap;
+
+// Look for a swap disk, other than the root disk, and set up its
+// slot tables. After kinit2().
+void swapinit(void){
+	struct swaphdr* h;
+	uint16 pages;
+	char* page;
+	uint n;
+
+	initlock(&swap.lock, "swap");
+	if ((page = kalloc()) == 0)
+		return;
+	h = (struct swaphdr*)page;
+	for (n = 0; n < sata_device_count(); n++) {
+		if (TODEVNUM(DEV_SATA, n) == ROOT_DEV)
+			continue;
+		if (sata_read(n, 0, 1, (uint8*)page) == SATA_IO_SUCCESS &&
+		    memcmp(h->magic, SWAP_MAGIC, sizeof(h->magic)) == 0 && h->npages > 1)
+			break;
+	}
+	if (n == sata_device_count()) {
+		kfree(page);
+		return;
+	}
+	swap.dev = TODEVNUM(DEV_SATA, n);
+	swap.nslots = h->npages - 1 < SWAP_MAXPAGES ? h->npages - 1 : SWAP_MAXPAGES;
+	kfree(page);
+
+	pages = PGROUNDUP(swap.nslots * sizeof(char*)) / PGSIZE;
+	if ((swap.cache = (char**)kmalloc(pages)) == 0) {
+		swap.nslots = 0;
+		return;
+	}
+	memset(swap.cache, 0, pages * PGSIZE);
+	pages = PGROUNDUP(swap.nslots * sizeof(ushort)) / PGSIZE;
+	if ((swap.ref = (ushort*)kmalloc(pages)) == 0) {
+		swap.nslots = 0;
+		return;
+	}
+	memset(swap.ref, 0, pages * PGSIZE);
+	swap.bufs = kmem_cache_create("swapbuf", sizeof(struct buf), 0);
+	cprintf("swap: disk(%d, %d), %d pages\n", DEV_SATA, n, swap.nslots);
+}
+
+// Take a free slot for page, which is about to be written to it.
+// Returns the slot, or -1 if swap is full.
+static int swapalloc(char* page){
+	uint s;
+
+	acquire(&swap.lock);
+	for (uint i = 0; i < swap.nslots; i++) {
+		s = (swap.hand + i) % swap.nslots;
+		// Not one still being written, either: a second write
+		// to the slot could overtake the first.
+		if (swap.ref[s] == 0 && swap.cache[s] == 0) {
+			swap.ref[s] = 1;
+			swap.cache[s] = page;
+			swap.hand = s + 1;
+			swap.used++;
+			swap.writing++;
+			release(&swap.lock);
+			return s;
+		}
+	}
+	release(&swap.lock);
+	return -1;
+}
+
+// Another swap entry names pte's slot.
+void swapdup(pte_t pte){
+	acquire(&swap.lock);
+	swap.ref[SWAPSLOT(pte)]++;
+	release(&swap.lock);
+}
+
+// A swap entry naming this slot has gone.
+void swapfree(pte_t pte){
+	uint s = SWAPSLOT(pte);
+
+	acquire(&swap.lock);
+	if (swap.ref[s] == 0)
+		panic("swapfree");
+	if (--swap.ref[s] == 0)
+		swap.used--;
+	release(&swap.lock);
+}
+
+// Pages queued to be written out and not yet free.
+uint swapbusy(void){
+	return swap.writing;
+}
+
+// blkq.c is done writing b's page out.
+static void swapwritten(struct buf* b){
+	uint s = b->sector / SWAP_SECT - 1;
+	char* page;
+
+	acquire(&swap.lock);
+	page = swap.cache[s];
+	swap.cache[s] = 0;
+	swap.writing--;
+	swap.outs++;
+	release(&swap.lock);
+	kfree(page);
+	kmem_cache_free(swap.bufs, b);
+}
+
+// Visit vm: age up to SWAP_SCAN of its pages from where the last
+// visit stopped, and queue up to n of the cold ones to be written.
+// vm must not go away meanwhile. Returns the number queued.
+static int swapscan(struct vmspace* vm, int n){
+	struct buf* b[SWAP_BATCH];
+	char* page[SWAP_BATCH];
+	int slot[SWAP_BATCH];
+	int nb, k = 0, s;
+	pte_t* pte;
+	uintp a;
+
+	if (n > SWAP_BATCH)
+		n = SWAP_BATCH;
+	for (nb = 0; nb < n; nb++)
+		if ((b[nb] = kmem_cache_alloc(swap.bufs)) == 0)
+			break;
+
+	acquire(&vm->lock);
+	a = vm->swaphand;
+	for (int i = 0; i < SWAP_SCAN && k < nb && vm->sz > 0; i++, a += PGSIZE) {
+		if (a >= vm->sz)
+			a = 0;
+		if ((pte = walkpgdir(vm->pgdir, (char*)a, 0)) == 0) {
+			// skip to the last page this page table would map
+			a = (a & ~((uintp)NPTENTRIES * PGSIZE - 1)) + (NPTENTRIES - 1) * PGSIZE;
+			continue;
+		}
+		if ((*pte & (PTE_P | PTE_U | PTE_W | PTE_PS)) != (PTE_P | PTE_U | PTE_W))
+			continue;
+		if (krefcount(p2v(PTE_ADDR(*pte))) != 1)
+			continue;
+		if (*pte & PTE_A) {
+			*pte &= ~PTE_A;
+			continue;
+		}
+		if ((s = swapalloc(p2v(PTE_ADDR(*pte)))) < 0)
+			break;
+		page[k] = p2v(PTE_ADDR(*pte));
+		slot[k++] = s;
+		*pte = SWAPPTE(s);
+	}
+	vm->swaphand = a;
+	// The pages can't change once no cpu can reach them.
+	if (k > 0)
+		vmflush(vm);
+	release(&vm->lock);
+
+	for (int j = 0; j < nb; j++) {
+		if (j >= k) {
+			kmem_cache_free(swap.bufs, b[j]);
+			continue;
+		}
+		memset(b[j], 0, sizeof(*b[j]));
+		b[j]->flags = B_DIRTY;
+		b[j]->dev = swap.dev;
+		b[j]->sector = (slot[j] + 1) * SWAP_SECT;
+		b[j]->nsec = SWAP_SECT;
+		b[j]->data = (uint8*)page[j];
+		bsubmit(b[j], swapwritten);
+	}
+	return k;
+}
+
+// Queue up to n cold user pages to be written to swap. Returns
+// how many were; they are free once the writes finish.
+int swapout(int n){
+	struct vmspace* vms[SWAP_MAXVM];
+	int nvm, queued = 0;
+
+	if (swap.nslots == 0 || swap.used == swap.nslots)
+		return 0;
+	nvm = vmspacepin(vms, SWAP_MAXVM);
+	for (int i = 0; i < nvm; i++) {
+		if (queued < n)
+			queued += swapscan(vms[i], n - queued);
+		vmspacerelease(vms[i]);
+	}
+	return queued;
+}
+
+// Bring back the page at a in p, whose PTE *pte is a swap entry.
+// Must hold vmlock(p->vm). May sleep reading the disk. Returns 1
+// if the page is mapped now, -1 if out of memory.
+int swapin(struct proc* p, uintp a, pte_t* pte){
+	pte_t e = *pte;
+	uint s = SWAPSLOT(e);
+	char* mem = 0, * cached;
+	struct buf b;
+
+	acquire(&swap.lock);
+	if ((cached = swap.cache[s]) != 0) {
+		kref(cached);
+		swap.hits++;
+		// Still being written, and nobody else wants what is on
+		// the disk: it can just be mapped again.
+		if (swap.ref[s] == 1)
+			mem = cached;
+	}
+	release(&swap.lock);
+
+	if (mem == 0) {
+		if ((mem = kalloc()) == 0) {
+			if (cached)
+				kfree(cached);
+			return -1;
+		}
+		if (cached) {
+			memmove(mem, cached, PGSIZE);
+			kfree(cached);
+		} else {
+			memset(&b, 0, sizeof(b));
+			b.dev = swap.dev;
+			b.sector = (s + 1) * SWAP_SECT;
+			b.nsec = SWAP_SECT;
+			b.data = (uint8*)mem;
+			bsubmit(&b, 0);
+			bwait(&b);
+			__atomic_fetch_add(&swap.ins, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	acquire(&p->vm->lock);
+	*pte = v2p(mem) | PTE_P | PTE_W | PTE_U;
+	release(&p->vm->lock);
+	swapfree(e);
+	return 1;
+}
+
+// Print swap usage. For debugging; runs from procdump without locks.
+void swapstats(void){
+	if (swap.nslots == 0)
+		return;
+	cprintf("swap: %d/%d pages used, %d writing, %d out, %d in, %d cache hits\n",
+	        swap.used, swap.nslots, swap.writing, (uint)swap.outs, (uint)swap.ins, (uint)swap.hits);
+}
@@ -6,8 +6,12 @@
 #include "proc.h"
 #include "x86.h"
 #include "syscall.h"
+#include "syscallstat.h"
+#include "trace.h"
+#include "kernel/string.h"
 
-// User code makes a system call with INT T_SYSCALL.
+// User code makes a system call with SYSCALL (see syscallentry
+// in trapasm64.S) or INT T_SYSCALL.
 // System call number in %eax.
 // Arguments on the stack, from the user call to the C
 // library system call function. The saved user %esp points
@@ -15,17 +19,11 @@
 
 // Fetch the int at addr from the current process.
 int fetchint(uintp addr, int* ip){
-	if (addr >= proc->sz || addr + sizeof(int) > proc->sz)
-		return -1;
-	*ip = *(int*)(addr);
-	return 0;
+	return copy_from_user(ip, addr, sizeof(*ip));
 }
 
 int fetchuintp(uintp addr, uintp* ip){
-	if (addr >= proc->sz || addr + sizeof(uintp) > proc->sz)
-		return -1;
-	*ip = *(uintp*)(addr);
-	return 0;
+	return copy_from_user(ip, addr, sizeof(*ip));
 }
 
 // Fetch the nul-terminated string at addr from the current process.
@@ -34,10 +32,9 @@ int fetchuintp(uintp addr, uintp* ip){
 int fetchstr(uintp addr, char** pp){
 	char* s, * ep;
 
-	if (addr >= proc->sz)
+	if ((ep = (char*)uvmlimit(proc, addr)) == 0)
 		return -1;
 	*pp = (char*)addr;
-	ep = (char*)proc->sz;
 	for (s = *pp; s < ep; s++)
 		if (*s == 0)
 			return s - *pp;
@@ -81,7 +78,24 @@ int argptr(int n, char** pp, int size){
 
 	if (arguintp(n, &i) < 0)
 		return -1;
-	if (i >= proc->sz || i + size > proc->sz)
+	if (size < 0 || i + size > uvmlimit(proc, i))
+		return -1;
+	// The caller may touch the buffer with locks held.
+	if (pageinrange(proc, i, size) < 0)
+		return -1;
+	*pp = (char*)i;
+	return 0;
+}
+
+// argptr() for a buffer that will only be reached through
+// copy_from_user()/copy_to_user() or copyuser(), so it is enough
+// that it is below USERTOP: faults are taken as they come.
+int arguptr(int n, char** pp, int size){
+	uintp i;
+
+	if (arguintp(n, &i) < 0)
+		return -1;
+	if (size < 0 || i + size < i || i + size > USERTOP)
 		return -1;
 	*pp = (char*)i;
 	return 0;
@@ -113,7 +127,7 @@ extern int sys_mknod(void);
 extern int sys_open(void);
 extern int sys_pipe(void);
 extern int sys_read(void);
-extern int sys_sbrk(void);
+extern uintp sys_sbrk(void);
 extern int sys_sleep(void);
 extern int sys_unlink(void);
 extern int sys_wait(void);
@@ -137,6 +151,49 @@ extern int sys_nprocs(void);
 extern int sys_cpuhalt(void);
 extern int sys_getpriority(void);
 extern int sys_setpriority(void);
+extern uintp sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_hugepages(void);
+extern int sys_clock_gettime(void);
+extern int sys_sched_setaffinity(void);
+extern int sys_sched_getaffinity(void);
+extern int sys_cpureserve(void);
+extern int sys_clone(void);
+extern int sys_futex(void);
+extern int sys_lockstat(void);
+extern int sys_bcachestat(void);
+extern int sys_sync(void);
+extern int sys_fsync(void);
+extern int sys_mount(void);
+extern int sys_pread(void);
+extern int sys_pwrite(void);
+extern int sys_readv(void);
+extern int sys_writev(void);
+extern int sys_sendfile(void);
+extern int sys_getdents(void);
+extern int sys_pipe2(void);
+extern int sys_fcntl(void);
+extern int sys_poll(void);
+extern int sys_epoll_create(void);
+extern int sys_epoll_ctl(void);
+extern int sys_epoll_wait(void);
+extern int sys_kringwait(void);
+extern int sys_kringnotify(void);
+extern int sys_ipc_call(void);
+extern int sys_ipc_reply_wait(void);
+extern int sys_uring_enter(void);
+extern int sys_syscallstat(void);
+extern int sys_klogread(void);
+extern int sys_spawn(void);
+extern int sys__exit(void);
+extern int sys_waitpid(void);
+extern int sys_irqaffinity(void);
+extern int sys_perfctl(void);
+extern int sys_perfread(void);
+extern int sys_getrusage(void);
+extern uintp sys_uring_setup(void);
+extern uintp sys_kringmap(void);
+extern uintp sys_netrecv(void);
 
 static int (*syscalls[])(void) = {
 	[SYS_fork]          sys_fork,
@@ -150,7 +207,6 @@ static int (*syscalls[])(void) = {
 	[SYS_chdir]         sys_chdir,
 	[SYS_dup]           sys_dup,
 	[SYS_getpid]        sys_getpid,
-	[SYS_sbrk]          sys_sbrk,
 	[SYS_sleep]         sys_sleep,
 	[SYS_amblessed]     sys_amblessed,
 	[SYS_open]          sys_open,
@@ -178,18 +234,132 @@ static int (*syscalls[])(void) = {
 	[SYS_cpuhalt]       sys_cpuhalt,
 	[SYS_getpriority]   sys_getpriority,
 	[SYS_setpriority]   sys_setpriority,
+	[SYS_munmap]        sys_munmap,
+	[SYS_hugepages]     sys_hugepages,
+	[SYS_clock_gettime] sys_clock_gettime,
+	[SYS_sched_setaffinity] sys_sched_setaffinity,
+	[SYS_sched_getaffinity] sys_sched_getaffinity,
+	[SYS_cpureserve]    sys_cpureserve,
+	[SYS_clone]         sys_clone,
+	[SYS_futex]         sys_futex,
+	[SYS_lockstat]      sys_lockstat,
+	[SYS_bcachestat]    sys_bcachestat,
+	[SYS_sync]          sys_sync,
+	[SYS_fsync]         sys_fsync,
+	[SYS_mount]         sys_mount,
+	[SYS_pread]         sys_pread,
+	[SYS_pwrite]        sys_pwrite,
+	[SYS_readv]         sys_readv,
+	[SYS_writev]        sys_writev,
+	[SYS_sendfile]      sys_sendfile,
+	[SYS_getdents]      sys_getdents,
+	[SYS_pipe2]         sys_pipe2,
+	[SYS_fcntl]         sys_fcntl,
+	[SYS_poll]          sys_poll,
+	[SYS_epoll_create]  sys_epoll_create,
+	[SYS_epoll_ctl]     sys_epoll_ctl,
+	[SYS_epoll_wait]    sys_epoll_wait,
+	[SYS_kringwait]     sys_kringwait,
+	[SYS_kringnotify]   sys_kringnotify,
+	[SYS_ipc_call]      sys_ipc_call,
+	[SYS_ipc_reply_wait] sys_ipc_reply_wait,
+	[SYS_uring_enter]   sys_uring_enter,
+	[SYS_syscallstat]   sys_syscallstat,
+	[SYS_klogread]      sys_klogread,
+	[SYS_spawn]         sys_spawn,
+	[SYS__exit]         sys__exit,
+	[SYS_waitpid]       sys_waitpid,
+	[SYS_irqaffinity]   sys_irqaffinity,
+	[SYS_perfctl]       sys_perfctl,
+	[SYS_perfread]      sys_perfread,
+	[SYS_getrusage]     sys_getrusage,
+};
+
+// System calls that return user addresses, which
+// do not fit in an int.
+static uintp (*syscalls64[])(void) = {
+	[SYS_sbrk]          sys_sbrk,
+	[SYS_mmap]          sys_mmap,
+	[SYS_kringmap]      sys_kringmap,
+	[SYS_uring_setup]   sys_uring_setup,
+	[SYS_netrecv]       sys_netrecv,
 };
 
+// Each cpu's statistics, indexed by system call number. The
+// cpu counts with interrupts off, so needs no lock; readers and
+// resets from elsewhere may see a call half-counted.
+static struct syscallstat* syscallstats[NCPU];
+
+#define STATPAGES (PGROUNDUP(NSYSCALLSTAT * sizeof(struct syscallstat)) / PGSIZE)
+
+// Once the cpus are up and kmalloc() works. Cpus left without
+// statistics just don't count.
+void syscallinit(void){
+	for (int i = 0; i < ncpu; i++)
+		if ((syscallstats[i] = (struct syscallstat*)kmalloc(STATPAGES)) != 0)
+			memset(syscallstats[i], 0, STATPAGES * PGSIZE);
+}
+
+static void syscallcount(int num, uint64 cycles){
+	struct syscallstat* s;
+	int b;
+
+	pushcli();
+	if (num < NSYSCALLSTAT && (s = syscallstats[cpu->id]) != 0) {
+		s += num;
+		s->count++;
+		s->cycles += cycles;
+		b = cycles ? 63 - __builtin_clzll(cycles) : 0;
+		s->hist[b < SYSCALLSTAT_NHIST ? b : SYSCALLSTAT_NHIST - 1]++;
+	}
+	popcli();
+}
+
+// Copy the statistics of system calls 0..n-1 on cpu c, or summed
+// over all cpus if c is -1, to out, then zero them if reset is
+// set. Returns the number of entries copied.
+int syscallstatcopy(int c, struct syscallstat* out, int n, int reset){
+	struct syscallstat* s;
+
+	if (c < -1 || c >= ncpu || n < 0)
+		return -1;
+	if (n > NSYSCALLSTAT)
+		n = NSYSCALLSTAT;
+	memset(out, 0, n * sizeof(*out));
+	for (int i = 0; i < ncpu; i++) {
+		if ((c >= 0 && i != c) || (s = syscallstats[i]) == 0)
+			continue;
+		for (int k = 0; k < n; k++) {
+			out[k].count += s[k].count;
+			out[k].cycles += s[k].cycles;
+			for (int b = 0; b < SYSCALLSTAT_NHIST; b++)
+				out[k].hist[b] += s[k].hist[b];
+		}
+		if (reset)
+			memset(s, 0, NSYSCALLSTAT * sizeof(*s));
+	}
+	return n;
+}
+
 void syscall(void){
+	uint64 t0 = rdtsc();
 	int num;
 
 	num = proc->tf->eax;
-	if (num > 0 && num < NELEM(syscalls) && syscalls[num]) {
+	proc->nsyscall++;
+	TRACE(TRACE_SYSENTER, num, 0);
+	if (num > 0 && num < NELEM(syscalls64) && syscalls64[num]) {
+		proc->lastsyscall = num;
+		proc->tf->eax = syscalls64[num]();
+	} else if (num > 0 && num < NELEM(syscalls) && syscalls[num]) {
 		proc->lastsyscall = num;
 		proc->tf->eax = syscalls[num]();
 	} else {
 		cprintf("%d %s: unknown sys call %d\n",
 		        proc->pid, proc->name, num);
 		proc->tf->eax = -1;
+		return;
 	}
+	TRACE(TRACE_SYSEXIT, num, proc->tf->eax);
+	syscallcount(num, rdtsc() - t0);
 }
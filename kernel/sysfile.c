@@ -10,9 +10,17 @@
 #include "stat.h"
 #include "mmu.h"
 #include "proc.h"
+#include "vfs.h"
 #include "fs/fs1.h"
+#include "fs/tmpfs.h"
+#include "fs/procfs.h"
 #include "file.h"
+#include "buf.h"
 #include "fcntl.h"
+#include "uio.h"
+#include "dirent.h"
+#include "poll.h"
+#include "epoll.h"
 #include "kernel/string.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
@@ -23,7 +31,7 @@ static int argfd(int n, int* pfd, struct file** pf){
 
 	if (argint(n, &fd) < 0)
 		return -1;
-	if (fd < 0 || fd >= NOFILE || (f = proc->ofile[fd]) == 0)
+	if (fd < 0 || fd >= NOFILE || (f = proc->files->ofile[fd]) == 0)
 		return -1;
 	if (pfd)
 		*pfd = fd;
@@ -37,12 +45,15 @@ static int argfd(int n, int* pfd, struct file** pf){
 static int fdalloc(struct file* f){
 	int fd;
 
+	acquire(&proc->files->lock);
 	for (fd = 0; fd < NOFILE; fd++) {
-		if (proc->ofile[fd] == 0) {
-			proc->ofile[fd] = f;
+		if (proc->files->ofile[fd] == 0) {
+			proc->files->ofile[fd] = f;
+			release(&proc->files->lock);
 			return fd;
 		}
 	}
+	release(&proc->files->lock);
 	return -1;
 }
 
@@ -58,16 +69,178 @@ int sys_dup(void){
 	return fd;
 }
 
+// Pipes copy with copyuser() and fault user pages in themselves;
+// everything else may touch the buffer with locks held, so gets
+// it faulted in up front by argptr().
+static int argbuf(struct file* f, int n, char** pp, int size){
+	if (f->type == FD_PIPE)
+		return arguptr(n, pp, size);
+	return argptr(n, pp, size);
+}
+
 int sys_read(void){
 	struct file* f;
 	int n;
 	char* p;
 
-	if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+	if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argbuf(f, 1, &p, n) < 0)
 		return -1;
 	return fileread(f, p, n);
 }
 
+int sys_pread(void){
+	struct file* f;
+	int n, off;
+	char* p;
+
+	if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0 ||
+	    argint(3, &off) < 0 || off < 0)
+		return -1;
+	return filepread(f, p, n, off);
+}
+
+int sys_pwrite(void){
+	struct file* f;
+	int n, off;
+	char* p;
+
+	if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0 ||
+	    argint(3, &off) < 0 || off < 0)
+		return -1;
+	return filepwrite(f, p, n, off);
+}
+
+// Fetch the vector of cnt buffers for readv() and writev().
+static int argiov(int n, struct iovec** iov, int cnt){
+	if (cnt < 0 || cnt > IOV_MAX)
+		return -1;
+	return argptr(n, (char**)iov, cnt * sizeof(struct iovec));
+}
+
+// Check that the buffer v lies in the process's memory, as
+// argptr() does. v must be a copy, so that another thread
+// can't change it after it's checked.
+static int iovcheck(struct iovec* v){
+	uintp base = (uintp)v->iov_base;
+
+	if (v->iov_len > 0x7FFFFFFF || base + v->iov_len > uvmlimit(proc, base))
+		return -1;
+	return pageinrange(proc, base, v->iov_len);
+}
+
+// Read into each buffer in turn, stopping at a short read.
+int sys_readv(void){
+	struct file* f;
+	struct iovec* iov, v;
+	int cnt, r, tot = 0;
+
+	if (argfd(0, 0, &f) < 0 || argint(2, &cnt) < 0 || argiov(1, &iov, cnt) < 0)
+		return -1;
+	for (int i = 0; i < cnt; i++) {
+		v = iov[i];
+		if (iovcheck(&v) < 0 || (r = fileread(f, v.iov_base, v.iov_len)) < 0)
+			return tot > 0 ? tot : -1;
+		tot += r;
+		if (r < v.iov_len)
+			break;
+	}
+	return tot;
+}
+
+// Write each buffer in turn, stopping at a short write.
+int sys_writev(void){
+	struct file* f;
+	struct iovec* iov, v;
+	int cnt, r, tot = 0;
+
+	if (argfd(0, 0, &f) < 0 || argint(2, &cnt) < 0 || argiov(1, &iov, cnt) < 0)
+		return -1;
+	for (int i = 0; i < cnt; i++) {
+		v = iov[i];
+		if (iovcheck(&v) < 0 || (r = filewrite(f, v.iov_base, v.iov_len)) < 0)
+			return tot > 0 ? tot : -1;
+		tot += r;
+		if (r < v.iov_len)
+			break;
+	}
+	return tot;
+}
+
+// sendfile(out, in, off, n): copy n bytes of the file open as in
+// to out, a pipe or another file, inside the kernel. Reads from
+// *off and updates it if off isn't 0, or else from in's offset.
+int sys_sendfile(void){
+	struct file* out, * in;
+	int* offp = 0;
+	uintp addr;
+	uint off;
+	int n, r;
+
+	if (argfd(0, 0, &out) < 0 || argfd(1, 0, &in) < 0 || arguintp(2, &addr) < 0 || argint(3, &n) < 0 || n < 0)
+		return -1;
+	if (addr && (argptr(2, (char**)&offp, sizeof(*offp)) < 0 || *offp < 0))
+		return -1;
+	if (offp == 0)
+		return filesendfile(out, in, 0, n);
+	off = *offp;
+	r = filesendfile(out, in, &off, n);
+	*offp = off;
+	return r;
+}
+
+#define DENT_BATCH 32   // entries looked up per directory locking
+
+// getdents(fd, buf, n): fill in up to n entries of the directory
+// open as fd, carrying on from where the last call left off.
+// Returns how many, 0 at the end. The entries' inodes are held
+// while the directory is locked, so they can't be freed, and
+// locked for their types and sizes after it is unlocked.
+int sys_getdents(void){
+	struct file* f;
+	struct dent* d;
+	struct inode* dp, * ip[DENT_BATCH];
+	char name[DIRSIZ];
+	uint inum;
+	int n, i = 0, m, r = 1;
+
+	if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || n < 0 || n > 0x7FFFFFFF / sizeof(*d) ||
+	    argptr(1, (char**)&d, n * sizeof(*d)) < 0)
+		return -1;
+	if (f->type != FD_INODE || f->readable == 0)
+		return -1;
+	dp = f->ip;
+
+	acquiresleep(&f->offlock);
+	while (i < n && r > 0) {
+		ilockshared(dp);
+		if (dp->type != T_DIR) {
+			iunlock(dp);
+			releasesleep(&f->offlock);
+			return -1;
+		}
+		for (m = 0; m < DENT_BATCH && i + m < n; m++) {
+			if ((r = readdir(dp, &f->off, name, &inum)) <= 0)
+				break;
+			memmove(d[i + m].name, name, DIRSIZ);
+			d[i + m].name[DIRSIZ] = 0;
+			d[i + m].ino = inum;
+			ip[m] = iget(dp->dev, inum);
+		}
+		iunlock(dp);
+
+		begin_op();
+		for (int j = 0; j < m; j++, i++) {
+			ilockshared(ip[j]);
+			d[i].type = ip[j]->type;
+			d[i].size = ip[j]->size;
+			iunlockput(ip[j]);
+		}
+		end_op();
+	}
+	releasesleep(&f->offlock);
+	return r < 0 && i == 0 ? -1 : i;
+}
+
 int sys_seek(void){
 	struct file* fd;
 	int offset;
@@ -83,18 +256,32 @@ int sys_write(void){
 	int n;
 	char* p;
 
-	if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+	if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argbuf(f, 1, &p, n) < 0)
 		return -1;
 	return filewrite(f, p, n);
 }
 
 int sys_close(void){
 	int fd;
+
+	if (argint(0, &fd) < 0)
+		return -1;
+	return closefd(fd);
+}
+
+// Close fd of the current process.
+int closefd(int fd){
 	struct file* f;
 
-	if (argfd(0, &fd, &f) < 0)
+	if (fd < 0 || fd >= NOFILE)
+		return -1;
+	// Another thread may be closing it too.
+	acquire(&proc->files->lock);
+	f = proc->files->ofile[fd];
+	proc->files->ofile[fd] = 0;
+	release(&proc->files->lock);
+	if (f == 0)
 		return -1;
-	proc->ofile[fd] = 0;
 	fileclose(f);
 	return 0;
 }
@@ -156,24 +343,8 @@ bad:
 	return -1;
 }
 
-// Is the directory dp empty except for "." and ".." ?
-static int isdirempty(struct inode* dp){
-	int off;
-	struct dirent de;
-
-	for (off = 2 * sizeof(de); off < dp->size; off += sizeof(de)) {
-		if (readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-			panic("isdirempty: readi");
-		if (de.inum != 0)
-			return 0;
-	}
-	return 1;
-}
-
-
 int sys_unlink(void){
 	struct inode* ip, * dp;
-	struct dirent de;
 	char name[DIRSIZ], * path;
 	uint off;
 
@@ -198,14 +369,21 @@ int sys_unlink(void){
 
 	if (ip->nlink < 1)
 		panic("unlink: nlink < 1");
+	if (ip->flags & I_MOUNT) {
+		iunlockput(ip);
+		goto bad;
+	}
 	if (ip->type == T_DIR && !isdirempty(ip)) {
 		iunlockput(ip);
 		goto bad;
 	}
 
-	memset(&de, 0, sizeof(de));
-	if (writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-		panic("unlink: writei");
+	if (dirunlink(dp, off) < 0) {
+		// /proc's names can't be taken away.
+		iunlockput(ip);
+		goto bad;
+	}
+	namecachenegative(dp->dev, dp->inum, name);
 	if (ip->type == T_DIR) {
 		dp->nlink--;
 		iupdate(dp);
@@ -244,8 +422,10 @@ static struct inode* create(char* path, short type, short major, short minor){
 		return 0;
 	}
 
-	if ((ip = ialloc(dp->dev, type)) == 0)
-		panic("create: ialloc");
+	if ((ip = ialloc(dp->dev, type)) == 0) {
+		iunlockput(dp); // out of inodes
+		return 0;
+	}
 
 	ilock(ip);
 	ip->major = major;
@@ -271,12 +451,18 @@ static struct inode* create(char* path, short type, short major, short minor){
 
 int sys_open(void){
 	char* path;
-	int fd, omode;
-	struct file* f;
-	struct inode* ip;
+	int omode;
 
 	if (argstr(0, &path) < 0 || argint(1, &omode) < 0)
 		return -1;
+	return openpath(path, omode);
+}
+
+// Open path, already checked, as open() does.
+int openpath(char* path, int omode){
+	int fd;
+	struct file* f;
+	struct inode* ip;
 
 	begin_op();
 
@@ -372,7 +558,7 @@ int sys_mkvdev(void) {
 
 int sys_chdir(void){
 	char* path;
-	struct inode* ip;
+	struct inode* ip, * old;
 
 	begin_op();
 	if (argstr(0, &path) < 0 || (ip = namei(path)) == 0) {
@@ -386,49 +572,71 @@ int sys_chdir(void){
 		return -1;
 	}
 	iunlock(ip);
-	iput(proc->cwd);
+	acquire(&proc->files->lock);
+	old = proc->files->cwd;
+	proc->files->cwd = ip;
+	release(&proc->files->lock);
+	iput(old);
 	end_op();
-	proc->cwd = ip;
 	return 0;
 }
 
-int sys_exec(void){
-	char* path, * argv[MAXARG];
-	int i;
-	uintp uargv, uarg;
+// Fetch the argument vector at user address uargv.
+static int fetchargv(uintp uargv, char** argv){
+	uintp uarg;
 
-	if (argstr(0, &path) < 0 || arguintp(1, &uargv) < 0) {
-		return -1;
-	}
-	memset(argv, 0, sizeof(argv));
-	for (i = 0;; i++) {
-		if (i >= NELEM(argv))
+	memset(argv, 0, MAXARG * sizeof(argv[0]));
+	for (int i = 0;; i++) {
+		if (i >= MAXARG)
 			return -1;
 		if (fetchuintp(uargv + sizeof(uintp) * i, &uarg) < 0)
 			return -1;
 		if (uarg == 0) {
 			argv[i] = 0;
-			break;
+			return 0;
 		}
 		if (fetchstr(uarg, &argv[i]) < 0)
 			return -1;
 	}
+}
+
+int sys_exec(void){
+	char* path, * argv[MAXARG];
+	uintp uargv;
+
+	if (argstr(0, &path) < 0 || arguintp(1, &uargv) < 0 || fetchargv(uargv, argv) < 0)
+		return -1;
 	return exec(path, argv);
 }
 
-int sys_pipe(void){
-	int* fd;
+// spawn(path, argv, fds): see spawn() in proc.c.
+int sys_spawn(void){
+	char* path, * argv[MAXARG];
+	uintp uargv, ufds;
+	int* fds = 0;
+
+	if (argstr(0, &path) < 0 || arguintp(1, &uargv) < 0 || arguintp(2, &ufds) < 0 ||
+	    fetchargv(uargv, argv) < 0)
+		return -1;
+	if (ufds && argptr(2, (char**)&fds, 3 * sizeof(int)) < 0)
+		return -1;
+	return spawn(path, argv, fds);
+}
+
+// Make a pipe with both ends set to flags (O_NONBLOCK or 0).
+static int makepipe(int* fd, int flags){
 	struct file* rf, * wf;
 	int fd0, fd1;
 
-	if (argptr(0, (void*)&fd, 2 * sizeof(fd[0])) < 0)
+	if (flags & ~O_NONBLOCK)
 		return -1;
 	if (pipealloc(&rf, &wf) < 0)
 		return -1;
+	rf->nonblock = wf->nonblock = (flags & O_NONBLOCK) != 0;
 	fd0 = -1;
 	if ((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0) {
 		if (fd0 >= 0)
-			proc->ofile[fd0] = 0;
+			proc->files->ofile[fd0] = 0;
 		fileclose(rf);
 		fileclose(wf);
 		return -1;
@@ -437,3 +645,175 @@ int sys_pipe(void){
 	fd[1] = fd1;
 	return 0;
 }
+
+int sys_pipe(void){
+	int* fd;
+
+	if (argptr(0, (void*)&fd, 2 * sizeof(fd[0])) < 0)
+		return -1;
+	return makepipe(fd, 0);
+}
+
+// fcntl(fd, cmd, arg): get or set fd's O_NONBLOCK, or a pipe's
+// buffer size.
+int sys_fcntl(void){
+	struct file* f;
+	int cmd, arg;
+
+	if (argfd(0, 0, &f) < 0 || argint(1, &cmd) < 0 || argint(2, &arg) < 0)
+		return -1;
+	switch (cmd) {
+	case F_GETFL:
+		return f->nonblock ? O_NONBLOCK : 0;
+	case F_SETFL:
+		if (arg & ~O_NONBLOCK)
+			return -1;
+		f->nonblock = (arg & O_NONBLOCK) != 0;
+		return 0;
+	case F_GETPIPE_SZ:
+		return f->type == FD_PIPE ? pipesize(f->pipe) : -1;
+	case F_SETPIPE_SZ:
+		return f->type == FD_PIPE ? piperesize(f->pipe, arg) : -1;
+	}
+	return -1;
+}
+
+// poll(fds, nfds, timeout), timeout in milliseconds, negative to
+// wait for ever.
+int sys_poll(void){
+	struct pollfd* fds;
+	int nfds, timeout;
+
+	if (argint(1, &nfds) < 0 || argint(2, &timeout) < 0)
+		return -1;
+	if (nfds < 0 || nfds > PGSIZE || argptr(0, (void*)&fds, nfds * sizeof(*fds)) < 0)
+		return -1;
+	if (timeout > 0)
+		timeout = (timeout * (uint64)HZ + 999) / 1000;
+	return poll(fds, nfds, timeout);
+}
+
+int sys_epoll_create(void){
+	struct file* f;
+	struct epoll* ep;
+	int fd;
+
+	if ((ep = epollalloc()) == 0)
+		return -1;
+	if ((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0) {
+		if (f)
+			fileclose(f);
+		epollclose(ep);
+		return -1;
+	}
+	f->type = FD_EPOLL;
+	f->ep = ep;
+	f->readable = f->writable = 0;
+	return fd;
+}
+
+// epoll_ctl(epfd, op, fd, event); event is ignored for EPOLL_CTL_DEL.
+int sys_epoll_ctl(void){
+	struct file* epf, * f;
+	struct epoll_event* ev = 0;
+	int op, fd;
+
+	if (argfd(0, 0, &epf) < 0 || argint(1, &op) < 0 || argfd(2, &fd, &f) < 0)
+		return -1;
+	if (epf->type != FD_EPOLL)
+		return -1;
+	if (op != EPOLL_CTL_DEL && argptr(3, (void*)&ev, sizeof(*ev)) < 0)
+		return -1;
+	return epollctl(epf->ep, op, fd, f, ev);
+}
+
+// epoll_wait(epfd, events, maxevents, timeout), timeout in
+// milliseconds, negative to wait for ever.
+int sys_epoll_wait(void){
+	struct file* f;
+	struct epoll_event* evs;
+	int max, timeout;
+
+	if (argfd(0, 0, &f) < 0 || argint(2, &max) < 0 || argint(3, &timeout) < 0)
+		return -1;
+	if (f->type != FD_EPOLL || max <= 0 || max > PGSIZE)
+		return -1;
+	if (argptr(1, (void*)&evs, max * sizeof(*evs)) < 0)
+		return -1;
+	if (timeout > 0)
+		timeout = (timeout * (uint64)HZ + 999) / 1000;
+	return epollwait(f->ep, evs, max, timeout);
+}
+
+int sys_pipe2(void){
+	int* fd;
+	int flags;
+
+	if (argptr(0, (void*)&fd, 2 * sizeof(fd[0])) < 0 || argint(1, &flags) < 0)
+		return -1;
+	return makepipe(fd, flags);
+}
+
+// Get every delayed write to disk. Waits for the log to commit
+// what has been done so far, then gets it home too.
+int sys_sync(void){
+	log_force();
+	bsync();
+	return 0;
+}
+
+// Get fd's file to disk, as cheaply as its file system can:
+// for fs1 that is waiting for the log to commit, leaving the
+// installing to the flusher. Writes before it may go out in any
+// order, and together.
+int sys_fsync(void){
+	struct file* f;
+
+	if (argfd(0, 0, &f) < 0)
+		return -1;
+	if (f->type != FD_INODE)
+		return -1;
+	return fsynci(f->ip);
+}
+
+int sys_bcachestat(void){
+	struct bcachestat* st;
+
+	if (argptr(0, (char**)&st, sizeof(*st)) < 0)
+		return -1;
+	bcachestat(st);
+	return 0;
+}
+
+// Mount a file system of the named type on the directory path.
+// Only tmpfs and procfs, which need no device, can be mounted so far.
+int sys_mount(void){
+	static struct {
+		char* name;
+		uint dev;
+		struct fsops* ops;
+	} types[] = {
+		{ "tmpfs",  TMPFS_DEV,  &tmpfs_ops },
+		{ "procfs", PROCFS_DEV, &procfs_ops },
+	};
+	char* path, * type;
+	struct inode* ip;
+	int i, r;
+
+	if (argstr(0, &path) < 0 || argstr(1, &type) < 0)
+		return -1;
+	for (i = 0; i < NELEM(types); i++)
+		if (strncmp(type, types[i].name, DIRSIZ) == 0)
+			break;
+	if (i == NELEM(types))
+		return -1;
+
+	begin_op();
+	if ((ip = namei(path)) == 0) {
+		end_op();
+		return -1;
+	}
+	r = vfsmount(types[i].dev, types[i].ops, ip);
+	end_op();
+	return r;
+}
@@ -5,13 +5,61 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "ktimer.h"
+#include "time.h"
+#include "futex.h"
+#include "ipc.h"
+#include "syscallstat.h"
+#include "perf.h"
+#include "rusage.h"
+#include "kernel/string.h"
 
 int sys_fork(void){
 	return fork();
 }
 
+// clone(fn, arg, stack, tls): see clone() in proc.c.
+int sys_clone(void){
+	uintp fn, arg, stack, tls;
+
+	if (arguintp(0, &fn) < 0 || arguintp(1, &arg) < 0 ||
+	    arguintp(2, &stack) < 0 || arguintp(3, &tls) < 0)
+		return -1;
+	if (fn >= USERTOP || stack >= USERTOP || stack < 2 * sizeof(uintp))
+		return -1;
+	return clone(fn, arg, stack, tls);
+}
+
+int sys_futex(void){
+	uintp addr;
+	int op, val;
+
+	if (arguintp(0, &addr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0)
+		return -1;
+	if (addr >= USERTOP)
+		return -1;
+	switch (op) {
+	case FUTEX_WAIT:
+		return futexwait(addr, val);
+	case FUTEX_WAKE:
+		return futexwake(addr, val);
+	}
+	return -1;
+}
+
 int sys_procexit(void){
-	exit();
+	exit(0);
+	return 0; // not reached
+}
+
+// _exit(status): exit with status, of which waitpid() sees the
+// low 8 bits.
+int sys__exit(void){
+	int status;
+
+	if (argint(0, &status) < 0)
+		status = 0;
+	exit(status & 0xFF);
 	return 0; // not reached
 }
 
@@ -19,6 +67,20 @@ int sys_wait(void){
 	return wait();
 }
 
+// waitpid(pid, status, options): see waitpid() in proc.c.
+int sys_waitpid(void){
+	int pid, options, xstatus, r;
+	uintp ustatus;
+
+	if (argint(0, &pid) < 0 || arguintp(1, &ustatus) < 0 || argint(2, &options) < 0)
+		return -1;
+	// The child is gone either way, so a bad status pointer
+	// only loses its status.
+	if ((r = waitpid(pid, &xstatus, options)) > 0 && ustatus)
+		copy_to_user(ustatus, &xstatus, sizeof(xstatus));
+	return r;
+}
+
 int sys_kill(void){
 	int pid;
 
@@ -37,27 +99,46 @@ uintp sys_sbrk(void){
 
 	if (arguintp(0, &n) < 0)
 		return -1;
-	addr = proc->sz;
+	addr = proc->vm->sz;
 	if (growproc(n) < 0)
 		return -1;
 	return addr;
 }
 
+// Opt the calling process in or out of huge pages for its
+// heap and anonymous mappings. Kept across fork and exec.
+// Returns the previous setting.
+int sys_hugepages(void){
+	int on, old;
+
+	if (argint(0, &on) < 0)
+		return -1;
+	old = proc->vm->hugepages;
+	proc->vm->hugepages = on != 0;
+	return old;
+}
+
 int sys_sleep(void){
 	int n;
 	uint ticks0;
+	struct ktimer t;
 
 	if (argint(0, &n) < 0)
 		return -1;
+	memset(&t, 0, sizeof(t));
 	acquire(&tickslock);
 	ticks0 = ticks;
+	// Sleep on our own timer so only this process is woken.
+	ktimerset(&t, ticks0 + n, wakeup, &t);
 	while (ticks - ticks0 < n) {
 		if (proc->killed) {
+			ktimercancel(&t);
 			release(&tickslock);
 			return -1;
 		}
-		sleep(&ticks, &tickslock);
+		sleep(&t, &tickslock);
 	}
+	ktimercancel(&t);
 	release(&tickslock);
 	return 0;
 }
@@ -148,3 +229,199 @@ int sys_setpriority(void) {
 		return -1;
 	return setpriority(pid, priority);
 }
+
+int sys_clock_gettime(void){
+	int clk;
+	struct timespec* ts;
+	uint64 ns;
+
+	if (argint(0, &clk) < 0 || argptr(1, (char**)&ts, sizeof(*ts)) < 0)
+		return -1;
+	if (clk != CLOCK_MONOTONIC)
+		return -1;
+	ns = nsecs();
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+	return 0;
+}
+
+// sched_setaffinity(pid, len, mask): mask is len bytes, one bit
+// per cpu. Cpus past the end of a short mask are left out.
+int sys_sched_setaffinity(void){
+	int pid, len;
+	char* m;
+	uint64 mask[NCPUMASK];
+
+	if (argint(0, &pid) < 0 || argint(1, &len) < 0 || len <= 0 || argptr(2, &m, len) < 0)
+		return -1;
+	memset(mask, 0, sizeof(mask));
+	memmove(mask, m, len < sizeof(mask) ? len : sizeof(mask));
+	return setaffinity(pid, mask);
+}
+
+// sched_getaffinity(pid, len, mask): returns the bytes stored.
+int sys_sched_getaffinity(void){
+	int pid, len;
+	char* m;
+	uint64 mask[NCPUMASK];
+
+	if (argint(0, &pid) < 0 || argint(1, &len) < 0 || len <= 0 || argptr(2, &m, len) < 0)
+		return -1;
+	if (getaffinity(pid, mask) < 0)
+		return -1;
+	if (len > sizeof(mask))
+		len = sizeof(mask);
+	memmove(m, mask, len);
+	return len;
+}
+
+int sys_cpureserve(void){
+	int c, reserved;
+
+	if (argint(0, &c) < 0 || argint(1, &reserved) < 0)
+		return -1;
+	return cpureserve(c, reserved);
+}
+
+// irqaffinity(irq, cpu): send an I/O APIC interrupt to cpu, or
+// back to the balancing if cpu < 0. Blessed processes only.
+int sys_irqaffinity(void){
+	int irq, c;
+
+	if (argint(0, &irq) < 0 || argint(1, &c) < 0)
+		return -1;
+	if (proc->blessed != PROC_BLESSED)
+		return -1;
+	return irqaffinity(irq, c);
+}
+
+// perfctl(events, n): count the n performance counter events
+// (perf.h) for this process; see perfctl().
+int sys_perfctl(void){
+	int* ev;
+	int n;
+
+	if (argint(1, &n) < 0 || n < 0 || n > PERF_MAXCTR || argptr(0, (char**)&ev, n * sizeof(*ev)) < 0)
+		return -1;
+	return perfctl(ev, n);
+}
+
+// perfread(vals, n): copy out up to n of this process's counts.
+int sys_perfread(void){
+	uint64* vals;
+	int n;
+
+	if (argint(1, &n) < 0 || n < 0 || argptr(0, (char**)&vals, n * sizeof(*vals)) < 0)
+		return -1;
+	return perfread(vals, n);
+}
+
+// getrusage(who, ru): this process's, or its reaped children's,
+// times and system calls.
+int sys_getrusage(void){
+	struct rusage* ru;
+	int who;
+
+	if (argint(0, &who) < 0 || argptr(1, (char**)&ru, sizeof(*ru)) < 0)
+		return -1;
+	return getrusage(who, ru);
+}
+
+// lockstat(buf, n): copy up to n lock statistics entries.
+int sys_lockstat(void){
+	struct lockstat* buf;
+	int n;
+
+	if (argint(1, &n) < 0 || n < 0 || argptr(0, (char**)&buf, n * sizeof(*buf)) < 0)
+		return -1;
+	return lockstatcopy(buf, n);
+}
+
+// klogread(buf, n): copy out the last n bytes of the kernel log.
+int sys_klogread(void){
+	char* buf;
+	int n;
+
+	if (argint(1, &n) < 0 || n < 0 || argptr(0, &buf, n) < 0)
+		return -1;
+	return klogread(buf, n);
+}
+
+// syscallstat(cpu, buf, n, reset): see syscallstatcopy().
+int sys_syscallstat(void){
+	struct syscallstat* buf;
+	int c, n, reset;
+
+	if (argint(0, &c) < 0 || argint(2, &n) < 0 || argint(3, &reset) < 0 ||
+	    n < 0 || n > NSYSCALLSTAT || argptr(1, (char**)&buf, n * sizeof(*buf)) < 0)
+		return -1;
+	return syscallstatcopy(c, buf, n, reset);
+}
+
+uintp sys_kringmap(void){
+	return kringmap();
+}
+
+int sys_kringwait(void){
+	int what;
+
+	if (argint(0, &what) < 0)
+		return -1;
+	return kringwait(what);
+}
+
+int sys_kringnotify(void){
+	return kringnotify();
+}
+
+// ipc_call(pid, msg): msg holds the request, then the reply.
+int sys_ipc_call(void){
+	struct ipcmsg m;
+	int pid;
+	char* u;
+
+	if (argint(0, &pid) < 0 || argptr(1, &u, sizeof(m)) < 0)
+		return -1;
+	memmove(&m, u, sizeof(m));
+	if (ipccall(pid, &m) < 0)
+		return -1;
+	memmove(u, &m, sizeof(m));
+	return 0;
+}
+
+// ipc_reply_wait(to, msg): reply with msg to caller to, if
+// positive, then wait for a call; returns its pid.
+int sys_ipc_reply_wait(void){
+	struct ipcmsg m;
+	int to, pid;
+	char* u;
+
+	if (argint(0, &to) < 0 || argptr(1, &u, sizeof(m)) < 0)
+		return -1;
+	memmove(&m, u, sizeof(m));
+	if ((pid = ipcreplywait(to, &m)) < 0)
+		return -1;
+	memmove(u, &m, sizeof(m));
+	return pid;
+}
+
+// netrecv(dev, len): the next frame, mapped in; see net.c.
+uintp sys_netrecv(void){
+	int dev, *len;
+
+	if (argint(0, &dev) < 0 || argptr(1, (char**)&len, sizeof(*len)) < 0)
+		return 0;
+	return netrecv(dev, len);
+}
+
+uintp sys_uring_setup(void){
+	return uringsetup();
+}
+
+int sys_uring_enter(void){
+	int n;
+
+	if (argint(0, &n) < 0)
+		return -1;
+	return uringenter(n);
+}
@@ -1,13 +1,32 @@
 #include "types.h"
 #include "x86.h"
 
+// Shorter than this, a loop of word moves beats starting up a rep
+// string instruction. Longer, rep movsb and rep stosb if the CPU
+// has ERMS (they then move a cache line at a time, from any
+// alignment), or else rep movsq and rep stosq and a byte tail.
+#define REPMIN 64
+
+extern int CPU_ERMS;
+
+// A word that may sit at any address.
+typedef uint64 uword __attribute__((aligned(1), may_alias));
 
 void* sys_memset(void* dst, int c, uint n) {
-	if ((uintp)dst % 4 == 0 && n % 4 == 0) {
-		c &= 0xFF;
-		stosl(dst, (c << 24) | (c << 16) | (c << 8) | c, n / 4);
-	} else
-		stosb(dst, c, n);
+	uint64 w = 0x0101010101010101UL * (uchar)c;
+	char* d = dst;
+
+	if (n < REPMIN) {
+		for (; n >= 8; n -= 8, d += 8)
+			*(uword*)d = w;
+		while (n-- > 0)
+			*d++ = c;
+	} else if (CPU_ERMS) {
+		stosb(d, c, n);
+	} else {
+		stosq(d, w, n / 8);
+		stosb(d + (n & ~7), c, n % 8);
+	}
 	return dst;
 }
 
@@ -18,13 +37,24 @@ void* sys_memmove(void* dst, const void* src, uint n) {
 	s = src;
 	d = dst;
 	if (s < d && s + n > d) {
-		s += n;
-		d += n;
+		// Backwards, a word at a time; copies that overlap
+		// this way are rare and rep with the direction flag
+		// set is slow.
+		for (; n >= 8; n -= 8)
+			*(uword*)(d + n - 8) = *(uword*)(s + n - 8);
 		while (n-- > 0)
-			*--d = *--s;
-	} else
+			d[n] = s[n];
+	} else if (n < REPMIN) {
+		for (; n >= 8; n -= 8, d += 8, s += 8)
+			*(uword*)d = *(uword*)s;
 		while (n-- > 0)
 			*d++ = *s++;
+	} else if (CPU_ERMS) {
+		movsb(d, s, n);
+	} else {
+		movsq(d, s, n / 8);
+		movsb(d + (n & ~7), s + (n & ~7), n % 8);
+	}
 
 	return dst;
 }
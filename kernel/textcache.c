@@ -0,0 +1,168 @@
+// Cache of executable pages shared between processes.
+//
+// pagein() builds each page of a demand-paged executable from its
+// inode; the finished page is remembered here under (dev, inum,
+// user address) so the next process running the same binary maps
+// the same physical page instead of reading it again. Pages are
+// mapped copy-on-write, so a process that writes to its data
+// gets a private copy. The cache holds one reference to each page.
+// Writing to or truncating a file drops its pages.
+//
+// Beside the pages, the cache keeps the load plans of the last
+// few executables run: their entry points and segments, as
+// execload() read them from the ELF headers. A file's plan goes
+// when its pages do, so a plan found is for the contents the
+// file has now, and an inode number reused after a file is freed
+// finds nothing.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "shrinker.h"
+
+#define NTEXTCACHE 512   // direct-mapped slots
+#define NEXECPLAN  16    // load plans, likewise
+
+struct tcentry {
+	uint dev;
+	uint inum;
+	uintp va;
+	char* page;   // 0 if slot is empty
+};
+
+struct tcplan {
+	uint dev;
+	uint inum;
+	int valid;
+	struct execplan plan;
+};
+
+static struct {
+	struct spinlock lock;
+	struct tcentry e[NTEXTCACHE];
+	int n;        // slots in use
+	struct tcplan p[NEXECPLAN];
+	int nplan;
+} tcache;
+
+static inline uint tchash(uint dev, uint inum, uintp va){
+	return (dev * 31 + inum * 1103515245 + (va >> PGSHIFT)) % NTEXTCACHE;
+}
+
+// Shrinker: forget up to n pages no process has mapped.
+static int tcshrink(int n){
+	int freed = 0;
+
+	if (tcache.n == 0 || holding(&tcache.lock))
+		return 0;
+	acquire(&tcache.lock);
+	for (int i = 0; i < NTEXTCACHE && freed < n; i++) {
+		struct tcentry* t = &tcache.e[i];
+		if (t->page && krefcount(t->page) == 1) {
+			kfree(t->page);
+			t->page = 0;
+			tcache.n--;
+			freed++;
+		}
+	}
+	release(&tcache.lock);
+	return freed;
+}
+
+static struct shrinker tcshrinker = { "textcache", tcshrink };
+
+void textcacheinit(void){
+	initlock(&tcache.lock, "textcache");
+	register_shrinker(&tcshrinker);
+}
+
+// Return the cached page for (dev, inum, va) with a reference
+// taken for the caller, or 0 if it is not cached.
+char* textcache_get(uint dev, uint inum, uintp va){
+	struct tcentry* t = &tcache.e[tchash(dev, inum, va)];
+	char* page = 0;
+
+	acquire(&tcache.lock);
+	if (t->page && t->dev == dev && t->inum == inum && t->va == va) {
+		page = t->page;
+		kref(page);
+	}
+	release(&tcache.lock);
+	return page;
+}
+
+// Remember page as the contents of (dev, inum, va). The caller
+// must not write to the page afterwards.
+void textcache_put(uint dev, uint inum, uintp va, char* page){
+	struct tcentry* t = &tcache.e[tchash(dev, inum, va)];
+	char* old;
+
+	kref(page);
+	acquire(&tcache.lock);
+	old = t->page;
+	if (old == 0)
+		tcache.n++;
+	t->dev = dev;
+	t->inum = inum;
+	t->va = va;
+	t->page = page;
+	release(&tcache.lock);
+	if (old)
+		kfree(old);
+}
+
+// Copy the load plan of (dev, inum) to *plan. Returns -1 if
+// there is none.
+int textcache_plan_get(uint dev, uint inum, struct execplan* plan){
+	struct tcplan* t = &tcache.p[(dev * 31 + inum) % NEXECPLAN];
+	int r = -1;
+
+	acquire(&tcache.lock);
+	if (t->valid && t->dev == dev && t->inum == inum) {
+		*plan = t->plan;
+		r = 0;
+	}
+	release(&tcache.lock);
+	return r;
+}
+
+// Remember plan as the load plan of (dev, inum). The caller holds
+// the inode locked, so it can't change meanwhile.
+void textcache_plan_put(uint dev, uint inum, struct execplan* plan){
+	struct tcplan* t = &tcache.p[(dev * 31 + inum) % NEXECPLAN];
+
+	acquire(&tcache.lock);
+	if (!t->valid)
+		tcache.nplan++;
+	t->dev = dev;
+	t->inum = inum;
+	t->valid = 1;
+	t->plan = *plan;
+	release(&tcache.lock);
+}
+
+// Drop every cached page and the plan of a file whose contents changed.
+void textcache_invalidate(uint dev, uint inum){
+	if (tcache.n == 0 && tcache.nplan == 0)
+		return;
+	acquire(&tcache.lock);
+	for (int i = 0; i < NEXECPLAN; i++) {
+		struct tcplan* t = &tcache.p[i];
+		if (t->valid && t->dev == dev && t->inum == inum) {
+			t->valid = 0;
+			tcache.nplan--;
+		}
+	}
+	for (int i = 0; i < NTEXTCACHE; i++) {
+		struct tcentry* t = &tcache.e[i];
+		if (t->page && t->dev == dev && t->inum == inum) {
+			kfree(t->page);
+			t->page = 0;
+			tcache.n--;
+		}
+	}
+	release(&tcache.lock);
+}
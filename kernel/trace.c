@@ -0,0 +1,134 @@
+// Static tracepoints.
+//
+// TRACE() at points of interest around the kernel (see trace.h)
+// puts a record with the TSC in the cpu's trace ring while tracing
+// is on. Like the profiler's, each ring has one writer, the cpu
+// with interrupts off, and readers that take turns; a record that
+// doesn't fit is dropped, and a TRACE_DROPPED record read out later
+// says how many were.
+//
+// /dev/trace: write "1" to start tracing and "0" to stop. A read
+// drains the rings, cpu by cpu, as whole struct tracerecs; the
+// records carry the cpu, and sort by tsc. The trace command
+// prints them.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "trace.h"
+#include "kernel/string.h"
+
+#define TRACE_NREC 1024   // records in a cpu's ring
+
+struct tracering {
+	uint head;            // written up to here, by the cpu
+	uint tail;            // read up to here
+	uint dropped;         // records that didn't fit
+	struct tracerec rec[TRACE_NREC];
+};
+
+int tracing;
+
+static struct {
+	struct sleeplock lock;            // readers, and turning on
+	struct tracering* ring[NCPU];     // allocated at the first start
+} trace;
+
+void tracerec(int ev, uint64 a, uint64 b){
+	struct tracering* r;
+	struct tracerec* t;
+
+	pushcli();
+	if ((r = trace.ring[cpu->id]) == 0) {
+		popcli();
+		return;
+	}
+	if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == TRACE_NREC) {
+		r->dropped++;
+		popcli();
+		return;
+	}
+	t = &r->rec[r->head % TRACE_NREC];
+	t->tsc = rdtsc();
+	t->arg[0] = a;
+	t->arg[1] = b;
+	t->pid = proc ? proc->pid : 0;
+	t->event = ev;
+	t->cpu = cpu->id;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	popcli();
+}
+
+// Copy out as many whole records as fit in n bytes.
+static int traceread(struct inode* ip, char* dst, int n){
+	struct tracering* r;
+	struct tracerec d;
+	int tot = 0;
+
+	acquiresleep(&trace.lock);
+	for (int c = 0; c < ncpu; c++) {
+		if ((r = trace.ring[c]) == 0)
+			continue;
+		if (tot + sizeof(d) <= n && r->dropped) {
+			memset(&d, 0, sizeof(d));
+			d.tsc = rdtsc();
+			d.arg[0] = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+			d.event = TRACE_DROPPED;
+			d.cpu = c;
+			memmove(dst + tot, &d, sizeof(d));
+			tot += sizeof(d);
+		}
+		while (r->tail != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+			if (tot + sizeof(struct tracerec) > n)
+				goto done;
+			memmove(dst + tot, &r->rec[r->tail % TRACE_NREC], sizeof(struct tracerec));
+			tot += sizeof(struct tracerec);
+			__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+		}
+	}
+done:
+	releasesleep(&trace.lock);
+	return tot;
+}
+
+static int tracewrite(struct inode* ip, char* src, int n){
+	int pages = PGROUNDUP(sizeof(struct tracering)) / PGSIZE;
+	int r = n;
+
+	if (n < 1)
+		return -1;
+	acquiresleep(&trace.lock);
+	if (src[0] == '1') {
+		for (int c = 0; c < ncpu && r > 0; c++) {
+			struct tracering* ring;
+			if (trace.ring[c])
+				continue;
+			if ((ring = (struct tracering*)kmalloc(pages)) == 0) {
+				r = -1;
+				break;
+			}
+			memset(ring, 0, sizeof(*ring));
+			trace.ring[c] = ring;
+		}
+		if (r > 0)
+			tracing = 1;
+	} else if (src[0] == '0') {
+		tracing = 0;
+	} else if (src[0] != '\n') { // echo writes its newline apart
+		r = -1;
+	}
+	releasesleep(&trace.lock);
+	return r;
+}
+
+void traceinit(void){
+	initsleeplock(&trace.lock, "trace");
+	devsw[TRACE0].read = traceread;
+	devsw[TRACE0].write = tracewrite;
+}
@@ -20,38 +20,103 @@ uint ticks;
 struct spinlock irqHandlersLock;
 irqhandler irqHandlers[MAX_IRQS];
 
-irqhandler get_registered_handler(uint16 irq);
+
+// {faulting instruction, where to resume} pairs; see uaccess64.S.
+struct exentry {
+	uintp insn;
+	uintp fixup;
+};
+extern struct exentry __start_ex_table[], __stop_ex_table[];
 
 void trapinit() {
 	initlock(&tickslock, "tickslock");
 	initlock(&irqHandlersLock, "irqHandlersLock");
 }
 
-void trap(struct trapframe* tf){
+static void dotrap(struct trapframe* tf){
+	if (tf->trapno == T_NMI && watchdognmi(tf))
+		return;
 	if (tf->trapno == T_SYSCALL) {
 		if (proc->killed)
-			exit();
+			exit(-1);
 		proc->tf = tf;
 		syscall();
 		if (proc->killed)
-			exit();
+			exit(-1);
 		return;
 	}
 
+	// First FPU or SIMD instruction since being switched in.
+	if (tf->trapno == T_DEVICE && proc != 0 && (tf->cs & 3) == DPL_USER) {
+		if (fputrap() == 0 || oomkill() == 0)
+			return;
+		cprintf("pid %d %s: out of memory for FPU state--kill proc\n", proc->pid, proc->name);
+		proc->killed = 1;
+		exit(-1);
+	}
+
+	// First touch of a page exec() left to be demand paged.
+	// Reading the executable may sleep, which is only safe
+	// if the faulting code held no spinlocks.
+	if (tf->trapno == T_PGFLT && proc != 0 && !(tf->err & FEC_PR) && cpu->ncli == 0) {
+		if (tf->eflags & FL_IF)
+			amd64_sti();
+		int r = pagein(proc, (char*)rcr2());
+		amd64_cli();
+		if (r > 0)
+			return;
+	}
+
+	// A write to a copy-on-write page, from user space or
+	// from the kernel on the user's behalf.
+	if (tf->trapno == T_PGFLT && proc != 0 && (tf->err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)) {
+		int r = cowfault(proc->vm->pgdir, (char*)rcr2());
+		if (r > 0)
+			return;
+		// Try again once the OOM killer has made room.
+		if (r < 0 && (tf->cs & 3) == DPL_USER && oomkill() == 0)
+			return;
+		if (r < 0 && (tf->cs & 3) == DPL_USER) {
+			cprintf("pid %d %s: out of memory on copy-on-write--kill proc\n",
+			        proc->pid, proc->name);
+			proc->killed = 1;
+			exit(-1);
+		}
+	}
+
+	// The kernel copying to or from a user address that can't
+	// be paged in: make the copy fail rather than panic.
+	if (tf->trapno == T_PGFLT && (tf->cs & 3) == 0) {
+		for (struct exentry* e = __start_ex_table; e < __stop_ex_table; e++) {
+			if (e->insn == tf->eip) {
+				tf->eip = e->fixup;
+				return;
+			}
+		}
+	}
+
+	// A kernel stack ran into its guard; see kstack.c.
+	if (tf->trapno == T_DBLFLT && kstackguard(tf->esp))
+		panic("kernel stack overflow");
+
 	switch (tf->trapno) {
 	case T_IRQ0 + IRQ_TIMER:
 		if (cpu->id == 0) {
 			acquire(&tickslock);
 			ticks++;
-			wakeup(&ticks);
+			vdsotick(ticks);
+			ktimertick(ticks);
+			loadavgtick(ticks);
 	    #ifdef POLL_UART
-			//hack
+			// In case the uart's interrupts get lost.
 			if(ticks % 100) {
 				uartintr();
 			}
 	    #endif
 			release(&tickslock);
 		}
+		watchdogtick(tf);
+		proftick(tf);
 		lapiceoi();
 		break;
 	case T_IRQ0 + IRQ_IDE1:
@@ -62,6 +127,14 @@ void trap(struct trapframe* tf){
 		ideintr();
 		lapiceoi();
 		break;
+	case T_IRQ0 + IRQ_TLB:
+		tlbintr();
+		lapiceoi();
+		break;
+	case T_IRQ0 + IRQ_RESCHED:
+		// Nothing to do: the scheduler looks at its queue on return.
+		lapiceoi();
+		break;
 	case T_IRQ0 + IRQ_KBD:
 		kbdintr();
 		lapiceoi();
@@ -79,11 +152,13 @@ void trap(struct trapframe* tf){
 
 	default:
 		amd64_nop(); // a label can only appear directly in front of a statement, so...
-		void (*dynamicIrqHandler)(uint16) = get_registered_handler(tf->trapno);
+		void (*dynamicIrqHandler)(uint16) = 0;
+		if (tf->trapno >= T_IRQ0 && tf->trapno < T_IRQ0 + MAX_IRQS)
+			dynamicIrqHandler = get_registered_handler(tf->trapno - T_IRQ0);
 
 		if(dynamicIrqHandler) {
 			//all's good, we found a dyanmic IRQ handler that was defined for this
-			dynamicIrqHandler(tf->trapno);
+			dynamicIrqHandler(tf->trapno - T_IRQ0);
 			lapiceoi();
 		}else if (proc == 0 || (tf->cs & 3) == 0) {
 			// In kernel, it must be our mistake.
@@ -104,20 +179,41 @@ void trap(struct trapframe* tf){
 		}
 	}
 
+	// Bottom halves left by the handler, if any.
+	softirq();
+
 	// Force process exit if it has been killed and is in user space.
 	// (If it is still executing in the kernel, let it keep running
 	// until it gets to the regular system call return.)
 	if (proc && proc->killed && (tf->cs & 3) == DPL_USER)
-		exit();
+		exit(-1);
 
-	// Force process to give up CPU on clock tick.
+	// Force process to give up CPU on the clock tick that ends its
+	// time slice, unless it asked not to be (preempt_disable()).
 	// If interrupts were on while locks held, would need to check nlock.
-	if (proc && proc->state == RUNNING && tf->trapno == T_IRQ0 + IRQ_TIMER)
+	// Not from under a bottom half, which would then finish on
+	// some other cpu.
+	if (proc && proc->state == RUNNING && tf->trapno == T_IRQ0 + IRQ_TIMER && !cpu->insoftirq &&
+	    proc->preempt == 0 && sliceover())
 		yield();
 
 	// Check if the process has been killed since we yielded
 	if (proc && proc->killed && (tf->cs & 3) == DPL_USER)
-		exit();
+		exit(-1);
+}
+
+// Time from entering the kernel from user mode to going back is
+// system time, and the rest user time; see acctcharge(). A new
+// process's first return to user mode doesn't come through here,
+// and what it spends getting there counts as user time.
+void trap(struct trapframe* tf){
+	int user = (tf->cs & 3) == DPL_USER;
+
+	if (user)
+		acctcharge(1);
+	dotrap(tf);
+	if (user)
+		acctcharge(0);
 }
 
 uint8 irq_register_handler(uint16 irq, irqhandler handler) {
@@ -130,6 +226,21 @@ uint8 irq_register_handler(uint16 irq, irqhandler handler) {
 	return 1;
 }
 
+// Register handler on a free vector from the MSI range.
+// Returns the irq, or -1 if none is left.
+int irq_alloc_handler(irqhandler handler) {
+	acquire(&irqHandlersLock);
+	for (int irq = IRQ_MSI0; irq < MAX_IRQS; irq++) {
+		if (irqHandlers[irq] == 0) {
+			irqHandlers[irq] = handler;
+			release(&irqHandlersLock);
+			return irq;
+		}
+	}
+	release(&irqHandlersLock);
+	return -1;
+}
+
 irqhandler get_registered_handler(uint16 irq) {
 	irqhandler result = 0;
 	if(irq < MAX_IRQS) {
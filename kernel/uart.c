@@ -14,27 +14,58 @@
 #include "x86.h"
 
 #define BAUD_RATE 115200
+#define UARTBUF   8192     // bytes queued for output
 
-static int uart;    // is there a uart?
+// Registers, from COM1.
+#define THR 0   // transmit holding (write)
+#define RBR 0   // receive buffer (read)
+#define IER 1   // interrupt enable
+#define FCR 2   // FIFO control (write)
+#define IIR 2   // interrupt identification (read)
+#define LCR 3
+#define MCR 4
+#define LSR 5   // line status
+
+#define IER_RX  0x01   // received data available
+#define IER_TX  0x02   // transmit holding register empty
+#define LSR_DR  0x01   // data ready
+#define LSR_THRE 0x20  // the transmitter (FIFO, if on) is empty
+
+// Output goes through a ring: uartputc() queues a byte and
+// returns, and the transmitter-empty interrupt refills the
+// 16550's FIFO from the ring, up to 16 bytes at a time. Before
+// uartinit() turns interrupts on, and after uartsync() (for
+// panic()), uartputc() waits for the transmitter instead.
+static struct {
+	struct spinlock lock;
+	int present;     // is there a uart?
+	int intr;        // output is interrupt-driven
+	uint fifo;       // bytes the transmitter takes at once
+	uchar ier;
+	char buf[UARTBUF];
+	uint r, w;       // read and write counts
+} uart;
 
 void uartearlyinit(void){
 	char* p;
 
-	// Turn off the FIFO
-	amd64_out8(COM1 + 2, 0);
+	// Turn on the FIFOs, cleared, if it is a 16550.
+	amd64_out8(COM1 + FCR, 0xC7);
 
 	// 115200 baud, 8 data bits, 1 stop bit, parity off.
-	amd64_out8(COM1 + 3, 0x80); // Unlock divisor
+	amd64_out8(COM1 + LCR, 0x80); // Unlock divisor
 	amd64_out8(COM1 + 0, 115200 / BAUD_RATE);
 	amd64_out8(COM1 + 1, 0);
-	amd64_out8(COM1 + 3, 0x03); // Lock divisor, 8 data bits.
-	amd64_out8(COM1 + 4, 0);
-	amd64_out8(COM1 + 1, 0x01); // Enable receive interrupts.
+	amd64_out8(COM1 + LCR, 0x03); // Lock divisor, 8 data bits.
+	amd64_out8(COM1 + MCR, 0);
+	uart.ier = IER_RX;
+	amd64_out8(COM1 + IER, uart.ier); // Enable receive interrupts.
 
 	// If status is 0xFF, no serial port.
-	if (inb(COM1 + 5) == 0xFF)
+	if (inb(COM1 + LSR) == 0xFF)
 		return;
-	uart = 1;
+	uart.present = 1;
+	uart.fifo = (inb(COM1 + IIR) & 0xC0) == 0xC0 ? 16 : 1;
 
 	// Announce that we're here.
 	for (p = "Xv64 UART Console 1\n"; *p; p++)
@@ -42,35 +73,88 @@ void uartearlyinit(void){
 }
 
 void uartinit(void){
-	if (!uart)
+	if (!uart.present)
 		return;
 
+	initlock(&uart.lock, "uart");
 	// Acknowledge pre-existing interrupt conditions;
 	// enable interrupts.
-	inb(COM1 + 2);
-	inb(COM1 + 0);
+	inb(COM1 + IIR);
+	inb(COM1 + RBR);
 	picenable(IRQ_COM1);
 	ioapicenable(IRQ_COM1, 0);
+	uart.intr = 1;
+}
+
+static void uartwait(void){
+	while (!(inb(COM1 + LSR) & LSR_THRE))
+		microdelay(10);
+}
+
+// Move what the transmitter will take from the ring, and ask for
+// an interrupt when it is empty again if there is more. Must hold
+// uart.lock.
+static void uartstart(void){
+	uchar ier;
+
+	if (inb(COM1 + LSR) & LSR_THRE)
+		for (uint i = 0; i < uart.fifo && uart.r != uart.w; i++)
+			amd64_out8(COM1 + THR, uart.buf[uart.r++ % UARTBUF]);
+	ier = uart.r != uart.w ? IER_RX | IER_TX : IER_RX;
+	if (ier != uart.ier) {
+		uart.ier = ier;
+		amd64_out8(COM1 + IER, ier);
+	}
 }
 
 void uartputc(int c){
-	if (!uart) {
+	if (!uart.present)
+		return;
+	if (!uart.intr) {
+		uartwait();
+		amd64_out8(COM1 + THR, c);
 		return;
 	}
-	while(!(inb(COM1 + 5) & 0x20)) {
-		microdelay(10);
+	acquire(&uart.lock);
+	// Full: make room at the serial port's pace.
+	while (uart.w - uart.r == UARTBUF) {
+		uartwait();
+		uartstart();
+	}
+	uart.buf[uart.w++ % UARTBUF] = c;
+	uartstart();
+	release(&uart.lock);
+}
+
+// Write out what is queued and wait for the transmitter from now
+// on. The lock is not taken, since panic() may have interrupted
+// its holder.
+void uartsync(void){
+	if (!uart.present || !uart.intr)
+		return;
+	uart.intr = 0;
+	amd64_out8(COM1 + IER, IER_RX);
+	while (uart.r != uart.w) {
+		uartwait();
+		amd64_out8(COM1 + THR, uart.buf[uart.r++ % UARTBUF]);
 	}
-	amd64_out8(COM1 + 0, c);
 }
 
 static int uartgetc(void){
-	if (!uart)
+	if (!uart.present)
 		return -1;
-	if (!(inb(COM1 + 5) & 0x01))
+	if (!(inb(COM1 + LSR) & LSR_DR))
 		return -1;
-	return inb(COM1 + 0);
+	return inb(COM1 + RBR);
 }
 
+// Input is ready, or the transmitter wants more, or (from the
+// timer, see POLL_UART in trap.c) neither.
 void uartintr(void){
 	consoleintr(uartgetc);
+	if (uart.intr) {
+		acquire(&uart.lock);
+		uartstart();
+		release(&uart.lock);
+	}
 }
@@ -0,0 +1,113 @@
+// Batched system calls.
+//
+// uring_setup() maps a page shared with the kernel holding a
+// queue of requests and a queue of completions (struct uring, in
+// uring.h). The process queues any number of reads, writes,
+// opens, closes and fstats, then hands them all over with one
+// uring_enter(), which runs them in order and posts a completion
+// for each before it returns, so many small calls cost one kernel
+// entry. Nothing runs behind the process's back: the completions
+// are all there by the time uring_enter() returns.
+//
+// Each process has at most one ring page; mapping it again maps
+// the same page. The process may scribble on the page at any
+// time, so each request is copied out before it is looked at.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "mmu.h"
+#include "proc.h"
+#include "vfs.h"
+#include "file.h"
+#include "uring.h"
+
+static struct file* uringfd(int fd){
+	if (fd < 0 || fd >= NOFILE)
+		return 0;
+	return proc->files->ofile[fd];
+}
+
+// Check [addr, addr+n) as argptr() does.
+static int uringbuf(uintp addr, uint n){
+	if (n > 0x7FFFFFFF || addr + n > uvmlimit(proc, addr))
+		return -1;
+	return pageinrange(proc, addr, n);
+}
+
+static int uringdo(struct uring_sqe* e){
+	struct file* f;
+	char* path;
+
+	switch (e->op) {
+	case URING_NOP:
+		return 0;
+	case URING_READ:
+		if ((f = uringfd(e->fd)) == 0 || uringbuf(e->addr, e->len) < 0)
+			return -1;
+		return fileread(f, (char*)e->addr, e->len);
+	case URING_WRITE:
+		if ((f = uringfd(e->fd)) == 0 || uringbuf(e->addr, e->len) < 0)
+			return -1;
+		return filewrite(f, (char*)e->addr, e->len);
+	case URING_OPEN:
+		if (fetchstr(e->addr, &path) < 0)
+			return -1;
+		return openpath(path, e->flags);
+	case URING_CLOSE:
+		return closefd(e->fd);
+	case URING_FSTAT:
+		if ((f = uringfd(e->fd)) == 0 || uringbuf(e->addr, sizeof(struct stat)) < 0)
+			return -1;
+		return filestat(f, (struct stat*)e->addr);
+	}
+	return -1;
+}
+
+// Map the ring into the process. Returns its address, or 0.
+uintp uringsetup(void){
+	char* page;
+
+	if ((page = (char*)proc->uring) == 0) {
+		if ((page = kalloc_zeroed()) == 0)
+			return 0;
+		proc->uring = (struct uring*)page;
+	}
+	return mmapshared(proc, &page, 1);
+}
+
+// Run up to n queued requests, stopping early if the completion
+// queue fills. Returns how many ran.
+int uringenter(int n){
+	struct uring* r = proc->uring;
+	struct uring_sqe e;
+	struct uring_cqe* c;
+	uint head;
+	int done;
+
+	if (r == 0 || n < 0)
+		return -1;
+	head = r->sqhead;
+	for (done = 0; done < n && head != r->sqtail && !proc->killed; done++) {
+		if (r->cqtail - r->cqhead >= URING_ENTRIES)
+			break;
+		__sync_synchronize(); // the index, then the entry
+		e = r->sq[head % URING_ENTRIES];
+		r->sqhead = ++head;
+		c = &r->cq[r->cqtail % URING_ENTRIES];
+		c->res = uringdo(&e);
+		c->data = e.data;
+		__sync_synchronize(); // the entry, then the index
+		r->cqtail++;
+	}
+	return done;
+}
+
+// The process is done with its ring, though it may stay mapped.
+void uringrelease(struct proc* p){
+	if (p->uring) {
+		kfree((char*)p->uring);
+		p->uring = 0;
+	}
+}
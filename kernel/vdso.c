@@ -0,0 +1,78 @@
+// vDSO data pages.
+//
+// Every user address space maps two read-only pages just above
+// MMAPTOP (see vdso.h): one that all processes share, holding
+// ticks and the TSC calibration nsecs() uses, and one of the
+// process's own, with its pid and its parent's. ulib's ticks(),
+// clock_gettime(), getpid() and getppid() read them instead of
+// entering the kernel, which writes them through the direct map.
+//
+// Threads made by clone() share an address space but not a pid,
+// so cloning clears the pid and ulib falls back to the system
+// call.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "vdso.h"
+
+static struct vdsotime* vdsotime;
+
+// After clockinit().
+void vdsoinit(void){
+	if ((vdsotime = (struct vdsotime*)kalloc_zeroed()) == 0)
+		panic("vdsoinit");
+	clockparams(&vdsotime->tscboot, &vdsotime->tsckhz);
+}
+
+// ticks has moved on. Called with tickslock held.
+void vdsotick(uint t){
+	vdsotime->ticks = t;
+}
+
+// Map the pages into pgdir, for process pid whose parent is
+// ppid. Returns -1 if out of memory, leaving whatever was mapped
+// for freevm().
+int vdsomap(pde_t* pgdir, int pid, int ppid){
+	struct vdsoproc* v;
+
+	kref((char*)vdsotime);
+	if (mappages(pgdir, (char*)VDSO_TIME, PGSIZE, V2P(vdsotime), PTE_U) < 0) {
+		kfree((char*)vdsotime);
+		return -1;
+	}
+	if ((v = (struct vdsoproc*)kalloc_zeroed()) == 0)
+		return -1;
+	v->pid = pid;
+	v->ppid = ppid;
+	if (mappages(pgdir, (char*)VDSO_PROC, PGSIZE, V2P(v), PTE_U) < 0) {
+		kfree((char*)v);
+		return -1;
+	}
+	return 0;
+}
+
+static struct vdsoproc* vdsoproc(struct proc* p){
+	if (p->vm == 0 || p->vm->pgdir == 0)
+		return 0;
+	return (struct vdsoproc*)uva2ka(p->vm->pgdir, (char*)VDSO_PROC);
+}
+
+// p's address space is now shared with a thread.
+void vdsoshared(struct proc* p){
+	struct vdsoproc* v;
+
+	if ((v = vdsoproc(p)) != 0)
+		v->pid = 0;
+}
+
+// p has a new parent. Must hold ptable.lock.
+void vdsoreparent(struct proc* p){
+	struct vdsoproc* v;
+
+	if ((v = vdsoproc(p)) != 0 && v->pid == p->pid)
+		v->ppid = p->parent->pid;
+}
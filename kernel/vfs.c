@@ -9,6 +9,7 @@
 #include "stat.h"
 #include "fs/fs1.h"
 #include "fs/ext2.h"
+#include "fs/tmpfs.h"
 #include "spinlock.h"
 #include "buf.h"
 #include "defs.h"
@@ -16,124 +17,257 @@
 #include "kernel/string.h"
 #include "mmu.h"
 #include "proc.h"
+#include "slab.h"
+#include "shrinker.h"
 
+// The mounted devices, the file system each is mounted with and
+// the directory it is mounted on, 0 for the root. A mounted-on
+// directory is flagged I_MOUNT, and namex() steps across to the
+// root of what is mounted there; ".." from that root goes back.
 struct fsmap_t {
-	fstype type;
+	struct fsops *ops;
 	uint64 dev;
-	uint8 used;
+	struct inode *on;
+	uint8 used;     // 2 while being mounted
 };
 
+// The inode cache, for all file systems. Entries are found by
+// (dev, inum) through a hash table, and stay there when their
+// last reference goes, on an LRU list; iget() of a new inode
+// reuses the least recently used one once there are NICACHE.
+// ref and the lists are under icache.lock.
+#define NIHASH  64
+
 struct icache_node {
-    uint8 used;
-    struct inode inode;
-    struct icache_node *next;
+	struct inode inode;
+	struct icache_node *hnext;             // hash chain
+	struct icache_node *lnext, *lprev;     // LRU, while unreferenced
 };
 
 struct {
 	struct spinlock lock;
-    uint16 unused_nodes;
-    struct icache_node *head;
+	struct icache_node *hash[NIHASH];
+	struct icache_node lru;                // head; lnext is most recent
+	int n;
+	struct kmem_cache *cache;
 } icache;
 
-void growicache();
-static inline struct inode* iget(uint64 dev, uint32 inum);
 static char* skipelem(char* path, char* name);
 
 extern uint64 ROOT_DEV;
 struct fsmap_t fsmap[FS_MAX_INIT_DEV];
 struct spinlock lock;
 
-static inline fstype getfstype(uint64 dev) {
+static struct fsops *getfsops(uint64 dev) {
 	for(uint16 i = 0; i != FS_MAX_INIT_DEV; i++) {
 		struct fsmap_t map = fsmap[i];
 		if(map.used == 1 && map.dev == dev) {
-			return map.type;
+			return map.ops;
 		}
 	}
-	return -1;
+	return 0;
 }
 
-static inline int8 setfstype(uint64 dev, fstype type) {
+// Mount dev with the file system ops on the directory on, or as
+// the root if on is 0; its inodes use ops from then on. Keeps
+// the caller's reference to on. Returns 0, or -1 if on is not a
+// directory free to mount on, dev is already mounted, there's no
+// room, or the file system's mount fails.
+int vfsmount(uint dev, struct fsops *ops, struct inode *on) {
+	struct fsmap_t *map = 0;
+
+	if(on) {
+		ilock(on);
+		if(on->type != T_DIR || (on->flags & I_MOUNT))
+			goto bad;
+	}
 	acquire(&lock);
 	for(uint16 i = 0; i != FS_MAX_INIT_DEV; i++) {
-		struct fsmap_t *map = &fsmap[i];
-		if(map->used == 0) {
-			map->dev = dev;
-			map->type = type;
-			map->used = 1;
-
-			release(&lock);
-			return 1;
+		if(fsmap[i].used != 0 && fsmap[i].dev == dev) {
+			map = 0;
+			break;
 		}
+		if(fsmap[i].used == 0 && map == 0)
+			map = &fsmap[i];
+	}
+	if(map == 0) {
+		release(&lock);
+		goto bad;
 	}
+	map->dev = dev;
+	map->used = 2;
 	release(&lock);
+
+	if(ops->mount && ops->mount(dev) < 0) {
+		map->used = 0;
+		goto bad;
+	}
+	map->ops = ops;
+	map->on = on;
+	if(on) {
+		// Names cached under on are on the file system it hides.
+		namecachepurge(on->dev, on->inum);
+		on->flags |= I_MOUNT;
+		iunlock(on);
+	}
+	__sync_synchronize();
+	map->used = 1;
+	return 0;
+
+bad:
+	if(on)
+		iunlockput(on);
 	return -1;
 }
 
-void readsb(int dev, struct superblock *sb){
-	fstype t = getfstype(dev);
-	uint8 devtype = GETDEVTYPE(ROOT_DEV);
-	uint32 devnum = GETDEVNUM(ROOT_DEV);
+// If ip has a file system mounted on it, trade it for the root
+// of that one.
+static struct inode *mountdown(struct inode *ip) {
+	if(!(ip->flags & I_MOUNT))
+		return ip;
+	for(uint16 i = 0; i != FS_MAX_INIT_DEV; i++) {
+		struct fsmap_t *map = &fsmap[i];
+		if(map->used == 1 && map->on == ip) {
+			struct inode *root = iget(map->dev, map->ops->rootino);
+			iput(ip);
+			return root;
+		}
+	}
+	return ip;
+}
 
-	void *sbptr = &(sb->data[0]);
-	if(t == FS_TYPE_EXT2) {
-		ext2_readsb(devtype, devnum, (struct ext2_superblock *)sbptr);
-	} else if(t == FS_TYPE_FS1) {
-		fs1_readsb(dev, (struct fs1_superblock *)sbptr);
-	} else {
-		panic("Unknown fs type");
+// If ip is the root of a file system mounted on a directory,
+// trade it for that directory, where ".." leads up from.
+static struct inode *mountup(struct inode *ip) {
+	if(ip->inum != ip->ops->rootino)
+		return ip;
+	for(uint16 i = 0; i != FS_MAX_INIT_DEV; i++) {
+		struct fsmap_t *map = &fsmap[i];
+		if(map->used == 1 && map->dev == ip->dev && map->on) {
+			struct inode *on = idup(map->on);
+			iput(ip);
+			return on;
+		}
 	}
+	return ip;
+}
+
+void readsb(int dev, struct superblock *sb){
+	struct fsops *ops = getfsops(dev);
+	if(ops == 0)
+		panic("readsb: not mounted");
+	ops->readsb(dev, sb);
 }
 
 int dirlink(struct inode *dp, char *name, uint inum) {
-	fstype t = getfstype(dp->dev);
-	if(t == FS_TYPE_EXT2) {
-		return ext2_dirlink(dp, name, inum);
-	} else if(t == FS_TYPE_FS1) {
-		return fs1_dirlink(dp, name, inum);
-	} else {
-		panic("Unknown fs type");
-	}
+	namecacheremove(dp->dev, dp->inum, name); // may be cached as missing
+	return dp->ops->dirlink(dp, name, inum);
 }
 
 struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
-	fstype t = getfstype(dp->dev);
-	if(t == FS_TYPE_EXT2) {
-		return ext2_dirlookup(dp, name, poff);
-	} else if(t == FS_TYPE_FS1) {
-		return fs1_dirlookup(dp, name, poff);
-	} else {
-		panic("Unknown fs type");
-	}
+	return dp->ops->dirlookup(dp, name, poff);
+}
+
+int dirunlink(struct inode *dp, uint off) {
+	if(dp->ops->dirunlink == 0)
+		return -1;
+	return dp->ops->dirunlink(dp, off);
+}
+
+int isdirempty(struct inode *dp) {
+	return dp->ops->isdirempty(dp);
+}
+
+// Return the next entry of dp at or after *off, setting name (of
+// DIRSIZ bytes) and *inum and moving *off past it: 1 if there is
+// one, 0 at the end, -1 on error. Must hold dp locked.
+int readdir(struct inode *dp, uint *off, char *name, uint *inum) {
+	return dp->ops->readdir(dp, off, name, inum);
 }
 
 struct inode *ialloc(uint dev, short type) {
-	fstype t = getfstype(dev);
-	if(t == FS_TYPE_EXT2) {
-		return ext2_ialloc(dev, type);
-	} else if(t == FS_TYPE_FS1) {
-		return fs1_ialloc(dev, type);
-	} else {
-		panic("Unknown fs type");
-	}
+	struct fsops *ops = getfsops(dev);
+	if(ops == 0)
+		panic("ialloc: not mounted");
+	return ops->ialloc(dev, type);
 }
 
+// Increment reference count for ip.
+// Returns ip to enable ip = idup(ip1) idiom.
 struct inode *idup(struct inode *ip) {
-	fstype t = getfstype(ip->dev);
-	if(t == FS_TYPE_EXT2) {
-		return ext2_idup(ip);
-	} else if(t == FS_TYPE_FS1) {
-		return fs1_idup(ip);
-	} else {
-		panic("Unknown fs type");
-	}
+	acquire(&icache.lock);
+	ip->ref++;
+	release(&icache.lock);
+	return ip;
+}
+
+static void icachector(void* v){
+	struct icache_node *node = v;
+
+	memset(node, 0, sizeof(*node));
+	initsleeplock(&node->inode.lock, "inode");
+	initlock(&node->inode.maplock, "inode.map");
+	initlock(&node->inode.pclock, "inode.pc");
+}
+
+static struct icache_node **ihash(uint dev, uint inum) {
+	return &icache.hash[(inum * 2654435761U ^ dev) % NIHASH];
+}
+
+static void lruremove(struct icache_node *node) {
+	node->lprev->lnext = node->lnext;
+	node->lnext->lprev = node->lprev;
+}
+
+// Put node on the LRU list: at the front, or at the back to be
+// reused first.
+static void lruinsert(struct icache_node *node, int back) {
+	struct icache_node *at = back ? icache.lru.lprev : &icache.lru;
+
+	node->lnext = at->lnext;
+	node->lprev = at;
+	at->lnext->lprev = node;
+	at->lnext = node;
+}
+
+// Shrinker: drop the cached pages of unreferenced inodes, least
+// recently used first. The inodes stay cached. iget() allocates
+// holding icache.lock, so skip if this cpu holds it.
+static int ishrink(int n){
+	struct icache_node *node;
+	int freed = 0;
+
+	if (holding(&icache.lock))
+		return 0;
+	acquire(&icache.lock);
+	for (node = icache.lru.lprev; node != &icache.lru && freed < n; node = node->lprev)
+		if (node->inode.pcroot)
+			freed += pagecache_drop(&node->inode);
+	release(&icache.lock);
+	return freed;
 }
 
+static struct shrinker ishrinker = { "icache", ishrink };
+
 void vfsinit() {
 	fs1_iinit(); // fs1 needs an explicit init before we can invoke any methods
 
 	initlock(&lock, "vfs");
-	growicache();
+	namecacheinit();
+	pagecacheinit();
+	initlock(&icache.lock, "icache");
+	icache.lru.lnext = icache.lru.lprev = &icache.lru;
+	icache.cache = kmem_cache_create("icache", sizeof(struct icache_node), icachector);
+	register_shrinker(&ishrinker);
+
+	// A MEMFS kernel's root is the archive built into it, which
+	// initramfs() unpacks into tmpfs once there is the memory.
+	if(initramfs_present()) {
+		ROOT_DEV = TMPFS_DEV;
+		cprintf("root in memory, on tmpfs\n");
+		vfsmount(ROOT_DEV, &tmpfs_ops, 0);
+		return;
+	}
 
 	// for now, let's just run with the ROOT_DEVd
 	// later we will want to enumerate all devices
@@ -144,35 +278,24 @@ void vfsinit() {
 		// The current IDE driver does not work in kernel mode, so let's
 		// skip it. Otherwise, test to see if this is an ext2 FS.
 		cprintf("ext2 filesystem detected on disk(%d,%d)\n", devtype, devnum);
-		setfstype(ROOT_DEV, FS_TYPE_EXT2);
+		vfsmount(ROOT_DEV, &ext2_ops, 0);
 	} else {
 		// legacy fallback...
 		cprintf("xv6 filesystem assumed on disk(%d,%d)\n", devtype, devnum);
-		setfstype(ROOT_DEV, FS_TYPE_FS1);
+		vfsmount(ROOT_DEV, &fs1_ops, 0);
 	}
 }
 
-// Lock the given inode.
+// Lock the given inode exclusively.
 // Reads the inode from disk if necessary.
 void ilock(struct inode* ip){
 	if (ip == 0 || ip->ref < 1)
 		panic("ilock");
 
-	acquire(&lock);
-	while (ip->flags & I_BUSY)
-		sleep(ip, &lock);
-	ip->flags |= I_BUSY;
-	release(&lock);
+	acquiresleep(&ip->lock);
 
 	if (!(ip->flags & I_VALID)) {
-		fstype t = getfstype(ip->dev);
-		if(t == FS_TYPE_EXT2) {
-			ext2_readinode(ip);
-		} else if(t == FS_TYPE_FS1) {
-			fs1_readinode(ip);
-		} else {
-			panic("Unknown fs type");
-		}
+		ip->ops->readinode(ip);
 		ip->flags |= I_VALID;
 		if (ip->type == 0) {
 			cprintf("Error reading inode %d from disk\n", ip->inum);
@@ -181,6 +304,22 @@ void ilock(struct inode* ip){
 	}
 }
 
+// Lock the given inode shared with other readers, for code
+// that only reads the inode and its content.
+void ilockshared(struct inode* ip){
+	if (ip == 0 || ip->ref < 1)
+		panic("ilockshared");
+
+	acquiresleepshared(&ip->lock);
+	if (ip->flags & I_VALID)
+		return;
+
+	// Reading it in from disk needs the lock to ourselves.
+	releasesleep(&ip->lock);
+	ilock(ip);
+	downgradesleep(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode cache entry can
 // be recycled.
@@ -189,40 +328,43 @@ void ilock(struct inode* ip){
 // All calls to iput() must be inside a transaction in
 // case it has to free the inode.
 void iput(struct inode *ip) {
-	acquire(&lock);
+	int freed = 0;
+
+	// Let the file system give back what it set aside for the
+	// file's next writes; a reference taken meanwhile just finds
+	// it gone.
+	if (ip->ref == 1 && (ip->flags & I_VALID) && ip->ops->release)
+		ip->ops->release(ip);
+
+	acquire(&icache.lock);
 	if (ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0) {
 		// inode has no links and no other references: truncate and free.
-		if (ip->flags & I_BUSY)
+		if (sleeplocked(&ip->lock))
 			panic("iput busy");
-		ip->flags |= I_BUSY;
-		release(&lock);
-		fstype t = getfstype(ip->dev);
-		if(t == FS_TYPE_EXT2) {
-			ext2_itrunc(ip);
-		} else if(t == FS_TYPE_FS1) {
-			fs1_itrunc(ip);
-		} else {
-			panic("Unknown fs type");
-		}
+		acquiresleep(&ip->lock);
+		release(&icache.lock);
+		textcache_invalidate(ip->dev, ip->inum);
+		namecachepurge(ip->dev, ip->inum);
+		pagecache_drop(ip);
+		ip->ops->itrunc(ip);
 		ip->type = 0;
 		iupdate(ip);
-		acquire(&lock);
+		acquire(&icache.lock);
 		ip->flags = 0;
-		wakeup(ip);
+		releasesleep(&ip->lock);
+		freed = 1;
 	}
-	ip->ref--;
-	release(&lock);
+	if (--ip->ref == 0)
+		lruinsert((struct icache_node*)ip, freed);
+	release(&icache.lock);
 }
 
 // Unlock the given inode.
 void iunlock(struct inode *ip) {
-	if (ip == 0 || !(ip->flags & I_BUSY) || ip->ref < 1)
+	if (ip == 0 || !sleeplocked(&ip->lock) || ip->ref < 1)
 		panic("iunlock");
 
-	acquire(&lock);
-	ip->flags &= ~I_BUSY;
-	wakeup(ip);
-	release(&lock);
+	releasesleep(&ip->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -232,14 +374,7 @@ void iunlockput(struct inode *ip) {
 }
 
 void iupdate(struct inode *ip) {
-	fstype t = getfstype(ip->dev);
-	if(t == FS_TYPE_EXT2) {
-		ext2_iupdate(ip);
-	} else if(t == FS_TYPE_FS1) {
-		fs1_iupdate(ip);
-	} else {
-		panic("Unknown fs type");
-	}
+	ip->ops->iupdate(ip);
 }
 
 int namecmp(const char *s, const char *t) {
@@ -281,20 +416,82 @@ static char* skipelem(char* path, char* name){
 	return path;
 }
 
+// Walk path through the name cache alone, taking no locks
+// but one to reference the result. Returns 0 if any step
+// misses, leaving the caller to do it the slow way; also if
+// no step is taken, so the start inode is always the one
+// namex() would use. Sets *absent if a step is cached as
+// not existing, and there's no need to look further.
+static struct inode* namexcached(char* path, int nameiparent, char* name, int* absent){
+	uint dev, inum, next, parent = 0;
+	char last[DIRSIZ];
+	struct inode* ip;
+	int steps = 0, r;
+
+	*absent = 0;
+	if (getfsops(ROOT_DEV)->type != FS_TYPE_FS1)
+		return 0;
+	if (*path == '/') {
+		dev = ROOT_DEV;
+		inum = getfsops(ROOT_DEV)->rootino;
+	} else {
+		acquire(&proc->files->lock);
+		dev = proc->files->cwd->dev;
+		inum = proc->files->cwd->inum;
+		release(&proc->files->lock);
+	}
+
+	while ((path = skipelem(path, name)) != 0) {
+		if (nameiparent && *path == '\0')
+			break;
+		if ((r = namecachelookup(dev, inum, name, &next)) <= 0) {
+			*absent = r < 0;
+			return 0;
+		}
+		parent = inum;
+		memmove(last, name, DIRSIZ);
+		inum = next;
+		steps++;
+	}
+	if (steps == 0 || (nameiparent && path == 0))
+		return 0;
+
+	// The name may have been unlinked since we looked; once we
+	// hold a reference, seeing it still cached means the inode
+	// can't be freed under us.
+	ip = iget(dev, inum);
+	if (namecachelookup(dev, parent, last, &next) <= 0 || next != inum) {
+		iput(ip);
+		return 0;
+	}
+	return ip;
+}
+
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
 // Must be called inside a transaction since it calls iput().
 static struct inode* namex(char* path, int nameiparent, char* name){
 	struct inode* ip, * next;
+	int absent;
+
+	if ((ip = namexcached(path, nameiparent, name, &absent)) != 0 || absent)
+		return ip;
 
 	if (*path == '/')
-		ip = iget(ROOT_DEV, ROOTINO);
-	else
-		ip = idup(proc->cwd);
+		ip = iget(ROOT_DEV, getfsops(ROOT_DEV)->rootino);
+	else {
+		// chdir() in another thread may be replacing it.
+		acquire(&proc->files->lock);
+		ip = idup(proc->files->cwd);
+		release(&proc->files->lock);
+	}
 
+	// Directories on the way are only read, so lock them shared.
 	while ((path = skipelem(path, name)) != 0) {
-		ilock(ip);
+		if (namecmp(name, "..") == 0)
+			ip = mountup(ip);
+		ilockshared(ip);
 		if (ip->type != T_DIR) {
 			iunlockput(ip);
 			return 0;
@@ -305,9 +502,17 @@ static struct inode* namex(char* path, int nameiparent, char* name){
 			return ip;
 		}
 		if ((next = dirlookup(ip, name, 0)) == 0) {
+			if (!ip->ops->nonamecache)
+				namecachenegative(ip->dev, ip->inum, name);
 			iunlockput(ip);
 			return 0;
 		}
+		// A step onto another file system isn't cached; the cache
+		// only knows inums on the one it started on.
+		if (next->flags & I_MOUNT)
+			next = mountdown(next);
+		else if (!ip->ops->nonamecache)
+			namecacheenter(ip->dev, ip->inum, name, next->inum);
 		iunlockput(ip);
 		ip = next;
 	}
@@ -333,100 +538,104 @@ int readi(struct inode *ip, char *dst, uint off, uint n) {
 			return -1;
 		return devsw[ip->major].read(ip, dst, n);
 	}
-	// otherwise, we need to route this to the correct fs impl.
-	fstype t = getfstype(ip->dev);
-	if(t == FS_TYPE_EXT2) {
-		return ext2_readi(ip, dst, off, n);
-	} else if(t == FS_TYPE_FS1) {
-		return fs1_readi(ip, dst, off, n);
-	} else {
-		panic("Unknown fs type");
+	// otherwise, it's up to the file system.
+	if (ip->type == T_FILE && ip->ops->pagecache)
+		return pagecache_read(ip, dst, off, n);
+	return ip->ops->readi(ip, dst, off, n);
+}
+
+// Prefetch [off, off+n) of ip into the buffer cache, if its
+// file system knows how.
+void readaheadi(struct inode *ip, uint off, uint n) {
+	if (ip->type != T_FILE)
+		return;
+	// What the page cache has needn't be read again.
+	while (ip->ops->pagecache && n > 0 && pagecache_has(ip, off / PGSIZE)) {
+		uint m = PGSIZE - off % PGSIZE;
+		if (m >= n)
+			return;
+		off += m;
+		n -= m;
 	}
+	if (ip->ops->readahead)
+		ip->ops->readahead(ip, off, n);
 }
 
 void stati(struct inode *ip, struct stat *st) {
-	fstype t = getfstype(ip->dev);
-	if(t == FS_TYPE_EXT2) {
-		ext2_stati(ip, st);
-	} else if(t == FS_TYPE_FS1) {
-		fs1_stati(ip, st);
-	} else {
-		panic("Unknown fs type");
-	}
+	ip->ops->stati(ip, st);
+}
+
+// Wait for ip's changes so far to be on disk. ip needn't be
+// locked. Nothing to do for a file system without fsync.
+int fsynci(struct inode *ip) {
+	if (ip->ops->fsync == 0)
+		return 0;
+	return ip->ops->fsync(ip);
 }
 
 int writei(struct inode *ip, char *src, uint off, uint n) {
+	int r;
+
 	if (ip->type == T_DEV) {
 		// same idea as readi...
 		if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write)
 			return -1;
 		return devsw[ip->major].write(ip, src, n);
 	}
-	fstype t = getfstype(ip->dev);
-	if(t == FS_TYPE_EXT2) {
-		return ext2_writei(ip, src, off, n);
-	} else if(t == FS_TYPE_FS1) {
-		return fs1_writei(ip, src, off, n);
-	} else {
-		panic("Unknown fs type");
-	}
+	textcache_invalidate(ip->dev, ip->inum);
+	if ((r = ip->ops->writei(ip, src, off, n)) > 0 && ip->type == T_FILE && ip->ops->pagecache)
+		pagecache_write(ip, src, off, r);
+	return r;
 }
 
-static inline struct inode* iget(uint64 dev, uint32 inum){
-	struct inode* ip, * empty;
+// Find the inode with number inum on device dev
+// and return the in-memory copy. Does not lock
+// the inode and does not read it from disk.
+struct inode* iget(uint dev, uint inum){
+	struct icache_node **hp, *node;
+	struct inode* ip;
+	struct fsops *ops;
 
-	acquire(&lock);
+	if ((ops = getfsops(dev)) == 0)
+		panic("iget: not mounted");
+	acquire(&icache.lock);
 
 	// Is the inode already cached?
-	empty = 0;
-    for (struct icache_node *node = icache.head; node->next != 0; node = node->next) {
-        ip = &(node->inode);
-		if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-			ip->ref++;
-			release(&lock);
+	for (node = *ihash(dev, inum); node != 0; node = node->hnext) {
+		ip = &node->inode;
+		if (ip->dev == dev && ip->inum == inum) {
+			if (ip->ref++ == 0)
+				lruremove(node);
+			release(&icache.lock);
 			return ip;
 		}
-		if (empty == 0 && ip->ref == 0) // Remember empty slot.
-			empty = ip;
 	}
 
-	// Recycle an inode cache entry.
-	if (empty == 0) {
-        growicache();
-        release(&lock);
-		return iget(dev, inum);
-    }
+	// Add a new entry, or recycle the least recently used one.
+	if (icache.n < NICACHE || icache.lru.lprev == &icache.lru) {
+		if ((node = kmem_cache_alloc(icache.cache)) == 0)
+			panic("iget: no inodes");
+		icache.n++;
+	} else {
+		node = icache.lru.lprev;
+		lruremove(node);
+		for (hp = ihash(node->inode.dev, node->inode.inum); *hp != node; hp = &(*hp)->hnext)
+			;
+		*hp = node->hnext;
+		pagecache_drop(&node->inode);
+	}
+	hp = ihash(dev, inum);
+	node->hnext = *hp;
+	*hp = node;
 
-	ip = empty;
+	ip = &node->inode;
 	ip->dev = dev;
 	ip->inum = inum;
 	ip->ref = 1;
 	ip->flags = 0;
-	release(&lock);
+	ip->ops = ops;
+	release(&icache.lock);
 
 	return ip;
 }
 
-// only call this function if you hold a lock on the cache!
-void growicache() {
-    void *ptr = (void *)kalloc();
-    memset(ptr, 0, 4096);
-    uint16 allot = 4096 / sizeof(struct icache_node);
-    uint16 offset = 0;
-    struct icache_node *last;
-    if (icache.head == 0) {
-        icache.head = (struct icache_node *)ptr;
-        offset++;
-        last = icache.head;
-    } else {
-        last = icache.head;
-        while(last->next != 0) {
-            last = last->next;
-        }
-    }
-    while(allot > offset) {
-        last->next = ((struct icache_node *)ptr) + offset++;
-        last = last->next;
-    }
-    icache.unused_nodes += allot;
-}
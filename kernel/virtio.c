@@ -0,0 +1,264 @@
+// Virtio PCI transport and split virtqueues.
+//
+// A modern virtio device describes where its register blocks
+// live with vendor-specific PCI capabilities; virtio_pci_init()
+// finds them, resets the device and acknowledges it. The driver
+// then negotiates features, sets up its queues and declares
+// itself ready.
+//
+// Each queue takes one page for its descriptor table and rings.
+// Free descriptors are chained through their next fields; a
+// request is a chain taken from there, put on the available ring
+// and handed back once it shows up on the used ring. Callers
+// hold vq->lock around all of the virtq_ functions.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "pci.h"
+#include "virtio.h"
+#include "kernel/string.h"
+
+// Map a register block: offset off in BAR bar.
+static volatile uint8* virtio_bar(struct pci_func *f, int bar, uint32 off){
+	uint32 hi = 0;
+	uint64 base;
+
+	if (bar > 5 || f->reg_base[bar] == 0)
+		return 0;
+	// 64-bit BARs must still have been put below 4GB.
+	if (bar < 5 && (pci_conf_read(f, PCI_BAR0_OFFSET + 4 * bar) & 0x7) == PCI_MAPREG_MEM_TYPE_64BIT)
+		hi = pci_conf_read(f, PCI_BAR0_OFFSET + 4 * (bar + 1));
+	base = f->reg_base[bar] + (uint64)off;
+	if (hi != 0 || base < DEVSPACE) {
+		cprintf("   virtio: BAR%d at 0x%x out of reach\n", bar, f->reg_base[bar]);
+		return 0;
+	}
+	return (volatile uint8*)IO2V(base);
+}
+
+int virtio_pci_init(struct virtio_pci *vp, struct pci_func *f){
+	uint32 ptr;
+
+	memset(vp, 0, sizeof(*vp));
+	pci_func_enable(f);
+	if ((pci_conf_read(f, PCI_COMMAND_STATUS_REG) & PCI_STATUS_CAPLIST) == 0)
+		return -1;
+	for (ptr = pci_conf_read(f, PCI_CAPLIST_REG) & 0xFC; ptr; ) {
+		uint32 hdr = pci_conf_read(f, ptr);
+		uint32 next = (hdr >> 8) & 0xFC;
+		if ((hdr & 0xFF) == PCI_CAP_ID_VNDR) {
+			int bar = pci_conf_read(f, ptr + 4) & 0xFF;
+			uint32 off = pci_conf_read(f, ptr + 8);
+			volatile uint8 *p;
+
+			switch ((hdr >> 24) & 0xFF) {
+			case VIRTIO_PCI_CAP_COMMON:
+				if (vp->common == 0 && (p = virtio_bar(f, bar, off)) != 0)
+					vp->common = (virtio_common_cfg*)p;
+				break;
+			case VIRTIO_PCI_CAP_NOTIFY:
+				if (vp->notify == 0 && (p = virtio_bar(f, bar, off)) != 0) {
+					vp->notify = p;
+					vp->notify_mult = pci_conf_read(f, ptr + 16);
+				}
+				break;
+			case VIRTIO_PCI_CAP_ISR:
+				if (vp->isr == 0)
+					vp->isr = virtio_bar(f, bar, off);
+				break;
+			case VIRTIO_PCI_CAP_DEVICE:
+				if (vp->device == 0)
+					vp->device = virtio_bar(f, bar, off);
+				break;
+			}
+		}
+		ptr = next;
+	}
+	if (vp->common == 0 || vp->notify == 0 || vp->isr == 0)
+		return -1;
+
+	vp->irq = f->irq_line;
+	if (vp->irq == 0 || vp->irq >= IRQ_ERROR)
+		vp->irq = -1;
+
+	vp->common->device_status = 0; // reset
+	while (vp->common->device_status != 0)
+		amd64_nop();
+	vp->common->msix_config = VIRTIO_NO_VECTOR;
+	vp->common->device_status = VIRTIO_STAT_ACK;
+	vp->common->device_status |= VIRTIO_STAT_DRIVER;
+	return 0;
+}
+
+// Accept the features in wanted that the device offers, which
+// must include VIRTIO_F_VERSION_1. Returns 0 and sets *features
+// to what was agreed, or -1.
+int virtio_negotiate(struct virtio_pci *vp, uint64 wanted, uint64 *features){
+	uint64 offered;
+
+	vp->common->device_feature_select = 0;
+	offered = vp->common->device_feature;
+	vp->common->device_feature_select = 1;
+	offered |= (uint64)vp->common->device_feature << 32;
+	if ((offered & VIRTIO_F_VERSION_1) == 0)
+		return -1;
+	*features = offered & (wanted | VIRTIO_F_VERSION_1);
+
+	vp->common->driver_feature_select = 0;
+	vp->common->driver_feature = (uint32)*features;
+	vp->common->driver_feature_select = 1;
+	vp->common->driver_feature = (uint32)(*features >> 32);
+	vp->common->device_status |= VIRTIO_STAT_FEATURES_OK;
+	if ((vp->common->device_status & VIRTIO_STAT_FEATURES_OK) == 0)
+		return -1;
+	return 0;
+}
+
+void virtio_ready(struct virtio_pci *vp){
+	vp->common->device_status |= VIRTIO_STAT_DRIVER_OK;
+}
+
+void virtio_fail(struct virtio_pci *vp){
+	vp->common->device_status |= VIRTIO_STAT_FAILED;
+}
+
+// Read device configuration at off, consistently with respect to
+// other fields read at the same time.
+uint32 virtio_config32(struct virtio_pci *vp, int off){
+	uint8 gen;
+	uint32 v;
+
+	do {
+		gen = vp->common->config_generation;
+		v = *(volatile uint32*)(vp->device + off);
+	} while (gen != vp->common->config_generation);
+	return v;
+}
+
+uint64 virtio_config64(struct virtio_pci *vp, int off){
+	uint8 gen;
+	uint64 v;
+
+	do {
+		gen = vp->common->config_generation;
+		v = *(volatile uint32*)(vp->device + off);
+		v |= (uint64)*(volatile uint32*)(vp->device + off + 4) << 32;
+	} while (gen != vp->common->config_generation);
+	return v;
+}
+
+uint16 virtio_config16(struct virtio_pci *vp, int off){
+	return *(volatile uint16*)(vp->device + off);
+}
+
+// Set up queue index, signalling completions on MSI-X table
+// entry vector (VIRTIO_NO_VECTOR for the INTx line).
+int virtq_init(struct virtio_pci *vp, struct virtq *vq, int index, int vector){
+	char *page;
+	uint64 pa;
+	uint16 size;
+
+	vp->common->queue_select = index;
+	if ((size = vp->common->queue_size) == 0)
+		return -1;
+	if (size > VIRTQ_MAX)
+		size = VIRTQ_MAX;
+	if ((page = kalloc()) == 0)
+		return -1;
+	memset(page, 0, PGSIZE);
+
+	initlock(&vq->lock, "virtq");
+	vq->vp = vp;
+	vq->index = index;
+	vq->size = size;
+	vq->desc = (struct virtq_desc*)page;
+	vq->avail = (struct virtq_avail*)(page + VIRTQ_MAX * sizeof(struct virtq_desc));
+	vq->used = (struct virtq_used*)(page +
+		((VIRTQ_MAX * sizeof(struct virtq_desc) + sizeof(struct virtq_avail) + 3) & ~3));
+	for (int i = 0; i < size; i++)
+		vq->desc[i].next = i + 1;
+	vq->freehead = 0;
+	vq->nfree = size;
+	vq->lastused = 0;
+
+	vp->common->queue_size = size;
+	vp->common->queue_msix_vector = vector;
+	if (vp->common->queue_msix_vector != vector) {
+		kfree(page);
+		return -1;
+	}
+	pa = V2P(vq->desc);
+	vp->common->queue_desc_lo = (uint32)pa;
+	vp->common->queue_desc_hi = (uint32)(pa >> 32);
+	pa = V2P(vq->avail);
+	vp->common->queue_driver_lo = (uint32)pa;
+	vp->common->queue_driver_hi = (uint32)(pa >> 32);
+	pa = V2P(vq->used);
+	vp->common->queue_device_lo = (uint32)pa;
+	vp->common->queue_device_hi = (uint32)(pa >> 32);
+	vq->notify = (volatile uint16*)(vp->notify + vp->common->queue_notify_off * vp->notify_mult);
+	vp->common->queue_enable = 1;
+	return 0;
+}
+
+// Take a chain of n descriptors, linked with VIRTQ_DESC_NEXT.
+// Returns its head, or -1 if there aren't that many free.
+int virtq_alloc(struct virtq *vq, int n){
+	int head, d;
+
+	if (n <= 0 || n > vq->nfree)
+		return -1;
+	head = d = vq->freehead;
+	for (int i = 0; i < n; i++) {
+		vq->desc[d].flags = i < n - 1 ? VIRTQ_DESC_NEXT : 0;
+		if (i < n - 1)
+			d = vq->desc[d].next;
+	}
+	vq->freehead = vq->desc[d].next;
+	vq->nfree -= n;
+	return head;
+}
+
+// Return the chain starting at head to the free list.
+void virtq_free(struct virtq *vq, int head){
+	int d = head;
+
+	vq->nfree++;
+	while (vq->desc[d].flags & VIRTQ_DESC_NEXT) {
+		d = vq->desc[d].next;
+		vq->nfree++;
+	}
+	vq->desc[d].next = vq->freehead;
+	vq->freehead = head;
+}
+
+// Make the chain at head available to the device and tell it.
+void virtq_submit(struct virtq *vq, int head){
+	vq->avail->ring[vq->avail->idx % vq->size] = head;
+	__sync_synchronize(); // descriptors before the index
+	vq->avail->idx++;
+	__sync_synchronize(); // index before the notification
+	*vq->notify = vq->index;
+}
+
+// Take the next finished chain off the used ring, returning its
+// head and setting *len to the bytes the device wrote, or -1 if
+// there is none.
+int virtq_reap(struct virtq *vq, uint32 *len){
+	volatile struct virtq_used_elem *e;
+
+	if (vq->lastused == vq->used->idx)
+		return -1;
+	__sync_synchronize(); // index before the entry
+	e = &vq->used->ring[vq->lastused % vq->size];
+	vq->lastused++;
+	if (len)
+		*len = e->len;
+	return e->id;
+}
@@ -0,0 +1,286 @@
+// Virtio block device driver.
+//
+// Each disk has up to VBLK_MAXQ request queues (one unless the
+// device offers VIRTIO_BLK_F_MQ), picked by the submitting CPU.
+// A request is a descriptor chain of the header, the data
+// segments and a status byte; any number may be in flight on a
+// queue at once, up to its size. Completions arrive on the used
+// ring and the interrupt handler wakes their waiters, with a
+// one-tick timer in case an interrupt goes missing. With MSI-X
+// each queue has its own vector, aimed at the CPU using it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "ktimer.h"
+#include "buf.h"
+#include "pci.h"
+#include "ahci.h"
+#include "virtio.h"
+#include "kernel/string.h"
+
+#define VBLK_MAX      4          // disks
+#define VBLK_MAXQ     4          // request queues per disk
+#define VBLK_SEGBYTES (4 << 20)  // largest segment without SIZE_MAX
+
+struct vblkq {
+	struct virtq vq;
+	struct virtio_blk_req *hdr;  // per chain head, with status
+	uint8 *status;
+	uint8 done[VIRTQ_MAX];       // chain head showed up on the used ring
+};
+
+struct vblk {
+	struct virtio_pci vp;
+	struct vblkq q[VBLK_MAXQ];
+	int nq;
+	uint64 capacity;             // sectors
+	uint32 segmax;               // data segments per request
+	uint32 sizemax;              // bytes per segment
+	int ro;
+	int intr;                    // completions interrupt
+};
+
+static struct vblk vblks[VBLK_MAX];
+static int nvblk;
+static irqhandler vblkchain[MAX_IRQS]; // whoever had the line before us
+static struct vblkq *vblkirq[MAX_IRQS]; // queue of each MSI-X vector
+
+extern uint64 ROOT_DEV;
+
+// Mark the requests the device has finished. Must hold q->vq.lock.
+static void vblk_collect(struct vblkq *q){
+	int head;
+
+	while ((head = virtq_reap(&q->vq, 0)) >= 0)
+		q->done[head] = 1;
+}
+
+// Wait for something to happen on q. Must hold q->vq.lock.
+static void vblk_block(struct vblk *d, struct vblkq *q){
+	if (d->intr && proc) {
+		sleep(q, &q->vq.lock);
+	} else {
+		release(&q->vq.lock);
+		amd64_nop();
+		acquire(&q->vq.lock);
+		vblk_collect(q);
+	}
+}
+
+static void vblkintr(uint16 irq){
+	for (int i = 0; i < nvblk; i++) {
+		struct vblk *d = &vblks[i];
+		if (d->vp.irq != irq)
+			continue;
+		// Reading the ISR status acknowledges the interrupt.
+		if ((*d->vp.isr & VIRTIO_ISR_QUEUE) == 0)
+			continue;
+		for (int j = 0; j < d->nq; j++) {
+			acquire(&d->q[j].vq.lock);
+			vblk_collect(&d->q[j]);
+			wakeup(&d->q[j]);
+			release(&d->q[j].vq.lock);
+		}
+	}
+	if (vblkchain[irq])
+		vblkchain[irq](irq);
+}
+
+static void vblkmsix(uint16 irq){
+	struct vblkq *q = vblkirq[irq];
+
+	acquire(&q->vq.lock);
+	vblk_collect(q);
+	wakeup(q);
+	release(&q->vq.lock);
+}
+
+// Transfer between the sectors starting at lba and the buffers in
+// sg, in order, as one request. Returns VIRTIO_BLK_S_OK or an
+// error status.
+int virtio_blk_rw(uint32 dev, uint64 lba, struct sata_sg *sg, int nsg, int write){
+	struct ktimer t;
+	struct vblk *d;
+	struct vblkq *q;
+	struct virtq_desc *desc;
+	uint64 nsect = 0;
+	int head, dsc, ndesc = 2, slept = 0, r;
+
+	if (dev >= nvblk)
+		return VIRTIO_BLK_S_IOERR;
+	d = &vblks[dev];
+	for (int i = 0; i < nsg; i++) {
+		if (sg[i].len == 0 || sg[i].len % SECTOR_SIZE)
+			panic("virtio_blk_rw: bad segment");
+		nsect += sg[i].len / SECTOR_SIZE;
+		ndesc += (sg[i].len + d->sizemax - 1) / d->sizemax;
+	}
+	if ((write && d->ro) || lba + nsect > d->capacity || ndesc - 2 > d->segmax)
+		return VIRTIO_BLK_S_IOERR;
+
+	q = &d->q[cpu->id % d->nq];
+	desc = q->vq.desc;
+	acquire(&q->vq.lock);
+	while ((head = virtq_alloc(&q->vq, ndesc)) < 0)
+		vblk_block(d, q);
+
+	q->hdr[head].type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	q->hdr[head].reserved = 0;
+	q->hdr[head].sector = lba;
+	q->status[head] = 0xFF;
+	q->done[head] = 0;
+	dsc = head;
+	desc[dsc].addr = V2P(&q->hdr[head]);
+	desc[dsc].len = sizeof(struct virtio_blk_req);
+	for (int i = 0; i < nsg; i++) {
+		uint64 addr = V2P(sg[i].buf);
+		uint32 len = sg[i].len;
+		while (len > 0) {
+			uint32 chunk = len < d->sizemax ? len : d->sizemax;
+			dsc = desc[dsc].next;
+			desc[dsc].addr = addr;
+			desc[dsc].len = chunk;
+			if (!write)
+				desc[dsc].flags |= VIRTQ_DESC_WRITE;
+			addr += chunk;
+			len -= chunk;
+		}
+	}
+	dsc = desc[dsc].next;
+	desc[dsc].addr = V2P(&q->status[head]);
+	desc[dsc].len = 1;
+	desc[dsc].flags |= VIRTQ_DESC_WRITE;
+	virtq_submit(&q->vq, head);
+
+	memset(&t, 0, sizeof(t));
+	for (;;) {
+		vblk_collect(q);
+		if (q->done[head])
+			break;
+		if (d->intr && proc) {
+			ktimerset(&t, ticks + 1, wakeup, q);
+			sleep(q, &q->vq.lock);
+			slept = 1;
+		} else {
+			amd64_nop();
+		}
+	}
+	if (slept)
+		ktimercancel(&t);
+	r = q->status[head];
+	virtq_free(&q->vq, head);
+	wakeup(q); // descriptors are free again
+	release(&q->vq.lock);
+	return r;
+}
+
+// Attach a virtio-blk PCI function; called from pci.c.
+// Returns 1 if it is driven from now on.
+int virtio_blk_attach(struct pci_func *f){
+	struct vblk *d;
+	uint64 features;
+	int nq, i, msix;
+	char *page;
+
+	cprintf("virtio-blk found (bus=%d, slot=%d, func=%d)\n", f->bus->busno, f->dev, f->func);
+	if (nvblk == VBLK_MAX) {
+		cprintf("   too many virtio disks, ignoring\n");
+		return 0;
+	}
+	d = &vblks[nvblk];
+	if (virtio_pci_init(&d->vp, f) < 0 || d->vp.device == 0) {
+		cprintf("   no virtio 1.0 interface\n");
+		return 0;
+	}
+	if (virtio_negotiate(&d->vp, VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX |
+	                     VIRTIO_BLK_F_RO | VIRTIO_BLK_F_MQ, &features) < 0) {
+		cprintf("   feature negotiation failed\n");
+		virtio_fail(&d->vp);
+		return 0;
+	}
+
+	nq = (features & VIRTIO_BLK_F_MQ) ? virtio_config16(&d->vp, VIRTIO_BLK_CFG_NUMQ) : 1;
+	if (nq > VBLK_MAXQ)
+		nq = VBLK_MAXQ;
+	if (nq > ncpu)
+		nq = ncpu;
+	msix = pci_msix_count(f) >= nq;
+	for (i = 0; i < nq; i++) {
+		int vector = VIRTIO_NO_VECTOR;
+		if (msix) {
+			int irq = pci_msix_vector(f, i, vblkmsix, i);
+			if (irq >= 0) {
+				vblkirq[irq] = &d->q[i];
+				vector = i;
+			} else if (i == 0) {
+				msix = 0;
+			} else {
+				break;
+			}
+		}
+		if ((page = kalloc()) == 0)
+			break;
+		if (virtq_init(&d->vp, &d->q[i].vq, i, vector) < 0) {
+			kfree(page);
+			break;
+		}
+		memset(page, 0, PGSIZE);
+		d->q[i].hdr = (struct virtio_blk_req*)page;
+		d->q[i].status = (uint8*)(page + VIRTQ_MAX * sizeof(struct virtio_blk_req));
+	}
+	if (i == 0) {
+		cprintf("   no request queue\n");
+		virtio_fail(&d->vp);
+		return 0;
+	}
+	d->nq = i;
+
+	d->capacity = virtio_config64(&d->vp, VIRTIO_BLK_CFG_CAPACITY);
+	d->sizemax = VBLK_SEGBYTES;
+	if (features & VIRTIO_BLK_F_SIZE_MAX) {
+		uint32 sm = virtio_config32(&d->vp, VIRTIO_BLK_CFG_SIZE_MAX) & ~(SECTOR_SIZE - 1);
+		if (sm != 0 && sm < d->sizemax)
+			d->sizemax = sm;
+	}
+	d->segmax = (uint32)-1;
+	if (features & VIRTIO_BLK_F_SEG_MAX)
+		d->segmax = virtio_config32(&d->vp, VIRTIO_BLK_CFG_SEG_MAX);
+	for (i = 0; i < d->nq; i++)
+		if (d->q[i].vq.size - 2 < d->segmax)
+			d->segmax = d->q[i].vq.size - 2;
+	d->ro = (features & VIRTIO_BLK_F_RO) != 0;
+	virtio_ready(&d->vp);
+
+	uint32 devNum = nvblk++;
+	cprintf("   %d sectors, %d queue(s)%s\n", (uint)d->capacity, d->nq, d->ro ? ", read-only" : "");
+	cprintf("   Init success: disk(%d, %d)\n", DEV_VIRTIO, devNum);
+	if (devNum == 0 && GETDEVTYPE(ROOT_DEV) == DEV_IDE)
+		ROOT_DEV = TODEVNUM(DEV_VIRTIO, 0);
+
+	if (msix) {
+		cprintf("   MSI-X, a vector per queue\n");
+		d->vp.irq = -1;
+		d->intr = 1;
+		return 1;
+	}
+	if (d->vp.irq < 0) {
+		cprintf("   no interrupt line, polling\n");
+		return 1;
+	}
+	irqhandler prev = get_registered_handler(d->vp.irq);
+	if (prev != vblkintr) {
+		vblkchain[d->vp.irq] = prev;
+		irq_register_handler(d->vp.irq, vblkintr);
+		picenable(d->vp.irq);
+		ioapicenable(d->vp.irq, 0);
+	}
+	d->intr = 1;
+	return 1;
+}
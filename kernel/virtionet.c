@@ -0,0 +1,233 @@
+// Virtio network device driver.
+//
+// Queue 0 receives and queue 1 sends, one descriptor per frame.
+// Every receive descriptor holds a whole page from kalloc(),
+// which the device fills with a virtio_net_hdr and the frame; the
+// page goes up to net.c as it is and a fresh one takes its place.
+// A frame to send already has NETHEADROOM in front of it, so its
+// header goes in the same page and the page is the descriptor;
+// sent pages are freed when the next send or poll finds them on
+// the used ring, the send queue never interrupting.
+//
+// The receive queue's interrupt, an MSI-X vector of its own where
+// there is one, turns itself off with VIRTQ_AVAIL_F_NO_INTERRUPT
+// and schedules a poll; see net.c.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "poll.h"
+#include "ktimer.h"
+#include "pci.h"
+#include "virtio.h"
+#include "net.h"
+#include "kernel/string.h"
+
+#define VNET_MAX   2             // cards
+#define VNET_RXBUF 64            // pages posted to receive into
+#define VNET_HDR   sizeof(struct virtio_net_hdr)
+
+struct vnet {
+	struct netdev nd;
+	struct virtio_pci vp;
+	struct virtq rx, tx;
+	char *rxpage[VIRTQ_MAX];     // by descriptor
+	char *txpage[VIRTQ_MAX];
+	int msix;
+};
+
+static struct vnet vnets[VNET_MAX];
+static int nvnet;
+static irqhandler vnetchain[MAX_IRQS]; // whoever had the line before us
+static struct vnet *vnetirq[MAX_IRQS]; // card of each MSI-X vector
+
+// Free the pages the device has finished sending. Must hold d->tx.lock.
+static void vnet_txreap(struct vnet *d){
+	int head;
+
+	while ((head = virtq_reap(&d->tx, 0)) >= 0) {
+		kfree(d->txpage[head]);
+		d->txpage[head] = 0;
+		virtq_free(&d->tx, head);
+	}
+}
+
+// Give the device page to receive into. Must hold d->rx.lock.
+static int vnet_rxpost(struct vnet *d, char *page){
+	int head;
+
+	if ((head = virtq_alloc(&d->rx, 1)) < 0)
+		return -1;
+	d->rx.desc[head].addr = V2P(page);
+	d->rx.desc[head].len = PGSIZE;
+	d->rx.desc[head].flags = VIRTQ_DESC_WRITE;
+	d->rxpage[head] = page;
+	virtq_submit(&d->rx, head);
+	return 0;
+}
+
+static int vnet_xmit(struct netdev *nd, char *page, int off, int len){
+	struct vnet *d = (struct vnet*)nd;
+	char *hdr = page + off - VNET_HDR;
+	int head;
+
+	memset(hdr, 0, VNET_HDR);
+	acquire(&d->tx.lock);
+	vnet_txreap(d);
+	if ((head = virtq_alloc(&d->tx, 1)) < 0) {
+		release(&d->tx.lock);
+		kfree(page);
+		return -1;
+	}
+	d->tx.desc[head].addr = V2P(hdr);
+	d->tx.desc[head].len = VNET_HDR + len;
+	d->txpage[head] = page;
+	virtq_submit(&d->tx, head);
+	release(&d->tx.lock);
+	return 0;
+}
+
+static int vnet_rxpoll(struct netdev *nd, int budget){
+	struct vnet *d = (struct vnet*)nd;
+	char *page, *fresh;
+	uint32 len;
+	int head, n = 0;
+
+	acquire(&d->tx.lock);
+	vnet_txreap(d);
+	release(&d->tx.lock);
+
+	acquire(&d->rx.lock);
+	while (n < budget && (head = virtq_reap(&d->rx, &len)) >= 0) {
+		page = d->rxpage[head];
+		virtq_free(&d->rx, head);
+		n++;
+		// Without a page to post instead, this one goes back.
+		if (len <= VNET_HDR || (fresh = kalloc()) == 0) {
+			nd->rxdrops++;
+			vnet_rxpost(d, page);
+			continue;
+		}
+		vnet_rxpost(d, fresh);
+		release(&d->rx.lock);
+		netrxput(nd, page, VNET_HDR, len - VNET_HDR);
+		acquire(&d->rx.lock);
+	}
+	release(&d->rx.lock);
+	return n;
+}
+
+static int vnet_irqon(struct netdev *nd){
+	struct vnet *d = (struct vnet*)nd;
+	int more;
+
+	acquire(&d->rx.lock);
+	d->rx.avail->flags = 0;
+	__sync_synchronize(); // flag before the look at the used ring
+	more = d->rx.lastused != d->rx.used->idx;
+	release(&d->rx.lock);
+	return more;
+}
+
+static void vnet_schedule(struct vnet *d){
+	d->rx.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+	netschedule(&d->nd);
+}
+
+static void vnetintr(uint16 irq){
+	for (int i = 0; i < nvnet; i++) {
+		struct vnet *d = &vnets[i];
+		// Reading the ISR status acknowledges the interrupt.
+		if (d->vp.irq == irq && (*d->vp.isr & VIRTIO_ISR_QUEUE))
+			vnet_schedule(d);
+	}
+	if (vnetchain[irq])
+		vnetchain[irq](irq);
+}
+
+static void vnetmsix(uint16 irq){
+	vnet_schedule(vnetirq[irq]);
+}
+
+// Attach a virtio-net PCI function; called from pci.c.
+// Returns 1 if it is driven from now on.
+int virtio_net_attach(struct pci_func *f){
+	struct vnet *d;
+	uint64 features;
+	int vector = VIRTIO_NO_VECTOR, irq, i;
+	char *page;
+
+	cprintf("virtio-net found (bus=%d, slot=%d, func=%d)\n", f->bus->busno, f->dev, f->func);
+	if (nvnet == VNET_MAX) {
+		cprintf("   too many virtio network cards, ignoring\n");
+		return 0;
+	}
+	d = &vnets[nvnet];
+	if (virtio_pci_init(&d->vp, f) < 0 || d->vp.device == 0) {
+		cprintf("   no virtio 1.0 interface\n");
+		return 0;
+	}
+	if (virtio_negotiate(&d->vp, VIRTIO_NET_F_MAC | VIRTIO_NET_F_MTU, &features) < 0) {
+		cprintf("   feature negotiation failed\n");
+		virtio_fail(&d->vp);
+		return 0;
+	}
+	if (pci_msix_count(f) >= 1 && (irq = pci_msix_vector(f, 0, vnetmsix, 0)) >= 0) {
+		vnetirq[irq] = d;
+		vector = 0;
+		d->msix = 1;
+	}
+	if (virtq_init(&d->vp, &d->rx, 0, vector) < 0 ||
+	    virtq_init(&d->vp, &d->tx, 1, VIRTIO_NO_VECTOR) < 0) {
+		cprintf("   no queues\n");
+		virtio_fail(&d->vp);
+		return 0;
+	}
+	d->tx.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+	d->rx.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT; // until the first poll is done
+	if (features & VIRTIO_NET_F_MAC)
+		for (i = 0; i < 6; i++)
+			d->nd.mac[i] = d->vp.device[VIRTIO_NET_CFG_MAC + i];
+	if (features & VIRTIO_NET_F_MTU)
+		d->nd.mtu = virtio_config16(&d->vp, VIRTIO_NET_CFG_MTU);
+	if (d->nd.mtu > PGSIZE - NETHEADROOM - ETH_HLEN)
+		d->nd.mtu = PGSIZE - NETHEADROOM - ETH_HLEN;
+	d->nd.xmit = vnet_xmit;
+	d->nd.rxpoll = vnet_rxpoll;
+	d->nd.irqon = vnet_irqon;
+	virtio_ready(&d->vp);
+	acquire(&d->rx.lock);
+	for (i = 0; i < VNET_RXBUF && (page = kalloc()) != 0; i++)
+		if (vnet_rxpost(d, page) < 0) {
+			kfree(page);
+			break;
+		}
+	release(&d->rx.lock);
+
+	if (d->msix) {
+		cprintf("   MSI-X\n");
+		d->vp.irq = -1;
+	}
+	d->nd.irq = d->msix || d->vp.irq >= 0;
+	if (netregister(&d->nd) < 0) {
+		cprintf("   too many network devices\n");
+		virtio_fail(&d->vp);
+		return 0;
+	}
+	nvnet++;
+	if (d->vp.irq >= 0) {
+		irqhandler prev = get_registered_handler(d->vp.irq);
+		if (prev != vnetintr) {
+			vnetchain[d->vp.irq] = prev;
+			irq_register_handler(d->vp.irq, vnetintr);
+			picenable(d->vp.irq);
+			ioapicenable(d->vp.irq, 0);
+		}
+	}
+	return 1;
+}
@@ -6,6 +6,8 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "file.h"
+#include "swap.h"
 #include "kernel/string.h"
 
 extern char data[];  // defined by kernel.ld
@@ -13,33 +15,92 @@ pde_t* kpgdir;  // for use in scheduler()
 struct segdesc gdt[NSEGS];
 
 
+// Return the address of the entry for virtual address va in
+// the four-level page table pgdir (the PML4), at the level that
+// translates bits leafshift and up: PTXSHIFT for a PTE, PDXSHIFT
+// for a page directory entry. A PTE_PS entry found on the way
+// maps va itself and is returned instead. If alloc!=0, create
+// any required page table pages.
+static pte_t* walk(pde_t* pgdir, const void* va, int leafshift, int alloc){
+	pde_t* pde;
+	pde_t* t = pgdir;
+	int shift;
+
+	for (shift = PML4XSHIFT; shift > leafshift; shift -= 9) {
+		pde = &t[((uintp)va >> shift) & PXMASK];
+		if (*pde & PTE_P) {
+			if (*pde & PTE_PS)
+				return pde;
+			t = (pde_t*)p2v(PTE_ADDR(*pde));
+		} else {
+			// kalloc_zeroed makes sure all those PTE_P bits are zero.
+			if (!alloc || (t = (pde_t*)kalloc_zeroed()) == 0)
+				return 0;
+			// The permissions here are overly generous, but they can
+			// be further restricted by the permissions in the page table
+			// entries, if necessary.
+			*pde = v2p(t) | PTE_P | PTE_W | PTE_U;
+		}
+	}
+	return &t[((uintp)va >> leafshift) & PXMASK];
+}
+
 // Return the address of the PTE in page table pgdir
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page table pages.
-static pte_t* walkpgdir(pde_t* pgdir, const void* va, int alloc){
+// that corresponds to virtual address va, or of the
+// PTE_PS directory entry if va is in a huge page.
+// If alloc!=0, create any required page table pages.
+pte_t* walkpgdir(pde_t* pgdir, const void* va, int alloc){
+	return walk(pgdir, va, PTXSHIFT, alloc);
+}
+
+// Map the HUGEPGSIZE page mem from kalloc_huge() at the 2 MB
+// aligned user address va. Returns -1 if va is already backed
+// by a page table or the directory cannot be allocated.
+int mapuvmhuge(pde_t* pgdir, uintp va, char* mem, int perm){
 	pde_t* pde;
-	pte_t* pgtab;
 
-	pde = &pgdir[PDX(va)];
-	if (*pde & PTE_P) {
-		pgtab = (pte_t*)p2v(PTE_ADDR(*pde));
-	} else {
-		if (!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-			return 0;
-		// Make sure all those PTE_P bits are zero.
-		memset(pgtab, 0, PGSIZE);
-		// The permissions here are overly generous, but they can
-		// be further restricted by the permissions in the page table
-		// entries, if necessary.
-		*pde = v2p(pgtab) | PTE_P | PTE_W | PTE_U;
+	if ((pde = walk(pgdir, (void*)va, PDXSHIFT, 1)) == 0 || (*pde & PTE_P))
+		return -1;
+	*pde = v2p(mem) | perm | PTE_PS | PTE_P;
+	return 0;
+}
+
+// Replace the huge page mapped by *pde with a page table of
+// 4 KB PTEs for the same memory, so that part of it can be
+// unmapped. A huge page still shared copy-on-write is copied
+// first. Returns -1 if out of memory.
+static int hugesplit(pde_t* pde){
+	pte_t* pt;
+	char* mem, * copy;
+	uintp flags;
+	int i;
+
+	mem = p2v(PTE_ADDR(*pde));
+	flags = PTE_FLAGS(*pde) & ~PTE_PS;
+	if ((pt = (pte_t*)kalloc_zeroed()) == 0)
+		return -1;
+	if (krefcount(mem) > 1) {
+		if ((copy = kalloc_huge()) == 0) {
+			kfree((char*)pt);
+			return -1;
+		}
+		memmove(copy, mem, HUGEPGSIZE);
+		kfree(mem);
+		mem = copy;
+		if (flags & PTE_COW)
+			flags = (flags & ~PTE_COW) | PTE_W;
 	}
-	return &pgtab[PTX(va)];
+	ksplit(mem);
+	for (i = 0; i < NPTENTRIES; i++)
+		pt[i] = v2p(mem + i * PGSIZE) | flags;
+	*pde = v2p(pt) | PTE_P | PTE_W | PTE_U;
+	return 0;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
-static int mappages(pde_t* pgdir, void* va, uintp size, uintp pa, int perm){
+int mappages(pde_t* pgdir, void* va, uintp size, uintp pa, int perm){
 	char* a, * last;
 	pte_t* pte;
 
@@ -66,8 +127,7 @@ void inituvm(pde_t* pgdir, char* init, uint sz){
 
 	if (sz >= PGSIZE)
 		panic("inituvm: more than a page");
-	mem = kalloc();
-	memset(mem, 0, PGSIZE);
+	mem = kalloc_zeroed();
 	mappages(pgdir, 0, PGSIZE, v2p(mem), PTE_W | PTE_U);
 	memmove(mem, init, sz);
 }
@@ -75,7 +135,8 @@ void inituvm(pde_t* pgdir, char* init, uint sz){
 // Load a program segment into pgdir.  addr must be page-aligned
 // and the pages from addr to addr+sz must already be mapped.
 int loaduvm(pde_t* pgdir, char* addr, struct inode* ip, uint offset, uint sz){
-	uint i, pa, n;
+	uint i, n;
+	uintp pa;
 	pte_t* pte;
 
 	if ((uintp)addr % PGSIZE != 0)
@@ -96,34 +157,53 @@ int loaduvm(pde_t* pgdir, char* addr, struct inode* ip, uint offset, uint sz){
 
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
-int allocuvm(pde_t* pgdir, uint oldsz, uint newsz){
+// If huge is set, 2 MB aligned runs that fit are backed by huge pages
+// while the buddy allocator can supply them.
+static uintp uvmalloc(pde_t* pgdir, uintp oldsz, uintp newsz, int huge){
 	char* mem;
 	uintp a;
 
-	if (newsz >= KERNBASE)
+	if (newsz >= USERTOP)
 		return 0;
 	if (newsz < oldsz)
 		return oldsz;
 
 	a = PGROUNDUP(oldsz);
 	for (; a < newsz; a += PGSIZE) {
-		mem = kalloc();
+		if (huge && a % HUGEPGSIZE == 0 && a + HUGEPGSIZE <= newsz) {
+			if ((mem = kalloc_huge()) != 0) {
+				if (mapuvmhuge(pgdir, a, mem, PTE_W | PTE_U) == 0) {
+					a += HUGEPGSIZE - PGSIZE;
+					continue;
+				}
+				kfree(mem);
+			}
+		}
+		mem = kalloc_zeroed();
 		if (mem == 0) {
 			cprintf("allocuvm out of memory\n");
 			deallocuvm(pgdir, newsz, oldsz);
 			return 0;
 		}
-		memset(mem, 0, PGSIZE);
 		mappages(pgdir, (char*)a, PGSIZE, v2p(mem), PTE_W | PTE_U);
 	}
 	return newsz;
 }
 
+uintp allocuvm(pde_t* pgdir, uintp oldsz, uintp newsz){
+	return uvmalloc(pgdir, oldsz, newsz, 0);
+}
+
+// allocuvm, using huge pages where possible.
+uintp allocuvmhuge(pde_t* pgdir, uintp oldsz, uintp newsz){
+	return uvmalloc(pgdir, oldsz, newsz, 1);
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
 // process size.  Returns the new process size.
-int deallocuvm(pde_t* pgdir, uintp oldsz, uintp newsz){
+uintp deallocuvm(pde_t* pgdir, uintp oldsz, uintp newsz){
 	pte_t* pte;
 	uintp a, pa;
 
@@ -134,32 +214,67 @@ int deallocuvm(pde_t* pgdir, uintp oldsz, uintp newsz){
 	for (; a < oldsz; a += PGSIZE) {
 		pte = walkpgdir(pgdir, (char*)a, 0);
 		if (!pte)
-			a += (NPTENTRIES - 1) * PGSIZE;
-		else if ((*pte & PTE_P) != 0) {
+			// skip to the last page this page table would map
+			a = (a & ~((uintp)NPTENTRIES * PGSIZE - 1)) + (NPTENTRIES - 1) * PGSIZE;
+		else if (*pte & PTE_PS) {
+			// Free a huge page whole, or split it if only
+			// part of it is going away.
+			uintp base = a & ~(HUGEPGSIZE - 1);
+			if (base < PGROUNDUP(newsz) || base + HUGEPGSIZE > oldsz) {
+				if (hugesplit(pte) < 0) {
+					cprintf("deallocuvm out of memory\n");
+					return oldsz;
+				}
+				a -= PGSIZE;
+				continue;
+			}
+			kfree(p2v(PTE_ADDR(*pte)));
+			*pte = 0;
+			a = base + HUGEPGSIZE - PGSIZE;
+		} else if ((*pte & PTE_P) != 0) {
 			pa = PTE_ADDR(*pte);
 			if (pa == 0)
 				panic("kfree");
 			char* v = p2v(pa);
 			kfree(v);
 			*pte = 0;
+		} else if (*pte & PTE_SWAP) {
+			swapfree(*pte);
+			*pte = 0;
 		}
 	}
 	return newsz;
 }
 
+// Free page table t, which is level tables above the PTEs,
+// along with every page it maps.
+static void freewalk(pde_t* t, int level){
+	int i;
+
+	for (i = 0; i < NPTENTRIES; i++) {
+		if (level == 0 && (t[i] & (PTE_P | PTE_SWAP)) == PTE_SWAP)
+			swapfree(t[i]);
+		if (!(t[i] & PTE_P))
+			continue;
+		if (level > 0 && !(t[i] & PTE_PS))
+			freewalk((pde_t*)p2v(PTE_ADDR(t[i])), level - 1);
+		else
+			kfree(p2v(PTE_ADDR(t[i])));
+		if (level == 1)
+			cond_resched(); // every 2 MB or so
+	}
+	kfree((char*)t);
+}
+
 // Free a page table and all the physical memory pages
 // in the user part.
 void freevm(pde_t* pgdir){
 	uint i;
 	if (pgdir == 0)
 		panic("freevm: no pgdir");
-	deallocuvm(pgdir, 0x3fa00000, 0);
-	for (i = 0; i < NPDENTRIES - 2; i++) {
-		if (pgdir[i] & PTE_P) {
-			char* v = p2v(PTE_ADDR(pgdir[i]));
-			kfree(v);
-		}
-	}
+	for (i = 0; i < PML4X(USERTOP); i++)
+		if (pgdir[i] & PTE_P)
+			freewalk((pde_t*)p2v(PTE_ADDR(pgdir[i])), 2);
 	kfree((char*)pgdir);
 }
 
@@ -175,58 +290,281 @@ void clearpteu(pde_t* pgdir, char* uva){
 }
 
 // Given a parent process's page table, create a copy
-// of it for a child.
-pde_t* copyuvm(pde_t* pgdir, uint sz){
+// of it for a child. Pages are shared rather than copied:
+// writable pages become read-only PTE_COW in both tables
+// and are copied by cowfault() on the first write.
+pde_t* copyuvm(pde_t* pgdir, uintp sz){
 	pde_t* d;
-	pte_t* pte;
-	uintp pa, i, flags;
-	char* mem;
 
 	if ((d = setupkvm()) == 0)
 		return 0;
-	for (i = 0; i < sz; i += PGSIZE) {
-		if ((pte = walkpgdir(pgdir, (void*)i, 0)) == 0)
-			panic("copyuvm: pte should exist");
+	if (copyuvmrange(pgdir, d, 0, sz) < 0) {
+		freevm(d);
+		return 0;
+	}
+	return d;
+}
+
+// Share the present pages of [start, end) in pgdir with d,
+// marking writable ones copy-on-write in both. If pgdir is the
+// current process's, the caller holds its vm->lock (and vmlock()),
+// which is let go now and then for other processes to run, once
+// the pages shared so far are read-only on every cpu.
+int copyuvmrange(pde_t* pgdir, pde_t* d, uintp start, uintp end){
+	pte_t* pte;
+	uintp pa, i, flags;
+	int r = 0;
+
+	for (i = start; i < end; i += PGSIZE) {
+		if (pgdir == proc->vm->pgdir && i % (NPTENTRIES * PGSIZE) == 0 && sliceover()) {
+			uvmflush(0);
+			release(&proc->vm->lock);
+			cond_resched();
+			acquire(&proc->vm->lock);
+		}
+		// Pages exec() has not paged in yet are left for
+		// the child to fault in from its own copy of useg[].
+		if ((pte = walkpgdir(pgdir, (void*)i, 0)) == 0) {
+			// skip to the last page this page table would map
+			i = (i & ~((uintp)NPTENTRIES * PGSIZE - 1)) + (NPTENTRIES - 1) * PGSIZE;
+			continue;
+		}
+		if ((*pte & (PTE_P | PTE_SWAP)) == PTE_SWAP) {
+			// Share the slot, as a page would be.
+			pte_t* cpte;
+			if ((cpte = walkpgdir(d, (void*)i, 1)) == 0) {
+				r = -1;
+				break;
+			}
+			swapdup(*pte);
+			*cpte = *pte;
+			continue;
+		}
 		if (!(*pte & PTE_P))
-			panic("copyuvm: page not present");
+			continue;
+		if (*pte & PTE_W)
+			*pte = (*pte & ~PTE_W) | PTE_COW;
 		pa = PTE_ADDR(*pte);
 		flags = PTE_FLAGS(*pte);
-		if ((mem = kalloc()) == 0)
-			goto bad;
-		memmove(mem, (char*)p2v(pa), PGSIZE);
-		if (mappages(d, (void*)i, PGSIZE, v2p(mem), flags) < 0)
-			goto bad;
+		if (flags & PTE_PS) {
+			if (mapuvmhuge(d, i, p2v(pa), flags & ~(PTE_PS | PTE_P)) < 0) {
+				r = -1;
+				break;
+			}
+			kref(p2v(pa));
+			i = (i & ~(HUGEPGSIZE - 1)) + HUGEPGSIZE - PGSIZE;
+			continue;
+		}
+		if (mappages(d, (void*)i, PGSIZE, pa, flags) < 0) {
+			r = -1;
+			break;
+		}
+		kref(p2v(pa));
 	}
-	return d;
+	// The parent just lost write access to its pages.
+	if (pgdir == proc->vm->pgdir)
+		uvmflush(0);
+	return r;
+}
 
-bad:
-	freevm(d);
-	return 0;
+// Resolve a write to the copy-on-write page holding uva in
+// pgdir, copying it unless this is the last reference. Threads
+// sharing the current address space are kept out by vm->lock.
+// Returns 1 if the page is writable now, 0 if uva is not a
+// copy-on-write page and -1 if out of memory.
+int cowfault(pde_t* pgdir, char* uva){
+	pte_t* pte;
+	char* old, * mem;
+	int huge, r;
+
+	if ((uintp)uva >= USERTOP || (pte = walkpgdir(pgdir, uva, 0)) == 0)
+		return 0;
+	if (pgdir == proc->vm->pgdir)
+		acquire(&proc->vm->lock);
+	if ((*pte & (PTE_P | PTE_U | PTE_W)) == (PTE_P | PTE_U | PTE_W)) {
+		// Another thread got here first.
+		r = 1;
+		goto out;
+	}
+	if ((*pte & (PTE_P | PTE_U | PTE_COW)) != (PTE_P | PTE_U | PTE_COW)) {
+		r = 0;
+		goto out;
+	}
+
+	old = p2v(PTE_ADDR(*pte));
+	huge = (*pte & PTE_PS) != 0;
+	if (krefcount(old) == 1) {
+		*pte = (*pte & ~PTE_COW) | PTE_W;
+	} else {
+		if ((mem = huge ? kalloc_huge() : kalloc()) == 0) {
+			r = -1;
+			goto out;
+		}
+		memmove(mem, old, huge ? HUGEPGSIZE : PGSIZE);
+		*pte = v2p(mem) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+		kfree(old);
+	}
+	if (pgdir == proc->vm->pgdir)
+		uvmflush((char*)PGROUNDDOWN((uintp)uva));
+	r = 1;
+out:
+	if (pgdir == proc->vm->pgdir)
+		release(&proc->vm->lock);
+	return r;
+}
+
+
+static int pageinexe(struct proc* p, uintp a);
+
+// Fault in the page holding uva from swap (see swapin), from the
+// executable segments recorded by exec(), zero-filling past the
+// end of file data, or from its mmap() region (see vmapagein).
+// Pages with file data are shared through the text cache and
+// mapped copy-on-write. May sleep reading the inode, so no
+// spinlocks may be held.
+// Returns 1 if the page is mapped now, 0 if uva is not a
+// demand-paged address and -1 on error.
+int pagein(struct proc* p, char* uva){
+	uintp a;
+	pte_t* pte;
+	int r;
+
+	a = PGROUNDDOWN((uintp)uva);
+	if ((pte = walkpgdir(p->vm->pgdir, (char*)a, 0)) != 0 && (*pte & PTE_P))
+		return 0;
+	// Another thread may have faulted it in while we waited.
+	vmlock(p->vm);
+	if ((pte = walkpgdir(p->vm->pgdir, (char*)a, 0)) != 0 && (*pte & PTE_P))
+		r = 0;
+	else if (pte && (*pte & PTE_SWAP))
+		r = swapin(p, a, pte);
+	else if (a >= p->vm->sz)
+		r = vmapagein(p, a);
+	else
+		r = pageinexe(p, a);
+	vmunlock(p->vm);
+	return r;
+}
+
+// pagein() for a page below sz. Must hold vmlock(p->vm).
+static int pageinexe(struct proc* p, uintp a){
+	uintp lo, hi;
+	struct useg* s;
+	int perm;
+	char* mem;
+	int i, found, filedata;
+
+	if (p->vm->exe == 0)
+		return 0;
+
+	found = 0;
+	for (i = 0; i < p->vm->nuseg; i++) {
+		s = &p->vm->useg[i];
+		if (s->vaddr < a + PGSIZE && s->vaddr + s->memsz > a)
+			found = 1;
+	}
+	if (!found)
+		return 0;
+
+	if ((mem = textcache_get(p->vm->exe->dev, p->vm->exe->inum, a)) != 0) {
+		if (mappages(p->vm->pgdir, (char*)a, PGSIZE, v2p(mem), PTE_U | PTE_COW) < 0) {
+			kfree(mem);
+			return -1;
+		}
+		return 1;
+	}
+
+	if ((mem = kalloc_zeroed()) == 0)
+		return -1;
+	filedata = 0;
+	ilockshared(p->vm->exe);
+	for (i = 0; i < p->vm->nuseg; i++) {
+		s = &p->vm->useg[i];
+		lo = s->vaddr > a ? s->vaddr : a;
+		hi = s->vaddr + s->filesz < a + PGSIZE ? s->vaddr + s->filesz : a + PGSIZE;
+		if (lo >= hi)
+			continue;
+		filedata = 1;
+		if (readi(p->vm->exe, mem + (lo - a), s->off + (lo - s->vaddr), hi - lo) != hi - lo) {
+			iunlock(p->vm->exe);
+			kfree(mem);
+			return -1;
+		}
+	}
+	iunlock(p->vm->exe);
+
+	perm = PTE_W | PTE_U;
+	if (filedata) {
+		textcache_put(p->vm->exe->dev, p->vm->exe->inum, a, mem);
+		perm = PTE_U | PTE_COW;
+	}
+	if (mappages(p->vm->pgdir, (char*)a, PGSIZE, v2p(mem), perm) < 0) {
+		kfree(mem);
+		return -1;
+	}
+	return 1;
+}
+
+// Map into pgdir, copy-on-write as pageinexe() would, the pages
+// of exe's segments the text cache holds, so a process running a
+// binary run lately faults only on the rest.
+void premapexe(pde_t* pgdir, struct inode* exe, struct useg* useg, int nuseg){
+	pte_t* pte;
+	char* mem;
+
+	for (int i = 0; i < nuseg; i++) {
+		for (uintp a = PGROUNDDOWN(useg[i].vaddr); a < useg[i].vaddr + useg[i].filesz; a += PGSIZE) {
+			if ((pte = walkpgdir(pgdir, (char*)a, 0)) != 0 && (*pte & PTE_P))
+				continue; // shared with the segment before
+			if ((mem = textcache_get(exe->dev, exe->inum, a)) == 0)
+				continue;
+			if (mappages(pgdir, (char*)a, PGSIZE, v2p(mem), PTE_U | PTE_COW) < 0) {
+				kfree(mem);
+				return;
+			}
+		}
+	}
 }
 
+// Page in any not-yet-loaded pages of [uva, uva+len) so the
+// kernel can touch them while holding locks.
+int pageinrange(struct proc* p, uintp uva, uintp len){
+	uintp a;
+
+	for (a = PGROUNDDOWN(uva); a < uva + len; a += PGSIZE)
+		if (pagein(p, (char*)a) < 0)
+			return -1;
+	return 0;
+}
 
 // Map user virtual address to kernel address.
 char* uva2ka(pde_t* pgdir, char* uva){
 	pte_t* pte;
 
 	pte = walkpgdir(pgdir, uva, 0);
-	if ((*pte & PTE_P) == 0)
+	if (pte == 0 || (*pte & PTE_P) == 0)
 		return 0;
 	if ((*pte & PTE_U) == 0)
 		return 0;
+	if (*pte & PTE_PS)
+		return (char*)p2v(PTE_ADDR(*pte)) + (PGROUNDDOWN((uintp)uva) & (HUGEPGSIZE - 1));
 	return (char*)p2v(PTE_ADDR(*pte));
 }
 
 // Copy len bytes from p to user address va in page table pgdir.
 // Most useful when pgdir is not the current page table.
 // uva2ka ensures this only works for PTE_U pages.
-int copyout(pde_t* pgdir, uint va, void* p, uint len){
+int copyout(pde_t* pgdir, uintp va, void* p, uintp len){
 	char* buf, * pa0;
 	uintp n, va0;
 
 	buf = (char*)p;
 	while (len > 0) {
-		va0 = (uint)PGROUNDDOWN(va);
+		va0 = PGROUNDDOWN(va);
+		if (pgdir == proc->vm->pgdir && pagein(proc, (char*)va0) < 0)
+			return -1;
+		if (cowfault(pgdir, (char*)va0) < 0)
+			return -1;
 		pa0 = uva2ka(pgdir, (char*)va0);
 		if (pa0 == 0)
 			return -1;
@@ -240,3 +578,47 @@ int copyout(pde_t* pgdir, uint va, void* p, uint len){
 	}
 	return 0;
 }
+
+// Is [va, va+len) below USERTOP?
+static int isuser(uintp va, uintp len){
+	return len <= USERTOP && va <= USERTOP - len;
+}
+
+// Copy len bytes from user address src in the current process,
+// through its page table. Pages not yet in are faulted in, unless
+// the caller holds a spinlock, in which case the copy fails; see
+// uprefault(). Returns 0, or -1 if any of it isn't mapped.
+int copy_from_user(void* dst, uintp src, uintp len){
+	if (!isuser(src, len) || copyuser(dst, (void*)src, len) != 0)
+		return -1;
+	return 0;
+}
+
+// Copy len bytes to user address dst in the current process,
+// as copy_from_user() does.
+int copy_to_user(uintp dst, void* src, uintp len){
+	if (!isuser(dst, len) || copyuser((void*)dst, src, len) != 0)
+		return -1;
+	return 0;
+}
+
+// Fault in [va, va+len) of the current process, writable if write
+// is set, for a caller whose copy faulted with a spinlock held and
+// can retry it without. Returns -1 if some of it can't be mapped.
+int uprefault(uintp va, uintp len, int write){
+	pte_t* pte;
+	uintp a;
+
+	if (!isuser(va, len) || pageinrange(proc, va, len) < 0)
+		return -1;
+	for (a = PGROUNDDOWN(va); a < va + len; a += PGSIZE) {
+		if (write && cowfault(proc->vm->pgdir, (char*)a) < 0)
+			return -1;
+		pte = walkpgdir(proc->vm->pgdir, (char*)a, 0);
+		if (pte == 0 || (*pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U))
+			return -1;
+		if (write && (*pte & PTE_W) == 0)
+			return -1;
+	}
+	return 0;
+}
@@ -31,18 +31,41 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "traps.h"
 #include "kernel/string.h"
 
 __thread struct cpu* cpu;
 __thread struct proc* proc;
+__thread uintp syscallstack;   // top of proc's kernel stack; see syscallentry
+__thread uintp syscallusp;     // user %rsp while syscallentry switches stacks
+
+extern int CPU_PCID;
+extern int CPU_PDPE1GB;
+extern int CPU_PAT;
 
 static pde_t* kpml4;
+static uint64 nextmmid = 1;
 static pde_t* kpdpt;
 static pde_t* iopgdir;
 static pde_t* kpgdir0;
 static pde_t* kpgdir1;
+static pde_t* fbpgdir;
 
 void wrmsr(uint msr, uint64 val);
+uint64 rdmsr(uint msr);
+
+#define MSR_EFER   0xC0000080
+#define MSR_STAR   0xC0000081
+#define MSR_LSTAR  0xC0000082
+#define MSR_FMASK  0xC0000084
+#define MSR_PAT    0x00000277
+#define MSR_FSBASE 0xC0000100
+
+// PAT entries 0-7: WB WT UC- UC WC WT UC- UC
+#define PAT_DEFAULT_WC4 0x0007040100070406ULL
+#define MSR_GSBASE 0xC0000101
+
+#define EFER_SCE   0x1         // SYSCALL/SYSRET enable
 
 void tvinit(void) {
 }
@@ -66,37 +89,55 @@ static void tss_set_rsp(uint* tss, uint n, uint64 rsp) {
 }
 
 extern void* vectors[];
+extern void syscallentry(void);
 
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
+// The pages seginit() needs on each cpu: IDT, cpu-local storage
+// and the double fault stack. The boot cpu takes the APs' for them
+// in segalloc(), as they start while kalloc() doesn't lock yet.
+static char* segpages[NCPU][3];
+
+void segalloc(int id){
+	for (int i = 0; i < 3; i++)
+		if ((segpages[id][i] = kalloc()) == 0)
+			panic("segalloc");
+}
+
 void seginit(void){
 	uint64* gdt;
 	uint* tss;
 	uint64 addr;
 	void* local;
 	struct cpu* c;
-	uint* idt = (uint*)kalloc();
-	int n;
+	uint* idt;
+	int n, id = cpunum();
+
+	if (segpages[id][0] == 0)
+		segalloc(id);
+	idt = (uint*)segpages[id][0];
 	memset(idt, 0, PGSIZE);
 
 	for (n = 0; n < 256; n++)
 		mkgate(idt, n, vectors[n], 0, 0);
 	mkgate(idt, 64, vectors[64], 3, 1);
+	idt[T_DBLFLT * 4 + 1] |= 1; // on IST1, in case a kernel stack overflowed
 
 	lidt((void*)idt, PGSIZE);
 
 	// create a page for cpu local storage
-	local = kalloc();
+	local = segpages[id][1];
 	memset(local, 0, PGSIZE);
 
 	gdt = (uint64*)local;
 	tss = (uint*)(((char*)local) + 1024);
 	tss[16] = 0x00680000; // IO Map Base = End of TSS
+	tss_set_rsp(tss, 4, (uint64)segpages[id][2] + PGSIZE); // IST1, for double faults
 
 	// point FS smack in the middle of our local storage page
-	wrmsr(0xC0000100, ((uint64)local) + (PGSIZE / 2));
+	wrmsr(MSR_FSBASE, ((uint64)local) + (PGSIZE / 2));
 
-	c = &cpus[cpunum()];
+	c = &cpus[id];
 	c->local = local;
 
 	cpu = c;
@@ -116,36 +157,101 @@ void seginit(void){
 	lgdt((void*)gdt, 8 * sizeof(uint64));
 
 	ltr(SEG_TSS << 3);
+
+	// SYSCALL enters at syscallentry with the kernel's segments
+	// and interrupts off; SYSRET goes back to SEG_UCODE, taking
+	// the stack segment from the slot below it. INT T_SYSCALL
+	// still works too.
+	wrmsr(MSR_STAR, ((uint64)((SEG_UDATA - 1) << 3) << 48) | ((uint64)(SEG_KCODE << 3) << 32));
+	wrmsr(MSR_LSTAR, (uint64)syscallentry);
+	wrmsr(MSR_FMASK, FL_IF | FL_TF | FL_DF | FL_AC | FL_NT);
+	wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+
+	// PCID 0 is the kernel's; switchuvm hands out the rest.
+	if (CPU_PCID && (rcr3() & 0xFFF) == 0)
+		lcr4(rcr4() | CR4_PCIDE);
+
+	// The power-on PAT, but entry 4 (PTE_PS_PAT alone) is
+	// write-combining, for fbmap(). Nothing maps with entries 4-7
+	// yet, so no cached data changes type.
+	if (CPU_PAT)
+		wrmsr(MSR_PAT, PAT_DEFAULT_WC4);
 };
 
-// The core xv6 code only knows about two levels of page tables,
-// so we will create all four, but only return the second level.
-// because we need to find the other levels later, we'll stash
-// backpointers to them in the top two entries of the level two
-// table.
+// Map len bytes of framebuffer at physical pa at FBBASE, in 2 MB
+// pages, write-combining where there is a PAT and uncached
+// otherwise. Returns the address of pa, or 0.
+char* fbmap(uint64 pa, uint64 len){
+	uint64 base = pa & ~(HUGEPGSIZE - 1);
+	int n;
+
+	if (len == 0 || pa + len - base > (1UL << PDPTXSHIFT))
+		return 0;
+	if ((fbpgdir = (pde_t*)kalloc_zeroed()) == 0)
+		return 0;
+	for (n = 0; base + ((uint64)n << PDXSHIFT) < pa + len; n++)
+		fbpgdir[n] = (base + ((uint64)n << PDXSHIFT)) | PTE_PS | PTE_P | PTE_W |
+		             (CPU_PAT ? PTE_PS_PAT : PTE_PWT | PTE_PCD);
+	kpdpt[PDPTX(FBBASE)] = v2p(fbpgdir) | PTE_P | PTE_W;
+	return (char*)FBBASE + (pa - base);
+}
+
+// User page tables are a full four-level tree rooted at the
+// PML4, which is what proc->vm->pgdir points to. The lower half is
+// filled in by walkpgdir() as the process grows; the upper half
+// (the direct map, the kernel stacks and the kernel image) is
+// shared with kpml4, whose own entries never change after
+// kvmalloc().
 pde_t* setupkvm(void){
-	pde_t* pml4 = (pde_t*)kalloc();
-	pde_t* pdpt = (pde_t*)kalloc();
-	pde_t* pgdir = (pde_t*)kalloc();
-
-	memset(pml4, 0, PGSIZE);
-	memset(pdpt, 0, PGSIZE);
-	memset(pgdir, 0, PGSIZE);
-	pml4[511] = v2p(kpdpt) | PTE_P | PTE_W | PTE_U;
-	pml4[0] = v2p(pdpt) | PTE_P | PTE_W | PTE_U;
-	pdpt[0] = v2p(pgdir) | PTE_P | PTE_W | PTE_U;
-
-	// virtual backpointers
-	pgdir[511] = ((uintp)pml4) | PTE_P;
-	pgdir[510] = ((uintp)pdpt) | PTE_P;
-
-	return pgdir;
+	pde_t* pml4 = (pde_t*)kalloc_zeroed();
+	int n;
+
+	if (pml4 == 0)
+		return 0;
+	for (n = PML4X(DIRECTBASE); n < NPDENTRIES; n++)
+		pml4[n] = kpml4[n];
+	return pml4;
 };
 
+// Map page at va in the kernel's part of every address space,
+// below a kpml4 entry made by kvmalloc(). Returns -1 if out of
+// memory for page tables.
+int kmap(char* va, char* page){
+	return mappages(kpml4, va, PGSIZE, v2p(page), PTE_W);
+}
+
+// Map physical memory [0, top) at DIRECTBASE, using 1 GB
+// pages when the cpu has them and 2 MB pages otherwise.
+static void directmap(uint64 top){
+	uint64 pa;
+	pde_t* pdpt, * pd;
+	int n;
+
+	for (pa = 0; pa < top; pa += 1UL << PDPTXSHIFT) {
+		pde_t* pml4e = &kpml4[PML4X(DIRECTBASE + pa)];
+		if (!(*pml4e & PTE_P)) {
+			if ((pdpt = (pde_t*)kalloc_zeroed()) == 0)
+				panic("directmap");
+			*pml4e = v2p(pdpt) | PTE_P | PTE_W;
+		}
+		pdpt = (pde_t*)p2v(PTE_ADDR(*pml4e));
+		if (CPU_PDPE1GB) {
+			pdpt[PDPTX(DIRECTBASE + pa)] = pa | PTE_PS | PTE_P | PTE_W;
+			continue;
+		}
+		if ((pd = (pde_t*)kalloc()) == 0)
+			panic("directmap");
+		for (n = 0; n < NPDENTRIES; n++)
+			pd[n] = (pa + ((uint64)n << PDXSHIFT)) | PTE_PS | PTE_P | PTE_W;
+		pdpt[PDPTX(DIRECTBASE + pa)] = v2p(pd) | PTE_P | PTE_W;
+	}
+}
+
 // Allocate one page table for the machine for the kernel address
 // space for scheduler processes.
 //
-// linear map the first 4GB of physical memory starting at 0xFFFFFFFF80000000
+// linear map the first 2GB of physical memory starting at 0xFFFFFFFF80000000
+// for the kernel image, and all of it at DIRECTBASE.
 void kvmalloc(void){
 	int n;
 	kpml4 = (pde_t*)kalloc();
@@ -157,6 +263,8 @@ void kvmalloc(void){
 	memset(kpdpt, 0, PGSIZE);
 	memset(iopgdir, 0, PGSIZE);
 	kpml4[511] = v2p(kpdpt) | PTE_P | PTE_W;
+	// Filled in by kmap(), after setupkvm() has copied the entry.
+	kpml4[PML4X(KSTACKBASE)] = v2p(kalloc_zeroed()) | PTE_P | PTE_W;
 	kpdpt[511] = v2p(kpgdir1) | PTE_P | PTE_W;
 	kpdpt[510] = v2p(kpgdir0) | PTE_P | PTE_W;
 	kpdpt[509] = v2p(iopgdir) | PTE_P | PTE_W;
@@ -166,22 +274,117 @@ void kvmalloc(void){
 	}
 	for (n = 0; n < 16; n++)
 		iopgdir[n] = (DEVSPACE + (n << PDXSHIFT)) | PTE_PS | PTE_P | PTE_W | PTE_PWT | PTE_PCD;
+	// firmware tables and devices live below 4 GB even
+	// when RAM ends lower
+	directmap(e820top() > 0x100000000UL ? e820top() : 0x100000000UL);
 	switchkvm();
 }
 
 void switchkvm(void){
-	lcr3(v2p(kpml4));
+	uint64 cr3 = v2p(kpml4);
+	if (rcr4() & CR4_PCIDE)
+		cr3 |= CR3_NOFLUSH;
+	lcr3(cr3);
+}
+
+// Take this cpu out of the user address space it last loaded,
+// which may be freed once it switches to the kernel's page table.
+void uvmleave(void){
+	if (cpu->curvm) {
+		__atomic_fetch_and(&cpu->curvm->active[cpu->id / 64], ~(1ULL << (cpu->id % 64)), __ATOMIC_SEQ_CST);
+		cpu->curvm = 0;
+	}
 }
 
+// Address space generation for a new or changed page table.
+// A process takes a new one whenever its old TLB entries
+// might be stale, so no CPU reuses them.
+uint64 newmmid(void){
+	return __sync_fetch_and_add(&nextmmid, 1);
+}
+
+// With PCIDs each CPU keeps the TLB entries of its last NPCID
+// address spaces across switches. A slot still tagged with
+// p->vm->mmid is loaded without a flush; otherwise the oldest slot
+// is recycled and flushed as it is loaded.
 void switchuvm(struct proc* p){
-	void* pml4;
 	uint* tss;
+	uint64 cr3;
+	uint i;
 	pushcli();
-	if (p->pgdir == 0)
+	if (p->vm->pgdir == 0)
 		panic("switchuvm: no pgdir");
 	tss = (uint*)(((char*)cpu->local) + 1024);
 	tss_set_rsp(tss, 0, (uintp)proc->kstack + KSTACKSIZE);
-	pml4 = (void*)PTE_ADDR(p->pgdir[511]);
-	lcr3(v2p(pml4));
+	syscallstack = (uintp)proc->kstack + KSTACKSIZE;
+	cr3 = v2p(p->vm->pgdir);
+	// Let tlbshootdown() know, before looking at mmid.
+	if (cpu->curvm != p->vm) {
+		if (cpu->curvm)
+			__atomic_fetch_and(&cpu->curvm->active[cpu->id / 64], ~(1ULL << (cpu->id % 64)), __ATOMIC_SEQ_CST);
+		__atomic_fetch_or(&p->vm->active[cpu->id / 64], 1ULL << (cpu->id % 64), __ATOMIC_SEQ_CST);
+		cpu->curvm = p->vm;
+	}
+	if (rcr4() & CR4_PCIDE) {
+		for (i = 0; i < NPCID; i++)
+			if (cpu->pcidmm[i] == p->vm->mmid)
+				break;
+		if (i < NPCID) {
+			cr3 |= (i + 1) | CR3_NOFLUSH;
+		} else {
+			i = cpu->pcidnext;
+			cpu->pcidnext = (i + 1) % NPCID;
+			cpu->pcidmm[i] = p->vm->mmid;
+			cr3 |= i + 1;
+		}
+		lcr3(cr3);
+	} else if (rcr3() != cr3) {
+		lcr3(cr3);
+	}
+	// The kernel keeps its per-cpu pointers at the FS base, so
+	// user thread-local storage lives at the GS base instead.
+	fpuswitchin(p);
+	perfswitchin(p);
+	if (cpu->tls != p->tls) {
+		wrmsr(MSR_GSBASE, p->tls);
+		cpu->tls = p->tls;
+	}
 	popcli();
 }
+
+// Flush stale user translations of vm after mappings were
+// downgraded or removed: npages pages from va, or the whole
+// address space if npages is 0. The address space moves to a
+// new generation so other CPUs will not reuse their old entries,
+// and those running it now are told to flush.
+static void flush(struct vmspace* vm, uintp va, uint npages){
+	uint64 mmid = newmmid();
+	uint i;
+	pushcli();
+	if (rcr4() & CR4_PCIDE) {
+		for (i = 0; i < NPCID; i++)
+			if (cpu->pcidmm[i] == vm->mmid)
+				cpu->pcidmm[i] = mmid;
+	}
+	vm->mmid = mmid;
+	tlbshootdown(vm, va, npages);
+	popcli();
+}
+
+// The current process's page at va, or everything if va is 0.
+void uvmflush(char* va){
+	flush(proc->vm, (uintp)va, va ? 1 : 0);
+}
+
+// All of vm, which needn't be the current process's.
+void vmflush(struct vmspace* vm){
+	flush(vm, 0, 0);
+}
+
+// The pages of [start, end).
+void uvmflushrange(uintp start, uintp end){
+	start = PGROUNDDOWN(start);
+	end = PGROUNDUP(end);
+	if (end > start)
+		flush(proc->vm, start, (end - start) / PGSIZE);
+}
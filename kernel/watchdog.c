@@ -0,0 +1,90 @@
+// Lockup detector.
+//
+// Every cpu's timer tick comes here. A cpu that keeps taking ticks
+// without getting anywhere, neither through the scheduler nor in
+// and out of user mode (see acctcharge()), for SOFTLOCKUP ticks is
+// stuck in the kernel with interrupts on: a soft lockup, reported
+// from the tick that notices.
+//
+// A cpu stuck with interrupts off, say spinning in sacquire() on a
+// lock that never comes free, takes no ticks at all, so each cpu
+// also watches the next one round: if that one's tick count stays
+// still for HARDLOCKUP of the watcher's ticks, while not idle with
+// its timer stopped, the watcher sends it an NMI, which interrupts
+// it anyway, and it reports its own hard lockup from the handler.
+//
+// A report gives the interrupted PC and kernel stack, the lock
+// being spun on, if any, with who holds it and from where, and
+// the locks held, with where each was taken. Each lockup is
+// reported once.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "traps.h"
+#include "spinlock.h"
+
+#define SOFTLOCKUP (20 * HZ)
+#define HARDLOCKUP (10 * HZ)
+
+static void printpcs(uintp* pcs){
+	for (int i = 0; i < 10 && pcs[i] != 0; i++)
+		cprintf(" %p", pcs[i]);
+	cprintf("\n");
+}
+
+static void report(char* what, struct trapframe* tf){
+	struct spinlock* lk;
+	uintp pcs[10];
+
+	cprintf("watchdog: %s lockup on cpu%d, pid %d %s, rip %p\n", what, cpu->id,
+	        proc ? proc->pid : 0, proc ? proc->name : "-", tf->eip);
+	if ((tf->cs & 3) == 0) {
+		getstackpcs((uintp*)tf->rbp, pcs);
+		cprintf("  stack:");
+		printpcs(pcs);
+	}
+	if ((lk = cpu->spinning) != 0) {
+		cprintf("  spinning on %s, held by cpu%d from:", lk->name, lk->cpu ? lk->cpu->id : -1);
+		printpcs(lk->pcs);
+	}
+	for (int i = 0; i < cpu->nheld && i < NHELD; i++) {
+		cprintf("  holding %s from:", cpu->held[i]->name);
+		printpcs(cpu->held[i]->pcs);
+	}
+}
+
+// This cpu's timer interrupted tf.
+void watchdogtick(struct trapframe* tf){
+	struct cpu* c;
+
+	cpu->wdticks++;
+	if (cpu->wdticks - cpu->wdmoved == SOFTLOCKUP)
+		report("soft", tf);
+
+	if (ncpu == 1)
+		return;
+	c = &cpus[(cpu->id + 1) % ncpu];
+	if (!c->started || c->idle || c->wdticks != cpu->wdpeer) {
+		cpu->wdpeer = c->wdticks;
+		cpu->wdpeerat = cpu->wdticks;
+		return;
+	}
+	if (cpu->wdticks - cpu->wdpeerat == HARDLOCKUP) {
+		c->wdnmi = 1;
+		lapicnmi(c->id);
+	}
+}
+
+// An NMI interrupted tf. Returns 1 if it was the watchdog's,
+// 0 if it came from somewhere else.
+int watchdognmi(struct trapframe* tf){
+	if (!cpu->wdnmi)
+		return 0;
+	cpu->wdnmi = 0;
+	report("hard", tf);
+	return 1;
+}
@@ -0,0 +1,128 @@
+// Work queues.
+//
+// Code that has something to do but shouldn't do it where it is,
+// in an interrupt handler or in the middle of some unrelated
+// process's system call, hands a struct work to queue_work(). Each
+// cpu has a queue and a kernel thread, kworker, bound to that cpu,
+// which runs the queued work in order, in process context, where
+// it may sleep and take sleeplocks.
+//
+// queue_work() puts the work on the caller's cpu, so it runs
+// cache-warm and the queues need no balancing; queue_work_on()
+// picks the cpu. A work item is on at most one queue at a time:
+// queuing it again while it is pending does nothing, but once it
+// has started it may be queued again, and will then run again.
+//
+// Before the worker threads exist, work is run inline.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "workqueue.h"
+
+struct wq {
+	struct spinlock lock;
+	struct work* head;
+	struct work* tail;
+	struct work* running;   // being run by the worker, or 0
+};
+
+static struct {
+	struct wq q[NCPU];
+	int started;
+} wqs;
+
+static void kworker(void* arg){
+	struct wq* q = arg;
+	struct work* w;
+
+	acquire(&q->lock);
+	for (;;) {
+		while ((w = q->head) == 0)
+			sleep(q, &q->lock);
+		if ((q->head = w->next) == 0)
+			q->tail = 0;
+		w->next = 0;
+		q->running = w;
+		__atomic_store_n(&w->pending, 0, __ATOMIC_RELEASE);
+		release(&q->lock);
+
+		w->fn(w->arg);
+
+		acquire(&q->lock);
+		q->running = 0;
+		wakeup(&q->running);
+	}
+}
+
+// Start a worker on each cpu. After startothers().
+void workqueueinit(void){
+	char name[16] = "kworker/";
+	int i;
+
+	for (int c = 0; c < ncpu; c++) {
+		initlock(&wqs.q[c].lock, "wq");
+		i = 8;
+		if (c >= 100)
+			name[i++] = '0' + c / 100;
+		if (c >= 10)
+			name[i++] = '0' + c / 10 % 10;
+		name[i++] = '0' + c % 10;
+		name[i] = 0;
+		if (kthreadon(name, kworker, &wqs.q[c], c) < 0)
+			panic("workqueueinit");
+	}
+	wqs.started = 1;
+}
+
+// Run w on cpu c's worker. Returns 0 if it was already pending.
+// May be called from interrupt handlers.
+int queue_work_on(int c, struct work* w){
+	struct wq* q;
+
+	if (!wqs.started) {
+		w->fn(w->arg);
+		return 1;
+	}
+	if (__atomic_exchange_n(&w->pending, 1, __ATOMIC_ACQ_REL))
+		return 0;
+	q = &wqs.q[c];
+	acquire(&q->lock);
+	w->cpu = c;
+	w->next = 0;
+	if (q->tail)
+		q->tail->next = w;
+	else
+		q->head = w;
+	q->tail = w;
+	wakeup(q);
+	release(&q->lock);
+	return 1;
+}
+
+// Run w on this cpu's worker.
+int queue_work(struct work* w){
+	int c;
+
+	pushcli();
+	c = cpu->id;
+	popcli();
+	return queue_work_on(c, w);
+}
+
+// Wait until w is neither pending nor running. Only finishes the
+// last queuing: w may be back on a queue by the time this returns.
+// Not from w itself.
+void flush_work(struct work* w){
+	struct wq* q = &wqs.q[w->cpu];
+
+	if (!wqs.started)
+		return;
+	acquire(&q->lock);
+	while (w->pending || q->running == w)
+		sleep(&q->running, &q->lock);
+	release(&q->lock);
+}
@@ -1,8 +1,8 @@
 #!/bin/bash
 
-unset REBUILD IDE_MODE DEBUG EXT2 BIG
+unset REBUILD IDE_MODE DEBUG EXT2 BIG SWAP CORES
 
-while getopts 'rldeb' c
+while getopts 'rldebsc:' c
 do
   case $c in
     r) REBUILD=TRUE ;;
@@ -10,6 +10,8 @@ do
     d) DEBUG=TRUE ;;
     e) EXT2=TRUE ;;
     b) BIG=TRUE ;;
+    s) SWAP=TRUE ;;
+    c) CORES=$OPTARG ;;
   esac
 done
 
@@ -35,9 +37,19 @@ ROOT_DISK="-drive id=disk,file=./bin/$ROOT_IMG,if=none -device driver=ide-hd,dri
 if [ -n "$IDE_MODE" ]; then
     ROOT_DISK="-hdd ./bin/$ROOT_IMG"
 fi
+
+# A second AHCI disk for swap, made by "make swap.img".
+SWAP_DISK=""
+if [ -n "$SWAP" ]; then
+    SWAP_DISK="-drive id=swap,file=./bin/swap.img,format=raw,if=none -device driver=ide-hd,drive=swap,bus=ahci.1"
+fi
 CPU="-cpu phenom-v1 -smp sockets=1 -smp cores=4 -smp threads=1"
 if [ -n "$BIG" ]; then
     CPU="-cpu IvyBridge-v2 -smp sockets=2 -smp cores=12 -smp threads=2"
 fi
+# -c N: N cpus, for sweeping scale over core counts.
+if [ -n "$CORES" ]; then
+    CPU="-cpu phenom-v1 -smp $CORES,sockets=1,cores=$CORES,threads=1"
+fi
 
-qemu-system-x86_64 $QEMU_OPTS $DEBUG_OPTS -device ahci,id=ahci $CPU -m 512 $NETWORK $BOOT_DISK $ROOT_DISK
+qemu-system-x86_64 $QEMU_OPTS $DEBUG_OPTS -device ahci,id=ahci $CPU -m 512 $NETWORK $BOOT_DISK $ROOT_DISK $SWAP_DISK
@@ -0,0 +1,284 @@
+// fsck: check an fs1 image, as mkfs makes and the kernel leaves
+// it, for consistency:
+//
+//   every block an inode maps lies in the data area, once;
+//   the bitmap marks exactly the metadata and the mapped blocks;
+//   directories start with "." and "..", name only allocated
+//   inodes, and each directory is named by one other;
+//   each inode's nlink is the entries naming it, not counting
+//   "." and counting a subdirectory's "..", as the kernel keeps it.
+//
+// It reads the image as it is, so check one the kernel was shut
+// down cleanly on, after sync: a log not yet replayed may hold the
+// rest of a half-done operation. Usage: fsck fs.img. Exits 1 if it
+// found anything wrong.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#define stat xv6_stat  // avoid clash with host struct stat
+#include "../include/types.h"
+#include "../include/stat.h"
+#include "../include/param.h"
+struct inode;
+#include "../include/fs/fs1.h"
+
+int fsfd;
+struct fs1_superblock sb;
+uint datastart, logstart;
+int errors;
+
+uint *owner;     // per block: inode mapping it, or 0
+uchar *marked;   // per block: the bitmap's bit
+int *refs;       // per inode: entries naming it, as nlink counts
+uint *parent;    // per directory: the inode its ".." names
+int *named;      // per directory: entries naming it, but "." and ".."
+uint *namedby;   // per directory: the last directory naming it
+
+void bad(char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+void bad(char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	errors++;
+}
+
+void rsect(uint sec, void *buf) {
+	if(pread(fsfd, buf, BSIZE, sec * (off_t)BSIZE) != BSIZE) {
+		fprintf(stderr, "fsck: cannot read sector %u\n", sec);
+		exit(1);
+	}
+}
+
+void rinode(uint inum, struct dinode *din) {
+	struct dinode buf[IPB];
+
+	rsect(IBLOCK(inum), buf);
+	*din = buf[inum % IPB];
+}
+
+int indata(uint b) {
+	return b >= datastart && b < logstart;
+}
+
+// Note that inum maps block b, as its fbn'th block or, with fbn
+// -1, for its own bookkeeping. Returns 1 if b can be read.
+int use(uint inum, int fbn, uint b) {
+	if(!indata(b)) {
+		bad("inode %u: block %u (file block %d) outside the data area", inum, b, fbn);
+		return 0;
+	}
+	if(owner[b]) {
+		bad("inode %u: block %u (file block %d) is inode %u's too", inum, b, fbn, owner[b]);
+		return 0;
+	}
+	owner[b] = inum;
+	return 1;
+}
+
+// Block fbn of din, or 0 past its last, for each fbn in turn
+// from 0. With mark, the blocks of the map itself are claimed,
+// else a map block outside the data area is taken as empty.
+uint bmap(uint inum, struct dinode *din, uint fbn, int mark) {
+	static uint ind[NINDIRECT];
+	static struct fs1_extent ext[NIEXTENT];
+	struct fs1_extent *e;
+	uint nb = 0, i;
+
+	if(sb.flags & FS1_EXTENTS) {
+		if(fbn == 0 && din->addrs[NDIRECT]) {
+			if(mark ? !use(inum, -1, din->addrs[NDIRECT]) : !indata(din->addrs[NDIRECT]))
+				din->addrs[NDIRECT] = 0;
+			else
+				rsect(din->addrs[NDIRECT], ext);
+		}
+		for(i = 0; i < NEXTENT; i++) {
+			if(i >= NDEXTENT && din->addrs[NDIRECT] == 0)
+				return 0;
+			e = i < NDEXTENT ? (struct fs1_extent*)din->addrs + i : &ext[i - NDEXTENT];
+			if(e->len == 0)
+				return 0;
+			if(fbn < nb + e->len)
+				return e->start + fbn - nb;
+			nb += e->len;
+		}
+		return 0;
+	}
+	if(fbn < NDIRECT)
+		return din->addrs[fbn];
+	if(fbn >= MAXFILE || din->addrs[NDIRECT] == 0)
+		return 0;
+	if(fbn == NDIRECT) {
+		if(mark ? !use(inum, -1, din->addrs[NDIRECT]) : !indata(din->addrs[NDIRECT])) {
+			din->addrs[NDIRECT] = 0;
+			return 0;
+		}
+		rsect(din->addrs[NDIRECT], ind);
+	}
+	return ind[fbn - NDIRECT];
+}
+
+// Check inode inum's blocks against its size and claim them.
+void blocks(uint inum, struct dinode *din) {
+	uint n = (din->size + BSIZE - 1) / BSIZE, fbn, b;
+
+	if(!(sb.flags & FS1_EXTENTS) && n > MAXFILE)
+		bad("inode %u: size %u past the largest file", inum, din->size);
+	for(fbn = 0; fbn < (sb.flags & FS1_EXTENTS ? n + 1 : MAXFILE); fbn++) {
+		b = bmap(inum, din, fbn, 1);
+		if(b == 0) {
+			// Holes read as zeroes; with extents the map ends.
+			if(sb.flags & FS1_EXTENTS)
+				break;
+			continue;
+		}
+		if(fbn >= n)
+			bad("inode %u: block %u mapped past its size %u", inum, fbn, din->size);
+		use(inum, fbn, b);
+	}
+}
+
+// Read directory inum's entries, counting the inodes each names.
+void dir(uint inum, struct dinode *din) {
+	struct dirent de[BSIZE / sizeof(struct dirent)];
+	struct dinode sub;
+	uint fbn, b, i, off;
+
+	if(din->size % sizeof(struct dirent))
+		bad("directory %u: size %u not whole entries", inum, din->size);
+	for(off = 0, fbn = 0; off < din->size; fbn++) {
+		if((b = bmap(inum, din, fbn, 0)) == 0 || !indata(b))
+			memset(de, 0, sizeof(de));
+		else
+			rsect(b, de);
+		for(i = 0; i < BSIZE / sizeof(struct dirent) && off < din->size; i++, off += sizeof(de[0])) {
+			if(off == 0 && (de[0].inum != inum || strncmp(de[0].name, ".", DIRSIZ) != 0))
+				bad("directory %u: first entry isn't \".\"", inum);
+			if(off == sizeof(de[0]) && strncmp(de[1].name, "..", DIRSIZ) != 0)
+				bad("directory %u: second entry isn't \"..\"", inum);
+			if(de[i].inum == 0)
+				continue; // free, or the index of a hashed directory
+			if(de[i].inum >= sb.ninodes) {
+				bad("directory %u: %.14s names inode %u past the last", inum, de[i].name, de[i].inum);
+				continue;
+			}
+			rinode(de[i].inum, &sub);
+			if(sub.type == 0) {
+				bad("directory %u: %.14s names free inode %u", inum, de[i].name, de[i].inum);
+				continue;
+			}
+			if(off == 0)
+				continue; // "." isn't counted
+			if(off == sizeof(de[0])) {
+				parent[inum] = de[i].inum;
+				refs[de[i].inum]++;
+				continue;
+			}
+			if(strncmp(de[i].name, ".", DIRSIZ) == 0 || strncmp(de[i].name, "..", DIRSIZ) == 0)
+				bad("directory %u: another %.14s", inum, de[i].name);
+			refs[de[i].inum]++;
+			if(sub.type == T_DIR) {
+				named[de[i].inum]++;
+				namedby[de[i].inum] = inum;
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	uchar bits[BSIZE];
+	struct dinode din;
+	char buf[BSIZE];
+	uint inum, b;
+
+	if(argc != 2) {
+		fprintf(stderr, "Usage: fsck fs.img\n");
+		exit(1);
+	}
+	if((fsfd = open(argv[1], O_RDONLY)) < 0) {
+		perror(argv[1]);
+		exit(1);
+	}
+	rsect(1, buf);
+	memmove(&sb, buf, sizeof(sb));
+	datastart = sb.ninodes / IPB + 3 + sb.size / BPB + 1;
+	logstart = sb.size - sb.nlog;
+	if(sb.size == 0 || sb.ninodes == 0 || datastart + sb.nblocks + sb.nlog != sb.size) {
+		fprintf(stderr, "fsck: %s: superblock doesn't add up\n", argv[1]);
+		exit(1);
+	}
+	printf("%s: %u blocks, %u data, %u inodes, %u log, flags %x\n", argv[1], sb.size,
+	       sb.nblocks, sb.ninodes, sb.nlog, sb.flags);
+
+	owner = calloc(sb.size, sizeof(*owner));
+	marked = calloc(sb.size, 1);
+	refs = calloc(sb.ninodes, sizeof(*refs));
+	parent = calloc(sb.ninodes, sizeof(*parent));
+	named = calloc(sb.ninodes, sizeof(*named));
+	namedby = calloc(sb.ninodes, sizeof(*namedby));
+
+	// Inodes and their blocks, then what directories say.
+	for(inum = 1; inum < sb.ninodes; inum++) {
+		rinode(inum, &din);
+		if(din.type == 0)
+			continue;
+		if(din.type != T_DIR && din.type != T_FILE && din.type != T_DEV) {
+			bad("inode %u: type %d", inum, din.type);
+			continue;
+		}
+		if(din.type != T_DEV)
+			blocks(inum, &din);
+	}
+	rinode(ROOTINO, &din);
+	if(din.type != T_DIR) {
+		fprintf(stderr, "fsck: %s: no root directory\n", argv[1]);
+		exit(1);
+	}
+	for(inum = 1; inum < sb.ninodes; inum++) {
+		rinode(inum, &din);
+		if(din.type == T_DIR)
+			dir(inum, &din);
+	}
+
+	for(inum = 1; inum < sb.ninodes; inum++) {
+		rinode(inum, &din);
+		if(din.type == 0)
+			continue;
+		if(din.nlink != refs[inum])
+			bad("inode %u: nlink %d but %d links", inum, din.nlink, refs[inum]);
+		if(refs[inum] == 0)
+			bad("inode %u: in no directory", inum);
+		if(din.type == T_DIR && inum != ROOTINO && named[inum] != 1)
+			bad("directory %u: in %d directories", inum, named[inum]);
+		else if(din.type == T_DIR && inum != ROOTINO && parent[inum] != namedby[inum])
+			bad("directory %u: \"..\" is %u, but it's in %u", inum, parent[inum], namedby[inum]);
+		if(din.type == T_DIR && inum == ROOTINO && parent[inum] != ROOTINO)
+			bad("root's \"..\" is %u", parent[inum]);
+	}
+
+	// The bitmap against what's in use. The log isn't in it.
+	for(b = 0; b < sb.size; b++) {
+		if(b % BPB == 0)
+			rsect(BBLOCK(b, sb.ninodes), bits);
+		marked[b] = (bits[b % BPB / 8] >> (b % 8)) & 1;
+	}
+	for(b = 0; b < logstart; b++) {
+		if(b < datastart && !marked[b])
+			bad("block %u: metadata, but free in the bitmap", b);
+		else if(b >= datastart && owner[b] && !marked[b])
+			bad("block %u: inode %u's, but free in the bitmap", b, owner[b]);
+		else if(b >= datastart && !owner[b] && marked[b])
+			bad("block %u: in use in the bitmap, but no inode's", b);
+	}
+
+	printf("%s: %d problem%s\n", argv[1], errors, errors == 1 ? "" : "s");
+	exit(errors ? 1 : 0);
+}
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 #define stat xv6_stat  // avoid clash with host struct stat
 #include "../include/types.h"
@@ -19,6 +20,14 @@
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
 
+struct fs1_extent {
+  uint32 start;
+  uint32 len;
+};
+#define NDEXTENT (NDIRECT / 2)
+#define NIEXTENT (BSIZE / sizeof(struct fs1_extent))
+#define NEXTENT (NDEXTENT + NIEXTENT)
+
 // On-disk inode structure
 struct dinode {
   int16  type;               // File type
@@ -55,8 +64,12 @@ struct fs1_superblock {
   uint nblocks;      // Number of data blocks
   uint ninodes;      // Number of inodes.
   uint nlog;         // Number of log blocks
+  uint flags;        // FS1_*
 };
 
+#define FS1_EXTENTS  0x1  // files are mapped by extents
+#define FS1_DIRINDEX 0x2  // big directories may be hashed
+
 // ~~~~~~~~~~~~~~~~~~~~~~~
 
 #ifndef static_assert
@@ -65,15 +78,18 @@ struct fs1_superblock {
 
 #define MAX_PATH_LEN 2048
 #define FREESPACE 3000
-int nblocks = (995-LOGSIZE) + FREESPACE;
-int nlog = LOGSIZE;
-int ninodes = 200;
-int size = 1024 + FREESPACE + 25;
+#define NDATA ((995-30) + FREESPACE)  // data blocks without -s
+#define MAXINODES 65535               // dirent.inum is a ushort
+int nblocks;
+int nlog = 1 + LOGHDRSECT + LOGSIZE; // tail block, a full record
+int extents;
+int ninodes;
+int size;
 //size MUST EQUAL nblocks + usedblocks + nlog
 
 int fsfd;
+char *img; // the image, mapped
 struct fs1_superblock sb;
-char zeroes[512];
 uint freeblock;
 uint usedblocks;
 uint bitblocks;
@@ -110,6 +126,12 @@ struct dirent de;
 
 uint mkdir(char *dirname, uint parentdir) {
 	uint dirino = ialloc(T_DIR);
+	struct dinode din;
+
+	// The parent gets a link for "..", as in the kernel.
+	rinode(parentdir, &din);
+	din.nlink = xshort(xshort(din.nlink) + 1);
+	winode(parentdir, &din);
 
 	bzero(&de, sizeof(de));
 	de.inum = xshort(dirino);
@@ -129,6 +151,19 @@ uint mkdir(char *dirname, uint parentdir) {
 	return dirino;
 }
 
+// A size in sectors, or in bytes with a K, M or G after it.
+long parsesize(char *s) {
+	char *e;
+	long n = strtol(s, &e, 0);
+
+	switch(*e) {
+	case 'K': case 'k': return n * 1024 / BSIZE;
+	case 'M': case 'm': return n * 1024 * 1024 / BSIZE;
+	case 'G': case 'g': return n * 1024 * 1024 * 1024 / BSIZE;
+	}
+	return n;
+}
+
 int main(int argc, char *argv[]) {
 	int i, cc, fd;
 	uint rootino, inum, off;
@@ -138,8 +173,39 @@ int main(int argc, char *argv[]) {
 
 	static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-	if(argc < 2) {
-		fprintf(stderr, "Usage: mkfs fs.img files...\n");
+	for(;;) {
+		if(argc > 2 && !strcmp(argv[1], "-l")) {
+			// log size, in data sectors
+			nlog = 1 + LOGHDRSECT + atoi(argv[2]);
+			argc -= 2;
+			argv += 2;
+		} else if(argc > 2 && !strcmp(argv[1], "-s")) {
+			// image size
+			size = parsesize(argv[2]);
+			argc -= 2;
+			argv += 2;
+		} else if(argc > 2 && !strcmp(argv[1], "-i")) {
+			// inodes
+			ninodes = atoi(argv[2]);
+			argc -= 2;
+			argv += 2;
+		} else if(argc > 1 && !strcmp(argv[1], "-e")) {
+			// map files by extents
+			extents = 1;
+			argc--;
+			argv++;
+		} else {
+			break;
+		}
+	}
+	// Without -i, an inode for each 32 KB of a big image.
+	if(ninodes == 0)
+		ninodes = size / 64 > 200 ? size / 64 : 200;
+	if(ninodes > MAXINODES)
+		ninodes = MAXINODES;
+	if(argc < 2 || nlog < 1 + LOGHDRSECT + MAXWRITEBLOCKS || ninodes < IPB) {
+		fprintf(stderr, "Usage: mkfs [-e] [-s size[KMG]] [-i inodes] [-l logsectors] fs.img files...\n");
+		fprintf(stderr, "       the log takes at least %d sectors\n", MAXWRITEBLOCKS);
 		exit(1);
 	}
 
@@ -152,14 +218,28 @@ int main(int argc, char *argv[]) {
 		exit(1);
 	}
 
+	// Without -s, NDATA data blocks, the log, and the blocks
+	// before them.
+	if(size == 0) {
+		size = NDATA + nlog + ninodes / IPB + 3;
+		size += size/(512*8) + 1;
+	}
+	bitblocks = size/(512*8) + 1;
+	usedblocks = ninodes / IPB + 3 + bitblocks;
+	freeblock = usedblocks;
+	nblocks = size - usedblocks - nlog;
+	if(nblocks < 64) {
+		fprintf(stderr, "mkfs: %d sectors leave no room for data\n", size);
+		exit(1);
+	}
+
 	sb.size = xint(size);
 	sb.nblocks = xint(nblocks); // so whole disk is size sectors
 	sb.ninodes = xint(ninodes);
 	sb.nlog = xint(nlog);
-
-	bitblocks = size/(512*8) + 1;
-	usedblocks = ninodes / IPB + 3 + bitblocks;
-	freeblock = usedblocks;
+	// Directories are written linearly here; the kernel hashes
+	// them as they grow.
+	sb.flags = xint(FS1_DIRINDEX | (extents ? FS1_EXTENTS : 0));
 
 	printf("used %d (bit %d ninode %zu) free %u log %u total %d\n", usedblocks,
 	       bitblocks, ninodes/IPB + 1, freeblock, nlog, nblocks+usedblocks+nlog);
@@ -167,8 +247,17 @@ int main(int argc, char *argv[]) {
 	printf("size: %d\n", size);
 	assert(nblocks + usedblocks + nlog == size);
 
-	for(i = 0; i < nblocks + usedblocks + nlog; i++)
-		wsect(i, zeroes);
+	// The image is made in memory, zeroed to begin with, and
+	// written back as the kernel pages it out and at exit.
+	if(ftruncate(fsfd, (off_t)size * 512) < 0) {
+		perror("ftruncate");
+		exit(1);
+	}
+	img = mmap(0, (size_t)size * 512, PROT_READ | PROT_WRITE, MAP_SHARED, fsfd, 0);
+	if(img == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
 
 	memset(buf, 0, sizeof(buf));
 	memmove(buf, &sb, sizeof(sb));
@@ -261,18 +350,16 @@ int main(int argc, char *argv[]) {
 
 	balloc(usedblocks);
 
+	if(munmap(img, (size_t)size * 512) < 0 || close(fsfd) < 0) {
+		perror(argv[1]);
+		exit(1);
+	}
 	exit(0);
 }
 
 void wsect(uint sec, void *buf) {
-	if(lseek(fsfd, sec * 512L, 0) != sec * 512L) {
-		perror("lseek");
-		exit(1);
-	}
-	if(write(fsfd, buf, 512) != 512) {
-		perror("write");
-		exit(1);
-	}
+	assert(sec < size);
+	memmove(img + sec * 512L, buf, 512);
 }
 
 uint i2b(uint inum) {
@@ -303,18 +390,13 @@ void rinode(uint inum, struct dinode *ip) {
 }
 
 void rsect(uint sec, void *buf) {
-	if(lseek(fsfd, sec * 512L, 0) != sec * 512L) {
-		perror("lseek");
-		exit(1);
-	}
-	if(read(fsfd, buf, 512) != 512) {
-		perror("read");
-		exit(1);
-	}
+	assert(sec < size);
+	memmove(buf, img + sec * 512L, 512);
 }
 
 uint ialloc(ushort type) {
 	uint inum = freeinode++;
+	assert(inum < ninodes);
 	struct dinode din;
 
 	bzero(&din, sizeof(din));
@@ -325,22 +407,65 @@ uint ialloc(ushort type) {
 	return inum;
 }
 
+// Mark the first used blocks in the bitmap, which may take more
+// than one block of it.
 void balloc(int used) {
-	uchar buf[512];
+	uchar *bits = (uchar*)img + (ninodes / IPB + 3) * 512L;
 	int i;
 
 	printf("balloc: first %d blocks have been allocated\n", used);
-	assert(used < 512*8);
-	bzero(buf, 512);
-	for(i = 0; i < used; i++) {
-		buf[i/8] = buf[i/8] | (0x1 << (i%8));
-	}
-	printf("balloc: write bitmap block at sector %zu\n", ninodes/IPB + 3);
-	wsect(ninodes / IPB + 3, buf);
+	assert(used <= size - nlog);
+	memset(bits, 0xFF, used / 8);
+	for(i = used / 8 * 8; i < used; i++)
+		bits[i/8] |= 0x1 << (i%8);
+	printf("balloc: bitmap of %d blocks at sector %zu\n", bitblocks, ninodes/IPB + 3);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Block fbn of the extent-mapped din, which is at most one past
+// its end; blocks come in order, so most extend the last extent.
+uint ebmap(struct dinode *din, uint fbn) {
+	struct fs1_extent in[NIEXTENT], *e;
+	uint nb = 0;
+	int i, changed;
+
+	if(xint(din->addrs[NDIRECT]))
+		rsect(xint(din->addrs[NDIRECT]), (char*)in);
+	for(i = 0; i < NEXTENT; i++) {
+		e = i < NDEXTENT ? (struct fs1_extent*)din->addrs + i : &in[i - NDEXTENT];
+		if(xint(e->len) == 0)
+			break;
+		if(fbn < nb + xint(e->len))
+			return xint(e->start) + fbn - nb;
+		nb += xint(e->len);
+	}
+	assert(fbn == nb);
+	if(i > 0) {
+		e = i <= NDEXTENT ? (struct fs1_extent*)din->addrs + i - 1 : &in[i - 1 - NDEXTENT];
+		if(xint(e->start) + xint(e->len) == freeblock) {
+			e->len = xint(xint(e->len) + 1);
+			changed = i - 1;
+			goto done;
+		}
+	}
+	assert(i < NEXTENT);
+	if(i == NDEXTENT && xint(din->addrs[NDIRECT]) == 0) {
+		din->addrs[NDIRECT] = xint(freeblock++);
+		usedblocks++;
+		bzero(in, sizeof(in));
+	}
+	e = i < NDEXTENT ? (struct fs1_extent*)din->addrs + i : &in[i - NDEXTENT];
+	e->start = xint(freeblock);
+	e->len = xint(1);
+	changed = i;
+done:
+	if(changed >= NDEXTENT)
+		wsect(xint(din->addrs[NDIRECT]), (char*)in);
+	usedblocks++;
+	return freeblock++;
+}
+
 void iappend(uint inum, void *xp, int n) {
 	char *p = (char*)xp;
 	uint fbn, off, n1;
@@ -354,8 +479,10 @@ void iappend(uint inum, void *xp, int n) {
 	off = xint(din.size);
 	while(n > 0) {
 		fbn = off / 512;
-		assert(fbn < MAXFILE);
-		if(fbn < NDIRECT) {
+		if(extents) {
+			x = ebmap(&din, fbn);
+		} else if(fbn < NDIRECT) {
+			assert(fbn < MAXFILE);
 			if(xint(din.addrs[fbn]) == 0) {
 				din.addrs[fbn] = xint(freeblock++);
 				usedblocks++;
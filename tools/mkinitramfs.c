@@ -0,0 +1,128 @@
+// mkinitramfs: pack files into the archive a MEMFS kernel boots
+// from; see kernel/initramfs.c.
+//
+//   mkinitramfs initramfs.cpio fs/init fs/bin/sh ...
+//
+// The archive is a cpio archive in the "newc" format, as Linux's
+// initramfs is, so cpio -t can list it. A leading fs/ is taken
+// off each name, the directories on the way are put in before
+// the first file in them, and /dev, /bin and /kexts are always
+// there, as mkfs makes them.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define MAX_PATH_LEN 512
+#define MAXDIRS      256
+
+static FILE *out;
+static unsigned long outoff;
+static unsigned ino = 1;
+static char *dirs[MAXDIRS];
+static int ndirs;
+
+static void pad4(void) {
+	while(outoff % 4) {
+		fputc(0, out);
+		outoff++;
+	}
+}
+
+// Write the header and name of an entry; its size bytes of data
+// are to follow.
+static void header(const char *name, unsigned mode, unsigned long size) {
+	int n = fprintf(out, "070701%08X%08X%08X%08X%08X%08X%08lX%08X%08X%08X%08X%08zX%08X",
+	                ino++, mode, 0, 0, (mode & S_IFMT) == S_IFDIR ? 2 : 1, 0, size,
+	                0, 0, 0, 0, strlen(name) + 1, 0);
+	outoff += n;
+	fwrite(name, 1, strlen(name) + 1, out);
+	outoff += strlen(name) + 1;
+	pad4();
+}
+
+// Put in directory name, and those it is in, unless already there.
+static void mkdirs(const char *name) {
+	char *slash, dir[MAX_PATH_LEN];
+
+	for(int i = 0; i < ndirs; i++)
+		if(strcmp(dirs[i], name) == 0)
+			return;
+	strcpy(dir, name);
+	if((slash = strrchr(dir, '/')) != 0) {
+		*slash = 0;
+		mkdirs(dir);
+	}
+	if(ndirs == MAXDIRS) {
+		fprintf(stderr, "mkinitramfs: too many directories\n");
+		exit(1);
+	}
+	dirs[ndirs++] = strdup(name);
+	header(name, S_IFDIR | 0755, 0);
+}
+
+// Put in the file at path, by its name in the archive.
+static void addfile(const char *path) {
+	const char *p = path;
+	char name[MAX_PATH_LEN], *slash, buf[4096];
+	struct stat st;
+	int fd, cc;
+
+	if(strncmp(p, "fs/", 3) == 0)
+		p += 3;
+	while(*p == '/')
+		p++;
+	if(strlen(p) >= sizeof(name)) {
+		fprintf(stderr, "mkinitramfs: %s: name too long\n", path);
+		exit(1);
+	}
+	strcpy(name, p);
+	if((slash = strrchr(name, '/')) != 0) {
+		*slash = 0;
+		mkdirs(name);
+		*slash = '/';
+	}
+
+	if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	printf("Copying /%s... %ld\n", name, (long)st.st_size);
+	header(name, S_IFREG | 0755, st.st_size);
+	while((cc = read(fd, buf, sizeof(buf))) > 0) {
+		fwrite(buf, 1, cc, out);
+		outoff += cc;
+		st.st_size -= cc;
+	}
+	close(fd);
+	if(cc < 0 || st.st_size != 0) {
+		fprintf(stderr, "mkinitramfs: %s changed while being read\n", path);
+		exit(1);
+	}
+	pad4();
+}
+
+int main(int argc, char *argv[]) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: mkinitramfs initramfs.cpio files...\n");
+		exit(1);
+	}
+	if((out = fopen(argv[1], "wb")) == 0) {
+		perror(argv[1]);
+		exit(1);
+	}
+	mkdirs("dev");
+	mkdirs("bin");
+	mkdirs("kexts");
+	for(int i = 2; i < argc; i++)
+		addfile(argv[i]);
+	header("TRAILER!!!", 0, 0);
+	if(fclose(out) < 0) {
+		perror(argv[1]);
+		exit(1);
+	}
+	exit(0);
+}
@@ -0,0 +1,39 @@
+// Make a swap disk image for Xv64: mkswap img npages
+// Writes the header kernel/swap.c looks for and extends the
+// image to npages 4096-byte pages.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../include/types.h"
+#include "../include/swap.h"
+
+int main(int argc, char *argv[]) {
+	struct swaphdr h;
+	char sector[512];
+	int fd;
+
+	if (argc != 3 || atoi(argv[2]) < 2) {
+		fprintf(stderr, "Usage: mkswap img npages\n");
+		exit(1);
+	}
+	memset(&h, 0, sizeof(h));
+	memmove(h.magic, SWAP_MAGIC, sizeof(h.magic));
+	h.npages = atoi(argv[2]);
+	memset(sector, 0, sizeof(sector));
+	memmove(sector, &h, sizeof(h));
+
+	if ((fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
+		perror(argv[1]);
+		exit(1);
+	}
+	if (write(fd, sector, sizeof(sector)) != sizeof(sector) ||
+	    ftruncate(fd, (off_t)h.npages * 4096) < 0) {
+		perror(argv[1]);
+		exit(1);
+	}
+	close(fd);
+	return 0;
+}
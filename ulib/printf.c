@@ -8,15 +8,42 @@
 //defined on page 404 of POSIX Base Definitions, Issue 6
 
 #define UNUSED(x) UNUSED_ ## x __attribute__((__unused__))
-#define PRINT_SCREEN 0
-#define PRINT_BUFFER 1
+#define OUTBUF 256
 
-static int32 putc(int fd, char c) {
-	write(fd, &c, 1);
-	return 1;
+// Where formatted output goes: for snprintf(), the caller's buffer,
+// with room kept for the nul; for fprintf(), a buffer on the stack
+// that is written to fd when it fills and once at the end, so a
+// call costs one write() unless its output is long.
+struct out {
+	int32 fd;  // -1 for snprintf()
+	char *buf;
+	uint32 size;
+	uint32 n;  // bytes in buf
+	int32 len; // bytes output so far, or that would have been
+};
+
+static void flush(struct out *o) {
+	if(o->fd >= 0 && o->n > 0) {
+		write(o->fd, o->buf, o->n);
+	}
+	o->n = 0;
 }
 
-static int8 printint(int xx, int base, int sgn, char *outbuf) {
+static void putc(struct out *o, char c) {
+	if(o->fd < 0) {
+		if(o->len + 1 < o->size) {
+			o->buf[o->len] = c;
+		}
+	} else {
+		if(o->n == o->size) {
+			flush(o);
+		}
+		o->buf[o->n++] = c;
+	}
+	o->len++;
+}
+
+static void printint(struct out *o, int xx, int base, int sgn) {
 	static char digits[] = "0123456789ABCDEF";
 	char buf[16];
 	int i, neg;
@@ -36,22 +63,16 @@ static int8 printint(int xx, int base, int sgn, char *outbuf) {
 	} while((x /= base) != 0);
 	if(neg)
 		buf[i++] = '-';
-	int32 len = i;
 
 	while(--i >= 0) {
-		outbuf[len - (i + 1)] = buf[i];
+		putc(o, buf[i]);
 	}
-
-	return len;
 }
 
 // This is the core print method, all external functions delegate to this.
-static int32 vprintf(uint8 mode, int32 fd, char *buf, uint32 maxlen, const char *fmt,  va_list ap){
+static void vprintf(struct out *o, const char *fmt,  va_list ap){
 	char *s;
 	int c, i, state;
-	int32 len = 0; //based on mode this will either represent:
-	               //     when mode == PRINT_SCREEN: the total number of characters printed
-	               //     when mode == PRINT_BUFFER: the total number of characters that *could* have been written
 
 	state = 0;
 	for(i = 0; fmt[i]; i++) {
@@ -60,119 +81,65 @@ static int32 vprintf(uint8 mode, int32 fd, char *buf, uint32 maxlen, const char
 			if(c == '%') {
 				state = '%';
 			} else {
-				if(mode == PRINT_SCREEN) {
-					len += putc(fd, c);
-				}else{
-					if(len < maxlen) {
-						buf[len] = c;
-					}
-					len++;
-				}
+				putc(o, c);
 			}
 		} else if(state == '%') {
 			if(c == 'd') {
-				char buf[16];
-				int8 segmentLen = printint(va_arg(ap, int), 10, 1, &buf[0]);
-				for(uint8 j = 0; j != segmentLen; j++) {
-					if(mode == PRINT_SCREEN) {
-						len += putc(fd, buf[j]);
-					}else {
-						if(len < maxlen) {
-							buf[len] = c;
-						}
-						len++;
-					}
-				}
+				printint(o, va_arg(ap, int), 10, 1);
 			} else if(c == 'x' || c == 'p') {
-				char buf[16];
-				int8 segmentLen = printint(va_arg(ap, int), 16, 0, &buf[0]);
-				for(uint8 j = 0; j != segmentLen; j++) {
-					if(mode == PRINT_SCREEN) {
-						len += putc(fd, buf[j]);
-					}else {
-						if(len < maxlen) {
-							buf[len] = c;
-						}
-						len++;
-					}
-				}
+				printint(o, va_arg(ap, int), 16, 0);
 			} else if(c == 's') {
 				s = va_arg(ap, char*);
 				if(s == 0)
 					s = "(null)";
 				while(*s != 0) {
-					if(mode == PRINT_SCREEN) {
-						len += putc(fd, *s);
-					}else{
-						if(len < maxlen) {
-							buf[len] = *s;
-						}
-						len++;
-					}
+					putc(o, *s);
 					s++;
 				}
 			} else if(c == 'c') {
-				if(mode == PRINT_SCREEN) {
-					len += putc(fd, va_arg(ap, uint));
-				}else{
-					if(len < maxlen) {
-						buf[len] = va_arg(ap, uint);
-					}
-					len++;
-				}
+				putc(o, va_arg(ap, uint));
 			} else if(c == '%') {
-				if(mode == PRINT_SCREEN) {
-					len += putc(fd, c);
-				}else{
-					if(len < maxlen) {
-						buf[len] = c;
-					}
-					len++;
-				}
+				putc(o, c);
 			} else {
 				// Unknown % sequence.  Print it to draw attention.
-				if(mode == PRINT_SCREEN) {
-					len += putc(fd, '%');
-					len += putc(fd, c);
-				}else{
-					if(len < maxlen) {
-						buf[len] = '%';
-					}
-					len++;
-					if(len < maxlen) {
-						buf[len] = c;
-					}
-					len++;
-				}
+				putc(o, '%');
+				putc(o, c);
 			}
 			state = 0;
 		}
 	}
-	if(mode == PRINT_BUFFER) {
-		//null terminate our string, but do NOT increment len in the process
-		buf[ len < maxlen ? len + 1 : maxlen ] = '\0';
-	}
-	return len;
 }
 
 void fprintf(int32 fd, const char *fmt, ...){
+	char buf[OUTBUF];
+	struct out o = {fd, buf, sizeof(buf), 0, 0};
 	va_list args;
 	va_start(args, fmt);
-	vprintf(PRINT_SCREEN, fd, 0, 0, fmt, args);
+	vprintf(&o, fmt, args);
 	va_end(args);
+	flush(&o);
 }
 
 void printf(const char *fmt, ...) {
+	char buf[OUTBUF];
+	struct out o = {stdout, buf, sizeof(buf), 0, 0};
 	va_list args;
 	va_start(args, fmt);
-	vprintf(PRINT_SCREEN, 0, 0, 0, fmt, args);
+	vprintf(&o, fmt, args);
 	va_end(args);
+	flush(&o);
 }
 
+// Format into s, at most n bytes with the nul. Returns the length
+// the whole output would have had, as C99 says.
 int snprintf(char *s, unsigned int n, const char *fmt, ...) {
+	struct out o = {-1, s, n, 0, 0};
 	va_list args;
 	va_start(args, fmt);
-	int result = vprintf(PRINT_BUFFER, 0, s, n, fmt, args);
+	vprintf(&o, fmt, args);
 	va_end(args);
-	return result;
+	if(n > 0) {
+		s[o.len < n ? o.len : n - 1] = '\0';
+	}
+	return o.len;
 }
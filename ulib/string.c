@@ -1,18 +1,13 @@
 #include "types.h"
 #include "x86.h"
+#include "strsimd.h"
 
 int memcmp(const void* v1, const void* v2, uint n) {
-	const uchar* s1, * s2;
-
-	s1 = v1;
-	s2 = v2;
-	while (n-- > 0) {
-		if (*s1 != *s2)
-			return *s1 - *s2;
-		s1++, s2++;
-	}
+	return _memcmp(v1, v2, n);
+}
 
-	return 0;
+void* memchr(const void* s, int c, uint n) {
+	return _memchr(s, c, n);
 }
 
 
@@ -44,11 +39,7 @@ void* memmove(void* dst, const void* src, uint n){
 }
 
 int strlen(const char* s) {
-	int n;
-
-	for (n = 0; s[n]; n++)
-		;
-	return n;
+	return _strlen(s);
 }
 
 char* strcpy(char *s, char *t) {
@@ -118,10 +109,7 @@ int atoi(const char *s) {
 }
 
 char* strchr(const char *s, char c) {
-	for(; *s; s++)
-		if(*s == c)
-			return (char*)s;
-	return 0;
+	return _strchr(s, c);
 }
 
 char* strstr(const char *str1, char *str2) {
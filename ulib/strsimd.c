@@ -0,0 +1,233 @@
+// String scanning with SSE2, or AVX2 when the CPU and kernel
+// support it, picked on first use; plain byte loops otherwise.
+//
+// Scans for a terminator load whole aligned vectors, which may run
+// past the end of the string but never into the next page, and
+// mask off what they found before the start.
+
+#include <immintrin.h>
+#include "types.h"
+#include "x86.h"
+#include "strsimd.h"
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+enum { SCALAR, SSE2, AVX2 };
+
+static int level = -1;
+
+static int simdlevel(void){
+	uint regs[4], ecx1, lo, hi;
+
+	if (level >= 0)
+		return level;
+	amd64_cpuid(0, regs);
+	if (regs[0] < 1) {
+		level = SCALAR;
+		return level;
+	}
+	amd64_cpuid(1, regs);
+	ecx1 = regs[2];
+	level = (regs[3] & (1 << 26)) ? SSE2 : SCALAR;
+	// AVX2 needs the kernel to be saving the upper halves (OSXSAVE
+	// and XCR0's SSE and AVX bits) as well as the CPU to have it.
+	if (level == SSE2 && (ecx1 & (1 << 27)) && (ecx1 & (1 << 28))) {
+		asm volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+		amd64_cpuid(0, regs);
+		if ((lo & 6) == 6 && regs[0] >= 7) {
+			amd64_cpuidcount(7, 0, regs);
+			if (regs[1] & (1 << 5))
+				level = AVX2;
+		}
+	}
+	return level;
+}
+
+// Lowest set bit of a movemask, which must be nonzero.
+#define first(m) __builtin_ctz(m)
+
+static unsigned long strlen_sse2(const char* s){
+	const char* p = (const char*)((uintp)s & ~15);
+	__m128i z = _mm_setzero_si128();
+	uint m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), z)) >> (s - p);
+
+	if (m)
+		return first(m);
+	for (;;) {
+		p += 16;
+		if ((m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), z))) != 0)
+			return p + first(m) - s;
+	}
+}
+
+static TARGET_AVX2 unsigned long strlen_avx2(const char* s){
+	const char* p = (const char*)((uintp)s & ~31);
+	__m256i z = _mm256_setzero_si256();
+	uint m = (uint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), z)) >> (s - p);
+
+	if (m)
+		return first(m);
+	for (;;) {
+		p += 32;
+		if ((m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), z))) != 0)
+			return p + first(m) - s;
+	}
+}
+
+unsigned long _strlen(const char* s){
+	unsigned long n;
+
+	switch (simdlevel()) {
+	case AVX2:
+		return strlen_avx2(s);
+	case SSE2:
+		return strlen_sse2(s);
+	}
+	for (n = 0; s[n]; n++)
+		;
+	return n;
+}
+
+static void* memchr_sse2(const char* s, int c, unsigned long n){
+	const char* p = (const char*)((uintp)s & ~15);
+	const char* end = s + n;
+	__m128i v = _mm_set1_epi8(c);
+	uint m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), v)) >> (s - p) << (s - p);
+
+	for (;;) {
+		if (m)
+			return p + first(m) < end ? (void*)(p + first(m)) : 0;
+		if ((p += 16) >= end)
+			return 0;
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), v));
+	}
+}
+
+static TARGET_AVX2 void* memchr_avx2(const char* s, int c, unsigned long n){
+	const char* p = (const char*)((uintp)s & ~31);
+	const char* end = s + n;
+	__m256i v = _mm256_set1_epi8(c);
+	uint m = (uint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), v));
+
+	m = m >> (s - p) << (s - p);
+	for (;;) {
+		if (m)
+			return p + first(m) < end ? (void*)(p + first(m)) : 0;
+		if ((p += 32) >= end)
+			return 0;
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), v));
+	}
+}
+
+void* _memchr(const void* s, int c, unsigned long n){
+	const uchar* p = s;
+
+	if (n == 0)
+		return 0;
+	switch (simdlevel()) {
+	case AVX2:
+		return memchr_avx2(s, c, n);
+	case SSE2:
+		return memchr_sse2(s, c, n);
+	}
+	for (; n > 0; n--, p++)
+		if (*p == (uchar)c)
+			return (void*)p;
+	return 0;
+}
+
+// Both strings are read with unaligned loads, and only the n bytes
+// asked for.
+static int memcmp_sse2(const uchar* a, const uchar* b, unsigned long n){
+	uint m;
+
+	for (; n >= 16; n -= 16, a += 16, b += 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b)));
+		if (m != 0xFFFF) {
+			m = first(~m);
+			return a[m] - b[m];
+		}
+	}
+	for (; n > 0; n--, a++, b++)
+		if (*a != *b)
+			return *a - *b;
+	return 0;
+}
+
+static TARGET_AVX2 int memcmp_avx2(const uchar* a, const uchar* b, unsigned long n){
+	uint m;
+
+	for (; n >= 32; n -= 32, a += 32, b += 32) {
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)a),
+		                                           _mm256_loadu_si256((const __m256i*)b)));
+		if (m != 0xFFFFFFFF) {
+			m = first(~m);
+			return a[m] - b[m];
+		}
+	}
+	return memcmp_sse2(a, b, n);
+}
+
+int _memcmp(const void* v1, const void* v2, unsigned long n){
+	const uchar* s1 = v1, * s2 = v2;
+
+	switch (simdlevel()) {
+	case AVX2:
+		return memcmp_avx2(s1, s2, n);
+	case SSE2:
+		return memcmp_sse2(s1, s2, n);
+	}
+	for (; n > 0; n--, s1++, s2++)
+		if (*s1 != *s2)
+			return *s1 - *s2;
+	return 0;
+}
+
+// The first c or nul, whichever comes first.
+static char* strchr_sse2(const char* s, int c){
+	const char* p = (const char*)((uintp)s & ~15);
+	__m128i z = _mm_setzero_si128(), v = _mm_set1_epi8(c), x;
+	uint m;
+
+	x = _mm_load_si128((const __m128i*)p);
+	m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, z), _mm_cmpeq_epi8(x, v))) >> (s - p) << (s - p);
+	while (m == 0) {
+		p += 16;
+		x = _mm_load_si128((const __m128i*)p);
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, z), _mm_cmpeq_epi8(x, v)));
+	}
+	return (char*)p + first(m);
+}
+
+static TARGET_AVX2 char* strchr_avx2(const char* s, int c){
+	const char* p = (const char*)((uintp)s & ~31);
+	__m256i z = _mm256_setzero_si256(), v = _mm256_set1_epi8(c), x;
+	uint m;
+
+	x = _mm256_load_si256((const __m256i*)p);
+	m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, z), _mm256_cmpeq_epi8(x, v)));
+	m = m >> (s - p) << (s - p);
+	while (m == 0) {
+		p += 32;
+		x = _mm256_load_si256((const __m256i*)p);
+		m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, z), _mm256_cmpeq_epi8(x, v)));
+	}
+	return (char*)p + first(m);
+}
+
+// As ulib's strchr() always has: 0 if s has no c before its nul,
+// even when c is nul.
+char* _strchr(const char* s, int c){
+	switch (simdlevel()) {
+	case AVX2:
+		s = strchr_avx2(s, c);
+		break;
+	case SSE2:
+		s = strchr_sse2(s, c);
+		break;
+	default:
+		while (*s && *s != (char)c)
+			s++;
+	}
+	return *s ? (char*)s : 0;
+}
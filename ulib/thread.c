@@ -0,0 +1,135 @@
+#include "types.h"
+#include "user.h"
+#include "mman.h"
+#include "futex.h"
+
+// Threads on top of clone(). Each thread gets one anonymous
+// mapping: its struct thread at the bottom and its stack
+// growing down from the top. The struct is also the thread's
+// TLS block, with the %gs base pointing at it, so thread_self()
+// is a single load.
+
+#define THREAD_STACK (64*1024)
+
+struct thread {
+	struct thread* self;
+	void (*fn)(void*);
+	void* arg;
+	int tid;
+	void* mcache;     // malloc()'s cache for this thread
+};
+
+// Set once there may be more than one thread, for malloc().
+int _threaded;
+
+static void* mainmcache;
+
+static void thread_start(void* arg) {
+	struct thread* t = arg;
+
+	t->fn(t->arg);
+	_malloc_threadexit(t->mcache);
+	procexit();
+}
+
+thread_t thread_create(void (*fn)(void*), void* arg) {
+	struct thread* t;
+
+	t = mmap(0, THREAD_STACK, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (t == MAP_FAILED)
+		return 0;
+	t->self = t;
+	t->fn = fn;
+	t->arg = arg;
+	t->mcache = 0;
+	_threaded = 1;
+	t->tid = clone(thread_start, t, (char*)t + THREAD_STACK, t);
+	if (t->tid < 0) {
+		munmap(t, THREAD_STACK);
+		return 0;
+	}
+	return t;
+}
+
+// Wait for t to exit and release its stack.
+int thread_join(thread_t t) {
+	if (waitpid(t->tid, 0, 0) < 0)
+		return -1;
+	munmap(t, THREAD_STACK);
+	return 0;
+}
+
+// The calling thread. Only valid in threads started by
+// thread_create(); the initial thread has no TLS block.
+thread_t thread_self(void) {
+	struct thread* t;
+
+	__asm__ volatile("mov %%gs:0, %0" : "=r" (t));
+	return t;
+}
+
+// Where malloc() keeps the calling thread's cache. On the initial
+// thread %gs:0 reads whatever is at address 0, which doesn't
+// bracket the stack pointer the way a thread's own block does.
+void** _thread_mcache(void) {
+	struct thread* t = thread_self();
+	char* sp = __builtin_frame_address(0);
+
+	if ((char*)t <= sp && sp < (char*)t + THREAD_STACK)
+		return &t->mcache;
+	return &mainmcache;
+}
+
+int thread_id(thread_t t) {
+	return t->tid;
+}
+
+// Mutexes after Drepper, "Futexes Are Tricky": state is 0 when
+// unlocked, 1 when locked and 2 when locked with waiters, so an
+// uncontended lock and unlock never enter the kernel.
+void mutex_lock(mutex_t* m) {
+	int c;
+
+	if ((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+		return;
+	if (c != 2)
+		c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+	while (c != 0) {
+		futex(&m->state, FUTEX_WAIT, 2);
+		c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+int mutex_trylock(mutex_t* m) {
+	return __sync_val_compare_and_swap(&m->state, 0, 1) == 0;
+}
+
+void mutex_unlock(mutex_t* m) {
+	if (__sync_fetch_and_sub(&m->state, 1) != 1) {
+		m->state = 0;
+		futex(&m->state, FUTEX_WAKE, 1);
+	}
+}
+
+// Condition variables are a sequence number bumped on every
+// signal; a waiter sleeps only if no signal came in after it
+// dropped the mutex.
+void cond_wait(cond_t* c, mutex_t* m) {
+	int seq = c->seq;
+
+	mutex_unlock(m);
+	futex(&c->seq, FUTEX_WAIT, seq);
+	// Others may be queued behind us: take the lock contended.
+	while (__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+		futex(&m->state, FUTEX_WAIT, 2);
+}
+
+void cond_signal(cond_t* c) {
+	__sync_fetch_and_add(&c->seq, 1);
+	futex(&c->seq, FUTEX_WAKE, 1);
+}
+
+void cond_broadcast(cond_t* c) {
+	__sync_fetch_and_add(&c->seq, 1);
+	futex(&c->seq, FUTEX_WAKE, 0x7fffffff);
+}
@@ -2,89 +2,540 @@
 #include "stat.h"
 #include "user.h"
 #include "param.h"
+#include "mman.h"
+#include "string.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.
+//
+// Requests of up to MAXSMALL bytes are rounded up to a power of
+// two and carved out of slabs: SLAB-byte, SLAB-aligned blocks of
+// objects of one size class behind a header, so free() finds an
+// object's slab, and so its class, by masking its address. Each
+// slab has a list of its free objects, and a class has a list of
+// its slabs with any free.
+//
+// Bigger requests get a run of whole slabs, the header on the
+// first saying how many. Free runs, including slabs whose objects
+// are all free again, are on an address-ordered list, merged with
+// their neighbours and taken first fit; the heap grows by sbrk().
+// Requests of LARGE bytes or more get an mmap() of their own, given
+// back when freed, if the process has a mapping to spare.
+//
+// Once thread_create() has started a thread all this is under a
+// lock, and each thread keeps up to NCACHE free objects of each
+// class, so most small malloc()s and free()s don't take it. A
+// cache is refilled from the slabs and drained into them
+// NCACHE/2 objects at a time.
+//
+// Counters of calls per class and of bytes in use are kept all
+// the time. malloc_profile() also turns on a sampling heap
+// profiler: about once per rate bytes allocated, the caller of
+// malloc() is charged with a sample in a small table of call
+// sites. malloc_stats() prints both.
 
-typedef long Align;
+#define SLABSHIFT 14
+#define SLAB      (1UL << SLABSHIFT)
+#define MINSHIFT  4
+#define NCLASS    MALLOC_NCLASS                   // 16 bytes to 2K
+#define MAXSMALL  (1U << (MINSHIFT + NCLASS - 1))
+#define LARGE     (256*1024)
+#define GROW      4                               // slabs to sbrk() at least
+#define NCACHE    32
+#define MPGSIZE   4096
+#define NPROF     64                              // call sites profiled
 
-union header {
-	struct {
-		union header *ptr;
-		uint size;
-	} s;
-	Align x;
+#define RUN    NCLASS        // slab.class of a run of slabs
+#define MAPPED (NCLASS + 1)  // and of a mapping
+
+#define SLABOF(p) ((struct slab*)((uintp)(p) & ~(SLAB - 1)))
+
+struct obj {
+	struct obj* next;
+};
+
+struct slab {
+	int class;
+	uint nfree;            // objects free, on the list or past bump
+	struct obj* free;
+	char* bump;            // objects from here on were never used
+	struct slab* next;     // on its class's list, or the free runs
+	struct slab* prev;
+	uintp nslab;           // slabs in a run
+	char* base;            // a mapping's start and length
+	uintp len;
+} __attribute__((aligned(16)));
+
+#define HDR sizeof(struct slab)
+
+struct mcache {
+	struct obj* list[NCLASS];
+	uint n[NCLASS];
 };
 
-typedef union header Header;
+static struct {
+	mutex_t lock;
+	struct slab* partial[NCLASS];
+	struct slab* runs;
+} heap;
+
+static struct mallocstats stats;
+
+static struct {
+	uint rate;             // bytes per sample, 0 if off
+	long left;             // bytes to go before the next sample
+	uint seed;
+	struct {
+		uintp pc;
+		uint64 n;          // samples
+		uint64 bytes;      // in the sampled allocations
+	} site[NPROF];
+	uint64 nsample;
+	uint64 lost;           // samples from sites that didn't fit
+} prof;
+
+#define STAT(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+
+static void lock(void) {
+	if (_threaded)
+		mutex_lock(&heap.lock);
+}
+
+static void unlock(void) {
+	if (_threaded)
+		mutex_unlock(&heap.lock);
+}
+
+static int sizeclass(uint n) {
+	int c = 0;
+
+	while ((1U << (MINSHIFT + c)) < n)
+		c++;
+	return c;
+}
+
+// Put run s back on the free list, merging it with its
+// neighbours. Lock held.
+static void runfree(struct slab* s) {
+	struct slab** pp = &heap.runs, * prev = 0;
+
+	while (*pp && *pp < s) {
+		prev = *pp;
+		pp = &(*pp)->next;
+	}
+	s->class = RUN;
+	s->next = *pp;
+	if (s->next && (char*)s + s->nslab * SLAB == (char*)s->next) {
+		s->nslab += s->next->nslab;
+		s->next = s->next->next;
+	}
+	if (prev && (char*)prev + prev->nslab * SLAB == (char*)s) {
+		prev->nslab += s->nslab;
+		prev->next = s->next;
+	} else {
+		*pp = s;
+	}
+}
+
+// Get more heap, at least n slabs. Lock held.
+static int grow(uintp n) {
+	uintp pad;
+	char* p;
+
+	if (n < GROW)
+		n = GROW;
+	if (n * SLAB > 0x7fffffff - SLAB)
+		return -1;
+	pad = -(uintp)sbrk(0) & (SLAB - 1);
+	if ((p = sbrk(pad + n * SLAB)) == (char*)-1)
+		return -1;
+	STAT(stats.heap, pad + n * SLAB);
+	p += pad;
+	((struct slab*)p)->nslab = n;
+	runfree((struct slab*)p);
+	return 0;
+}
+
+// Take a run of n slabs, first fit, from the tail of a free one
+// so the list only changes on an exact fit. Lock held.
+static struct slab* runalloc(uintp n) {
+	struct slab** pp, * s;
+
+	for (;;) {
+		for (pp = &heap.runs; *pp; pp = &(*pp)->next) {
+			s = *pp;
+			if (s->nslab == n) {
+				*pp = s->next;
+				return s;
+			}
+			if (s->nslab > n) {
+				s->nslab -= n;
+				s = (struct slab*)((char*)s + s->nslab * SLAB);
+				s->nslab = n;
+				return s;
+			}
+		}
+		if (grow(n) < 0)
+			return 0;
+	}
+}
+
+static void unpartial(struct slab* s) {
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		heap.partial[s->class] = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+}
+
+static void push(struct slab* s) {
+	s->prev = 0;
+	s->next = heap.partial[s->class];
+	if (s->next)
+		s->next->prev = s;
+	heap.partial[s->class] = s;
+}
+
+// An object of class c, or 0. Lock held.
+static struct obj* slaballoc(int c) {
+	uint size = 1U << (MINSHIFT + c);
+	struct slab* s;
+	struct obj* o;
+
+	if ((s = heap.partial[c]) == 0) {
+		if ((s = runalloc(1)) == 0)
+			return 0;
+		s->class = c;
+		s->free = 0;
+		s->bump = (char*)s + HDR;
+		s->nfree = (SLAB - HDR) / size;
+		push(s);
+	}
+	if ((o = s->free) != 0) {
+		s->free = o->next;
+	} else {
+		o = (struct obj*)s->bump;
+		s->bump += size;
+	}
+	if (--s->nfree == 0)
+		unpartial(s);
+	return o;
+}
+
+// Give back an object to its slab, and the slab to the free runs
+// once it is all free, unless it is its class's only one. Lock
+// held.
+static void slabfree(struct obj* o) {
+	struct slab* s = SLABOF(o);
+	uint size = 1U << (MINSHIFT + s->class);
+
+	o->next = s->free;
+	s->free = o;
+	if (s->nfree++ == 0)
+		push(s);
+	if (s->nfree == (SLAB - HDR) / size && (s->prev || s->next)) {
+		unpartial(s);
+		s->nslab = 1;
+		runfree(s);
+	}
+}
+
+// The calling thread's cache, or 0 if there is no memory for one.
+static struct mcache* mycache(void) {
+	struct mcache** slot = (struct mcache**)_thread_mcache();
+
+	if (*slot == 0) {
+		lock();
+		*slot = (struct mcache*)slaballoc(sizeclass(sizeof(struct mcache)));
+		unlock();
+		if (*slot)
+			memset(*slot, 0, sizeof(struct mcache));
+	}
+	return *slot;
+}
+
+// Move n objects of class c from mc back to the slabs. Lock held.
+static void drain(struct mcache* mc, int c, uint n) {
+	struct obj* o;
+
+	while (n-- > 0 && (o = mc->list[c]) != 0) {
+		mc->list[c] = o->next;
+		mc->n[c]--;
+		slabfree(o);
+	}
+}
+
+static void* bigalloc(uint n) {
+	struct slab* s;
+	uintp len;
+	char* p;
+
+	if (n >= LARGE) {
+		// mmap() only promises page alignment.
+		len = (HDR + n + SLAB - MPGSIZE + MPGSIZE - 1) & ~(uintp)(MPGSIZE - 1);
+		p = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED) {
+			s = SLABOF(p + SLAB - 1);
+			s->class = MAPPED;
+			s->base = p;
+			s->len = len;
+			STAT(stats.mapped, len);
+			return (char*)s + HDR;
+		}
+	}
+	lock();
+	s = runalloc((HDR + n + SLAB - 1) / SLAB);
+	unlock();
+	if (s == 0)
+		return 0;
+	s->class = RUN;
+	return (char*)s + HDR;
+}
+
+static void* alloc(uint n) {
+	struct mcache* mc;
+	struct obj* o;
+	int c;
+
+	if (n > MAXSMALL)
+		return bigalloc(n);
+	c = sizeclass(n);
+	if (_threaded && (mc = mycache()) != 0) {
+		if (mc->list[c] == 0) {
+			lock();
+			while (mc->n[c] < NCACHE / 2 && (o = slaballoc(c)) != 0) {
+				o->next = mc->list[c];
+				mc->list[c] = o;
+				mc->n[c]++;
+			}
+			unlock();
+			if (mc->list[c] == 0)
+				return 0;
+		}
+		o = mc->list[c];
+		mc->list[c] = o->next;
+		mc->n[c]--;
+		return o;
+	}
+	lock();
+	o = slaballoc(c);
+	unlock();
+	return o;
+}
+
+static void release(void* p) {
+	struct slab* s = SLABOF(p);
+	struct obj* o = p;
+	struct mcache* mc;
+
+	if (s->class == MAPPED) {
+		STAT(stats.mapped, -s->len);
+		munmap(s->base, s->len);
+		return;
+	}
+	if (s->class == RUN) {
+		lock();
+		runfree(s);
+		unlock();
+		return;
+	}
+	if (_threaded && (mc = mycache()) != 0) {
+		o->next = mc->list[s->class];
+		mc->list[s->class] = o;
+		if (++mc->n[s->class] > NCACHE) {
+			lock();
+			drain(mc, s->class, NCACHE / 2);
+			unlock();
+		}
+		return;
+	}
+	lock();
+	slabfree(o);
+	unlock();
+}
+
+// The bytes p really takes, and its line in the counters.
+static uintp usable(void* p, int* c) {
+	struct slab* s = SLABOF(p);
+
+	if (s->class < NCLASS) {
+		*c = s->class;
+		return 1U << (MINSHIFT + s->class);
+	}
+	*c = NCLASS;
+	if (s->class == MAPPED)
+		return s->len;
+	return s->nslab * SLAB;
+}
+
+// Charge a sample of a size-byte allocation to pc.
+static void sample(uintp pc, uint size) {
+	uint h = (pc >> 2) % NPROF;
+
+	lock();
+	prof.nsample++;
+	prof.seed = prof.seed * 1103515245 + 12345;
+	prof.left = prof.rate / 2 + (prof.seed >> 8) % prof.rate;
+	for (int i = 0; i < NPROF; i++, h = (h + 1) % NPROF) {
+		if (prof.site[h].pc == pc || prof.site[h].pc == 0) {
+			prof.site[h].pc = pc;
+			prof.site[h].n++;
+			prof.site[h].bytes += size;
+			unlock();
+			return;
+		}
+	}
+	prof.lost++;
+	unlock();
+}
+
+void*
+malloc(uint n)
+{
+	uint64 inuse, peak;
+	uintp size;
+	void* p;
+	int c;
+
+	if ((p = alloc(n)) == 0)
+		return 0;
+	size = usable(p, &c);
+	STAT(stats.nmalloc[c], 1);
+	inuse = STAT(stats.inuse, size) + size;
+	while (inuse > (peak = stats.peak) &&
+	       !__sync_bool_compare_and_swap(&stats.peak, peak, inuse))
+		;
+	if (prof.rate && __atomic_sub_fetch(&prof.left, size, __ATOMIC_RELAXED) < 0)
+		sample((uintp)__builtin_return_address(0), n);
+	return p;
+}
+
+void
+free(void *p)
+{
+	int c;
 
-static Header base;
-static Header *freep;
+	if (p == 0)
+		return;
+	STAT(stats.inuse, -usable(p, &c));
+	STAT(stats.nfree[c], 1);
+	release(p);
+}
 
+// Copy out the counters.
 void
-free(void *ap)
+malloc_info(struct mallocstats* st)
 {
-	Header *bp, *p;
-
-	bp = (Header*)ap - 1;
-	for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-		if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-			break;
-	if(bp + bp->s.size == p->s.ptr) {
-		bp->s.size += p->s.ptr->s.size;
-		bp->s.ptr = p->s.ptr->s.ptr;
-	} else
-		bp->s.ptr = p->s.ptr;
-	if(p + p->s.size == bp) {
-		p->s.size += bp->s.size;
-		p->s.ptr = bp->s.ptr;
-	} else
-		p->s.ptr = bp;
-	freep = p;
-}
-
-static Header*
-morecore(uint nu)
+	*st = stats;
+}
+
+// Sample about once every rate bytes allocated; 0 turns the
+// profiler off. Earlier samples are kept.
+void
+malloc_profile(uint rate)
 {
-	char *p;
-	Header *hp;
+	lock();
+	prof.rate = rate;
+	prof.left = rate;
+	unlock();
+}
 
-	if(nu < 4096)
-		nu = 4096;
-	p = sbrk(nu * sizeof(Header));
-	if(p == (char*)-1)
-		return 0;
-	hp = (Header*)p;
-	hp->s.size = nu;
-	free((void*)(hp + 1));
-	return freep;
+// malloc_stats() has to do without printf(), which isn't the same
+// in the native and POSIX libraries.
+struct line {
+	char buf[128];
+	int n;
+};
+
+static void putstr(struct line* l, char* s) {
+	while (*s && l->n < sizeof(l->buf))
+		l->buf[l->n++] = *s++;
 }
 
-void*
-malloc(uint nbytes)
+static void putu(struct line* l, uint64 v, int base, int width) {
+	char tmp[24];
+	int i = 0;
+
+	do {
+		tmp[i++] = "0123456789abcdef"[v % base];
+		v /= base;
+	} while (v);
+	while (width-- > i && l->n < sizeof(l->buf))
+		l->buf[l->n++] = ' ';
+	while (i > 0 && l->n < sizeof(l->buf))
+		l->buf[l->n++] = tmp[--i];
+}
+
+static void putline(struct line* l) {
+	putstr(l, "\n");
+	write(2, l->buf, l->n);
+	l->n = 0;
+}
+
+// Print the counters, and the profile if there is one, on stderr.
+void
+malloc_stats(void)
 {
-	Header *p, *prevp;
-	uint nunits;
-
-	nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-	if((prevp = freep) == 0) {
-		base.s.ptr = freep = prevp = &base;
-		base.s.size = 0;
-	}
-	for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr) {
-		if(p->s.size >= nunits) {
-			if(p->s.size == nunits)
-				prevp->s.ptr = p->s.ptr;
-			else {
-				p->s.size -= nunits;
-				p += p->s.size;
-				p->s.size = nunits;
-			}
-			freep = prevp;
-			return (void*)(p + 1);
-		}
-		if(p == freep)
-			if((p = morecore(nunits)) == 0)
-				return 0;
+	struct mallocstats st;
+	struct line l = { .n = 0 };
+
+	malloc_info(&st);
+	putstr(&l, "class     mallocs       frees");
+	putline(&l);
+	for (int c = 0; c <= NCLASS; c++) {
+		if (c < NCLASS)
+			putu(&l, 1U << (MINSHIFT + c), 10, 5);
+		else
+			putstr(&l, "  big");
+		putu(&l, st.nmalloc[c], 10, 12);
+		putu(&l, st.nfree[c], 10, 12);
+		putline(&l);
 	}
+	putstr(&l, "in use ");
+	putu(&l, st.inuse, 10, 0);
+	putstr(&l, ", peak ");
+	putu(&l, st.peak, 10, 0);
+	putstr(&l, ", heap ");
+	putu(&l, st.heap, 10, 0);
+	putstr(&l, ", mapped ");
+	putu(&l, st.mapped, 10, 0);
+	putline(&l);
+
+	if (prof.nsample == 0)
+		return;
+	putstr(&l, "call site      samples       bytes  (1 per ");
+	putu(&l, prof.rate, 10, 0);
+	putstr(&l, " bytes)");
+	putline(&l);
+	lock();
+	for (int i = 0; i < NPROF; i++) {
+		if (prof.site[i].n == 0)
+			continue;
+		putstr(&l, "0x");
+		putu(&l, prof.site[i].pc, 16, 8);
+		putu(&l, prof.site[i].n, 10, 12);
+		putu(&l, prof.site[i].bytes, 10, 12);
+		putline(&l);
+	}
+	if (prof.lost) {
+		putstr(&l, "others    ");
+		putu(&l, prof.lost, 10, 12);
+		putline(&l);
+	}
+	unlock();
+}
+
+// A thread is exiting: give back its cache and what is in it.
+void
+_malloc_threadexit(void* cache)
+{
+	struct mcache* mc = cache;
+
+	if (mc == 0)
+		return;
+	lock();
+	for (int c = 0; c < NCLASS; c++)
+		drain(mc, c, NCACHE + 1);
+	slabfree((struct obj*)mc);
+	unlock();
 }
@@ -10,14 +10,84 @@
 #define PRINT_SCREEN 1
 #define PRINT_BUFFER 2
 
-static FILE stdin_const  = {0, 0};
-static FILE stdout_const = {1, 0};
-static FILE stderr_const = {2, 0};
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// stdout is line buffered so prompts and output lines show up as
+// they are written; stderr isn't buffered at all.
+static FILE stderr_const = {.fd = 2, .mode = _IONBF};
+static FILE stdout_const = {.fd = 1, .mode = _IOLBF, .next = &stderr_const};
+static FILE stdin_const  = {.fd = 0, .mode = _IOFBF, .next = &stdout_const};
 
 FILE *_xv64_stdin  = &stdin_const;
 FILE *_xv64_stdout = &stdout_const;
 FILE *_xv64_stderr = &stderr_const;
 
+static FILE *files = &stdin_const; // every open stream
+
+// Give f a buffer on first use: BUFSIZ bytes from malloc(), or
+// just f->ch if it is unbuffered or there is no memory.
+static void getbuf(FILE *f) {
+	if(f->buf) {
+		return;
+	}
+	if(f->mode != _IONBF && (f->buf = malloc(BUFSIZ)) != 0) {
+		f->bufsize = BUFSIZ;
+		f->ownbuf = 1;
+	} else {
+		f->buf = &f->ch;
+		f->bufsize = 1;
+	}
+}
+
+// Write out the bytes waiting in f's buffer.
+static int flushout(FILE *f) {
+	int off = 0;
+
+	while(off < f->wlen) {
+		int n = write(f->fd, f->buf + off, f->wlen - off);
+		if(n <= 0) {
+			f->wlen = 0;
+			return EOF;
+		}
+		off += n;
+	}
+	f->wlen = 0;
+	return 0;
+}
+
+// Give back bytes read ahead but not used, so the file offset is
+// where the caller thinks it is, before writing or seeking.
+static void dropread(FILE *f) {
+	if(f->rlen > f->rpos) {
+		seek(f->fd, f->rpos - f->rlen);
+	}
+	f->rpos = f->rlen = 0;
+}
+
+// Read more into f's empty buffer. Returns EOF at end of file or
+// on an error.
+static int fill(FILE *f) {
+	if(f->readable == -1) {
+		return EOF;
+	}
+	if(f->wlen > 0 && flushout(f) == EOF) {
+		return EOF;
+	}
+	// About to wait for input: let the user see any prompt first.
+	if(f != stdout && stdout->mode == _IOLBF && stdout->wlen > 0) {
+		flushout(stdout);
+	}
+	getbuf(f);
+	int n = read(f->fd, f->buf, f->bufsize);
+	f->rpos = 0;
+	f->rlen = n > 0 ? n : 0;
+	if(n <= 0) {
+		f->readable = -1;
+		return EOF;
+	}
+	return 0;
+}
+
 int feof(FILE *stream) {
 	/*
 	    The feof( ) function shall test the end-of-file indicator for the stream pointed to by stream.
@@ -29,16 +99,53 @@ int feof(FILE *stream) {
 	return 0;
 }
 
-int fgetc(FILE *stream) {
-	if(stream->readable == -1) {
-		return EOF;
+int fflush(FILE *stream) {
+	//POSIX Base Definitions, Issue 6 - page 357
+	//with a null stream, flush every stream that has output waiting
+	int result = 0;
+
+	if(stream == 0) {
+		for(FILE *f = files; f != 0; f = f->next) {
+			if(f->wlen > 0 && flushout(f) == EOF) {
+				result = EOF;
+			}
+		}
+		return result;
 	}
-	unsigned char buf = EOF;
-	stream->readable = read(stream->fd, &buf, sizeof(buf)) == sizeof(buf) ? 1 : -1;
-	if(stream->readable == -1) {
+	return stream->wlen > 0 ? flushout(stream) : 0;
+}
+
+int setvbuf(FILE *restrict stream, char *restrict buf, int mode, size_t size) {
+	//POSIX Base Definitions, Issue 6 - page 1276
+	//only before any other operation on the stream
+	if(mode != _IOFBF && mode != _IOLBF && mode != _IONBF) {
+		return -1;
+	}
+	if(stream->wlen > 0 || stream->rlen > 0) {
+		return -1;
+	}
+	if(stream->ownbuf) {
+		free(stream->buf);
+	}
+	stream->buf = 0;
+	stream->ownbuf = 0;
+	stream->mode = mode;
+	if(mode != _IONBF && buf != 0 && size > 0) {
+		stream->buf = buf;
+		stream->bufsize = size;
+	}
+	return 0;
+}
+
+int fgetc(FILE *stream) {
+	if(stream->rpos == stream->rlen && fill(stream) == EOF) {
 		return EOF;
 	}
-	return (int)buf;
+	return (unsigned char)stream->buf[stream->rpos++];
+}
+
+int getchar(void) {
+	return fgetc(stdin);
 }
 
 char *fgets(char *restrict buf, int n, FILE *restrict stream) {
@@ -48,29 +155,128 @@ char *fgets(char *restrict buf, int n, FILE *restrict stream) {
 	    The string is then terminated with a null byte.
 	    -- POSIX Base Definitions, Issue 6 - page 368
 	 */
+	int i = 0;
 
-	for(int i = 0; i != (n - 1); i++) {
-		int c = fgetc(stream);
-		if(c == EOF) {
-			buf[i] = '\0';
+	while(i < n - 1) {
+		if(stream->rpos == stream->rlen && fill(stream) == EOF) {
 			break;
 		}
-		buf[i] = (char)c;
-		buf[i+1] = '\0'; //this only is safe because we're looping until n-1
-
-		if(c == '\n') {
-			//unlike the test for EOF, we want to
-			//copy the newline to the output buffer
-			//before we conclude.
+		char *p = stream->buf + stream->rpos;
+		int m = min(stream->rlen - stream->rpos, n - 1 - i);
+		char *nl = memchr(p, '\n', m);
+		if(nl) {
+			//copy the newline too, then stop
+			m = nl - p + 1;
+		}
+		memmove(buf + i, p, m);
+		stream->rpos += m;
+		i += m;
+		if(nl) {
 			break;
 		}
 	}
+	if(i == 0 && n > 1) {
+		return 0;
+	}
+	buf[i] = '\0';
 	return buf;
 }
 
+size_t fread(void *restrict ptr, size_t size, size_t nitems, FILE *restrict stream) {
+	//POSIX Base Definitions, Issue 6 - page 408
+	size_t want = size * nitems, got = 0;
+	char *dst = ptr;
+
+	if(want == 0) {
+		return 0;
+	}
+	while(got < want) {
+		int m = stream->rlen - stream->rpos;
+		if(m == 0) {
+			// A big read goes straight into the caller's memory.
+			if(want - got >= BUFSIZ && stream->wlen == 0 && stream->readable != -1) {
+				int n = read(stream->fd, dst + got, want - got);
+				if(n <= 0) {
+					stream->readable = -1;
+					break;
+				}
+				got += n;
+				continue;
+			}
+			if(fill(stream) == EOF) {
+				break;
+			}
+			m = stream->rlen;
+		}
+		m = min(m, want - got);
+		memmove(dst + got, stream->buf + stream->rpos, m);
+		stream->rpos += m;
+		got += m;
+	}
+	return got / size;
+}
+
+size_t fwrite(const void *restrict ptr, size_t size, size_t nitems, FILE *restrict stream) {
+	//POSIX Base Definitions, Issue 6 - page 450
+	size_t want = size * nitems, put = 0;
+	const char *src = ptr;
+
+	if(want == 0) {
+		return 0;
+	}
+	dropread(stream);
+	getbuf(stream);
+	// More than a buffer's worth goes straight out after what is waiting.
+	if(want >= stream->bufsize) {
+		if(fflush(stream) == EOF) {
+			return 0;
+		}
+		while(put < want) {
+			int n = write(stream->fd, (char*)src + put, want - put);
+			if(n <= 0) {
+				break;
+			}
+			put += n;
+		}
+		return put / size;
+	}
+	while(put < want) {
+		int m = min(stream->bufsize - stream->wlen, want - put);
+		memmove(stream->buf + stream->wlen, src + put, m);
+		stream->wlen += m;
+		put += m;
+		if(stream->wlen == stream->bufsize && flushout(stream) == EOF) {
+			return 0;
+		}
+	}
+	if(stream->mode == _IOLBF && memchr(src, '\n', want) && fflush(stream) == EOF) {
+		return 0;
+	}
+	return nitems;
+}
+
+int fputc(int c, FILE *stream) {
+	char ch = c;
+
+	if(stream->wlen > 0 && stream->wlen < stream->bufsize - 1 && ch != '\n') {
+		//the usual case, just buffer it
+		stream->buf[stream->wlen++] = ch;
+		return (unsigned char)ch;
+	}
+	return fwrite(&ch, 1, 1, stream) == 1 ? (unsigned char)ch : EOF;
+}
+
+int fputs(const char *restrict s, FILE *restrict stream) {
+	size_t n = strlen(s);
+	return fwrite(s, 1, n, stream) == n ? 0 : EOF;
+}
+
+int putchar(int c) {
+	return fputc(c, stdout);
+}
 
-static int32_t putc(int fd, char c) {
-	write(fd, &c, 1);
+static int32_t putc(FILE *stream, char c) {
+	fputc(c, stream);
 	return 1;
 }
 
@@ -133,7 +339,7 @@ static int8_t printlong(long xx, int base, int sgn, char *outbuf) {
 }
 
 // This is the core print method, all external functions delegate to this.
-static int32_t vprintf(uint8_t mode, int32_t fd, char *obuf, uint32_t maxlen, const char *fmt,  va_list ap){
+static int32_t vprintf(uint8_t mode, FILE *fd, char *obuf, uint32_t maxlen, const char *fmt,  va_list ap){
 	char *s;
 	int c, i, state;
 	int32_t len = 0; //based on mode this will either represent:
@@ -258,7 +464,7 @@ static int32_t vprintf(uint8_t mode, int32_t fd, char *obuf, uint32_t maxlen, co
 int fprintf(FILE *stream, const char *fmt, ...){
 	va_list args;
 	va_start(args, fmt);
-	int result = vprintf(PRINT_SCREEN, stream->fd, 0, 0, fmt, args);
+	int result = vprintf(PRINT_SCREEN, stream, 0, 0, fmt, args);
 	va_end(args);
 	return result;
 }
@@ -266,7 +472,7 @@ int fprintf(FILE *stream, const char *fmt, ...){
 void printf(const char *fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	vprintf(PRINT_SCREEN, 0, 0, 0, fmt, args);
+	vprintf(PRINT_SCREEN, stdout, 0, 0, fmt, args);
 	va_end(args);
 }
 
@@ -290,8 +496,19 @@ FILE *fopen(const char *restrict filename, const char *restrict mode) {
 	}
 	char fname[2048]; //HACK
 	int fd = open(strncpy(&fname[0], filename, 2048), omode);
+	if(fd < 0) {
+		return 0;
+	}
 	FILE *result = malloc(sizeof(FILE));
+	if(result == 0) {
+		close(fd);
+		return 0;
+	}
+	memset(result, 0, sizeof(FILE));
 	result->fd = fd;
+	result->mode = _IOFBF;
+	result->next = files;
+	files = result;
 
 	return result;
 }
@@ -299,30 +516,58 @@ FILE *fopen(const char *restrict filename, const char *restrict mode) {
 long ftell(FILE *stream) {
 	//the Xv64 "seek" syscall returns the file offset after seeking,
 	//so if we seek to 0 (e.g. our current location)
-	//then we will have the current file offset
+	//then we will have the current file offset, less what is
+	//read ahead and plus what is waiting to be written
 	int result = seek(stream->fd, 0);
 	if(result < 0) {
 		return -1;
 	}
-	return result;
+	return result - (stream->rlen - stream->rpos) + stream->wlen;
 }
 
 int fclose(FILE *f) {
-	return close(f->fd);
+	int result = fflush(f);
+
+	if(close(f->fd) < 0) {
+		result = EOF;
+	}
+	if(f->ownbuf) {
+		free(f->buf);
+	}
+	f->buf = 0;
+	f->ownbuf = 0;
+	f->rpos = f->rlen = 0;
+	if(f == stdin || f == stdout || f == stderr) {
+		return result;
+	}
+	for(FILE **pp = &files; *pp != 0; pp = &(*pp)->next) {
+		if(*pp == f) {
+			*pp = f->next;
+			break;
+		}
+	}
+	free(f);
+	return result;
 }
 
 int fseek(FILE *stream, long offset, int whence) {
 	//POSIX Base Definitions, Issue 6 - page 442
 	if(whence == SEEK_CUR) {
+		if(fflush(stream) == EOF) {
+			return -1;
+		}
+		offset -= stream->rlen - stream->rpos;
+		stream->rpos = stream->rlen = 0;
 		int result = seek(stream->fd, offset);
 		if(result < 0) {
 			return -1;
 		}
+		stream->readable = 0;
 		return 0;
 	}
 	return -1; //not supported at the moment
 }
 
 int vfprintf(FILE *stream, const char *restrict fmt, va_list args) {
-	return vprintf(PRINT_SCREEN, stream->fd, 0, 0, fmt, args);
+	return vprintf(PRINT_SCREEN, stream, 0, 0, fmt, args);
 }
@@ -3,6 +3,7 @@
 #include "syscalls.h"
 #include "x86.h"
 #include "fcntl.h"
+#include "strsimd.h"
 
 int32_t atoi(const char *s) {
 	int32_t n;
@@ -33,18 +34,12 @@ char *gets(char *buf, int32_t max) {
 }
 
 
-int32_t memcmp(const void* v1, const void* v2, uint32_t n) {
-	const unsigned char* s1, * s2;
-
-	s1 = v1;
-	s2 = v2;
-	while (n-- > 0) {
-		if (*s1 != *s2)
-			return *s1 - *s2;
-		s1++, s2++;
-	}
+void* memchr(const void* s, int32_t c, uint32_t n) {
+	return _memchr(s, c, n);
+}
 
-	return 0;
+int32_t memcmp(const void* v1, const void* v2, uint32_t n) {
+	return _memcmp(v1, v2, n);
 }
 
 void* memmove(void* dst, const void* src, uint32_t n){
@@ -104,10 +99,7 @@ char* strcat_s(char *dest, char *right, int32_t max_len) {
 }
 
 char* strchr(const char *s, char c) {
-	for(; *s; s++)
-		if(*s == c)
-			return (char*)s;
-	return 0;
+	return _strchr(s, c);
 }
 
 char* strcpy(char *s, char *t) {
@@ -120,11 +112,7 @@ char* strcpy(char *s, char *t) {
 }
 
 int32_t strlen(const char* s) {
-	int32_t n;
-
-	for (n = 0; s[n]; n++)
-		;
-	return n;
+	return _strlen(s);
 }
 
 int32_t strcmp(const char *s1, const char *s2) {
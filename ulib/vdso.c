@@ -0,0 +1,42 @@
+// Queries answered from the pages the kernel maps at the top of
+// every address space (see vdso.h), without a system call.
+
+#include "types.h"
+#include "x86.h"
+#include "time.h"
+#include "user.h"
+#include "vdso.h"
+
+// The system calls themselves, in usys.S.
+int _getpid(void);
+uint32 _getppid(void);
+int _ticks(void);
+int _clock_gettime(int, struct timespec*);
+
+#define VT ((struct vdsotime*)VDSO_TIME)
+#define VP ((struct vdsoproc*)VDSO_PROC)
+
+int getpid(void){
+	return VP->pid ? VP->pid : _getpid();
+}
+
+uint32 getppid(void){
+	return VP->pid ? VP->ppid : _getppid();
+}
+
+int ticks(void){
+	return VT->ticks;
+}
+
+// As nsecs() in the kernel.
+int clock_gettime(int clk, struct timespec* ts){
+	uint64 d, khz = VT->tsckhz, ns;
+
+	if (clk != CLOCK_MONOTONIC || khz == 0)
+		return _clock_gettime(clk, ts);
+	d = rdtsc() - VT->tscboot;
+	ns = d / khz * 1000000 + d % khz * 1000000 / khz;
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+	return 0;
+}
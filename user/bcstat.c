@@ -0,0 +1,19 @@
+#include "types.h"
+#include "user.h"
+#include "buf.h"
+
+// Print the kernel's buffer cache counters.
+int main(int argc, char **argv) {
+	struct bcachestat st;
+
+	if (bcachestat(&st) < 0) {
+		fprintf(stderr, "bcstat: failed\n");
+		procexit();
+	}
+	fprintf(stdout, "buffers\t%d in %d pages of at most %d\n", (int)st.nbuf, (int)st.pages, (int)st.maxpages);
+	fprintf(stdout, "hits\t%d\nmisses\t%d\nevicted\t%d\n", (int)st.hits, (int)st.misses, (int)st.evictions);
+	fprintf(stdout, "readahead\t%d\n", (int)st.readaheads);
+	fprintf(stdout, "delayed\t%d\nflushed\t%d\ndirty\t%d\n", (int)st.delwri, (int)st.flushed, (int)st.ndirty);
+	fprintf(stdout, "grown\t%d pages\nshrunk\t%d pages\n", (int)st.grows, (int)st.shrinks);
+	procexit();
+}
@@ -0,0 +1,285 @@
+#include "types.h"
+#include "user.h"
+#include "string.h"
+#include "fcntl.h"
+#include "x86.h"
+#include "vdso.h"
+#include "perf.h"
+
+// Kernel microbenchmarks: bench [name...] runs the named ones, or
+// all of them, and prints the TSC cycles and nanoseconds each
+// operation took, on average, for comparing one kernel with the
+// next. Run it on a quiet machine, a few times.
+//
+// Where the CPU has performance counters, each line also gives
+// instructions per cycle and the last-level cache and branch miss
+// rates, as many of them as there are counters for. They count
+// bench's own process only, not the children some benchmarks fork.
+
+#define FILE   "/benchfile"
+#define FILESZ (1024 * 1024)
+#define BLK    4096
+
+int _getpid(void); // the system call, not the vdso's answer
+
+static char buf[BLK];
+
+// Counted in pairs, the first pairs if there aren't counters for all.
+static int events[] = {
+	PERF_CYCLES, PERF_INSTRUCTIONS,
+	PERF_LLCREFS, PERF_LLCMISSES,
+	PERF_BRANCHES, PERF_BRANCHMISSES,
+};
+
+#define NEVENTS (sizeof(events) / sizeof(events[0]))
+
+static int nevents;             // of them being counted
+
+static void die(char *what) {
+	fprintf(stderr, "bench: %s failed\n", what);
+	procexit();
+}
+
+// Print n / of to two places, with what before it and unit after.
+static void ratio(char *what, uint64 n, uint64 of, int scale, char *unit) {
+	uint64 v;
+
+	if (of == 0)
+		return;
+	v = n * scale * 100 / of;
+	fprintf(stdout, "\t%s %d.%d%d%s", what, (int)(v / 100), (int)(v / 10 % 10), (int)(v % 10), unit);
+}
+
+static void report(char *name, int ops, uint64 cycles, unsigned long *ctr) {
+	uint64 khz = ((struct vdsotime*)VDSO_TIME)->tsckhz;
+	uint64 per = cycles / ops;
+
+	fprintf(stdout, "%s\t%d ops\t%d cycles/op", name, ops, (int)per);
+	if (khz)
+		fprintf(stdout, "\t%d ns/op", (int)(per * 1000000 / khz));
+	if (nevents >= 2)
+		ratio("IPC", ctr[1], ctr[0], 1, "");
+	if (nevents >= 4)
+		ratio("LLC miss", ctr[3], ctr[2], 100, "%");
+	if (nevents >= 6)
+		ratio("branch miss", ctr[5], ctr[4], 100, "%");
+	fprintf(stdout, "\n");
+}
+
+static int null(void) {
+	for (int i = 0; i < 100000; i++)
+		_getpid();
+	return 100000;
+}
+
+static int forkexit(void) {
+	int pid;
+
+	for (int i = 0; i < 200; i++) {
+		if ((pid = fork()) < 0)
+			die("fork");
+		if (pid == 0)
+			procexit();
+		wait();
+	}
+	return 200;
+}
+
+static int forkexec(void) {
+	char *argv[] = { "bench", "-exit", 0 };
+	int pid;
+
+	for (int i = 0; i < 100; i++) {
+		if ((pid = fork()) < 0)
+			die("fork");
+		if (pid == 0) {
+			exec("/bin/bench", argv);
+			die("exec");
+		}
+		wait();
+	}
+	return 100;
+}
+
+// A byte back and forth between two processes: each op is a round
+// trip, two switches.
+static int ctxsw(void) {
+	int to[2], from[2], pid, n = 10000;
+	char c = 0;
+
+	if (pipe(to) < 0 || pipe(from) < 0)
+		die("pipe");
+	if ((pid = fork()) < 0)
+		die("fork");
+	if (pid == 0) {
+		while (read(to[0], &c, 1) == 1)
+			write(from[1], &c, 1);
+		procexit();
+	}
+	for (int i = 0; i < n; i++) {
+		write(to[1], &c, 1);
+		read(from[0], &c, 1);
+	}
+	close(to[1]);
+	wait();
+	close(to[0]);
+	close(from[0]);
+	close(from[1]);
+	return n;
+}
+
+// 4 KB writes into a pipe, read out by a child.
+static int pipethru(void) {
+	int p[2], pid, n = 4096;
+
+	if (pipe(p) < 0)
+		die("pipe");
+	if ((pid = fork()) < 0)
+		die("fork");
+	if (pid == 0) {
+		close(p[1]);
+		while (read(p[0], buf, sizeof(buf)) > 0)
+			;
+		procexit();
+	}
+	close(p[0]);
+	for (int i = 0; i < n; i++)
+		if (write(p[1], buf, sizeof(buf)) != sizeof(buf))
+			die("pipe write");
+	close(p[1]);
+	wait();
+	return n;
+}
+
+// Pages from sbrk, touched and given back: each op is a page in
+// and out of kalloc.
+static int kallocrate(void) {
+	int pages = 256, rounds = 16;
+	char *p;
+
+	for (int r = 0; r < rounds; r++) {
+		if ((p = sbrk(pages * BLK)) == (char*)-1)
+			die("sbrk");
+		for (int i = 0; i < pages; i++)
+			p[i * BLK] = 1;
+		sbrk(-pages * BLK);
+	}
+	return pages * rounds;
+}
+
+static int seqwrite(void) {
+	int fd;
+
+	unlink(FILE);
+	if ((fd = open(FILE, O_CREATE | O_RDWR)) < 0)
+		die("create");
+	for (int i = 0; i < FILESZ / BLK; i++)
+		if (write(fd, buf, BLK) != BLK)
+			die("write");
+	fsync(fd);
+	close(fd);
+	return FILESZ / BLK;
+}
+
+static int seqread(void) {
+	int fd;
+
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		die("open");
+	for (int i = 0; i < FILESZ / BLK; i++)
+		if (read(fd, buf, BLK) != BLK)
+			die("read");
+	close(fd);
+	return FILESZ / BLK;
+}
+
+static uint next = 1;
+
+static int randblk(void) {
+	next = next * 1103515245 + 12345;
+	return (next >> 16) % (FILESZ / BLK);
+}
+
+static int randread(void) {
+	int fd;
+
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		die("open");
+	for (int i = 0; i < FILESZ / BLK; i++)
+		if (pread(fd, buf, BLK, randblk() * BLK) != BLK)
+			die("pread");
+	close(fd);
+	return FILESZ / BLK;
+}
+
+static int randwrite(void) {
+	int fd;
+
+	if ((fd = open(FILE, O_RDWR)) < 0)
+		die("open");
+	for (int i = 0; i < FILESZ / BLK; i++)
+		if (pwrite(fd, buf, BLK, randblk() * BLK) != BLK)
+			die("pwrite");
+	fsync(fd);
+	close(fd);
+	unlink(FILE);
+	return FILESZ / BLK;
+}
+
+// In order: the file ones need seqwrite's file.
+static struct {
+	char *name;
+	int (*fn)(void);
+} benches[] = {
+	{ "null",      null },
+	{ "fork",      forkexit },
+	{ "exec",      forkexec },
+	{ "ctxsw",     ctxsw },
+	{ "pipe",      pipethru },
+	{ "kalloc",    kallocrate },
+	{ "seqwrite",  seqwrite },
+	{ "seqread",   seqread },
+	{ "randread",  randread },
+	{ "randwrite", randwrite },
+};
+
+#define NBENCH (sizeof(benches) / sizeof(benches[0]))
+
+static void run(int i) {
+	unsigned long ctr[NEVENTS];
+	uint64 t0, t1;
+	int ops;
+
+	if (nevents)
+		perfctl(events, nevents); // from zero
+	t0 = rdtsc();
+	ops = benches[i].fn();
+	t1 = rdtsc();
+	if (nevents)
+		perfread(ctr, nevents);
+	report(benches[i].name, ops, t1 - t0, ctr);
+}
+
+int main(int argc, char *argv[]) {
+	int i, j;
+
+	if (argc > 1 && strncmp(argv[1], "-exit", 6) == 0)
+		procexit(); // exec's child
+	for (nevents = NEVENTS; nevents > 0 && perfctl(events, nevents) < 0; nevents -= 2)
+		;
+	if (argc == 1)
+		for (i = 0; i < NBENCH; i++)
+			run(i);
+	for (j = 1; j < argc; j++) {
+		for (i = 0; i < NBENCH && strncmp(argv[j], benches[i].name, strlen(benches[i].name) + 1) != 0; i++)
+			;
+		if (i == NBENCH) {
+			fprintf(stderr, "bench: no benchmark %s\n", argv[j]);
+			continue;
+		}
+		if (benches[i].fn == seqread || benches[i].fn == randread || benches[i].fn == randwrite)
+			seqwrite(); // something to read
+		run(i);
+	}
+	procexit();
+}
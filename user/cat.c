@@ -3,14 +3,32 @@
 #include "user.h"
 #include "fcntl.h"
 
-char buf[32];
+// A file goes to stdout with sendfile, page by page inside the
+// kernel; anything else, or a stdout sendfile can't write to,
+// through a buffer.
+
+#define CHUNK (1024 * 1024) // asked of sendfile at a time
+
+char buf[64 * 1024];
 
 void cat(int fd) {
-	int n = 1;
+	struct stat st;
+	int n = 1, m, w;
+
+	if(fstat(fd, &st) == 0 && st.type == T_FILE) {
+		while((n = sendfile(1, fd, 0, CHUNK)) > 0)
+			;
+		if(n == 0)
+			return;
+		n = 1; // on from where it stopped
+	}
 	while(n > 0 || n == FNOT_READY) {
 		n = read(fd, buf, sizeof(buf));
-		if (n > 0) {
-			write(1, buf, n);
+		for(m = 0; m < n; m += w) {
+			if((w = write(1, buf + m, n - m)) <= 0) {
+				fprintf(stderr, "cat: write error\n");
+				procexit();
+			}
 		}
 	}
 	if(n < 0) {
@@ -0,0 +1,17 @@
+#include "types.h"
+#include "user.h"
+
+#define LOGSIZE 16384
+
+// Print what the kernel has logged, as far back as it remembers.
+int main(int argc, char **argv) {
+	char *buf = malloc(LOGSIZE);
+	int n;
+
+	if (buf == 0 || (n = klogread(buf, LOGSIZE)) < 0) {
+		fprintf(stderr, "dmesg: failed\n");
+		procexit();
+	}
+	write(stdout, buf, n);
+	procexit();
+}
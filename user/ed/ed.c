@@ -16,12 +16,6 @@
 
 #define LINE_MAX_LEN 1024
 
-struct line {
-	char *text;
-	struct line *next;
-	struct line *prev;
-};
-
 static char *read_line(FILE *f)
 {
 	char buf[LINE_MAX_LEN];
@@ -57,8 +51,18 @@ enum err {
 	E_BUF_MODIFIED,
 };
 
+/*
+ * Lines are kept in an array with a gap in it where the last insert or
+ * delete was, so addressing a line is an index and editing near the
+ * same place moves nothing. Each line's text is malloc'd by itself,
+ * except for a file loaded at start, which is read whole and split up
+ * in one piece.
+ */
 struct buffer {
-	struct line *first;
+	char **lines;
+	long int size;			/* of lines[] */
+	long int gap, gap_end;		/* lines[gap..gap_end) is free */
+	char *loaded, *loaded_end;	/* the text of the file loaded, if any */
 	long int nlines;
 	long int cur_line;
 	int print_errors;
@@ -67,48 +71,112 @@ struct buffer {
 
 static void buffer_init(struct buffer *b)
 {
-	b->first = NULL;
+	b->lines = NULL;
+	b->size = b->gap = b->gap_end = 0;
+	b->loaded = b->loaded_end = NULL;
 	b->nlines = 0;
 	b->cur_line = 1;
 	b->print_errors = 0;
 	b->changed = 0;
 }
 
+/* Text of line n, counting from 1. */
+static char *buffer_line(struct buffer *b, long int n)
+{
+	n--;
+	return b->lines[n < b->gap ? n : n + b->gap_end - b->gap];
+}
+
+/* Move the gap to before line at + 1, making it at least need long. */
+static void buffer_gap(struct buffer *b, long int at, long int need)
+{
+	if (b->gap_end - b->gap < need) {
+		long int after = b->size - b->gap_end, size = 2 * b->size;
+		if (size < b->nlines + need)
+			size = b->nlines + need;
+		if (size < 64)
+			size = 64;
+		char **lines = malloc(size * sizeof(char *));
+		if (!lines) {
+			fprintf(stderr, "malloc");
+			exit(1);
+		}
+		if (b->lines) {
+			memcpy(lines, b->lines, b->gap * sizeof(char *));
+			memcpy(lines + size - after, b->lines + b->gap_end, after * sizeof(char *));
+			free(b->lines);
+		}
+		b->lines = lines;
+		b->gap_end = size - after;
+		b->size = size;
+	}
+	if (at < b->gap) {
+		long int n = b->gap - at;
+		memmove(b->lines + b->gap_end - n, b->lines + at, n * sizeof(char *));
+		b->gap = at;
+		b->gap_end -= n;
+	} else if (at > b->gap) {
+		long int n = at - b->gap;
+		memmove(b->lines + b->gap, b->lines + b->gap_end, n * sizeof(char *));
+		b->gap = at;
+		b->gap_end += n;
+	}
+}
+
 static void buffer_init_load(struct buffer *b, FILE *f)
 {
-	size_t l = 0;
-	struct line *first = NULL, *prev = NULL;
-	char *text;
-	b->nlines = 0;
-	while ((text = read_line(f)) != NULL) {
-		if (l > LINE_MAX_LEN)
-			fprintf(stderr, "input line too long at %zu bytes", l);
-		struct line *l = malloc(sizeof(*l));
-		if (!first)
-			first = l;
-		l->text = text;
-		l->prev = prev;
-		if (prev)
-			prev->next = l;
-		prev = l;
-		l->next = NULL;
-		b->nlines++;
+	long int size, nlines = 0;
+	char *data, *p, *end, *nl;
+	buffer_init(b);
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	b->cur_line = 0;
+	if (size <= 0)
+		return;
+	data = malloc(size);
+	if (!data) {
+		fprintf(stderr, "malloc");
+		exit(1);
+	}
+	size = fread(data, 1, size, f);
+	for (p = data, end = data + size; p < end; p = nl + 1, nlines++)
+		if (!(nl = memchr(p, '\n', end - p)))
+			nl = end;
+	/* Each line as it was, and a NUL after it. */
+	b->loaded = malloc(size + nlines + 1);
+	if (!b->loaded) {
+		fprintf(stderr, "malloc");
+		exit(1);
+	}
+	b->loaded_end = b->loaded + size + nlines + 1;
+	buffer_gap(b, 0, nlines);
+	char *t = b->loaded;
+	for (p = data; p < end; p = nl + 1) {
+		if (!(nl = memchr(p, '\n', end - p)))
+			nl = end - 1;
+		memcpy(t, p, nl + 1 - p);
+		b->lines[b->gap++] = t;
+		t += nl + 1 - p;
+		*t++ = '\0';
 	}
-	b->first = first;
+	free(data);
+	b->nlines = nlines;
 	b->cur_line = b->nlines;
-	b->print_errors = 0;
-	b->changed = 0;
+}
+
+static void buffer_free_text(struct buffer *buf, char *text)
+{
+	if (text < buf->loaded || text >= buf->loaded_end)
+		free(text);
 }
 
 static void buffer_free(struct buffer *buf)
 {
-	struct line *line = buf->first, *prev;
-	while (line) {
-		free(line->text);
-		prev = line;
-		line = line->next;
-		free(prev);
-	}
+	for (long int n = 1; n <= buf->nlines; n++)
+		buffer_free_text(buf, buffer_line(buf, n));
+	free(buf->loaded);
+	free(buf->lines);
 }
 
 static void xusage(int eval, char *fmt, ...)
@@ -219,69 +287,37 @@ out_err:
 static void buffer_print_range(struct buffer *buf, long int a, long int b,
                                int with_line_numbers)
 {
-	struct line *line;
-	long int line_no = 1;
-	for (line = buf->first; line != NULL; line = line->next, line_no++) {
-		if (line_no > b)
-			break;
-		if (line_no < a)
-			continue;
+	for (long int line_no = a; line_no <= b; line_no++) {
 		if (with_line_numbers)
-			printf("%d\t%s", line_no, line->text);
+			printf("%d\t%s", line_no, buffer_line(buf, line_no));
 		else
-			printf("%s", line->text);
+			printf("%s", buffer_line(buf, line_no));
 	}
 }
 
 static void buffer_cut_range(struct buffer *buf, long int a, long int b)
 {
-	struct line *cur, *next = NULL;
-	long int line_no = 1;
-	for (cur = buf->first; cur != NULL; cur = next, line_no++) {
-		next = cur->next;
-		if (line_no > b)
-			break;
-		if (line_no < a)
-			continue;
-		if (cur->prev)
-			cur->prev->next = next;
-		else
-			buf->first = next;
-		if (next)
-			next->prev = cur->prev;
-		buf->nlines--;
-		buf->changed = 1;
-		free(cur->text);
-		free(cur);
-	}
+	if (a < 1)
+		a = 1;
+	if (b > buf->nlines)
+		b = buf->nlines;
+	if (a > b)
+		return;
+	buffer_gap(buf, a - 1, 0);
+	for (long int line_no = a; line_no <= b; line_no++)
+		buffer_free_text(buf, buf->lines[buf->gap_end++]);
+	buf->nlines -= b - a + 1;
+	buf->changed = 1;
 }
 
-static void buffer_insert(struct buffer *buf, long int before, struct line *l)
+static void buffer_insert(struct buffer *buf, long int before, char *text)
 {
-	struct line *line, *last = NULL;
-	long int line_no = 1;
-	for (line = buf->first; line != NULL; line = line->next, line_no++) {
-		last = line;
-		if (line_no == before)
-			break;
-	}
-	if (line && line_no == before && buf->nlines != 0)
-		line = line->prev;
-	else
-		line = last;
-	if (line) {
-		if (line->next)
-			line->next->prev = l;
-		l->next = line->next;
-		l->prev = line;
-		line->next = l;
-	} else {
-		/* TODO Using a list with a head, we wouldn't need this branch. */
-		l->next = buf->first;
-		if (buf->first)
-			buf->first->prev = l;
-		buf->first = l;
-	}
+	if (before < 1)
+		before = 1;
+	if (before > buf->nlines)
+		before = buf->nlines + 1;
+	buffer_gap(buf, before - 1, 1);
+	buf->lines[buf->gap++] = text;
 	buf->nlines++;
 	buf->changed = 1;
 }
@@ -294,8 +330,8 @@ static enum err buf_write(struct buffer *buf, const char *fname)
 		fprintf(stderr, "%s: %s\n", fname, strerror(errno));
 		return E_BAD_OF;
 	}
-	for (struct line *l = buf->first; l != NULL; l = l->next)
-		written += (size_t)fprintf(f, "%s", l->text);
+	for (long int n = 1; n <= buf->nlines; n++)
+		written += (size_t)fprintf(f, "%s", buffer_line(buf, n));
 	fclose(f);
 	buf->changed = 0;
 	printf("%d\n", written);
@@ -466,10 +502,7 @@ void main(int argc, char *argv[]) {
 					free(input);
 					break;
 				}
-				struct line *l = malloc(sizeof(*l));
-				l->next = l->prev = NULL;
-				l->text = input;
-				buffer_insert(&buf, before, l);
+				buffer_insert(&buf, before, input);
 				before++;
 			}
 			buf.cur_line = cmd.a;
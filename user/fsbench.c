@@ -0,0 +1,167 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "string.h"
+#include "fcntl.h"
+#include "x86.h"
+#include "vdso.h"
+
+// File system metadata benchmark: fsbench [-n files] [dir] makes,
+// stats and removes many small files in one directory, a deep tree
+// of directories, and a few files grown by small appends, under dir
+// (default /fsbench), printing each phase's time and cycles per
+// operation. Everything is removed again at the end, then synced,
+// so tools/fsck can check the disk after a halt ("make fsck").
+
+#define DEPTH   32    // directories in the deep tree
+#define NAPPEND 4     // files appended to
+#define ASIZE   512   // bytes an append writes
+
+static char buf[ASIZE];
+static char path[256];
+
+static void die(char *what, char *name) {
+	fprintf(stderr, "fsbench: %s %s failed\n", what, name);
+	procexit();
+}
+
+static uint64 t0;
+
+static void start(void) {
+	t0 = rdtsc();
+}
+
+static void report(char *phase, int ops) {
+	uint64 cycles = rdtsc() - t0, khz = ((struct vdsotime*)VDSO_TIME)->tsckhz;
+
+	fprintf(stdout, "%s\t%d ops\t%d cycles/op", phase, ops, (int)(cycles / (ops ? ops : 1)));
+	if (khz)
+		fprintf(stdout, "\t%d ms", (int)(cycles / khz));
+	fprintf(stdout, "\n");
+}
+
+// "f" and i in decimal, into name.
+static char *fname(char *name, char *f, int i) {
+	char d[12];
+	int n = 0;
+
+	do
+		d[n++] = '0' + i % 10;
+	while ((i /= 10) > 0);
+	strcpy(name, f);
+	for (f = name + strlen(name); n > 0; )
+		*f++ = d[--n];
+	*f = 0;
+	return name;
+}
+
+static void smallfiles(int n) {
+	char name[16];
+	struct stat st;
+	int fd;
+
+	start();
+	for (int i = 0; i < n; i++) {
+		if ((fd = open(fname(name, "f", i), O_CREATE | O_RDWR)) < 0)
+			die("create", name);
+		write(fd, buf, 64);
+		close(fd);
+	}
+	report("create", n);
+	start();
+	for (int i = 0; i < n; i++)
+		if (stat(fname(name, "f", i), &st) < 0 || st.size != 64)
+			die("stat", name);
+	report("stat", n);
+	start();
+	for (int i = n - 1; i >= 0; i -= 2)
+		if (stat(fname(name, "f", i), &st) < 0)
+			die("stat", name);
+	for (int i = 0; i < n; i += 2)
+		if (stat(fname(name, "f", i), &st) < 0)
+			die("stat", name);
+	report("stat-shuffled", n);
+	start();
+	for (int i = 0; i < n; i++)
+		if (unlink(fname(name, "f", i)) < 0)
+			die("unlink", name);
+	report("unlink", n);
+}
+
+// DEPTH directories, one in the next, made by full path each
+// time so lookup walks the whole tree; then removed deepest first.
+static void deeptree(void) {
+	struct stat st;
+	int len;
+
+	start();
+	strcpy(path, "d");
+	for (int i = 0; i < DEPTH; i++) {
+		if (mkdir(path) < 0)
+			die("mkdir", path);
+		strcpy(path + strlen(path), "/d");
+	}
+	report("mkdir-deep", DEPTH);
+	path[strlen(path) - 2] = 0;
+	start();
+	for (int i = 0; i < 100; i++)
+		if (stat(path, &st) < 0)
+			die("stat", path);
+	report("stat-deep", 100);
+	start();
+	for (int i = 0; i < DEPTH; i++) {
+		if (unlink(path) < 0)
+			die("rmdir", path);
+		if ((len = strlen(path)) > 2)
+			path[len - 2] = 0;
+	}
+	report("rmdir-deep", DEPTH);
+}
+
+// As big as a file can be, by the block or beyond: appends until
+// a write falls short.
+static void appends(void) {
+	char name[16];
+	int fd, n = 0, done;
+
+	start();
+	for (int i = 0; i < NAPPEND; i++) {
+		if ((fd = open(fname(name, "a", i), O_CREATE | O_RDWR)) < 0)
+			die("create", name);
+		for (done = 0; done < 1024 && write(fd, buf, ASIZE) == ASIZE; done++)
+			;
+		n += done;
+		close(fd);
+	}
+	report("append", n);
+	start();
+	for (int i = 0; i < NAPPEND; i++)
+		if (unlink(fname(name, "a", i)) < 0)
+			die("unlink", name);
+	report("unlink-big", NAPPEND);
+}
+
+int main(int argc, char *argv[]) {
+	char *dir = "/fsbench";
+	int n = 100;
+
+	if (argc > 2 && strncmp(argv[1], "-n", 3) == 0) {
+		n = atoi(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc > 1)
+		dir = argv[1];
+	if (mkdir(dir) < 0 || chdir(dir) < 0)
+		die("mkdir", dir);
+	smallfiles(n);
+	deeptree();
+	appends();
+	chdir("/");
+	if (unlink(dir) < 0)
+		die("rmdir", dir);
+	start();
+	sync();
+	report("sync", 1);
+	procexit();
+}
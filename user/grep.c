@@ -1,35 +1,206 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+// The pattern is compiled to an NFA, a list of atoms each maybe
+// starred, and run over each line a state set at a time, so a
+// line costs its length times the pattern's at worst, with no
+// backtracking. Most patterns have a run of plain characters any
+// match must contain; grep looks for that across the whole buffer
+// with memchr and checks only the lines it turns up in.
 
 #include "types.h"
 #include "stat.h"
 #include "user.h"
 #include "string.h"
 
-char buf[1024];
-int match(char*, char*);
+#define BUFSZ (64 * 1024)
+#define ANY   -1
 
-void grep(char *pattern, int fd) {
-	int n, m;
-	char *p, *q;
+struct atom {
+	int c;        // the character, or ANY for .
+	int star;     // followed by *: zero or more
+};
 
-	m = 0;
-	while((n = read(fd, buf+m, sizeof(buf)-m)) > 0) {
-		m += n;
-		p = buf;
-		while((q = strchr(p, '\n')) != 0) {
-			*q = 0;
-			if(match(pattern, p)) {
-				*q = '\n';
-				write(1, p, q+1 - p);
-			}
-			p = q+1;
+char buf[BUFSZ];
+char out[8192];
+int nout;
+
+struct atom *re;  // the pattern, natoms of it
+int natoms, bol, eol;
+char *must;       // characters every match contains, in a row
+int nmust, rare;  // and the offset in them of the one to look for
+int plain;        // must is the whole pattern
+
+int *cur, *nxt, *mark, gen;
+
+void flush(void) {
+	if(nout > 0)
+		write(1, out, nout);
+	nout = 0;
+}
+
+void emit(char *p, int n) {
+	if(nout + n + 1 > sizeof(out))
+		flush();
+	if(n + 1 > sizeof(out)) {
+		write(1, p, n);
+		write(1, "\n", 1);
+		return;
+	}
+	memmove(out + nout, p, n);
+	nout += n;
+	out[nout++] = '\n';
+}
+
+void compile(char *pat) {
+	static char freq[] = " etaoinshrdlcumwfgypbvkjxqz"; // commonest first
+	int i, len, best = -1, rank, r;
+	char *f;
+
+	if(*pat == '^') {
+		bol = 1;
+		pat++;
+	}
+	len = strlen(pat);
+	if(len > 0 && pat[len - 1] == '$') {
+		eol = 1;
+		pat[--len] = 0;
+	}
+	re = malloc((len + 1) * sizeof(*re));
+	mark = malloc((len + 1) * sizeof(int));
+	cur = malloc((len + 1) * sizeof(int));
+	nxt = malloc((len + 1) * sizeof(int));
+	if(re == 0 || mark == 0 || cur == 0 || nxt == 0) {
+		fprintf(stderr, "grep: out of memory\n");
+		procexit();
+	}
+	for(i = 0; i < len; i++) {
+		re[natoms].c = pat[i] == '.' ? ANY : (uchar)pat[i];
+		re[natoms].star = pat[i + 1] == '*';
+		if(re[natoms].star)
+			i++;
+		mark[natoms++] = 0;
+	}
+	mark[natoms] = 0;
+
+	// The longest run of unstarred plain characters; a starred one
+	// may match nothing, so it breaks a run, as does a dot.
+	for(i = 0; i < natoms; ) {
+		int j = i;
+		while(j < natoms && re[j].c != ANY && !re[j].star)
+			j++;
+		if(j - i > nmust) {
+			nmust = j - i;
+			best = i;
+		}
+		i = j + 1;
+	}
+	if(nmust == 0)
+		return;
+	must = malloc(nmust);
+	for(i = 0; i < nmust; i++)
+		must[i] = re[best + i].c;
+	plain = nmust == natoms && !bol && !eol;
+	// Search for its least common character, roughly.
+	for(i = 0, rank = -1; i < nmust; i++) {
+		f = strchr(freq, must[i] | 0x20);
+		if((r = f ? f - freq : sizeof(freq)) > rank) {
+			rank = r;
+			rare = i;
+		}
+	}
+}
+
+// Add state i, and those it reaches without a character, to set.
+void add(int *set, int *n, int i) {
+	for(; mark[i] != gen; i++) {
+		mark[i] = gen;
+		set[(*n)++] = i;
+		if(i == natoms || !re[i].star)
+			break;
+	}
+}
+
+// The pattern against the line s[0..len).
+int nfa(char *s, int len) {
+	int ncur = 0, nnxt, *t, i, st, ch;
+
+	gen++;
+	if(bol)
+		add(cur, &ncur, 0);
+	for(i = 0; ; i++) {
+		if(!bol)
+			add(cur, &ncur, 0);
+		if(mark[natoms] == gen && (!eol || i == len))
+			return 1;
+		if(i == len || ncur == 0)
+			return 0;
+		ch = (uchar)s[i];
+		gen++;
+		nnxt = 0;
+		for(int k = 0; k < ncur; k++) {
+			st = cur[k];
+			if(st == natoms || (re[st].c != ANY && re[st].c != ch))
+				continue;
+			add(nxt, &nnxt, re[st].star ? st : st + 1);
 		}
-		if(p == buf)
-			m = 0;
-		if(m > 0) {
-			m -= p - buf;
-			memmove(buf, p, m);
+		t = cur; cur = nxt; nxt = t;
+		ncur = nnxt;
+	}
+}
+
+// Lines of buf[0..n), all whole, that match.
+void scan(char *p, char *end) {
+	char *q, *s, *e, *line = p;
+
+	if(nmust == 0) {
+		for(; p < end; p = q + 1) {
+			q = memchr(p, '\n', end - p);
+			if(nfa(p, q - p))
+				emit(p, q - p);
+		}
+		return;
+	}
+	while(end - p >= nmust) {
+		if((q = memchr(p + rare, must[rare], end - p - rare)) == 0)
+			return;
+		s = q - rare;
+		if(s + nmust > end || memcmp(s, must, nmust) != 0) {
+			p = s + 1;
+			continue;
+		}
+		// Back to the start of its line, on to the end.
+		for(q = s; q > line && q[-1] != '\n'; q--)
+			;
+		e = memchr(s, '\n', end - s);
+		if(memchr(s, '\n', nmust) == 0 && (plain || nfa(q, e - q)))
+			emit(q, e - q);
+		p = line = e + 1;
+	}
+}
+
+void grep(int fd) {
+	int n, m = 0;
+	char *last;
+
+	while((n = read(fd, buf + m, sizeof(buf) - m)) > 0) {
+		m += n;
+		last = buf + m;
+		while(last > buf && last[-1] != '\n')
+			last--;
+		if(last == buf) {
+			if(m < sizeof(buf))
+				continue;
+			// A line longer than the buffer: take what there is.
+			buf[m - 1] = '\n';
+			last = buf + m;
 		}
+		scan(buf, last);
+		m -= last - buf;
+		memmove(buf, last, m);
+	}
+	if(m > 0 && m < sizeof(buf)) {
+		buf[m] = '\n';
+		scan(buf, buf + m + 1);
 	}
 }
 
@@ -37,68 +208,28 @@ int
 main(int argc, char *argv[])
 {
 	int fd, i;
-	char *pattern;
 
 	if(argc <= 1) {
 		fprintf(stderr, "usage: grep pattern [file ...]\n");
 		procexit();
 	}
-	pattern = argv[1];
+	compile(argv[1]);
 
 	if(argc <= 2) {
-		grep(pattern, 0);
+		grep(0);
+		flush();
 		procexit();
 	}
 
 	for(i = 2; i < argc; i++) {
 		if((fd = open(argv[i], 0)) < 0) {
+			flush();
 			fprintf(stdout, "grep: cannot open %s\n", argv[i]);
 			procexit();
 		}
-		grep(pattern, fd);
+		grep(fd);
 		close(fd);
 	}
+	flush();
 	procexit();
 }
-
-// Regexp matcher from Kernighan & Pike,
-// The Practice of Programming, Chapter 9.
-
-int matchhere(char*, char*);
-int matchstar(int, char*, char*);
-
-int
-match(char *re, char *text)
-{
-	if(re[0] == '^')
-		return matchhere(re+1, text);
-	do{ // must look at empty string
-		if(matchhere(re, text))
-			return 1;
-	}while(*text++ != '\0');
-	return 0;
-}
-
-// matchhere: search for re at beginning of text
-int matchhere(char *re, char *text)
-{
-	if(re[0] == '\0')
-		return 1;
-	if(re[1] == '*')
-		return matchstar(re[0], re+2, text);
-	if(re[0] == '$' && re[1] == '\0')
-		return *text == '\0';
-	if(*text!='\0' && (re[0]=='.' || re[0]==*text))
-		return matchhere(re+1, text+1);
-	return 0;
-}
-
-// matchstar: search for c*re at beginning of text
-int matchstar(int c, char *re, char *text)
-{
-	do{ // a * matches zero or more instances
-		if(matchhere(re, text))
-			return 1;
-	}while(*text!='\0' && (*text++==c || c=='.'));
-	return 0;
-}
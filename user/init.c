@@ -8,7 +8,9 @@
 #include "mmu.h"
 #include "proc.h"
 
-int spawn(char *task, char *name, int blessed){
+#define TMPFS_DEV (4 << 28)  // TODEVNUM(DEV_TMPFS, 0); see buf.h
+
+int start(char *task, char *name, int blessed){
 	fprintf(stdout, "init: starting %s\n", name);
 	int pid = blessed ? bfork() : fork();
 	char *argv[] = { name, 0 };
@@ -32,18 +34,48 @@ int main(void) {
 	dup(0); // stdout
 	dup(0); // stderr
 
-	// int kzeropid = 0;
-	// int krandompid = 0;
+	// The sampling profiler's, the tracepoints' and the
+	// in-kernel /dev/zero and /dev/random.
+	int fd = open("/dev/prof", O_RDONLY);
+	if(fd < 0)
+		mknod("/dev/prof", 4, 0);
+	else
+		close(fd);
+	if((fd = open("/dev/trace", O_RDONLY)) < 0)
+		mknod("/dev/trace", 5, 0);
+	else
+		close(fd);
+	if((fd = open("/dev/zero", O_RDONLY)) < 0)
+		mknod("/dev/zero", 6, 0);
+	else
+		close(fd);
+	if((fd = open("/dev/random", O_RDONLY)) < 0)
+		mknod("/dev/random", 7, 0);
+	else
+		close(fd);
+	if((fd = open("/dev/net0", O_RDONLY)) < 0)
+		mknod("/dev/net0", 8, 0);
+	else
+		close(fd);
+
+	// Scratch files live in memory. So does all of a MEMFS
+	// kernel's root, on the one tmpfs, and /tmp is just part of it.
+	struct stat st;
+	mkdir("/tmp");
+	if(mount("/tmp", "tmpfs") < 0 && (stat("/", &st) < 0 || st.dev != TMPFS_DEV))
+		fprintf(stdout, "init: cannot mount tmpfs on /tmp\n");
+	mkdir("/proc");
+	if(mount("/proc", "procfs") < 0)
+		fprintf(stdout, "init: cannot mount procfs on /proc\n");
+
 	int kidlepid = 0;
 	int shpid = 0;
 	int child = 0;
 	fprintf(stdout, "init: starting...\n");
 	while(1) {
 
-		//kzeropid = child == kzeropid ? spawn("/kexts/kzero", "kzero", 1) : kzeropid;
-		//krandompid = child == krandompid ? spawn("/kexts/krandom", "krandom", 1) : krandompid;
-		kidlepid = child == kidlepid ? spawn("/kexts/kidle", "kidle", 1) : kidlepid;
-		shpid = child == shpid ? spawn("/bin/sh", "sh", 0) : shpid;
+		kidlepid = child == kidlepid ? start("/kexts/kidle", "kidle", 1) : kidlepid;
+		shpid = child == shpid ? start("/bin/sh", "sh", 0) : shpid;
 
 		sleep(10);
 		child = wait();
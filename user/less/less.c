@@ -20,62 +20,130 @@
 #include <poll.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <sys/mman.h>
 
-// line structure
-struct line {
-	int no; // line number
-	int len; // length
-	char *cs; // characters
-	struct line *prev; // pointer to the previous line
-	struct line *next; // pointer to the next line
-};
+// Input is kept as it came, not line by line: a plain file is
+// mapped, a pipe read into blocks; lines are found with memchr a
+// block at a time, as far as they are wanted, and their starting
+// offsets kept in an index. Lines are numbered from 1.
+
+// block size
+#define BLKSZ 65536
 
-// append line to the list
-struct line *
-append (struct line *rl, char *buf, int sz) {
-	struct line *lptr; // line pointer
-	// allocate new line structure
-	lptr=malloc(sizeof(struct line));
-	// copy line and add terminating 0
-	lptr->len=sz;
-	lptr->cs=malloc(sz+1);
-	memcpy(lptr->cs,buf,sz);
-	lptr->cs[sz]=0;
-	// append line to the list
-	lptr->next=NULL;
-	lptr->prev=rl;
-	if (rl) {
-		lptr->no=rl->no+1;
-		rl->next=lptr;
-	} else
-		lptr->no=1;
-	return lptr;
+char *map; // mapped file, or NULL
+long mapsz; // its size
+char **blks; // blocks read from a pipe
+int nblks; // number of blocks
+long datalen; // bytes read or scanned so far
+long *lofs; // lofs[i] is where line i+1 starts; lofs[nl] is past line nl
+int nl; // number of lines known
+int maxl; // size of lofs
+int eof; // end-of-file reached flag
+
+// bytes at offset o; n gets how many follow in the same block
+char *
+at (long o, long *n) {
+	if (map) {
+		*n=mapsz-o;
+		return map+o;
+	}
+	*n=BLKSZ-o%BLKSZ;
+	return blks[o/BLKSZ]+o%BLKSZ;
 }
 
-// move pointer n lines before lptr
-struct line *
-sub (struct line *lptr, int n) {
-	int i=0;
-	while (lptr&&i<n) {
-		if (lptr->prev==NULL)
-			break;
-		lptr=lptr->prev;
-		++i;
+// note that a line starts at offset o
+void
+addline (long o) {
+	if (nl+2>maxl) {
+		// grow the index
+		long *n; // new index
+		maxl*=2;
+		n=malloc(maxl*sizeof(long));
+		memcpy(n,lofs,(nl+1)*sizeof(long));
+		free(lofs);
+		lofs=n;
 	}
-	return lptr;
+	lofs[++nl]=o;
 }
 
-// move pointer n lines after lptr
-struct line *
-add (struct line *lptr, int n) {
-	int i=0;
-	while (lptr&&i<n) {
-		if (lptr->next==NULL)
-			break;
-		lptr=lptr->next;
-		++i;
+// index the lines ending in [from,to), all in one block
+void
+scan (long from, long to) {
+	long n; // bytes there
+	char *s=at(from,&n),*e=s+(to-from),*p; // start, end and newline
+	while ((p=memchr(s,'\n',e-s))) {
+		addline(from+(p+1-s));
+		from+=p+1-s;
+		s=p+1;
 	}
-	return lptr;
+}
+
+// the input has ended; the last line may have had no newline
+void
+finish (void) {
+	if (lofs[nl]<datalen)
+		addline(datalen+1);
+	eof=1;
+}
+
+// get more input, if any, and index it; from a pipe this waits
+void
+more (void) {
+	long n; // bytes got
+	if (eof)
+		return;
+	if (map) {
+		n=mapsz-datalen<BLKSZ?mapsz-datalen:BLKSZ;
+		scan(datalen,datalen+n);
+		datalen+=n;
+		if (datalen==mapsz)
+			finish();
+		return;
+	}
+	if (datalen==(long)nblks*BLKSZ) {
+		char **nb=malloc((nblks+1)*sizeof(char *)); // new block list
+		if (nblks) memcpy(nb,blks,nblks*sizeof(char *));
+		free(blks);
+		blks=nb;
+		blks[nblks++]=malloc(BLKSZ);
+	}
+	n=read(0,blks[datalen/BLKSZ]+datalen%BLKSZ,BLKSZ-datalen%BLKSZ);
+	if (n<=0) {
+		finish();
+		return;
+	}
+	scan(datalen,datalen+n);
+	datalen+=n;
+}
+
+// copy line no, up to BUFSZ-1 characters of it, to buf; return its length
+int
+getln (int no, char *buf) {
+	long o=lofs[no-1],len=lofs[no]-o-1,k,n; // offset, length, copied so far, available
+	char *p; // where the rest is
+	if (len>BUFSZ-1)
+		// ignore rest of line
+		len=BUFSZ-1;
+	for (k=0; k<len; k+=n) {
+		p=at(o+k,&n);
+		if (n>len-k) n=len-k;
+		memcpy(buf+k,p,n);
+	}
+	buf[len]=0;
+	return len;
+}
+
+// line n lines before no, but not before the first
+int
+sub (int no, int n) {
+	return no-n>1?no-n:1;
+}
+
+// line n lines after no, but not after the last known
+int
+add (int no, int n) {
+	return no+n<nl?no+n:nl;
 }
 
 // clear status line
@@ -101,7 +169,7 @@ prthl (char *line, char *sub, int n) {
 	char *m; // pointer to match
 	// make buffer contain a null-terminated string
 	strncpy(buf,line,n);
-	buf[n+1]=0;
+	buf[n]=0;
 	b=buf;
 	// loop
 	do {
@@ -130,39 +198,42 @@ prthl (char *line, char *sub, int n) {
 	} while (m);
 }
 
-// print n lines before lptr
+// print n lines ending with line dl
 void
-prt (struct line *lptr, int n, int eof, int w, int h, int l, char *sstr) {
+prt (int dl, int n, int w, int h, int l, char *sstr) {
 	int i; // counter
+	int no; // line number
+	int len; // line length
 	int prtlen; // number of characters to be printed
 	int ateof; // last line is at EOF flag
 	int sn,en; // start and end line numbers
 	char sl[256]; // status line
+	char buf[BUFSZ]; // line
 	// is last line at EOF?
-	ateof=lptr->next==NULL&&eof;
+	ateof=dl==nl&&eof;
 	// find end and start line numbers
-	en=lptr->no;
+	en=dl;
 	sn=(en-h+1)>0?en-h+1:1;
-	// find start line pointer
-	lptr=sub(lptr,n-1);
+	// find start line
+	no=sub(dl,n-1);
 	// erase old status line
 	clrsl();
 	// print lines
-	for (i=0; i<n; ++i) {
-		if (lptr) {
-			if (lptr->len-l>0) {
-				prtlen=lptr->len-l;
+	for (i=0; i<n; ++i,++no) {
+		if (no<=nl) {
+			len=getln(no,buf);
+			if (len-l>0) {
+				prtlen=len-l;
 				if (prtlen>w) {
-					prthl(lptr->cs+l,sstr,w-1);
+					prthl(buf+l,sstr,w-1);
 					// continuation sign
 					write(1,INV,strlen(INV));
 					write(1,">",1);
 					write(1,NORM,strlen(NORM));
 				} else
-					prthl(lptr->cs+l,sstr,prtlen);
+					prthl(buf+l,sstr,prtlen);
 			}
 			write(1,"\n",1);
-			lptr=lptr->next;
 		} else
 			write(1,"~\n",2);
 	}
@@ -171,18 +242,33 @@ prt (struct line *lptr, int n, int eof, int w, int h, int l, char *sstr) {
 	prtsl(sl);
 }
 
-// search
-struct line *
-search (struct line *lptr, char *s, int fwd) {
-	while (lptr) {
-		if (strstr(lptr->cs,s))
-			return lptr;
+// search from line no on; a mapped file is indexed as it goes
+int
+search (int no, char *s, int fwd) {
+	char buf[BUFSZ]; // line
+	while (no>=1) {
+		if (no>nl&&map&&fwd&&!eof) {
+			more();
+			continue;
+		}
+		if (no>nl)
+			break;
+		getln(no,buf);
+		if (strstr(buf,s))
+			return no;
 		if (fwd)
-			lptr=lptr->next;
+			++no;
 		else
-			lptr=lptr->prev;
+			--no;
 	}
-	return NULL;
+	return 0;
+}
+
+// index lines up to no, if input is at hand to do it
+void
+need (int no) {
+	while (map&&nl<no&&!eof)
+		more();
 }
 
 int
@@ -193,19 +279,17 @@ main (void) {
 	int termfd; // terminal file descriptor
 	struct termios t,t2; // terminal structures
 	struct pollfd pollfds[2]; // poll descriptors
+	struct stat st; // stdin's
 	char c; // current character
-	int n; // number of characters read
+	int cc; // current character number
 	char buf[BUFSZ]; // line buffer
-	struct line *vfl=NULL; // very first line
-	struct line *rl=NULL; // last read line
-	struct line *dl=NULL; // last displayed line
-	int cl,cc; // current line and character numbers
-	int ltr; // lines to read
-	int eof=0; // end-of-file reached flag
+	int dl=0; // last displayed line
+	int want; // line to display last once read, or 0
+	int from; // last displayed line when it was wanted
 	int hstep; // horizontal scroll step
 	char sstr[BUFSZ]=""; // search string
 	int sfwd; // search forward flag
-	struct line *fl=NULL; // last found line
+	int fl; // last found line
 	// find w and h
 	ioctl(1,TIOCGWINSZ,&winsz);
 	// -1 because some terminals add new line after last character
@@ -224,6 +308,17 @@ main (void) {
 	if (termfd==-1)
 		// stdout is not a terminal
 		return 2;
+	// a plain file is mapped, so even a big one opens at once
+	if (fstat(0,&st)==0&&S_ISREG(st.st_mode)&&st.st_size>0) {
+		map=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,0,0);
+		if (map==MAP_FAILED)
+			map=NULL;
+		else
+			mapsz=st.st_size;
+	}
+	// the first line starts at 0
+	lofs=malloc((maxl=4096)*sizeof(long));
+	lofs[0]=0;
 	// put it to non-canonical mode
 	tcgetattr(termfd,&t);
 	t2=t;
@@ -232,15 +327,34 @@ main (void) {
 	t2.c_cc[VTIME]=0;
 	tcsetattr(termfd,TCSANOW,&t2);
 	// prepare pollfd structures
-	pollfds[0].fd=0; // stdin
+	pollfds[0].fd=map?-1:0; // stdin, unless it's mapped
 	pollfds[0].events=POLLIN|POLLHUP;
 	pollfds[1].fd=termfd; // tty
 	pollfds[1].events=POLLIN;
 	// our first goal is to read a screenful of lines
-	ltr=h;
-	cl=cc=0;
+	want=h;
+	from=0;
 	// main loop
 	while (1) {
+		need(want);
+		if (want&&nl>=want) {
+			// goal reached: print new lines
+			dl=want;
+			prt(dl,dl-from,w,h,l,sstr);
+			want=0;
+		} else if (want&&eof) {
+			if (nl==0)
+				// stdin was an empty file
+				// nothing to show
+				break;
+			// print what there is
+			dl=nl;
+			prt(dl,h,w,h,l,sstr);
+			want=0;
+		}
+		if (eof)
+			// mask stdin events
+			pollfds[0].fd=-1;
 		// wait for events
 		poll(pollfds,2,-1);
 		// process events
@@ -249,67 +363,69 @@ main (void) {
 			read(termfd,&c,1);
 			if (c=='q')
 				break;
+			need(dl+h+1);
 			if (c==' ') {
 				if (dl) {
-					if (dl->next==NULL) {
+					if (dl==nl) {
 						if (!eof) {
 							// read next screenful
-							ltr=h;
-							cl=cc=0;
+							want=dl+h;
+							from=dl;
 						}
 					} else {
 						// page down
 						dl=add(dl,h);
-						prt(dl,h,eof,w,h,l,sstr);
+						prt(dl,h,w,h,l,sstr);
 					}
 				}
 			}
 			if (c=='b') {
 				if (dl) {
 					// page up
-					if (dl->no>2*h)
+					if (dl>2*h)
 						dl=sub(dl,h);
-					else if (dl->no>h)
-						dl=sub(dl,dl->no-h);
+					else if (dl>h)
+						dl=sub(dl,dl-h);
 					else
 						continue;
-					prt(dl,h,eof,w,h,l,sstr);
+					prt(dl,h,w,h,l,sstr);
 				}
 			}
 			if (c=='j'||c=='\n') {
 				if (dl) {
-					if (dl->next==NULL) {
+					if (dl==nl) {
 						if (!eof) {
 							// read next line
-							ltr=1;
-							cl=cc=0;
+							want=dl+1;
+							from=dl;
 						}
 					} else {
 						// scroll down
-						dl=dl->next;
-						prt(dl,1,eof,w,h,l,sstr);
+						++dl;
+						prt(dl,1,w,h,l,sstr);
 					}
 				}
 			}
 			if (c=='k') {
-				if (dl&&dl->no>h) {
+				if (dl>h) {
 					// scroll up
-					dl=dl->prev;
-					prt(dl,h,eof,w,h,l,sstr);
+					--dl;
+					prt(dl,h,w,h,l,sstr);
 				}
 			}
 			if (c=='G') {
-				if (rl) {
+				need(INT_MAX);
+				if (nl) {
 					// go to the last line
-					dl=rl;
-					prt(dl,h,eof,w,h,l,sstr);
+					dl=nl;
+					prt(dl,h,w,h,l,sstr);
 				}
 			}
 			if (c=='g') {
-				if (vfl) {
+				if (nl) {
 					// go to the first line
-					dl=add(vfl,h-1);
-					prt(dl,h,eof,w,h,l,sstr);
+					dl=add(1,h-1);
+					prt(dl,h,w,h,l,sstr);
 				}
 			}
 			if (c=='h') {
@@ -317,7 +433,7 @@ main (void) {
 					// scroll left
 					l-=hstep;
 					if (l<0) l=0;
-					prt(dl,h,eof,w,h,l,sstr);
+					prt(dl,h,w,h,l,sstr);
 				}
 			}
 			if (c=='l') {
@@ -325,12 +441,12 @@ main (void) {
 					// scroll right
 					l+=hstep;
 					if (l>BUFSZ-2) l=BUFSZ-2;
-					prt(dl,h,eof,w,h,l,sstr);
+					prt(dl,h,w,h,l,sstr);
 				}
 			}
 			if (c=='/') {
 				// search
-				if (rl==NULL)
+				if (nl==0)
 					// nowhere to search
 					continue;
 				// erase status line
@@ -368,8 +484,8 @@ main (void) {
 					// found
 					// redraw (to clear old highlights)
 					// and show match on bottom
-					if (fl->no>dl->no) dl=fl;
-					prt(dl,h,eof,w,h,l,sstr);
+					if (fl>dl) dl=fl;
+					prt(dl,h,w,h,l,sstr);
 				} else {
 					// not found
 					prtsl("No matches below");
@@ -389,22 +505,23 @@ main (void) {
 				// search for the next match
 				if (sfwd)
 					// below display
-					fl=search(add(dl,1),sstr,sfwd);
+					fl=search(dl+1,sstr,sfwd);
 				else
 					// above display
-					fl=search(sub(dl,h),sstr,sfwd);
+					fl=search(dl-h,sstr,sfwd);
 				if (fl) {
 					// found
 					if (sfwd) {
 						// show match on bottom
-						int d=fl->no-dl->no;
+						int d=fl-dl;
 						if (d>h) d=h;
 						dl=fl;
-						prt(dl,d,eof,w,h,l,sstr);
+						prt(dl,d,w,h,l,sstr);
 					} else {
 						// show match on top
+						need(fl+h-1);
 						dl=add(fl,h-1);
-						prt(dl,h,eof,w,h,l,sstr);
+						prt(dl,h,w,h,l,sstr);
 					}
 				} else {
 					// not found
@@ -414,81 +531,9 @@ main (void) {
 						prtsl("No matches above");
 				}
 			}
-		} else if (pollfds[0].revents&POLLIN) {
-			// read from stdin
-			n=read(0,&c,1);
-			if (n==0) {
-				// stdin reached EOF
-				if (rl==NULL&&cc==0)
-					// stdin was an empty file
-					// nothing to show
-					break;
-				if (cc) {
-					// last line was without \n
-					rl=append(rl,buf,cc);
-					if (vfl==NULL) vfl=rl;
-					++cl;
-				}
-				// mask stdin events
-				pollfds[0].fd=-1;
-				// set flag
-				eof=1;
-				// enough lines?
-				if (cl<=ltr) {
-					// set pointer
-					dl=rl;
-					// print new lines
-					prt(dl,h,eof,w,h,l,sstr);
-				}
-				// skip to the next event
-				continue;
-			}
-			if (cc==BUFSZ-1) {
-				// ignore rest of line
-				if (c!='\n')
-					continue;
-			}
-			if (c!='\n') {
-				// save character
-				buf[cc++]=c;
-			} else {
-				// got full line
-				rl=append(rl,buf,cc);
-				if (vfl==NULL) vfl=rl;
-				++cl;
-				// goal reached?
-				if (cl==ltr) {
-					// set pointer
-					dl=rl;
-					// print new lines
-					prt(dl,cl,eof,w,h,l,sstr);
-				}
-				// clear character count for the next line
-				cc=0;
-			}
-		} else if (pollfds[0].revents&POLLHUP) {
-			// stdin reached EOF
-			if (rl==NULL&&cc==0)
-				// stdin was an empty file
-				// nothing to show
-				break;
-			if (cc) {
-				// last line was without \n
-				rl=append(rl,buf,cc);
-				if (vfl==NULL) vfl=rl;
-				++cl;
-			}
-			// mask stdin events
-			pollfds[0].fd=-1;
-			// set flag
-			eof=1;
-			// enough lines?
-			if (cl<=ltr) {
-				// set pointer
-				dl=rl;
-				// print new lines
-				prt(dl,h,eof,w,h,l,sstr);
-			}
+		} else if (pollfds[0].revents&(POLLIN|POLLHUP)) {
+			// read a block from stdin
+			more();
 		}
 	}
 	// restore terminal
@@ -13,7 +13,7 @@
 #include <assert.h>
 #include <stdarg.h>
 
-typedef enum { T_CONS, T_ATOM, T_CFUNC, T_LAMBDA } object_tag;
+typedef enum { T_CONS, T_ATOM, T_CFUNC, T_LAMBDA } object_tag; // a lambda's car is its code
 
 struct object_t;
 typedef struct object_t *(*cfunc)(struct object_t *);
@@ -24,19 +24,74 @@ typedef struct object_t {
 } object;
 
 #define TOKEN_MAX 256
-#define HASHMAP_SIZE 2048
+#define HASHMAP_SIZE 2048      // intern table buckets to start with
+#define ARENA 16384            // bytes of interned strings malloc'd at a time
 #define ATOMCHAR(ch) (((ch) >= '!' && (ch) <= '\'') || ((ch) >= '*' && (ch) <= '~'))
 #define TEXT(x) (((x) && (x)->tag == T_ATOM) ? ((const char *)((x)->car)) : "")
-#define HEAPSIZE 16384
+#define NURSERY 16384          // objects allocated between minor collections
+#define CHUNK 16384            // objects in each chunk of the old generation
+#define MINOLD (4 * CHUNK)     // old objects before the first major collection
 #define MAXROOTS 500
 #define MAXFRAMES 50
+#define MAXSLOTS 256           // parameters and defines in a lambda
+#define STACKMAX 16384         // values on the VM's stack
+#define MAXCALLS 4096          // lambda calls under way, but tail calls
 
 const char *TQUOTE = NULL, *TLAMBDA = NULL, *TCOND = NULL, *TDEFINE = NULL;
 char token_text[TOKEN_MAX];
 int token_peek = 0;
 object     *atom_t = NULL;
-object *heap, *tospace, *fromspace, *allocptr, *scanptr;
+
+// The heap is a nursery, where objects are made, and an old
+// generation of chunks, added as needed, that they move to if they
+// survive a minor collection. A minor collection copies only what
+// is reachable in the nursery, from the roots and from the old
+// objects the write barrier remembers pointing into it; a major
+// one, once the old generation has doubled, copies all of that to
+// fresh chunks and frees the old ones.
+typedef struct chunk {
+	struct chunk *next;
+	object *top, *end;
+	object obj[];
+} chunk;
+
+object *nursery, *allocptr;
+chunk *oldfirst, *oldlast;     // oldest first
+size_t oldlive, oldlimit = MINOLD;
+object **remset;               // old objects that may point into the nursery
+size_t nrem, maxrem;
+int major;
+#define IN_NURSERY(p) ((p) >= nursery && (p) < nursery + NURSERY)
 object ** roots[MAXROOTS];
+
+typedef struct code {
+	struct code *next;     // all code there is, whose constants are roots
+	unsigned char *ops;
+	object **consts;
+	struct code **subs;    // the lambdas it makes
+	size_t nops, maxops, nconsts, maxconsts, nsubs, maxsubs;
+	int nparams, nslots, heap, depth, maxdepth;
+} code;
+
+typedef struct scope {
+	struct scope *up;
+	const char *names[MAXSLOTS];
+	int nslots, heap;
+} scope;
+
+typedef struct vmframe {
+	unsigned char *pc;
+	code *c;
+	object **fp;
+	object *env;
+} vmframe;
+
+code *codes;
+int gc_compiling;
+object *vmstack[STACKMAX], **vmsp = vmstack, *vmenv;
+vmframe vmframes[MAXCALLS];
+size_t vmnframes;
+
 size_t rootstack[MAXFRAMES];
 size_t roottop, numroots;
 object fwdmarker = { .tag = T_ATOM, .car = 0, .cdr = 0 };
@@ -45,6 +100,7 @@ void    gc_init(void);
 object *gc_alloc(object_tag tag, object *car, object *cdr);
 void    gc_protect(object **r, ...);
 void    gc_pop(void);
+void    gc_barrier(object *obj, object *val);
 object *lisp_read_list(const char *tok, FILE *in);
 object *lisp_read_obj(const char *tok, FILE *in);
 object *lisp_read(FILE *in);
@@ -58,18 +114,64 @@ size_t djbhash(const unsigned char *str) {
 	return hash;
 }
 
+// Interned strings are never freed, so they're carved out of
+// arenas; the table doubles once it is three quarters full, each
+// node keeping its hash for the move.
+typedef struct node { struct node *next; size_t hash; char data[]; } node_t;
+node_t **nodes;
+size_t nnodes, nbuckets;
+char *arena, *arenaend;
+
+void *arena_alloc(size_t sz) {
+	sz = (sz + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if (sz > ARENA)
+		return malloc(sz);
+	if (arena == NULL || arenaend - arena < sz) {
+		if ((arena = malloc(ARENA)) == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			abort();
+		}
+		arenaend = arena + ARENA;
+	}
+	arena += sz;
+	return arena - sz;
+}
+
+void intern_grow(void) {
+	size_t n = nbuckets ? 2 * nbuckets : HASHMAP_SIZE;
+	node_t **t = malloc(n * sizeof(node_t *));
+	if (t == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		abort();
+	}
+	memset(t, 0, n * sizeof(node_t *));
+	for (size_t i = 0; i < nbuckets; i++)
+		for (node_t *is = nodes[i], *next; is != NULL; is = next) {
+			next = is->next;
+			is->next = t[is->hash % n];
+			t[is->hash % n] = is;
+		}
+	free(nodes);
+	nodes = t;
+	nbuckets = n;
+}
+
 const char *intern_string(const char *str) {
-	typedef struct node { struct node *next; char data[]; } node_t;
-	static node_t* nodes[HASHMAP_SIZE] = {0};
-	size_t hash = djbhash((const unsigned char *)str) % HASHMAP_SIZE;
-	for (node_t* is = nodes[hash]; is != NULL; is = is->next)
-		if (strcmp(is->data, str) == 0)
+	size_t hash = djbhash((const unsigned char *)str);
+	if (nbuckets == 0)
+		intern_grow();
+	for (node_t* is = nodes[hash % nbuckets]; is != NULL; is = is->next)
+		if (is->hash == hash && strcmp(is->data, str) == 0)
 			return is->data;
+	if (4 * (nnodes + 1) > 3 * nbuckets)
+		intern_grow();
 	size_t sz = strlen(str) + 1;
-	node_t *item = malloc(sizeof(node_t) + sz);
+	node_t *item = arena_alloc(sizeof(node_t) + sz);
 	memcpy(item->data, str, sz);
-	item->next = nodes[hash];
-	nodes[hash] = item;
+	item->hash = hash;
+	item->next = nodes[hash % nbuckets];
+	nodes[hash % nbuckets] = item;
+	nnodes++;
 	return item->data;
 }
 
@@ -179,18 +281,12 @@ object *list_find_pair(object *needle, object *haystack) {
 	return NULL;
 }
 
-object *env_lookup(object *needle, object *haystack) {
-	for (object *pair; haystack != NULL; haystack = haystack->cdr)
-		if ((pair = list_find_pair(needle, haystack->car)) != NULL)
-			return pair->cdr;
-	return NULL;
-}
-
 object *env_set(object *env, object *key, object *value) {
 	object *pair = NULL, *frame = NULL;
 	gc_protect(&env, &key, &value, &pair, &frame, NULL);
 	pair = new_cons(key, value);
 	frame = new_cons(pair, env->car);
+	gc_barrier(env, frame);
 	env->car = frame;
 	gc_pop();
 	return env;
@@ -200,90 +296,395 @@ object *new_env(object *env) {
 	return new_cons(NULL, env);
 }
 
-object *list_reverse(object *lst) {
-	if (lst == NULL)
-		return NULL;
-	object *prev = NULL, *curr = lst, *next = lst->cdr;
-	while (curr) {
-		curr->cdr = prev;
-		prev = curr;
-		curr = next;
-		if (next != NULL)
-			next = next->cdr;
+void *grow(void *p, size_t *max, size_t size) {
+	size_t n = *max ? 2 * *max : 16;
+	char *q = malloc(n * size);
+	if (q == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		abort();
 	}
-	return prev;
+	if (p != NULL) {
+		memcpy(q, p, *max * size);
+		free(p);
+	}
+	*max = n;
+	return q;
 }
 
-object *lisp_eval(object *expr, object *env) {
-restart:
-	if (expr == NULL)
-		return expr;
-	if (expr->tag == T_ATOM)
-		return match_number(TEXT(expr)) ? expr : env_lookup(expr, env);
-	if (expr->tag != T_CONS)
-		return expr;
-	object *head = expr->car;
-	if (TEXT(head) == TQUOTE) {
-		return expr->cdr->car;
-	} else if (TEXT(head) == TCOND) {
-		object *item = NULL, *cond = NULL;
-		gc_protect(&expr, &env, &item, &cond, NULL);
-		for (item = expr->cdr; item != NULL; item = item->cdr) {
-			cond = item->car;
-			if (lisp_eval(cond->car, env) != NULL) {
-				expr = cond->cdr->car;
-				gc_pop();
-				goto restart;
-			}
+// An expression is compiled to code for a small stack machine: each
+// operation a byte, the operands after it 16 bits each. Variables
+// are resolved as it is compiled: a global to the (name . value)
+// pair of its binding, a lambda's parameters and the names it
+// defines to slots in its frame. The frame is on the stack unless
+// the body makes a lambda, which might keep it; then it is a list
+// on the heap, in a chain of them that ends at the closure's.
+enum {
+	OP_CONST, OP_NIL, OP_LOCAL, OP_SETLOCAL, OP_HEAP, OP_SETHEAP,
+	OP_GLOBAL, OP_SETGLOBAL, OP_POP, OP_JUMP, OP_JUMPF, OP_CLOSURE,
+	OP_CALL, OP_TAILCALL, OP_RET
+};
+
+code *compile_new(void) {
+	code *c = malloc(sizeof(code));
+	memset(c, 0, sizeof(code));
+	c->next = codes;
+	codes = c;
+	return c;
+}
+
+void compile_free(code *c) {
+	code **p;
+	for (p = &codes; *p != c; p = &(*p)->next)
+		;
+	*p = c->next;
+	free(c->ops);
+	free(c->consts);
+	free(c->subs);
+	free(c);
+}
+
+void emit(code *c, int op, int nargs, int a, int b) {
+	if (c->nops + 5 > c->maxops)
+		c->ops = grow(c->ops, &c->maxops, 1);
+	c->ops[c->nops++] = op;
+	for (int i = 0; i < nargs; i++, a = b) {
+		c->ops[c->nops++] = a;
+		c->ops[c->nops++] = a >> 8;
+	}
+}
+
+// Stack depth after an operation that pushes n, or pops -n.
+void emit_depth(code *c, int n) {
+	if ((c->depth += n) > c->maxdepth)
+		c->maxdepth = c->depth;
+}
+
+// Where a jump is to go, now that it's known.
+void emit_patch(code *c, size_t at) {
+	if (c->nops > 0xFFFF) {
+		fprintf(stderr, "Error: Expression too long\n");
+		abort();
+	}
+	c->ops[at + 1] = c->nops;
+	c->ops[at + 2] = c->nops >> 8;
+}
+
+int emit_const(code *c, object *obj) {
+	if (c->nconsts == c->maxconsts)
+		c->consts = grow(c->consts, &c->maxconsts, sizeof(object *));
+	c->consts[c->nconsts] = obj;
+	return c->nconsts++;
+}
+
+object *global_pair(object *env, object *name) {
+	object *pair = list_find_pair(name, env->car);
+	if (pair == NULL)
+		pair = env_set(env, name, NULL)->car->car;
+	return pair;
+}
+
+int scope_slot(scope *s, const char *name) {
+	for (int i = 0; i < s->nslots; i++)
+		if (s->names[i] == name)
+			return i;
+	return -1;
+}
+
+// Find name in the scopes from s out: its slot, and how many heap
+// frames are passed on the way to it, or -1 for the stack frame,
+// -2 for none.
+int scope_find(scope *s, const char *name, int *slot) {
+	for (int depth = 0, first = 1; s != NULL; s = s->up, first = 0) {
+		if ((*slot = scope_slot(s, name)) >= 0)
+			return (first && !s->heap) ? -1 : depth;
+		depth += s->heap;
+	}
+	return -2;
+}
+
+int scope_add(scope *s, object *name) {
+	if (name == NULL || name->tag != T_ATOM || scope_slot(s, TEXT(name)) >= 0)
+		return 0;
+	if (s->nslots == MAXSLOTS) {
+		fprintf(stderr, "Error: Too many variables in lambda\n");
+		abort();
+	}
+	s->names[s->nslots++] = TEXT(name);
+	return 1;
+}
+
+// Whether evaluating expr might make a lambda.
+int has_lambda(object *expr) {
+	if (expr == NULL || expr->tag != T_CONS || TEXT(expr->car) == TQUOTE)
+		return 0;
+	if (TEXT(expr->car) == TLAMBDA)
+		return 1;
+	for (; expr != NULL && expr->tag == T_CONS; expr = expr->cdr)
+		if (has_lambda(expr->car))
+			return 1;
+	return 0;
+}
+
+void compile(code *c, scope *s, object *env, object *expr, int tail);
+
+void compile_body(code *c, scope *s, object *env, object *body, int tail) {
+	if (body == NULL) {
+		emit(c, OP_NIL, 0, 0, 0);
+		emit_depth(c, 1);
+	}
+	for (; body != NULL; body = body->cdr) {
+		compile(c, s, env, body->car, tail && body->cdr == NULL);
+		if (body->cdr != NULL) {
+			emit(c, OP_POP, 0, 0, 0);
+			emit_depth(c, -1);
 		}
-		return NULL; // was abort(), but no match should return nil
-	} else if (TEXT(head) == TDEFINE) {
-		object *name = NULL, *value = NULL;
-		gc_protect(&env, &name, &value, NULL);
-		name = expr->cdr->car;
-		value = lisp_eval(expr->cdr->cdr->car, env);
-		env_set(env, name, value);
-		gc_pop();
-		return value;
-	} else if (TEXT(head) == TLAMBDA) {
-		expr->cdr->tag = T_LAMBDA;
-		return expr->cdr;
 	}
+}
+
+code *compile_lambda(scope *up, object *env, object *expr) {
+	code *c = compile_new();
+	scope s = { .up = up };
+	object *params = expr->cdr ? expr->cdr->car : NULL, *body = expr->cdr ? expr->cdr->cdr : NULL;
+
+	emit_const(c, params); // for lisp_print
+	for (object *p = params; p != NULL && p->tag == T_CONS; p = p->cdr)
+		if (!scope_add(&s, p->car))
+			fprintf(stderr, "Error: Bad parameter\n");
+	c->nparams = s.nslots;
+	for (object *b = body; b != NULL; b = b->cdr)
+		if (b->car != NULL && b->car->tag == T_CONS && TEXT(b->car->car) == TDEFINE && b->car->cdr)
+			scope_add(&s, b->car->cdr->car);
+	c->nslots = s.nslots;
+	c->heap = s.heap = has_lambda(body);
+	compile_body(c, &s, env, body, 1);
+	emit(c, OP_RET, 0, 0, 0);
+	return c;
+}
 
-	object *fn = NULL, *args = NULL, *params = NULL, *param = NULL;
-	gc_protect(&expr, &env, &fn, &args, &params, &param, NULL);
-	fn = lisp_eval(head, env);
-	if (fn->tag == T_CFUNC) {
-		for (params = expr->cdr; params != NULL; params = params->cdr) {
-			param = lisp_eval(params->car, env);
-			args = new_cons(param, args);
+void compile(code *c, scope *s, object *env, object *expr, int tail) {
+	int slot, depth;
+
+	if (expr == NULL) {
+		emit(c, OP_NIL, 0, 0, 0);
+	} else if (expr->tag == T_ATOM) {
+		if (match_number(TEXT(expr)))
+			emit(c, OP_CONST, 1, emit_const(c, expr), 0);
+		else if ((depth = scope_find(s, TEXT(expr), &slot)) == -1)
+			emit(c, OP_LOCAL, 1, slot, 0);
+		else if (depth >= 0)
+			emit(c, OP_HEAP, 2, depth, slot);
+		else
+			emit(c, OP_GLOBAL, 1, emit_const(c, global_pair(env, expr)), 0);
+	} else if (expr->tag != T_CONS) {
+		emit(c, OP_CONST, 1, emit_const(c, expr), 0);
+	} else if (TEXT(expr->car) == TQUOTE) {
+		emit(c, OP_CONST, 1, emit_const(c, expr->cdr ? expr->cdr->car : NULL), 0);
+	} else if (TEXT(expr->car) == TCOND) {
+		size_t next, end = 0; // jumps to the end, chained through their operands
+		for (object *item = expr->cdr; item != NULL; item = item->cdr) {
+			object *clause = item->car;
+			compile(c, s, env, clause ? clause->car : NULL, 0);
+			next = c->nops;
+			emit(c, OP_JUMPF, 1, 0, 0);
+			emit_depth(c, -1);
+			compile_body(c, s, env, clause ? clause->cdr : NULL, tail);
+			emit_depth(c, -1);
+			emit(c, OP_JUMP, 1, end, 0);
+			end = c->nops - 3 + 1;
+			emit_patch(c, next);
 		}
-		object *ret = ((cfunc)fn->car)(list_reverse(args));
-		gc_pop();
-		return ret;
-	} else if (fn->tag == T_LAMBDA) {
-		object *callenv = new_env(env);
-		args = fn->car;
-		object *item = NULL;
-		gc_protect(&callenv, &item, NULL);
-		for (params = expr->cdr; params != NULL; params = params->cdr, args = args->cdr) {
-			param = lisp_eval(params->car, env);
-			env_set(callenv, args->car, param);
+		emit(c, OP_NIL, 0, 0, 0); // was abort(), but no match should return nil
+		while (end != 0) {
+			size_t at = end - 1;
+			end = c->ops[at + 1] | c->ops[at + 2] << 8;
+			emit_patch(c, at);
 		}
-		for (item = fn->cdr; item != NULL; item = item->cdr) {
-			if (item->cdr == NULL) {
-				expr = item->car;
-				env = callenv;
-				gc_pop();
-				gc_pop();
-				goto restart;
-			}
-			lisp_eval(item->car, callenv);
+	} else if (TEXT(expr->car) == TDEFINE) {
+		object *name = expr->cdr ? expr->cdr->car : NULL;
+		compile(c, s, env, expr->cdr && expr->cdr->cdr ? expr->cdr->cdr->car : NULL, 0);
+		if (name == NULL || name->tag != T_ATOM)
+			fprintf(stderr, "Error: Bad define\n");
+		else if (s == NULL || (slot = scope_slot(s, TEXT(name))) < 0)
+			emit(c, OP_SETGLOBAL, 1, emit_const(c, global_pair(env, name)), 0);
+		else if (s->heap)
+			emit(c, OP_SETHEAP, 2, 0, slot);
+		else
+			emit(c, OP_SETLOCAL, 1, slot, 0);
+		return;
+	} else if (TEXT(expr->car) == TLAMBDA) {
+		if (c->nsubs == c->maxsubs)
+			c->subs = grow(c->subs, &c->maxsubs, sizeof(code *));
+		c->subs[c->nsubs] = compile_lambda(s, env, expr);
+		emit(c, OP_CLOSURE, 1, c->nsubs++, 0);
+	} else {
+		int n = 0;
+		for (object *item = expr; item != NULL && item->tag == T_CONS; item = item->cdr, n++)
+			compile(c, s, env, item->car, 0);
+		emit(c, tail ? OP_TAILCALL : OP_CALL, 1, n - 1, 0);
+		emit_depth(c, -n);
+	}
+	emit_depth(c, 1);
+}
+
+void vm_overflow(void) {
+	fprintf(stderr, "Error: Stack overflow\n");
+	abort();
+}
+
+// Run c, which is at the top level, for its value. Calls to lambdas
+// go on in the same loop, with their frames in vmframes; each
+// operation's code jumps straight to the next's.
+object *vm_run(code *c) {
+	static void *ops[] = {
+		&&op_const, &&op_nil, &&op_local, &&op_setlocal, &&op_heap, &&op_setheap,
+		&&op_global, &&op_setglobal, &&op_pop, &&op_jump, &&op_jumpf, &&op_closure,
+		&&op_call, &&op_tailcall, &&op_ret
+	};
+	size_t base = vmnframes;
+	object **fp = vmsp, **sp = vmsp, *fn, **f, *l;
+	unsigned char *pc = c->ops;
+	int n, tail, i;
+
+#define ARG (pc += 2, pc[-2] | pc[-1] << 8)
+#define NEXT goto *ops[*pc++]
+#define SAVE (vmsp = sp) // before anything that may collect
+	if (sp + c->maxdepth > vmstack + STACKMAX)
+		vm_overflow();
+	NEXT;
+
+op_const:
+	*sp++ = c->consts[ARG];
+	NEXT;
+op_nil:
+	*sp++ = NULL;
+	NEXT;
+op_local:
+	*sp++ = fp[ARG];
+	NEXT;
+op_setlocal:
+	fp[ARG] = sp[-1];
+	NEXT;
+op_heap:
+op_setheap:
+	l = vmenv;
+	for (n = ARG; n > 0; n--)
+		l = l->cdr;
+	for (l = l->car, n = ARG; n > 0; n--)
+		l = l->cdr;
+	if (pc[-5] == OP_HEAP) {
+		*sp++ = l->car;
+	} else {
+		gc_barrier(l, sp[-1]);
+		l->car = sp[-1];
+	}
+	NEXT;
+op_global:
+	*sp++ = c->consts[ARG]->cdr;
+	NEXT;
+op_setglobal:
+	l = c->consts[ARG];
+	gc_barrier(l, sp[-1]);
+	l->cdr = sp[-1];
+	NEXT;
+op_pop:
+	sp--;
+	NEXT;
+op_jump:
+	pc = c->ops + ARG;
+	NEXT;
+op_jumpf:
+	n = ARG;
+	if (*--sp == NULL)
+		pc = c->ops + n;
+	NEXT;
+op_closure:
+	SAVE;
+	fn = gc_alloc(T_LAMBDA, (object *)c->subs[ARG], vmenv);
+	*sp++ = fn;
+	NEXT;
+op_call:
+op_tailcall:
+	tail = pc[-1] == OP_TAILCALL;
+	n = ARG;
+	fn = sp[-n - 1];
+	if (fn == NULL || fn->tag != T_LAMBDA) {
+		l = NULL;
+		if (fn != NULL && fn->tag == T_CFUNC) {
+			SAVE;
+			gc_protect(&l, NULL);
+			for (f = sp; f > sp - n; )
+				l = new_cons(*--f, l);
+			l = ((cfunc)sp[-n - 1]->car)(l);
+			gc_pop();
 		}
+		sp -= n + 1;
+		*sp++ = l;
+		if (tail)
+			goto op_ret;
+		NEXT;
+	}
+	if (tail) {
+		memmove(fp - 1, sp - n - 1, (n + 1) * sizeof(object *));
+		sp = fp + n;
+	} else {
+		if (vmnframes == MAXCALLS)
+			vm_overflow();
+		vmframes[vmnframes++] = (vmframe){ pc, c, fp, vmenv };
+		fp = sp - n;
+	}
+	c = (code *)fn->car;
+	if (fp + c->nslots + c->maxdepth > vmstack + STACKMAX)
+		vm_overflow();
+	for (sp = fp + n, i = n < c->nparams ? n : c->nparams; i < c->nslots; i++)
+		fp[i] = NULL;
+	if (c->heap) {
+		SAVE;
+		l = NULL;
+		gc_protect(&l, NULL);
+		for (i = c->nslots; i > 0; i--)
+			l = new_cons(fp[i - 1], l);
+		vmenv = new_cons(l, fp[-1]->cdr);
 		gc_pop();
-		gc_pop();
+		sp = fp;
+	} else {
+		vmenv = fn->cdr;
+		sp = fp + c->nslots;
 	}
-	return NULL;
+	pc = c->ops;
+	NEXT;
+op_ret:
+	l = sp[-1];
+	if (vmnframes == base) {
+		vmsp = fp;
+		return l;
+	}
+	sp = fp - 1;
+	*sp++ = l;
+	--vmnframes;
+	pc = vmframes[vmnframes].pc;
+	c = vmframes[vmnframes].c;
+	fp = vmframes[vmnframes].fp;
+	vmenv = vmframes[vmnframes].env;
+	NEXT;
+#undef ARG
+#undef NEXT
+#undef SAVE
+}
+
+object *lisp_eval(object *expr, object *env) {
+	code *c = compile_new();
+	object *ret;
+
+	gc_protect(&expr, &env, NULL);
+	gc_compiling = 1; // compile's pointers must stay put
+	compile(c, NULL, env, expr, 0);
+	emit(c, OP_RET, 0, 0, 0);
+	gc_compiling = 0;
+	vmenv = NULL;
+	ret = vm_run(c);
+	compile_free(c);
+	gc_pop();
+	return ret;
 }
 
 void lisp_print(object *obj) {
@@ -295,7 +696,7 @@ void lisp_print(object *obj) {
 		printf("<C@%p>", (void *)obj);
 	} else if (obj->tag == T_LAMBDA) {
 		printf("<lambda ");
-		lisp_print(obj->car);
+		lisp_print(((code *)obj->car)->consts[0]);
 		printf(">");
 	} else if (obj->tag == T_CONS) {
 		printf("(");
@@ -397,13 +798,33 @@ void defun(object *env, const char *name, cfunc fn) {
 	gc_pop();
 }
 
+object *old_alloc(void) {
+	if (oldlast == NULL || oldlast->top == oldlast->end) {
+		chunk *c = malloc(sizeof(chunk) + CHUNK * sizeof(object));
+		if (c == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			abort();
+		}
+		c->next = NULL;
+		c->top = c->obj;
+		c->end = c->obj + CHUNK;
+		if (oldlast != NULL)
+			oldlast->next = c;
+		else
+			oldfirst = c;
+		oldlast = c;
+	}
+	oldlive++;
+	return oldlast->top++;
+}
+
+// Move *root, which is in the space being collected, to the old
+// generation, unless it has been already.
 void gc_copy(object **root) {
-	if (*root == NULL)
-		return;
 	if ((*root)->car == &fwdmarker) {
 		*root = (*root)->cdr;
-	} else if (*root < fromspace || *root >= (fromspace + HEAPSIZE)) {
-		object *p = allocptr++;
+	} else {
+		object *p = old_alloc();
 		memcpy(p, *root, sizeof(object));
 		(*root)->car = &fwdmarker;
 		(*root)->cdr = p;
@@ -411,40 +832,140 @@ void gc_copy(object **root) {
 	}
 }
 
+// A field of an object: minor collections leave old objects be.
+void gc_field(object **f) {
+	if (*f != NULL && (major || IN_NURSERY(*f)))
+		gc_copy(f);
+}
+
+void gc_fields(object *obj) {
+	if (obj->tag == T_CONS)
+		gc_field(&(obj->car));
+	if (obj->tag == T_CONS || obj->tag == T_LAMBDA)
+		gc_field(&(obj->cdr));
+}
+
+// What the VM and compiled code hold.
+void gc_vm(void) {
+	for (object **p = vmstack; p < vmsp; ++p)
+		gc_field(p);
+	for (size_t i = 0; i < vmnframes; ++i)
+		gc_field(&vmframes[i].env);
+	gc_field(&vmenv);
+	for (code *c = codes; c != NULL; c = c->next)
+		for (size_t i = 0; i < c->nconsts; ++i)
+			gc_field(&c->consts[i]);
+}
+
+// Fix up the fields of everything copied from s in c on.
+void gc_scan(chunk *c, object *s) {
+	while (c != NULL) {
+		for (; s < c->top; ++s)
+			gc_fields(s);
+		if ((c = c->next) != NULL)
+			s = c->obj;
+	}
+}
+
+// Everything is in the old generation, in chunks that will be
+// freed; copy what's live to new ones.
+void gc_major(void) {
+	chunk *from = oldfirst, *next;
+
+	oldfirst = oldlast = NULL;
+	oldlive = 0;
+	major = 1;
+	for (size_t i = 0; i < numroots; ++i) {
+		object *r = *roots[i];
+		chunk *c;
+		// The same variable may be a root twice over.
+		for (c = oldfirst; c != NULL && !(r >= c->obj && r < c->top); c = c->next)
+			;
+		if (r != NULL && c == NULL)
+			gc_copy(roots[i]);
+	}
+	gc_vm();
+	if (oldfirst != NULL)
+		gc_scan(oldfirst, oldfirst->obj);
+	major = 0;
+	for (; from != NULL; from = next) {
+		next = from->next;
+		free(from);
+	}
+	oldlimit = 2 * oldlive > MINOLD ? 2 * oldlive : MINOLD;
+}
+
 void gc_collect(void) {
-	object *tmp = fromspace;
-	fromspace = tospace;
-	tospace = tmp;
-	allocptr = scanptr = fromspace;
+	chunk *c = oldlast;
+	object *s = c ? c->top : NULL;
 
 	for (size_t i = 0; i < numroots; ++i)
-		gc_copy(roots[i]);
+		gc_field(roots[i]);
+	gc_vm();
+	for (size_t i = 0; i < nrem; ++i)
+		gc_fields(remset[i]);
+	nrem = 0;
+	if (c == NULL && oldfirst != NULL) {
+		c = oldfirst;
+		s = c->obj;
+	}
+	gc_scan(c, s);
+	allocptr = nursery;
+	if (oldlive > oldlimit)
+		gc_major();
+}
 
-	for (; scanptr < allocptr; ++scanptr)
-		if (scanptr->tag == T_CONS || scanptr->tag == T_LAMBDA) {
-			gc_copy(&(scanptr->car));
-			gc_copy(&(scanptr->cdr));
+// obj is getting a field set to val: an old object pointing into
+// the nursery has to be remembered, as the only way there may be
+// from it.
+void gc_barrier(object *obj, object *val) {
+	if (val == NULL || !IN_NURSERY(val) || IN_NURSERY(obj))
+		return;
+	if (nrem > 0 && remset[nrem - 1] == obj)
+		return;
+	if (nrem == maxrem) {
+		object **n = malloc(sizeof(object *) * (maxrem ? 2 * maxrem : 256));
+		if (n == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			abort();
 		}
+		if (remset != NULL) {
+			memcpy(n, remset, sizeof(object *) * nrem);
+			free(remset);
+		}
+		remset = n;
+		maxrem = maxrem ? 2 * maxrem : 256;
+	}
+	remset[nrem++] = obj;
 }
 
 void gc_init(void) {
-	allocptr = fromspace = heap = malloc(sizeof(object) * HEAPSIZE * 2);
-	scanptr = tospace = heap + HEAPSIZE;
+	allocptr = nursery = malloc(sizeof(object) * NURSERY);
 	numroots = roottop = 0;
 }
 
 object *gc_alloc(object_tag tag, object *car, object *cdr) {
-	if (allocptr + 1 > fromspace + HEAPSIZE) {
+	if (allocptr == nursery + NURSERY && gc_compiling) {
+		// Nothing moves: straight to the old generation.
+		object *p = old_alloc();
+		p->tag = tag;
+		p->car = car;
+		p->cdr = cdr;
+		if (tag == T_CONS)
+			gc_barrier(p, car);
+		if (tag == T_CONS || tag == T_LAMBDA)
+			gc_barrier(p, cdr);
+		return p;
+	}
+	if (allocptr == nursery + NURSERY) {
 		if (tag == T_CONS)
 			gc_protect(&car, &cdr, NULL);
+		else if (tag == T_LAMBDA)
+			gc_protect(&cdr, NULL);
 		gc_collect();
-		if (tag == T_CONS)
+		if (tag == T_CONS || tag == T_LAMBDA)
 			gc_pop();
 	}
-	if (allocptr + 1 > fromspace + HEAPSIZE) {
-		fprintf(stderr, "Out of memory\n");
-		abort();
-	}
 	allocptr->tag = tag;
 	allocptr->car = car;
 	allocptr->cdr = cdr;
@@ -0,0 +1,21 @@
+#include "types.h"
+#include "user.h"
+#include "spinlock.h"
+
+#define NSTAT 64
+
+// Print the kernel's spinlock statistics, one line per lock name.
+int main(int argc, char **argv) {
+	struct lockstat *st = malloc(NSTAT * sizeof(*st));
+	int i, n;
+
+	if (st == 0 || (n = lockstat(st, NSTAT)) < 0) {
+		fprintf(stderr, "lockstat: failed\n");
+		procexit();
+	}
+	fprintf(stdout, "NAME\t\tACQUIRES\tCONTENDED\tSPINS\tMAXHOLD(ns)\n");
+	for (i = 0; i < n; i++)
+		fprintf(stdout, "%s\t\t%d\t%d\t%d\t%d\n", st[i].name, (int)st[i].acquires,
+		        (int)st[i].contended, (int)st[i].spins, (int)st[i].maxhold);
+	procexit();
+}
@@ -1,13 +1,12 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
-#include "file.h"
-#include "fs/fs1.h"
+#include "dirent.h"
 #include "string.h"
 #include "fcntl.h"
 
 char* fmtname(char *path) {
-	static char buf[DIRSIZ+1];
+	static char buf[DENT_NAMELEN+1];
 	char *p;
 
 	// Find first character after last slash.
@@ -16,17 +15,17 @@ char* fmtname(char *path) {
 	p++;
 
 	// Return blank-padded name.
-	if(strlen(p) >= DIRSIZ)
+	if(strlen(p) >= DENT_NAMELEN)
 		return p;
 	memmove(buf, p, strlen(p));
-	memset(buf+strlen(p), ' ', DIRSIZ-strlen(p));
+	memset(buf+strlen(p), ' ', DENT_NAMELEN-strlen(p));
 	return buf;
 }
 
 void ls(char *path) {
 	char buf[512], *p;
-	int fd;
-	struct dirent de;
+	int fd, i, n;
+	struct dent de[32];
 	struct stat st;
 
 	if((fd = open(path, O_RDONLY)) < 0) {
@@ -46,24 +45,22 @@ void ls(char *path) {
 		break;
 
 	case T_DIR:
-		if(strlen(path) + 1 + DIRSIZ + 1 > sizeof buf) {
+		if(strlen(path) + 1 + DENT_NAMELEN + 1 > sizeof buf) {
 			fprintf(stdout, "ls: path too long\n");
 			break;
 		}
 		strcpy(buf, path);
 		p = buf+strlen(buf);
 		*p++ = '/';
-		while(read(fd, &de, sizeof(de)) == sizeof(de)) {
-			if(de.inum == 0)
-				continue;
-			memmove(p, de.name, DIRSIZ);
-			p[DIRSIZ] = 0;
-			if(stat(buf, &st) < 0) {
-				fprintf(stdout, "ls: cannot stat %s\n", buf);
-				continue;
+		// Entries come with their types and sizes, a batch at a time.
+		while((n = getdents(fd, de, sizeof(de) / sizeof(de[0]))) > 0) {
+			for(i = 0; i < n; i++) {
+				strcpy(p, de[i].name);
+				fprintf(stdout, "%s %d %d %d\n", fmtname(buf), de[i].type, de[i].ino, de[i].size);
 			}
-			fprintf(stdout, "%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
 		}
+		if(n < 0)
+			fprintf(stdout, "ls: cannot read %s\n", path);
 		break;
 	}
 	close(fd);
@@ -1,38 +1,70 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
-#include "param.h"
-#include "mmu.h"
-#include "proc.h"
-
-char *statename(enum procstate state) {
-	if (state == EMBRYO) {
-		return "EMBRYO";
-	} else if (state == SLEEPING) {
-		return "SLEEPING";
-	} else if (state == RUNNABLE) {
-		return "RUNNABLE";
-	} else if (state == RUNNING) {
-		return "RUNNING";
-	} else if (state == ZOMBIE) {
-		return "ZOMBIE";
+#include "dirent.h"
+#include "string.h"
+#include "fcntl.h"
+
+// List processes from /proc: a directory read for the pids and a
+// read of each one's status, rather than a syscall per field.
+// Times are in microseconds.
+
+// Copy the value of key in a status file's "key value" lines to
+// out, of 16 bytes, or "?" if it isn't there.
+char *field(char *status, char *key, char *out) {
+	int n = strlen(key), i;
+	char *p, *e;
+
+	strcpy(out, "?");
+	for (p = status; *p; p = e + 1) {
+		if ((e = strchr(p, '\n')) == 0)
+			break;
+		if (strncmp(p, key, n) == 0 && p[n] == ' ') {
+			for (i = 0, p += n + 1; p < e && i < 15; i++, p++)
+				out[i] = *p;
+			out[i] = 0;
+			break;
+		}
 	}
-	return "";
+	return out;
+}
+
+void show(char *pid) {
+	char path[DENT_NAMELEN + 16], buf[512];
+	char name[16], state[16], blessed[16], priority[16], size[16], utime[16], stime[16];
+	char syscalls[16];
+	int fd, n;
+
+	strcpy(path, "/proc/");
+	strcpy(path + strlen(path), pid);
+	strcpy(path + strlen(path), "/status");
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return; // gone meanwhile
+	buf[n] = 0;
+
+	fprintf(stdout, "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n", pid, field(buf, "name", name),
+	        *field(buf, "blessed", blessed) == '1' ? "Y" : "n", field(buf, "priority", priority),
+	        field(buf, "state", state), field(buf, "size", size), field(buf, "utime", utime),
+	        field(buf, "stime", stime), field(buf, "syscalls", syscalls));
 }
 
 int main(int argc, char *argv[]) {
-	char *name = malloc(32 * sizeof(char));
-
-	fprintf(stdout, "PID\tNAME\tBLESSED\tPRIORITY\tSTATE\n");
-	for(uint64 pid = 0; pid != NPROC; pid++) {
-		enum procstate state = pstate(pid);
-		if (state != UNUSED) {
-			char *statestr = statename(state);
-			pname(pid, name, 32);
-			char *blessed = isblessed(pid) ? "Y" : "n";
-			int priority = getpriority(pid);
-			fprintf(stdout, "%d\t%s\t%s\t%x\t%s (%d)\n", pid, name, blessed,priority, statestr, state);
-		}
+	struct dent de[16];
+	int fd, n;
+
+	if ((fd = open("/proc", O_RDONLY)) < 0) {
+		fprintf(stderr, "ps: cannot open /proc\n");
+		procexit();
 	}
+	fprintf(stdout, "PID\tNAME\tBLESSED\tPRIORITY\tSTATE\tSIZE\tUTIME\tSTIME\tSYSCALLS\n");
+	while ((n = getdents(fd, de, sizeof(de) / sizeof(de[0]))) > 0)
+		for (int i = 0; i < n; i++)
+			if (de[i].type == T_DIR && de[i].name[0] >= '0' && de[i].name[0] <= '9')
+				show(de[i].name);
+	close(fd);
 	procexit();
 }
@@ -0,0 +1,178 @@
+#include "types.h"
+#include "user.h"
+#include "string.h"
+#include "fcntl.h"
+#include "time.h"
+
+// Scalability benchmarks: scale [-n cpus] [name...] runs each named
+// benchmark, or all of them, in 1, 2, ... up to n processes at once,
+// one pinned to each cpu, for a second each, and prints the
+// operations done per second in all and per process. Per-process
+// throughput that falls as processes are added is a lock, or a
+// cache line, that they are all fighting over. n defaults to all
+// the cpus; run.sh -c sets how many there are.
+
+#define FILE "/scalefile"
+#define BLK  4096
+#define SECS 1
+
+static char buf[BLK];
+
+static uint64 nanos(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(char *what) {
+	fprintf(stderr, "scale: %s failed\n", what);
+	procexit();
+}
+
+// One operation of each; the pipe and the fd are a worker's own.
+static int p[2], fd;
+
+static void forkop(void) {
+	int pid;
+
+	if ((pid = fork()) < 0)
+		die("fork");
+	if (pid == 0)
+		procexit();
+	waitpid(pid, 0, 0);
+}
+
+static void openop(void) {
+	int f;
+
+	if ((f = open(FILE, O_RDONLY)) < 0)
+		die("open");
+	close(f);
+}
+
+static void readop(void) {
+	if (pread(fd, buf, BLK, 0) != BLK)
+		die("pread");
+}
+
+static void pipeop(void) {
+	if (write(p[1], buf, 512) != 512 || read(p[0], buf, 512) != 512)
+		die("pipe");
+}
+
+static void sbrkop(void) {
+	char *a;
+
+	if ((a = sbrk(BLK)) == (char*)-1)
+		die("sbrk");
+	a[0] = 1;
+	sbrk(-BLK);
+}
+
+static struct {
+	char *name;
+	void (*op)(void);
+	char *what;       // what's shared
+} benches[] = {
+	{ "fork",  forkop, "ptable.lock, kalloc" },
+	{ "open",  openop, "namei, icache" },
+	{ "read",  readop, "one file's pages" },
+	{ "pipe",  pipeop, "nothing: a pipe each" },
+	{ "sbrk",  sbrkop, "kalloc" },
+};
+
+#define NBENCH (sizeof(benches) / sizeof(benches[0]))
+
+// A worker on cpu c: wait on go for the start, do op for SECS
+// seconds and write how many times to res.
+static void worker(int c, void (*op)(void), int go, int res) {
+	unsigned long mask[4] = { 0 };
+	uint64 end;
+	int n = 0;
+
+	mask[c / 64] = 1ul << (c % 64);
+	sched_setaffinity(0, sizeof(mask), mask);
+	if (pipe(p) < 0 || (fd = open(FILE, O_RDONLY)) < 0)
+		die("setup");
+	read(go, buf, 1); // returns at the close
+	for (end = nanos() + SECS * 1000000000ull; nanos() < end; n++)
+		op();
+	write(res, &n, sizeof(n));
+	procexit();
+}
+
+static void run(int b, int k) {
+	int go[2], res[2], n, tot = 0;
+
+	if (pipe(go) < 0 || pipe(res) < 0)
+		die("pipe");
+	for (int c = 0; c < k; c++) {
+		int pid = fork();
+		if (pid < 0)
+			die("fork");
+		if (pid == 0) {
+			close(go[1]);
+			close(res[0]);
+			worker(c, benches[b].op, go[0], res[1]);
+		}
+	}
+	close(go[0]);
+	close(res[1]);
+	close(go[1]); // go
+	while (read(res[0], &n, sizeof(n)) == sizeof(n))
+		tot += n;
+	close(res[0]);
+	for (int c = 0; c < k; c++)
+		wait();
+	fprintf(stdout, "%s\t%d\t%d/s\t%d/s per cpu\n", benches[b].name, k, tot / SECS, tot / SECS / k);
+}
+
+// The cpus there are, from /proc/stat's line for each.
+static int ncpus(void) {
+	char s[1024], *q;
+	int f, n, c = 0;
+
+	if ((f = open("/proc/stat", O_RDONLY)) < 0)
+		return 1;
+	n = read(f, s, sizeof(s) - 1);
+	close(f);
+	s[n > 0 ? n : 0] = 0;
+	for (q = s; (q = strchr(q, '\n')) != 0; q++)
+		if (strncmp(q + 1, "cpu", 3) == 0)
+			c++;
+	if (strncmp(s, "cpu", 3) == 0)
+		c++;
+	return c ? c : 1;
+}
+
+int main(int argc, char *argv[]) {
+	int max = ncpus(), i, j, f, any = 0;
+
+	if (argc > 2 && strncmp(argv[1], "-n", 3) == 0) {
+		if ((i = atoi(argv[2])) > 0 && i < max)
+			max = i;
+		argc -= 2;
+		argv += 2;
+	}
+	unlink(FILE);
+	if ((f = open(FILE, O_CREATE | O_RDWR)) < 0 || write(f, buf, BLK) != BLK)
+		die("create");
+	close(f);
+
+	fprintf(stdout, "NAME\tCPUS\tTOTAL\tPER CPU\n");
+	for (i = 0; i < NBENCH; i++) {
+		for (j = 1; j < argc && strncmp(argv[j], benches[i].name, strlen(benches[i].name) + 1) != 0; j++)
+			;
+		if (argc > 1 && j == argc)
+			continue;
+		any = 1;
+		fprintf(stdout, "# %s: sharing %s\n", benches[i].name, benches[i].what);
+		for (int k = 1; k <= max; k++)
+			run(i, k);
+	}
+	if (!any)
+		fprintf(stderr, "usage: scale [-n cpus] [fork | open | read | pipe | sbrk]...\n");
+	unlink(FILE);
+	procexit();
+}
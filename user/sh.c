@@ -4,6 +4,7 @@
 #include "user.h"
 #include "fcntl.h"
 #include "string.h"
+#include "wait.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -50,90 +51,203 @@ struct backcmd {
 	struct cmd *cmd;
 };
 
-int fork1(void);  // Fork but panics on failure.
 void panic(char*);
+void freecmd(struct cmd*);
 struct cmd *parsecmd(char*);
 
-// Execute cmd.  Never returns.
+// The children started for the command line being run, to wait
+// for; anything else is a background job, reaped as it exits.
+#define NFG 32
+int fg[NFG];
+int nfg;
+
+void
+addfg(int pid)
+{
+	if(nfg == NFG)
+		waitpid(fg[--nfg], 0, 0);
+	fg[nfg++] = pid;
+}
+
+// Wait for the children started since fg[from].
 void
-runcmd(struct cmd *cmd)
+waitfg(int from)
 {
-	int p[2];
+	while(nfg > from)
+		waitpid(fg[--nfg], 0, 0);
+}
+
+// Builtins run in the shell itself, writing to the command's
+// fds. Returns 1 if argv was one.
+int
+builtin(char **argv, int *fds)
+{
+	char buf[256];
+	int n = 0;
+
+	if(strncmp(argv[0], "cd", 3) == 0) {
+		char *dir = argv[1] ? argv[1] : "/";
+		if(chdir(dir) < 0)
+			fprintf(fds[2], "cannot cd %s\n", dir);
+		return 1;
+	}
+	if(strncmp(argv[0], "echo", 5) == 0) {
+		for(int i = 1; argv[i]; i++) {
+			if(n + strlen(argv[i]) + 1 > sizeof(buf)) {
+				write(fds[1], buf, n);
+				n = 0;
+			}
+			if(strlen(argv[i]) + 1 > sizeof(buf)) {
+				write(fds[1], argv[i], strlen(argv[i]));
+			} else {
+				memmove(buf + n, argv[i], strlen(argv[i]));
+				n += strlen(argv[i]);
+			}
+			buf[n++] = argv[i + 1] ? ' ' : '\n';
+		}
+		if(argv[1] == 0)
+			buf[n++] = '\n';
+		write(fds[1], buf, n);
+		return 1;
+	}
+	if(strncmp(argv[0], "exit", 5) == 0)
+		procexit();
+	return 0;
+}
+
+// Whether cmd, run by spawncmd(), would make the shell wait.
+int
+haslist(struct cmd *cmd)
+{
+	switch(cmd ? cmd->type : 0) {
+	case LIST:
+		return 1;
+	case REDIR:
+		return haslist(((struct redircmd*)cmd)->cmd);
+	case PIPE:
+		return haslist(((struct pipecmd*)cmd)->left) || haslist(((struct pipecmd*)cmd)->right);
+	case BACK:
+		return haslist(((struct backcmd*)cmd)->cmd);
+	}
+	return 0;
+}
+
+// Start cmd with fds as its standard input, output and error.
+// Everything is spawn()ed straight from the shell, a pipeline's
+// stages included, last first so a builtin on the left has its
+// reader running; only a list in the background, which must wait
+// between its commands, gets a forked shell of its own. The
+// children are added to fg.
+void
+spawncmd(struct cmd *cmd, int *fds)
+{
+	int p[2], cfds[3], fd, pid, mark;
 	struct backcmd *bcmd;
 	struct execcmd *ecmd;
 	struct listcmd *lcmd;
 	struct pipecmd *pcmd;
 	struct redircmd *rcmd;
+	char buf[256];
 
 	if(cmd == 0)
-		procexit();
+		return;
 
 	switch(cmd->type) {
-	default:
-		panic("runcmd");
-
 	case EXEC:
 		ecmd = (struct execcmd*)cmd;
-		if(ecmd->argv[0] == 0)
-			procexit();
-		exec(ecmd->argv[0], ecmd->argv);
-
-		char buf[256];
-		strcpy(buf, "/bin/"); //try in /bin if not in c.w.d.
-		strcat_s(buf, ecmd->argv[0], 256);
-		exec(buf, ecmd->argv);
-		fprintf(stderr, "exec %s failed\n", ecmd->argv[0]);
-		break;
+		if(ecmd->argv[0] == 0 || builtin(ecmd->argv, fds))
+			return;
+		if((pid = spawn(ecmd->argv[0], ecmd->argv, fds)) < 0) {
+			strcpy(buf, "/bin/"); //try in /bin if not in c.w.d.
+			strcat_s(buf, ecmd->argv[0], 256);
+			pid = spawn(buf, ecmd->argv, fds);
+		}
+		if(pid < 0)
+			fprintf(stderr, "exec %s failed\n", ecmd->argv[0]);
+		else
+			addfg(pid);
+		return;
 
 	case REDIR:
 		rcmd = (struct redircmd*)cmd;
-		close(rcmd->fd);
-		if(open(rcmd->file, rcmd->mode) < 0) {
+		if((fd = open(rcmd->file, rcmd->mode)) < 0) {
 			fprintf(stderr, "open %s failed\n", rcmd->file);
-			procexit();
+			return;
 		}
-		runcmd(rcmd->cmd);
-		break;
+		memmove(cfds, fds, sizeof(cfds));
+		cfds[rcmd->fd] = fd;
+		spawncmd(rcmd->cmd, cfds);
+		close(fd);
+		return;
 
 	case LIST:
 		lcmd = (struct listcmd*)cmd;
-		if(fork1() == 0)
-			runcmd(lcmd->left);
-		wait();
-		runcmd(lcmd->right);
-		break;
+		mark = nfg;
+		spawncmd(lcmd->left, fds);
+		waitfg(mark);
+		spawncmd(lcmd->right, fds);
+		return;
 
 	case PIPE:
 		pcmd = (struct pipecmd*)cmd;
-		if(pipe(p) < 0)
-			panic("pipe");
-		if(fork1() == 0) {
-			close(1);
-			dup(p[1]);
-			close(p[0]);
-			close(p[1]);
-			runcmd(pcmd->left);
-		}
-		if(fork1() == 0) {
-			close(0);
-			dup(p[0]);
-			close(p[0]);
-			close(p[1]);
-			runcmd(pcmd->right);
+		if(pipe(p) < 0) {
+			fprintf(stderr, "pipe failed\n");
+			return;
 		}
+		memmove(cfds, fds, sizeof(cfds));
+		cfds[0] = p[0];
+		spawncmd(pcmd->right, cfds);
 		close(p[0]);
+		memmove(cfds, fds, sizeof(cfds));
+		cfds[1] = p[1];
+		spawncmd(pcmd->left, cfds);
 		close(p[1]);
-		wait();
-		wait();
-		break;
+		return;
 
 	case BACK:
+		// Spawned, but not waited for.
 		bcmd = (struct backcmd*)cmd;
-		if(fork1() == 0)
-			runcmd(bcmd->cmd);
+		mark = nfg;
+		if(!haslist(bcmd->cmd)) {
+			spawncmd(bcmd->cmd, fds);
+		} else if((pid = fork()) == 0) {
+			spawncmd(bcmd->cmd, fds);
+			waitfg(mark);
+			procexit();
+		} else if(pid < 0) {
+			fprintf(stderr, "fork failed\n");
+		}
+		nfg = mark;
+		return;
+
+	default:
+		panic("spawncmd");
+	}
+}
+
+// Free cmd, now that the shell itself parses and runs commands.
+void
+freecmd(struct cmd *cmd)
+{
+	if(cmd == 0)
+		return;
+	switch(cmd->type) {
+	case REDIR:
+		freecmd(((struct redircmd*)cmd)->cmd);
+		break;
+	case PIPE:
+		freecmd(((struct pipecmd*)cmd)->left);
+		freecmd(((struct pipecmd*)cmd)->right);
+		break;
+	case LIST:
+		freecmd(((struct listcmd*)cmd)->left);
+		freecmd(((struct listcmd*)cmd)->right);
+		break;
+	case BACK:
+		freecmd(((struct backcmd*)cmd)->cmd);
 		break;
 	}
-	procexit();
+	free(cmd);
 }
 
 int getcmd(char *buf, int nbuf) {
@@ -147,22 +261,20 @@ int getcmd(char *buf, int nbuf) {
 
 int main(void) {
 	static char buf[100];
+	int stdfds[3] = { 0, 1, 2 };
+	struct cmd *cmd;
 
 	fprintf(stdout, "\nWelcome to Xv64\n");
 
 	// Read and run input commands.
 	while(getcmd(buf, sizeof(buf)) >= 0) {
-		if(buf[0] == 'c' && buf[1] == 'd' && buf[2] == ' ') {
-			// Clumsy but will have to do for now.
-			// Chdir has no effect on the parent if run in the child.
-			buf[strlen(buf)-1] = 0; // chop \n
-			if(chdir(buf+3) < 0)
-				fprintf(stderr, "cannot cd %s\n", buf+3);
-			continue;
-		}
-		if(fork1() == 0)
-			runcmd(parsecmd(buf));
-		wait();
+		cmd = parsecmd(buf);
+		spawncmd(cmd, stdfds);
+		waitfg(0);
+		freecmd(cmd);
+		while(waitpid(-1, 0, WNOHANG) > 0)
+			; // background jobs that are done
+
 	}
 	procexit();
 }
@@ -174,17 +286,6 @@ panic(char *s)
 	procexit();
 }
 
-int
-fork1(void)
-{
-	int pid;
-
-	pid = fork();
-	if(pid == -1)
-		panic("fork");
-	return pid;
-}
-
 
 // Constructors
 
@@ -255,6 +356,17 @@ backcmd(struct cmd *subcmd)
 
 // Parsing
 
+// The shell parses commands itself, so a mistake mustn't kill it:
+// note it, and have parsecmd() give up once the parse is over.
+int parseerr;
+
+void
+syntax(char *s)
+{
+	fprintf(stderr, "%s\n", s);
+	parseerr = 1;
+}
+
 char whitespace[] = " \t\r\n\v";
 char symbols[] = "<|>&;()";
 
@@ -331,7 +443,12 @@ parsecmd(char *s)
 	peek(&s, es, "");
 	if(s != es) {
 		fprintf(stderr, "leftovers: %s\n", s);
-		panic("syntax");
+		syntax("syntax");
+	}
+	if(parseerr) {
+		parseerr = 0;
+		freecmd(cmd);
+		return 0;
 	}
 	nulterminate(cmd);
 	return cmd;
@@ -371,8 +488,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
 	while(peek(ps, es, "<>")) {
 		tok = gettoken(ps, es, 0, 0);
-		if(gettoken(ps, es, &q, &eq) != 'a')
-			panic("missing file for redirection");
+		if(gettoken(ps, es, &q, &eq) != 'a') {
+			syntax("missing file for redirection");
+			break;
+		}
 		switch(tok) {
 		case '<':
 			cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -397,8 +516,10 @@ parseblock(char **ps, char *es)
 		panic("parseblock");
 	gettoken(ps, es, 0, 0);
 	cmd = parseline(ps, es);
-	if(!peek(ps, es, ")"))
-		panic("syntax - missing )");
+	if(!peek(ps, es, ")")) {
+		syntax("syntax - missing )");
+		return cmd;
+	}
 	gettoken(ps, es, 0, 0);
 	cmd = parseredirs(cmd, ps, es);
 	return cmd;
@@ -423,13 +544,17 @@ parseexec(char **ps, char *es)
 	while(!peek(ps, es, "|)&;")) {
 		if((tok=gettoken(ps, es, &q, &eq)) == 0)
 			break;
-		if(tok != 'a')
-			panic("syntax");
+		if(tok != 'a') {
+			syntax("syntax");
+			break;
+		}
+		if(argc + 1 >= MAXARGS) {
+			syntax("too many args");
+			break;
+		}
 		cmd->argv[argc] = q;
 		cmd->eargv[argc] = eq;
 		argc++;
-		if(argc >= MAXARGS)
-			panic("too many args");
 		ret = parseredirs(ret, ps, es);
 	}
 	cmd->argv[argc] = 0;
@@ -0,0 +1,34 @@
+#include "types.h"
+#include "user.h"
+#include "string.h"
+#include "syscallstat.h"
+
+// Print how often each system call was made and how long it took,
+// summed over cpus or for one: syscallstat [-r] [cpu].
+// -r zeroes the counts after printing them.
+int main(int argc, char **argv) {
+	struct syscallstat *st = malloc(NSYSCALLSTAT * sizeof(*st));
+	int i, b, n, reset = 0, cpu = -1;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "-r", 3) == 0)
+			reset = 1;
+		else
+			cpu = atoi(argv[i]);
+	}
+	if (st == 0 || (n = syscallstat(cpu, st, NSYSCALLSTAT, reset)) < 0) {
+		fprintf(stderr, "syscallstat: failed\n");
+		procexit();
+	}
+	fprintf(stdout, "NUM\tCALLS\tAVG(cycles)\tLOG2 CYCLES:CALLS\n");
+	for (i = 0; i < n; i++) {
+		if (st[i].count == 0)
+			continue;
+		fprintf(stdout, "%d\t%d\t%d\t", i, (int)st[i].count, (int)(st[i].cycles / st[i].count));
+		for (b = 0; b < SYSCALLSTAT_NHIST; b++)
+			if (st[i].hist[b])
+				fprintf(stdout, " %d:%d", b, st[i].hist[b]);
+		fprintf(stdout, "\n");
+	}
+	procexit();
+}
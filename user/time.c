@@ -0,0 +1,53 @@
+#include "types.h"
+#include "user.h"
+#include "string.h"
+#include "time.h"
+#include "rusage.h"
+
+// time cmd [args...]: run cmd and print how long it took, and
+// how much of that it and its children spent in user mode and in
+// the kernel, in milliseconds.
+
+static uint64 nanos(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void print(char *what, uint64 ns) {
+	uint64 us = ns / 1000;
+
+	fprintf(stderr, "%s %d.%d%d%d ms\n", what, (int)(us / 1000), (int)(us / 100 % 10),
+	        (int)(us / 10 % 10), (int)(us % 10));
+}
+
+int main(int argc, char **argv) {
+	struct rusage before, after;
+	char path[128];
+	uint64 t0;
+	int pid;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: time cmd [args...]\n");
+		procexit();
+	}
+	getrusage(RUSAGE_CHILDREN, &before);
+	t0 = nanos();
+	if ((pid = spawn(argv[1], argv + 1, 0)) < 0 && strlen(argv[1]) + 6 <= sizeof(path)) {
+		strcpy(path, "/bin/");
+		strcpy(path + 5, argv[1]);
+		pid = spawn(path, argv + 1, 0);
+	}
+	if (pid < 0) {
+		fprintf(stderr, "time: cannot run %s\n", argv[1]);
+		procexit();
+	}
+	waitpid(pid, 0, 0);
+	print("real", nanos() - t0);
+	getrusage(RUSAGE_CHILDREN, &after);
+	print("user", after.utime - before.utime);
+	print("sys ", after.stime - before.stime);
+	procexit();
+}
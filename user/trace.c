@@ -0,0 +1,115 @@
+#include "types.h"
+#include "user.h"
+#include "string.h"
+#include "fcntl.h"
+#include "vdso.h"
+#include "trace.h"
+
+// Kernel tracepoints: trace start, trace stop, or trace to print
+// what was recorded since the last time, oldest first, with times
+// in milliseconds, to the microsecond, from the first record.
+
+static char* names[TRACE_NEVENTS] = {
+	[TRACE_SWITCHIN]   = "switchin",
+	[TRACE_SWITCHOUT]  = "switchout",
+	[TRACE_SLEEP]      = "sleep",
+	[TRACE_WAKEUP]     = "wakeup",
+	[TRACE_BIOSUBMIT]  = "biosubmit",
+	[TRACE_BIODONE]    = "biodone",
+	[TRACE_BEGINOP]    = "begin_op",
+	[TRACE_ENDOP]      = "end_op",
+	[TRACE_COMMIT]     = "commit",
+	[TRACE_COMMITDONE] = "commitdone",
+	[TRACE_SYSENTER]   = "sysenter",
+	[TRACE_SYSEXIT]    = "sysexit",
+	[TRACE_DROPPED]    = "dropped",
+};
+
+// Each cpu's records come out in order, one cpu after another;
+// a shell sort puts them together quickly enough.
+static void sort(struct tracerec* r, int n){
+	struct tracerec t;
+	int gap, i, j;
+
+	for (gap = n / 2; gap > 0; gap /= 2) {
+		for (i = gap; i < n; i++) {
+			t = r[i];
+			for (j = i; j >= gap && r[j - gap].tsc > t.tsc; j -= gap)
+				r[j] = r[j - gap];
+			r[j] = t;
+		}
+	}
+}
+
+static void print(struct tracerec* t, uint64 t0, uint64 khz){
+	uint64 us = khz ? (t->tsc - t0) * 1000 / khz : 0;
+	char* name = t->event < TRACE_NEVENTS && names[t->event] ? names[t->event] : "?";
+
+	fprintf(stdout, "%d.%d%d%d cpu%d pid %d %s", (int)(us / 1000), (int)(us / 100 % 10),
+	        (int)(us / 10 % 10), (int)(us % 10), t->cpu, t->pid, name);
+	switch (t->event) {
+	case TRACE_SLEEP:
+		fprintf(stdout, " chan %x", (uint)t->arg[0]);
+		break;
+	case TRACE_WAKEUP:
+		fprintf(stdout, " pid %d chan %x", (int)t->arg[0], (uint)t->arg[1]);
+		break;
+	case TRACE_BIOSUBMIT:
+	case TRACE_BIODONE:
+		fprintf(stdout, " %s dev %x sector %d", (t->arg[1] & TRACE_WRITE) ? "write" : "read",
+		        (uint)t->arg[1], (int)t->arg[0]);
+		break;
+	case TRACE_SYSEXIT:
+		fprintf(stdout, " %d = %d", (int)t->arg[0], (int)t->arg[1]);
+		break;
+	case TRACE_SWITCHIN:
+		break;
+	default:
+		fprintf(stdout, " %d", (int)t->arg[0]);
+		break;
+	}
+	fprintf(stdout, "\n");
+}
+
+int main(int argc, char **argv) {
+	struct tracerec* r = 0, * nr;
+	int fd, n = 0, cap = 0, got;
+
+	if ((fd = open("/dev/trace", O_RDWR)) < 0) {
+		fprintf(stderr, "trace: cannot open /dev/trace\n");
+		procexit();
+	}
+	if (argc > 1) {
+		if (strncmp(argv[1], "start", 6) == 0)
+			got = write(fd, "1", 1);
+		else if (strncmp(argv[1], "stop", 5) == 0)
+			got = write(fd, "0", 1);
+		else
+			got = -1;
+		if (got < 0)
+			fprintf(stderr, "usage: trace [start | stop]\n");
+		procexit();
+	}
+
+	for (;;) {
+		if (n == cap) {
+			cap = cap ? 2 * cap : 1024;
+			if ((nr = malloc(cap * sizeof(*r))) == 0) {
+				fprintf(stderr, "trace: out of memory\n");
+				procexit();
+			}
+			if (r) {
+				memmove(nr, r, n * sizeof(*r));
+				free(r);
+			}
+			r = nr;
+		}
+		if ((got = read(fd, (char*)(r + n), (cap - n) * sizeof(*r))) <= 0)
+			break;
+		n += got / sizeof(*r);
+	}
+	sort(r, n);
+	for (int i = 0; i < n; i++)
+		print(&r[i], r[0].tsc, ((struct vdsotime*)VDSO_TIME)->tsckhz);
+	procexit();
+}
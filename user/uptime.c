@@ -1,8 +1,15 @@
 #include "types.h"
 #include "user.h"
+#include "time.h"
 
 int main(int argc, char **argv) {
     uint64 t = ticks();
-    fprintf(stdout, "Up %d ticks\n", t);
-	procexit();
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        fprintf(stdout, "Up %d ticks (%d.%d%d%d s)\n", t, ts.tv_sec,
+                ts.tv_nsec / 100000000, ts.tv_nsec / 10000000 % 10, ts.tv_nsec / 1000000 % 10);
+    else
+        fprintf(stdout, "Up %d ticks\n", t);
+    procexit();
 }
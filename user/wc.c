@@ -3,25 +3,53 @@
 #include "user.h"
 #include "string.h"
 
-char buf[512];
+// Counting goes 16 bytes at a time with SSE2, which every amd64
+// has: a mask of the newlines and one of the white space in each
+// vector, the words being where white space is followed by
+// something else; the odd bytes at the end go through a table.
+// GCC's vector types say it without immintrin.h, whose malloc
+// would clash with ours.
+
+typedef uchar v16 __attribute__((vector_size(16)));
+typedef char v16qi __attribute__((vector_size(16)));
+
+char buf[64 * 1024] __attribute__((aligned(16)));
+
+static uchar space[256] = {
+	[' '] = 1, ['\r'] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1,
+	[0] = 1, // as strchr(" \r\t\n\v", c) always had it
+};
+
+// Bits set in a 16-bit mask; there may be no popcnt.
+static inline int pop16(uint m) {
+	m = m - ((m >> 1) & 0x5555);
+	m = (m & 0x3333) + ((m >> 2) & 0x3333);
+	m = (m + (m >> 4)) & 0x0F0F;
+	return (m + (m >> 8)) & 0x1F;
+}
 
 void wc(int fd, char *name) {
 	int i, n;
-	int l, w, c, inword;
+	int l, w, c;
+	uint prev = 1; // the byte before was white space
 
 	l = w = c = 0;
-	inword = 0;
 	while((n = read(fd, buf, sizeof(buf))) > 0) {
-		for(i=0; i<n; i++) {
-			c++;
-			if(buf[i] == '\n')
-				l++;
-			if(strchr(" \r\t\n\v", buf[i]))
-				inword = 0;
-			else if(!inword) {
-				w++;
-				inword = 1;
-			}
+		c += n;
+		for(i = 0; i + 16 <= n; i += 16) {
+			v16 v = *(v16*)(buf + i);
+			// \t \n \v \f \r are 9 to 13; all but \f count.
+			v16qi ws = (v == ' ') | (v == 0) | (((v16)(v - '\t') <= 4) & (v != '\f'));
+			uint s = __builtin_ia32_pmovmskb128(ws);
+			l += pop16(__builtin_ia32_pmovmskb128((v16qi)(v == '\n')));
+			w += pop16(~s & 0xFFFF & (s << 1 | prev));
+			prev = s >> 15;
+		}
+		for(; i < n; i++) {
+			uint s = space[(uchar)buf[i]];
+			l += buf[i] == '\n';
+			w += prev & (s == 0);
+			prev = s;
 		}
 	}
 	if(n < 0) {